@@ -0,0 +1,89 @@
+#include <benchmark/benchmark.h>
+#include "bench_common.hpp"
+#include "auth/authenticator.hpp"
+#include <string>
+#include <vector>
+
+using email::Authenticator;
+
+namespace {
+
+constexpr size_t user_count = 256;
+constexpr const char* password = "bench-password";
+
+std::string username(size_t n) {
+    return "user" + std::to_string(n) + "@bench.test";
+}
+
+// Each user costs a full PBKDF2 hash to create, so the database is kept
+// under email_bench::root() and only topped up.
+Authenticator& authenticator() {
+    static Authenticator* auth = [] {
+        auto* a = new Authenticator(email_bench::root() / "users.db");
+        a->initialize();
+        a->create_domain("bench.test");
+        for (size_t n = 0; n < user_count; ++n) {
+            if (!a->get_user(username(n))) {
+                a->create_user(username(n), password, "bench.test");
+            }
+        }
+        return a;
+    }();
+    return *auth;
+}
+
+void BM_AuthGetUser(benchmark::State& state) {
+    auto& auth = authenticator();
+    size_t next = static_cast<size_t>(state.thread_index());
+    std::vector<std::string> names;
+    for (size_t n = 0; n < user_count; ++n) {
+        names.push_back(username(n));
+    }
+    for (auto _ : state) {
+        auto user = auth.get_user(names[next++ % user_count]);
+        benchmark::DoNotOptimize(user);
+    }
+}
+BENCHMARK(BM_AuthGetUser)->ThreadRange(1, 8)->UseRealTime();
+
+void BM_AuthUnknownUser(benchmark::State& state) {
+    auto& auth = authenticator();
+    const std::string name = "nobody@bench.test";
+    for (auto _ : state) {
+        auto user = auth.get_user(name);
+        benchmark::DoNotOptimize(user);
+    }
+}
+BENCHMARK(BM_AuthUnknownUser)->ThreadRange(1, 8)->UseRealTime();
+
+void BM_AuthIsLocalDomain(benchmark::State& state) {
+    auto& auth = authenticator();
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(auth.is_local_domain("bench.test"));
+    }
+}
+BENCHMARK(BM_AuthIsLocalDomain)->ThreadRange(1, 8)->UseRealTime();
+
+// Not cached: a query on a pooled reader each time.
+void BM_AuthListUsers(benchmark::State& state) {
+    auto& auth = authenticator();
+    for (auto _ : state) {
+        auto users = auth.list_users("bench.test");
+        benchmark::DoNotOptimize(users);
+    }
+    state.SetItemsProcessed(state.iterations() * user_count);
+}
+BENCHMARK(BM_AuthListUsers)->ThreadRange(1, 4)->UseRealTime();
+
+// A login the credential cache has seen; the first is a full PBKDF2 check.
+void BM_AuthCachedLogin(benchmark::State& state) {
+    auto& auth = authenticator();
+    const auto name = username(static_cast<size_t>(state.thread_index()));
+    auth.authenticate(name, password);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(auth.authenticate(name, password));
+    }
+}
+BENCHMARK(BM_AuthCachedLogin)->ThreadRange(1, 8)->UseRealTime();
+
+}  // namespace
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstdlib>
+#include <filesystem>
+
+namespace email_bench {
+
+// Where the benchmarks keep their mailboxes and user database:
+// $EMAIL_BENCH_DIR, or email_bench under the temporary directory. Left in
+// place between runs, as filling it takes far longer than measuring.
+inline std::filesystem::path root() {
+    static const std::filesystem::path path = [] {
+        const char* dir = std::getenv("EMAIL_BENCH_DIR");
+        std::filesystem::path p = dir && *dir ? std::filesystem::path(dir)
+                                              : std::filesystem::temp_directory_path() / "email_bench";
+        std::filesystem::create_directories(p);
+        return p;
+    }();
+    return path;
+}
+
+}  // namespace email_bench
@@ -0,0 +1,115 @@
+#include <benchmark/benchmark.h>
+#include "imap_commands.hpp"
+#include "imap_parser.hpp"
+#include "net/command_arena.hpp"
+#include <algorithm>
+#include <string_view>
+
+using namespace email::imap;
+
+namespace {
+
+// What a client sends most: FETCH, STORE and SEARCH after a SELECT.
+constexpr std::string_view command_lines[] = {
+    "A001 LOGIN \"user@example.com\" \"pa\\\\ss \\\"word\\\"\"",
+    "A002 SELECT INBOX",
+    "A003 UID FETCH 1:* (FLAGS UID RFC822.SIZE)",
+    "A004 STORE 1:5 +FLAGS.SILENT ($Junk (NonJunk \"Later\"))",
+    "A005 UID SEARCH UNSEEN FROM \"alice\" SINCE 1-Jan-2024",
+    "A006 noop",
+};
+
+void BM_CommandParse(benchmark::State& state) {
+    email::CommandArena arena;
+    for (auto _ : state) {
+        for (auto line : command_lines) {
+            arena.reset();
+            auto cmd = Command::parse(line, arena.resource());
+            benchmark::DoNotOptimize(cmd);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * std::size(command_lines));
+}
+BENCHMARK(BM_CommandParse);
+
+// The parse a session does before dispatch, with the quoted strings and
+// parenthesized lists of the arguments and a literal.
+void BM_CommandArguments(benchmark::State& state) {
+    constexpr std::string_view lines[] = {
+        "A001 LOGIN \"user@example.com\" \"pa\\\\ss \\\"word\\\"\"",
+        "A004 STORE 1:5 +FLAGS.SILENT ($Junk (NonJunk \"Later\"))",
+        "A005 RENAME \"Old Folder\" {10}\r\nNew Folder",
+    };
+    email::CommandArena arena;
+    for (auto _ : state) {
+        for (auto line : lines) {
+            arena.reset();
+            auto cmd = Command::parse(line, arena.resource());
+            size_t pos = 0;
+            while (auto argument = IMAPParser::parse_string(cmd.arguments, pos)) {
+                benchmark::DoNotOptimize(argument);
+            }
+            pos = std::min(cmd.arguments.find('('), cmd.arguments.size());
+            auto list = IMAPParser::parse_list(cmd.arguments, pos);
+            benchmark::DoNotOptimize(list);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * std::size(lines));
+}
+BENCHMARK(BM_CommandArguments);
+
+void BM_FetchItems(benchmark::State& state) {
+    email::CommandArena arena;
+    const std::string_view items =
+        "(UID FLAGS INTERNALDATE RFC822.SIZE BODY.PEEK[HEADER.FIELDS (FROM TO SUBJECT DATE)])";
+    for (auto _ : state) {
+        arena.reset();
+        auto parsed = IMAPParser::parse_fetch_items(items, arena.resource());
+        benchmark::DoNotOptimize(parsed);
+    }
+}
+BENCHMARK(BM_FetchItems);
+
+void BM_SearchCriteria(benchmark::State& state) {
+    email::CommandArena arena;
+    const std::string_view criteria =
+        "UNSEEN OR FROM \"alice\" SUBJECT \"report\" SINCE 1-Jan-2024 NOT DELETED";
+    for (auto _ : state) {
+        arena.reset();
+        auto parsed = IMAPParser::parse_search_criteria(criteria, arena.resource());
+        benchmark::DoNotOptimize(parsed);
+    }
+}
+BENCHMARK(BM_SearchCriteria);
+
+void BM_SequenceSetParse(benchmark::State& state) {
+    const std::string_view set = "1:100,150,200:300,7,8,9,400:*";
+    for (auto _ : state) {
+        auto parsed = SequenceSet::parse(set);
+        benchmark::DoNotOptimize(parsed);
+    }
+}
+BENCHMARK(BM_SequenceSetParse);
+
+// A fragmented set, as clients send after flagging scattered messages,
+// checked against every message of a mailbox of state.range(0).
+void BM_SequenceSetCovers(benchmark::State& state) {
+    const auto largest = static_cast<uint32_t>(state.range(0));
+    std::string text;
+    for (uint32_t i = 1; i < largest; i += 7) {
+        text += std::to_string(i) + ":" + std::to_string(i + 2) + ",";
+    }
+    text.pop_back();
+    const auto set = SequenceSet::parse(text).normalized(largest);
+    for (auto _ : state) {
+        size_t hits = 0;
+        for (uint32_t n = 1; n <= largest; ++n) {
+            hits += set.covers(n);
+        }
+        benchmark::DoNotOptimize(hits);
+    }
+    state.SetItemsProcessed(state.iterations() * largest);
+}
+BENCHMARK(BM_SequenceSetCovers)->Arg(10000)->Arg(100000);
+
+}  // namespace
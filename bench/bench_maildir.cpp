@@ -0,0 +1,93 @@
+#include <benchmark/benchmark.h>
+#include "bench_common.hpp"
+#include "storage/maildir.hpp"
+#include <map>
+#include <memory>
+#include <mutex>
+
+using email::Maildir;
+
+namespace {
+
+std::string synthetic_message(size_t n) {
+    std::string message =
+        "From: sender" + std::to_string(n % 97) + "@example.com\r\n"
+        "To: bench@bench.test\r\n"
+        "Subject: Synthetic message " + std::to_string(n) + "\r\n"
+        "Date: Mon, 1 Jan 2024 00:00:00 +0000\r\n"
+        "Message-ID: <" + std::to_string(n) + "@bench.test>\r\n"
+        "\r\n";
+    while (message.size() < 2048) {
+        message += "The quick brown fox jumps over the lazy dog. " + std::to_string(n) + "\r\n";
+    }
+    return message;
+}
+
+struct Mailbox {
+    std::unique_ptr<Maildir> maildir;
+    std::vector<std::string> unique_ids;
+};
+
+// A user whose INBOX holds `count` messages, filled on first use and kept
+// under email_bench::root() so later runs skip the deliveries.
+Mailbox& mailbox_of(size_t count) {
+    static std::mutex mutex;
+    static std::map<size_t, Mailbox> mailboxes;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& mailbox = mailboxes[count];
+    if (mailbox.maildir) {
+        return mailbox;
+    }
+    mailbox.maildir = std::make_unique<Maildir>(email_bench::root() / "mail", "bench.test",
+                                                "inbox" + std::to_string(count));
+    mailbox.maildir->initialize();
+    auto messages = mailbox.maildir->list_messages("INBOX");
+    for (size_t n = messages.size(); n < count; ++n) {
+        mailbox.maildir->deliver(synthetic_message(n));
+    }
+    for (const auto& message : mailbox.maildir->list_messages("INBOX")) {
+        mailbox.unique_ids.push_back(message.unique_id);
+    }
+    return mailbox;
+}
+
+void BM_MaildirListMessages(benchmark::State& state) {
+    auto& mailbox = mailbox_of(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        auto messages = mailbox.maildir->list_messages("INBOX");
+        benchmark::DoNotOptimize(messages);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MaildirListMessages)->Arg(10000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+void BM_MaildirGetMessage(benchmark::State& state) {
+    auto& mailbox = mailbox_of(static_cast<size_t>(state.range(0)));
+    // Strided, so consecutive lookups do not share cache lines.
+    size_t next = 0;
+    for (auto _ : state) {
+        auto message = mailbox.maildir->get_message(mailbox.unique_ids[next]);
+        benchmark::DoNotOptimize(message);
+        next = (next + 7919) % mailbox.unique_ids.size();
+    }
+}
+BENCHMARK(BM_MaildirGetMessage)->Arg(10000)->Arg(100000);
+
+// Delivery into an INBOX already that full; what was delivered is deleted
+// afterwards, untimed, so the mailbox keeps its size.
+void BM_MaildirDeliver(benchmark::State& state) {
+    auto& mailbox = mailbox_of(static_cast<size_t>(state.range(0)));
+    const auto message = synthetic_message(0);
+    // The first delivery loads the mailbox's indexes.
+    std::vector<std::string> delivered{mailbox.maildir->deliver(message)};
+    for (auto _ : state) {
+        delivered.push_back(mailbox.maildir->deliver(message));
+    }
+    state.SetBytesProcessed(state.iterations() * message.size());
+    for (const auto& unique_id : delivered) {
+        mailbox.maildir->delete_message(unique_id);
+    }
+}
+BENCHMARK(BM_MaildirDeliver)->Arg(10000)->Arg(100000);
+
+}  // namespace
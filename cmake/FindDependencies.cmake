@@ -25,6 +25,25 @@ function(find_dependencies)
         endif()
     endif()
 
+    # zstd (Compressed message storage)
+    if(ENABLE_COMPRESSION)
+        find_package(PkgConfig REQUIRED)
+        pkg_check_modules(ZSTD libzstd>=1.4)
+        if(ZSTD_FOUND)
+            message(STATUS "Found zstd ${ZSTD_VERSION}")
+            message(STATUS "  Include: ${ZSTD_INCLUDE_DIRS}")
+            message(STATUS "  Libraries: ${ZSTD_LINK_LIBRARIES}")
+        else()
+            message(FATAL_ERROR "zstd >= 1.4 is required. Install with: apt install libzstd-dev")
+        endif()
+    endif()
+
+    # zlib (IMAP COMPRESS=DEFLATE)
+    if(ENABLE_DEFLATE)
+        find_package(ZLIB REQUIRED)
+        message(STATUS "Found zlib ${ZLIB_VERSION_STRING}")
+    endif()
+
     # SQLite3 (Authentication database)
     find_package(SQLite3 3.35 REQUIRED)
     if(SQLite3_FOUND)
@@ -53,6 +72,25 @@ function(find_dependencies)
         endif()
     endif()
 
+    # Google Benchmark (Microbenchmarks)
+    if(BUILD_BENCHMARKS)
+        find_package(benchmark QUIET)
+        if(benchmark_FOUND)
+            message(STATUS "Found Google Benchmark ${benchmark_VERSION}")
+        else()
+            message(STATUS "Google Benchmark not found - fetching from GitHub")
+            include(FetchContent)
+            set(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+            set(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+            FetchContent_Declare(
+                benchmark
+                GIT_REPOSITORY https://github.com/google/benchmark.git
+                GIT_TAG v1.8.3
+            )
+            FetchContent_MakeAvailable(benchmark)
+        endif()
+    endif()
+
     # Threads
     find_package(Threads REQUIRED)
 
@@ -63,6 +101,10 @@ function(find_dependencies)
     set(OPENSSL_LIBRARIES ${OPENSSL_LIBRARIES} PARENT_SCOPE)
     set(SQLite3_INCLUDE_DIRS ${SQLite3_INCLUDE_DIRS} PARENT_SCOPE)
     set(SQLite3_LIBRARIES ${SQLite3_LIBRARIES} PARENT_SCOPE)
+    set(ZSTD_INCLUDE_DIRS ${ZSTD_INCLUDE_DIRS} PARENT_SCOPE)
+    set(ZSTD_LINK_LIBRARIES ${ZSTD_LINK_LIBRARIES} PARENT_SCOPE)
+    set(ZLIB_INCLUDE_DIRS ${ZLIB_INCLUDE_DIRS} PARENT_SCOPE)
+    set(ZLIB_LIBRARIES ${ZLIB_LIBRARIES} PARENT_SCOPE)
 endfunction()
 
 # Helper function to create a server executable
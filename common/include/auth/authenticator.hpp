@@ -4,11 +4,17 @@
 #include <optional>
 #include <memory>
 #include <filesystem>
+#include <functional>
 #include <vector>
 #include <mutex>
+#include <chrono>
 #include <cstdint>
+#include <unordered_map>
+#include "auth/database.hpp"
 
-struct sqlite3;
+namespace boost::asio {
+class thread_pool;
+}
 
 namespace email {
 
@@ -30,7 +36,8 @@ struct Domain {
 
 class Authenticator {
 public:
-    explicit Authenticator(const std::filesystem::path& db_path);
+    // `readers` read-only connections serve lookups next to the writer.
+    explicit Authenticator(const std::filesystem::path& db_path, size_t readers = 4);
     ~Authenticator();
 
     Authenticator(const Authenticator&) = delete;
@@ -38,14 +45,29 @@ public:
 
     bool initialize();
 
-    // Authentication
+    // Authentication. Password checks run a deliberately slow KDF on the
+    // caller's thread, so logins verify in parallel. A successful check is
+    // remembered for the credential cache TTL, and the same credentials are
+    // then accepted without the KDF as long as the stored hash is unchanged.
     bool authenticate(const std::string& username, const std::string& password);
+    // authenticate() on a pool of its own, sized to the cores; `done` is
+    // called on that pool with the result. For io threads, which must not
+    // spend the KDF's milliseconds.
+    void authenticate_async(std::string username, std::string password,
+                            std::function<void(bool)> done);
+    // 0 disables the cache. Ignored, with a warning, if no cache key could
+    // be generated.
+    void set_credential_cache_ttl(std::chrono::seconds ttl);
     bool authenticate_plain(const std::string& username, const std::string& password);
     bool authenticate_login(const std::string& username, const std::string& password);
     bool authenticate_cram_md5(const std::string& username,
                                const std::string& challenge,
                                const std::string& response);
 
+    // User and domain records are cached, including misses, and each write
+    // drops what it touched. Commits by other processes, such as the
+    // management tool's, empty the cache within a second.
+
     // User management
     bool create_user(const std::string& username, const std::string& password,
                      const std::string& domain, int64_t quota_bytes = 104857600);
@@ -70,21 +92,62 @@ public:
     // Email address parsing
     static std::pair<std::string, std::string> parse_email(const std::string& email);
 
-    std::string last_error() const { return last_error_; }
+    std::string last_error() const;
 
 private:
-    bool execute_sql(const std::string& sql);
+    struct UserRecord {
+        User user;
+        std::string password_hash;
+    };
+
     bool create_tables();
+    void set_error(const std::string& error);
+
+    // Read-through lookups; nullopt for a missing record.
+    std::optional<UserRecord> find_user(const std::string& user, const std::string& domain);
+    std::optional<Domain> find_domain(const std::string& domain);
+    // Runs a write to one user's row: `sql` takes the user and domain as ?1
+    // and ?2, `bind` sets any other parameters. False if no row changed.
+    bool update_user(const std::string& sql, const std::string& user, const std::string& domain,
+                     const std::function<void(Database::Statement&)>& bind);
+    void forget_user(const std::string& user, const std::string& domain);
+    void forget_domain(const std::string& domain, bool with_users);
+    void check_external_changes();
 
     // Password hashing (using bcrypt-like approach with SHA-256 + salt)
     std::string hash_password(const std::string& password);
     bool verify_password(const std::string& password, const std::string& hash);
     std::string generate_salt(size_t length = 16);
 
-    std::filesystem::path db_path_;
-    sqlite3* db_ = nullptr;
+    // The stored hash of an active user.
+    std::optional<std::string> stored_password_hash(const std::string& username);
+    // Keyed hash of the credentials and the hash they were checked against;
+    // what the cache holds in place of the password.
+    std::string credential_tag(const std::string& username, const std::string& password,
+                               const std::string& stored_hash) const;
+    bool recently_verified(const std::string& tag);
+    void remember_verified(std::string tag);
+
+    Database db_;
+
+    mutable std::mutex error_mutex_;
     std::string last_error_;
-    std::mutex mutex_;
+
+    std::mutex records_mutex_;
+    std::unordered_map<std::string, std::optional<UserRecord>> users_;  // By user@domain
+    std::unordered_map<std::string, std::optional<Domain>> domains_;
+    uint64_t records_generation_ = 0;  // Bumped by each write
+    int64_t data_version_ = -1;
+    std::chrono::steady_clock::time_point version_checked_;
+
+    std::mutex cache_mutex_;
+    std::chrono::seconds cache_ttl_{300};
+    unsigned char cache_key_[32];  // Random per process
+    bool cache_key_valid_ = false;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> verified_;  // Expiry by tag
+
+    std::once_flag pool_once_;
+    std::unique_ptr<boost::asio::thread_pool> pool_;
 };
 
 }  // namespace email
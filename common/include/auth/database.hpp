@@ -0,0 +1,115 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct sqlite3;
+struct sqlite3_stmt;
+
+namespace email {
+
+// A SQLite database in WAL mode: one connection for writes and a pool of
+// read-only connections for lookups, which WAL lets run while a write is in
+// progress. Each connection compiles a statement once and keeps it, so a
+// query costs a reset and a step instead of a prepare and a finalize.
+class Database {
+public:
+    struct Connection;
+
+    // A cached prepared statement, reset when it goes out of scope. Bind
+    // indexes start at 1, column indexes at 0.
+    class Statement {
+    public:
+        Statement() = default;
+        explicit Statement(sqlite3_stmt* stmt) : stmt_(stmt) {}
+        ~Statement();
+        Statement(Statement&& other) noexcept;
+        Statement& operator=(Statement&&) = delete;
+
+        explicit operator bool() const { return stmt_ != nullptr; }
+
+        Statement& bind(int index, std::string_view text);
+        Statement& bind(int index, int64_t value);
+
+        // SQLITE_ROW, SQLITE_DONE or an error code.
+        int step();
+        // step(), true if it produced a row.
+        bool next();
+
+        int64_t column_int64(int index) const;
+        std::string column_text(int index) const;  // Empty for NULL
+
+    private:
+        sqlite3_stmt* stmt_ = nullptr;
+    };
+
+    // A connection held for one operation: the writer, exclusively, or a
+    // reader taken from the pool. Statements must not outlive it.
+    class Lease {
+    public:
+        Lease(Database& database, Connection* connection, bool writer);
+        ~Lease();
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        explicit operator bool() const { return connection_ != nullptr; }
+
+        // The statement for `sql`, prepared on first use; empty on a syntax
+        // error, see error().
+        Statement prepare(const std::string& sql);
+        bool execute(const std::string& sql);
+        int changes() const;
+        std::string error() const;
+
+    private:
+        Database& database_;
+        Connection* connection_;
+        bool writer_;
+        std::unique_lock<std::mutex> lock_;  // The writer's
+    };
+
+    Database(std::filesystem::path path, size_t readers);
+    ~Database();
+
+    Database(const Database&) = delete;
+    Database& operator=(const Database&) = delete;
+
+    // Creates the file if needed and opens the writer.
+    bool open();
+
+    Lease writer();
+    // Waits while all readers are busy; opens more up to the pool size.
+    // Falls back to the writer if a reader cannot be opened.
+    Lease reader();
+
+    // Changes whenever another process commits; -1 on error.
+    int64_t data_version();
+
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    std::unique_ptr<Connection> connect(bool read_only);
+    void release(Connection* reader);
+
+    std::filesystem::path path_;
+    size_t max_readers_;
+
+    std::mutex writer_mutex_;
+    std::unique_ptr<Connection> writer_;
+
+    std::mutex readers_mutex_;
+    std::condition_variable reader_free_;
+    std::vector<std::unique_ptr<Connection>> readers_;
+    std::vector<Connection*> idle_readers_;
+
+    std::string last_error_;
+};
+
+}  // namespace email
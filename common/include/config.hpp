@@ -15,9 +15,19 @@ struct ServerConfig {
     uint16_t tls_port = 0;
     bool enable_starttls = true;
     size_t max_connections = 1000;
+    // Bytes all connections of the protocol may hold; new connections are
+    // refused past it. 0 means unlimited.
+    size_t memory_budget = 0;
     size_t thread_pool_size = 4;
+    // One io_context and SO_REUSEPORT acceptor per thread instead of a
+    // single shared io_context.
+    bool per_core_io = false;
+    bool pin_threads = false;
     std::chrono::seconds connection_timeout{300};
     std::chrono::seconds idle_timeout{600};
+    // Serves Prometheus metrics over HTTP at /metrics; 0 disables it.
+    uint16_t metrics_port = 0;
+    std::string metrics_address = "127.0.0.1";
 };
 
 struct TLSConfig {
@@ -27,17 +37,36 @@ struct TLSConfig {
     std::string ciphers = "HIGH:!aNULL:!MD5:!RC4";
     bool verify_client = false;
     int min_protocol_version = 0;  // 0 = TLS 1.2
+    size_t session_cache_size = 20480;
+    int session_timeout = 7200;            // seconds a cached session stays resumable
+    int ticket_key_lifetime = 43200;       // seconds; 0 disables session tickets
+    bool enable_ktls = false;
 };
 
 struct DatabaseConfig {
     std::filesystem::path path = "/var/lib/email_server/users.db";
     size_t connection_pool_size = 10;
+    // Seconds a verified login is remembered, sparing the password KDF on
+    // reconnects; 0 disables it.
+    int credential_cache_ttl = 300;
 };
 
 struct StorageConfig {
     std::filesystem::path maildir_root = "/var/mail";
     size_t default_quota_bytes = 104857600;  // 100 MB
     bool create_directories = true;
+    // How often the usage totals are recounted from the mailbox indexes
+    // and written back to the user database, in seconds; 0 disables it.
+    int usage_reconcile_interval = 3600;
+    // zstd level for storing new messages compressed; 0 stores them as
+    // they are. Needs a build with ENABLE_COMPRESSION.
+    int compression_level = 0;
+    // Messages per user the usage recount also looks at for compressing
+    // mail stored before compression was enabled; 0 disables it.
+    size_t recompress_batch = 1000;
+    // Bytes of mailbox listings kept for sessions of other connections to
+    // share (see MailboxSnapshotCache); 0 keeps none.
+    size_t snapshot_cache_size = 64 * 1024 * 1024;
 };
 
 struct LogConfig {
@@ -54,10 +83,26 @@ struct SMTPConfig : ServerConfig {
     std::string hostname = "localhost";
     std::vector<std::string> local_domains;
     size_t max_message_size = 25 * 1024 * 1024;  // 25 MB
+    // Larger messages go to the spool directory as they are received
+    // rather than being held in memory.
+    size_t data_spool_threshold = 256 * 1024;
     size_t max_recipients = 100;
     bool require_auth = true;
     bool allow_relay = false;
     std::vector<std::string> relay_hosts;
+    // Mail for other hosts waits here for the delivery workers; empty
+    // delivers it while the client waits for its reply instead.
+    std::filesystem::path spool_directory = "/var/spool/email_server";
+    size_t delivery_workers = 4;
+    size_t max_per_destination = 2;  // Concurrent deliveries to one domain
+    int retry_interval = 300;        // Seconds to the first retry; then doubling
+    int max_retries = 8;
+    // Outbound connections: open at once to one mail exchanger, kept open
+    // between messages, and for how many seconds.
+    size_t relay_connections_per_host = 4;
+    size_t relay_idle_connections = 2;
+    int relay_idle_timeout = 60;
+    bool relay_starttls = true;  // Whenever the exchanger offers it
 
     SMTPConfig() {
         port = 25;
@@ -76,7 +121,15 @@ struct POP3Config : ServerConfig {
 
 struct IMAPConfig : ServerConfig {
     size_t max_search_results = 1000;
+    // Largest command with its literals, and so the largest APPEND.
+    size_t max_command_size = 32 * 1024 * 1024;
     bool enable_idle = true;
+    // COMPRESS=DEFLATE; the window and memLevel bound each connection's
+    // compressor (see DeflateCodec).
+    bool enable_compress = true;
+    int compress_level = 6;
+    int compress_window_bits = 12;
+    int compress_mem_level = 5;
 
     IMAPConfig() {
         port = 143;
@@ -84,6 +137,19 @@ struct IMAPConfig : ServerConfig {
     }
 };
 
+// The single-process email_server, which runs the enabled protocols on
+// one shared set of I/O threads; each protocol's own threading keys are
+// then ignored.
+struct DaemonConfig {
+    bool smtp = true;
+    bool pop3 = true;
+    bool imap = true;
+    size_t io_threads = 0;  // 0 = one per CPU
+    bool pin_threads = false;
+    uint16_t metrics_port = 0;
+    std::string metrics_address = "127.0.0.1";
+};
+
 class Config {
 public:
     static Config& instance();
@@ -98,6 +164,7 @@ public:
     const SMTPConfig& smtp() const { return smtp_; }
     const POP3Config& pop3() const { return pop3_; }
     const IMAPConfig& imap() const { return imap_; }
+    const DaemonConfig& daemon() const { return daemon_; }
 
     TLSConfig& tls() { return tls_; }
     DatabaseConfig& database() { return database_; }
@@ -106,6 +173,7 @@ public:
     SMTPConfig& smtp() { return smtp_; }
     POP3Config& pop3() { return pop3_; }
     IMAPConfig& imap() { return imap_; }
+    DaemonConfig& daemon() { return daemon_; }
 
     std::optional<std::string> get(const std::string& key) const;
     void set(const std::string& key, const std::string& value);
@@ -124,6 +192,7 @@ private:
     SMTPConfig smtp_;
     POP3Config pop3_;
     IMAPConfig imap_;
+    DaemonConfig daemon_;
 
     std::unordered_map<std::string, std::string> custom_values_;
 };
@@ -1,14 +1,28 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <string_view>
 #include <memory>
 #include <mutex>
+#include <condition_variable>
 #include <fstream>
 #include <chrono>
 #include <format>
 #include <source_location>
 #include <filesystem>
+#include <thread>
+#include <vector>
+
+// Messages below this level are compiled out: 0 keeps everything, 2 drops
+// trace and debug. Release builds default to 2.
+#ifndef EMAIL_LOG_MIN_LEVEL
+#ifdef NDEBUG
+#define EMAIL_LOG_MIN_LEVEL 2
+#else
+#define EMAIL_LOG_MIN_LEVEL 0
+#endif
+#endif
 
 namespace email {
 
@@ -21,9 +35,22 @@ enum class LogLevel {
     Fatal = 5
 };
 
+inline constexpr LogLevel min_log_level = static_cast<LogLevel>(EMAIL_LOG_MIN_LEVEL);
+
+// What a thread does when its queue is full. Warnings and worse always
+// wait, whatever the policy.
+enum class LogOverflow {
+    Drop,   // Counted, and reported once there is room
+    Block,
+};
+
+// Callers only format the message and queue it on a ring of their own
+// thread, without locks or system calls. A background thread drains the
+// rings, adds timestamps, and writes in batches.
 class Logger {
 public:
     static Logger& instance();
+    ~Logger();
 
     void init(LogLevel level = LogLevel::Info,
               bool console = true,
@@ -31,16 +58,20 @@ public:
               size_t max_file_size = 10 * 1024 * 1024,
               size_t max_files = 5);
 
-    void set_level(LogLevel level) { level_ = level; }
-    LogLevel level() const { return level_; }
+    void set_level(LogLevel level) { level_.store(level, std::memory_order_relaxed); }
+    LogLevel level() const { return level_.load(std::memory_order_relaxed); }
+    void set_overflow(LogOverflow policy) { overflow_.store(policy, std::memory_order_relaxed); }
+
+    // Returns once everything this thread logged is written. Fatal
+    // messages flush themselves.
+    void flush();
 
     template<typename... Args>
     void log(LogLevel level, const std::source_location& loc,
              std::format_string<Args...> fmt, Args&&... args) {
-        if (level < level_) return;
+        if (level < this->level()) return;
 
-        std::string message = std::format(fmt, std::forward<Args>(args)...);
-        write(level, loc, message);
+        write(level, loc, std::format(fmt, std::forward<Args>(args)...));
     }
 
     void trace(std::string_view msg, const std::source_location& loc = std::source_location::current());
@@ -51,45 +82,83 @@ public:
     void fatal(std::string_view msg, const std::source_location& loc = std::source_location::current());
 
 private:
-    Logger() = default;
+    struct Record;
+    struct Ring;
+
+    Logger();
     Logger(const Logger&) = delete;
     Logger& operator=(const Logger&) = delete;
 
-    void write(LogLevel level, const std::source_location& loc, const std::string& message);
+    void write(LogLevel level, const std::source_location& loc, std::string message);
+    Ring& local_ring();
+    void wake_writer();
+
+    // The writer thread's side.
+    void run();
+    void format(const Record& record);
+    void output();
     void rotate_if_needed();
     std::string level_to_string(LogLevel level) const;
-    std::string get_timestamp() const;
+    std::string_view timestamp(std::chrono::system_clock::time_point time);
 
-    LogLevel level_ = LogLevel::Info;
+    std::atomic<LogLevel> level_{LogLevel::Info};
+    std::atomic<LogOverflow> overflow_{LogOverflow::Drop};
+    std::atomic<size_t> dropped_{0};
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<Ring>> rings_;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    std::condition_variable flushed_;
+    uint64_t flush_requested_ = 0;
+    uint64_t flush_done_ = 0;
+    bool wake_requested_ = false;  // A ring filled past half
+    bool stopping_ = false;
+
+    // Used by the writer, and by init() under output_mutex_.
+    std::mutex output_mutex_;
     bool console_ = true;
     std::filesystem::path log_file_;
     std::ofstream file_stream_;
     size_t max_file_size_ = 10 * 1024 * 1024;
     size_t max_files_ = 5;
     size_t current_size_ = 0;
-    std::mutex mutex_;
+    std::string console_batch_;
+    std::string file_batch_;
+    std::string line_;
+    int64_t stamped_second_ = -1;
+    char stamp_[32] = {};
+
+    std::thread writer_;
 };
 
-// Convenience macros
-#define LOG_TRACE(msg) email::Logger::instance().trace(msg)
-#define LOG_DEBUG(msg) email::Logger::instance().debug(msg)
-#define LOG_INFO(msg) email::Logger::instance().info(msg)
-#define LOG_WARNING(msg) email::Logger::instance().warning(msg)
-#define LOG_ERROR(msg) email::Logger::instance().error(msg)
-#define LOG_FATAL(msg) email::Logger::instance().fatal(msg)
+// Convenience macros. Levels under EMAIL_LOG_MIN_LEVEL compile to nothing;
+// their arguments are still checked but not evaluated.
+#define EMAIL_LOG_AT(lvl, call) \
+    do { \
+        if constexpr (email::LogLevel::lvl >= email::min_log_level) { \
+            call; \
+        } \
+    } while (0)
+
+#define LOG_TRACE(msg) EMAIL_LOG_AT(Trace, email::Logger::instance().trace(msg))
+#define LOG_DEBUG(msg) EMAIL_LOG_AT(Debug, email::Logger::instance().debug(msg))
+#define LOG_INFO(msg) EMAIL_LOG_AT(Info, email::Logger::instance().info(msg))
+#define LOG_WARNING(msg) EMAIL_LOG_AT(Warning, email::Logger::instance().warning(msg))
+#define LOG_ERROR(msg) EMAIL_LOG_AT(Error, email::Logger::instance().error(msg))
+#define LOG_FATAL(msg) EMAIL_LOG_AT(Fatal, email::Logger::instance().fatal(msg))
 
 // Format macros
-#define LOG_TRACE_FMT(fmt, ...) \
-    email::Logger::instance().log(email::LogLevel::Trace, std::source_location::current(), fmt, __VA_ARGS__)
-#define LOG_DEBUG_FMT(fmt, ...) \
-    email::Logger::instance().log(email::LogLevel::Debug, std::source_location::current(), fmt, __VA_ARGS__)
-#define LOG_INFO_FMT(fmt, ...) \
-    email::Logger::instance().log(email::LogLevel::Info, std::source_location::current(), fmt, __VA_ARGS__)
-#define LOG_WARNING_FMT(fmt, ...) \
-    email::Logger::instance().log(email::LogLevel::Warning, std::source_location::current(), fmt, __VA_ARGS__)
-#define LOG_ERROR_FMT(fmt, ...) \
-    email::Logger::instance().log(email::LogLevel::Error, std::source_location::current(), fmt, __VA_ARGS__)
-#define LOG_FATAL_FMT(fmt, ...) \
-    email::Logger::instance().log(email::LogLevel::Fatal, std::source_location::current(), fmt, __VA_ARGS__)
+#define EMAIL_LOG_FMT(lvl, fmt, ...) \
+    EMAIL_LOG_AT(lvl, email::Logger::instance().log(email::LogLevel::lvl, \
+                                                    std::source_location::current(), fmt, __VA_ARGS__))
+
+#define LOG_TRACE_FMT(fmt, ...) EMAIL_LOG_FMT(Trace, fmt, __VA_ARGS__)
+#define LOG_DEBUG_FMT(fmt, ...) EMAIL_LOG_FMT(Debug, fmt, __VA_ARGS__)
+#define LOG_INFO_FMT(fmt, ...) EMAIL_LOG_FMT(Info, fmt, __VA_ARGS__)
+#define LOG_WARNING_FMT(fmt, ...) EMAIL_LOG_FMT(Warning, fmt, __VA_ARGS__)
+#define LOG_ERROR_FMT(fmt, ...) EMAIL_LOG_FMT(Error, fmt, __VA_ARGS__)
+#define LOG_FATAL_FMT(fmt, ...) EMAIL_LOG_FMT(Fatal, fmt, __VA_ARGS__)
 
 }  // namespace email
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <variant>
+#include <vector>
+
+namespace email {
+
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// Updates go to one of a few cache-line sized stripes, picked per thread,
+// so io threads counting the same thing do not contend; reads add the
+// stripes up.
+inline constexpr size_t metric_stripes = 8;
+size_t metric_stripe();
+
+class Counter {
+public:
+    void add(uint64_t n = 1) {
+        stripes_[metric_stripe()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const;
+
+private:
+    struct alignas(64) Stripe {
+        std::atomic<uint64_t> value{0};
+    };
+    std::array<Stripe, metric_stripes> stripes_;
+};
+
+class Gauge {
+public:
+    void set(int64_t value) { value_.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { value_.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> value_{0};
+};
+
+// Durations in log-linear buckets, as HdrHistogram keeps them: each power
+// of two of nanoseconds is split into 8, so a bucket is within 12.5% of
+// any value in it, from 1ns to about 18 minutes. Recording is two relaxed
+// increments on the calling thread's stripe.
+class Histogram {
+public:
+    static constexpr int sub_bits = 3;
+    static constexpr int max_bits = 40;
+    static constexpr size_t bucket_count = (1u << sub_bits) * (max_bits - sub_bits + 1);
+
+    struct Snapshot {
+        std::array<uint64_t, bucket_count> buckets{};
+        uint64_t count = 0;
+        uint64_t sum_ns = 0;
+
+        // Upper bound of the bucket holding quantile `q`, in nanoseconds.
+        uint64_t quantile(double q) const;
+    };
+
+    void record(std::chrono::nanoseconds duration);
+    Snapshot snapshot() const;
+
+    static size_t bucket_of(uint64_t ns);
+    // The smallest value past the bucket.
+    static uint64_t bucket_end(size_t bucket);
+
+private:
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, bucket_count> buckets{};
+        std::atomic<uint64_t> sum_ns{0};
+    };
+    std::array<Stripe, metric_stripes> stripes_;
+};
+
+// Records the time from construction to destruction.
+class ScopedTimer {
+public:
+    explicit ScopedTimer(Histogram& histogram)
+        : histogram_(histogram), start_(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() { histogram_.record(std::chrono::steady_clock::now() - start_); }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// The process's metrics, rendered in the Prometheus text format. Metrics
+// are registered once, typically into a static or a member, and live as
+// long as the process; asking again for the same name and labels returns
+// the same one.
+class Metrics {
+public:
+    // A gauge read by calling back at scrape time; unregistered when
+    // destroyed.
+    class Probe {
+    public:
+        Probe() = default;
+        ~Probe();
+        Probe(Probe&& other) noexcept : id_(std::exchange(other.id_, 0)) {}
+        Probe& operator=(Probe&& other) noexcept;
+
+    private:
+        friend class Metrics;
+        explicit Probe(uint64_t id) : id_(id) {}
+        uint64_t id_ = 0;
+    };
+
+    static Metrics& instance();
+
+    Counter& counter(const std::string& name, const std::string& help, MetricLabels labels = {});
+    Gauge& gauge(const std::string& name, const std::string& help, MetricLabels labels = {});
+    // Exported in seconds.
+    Histogram& histogram(const std::string& name, const std::string& help, MetricLabels labels = {});
+    [[nodiscard]] Probe probe(const std::string& name, const std::string& help, MetricLabels labels,
+                              std::function<double()> read);
+
+    std::string render() const;
+
+private:
+    struct ProbeFunction {
+        uint64_t id;
+        std::function<double()> read;
+    };
+    using Value = std::variant<std::unique_ptr<Counter>, std::unique_ptr<Gauge>,
+                               std::unique_ptr<Histogram>, ProbeFunction>;
+    struct Family {
+        std::string help;
+        std::string type;
+        std::vector<std::pair<MetricLabels, Value>> series;
+    };
+
+    Metrics() = default;
+    template<typename T>
+    T& find_or_add(const std::string& name, const std::string& help, const char* type,
+                   MetricLabels labels);
+    void remove_probe(uint64_t id);
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Family> families_;
+    uint64_t next_probe_ = 1;
+};
+
+}  // namespace email
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+
+namespace email {
+
+// Scratch memory for the command a session is currently handling. Parsing
+// and response building allocate from a monotonic resource over an inline
+// buffer, so a typical command is a pointer bump inside the session object
+// instead of a trip through the shared malloc arenas. reset() after the
+// tagged response rewinds everything at once; commands that outgrow the
+// inline buffer spill into upstream chunks, which reset() gives back.
+//
+// Not thread-safe: like the rest of a session's state it belongs to the
+// session's strand.
+class CommandArena {
+public:
+    static constexpr std::size_t inline_size = 4096;
+
+    CommandArena() : resource_(buffer_.data(), buffer_.size(), std::pmr::new_delete_resource()) {}
+
+    CommandArena(const CommandArena&) = delete;
+    CommandArena& operator=(const CommandArena&) = delete;
+
+    std::pmr::memory_resource* resource() { return &resource_; }
+
+    // Invalidates everything allocated since the previous reset().
+    void reset() { resource_.release(); }
+
+private:
+    alignas(std::max_align_t) std::array<std::byte, inline_size> buffer_;
+    std::pmr::monotonic_buffer_resource resource_;
+};
+
+}  // namespace email
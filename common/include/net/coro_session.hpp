@@ -0,0 +1,86 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include "session.hpp"
+
+namespace email {
+
+// Shared pool for work that must not run on an io thread: password hashing,
+// synchronous SMTP relay, large disk reads. Sized to the hardware, with at
+// least two threads.
+asio::thread_pool& blocking_pool();
+
+// A Session whose protocol logic is a single coroutine instead of a chain of
+// callbacks. run() is spawned on the session's strand once the connection
+// (and, for implicit TLS, the handshake) is ready and reads its input with
+// co_await read_line(). Writing, STARTTLS, idle timeouts and backpressure are
+// inherited from Session; read_line() simply does not return while a TLS
+// upgrade is pending or output is backlogged.
+//
+// The run() frame lives for the whole connection, and the short-lived frames
+// of read_line()/write() and the socket operations come from asio's
+// per-thread recycling allocator, so a steady-state command costs no heap
+// allocation for the I/O plumbing.
+class CoroSession : public Session {
+public:
+    using Session::Session;
+
+    void stop() override;
+
+protected:
+    // The protocol. When it returns, the session closes after queued output
+    // has been written.
+    virtual asio::awaitable<void> run() = 0;
+
+    // The next input line without its terminator, or nullopt once the peer
+    // disconnected or the session stopped.
+    asio::awaitable<std::optional<std::string>> read_line();
+
+    // Queues data like send() and waits while output is backlogged.
+    asio::awaitable<void> write(std::string data);
+    asio::awaitable<void> write_line(std::string line);
+
+    // Runs fn() on `pool` and resumes on this session's strand with its
+    // result. The coroutine is suspended meanwhile, so fn may use session
+    // state that is otherwise only touched from the strand. A non-void
+    // result must be default constructible.
+    template<typename Fn>
+    asio::awaitable<std::invoke_result_t<Fn&>> offload(asio::thread_pool& pool, Fn fn) {
+        using Result = std::invoke_result_t<Fn&>;
+        if constexpr (std::is_void_v<Result>) {
+            co_await asio::co_spawn(pool,
+                [&fn]() -> asio::awaitable<void> { fn(); co_return; },
+                asio::use_awaitable);
+        } else {
+            co_return co_await asio::co_spawn(pool,
+                [&fn]() -> asio::awaitable<Result> { co_return fn(); },
+                asio::use_awaitable);
+        }
+    }
+
+    void do_read() override;
+    void on_write_drained() override;
+    void on_data(const std::string&) override {}
+
+private:
+    asio::awaitable<void> execute(std::shared_ptr<CoroSession> self);
+    asio::awaitable<void> wait_for_wakeup();
+    void wake();
+
+    bool spawned_ = false;
+    bool wake_pending_ = false;
+    bool waiting_ = false;
+    // Bytes at the front of the pending partial line already scanned.
+    std::size_t line_scanned_ = 0;
+    // Never expires on its own; cancelled to resume a waiting coroutine.
+    asio::steady_timer wakeup_{strand_, asio::steady_timer::time_point::max()};
+};
+
+}  // namespace email
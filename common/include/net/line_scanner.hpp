@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace email {
+
+// Splits complete lines out of `buffer` and appends them to `lines`, with the
+// LF or CRLF terminator stripped. Returns the number of bytes consumed, i.e.
+// the offset just past the last newline; anything after it is an incomplete
+// line. `clean_prefix` is the number of leading bytes already known to
+// contain no newline, so a long line arriving in pieces is only scanned once.
+//
+// The scan uses SSE2 (AVX2 when the CPU supports it) on x86-64 and NEON on
+// AArch64, falling back to a scalar loop elsewhere.
+std::size_t split_lines(std::string_view buffer,
+                        std::vector<std::string_view>& lines,
+                        std::size_t clean_prefix = 0);
+
+}  // namespace email
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+namespace email {
+
+// Memory shared by the sessions of one or more Servers. Each session charges
+// its footprint (session object, TLS state, read buffer, write queue,
+// protocol caches) as it changes, in page-sized steps so a steady
+// request/response loop does not touch the shared counter. A Server refuses
+// new connections while the budget is exhausted, and sessions on plain
+// sockets drop their read buffer between reads once it is under pressure.
+//
+// A zero limit means unlimited; usage is still tracked.
+class MemoryBudget {
+public:
+    // Share of the limit past which the budget counts as under pressure.
+    static constexpr std::size_t pressure_percent = 75;
+
+    explicit MemoryBudget(std::size_t limit = 0) : limit_(limit) {}
+
+    MemoryBudget(const MemoryBudget&) = delete;
+    MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+    void set_limit(std::size_t bytes) { limit_.store(bytes, std::memory_order_relaxed); }
+    std::size_t limit() const { return limit_.load(std::memory_order_relaxed); }
+    std::size_t used() const { return used_.load(std::memory_order_relaxed); }
+
+    void charge(std::size_t bytes) { used_.fetch_add(bytes, std::memory_order_relaxed); }
+    void release(std::size_t bytes) { used_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    // Whether `bytes` more would stay within the limit.
+    bool has_room(std::size_t bytes) const {
+        std::size_t max = limit();
+        return max == 0 || used() + bytes <= max;
+    }
+
+    bool under_pressure() const {
+        std::size_t max = limit();
+        return max != 0 && used() >= max / 100 * pressure_percent;
+    }
+
+private:
+    std::atomic<std::size_t> limit_;
+    std::atomic<std::size_t> used_{0};
+};
+
+// Helpers for estimating container footprints.
+
+// Heap bytes behind a string; none while it fits the inline buffer.
+inline std::size_t string_heap_bytes(const std::string& str) {
+    return str.capacity() > std::string().capacity() ? str.capacity() + 1 : 0;
+}
+
+// One node of a std::set / std::map: three links and the colour, then the value.
+template<typename T>
+inline constexpr std::size_t tree_node_bytes = 4 * sizeof(void*) + sizeof(T);
+
+// One node of a std::unordered_set / std::unordered_map: the link, the
+// value and the cached hash.
+template<typename T>
+inline constexpr std::size_t hash_node_bytes = 2 * sizeof(void*) + sizeof(T);
+
+}  // namespace email
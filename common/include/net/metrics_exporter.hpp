@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <boost/asio.hpp>
+
+namespace email {
+
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+
+// Serves Metrics::instance() to Prometheus: GET /metrics over plain HTTP,
+// answered on a thread of its own so a scrape never waits behind the io
+// threads, and never delays them either.
+class MetricsExporter {
+public:
+    MetricsExporter(std::string bind_address, uint16_t port);
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    // False if the address cannot be bound; see last_error().
+    bool start();
+    void stop();
+
+    // The port bound, which differs from the one asked for if that was 0.
+    uint16_t port() const { return port_; }
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    void do_accept();
+    void serve(tcp::socket socket);
+
+    std::string bind_address_;
+    uint16_t port_;
+    asio::io_context io_context_;
+    tcp::acceptor acceptor_;
+    std::thread thread_;
+    std::string last_error_;
+};
+
+}  // namespace email
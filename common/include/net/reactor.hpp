@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+namespace email {
+
+namespace asio = boost::asio;
+
+// A set of io_contexts, each run by one thread of its own, that several
+// Servers can share instead of each starting their own threads (see
+// Server::set_reactor). Every server listening on a reactor opens one
+// SO_REUSEPORT acceptor per shard, so a connection stays on the shard, and
+// the thread, that accepted it.
+class Reactor {
+public:
+    // Zero shards means one per CPU. With pin_threads, shard i runs on CPU
+    // i modulo the CPU count.
+    explicit Reactor(size_t shard_count = 0, bool pin_threads = false);
+    ~Reactor();
+
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    void start();
+    // Stops every shard and joins its thread. Handlers still queued are
+    // dropped with the io_contexts, so stop the servers first if their
+    // sessions should see a clean stop().
+    void stop();
+
+    bool is_running() const { return running_; }
+    size_t size() const { return shards_.size(); }
+    asio::io_context& shard(size_t index) { return *shards_[index]; }
+
+private:
+    using WorkGuard = asio::executor_work_guard<asio::io_context::executor_type>;
+
+    void run_thread(size_t index);
+
+    std::vector<std::unique_ptr<asio::io_context>> shards_;
+    std::vector<WorkGuard> work_;
+    std::vector<std::thread> threads_;
+    bool pin_threads_;
+    std::atomic<bool> running_{false};
+};
+
+}  // namespace email
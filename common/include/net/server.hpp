@@ -1,20 +1,28 @@
 #pragma once
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
 #include <thread>
 #include <atomic>
 #include <functional>
-#include <set>
-#include <mutex>
+#include <latch>
 #include <type_traits>
 #include <boost/asio.hpp>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 #ifdef ENABLE_TLS
 #include <boost/asio/ssl.hpp>
 #endif
 
+#include "memory_budget.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
 #include "session.hpp"
+#include "session_registry.hpp"
 
 namespace email {
 
@@ -24,6 +32,15 @@ using tcp = asio::ip::tcp;
 namespace ssl = asio::ssl;
 #endif
 
+// How a Server spreads its work over threads.
+enum class ExecutionMode {
+    // One io_context and acceptor, run by every thread (default).
+    Shared,
+    // One io_context, SO_REUSEPORT acceptor and thread per shard; sessions
+    // stay on the shard that accepted them.
+    PerCore
+};
+
 template<typename SessionType>
 class Server {
 public:
@@ -44,10 +61,35 @@ public:
     void stop();
 
     bool is_running() const { return running_; }
-    size_t connection_count() const;
+    size_t connection_count() const { return sessions_.size(); }
+
+    // Visits every live session (e.g. for broadcasts).
+    void for_each_session(const std::function<void(const std::shared_ptr<SessionType>&)>& fn) {
+        sessions_.for_each(fn);
+    }
 
     void set_max_connections(size_t max) { max_connections_ = max; }
+    // Memory charged by this server's sessions. New connections are refused
+    // while the budget cannot fit another session; servers can share one
+    // budget. By default each server tracks usage without a limit.
+    void set_memory_budget(std::shared_ptr<MemoryBudget> budget) { memory_budget_ = std::move(budget); }
+    const MemoryBudget& memory_budget() const { return *memory_budget_; }
+    // Connections turned away because the memory budget was exhausted.
+    size_t memory_refusals() const { return memory_refusals_.load(std::memory_order_relaxed); }
     void set_connection_timeout(std::chrono::seconds timeout) { connection_timeout_ = timeout; }
+    void set_max_write_batch(size_t bytes) { max_write_batch_ = bytes; }
+
+    // Must be called before start(). In PerCore mode thread_count is the
+    // shard count.
+    void set_execution_mode(ExecutionMode mode) { execution_mode_ = mode; }
+    ExecutionMode execution_mode() const { return execution_mode_; }
+    // Pin each thread to one CPU (round-robin over the available CPUs).
+    void set_cpu_affinity(bool pin) { pin_threads_ = pin; }
+    // Must be called before start(). Serves on `reactor`'s shards, one
+    // acceptor each, instead of starting threads; the execution mode,
+    // thread count and affinity are then the reactor's. stop() may run
+    // while the reactor does, but not on one of its threads.
+    void set_reactor(std::shared_ptr<Reactor> reactor) { reactor_ = std::move(reactor); }
 
     // Callback for session creation customization
     using SessionFactory = std::function<std::shared_ptr<SessionType>(
@@ -67,16 +109,34 @@ protected:
     virtual void on_session_end(std::shared_ptr<SessionType> session);
 
 private:
-    void do_accept();
-    void remove_session(std::shared_ptr<SessionType> session);
+    struct Shard {
+        std::unique_ptr<asio::io_context> owned;  // Unset on a reactor's shard
+        asio::io_context& io_context;
+        tcp::acceptor acceptor;
+
+        Shard() : owned(std::make_unique<asio::io_context>()), io_context(*owned), acceptor(io_context) {}
+        explicit Shard(asio::io_context& shared) : io_context(shared), acceptor(io_context) {}
+    };
+
+    void open_acceptor(Shard& shard, const tcp::endpoint& endpoint, bool reuse_port);
+    void do_accept(Shard& shard);
+    void run_thread(Shard& shard, size_t index);
+    void handle_accept(Shard& shard, tcp::socket socket);
+    void remove_session(const SessionType* session);
+    // stop() while the reactor runs: everything is closed on its own shard.
+    void stop_on_reactor();
 
     std::string name_;
     std::string bind_address_;
     uint16_t port_;
 
-    asio::io_context io_context_;
-    tcp::acceptor acceptor_;
+    std::vector<std::unique_ptr<Shard>> shards_;
     std::vector<std::thread> threads_;
+    ExecutionMode execution_mode_ = ExecutionMode::Shared;
+    bool pin_threads_ = false;
+    std::shared_ptr<Reactor> reactor_;
+    // async_accept calls whose handler has not finished yet.
+    std::atomic<size_t> pending_accepts_{0};
 
 #ifdef ENABLE_TLS
     ssl::context* ssl_context_ = nullptr;
@@ -86,12 +146,16 @@ private:
     std::atomic<bool> running_{false};
     size_t thread_count_;
     size_t max_connections_ = 1000;
+    std::shared_ptr<MemoryBudget> memory_budget_ = std::make_shared<MemoryBudget>();
+    std::atomic<size_t> memory_refusals_{0};
     std::chrono::seconds connection_timeout_{300};
+    size_t max_write_batch_ = 64 * 1024;
 
-    std::set<std::shared_ptr<SessionType>> sessions_;
-    std::mutex sessions_mutex_;
+    SessionRegistry<SessionType> sessions_;
 
     SessionFactory session_factory_;
+
+    Metrics::Probe connections_probe_;  // Last, so it goes before what it reads
 };
 
 // Template implementation
@@ -102,8 +166,8 @@ Server<SessionType>::Server(const std::string& name, const std::string& bind_add
     : name_(name)
     , bind_address_(bind_address)
     , port_(port)
-    , acceptor_(io_context_)
-    , thread_count_(thread_count) {
+    , thread_count_(thread_count)
+    , sessions_(std::max<size_t>(16, thread_count)) {
 }
 
 #ifdef ENABLE_TLS
@@ -113,10 +177,10 @@ Server<SessionType>::Server(const std::string& name, const std::string& bind_add
     : name_(name)
     , bind_address_(bind_address)
     , port_(port)
-    , acceptor_(io_context_)
     , ssl_context_(&ssl_ctx)
     , use_tls_(true)
-    , thread_count_(thread_count) {
+    , thread_count_(thread_count)
+    , sessions_(std::max<size_t>(16, thread_count)) {
 }
 #endif
 
@@ -129,35 +193,86 @@ template<typename SessionType>
 void Server<SessionType>::start() {
     if (running_) return;
 
+    const size_t threads = reactor_ ? 0 : std::max<size_t>(thread_count_, 1);
+    const bool per_core = reactor_ || execution_mode_ == ExecutionMode::PerCore;
+    const size_t shard_count = reactor_ ? reactor_->size() : per_core ? threads : 1;
+
     tcp::endpoint endpoint(asio::ip::make_address(bind_address_), port_);
-    acceptor_.open(endpoint.protocol());
-    acceptor_.set_option(asio::socket_base::reuse_address(true));
-    acceptor_.bind(endpoint);
-    acceptor_.listen(asio::socket_base::max_listen_connections);
+    shards_.clear();
+    for (size_t i = 0; i < shard_count; ++i) {
+        auto shard = reactor_ ? std::make_unique<Shard>(reactor_->shard(i)) : std::make_unique<Shard>();
+        open_acceptor(*shard, endpoint, per_core);
+        shards_.push_back(std::move(shard));
+    }
 
     running_ = true;
-    do_accept();
-
-    for (size_t i = 0; i < thread_count_; ++i) {
-        threads_.emplace_back([this]() {
-            io_context_.run();
+    for (auto& shard : shards_) {
+        do_accept(*shard);
+    }
+    connections_probe_ = Metrics::instance().probe(
+        "email_connections", "Open client connections", {{"server", name_}},
+        [this]() { return static_cast<double>(sessions_.size()); });
+
+    for (size_t i = 0; i < threads; ++i) {
+        Shard& shard = *shards_[per_core ? i : 0];
+        threads_.emplace_back([this, &shard, i]() {
+            run_thread(shard, i);
         });
     }
 }
 
+template<typename SessionType>
+void Server<SessionType>::open_acceptor(Shard& shard, const tcp::endpoint& endpoint,
+                                        bool reuse_port) {
+    shard.acceptor.open(endpoint.protocol());
+    shard.acceptor.set_option(asio::socket_base::reuse_address(true));
+#ifdef SO_REUSEPORT
+    if (reuse_port) {
+        // Every shard binds the same port; the kernel spreads incoming
+        // connections across the listening sockets.
+        using reuse_port_option = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+        shard.acceptor.set_option(reuse_port_option(true));
+    }
+#else
+    (void)reuse_port;
+#endif
+    shard.acceptor.bind(endpoint);
+    shard.acceptor.listen(asio::socket_base::max_listen_connections);
+}
+
+template<typename SessionType>
+void Server<SessionType>::run_thread(Shard& shard, size_t index) {
+#ifdef __linux__
+    if (pin_threads_) {
+        unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void)index;
+#endif
+    shard.io_context.run();
+}
+
 template<typename SessionType>
 void Server<SessionType>::stop() {
     if (!running_) return;
 
     running_ = false;
-    io_context_.stop();
+    connections_probe_ = {};
+    if (reactor_ && reactor_->is_running()) {
+        stop_on_reactor();
+        shards_.clear();
+        return;
+    }
+    for (auto& shard : shards_) {
+        shard->io_context.stop();
+    }
 
-    {
-        std::lock_guard<std::mutex> lock(sessions_mutex_);
-        for (auto& session : sessions_) {
-            session->stop();
-        }
-        sessions_.clear();
+    for (auto& session : sessions_.clear()) {
+        session->stop();
     }
 
     for (auto& thread : threads_) {
@@ -166,48 +281,109 @@ void Server<SessionType>::stop() {
         }
     }
     threads_.clear();
+    shards_.clear();
 }
 
 template<typename SessionType>
-size_t Server<SessionType>::connection_count() const {
-    std::lock_guard<std::mutex> lock(const_cast<std::mutex&>(sessions_mutex_));
-    return sessions_.size();
+void Server<SessionType>::stop_on_reactor() {
+    // Each shard has a single thread, so once a posted call has run there,
+    // whatever that thread was doing for this server before has finished.
+    auto on_each_shard = [this](auto fn) {
+        std::latch done(static_cast<std::ptrdiff_t>(shards_.size()));
+        for (auto& shard : shards_) {
+            asio::post(shard->io_context, [&fn, &done, acceptor = &shard->acceptor]() {
+                fn(*acceptor);
+                done.count_down();
+            });
+        }
+        done.wait();
+    };
+
+    // No session can be added after this.
+    on_each_shard([](tcp::acceptor& acceptor) {
+        boost::system::error_code ignored;
+        acceptor.close(ignored);
+    });
+
+    auto sessions = sessions_.clear();
+    std::latch stopped(static_cast<std::ptrdiff_t>(sessions.size()));
+    for (auto& session : sessions) {
+        session->stop_async([&stopped]() { stopped.count_down(); });
+    }
+    stopped.wait();
+    // Sessions that stopped on their own just before may still be in their
+    // close handler.
+    on_each_shard([](tcp::acceptor&) {});
+
+    // Nor may the cancelled accepts' handlers, the last to touch this server.
+    while (pending_accepts_.load() != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
 }
 
 template<typename SessionType>
-void Server<SessionType>::do_accept() {
-    acceptor_.async_accept(
-        [this](boost::system::error_code ec, tcp::socket socket) {
+void Server<SessionType>::do_accept(Shard& shard) {
+    pending_accepts_.fetch_add(1);
+    shard.acceptor.async_accept(
+        [this, &shard](boost::system::error_code ec, tcp::socket socket) {
             if (!ec && running_) {
-                if (connection_count() < max_connections_) {
-                    std::shared_ptr<SessionType> session;
+                handle_accept(shard, std::move(socket));
+            }
 
+            if (running_) {
+                do_accept(shard);
+            }
+            pending_accepts_.fetch_sub(1);
+        });
+}
+
+template<typename SessionType>
+void Server<SessionType>::handle_accept(Shard& shard, tcp::socket socket) {
+    std::size_t admitted = sizeof(SessionType);
 #ifdef ENABLE_TLS
-                    if (use_tls_ && ssl_context_) {
-                        session = create_tls_session(io_context_, std::move(socket), *ssl_context_);
-                    } else {
-                        session = create_session(io_context_, std::move(socket));
-                    }
+    if (use_tls_ && ssl_context_) {
+        admitted += tls_state_estimate;
+    }
+#endif
+    if (!memory_budget_->has_room(admitted)) {
+        memory_refusals_.fetch_add(1, std::memory_order_relaxed);
+        return;  // The socket closes as it goes out of scope
+    }
+    if (!sessions_.try_reserve(max_connections_)) {
+        return;  // Over the limit; the socket closes as it goes out of scope
+    }
+    // Replies are written whole but often end in a short tail right after
+    // a file (a POP3 ".", an IMAP tagged OK), which Nagle would hold back
+    // until the client's delayed ACK, some 40ms later.
+    boost::system::error_code ignored;
+    socket.set_option(tcp::no_delay(true), ignored);
+
+    std::shared_ptr<SessionType> session;
+
+#ifdef ENABLE_TLS
+    if (use_tls_ && ssl_context_) {
+        session = create_tls_session(shard.io_context, std::move(socket), *ssl_context_);
+    } else {
+        session = create_session(shard.io_context, std::move(socket));
+    }
 #else
-                    session = create_session(io_context_, std::move(socket));
+    session = create_session(shard.io_context, std::move(socket));
 #endif
 
-                    if (session) {
-                        {
-                            std::lock_guard<std::mutex> lock(sessions_mutex_);
-                            sessions_.insert(session);
-                        }
-                        session->set_timeout(connection_timeout_);
-                        on_session_start(session);
-                        session->start();
-                    }
-                }
-            }
+    if (!session) {
+        sessions_.release();
+        return;
+    }
 
-            if (running_) {
-                do_accept();
-            }
-        });
+    sessions_.add(session);
+    session->set_close_handler([this, raw = session.get()]() {
+        remove_session(raw);
+    });
+    session->set_timeout(connection_timeout_);
+    session->set_max_write_batch(max_write_batch_);
+    session->set_memory_budget(memory_budget_, sizeof(SessionType));
+    on_session_start(session);
+    session->start();
 }
 
 template<typename SessionType>
@@ -248,14 +424,15 @@ void Server<SessionType>::on_session_start(std::shared_ptr<SessionType> /* sessi
 }
 
 template<typename SessionType>
-void Server<SessionType>::on_session_end(std::shared_ptr<SessionType> session) {
-    remove_session(session);
+void Server<SessionType>::on_session_end(std::shared_ptr<SessionType> /* session */) {
+    // Override in derived class if needed
 }
 
 template<typename SessionType>
-void Server<SessionType>::remove_session(std::shared_ptr<SessionType> session) {
-    std::lock_guard<std::mutex> lock(sessions_mutex_);
-    sessions_.erase(session);
+void Server<SessionType>::remove_session(const SessionType* session) {
+    if (auto removed = sessions_.remove(session)) {
+        on_session_end(std::move(removed));
+    }
 }
 
 }  // namespace email
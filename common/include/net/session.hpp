@@ -1,16 +1,28 @@
 #pragma once
 
+#include <cstdint>
+#include <filesystem>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <span>
 #include <deque>
 #include <functional>
+#include <atomic>
 #include <chrono>
 #include <variant>
+#include <vector>
 #include <boost/asio.hpp>
 #ifdef ENABLE_TLS
 #include <boost/asio/ssl.hpp>
 #endif
 
+#include "memory_budget.hpp"
+#include "stream_codec.hpp"
+#include "timing_wheel.hpp"
+#include "storage/compression.hpp"
+
 namespace email {
 
 namespace asio = boost::asio;
@@ -19,6 +31,50 @@ using tcp = asio::ip::tcp;
 namespace ssl = asio::ssl;
 #endif
 
+// A read-only file queued with Session::send_file(). Opening it before
+// queuing lets a caller announce the size (e.g. in an IMAP literal or a
+// POP3 octet count) without racing a concurrent rename. A compressed
+// message file is sent decompressed, and its size is the logical one.
+class OutboundFile {
+public:
+    static std::optional<OutboundFile> open(const std::filesystem::path& path);
+
+    OutboundFile(OutboundFile&& other) noexcept;
+    OutboundFile& operator=(OutboundFile&& other) noexcept;
+    ~OutboundFile();
+
+    OutboundFile(const OutboundFile&) = delete;
+    OutboundFile& operator=(const OutboundFile&) = delete;
+
+    uint64_t size() const { return size_; }
+    int native_handle() const { return fd_; }
+    // Compressed files cannot go out with sendfile(); read() decodes them.
+    bool compressed() const { return reader_ != nullptr; }
+    ssize_t read(uint64_t offset, char* buffer, std::size_t length);
+
+private:
+    OutboundFile(int fd, uint64_t size) : fd_(fd), size_(size) {}
+
+    int fd_ = -1;
+    uint64_t size_ = 0;
+    std::unique_ptr<compression::Reader> reader_;
+};
+
+// What a TLS connection costs beyond the session object: asio's two 17 KiB
+// record buffers, the 17 KiB halves of its BIO pair and OpenSSL's own
+// connection state (its record buffers are released while idle).
+inline constexpr std::size_t tls_state_estimate = 80 * 1024;
+
+// Bytes a session holds, as charged to its MemoryBudget.
+struct MemoryFootprint {
+    std::size_t session = 0;      // the session object and its TLS state
+    std::size_t read_buffer = 0;
+    std::size_t write_queue = 0;  // owned queued data and file chunk buffers
+    std::size_t messages = 0;     // protocol caches, e.g. IMAP's message list
+
+    std::size_t total() const { return session + read_buffer + write_queue + messages; }
+};
+
 class Session : public std::enable_shared_from_this<Session> {
 public:
 #ifdef ENABLE_TLS
@@ -33,24 +89,93 @@ public:
 #ifdef ENABLE_TLS
     Session(asio::io_context& io_context, tcp::socket socket, ssl::context& ssl_ctx);
 #endif
-    virtual ~Session() = default;
+    virtual ~Session();
 
     Session(const Session&) = delete;
     Session& operator=(const Session&) = delete;
 
     virtual void start();
     virtual void stop();
+    // Stops once every reply queued so far has been written; further input
+    // is ignored. Use this after a protocol-level goodbye.
+    void close_after_flush();
+    // stop() for callers off the session's strand, e.g. a server stopping
+    // on a reactor that keeps running; `done` runs on the strand after it.
+    void stop_async(std::function<void()> done);
+
+    // Invoked once when the session stops, e.g. to unregister it.
+    void set_close_handler(std::function<void()> handler) { close_handler_ = std::move(handler); }
 
     void send(const std::string& data);
+    void send(std::string&& data);
+    // Queue a buffer that may be shared with other sessions; it is kept
+    // alive until the write completes and never copied.
+    void send(std::shared_ptr<const std::string> data);
     void send_line(const std::string& line);
+    void send_line(std::string&& line);
+
+    // Rewrites a streamed file into its wire form, one chunk at a time and
+    // in file order; `last` is set on the final call, which may have an
+    // empty chunk. Used for transformations such as POP3 dot-stuffing.
+    using StreamFilter = std::function<void(std::string_view chunk, bool last, std::string& out)>;
+    static constexpr uint64_t to_end = UINT64_MAX;
+
+    // Streams [offset, offset + length) of a file after everything queued
+    // so far, holding at most one chunk in memory. Unfiltered files on
+    // plain sockets go out with sendfile(); TLS sessions, filtered and
+    // compressed files are read in max_write_batch-sized chunks.
+    void send_file(OutboundFile file, uint64_t offset = 0, uint64_t length = to_end,
+                   StreamFilter filter = {});
+    bool send_file(const std::filesystem::path& path, uint64_t offset = 0,
+                   uint64_t length = to_end, StreamFilter filter = {});
+
+    // Output backpressure. Once the queued bytes reach the high watermark
+    // the session stops reading and handing lines to the protocol until
+    // the queue drains to the low watermark, then calls on_write_drained().
+    // Handlers producing a long response can check write_backlogged() and
+    // continue from on_write_drained().
+    void set_write_watermarks(std::size_t high, std::size_t low) {
+        write_high_watermark_ = high;
+        write_low_watermark_ = low;
+    }
+    bool write_backlogged() const { return queued_bytes_ >= write_high_watermark_; }
+
+    // Memory accounting. `object_size` is the size of the concrete session
+    // object, which only the creator knows. The budget is charged right
+    // away and released when the session is destroyed.
+    void set_memory_budget(std::shared_ptr<MemoryBudget> budget, std::size_t object_size);
+    MemoryFootprint footprint() const;
 
     bool is_tls() const { return is_tls_; }
+
+    // Stream compression, e.g. after IMAP COMPRESS DEFLATE: from here on
+    // `codec` sits between the socket (TLS included) and the buffers. Input
+    // after the line being handled is decoded; output is encoded once
+    // everything queued so far, normally the reply announcing the switch,
+    // has been written. Call on the strand; there is no going back.
+    void start_compression(std::unique_ptr<StreamCodec> codec);
+    bool compressing() const { return codec_ != nullptr; }
+    // nullptr until start_compression().
+    const StreamCodec* codec() const { return codec_.get(); }
     std::string remote_address() const;
     uint16_t remote_port() const;
 
+    // Idle timeout, enforced with one-second granularity by the
+    // io_context's TimingWheel. A zero timeout disables it.
     void set_timeout(std::chrono::seconds timeout);
+    std::chrono::seconds timeout() const {
+        return std::chrono::seconds(timeout_.load(std::memory_order_relaxed));
+    }
     void reset_timeout();
 
+    // Upper bound on the bytes handed to a single gather write. A single
+    // queued buffer larger than the cap is still written in one go.
+    void set_max_write_batch(std::size_t bytes) { max_write_batch_ = bytes; }
+
+    // Longest line accepted before the connection is dropped.
+    void set_max_line_length(std::size_t bytes) { max_line_length_ = bytes; }
+    std::size_t max_line_length() const { return max_line_length_; }
+
     bool is_authenticated() const { return authenticated_; }
     const std::string& username() const { return username_; }
     const std::string& domain() const { return domain_; }
@@ -66,26 +191,137 @@ public:
 protected:
     virtual void on_connect();
     virtual void on_data(const std::string& data) = 0;
+    // Receives every complete line from one socket read. The views point
+    // into the read buffer and are only valid for the duration of the call;
+    // overrides must stop consuming once accepting_lines() turns false and
+    // return how many lines they consumed. Lines left over because of
+    // write backpressure are offered again once the queue drains. The
+    // default forwards each line to on_line().
+    virtual std::size_t on_lines(std::span<const std::string_view> lines);
     virtual void on_line(const std::string& line);
+    // Hands the next `count` bytes of input to on_bytes() as they arrive,
+    // without looking for lines in them; for length-prefixed data such as
+    // IMAP literals. Called from on_lines(), which then stops and counts
+    // the line announcing the bytes as consumed. Callback sessions only.
+    void read_bytes(std::size_t count);
+    // A piece of the bytes asked for; `last` on the piece completing them.
+    virtual void on_bytes(std::string_view /* bytes */, bool /* last */) {}
+    // Hands input to on_stream() as it arrives, without looking for lines,
+    // until on_stream() calls end_stream(); for data that ends where its
+    // content says, such as an SMTP DATA body. Called from on_lines() like
+    // read_bytes().
+    void read_stream() { streaming_ = true; }
+    void end_stream() { streaming_ = false; }
+    // Stops handing out input while a command completes elsewhere, such as
+    // a login being verified on another thread; what was read is kept, and
+    // resume_input() carries on with it. Callback sessions only.
+    void suspend_input() { input_suspended_ = true; }
+    void resume_input();
+    // `fn` as a completion for work on other threads: posted to the strand,
+    // keeping the session and the io_context alive until then, and skipped
+    // if the session stopped meanwhile.
+    template<typename Fn>
+    auto on_strand(Fn fn) {
+        return [this, self = shared_from_this(), work = asio::make_work_guard(strand_),
+                fn = std::move(fn)](auto... args) {
+            asio::post(strand_, [this, self, fn, args...]() mutable {
+                if (!stopped_) {
+                    fn(args...);
+                }
+            });
+        };
+    }
+    // A piece of the stream. Returns how much of it was taken: all of it,
+    // unless the stream ended inside it; the rest is read as lines again.
+    virtual std::size_t on_stream(std::string_view bytes) { return bytes.size(); }
     virtual void on_disconnect();
     virtual void on_error(const boost::system::error_code& ec);
     virtual void on_tls_handshake_complete();
+    // The write queue fell back to the low watermark after backing up.
+    virtual void on_write_drained() {}
 
-    void do_read();
+    // Bytes held by protocol state such as message caches; kept current by
+    // the subclass, which calls update_footprint() when it changes.
+    virtual std::size_t messages_footprint() const { return 0; }
+    // Re-charges the memory budget after the footprint changed.
+    void update_footprint();
+
+    // Resumes reading input: the callback read loop here, or waking the
+    // reader coroutine in CoroSession. Called on start, after a TLS
+    // handshake and when write backpressure clears.
+    virtual void do_read();
     void do_write();
+    // Makes room for at least one more read at read_buffer_[read_end_].
+    void prepare_read_buffer();
+    // Where the next socket read goes, and taking in what it got: straight
+    // into read_buffer_, or through the codec. take_read() returns false
+    // if the input cannot be decoded.
+    asio::mutable_buffer read_target();
+    bool take_read(std::size_t bytes);
+    // Applies a pending start_compression() to the input: whatever is
+    // buffered from read_begin_ on was compressed already. False if it
+    // cannot be decoded.
+    bool switch_input();
+    // Called with no read in flight. Frees a read buffer that grew past its
+    // initial size once it holds no pending input, and under memory
+    // pressure frees it entirely on plain sockets; then returns true and
+    // the caller should wait for the socket to become readable before
+    // reading into a new buffer. TLS sessions always keep a buffer, since
+    // decrypted input may be pending inside the stream.
+    bool trim_read_buffer();
 
     void close_socket();
 
+    // False once the session stopped or a STARTTLS upgrade is pending; lines
+    // that arrived in the same read after STARTTLS are discarded. Also false
+    // while output is backlogged; those lines are kept for later.
+    bool accepting_lines() const {
+        return !stopped_ && !tls_handshake_pending_ && !close_after_flush_ &&
+               !input_switch_pending_ && bytes_wanted_ == 0 && !streaming_ &&
+               !input_suspended_ && !write_backlogged();
+    }
+
     asio::io_context& io_context_;
+    // Serialises socket completions, timer callbacks and cross-thread
+    // send() calls when the io_context runs on several threads.
+    asio::strand<asio::io_context::executor_type> strand_;
     Socket socket_;
     bool is_tls_ = false;
+    bool tls_handshake_pending_ = false;
+    // Set by start_compression() until switch_input() runs.
+    bool input_switch_pending_ = false;
 
-    asio::streambuf read_buffer_;
-    std::deque<std::string> write_queue_;
+    // The unsent part of a send_file() entry.
+    struct FileTransfer {
+        OutboundFile file;
+        uint64_t offset;
+        uint64_t remaining;
+        StreamFilter filter;
+    };
+
+    // A queued chunk of outgoing data: owned by the queue, a reference to a
+    // shared payload, or a file range streamed in chunks.
+    struct OutboundBuffer {
+        std::string owned;
+        std::shared_ptr<const std::string> shared;
+        std::unique_ptr<FileTransfer> file;
+
+        asio::const_buffer buffer() const {
+            return shared ? asio::buffer(*shared) : asio::buffer(owned);
+        }
+        std::size_t size() const {
+            return file ? static_cast<std::size_t>(file->remaining) : buffer().size();
+        }
+    };
+
+    // Flat receive buffer; unconsumed bytes live in [read_begin_, read_end_).
+    std::vector<char> read_buffer_;
+    std::size_t read_begin_ = 0;
+    std::size_t read_end_ = 0;
+    std::deque<OutboundBuffer> write_queue_;
     bool writing_ = false;
 
-    asio::steady_timer timeout_timer_;
-    std::chrono::seconds timeout_{300};
+    std::atomic<int64_t> timeout_{300};  // seconds
 
     bool authenticated_ = false;
     std::string username_;
@@ -94,11 +330,85 @@ protected:
     bool stopped_ = false;
 
 private:
+    friend class TimingWheel;
+
+    std::shared_ptr<MemoryBudget> memory_budget_;
+    std::size_t object_size_ = 0;
+    // Bytes currently charged to memory_budget_, a multiple of the page.
+    std::size_t charged_ = 0;
+
+    // Read by the timing wheel from whichever thread runs its tick.
+    TimingWheel::Clock::time_point idle_deadline() const;
+    void schedule_idle_check();
+    void handle_idle_timeout();
+
+    std::atomic<TimingWheel::Clock::rep> last_activity_{0};
+    std::atomic<uint64_t> idle_generation_{0};
+    bool idle_registered_ = false;
+
+    std::function<void()> close_handler_;
+    bool close_after_flush_ = false;
+
     void handle_read(const boost::system::error_code& ec, std::size_t bytes_transferred);
+    void start_read();
     void handle_write(const boost::system::error_code& ec, std::size_t bytes_transferred);
-    void handle_timeout(const boost::system::error_code& ec);
+    void continue_writing();
+    void write_file();
+    bool sendfile_chunk(FileTransfer& transfer);
+    void read_file_chunk(FileTransfer& transfer);
+    void account_written(std::size_t bytes);
+    void enqueue(OutboundBuffer buffer);
+    bool prepare_write_batch();
+    // Entries left the front of write_queue_.
+    void finish_entries(std::size_t count);
+    void process_read_buffer();
+    void consume_read_buffer();
+
+    // Buffers of the write currently in flight; they reference the first
+    // write_batch_count_ entries of write_queue_.
+    std::vector<asio::const_buffer> write_batch_;
+    std::size_t write_batch_count_ = 0;
+    std::size_t write_batch_bytes_ = 0;  // Before encoding
+    std::size_t max_write_batch_ = 64 * 1024;
+
+    // Bytes queued but not yet written, files counted by remaining length.
+    std::size_t queued_bytes_ = 0;
+    // Capacity of the owned buffers in write_queue_.
+    std::size_t queued_memory_ = 0;
+    std::size_t write_high_watermark_ = 1024 * 1024;
+    std::size_t write_low_watermark_ = 256 * 1024;
+    bool backlogged_ = false;
+    bool read_paused_ = false;
+    // Chunk of a file being written through TLS or a filter.
+    std::string file_chunk_;
+    std::string file_filtered_;
+
+    std::unique_ptr<StreamCodec> codec_;
+    bool decoding_ = false;
+    bool encoding_ = false;
+    // Entries at the front of write_queue_ that were queued before
+    // start_compression() and go out as they are.
+    std::size_t plain_ahead_ = 0;
+    std::vector<char> wire_in_;  // Input as read, while decoding
+    std::string wire_out_;       // Encoded output being written
+
+    std::vector<std::string_view> line_batch_;
+    // Left of a read_bytes() request.
+    std::size_t bytes_wanted_ = 0;
+    bool streaming_ = false;  // Between read_stream() and end_stream()
+    bool input_suspended_ = false;
+    // Set while input is handed out; replies queue without being written.
+    bool corked_ = false;
+    // Bytes at the front of the pending partial line already scanned.
+    std::size_t scanned_ = 0;
+    std::size_t max_line_length_ = 1024 * 1024;
 
 #ifdef ENABLE_TLS
+    void begin_tls_handshake(ssl::context& ssl_ctx);
+
+    // Set when STARTTLS was requested while replies were still queued.
+    ssl::context* pending_tls_context_ = nullptr;
+
     template<typename SocketType>
     void do_read_impl(SocketType& socket);
 
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace email {
+
+// Live sessions of one Server, spread over independently locked shards so
+// accepts and disconnects on different threads rarely meet on a mutex. The
+// live count is a single atomic, so the connection limit check is lock-free.
+template<typename SessionType>
+class SessionRegistry {
+public:
+    explicit SessionRegistry(size_t shard_count = 16)
+        : shards_(shard_count == 0 ? 1 : shard_count) {}
+
+    SessionRegistry(const SessionRegistry&) = delete;
+    SessionRegistry& operator=(const SessionRegistry&) = delete;
+
+    // Reserves a connection slot if fewer than `limit` are in use. A
+    // successful reservation must be followed by add() or release().
+    bool try_reserve(size_t limit) {
+        size_t current = count_.load(std::memory_order_relaxed);
+        do {
+            if (current >= limit) return false;
+        } while (!count_.compare_exchange_weak(current, current + 1,
+                                               std::memory_order_relaxed));
+        return true;
+    }
+
+    void release() { count_.fetch_sub(1, std::memory_order_relaxed); }
+
+    // Adds a session whose slot was reserved with try_reserve().
+    void add(std::shared_ptr<SessionType> session) {
+        auto& shard = shard_for(session.get());
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.sessions.emplace(session.get(), std::move(session));
+    }
+
+    // Removes a session and frees its slot. Returns the removed session, or
+    // nullptr if it was not registered (e.g. already removed by clear()).
+    std::shared_ptr<SessionType> remove(const SessionType* session) {
+        std::shared_ptr<SessionType> removed;
+        {
+            auto& shard = shard_for(session);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto it = shard.sessions.find(session);
+            if (it == shard.sessions.end()) return nullptr;
+            removed = std::move(it->second);
+            shard.sessions.erase(it);
+        }
+        release();
+        return removed;
+    }
+
+    size_t size() const { return count_.load(std::memory_order_relaxed); }
+
+    // Calls fn for every registered session. Each shard is copied under its
+    // lock and visited without it, so fn may stop sessions (which removes
+    // them from the registry).
+    void for_each(const std::function<void(const std::shared_ptr<SessionType>&)>& fn) {
+        std::vector<std::shared_ptr<SessionType>> batch;
+        for (auto& shard : shards_) {
+            batch.clear();
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                batch.reserve(shard.sessions.size());
+                for (auto& [key, session] : shard.sessions) {
+                    batch.push_back(session);
+                }
+            }
+            for (auto& session : batch) {
+                fn(session);
+            }
+        }
+    }
+
+    // Drops every session, returning them so the caller can stop them.
+    std::vector<std::shared_ptr<SessionType>> clear() {
+        std::vector<std::shared_ptr<SessionType>> all;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto& [key, session] : shard.sessions) {
+                all.push_back(std::move(session));
+            }
+            count_.fetch_sub(shard.sessions.size(), std::memory_order_relaxed);
+            shard.sessions.clear();
+        }
+        return all;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<const SessionType*, std::shared_ptr<SessionType>> sessions;
+    };
+
+    Shard& shard_for(const SessionType* session) {
+        // Sessions are heap objects; drop the alignment bits before mixing.
+        auto key = reinterpret_cast<std::uintptr_t>(session) >> 4;
+        key ^= key >> 17;
+        key *= 0x9e3779b97f4a7c15ULL;
+        return shards_[(key >> 32) % shards_.size()];
+    }
+
+    std::vector<Shard> shards_;
+    std::atomic<size_t> count_{0};
+};
+
+}  // namespace email
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace email {
+
+// Byte counts on either side of a codec: plain is what the protocol reads
+// and writes, wire what crosses the socket (inside TLS, if any).
+struct StreamStats {
+    uint64_t plain_in = 0;
+    uint64_t wire_in = 0;
+    uint64_t plain_out = 0;
+    uint64_t wire_out = 0;
+};
+
+// A transformation of a session's byte stream, applied between the socket
+// and the read buffer and write queue; see Session::start_compression().
+class StreamCodec {
+public:
+    virtual ~StreamCodec() = default;
+
+    // Decodes bytes off the wire into out[end...], growing `out` as needed
+    // and advancing `end`. False if the stream is corrupt.
+    virtual bool decode(std::string_view in, std::vector<char>& out, std::size_t& end) = 0;
+    // Encodes bytes to be written, appending to `out`. With `flush` the peer
+    // can decode everything encoded so far, as it must at the end of each
+    // write.
+    virtual bool encode(std::string_view in, std::string& out, bool flush) = 0;
+    // Heap held by the codec's state.
+    virtual std::size_t memory() const = 0;
+
+    const StreamStats& stats() const { return stats_; }
+
+protected:
+    StreamStats stats_;
+};
+
+// Raw DEFLATE (RFC 1951) both ways, as IMAP COMPRESS=DEFLATE (RFC 4978)
+// has it. The window and memLevel bound what compressing costs a
+// connection, about 2^(window_bits + 2) + 2^(mem_level + 9) bytes;
+// inflating always keeps a full 32 KiB window, since the peer picks its
+// own. Needs a build with ENABLE_DEFLATE.
+class DeflateCodec : public StreamCodec {
+public:
+    struct Options {
+        int level = 6;        // 1 (fast) to 9 (small)
+        int window_bits = 12; // 9 to 15
+        int mem_level = 5;    // 1 to 9
+    };
+
+    static bool available();
+    // nullptr if unavailable or zlib refuses the options.
+    static std::unique_ptr<DeflateCodec> create(const Options& options);
+    // Every connection's bytes so far, process-wide.
+    static StreamStats totals();
+
+    ~DeflateCodec() override;
+
+    bool decode(std::string_view in, std::vector<char>& out, std::size_t& end) override;
+    bool encode(std::string_view in, std::string& out, bool flush) override;
+    std::size_t memory() const override { return memory_; }
+
+private:
+    struct Streams;
+
+    DeflateCodec(std::unique_ptr<Streams> streams, std::size_t memory);
+
+    std::unique_ptr<Streams> streams_;
+    std::size_t memory_;
+};
+
+}  // namespace email
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <boost/asio.hpp>
+
+namespace email {
+
+namespace asio = boost::asio;
+
+class Session;
+
+// Idle-timeout bookkeeping for every session of one io_context, with one
+// second granularity. Sessions only record their last activity; a single
+// periodic tick walks the slot that is due and either expires a session or
+// re-files it under its current deadline. Each session therefore costs one
+// wheel operation per timeout period rather than a timer re-arm per command.
+//
+// The wheel is an asio service: TimingWheel::get(io_context) returns the
+// instance owned by that context.
+class TimingWheel : public asio::io_context::service {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static asio::io_context::id id;
+
+    explicit TimingWheel(asio::io_context& io_context);
+    ~TimingWheel() override = default;
+
+    static TimingWheel& get(asio::io_context& io_context) {
+        return asio::use_service<TimingWheel>(io_context);
+    }
+
+    // Files `session` under `deadline`. `generation` must match the
+    // session's current generation when the entry comes due, otherwise the
+    // entry is dropped; that is how rescheduling replaces older entries.
+    void schedule(std::weak_ptr<Session> session, Clock::time_point deadline, uint64_t generation);
+
+    // The tick: walks every slot up to `now` and returns the sessions whose
+    // idle deadline has passed, re-filing the others. on_tick() calls it
+    // with the current time and then times those sessions out.
+    std::vector<std::shared_ptr<Session>> advance(Clock::time_point now);
+
+    // Tick 0; tick n ends n seconds after it.
+    Clock::time_point epoch() const { return epoch_; }
+    size_t size() const;
+
+private:
+    static constexpr size_t level0_bits = 8;   // 256 one-second slots
+    static constexpr size_t level_bits = 6;    // 64 slots per upper level
+    static constexpr size_t levels = 3;        // ~12 days of range
+
+    struct Entry {
+        std::weak_ptr<Session> session;
+        uint64_t generation;
+        uint64_t tick = 0;  // tick the entry is filed under
+    };
+    using Slot = std::vector<Entry>;
+
+    void shutdown() override;
+
+    uint64_t to_tick(Clock::time_point time) const;
+    void insert(Entry entry, uint64_t tick);
+    void start_timer();
+    void on_tick(const boost::system::error_code& ec);
+    void advance_locked(Clock::time_point now, std::vector<std::shared_ptr<Session>>& expired);
+    void cascade(size_t level);
+
+    asio::steady_timer timer_;
+    Clock::time_point epoch_;
+    uint64_t current_tick_ = 0;
+    bool timer_running_ = false;
+    bool shut_down_ = false;
+    size_t entries_ = 0;
+
+    std::array<Slot, size_t{1} << level0_bits> level0_;
+    std::array<std::array<Slot, size_t{1} << level_bits>, levels - 1> upper_;
+
+    mutable std::mutex mutex_;
+};
+
+}  // namespace email
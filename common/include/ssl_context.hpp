@@ -4,6 +4,8 @@
 #include <string>
 #include <filesystem>
 #include <functional>
+#include <chrono>
+#include <cstdint>
 
 #ifdef ENABLE_TLS
 #include <boost/asio/ssl.hpp>
@@ -11,10 +13,24 @@
 
 namespace email {
 
+struct TLSConfig;
+
 #ifdef ENABLE_TLS
 namespace ssl = boost::asio::ssl;
 #endif
 
+// Handshake counters for one SSLContext. CPU time is sampled on the
+// handshaking thread between OpenSSL state transitions, so it covers the
+// cryptographic work but not the time spent waiting for the peer.
+struct TLSStats {
+    uint64_t full_handshakes = 0;
+    uint64_t resumed_handshakes = 0;
+    uint64_t failed_handshakes = 0;
+    uint64_t handshake_cpu_ns = 0;
+    uint64_t ktls_connections = 0;
+    uint64_t ticket_key_rotations = 0;
+};
+
 class SSLContext {
 public:
     enum class Mode {
@@ -47,6 +63,24 @@ public:
     void set_ciphers(const std::string& cipher_list);
     void set_password_callback(std::function<std::string()> callback);
 
+    // Server-side resumption: a shared session cache for session IDs plus
+    // stateless tickets protected by in-memory keys. The current key is
+    // rotated every ticket_key_lifetime; the previous one is still accepted
+    // (and the ticket renewed) for one more lifetime.
+    bool enable_session_resumption(size_t cache_size,
+                                   std::chrono::seconds session_timeout,
+                                   std::chrono::seconds ticket_key_lifetime);
+
+    // Requests kernel TLS (SSL_OP_ENABLE_KTLS). OpenSSL only engages it on
+    // socket BIOs with a kTLS-capable kernel; connections where it took
+    // effect are counted in TLSStats::ktls_connections. Returns false if
+    // this OpenSSL build has no kTLS support.
+    bool enable_ktls();
+
+    TLSStats stats() const;
+    // Logs stats() as `protocol`'s handshakes, e.g. at shutdown.
+    void log_stats(const std::string& protocol) const;
+
     bool is_initialized() const { return initialized_; }
     std::string last_error() const { return last_error_; }
 
@@ -61,13 +95,24 @@ public:
         const std::filesystem::path& ca_file = "",
         const std::string& ciphers = "");
 
+    // A server context as the [tls] section describes it: certificate,
+    // ciphers, session resumption and, if asked for, kernel TLS. Failures
+    // are logged; check is_initialized().
+    static SSLContext create_server_context(const TLSConfig& config);
+
     static SSLContext create_client_context(
         const std::filesystem::path& ca_file = "",
         bool verify_server = true);
 
+    // Resumption keys and handshake counters; opaque outside ssl_context.cpp.
+    struct TLSState;
+
 private:
     void set_error(const std::string& msg);
+    void install_callbacks();
 
+    // Declared before context_ so the SSL_CTX referencing it goes first.
+    std::unique_ptr<TLSState> state_;
 #ifdef ENABLE_TLS
     std::unique_ptr<ssl::context> context_;
 #endif
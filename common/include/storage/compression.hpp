@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+namespace email {
+
+// zstd at rest. A compressed message file is a single zstd frame holding
+// the message; it is told apart by the frame's magic number, which no
+// RFC 5322 message can start with, so the file keeps its name (and with it
+// its unique_id and UID) when it is compressed. The frame header records
+// the logical size, so a message's size is known from its first bytes.
+//
+// Without ENABLE_COMPRESSION nothing is compressed and compressed files
+// are recognised but cannot be read.
+namespace compression {
+
+// Enough of a file's start for is_compressed() and content_size().
+inline constexpr std::size_t header_size = 18;
+
+bool available();
+bool is_compressed(std::string_view prefix);
+// The logical size from a compressed file's first bytes; nullopt if the
+// frame does not record it.
+std::optional<uint64_t> content_size(std::string_view prefix);
+
+// nullopt if compression is unavailable or fails.
+std::optional<std::string> compress(std::string_view data, int level);
+std::optional<std::string> decompress(std::string_view data);
+
+// Streams a compressed file's contents. Reads are expected in order, as
+// sending does; reading behind the current position starts over.
+class Reader {
+public:
+    // nullopt if `fd` does not hold a compressed message that can be read
+    // here. The descriptor stays the caller's.
+    static std::unique_ptr<Reader> open(int fd);
+    ~Reader();
+
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+
+    uint64_t size() const { return size_; }
+    // Like pread() on the logical contents.
+    ssize_t read(uint64_t offset, char* buffer, std::size_t length);
+
+private:
+    Reader(int fd, uint64_t size);
+    bool restart();
+
+    int fd_;
+    uint64_t size_;
+    void* stream_ = nullptr;   // ZSTD_DStream
+    std::string input_;
+    std::size_t input_pos_ = 0;
+    uint64_t file_offset_ = 0;  // Compressed bytes read so far
+    uint64_t position_ = 0;     // Logical bytes produced so far
+    bool finished_ = false;
+};
+
+}  // namespace compression
+
+}  // namespace email
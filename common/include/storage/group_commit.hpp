@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace email {
+
+// Makes new directory entries durable for many writers at once. A delivery
+// is only safe once both its file and the directory it was renamed into
+// are on disk; the file's fsync() is the writer's own, but the directory's
+// can be shared. Writers hand the directory to a committer thread and
+// wait: whoever arrives while a batch is being synced joins the next one,
+// so a burst of deliveries into a mailbox costs one directory fsync() per
+// batch rather than one per message.
+class GroupCommit {
+public:
+    static GroupCommit& instance();
+
+    GroupCommit();
+    ~GroupCommit();
+
+    GroupCommit(const GroupCommit&) = delete;
+    GroupCommit& operator=(const GroupCommit&) = delete;
+
+    // Returns once an fsync() of `dir` that began after this call has
+    // completed; false if it failed.
+    bool sync_directory(const std::filesystem::path& dir);
+
+    // Directory fsync()s issued and the requests they covered.
+    uint64_t syncs() const;
+    uint64_t requests() const;
+
+private:
+    void run();
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_;
+    std::condition_variable done_;
+
+    std::unordered_set<std::string> pending_;
+    uint64_t open_batch_ = 1;       // The batch new requests join
+    uint64_t completed_batch_ = 0;  // The last batch fully synced
+    // Directory -> the last batch whose fsync() of it failed.
+    std::unordered_map<std::string, uint64_t> failed_;
+
+    uint64_t syncs_ = 0;
+    uint64_t requests_ = 0;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+}  // namespace email
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace email {
+
+// Tells whoever waits on a mailbox in this process that it changed, so IMAP
+// IDLE can push updates instead of clients polling. A mailbox is keyed by
+// its directory, which names both the user and the mailbox. Notifications
+// carry no details: a subscriber looks for itself through its Maildir's
+// watcher, which also sees what other processes did.
+//
+// Subscribers are spread over independently locked shards by key, so a
+// burst of deliveries to different mailboxes rarely meets on a mutex, and
+// a subscription costs its shard one pointer. While nobody in the process
+// subscribes, publishing is a single atomic load.
+class MailboxEvents {
+public:
+    // Subscribed while it lives; destroying it unsubscribes, after any
+    // notification of it in progress.
+    class Subscription {
+    public:
+        ~Subscription();
+
+        Subscription(const Subscription&) = delete;
+        Subscription& operator=(const Subscription&) = delete;
+
+    private:
+        friend class MailboxEvents;
+        Subscription(MailboxEvents& events, std::string key, std::function<void()> notify)
+            : events_(events), key_(std::move(key)), notify_(std::move(notify)) {}
+
+        MailboxEvents& events_;
+        std::string key_;
+        std::function<void()> notify_;
+    };
+
+    static MailboxEvents& instance();
+
+    explicit MailboxEvents(size_t shard_count = 64)
+        : shards_(shard_count == 0 ? 1 : shard_count) {}
+
+    MailboxEvents(const MailboxEvents&) = delete;
+    MailboxEvents& operator=(const MailboxEvents&) = delete;
+
+    // `notify` runs on the publishing thread with the shard locked, so it
+    // should only pass the news on (e.g. post to the subscriber's strand)
+    // and must not subscribe or unsubscribe.
+    std::unique_ptr<Subscription> subscribe(std::string key, std::function<void()> notify);
+    void publish(const std::string& key);
+
+    size_t subscribers() const { return count_.load(std::memory_order_relaxed); }
+
+private:
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::vector<Subscription*>> subscribers;
+    };
+
+    Shard& shard_for(const std::string& key) {
+        return shards_[std::hash<std::string>{}(key) % shards_.size()];
+    }
+    void unsubscribe(Subscription* subscription);
+
+    std::vector<Shard> shards_;
+    std::atomic<size_t> count_{0};
+};
+
+}  // namespace email
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "storage/record_log.hpp"
+#include "storage/uid_list.hpp"
+
+namespace email {
+
+// One message as recorded in a MailboxIndex. `filename` points into the
+// mapped index and is only valid until the index is next touched.
+struct IndexEntry {
+    std::string_view filename;  // Name in cur/ or new/, including any :2, info
+    bool in_new = false;
+    uint64_t size = 0;
+    int64_t internal_date = 0;  // Seconds since the epoch (file mtime)
+    uint64_t flags = 0;         // MailboxIndex::flag_bit() per maildir flag
+    uint32_t uid = 0;
+    uint32_t body_offset = 0;   // Bytes before the body; 0 if not known yet
+    uint64_t modseq = 0;        // Last change, as CONDSTORE numbers them
+
+    std::string_view unique_id() const { return filename.substr(0, filename.find(':')); }
+};
+
+// Persistent, memory-mapped listing of one Maildir mailbox, kept in the
+// mailbox directory as `email.index`. Fixed-size records (size, date, flag
+// bits, UID, where the body starts and the offset of the file name) follow
+// a small header and are in turn followed by a heap of file names, so
+// listing a mailbox is a walk over a mapping instead of a stat() per
+// message.
+//
+// The header remembers the mtimes of cur/ and new/ from the last sync, and
+// the total size of the live messages so usage is read, not summed. An
+// index whose mtimes still match is served as is; otherwise the directories
+// are re-read and only names the index does not know yet are stat()ed.
+// Maildir applies its own deliveries, renames and deletions in place, so a
+// sync after them finds nothing to add. A missing or damaged index is
+// rebuilt from scratch, and compaction rewrites it through a temporary file
+// and rename().
+//
+// UIDs come from the mailbox's UidList, which outlives the index: a rebuilt
+// index gets the same UIDs back, and a lost list is recovered from the
+// index with its UIDVALIDITY intact. Only when both are gone does the
+// mailbox start over under a new UIDVALIDITY.
+//
+// Every record carries the mod-sequence of its last change, taken from a
+// counter in the header that arrivals and renames bump. Removals are
+// logged beside the index in `email.vanished`, one RecordLog record per
+// removal keyed by its mod-sequence, so clients can be told which UIDs
+// went away since they last looked. The log is cut back when it grows;
+// the header remembers how far it still reaches. A rebuilt index starts
+// its counter from the clock, above anything handed out before.
+//
+// Processes share the file under flock(): readers hold a shared lock while
+// they walk the mapping, writers an exclusive one, which also covers the
+// UID list. Methods return false when the index cannot be used; callers
+// then scan the directories themselves.
+class MailboxIndex {
+public:
+    static constexpr const char* file_name = "email.index";
+
+    explicit MailboxIndex(std::filesystem::path mailbox_path);
+    ~MailboxIndex();
+
+    MailboxIndex(const MailboxIndex&) = delete;
+    MailboxIndex& operator=(const MailboxIndex&) = delete;
+
+    // Brings the index up to date (creating it if needed) and calls fn for
+    // every message, in index order.
+    bool for_each(const std::function<void(const IndexEntry&)>& fn);
+    // Brings the index up to date like for_each() and reports how many
+    // messages the mailbox holds and their total size, from the header.
+    bool totals(uint64_t& messages, uint64_t& bytes);
+
+    // In-place maintenance after Maildir changed a file. These never create
+    // an index; a mailbox nobody has listed yet is left alone.
+    bool add(std::string_view filename, bool in_new, uint64_t size, int64_t internal_date,
+             uint32_t body_offset = 0);
+
+    struct Addition {
+        std::string_view filename;
+        bool in_new = false;
+        uint64_t size = 0;
+        int64_t internal_date = 0;
+        uint32_t body_offset = 0;
+    };
+    // Several additions under one lock, one UID list flush and one header
+    // write. Each message may appear only once.
+    bool add_all(std::span<const Addition> additions);
+    bool rename(std::string_view unique_id, std::string_view filename, bool in_new);
+    bool remove(std::string_view unique_id);
+    // Several removals under one lock, one UID list flush, one vanished
+    // entry and one header write. Each message may appear only once.
+    bool remove_all(std::span<const std::string> unique_ids);
+    // Caches where the message's body starts, for header-only reads.
+    bool set_body_offset(std::string_view unique_id, uint32_t body_offset);
+    // The message's UID, or 0 if the index does not know it.
+    uint32_t uid_of(std::string_view unique_id);
+
+    struct Rename {
+        std::string_view unique_id;
+        std::string_view filename;
+        bool in_new = false;
+    };
+    // Several renames under one lock and one header write. Each message may
+    // appear only once.
+    bool rename_all(std::span<const Rename> renames);
+
+    // Bit for one maildir flag letter; 0 for characters that are not flags.
+    static constexpr uint64_t flag_bit(char flag) {
+        return flag >= 'A' && flag <= 'z' ? uint64_t{1} << (flag - 'A') : 0;
+    }
+    static uint64_t flags_from_filename(std::string_view filename);
+
+    // The mod-sequence of each message, 0 for those the index does not know.
+    bool modseqs(std::span<const std::string> unique_ids, std::vector<uint64_t>& out);
+    // UIDs removed after `modseq`, ascending. False when the log no longer
+    // reaches back that far, or there is no index.
+    bool vanished_since(uint64_t modseq, std::vector<uint32_t>& uids);
+
+    // UIDVALIDITY, UIDNEXT and HIGHESTMODSEQ as of the last successful
+    // for_each() or totals().
+    uint32_t uid_validity() const { return uid_validity_; }
+    uint32_t uid_next() const { return uid_next_; }
+    uint64_t highest_modseq() const { return highest_modseq_; }
+    // Counts the changes HIGHESTMODSEQ leaves out, such as a move from new/
+    // to cur/ under the same name or a body offset being recorded; with
+    // the others it tells whether a listing is still current.
+    uint32_t changes() const { return changes_; }
+
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    struct Header;
+    struct Record;
+    struct Candidate;
+
+    // Opens the index (creating it if asked), takes the flock and maps it,
+    // reopening if another process replaced the file meanwhile. Returns
+    // false with last_error_ empty when the index simply does not exist.
+    bool lock(int operation, bool create);
+    // Takes a shared lock on the index after syncing it if the directories
+    // moved on. Also refreshes uid_validity_ and uid_next_.
+    bool lock_current();
+    static std::size_t heap_offset(uint32_t capacity);
+    void unlock();
+    void close();
+    bool map();
+
+    bool header_valid() const;
+    bool up_to_date(int64_t cur_mtime, int64_t new_mtime) const;
+    bool sync(int64_t cur_mtime, int64_t new_mtime);
+    bool rewrite(std::vector<Candidate> entries, int64_t cur_mtime, int64_t new_mtime,
+                 int64_t synced_at, uint64_t highest_modseq, uint64_t vanished_floor);
+    // Loads the UID list, recovering or starting it if there is none.
+    bool load_uids();
+    uint32_t fresh_uid_validity() const;
+    std::vector<Candidate> live_candidates() const;
+
+    // Writers; the exclusive lock is held and the header is valid.
+    bool append_records(std::span<const Addition> additions);
+    bool update_record(uint32_t index, std::string_view filename, bool in_new);
+    // Writes the record's new name and state; the caller writes `header`.
+    bool stage_update(uint32_t index, std::string_view filename, bool in_new, Header& header);
+    bool remove_records(std::span<const uint32_t> indexes);
+    // Logs `uids` as removed under a new mod-sequence, trimming the log
+    // (and raising the floor) when it has grown long.
+    bool log_vanished(std::span<const uint32_t> uids, uint64_t& highest_modseq,
+                      uint64_t& vanished_floor);
+    // One email.vanished record: its key and space-separated UIDs.
+    void take_vanished(std::string_view modseq, std::string_view uids);
+    bool compact_if_sparse();
+    bool write_header(const Header& header);
+    std::optional<uint32_t> find(std::string_view unique_id);
+
+    const Header& header() const;
+    const Record& record(uint32_t index) const;
+    std::string_view name_of(const Record& record) const;
+    IndexEntry entry_of(const Record& record) const;
+
+    std::filesystem::path mailbox_path_;
+    std::filesystem::path index_path_;
+    int fd_ = -1;
+    const char* map_ = nullptr;
+    std::size_t map_size_ = 0;
+
+    // unique_id -> record number, covering the first ids_indexed_ records.
+    // Cleared when the file is replaced; entries are checked against the
+    // record before use since other processes may have removed messages.
+    std::unordered_map<std::string, uint32_t> ids_;
+    uint32_t ids_indexed_ = 0;
+
+    UidList uid_list_;
+    uint32_t uid_validity_ = 0;
+    uint32_t uid_next_ = 0;
+    uint64_t highest_modseq_ = 0;
+    uint32_t changes_ = 0;
+
+    // Removals read from email.vanished: (mod-sequence, UID), ascending.
+    std::vector<std::pair<uint64_t, uint32_t>> vanished_;
+    RecordLog vanished_log_;
+
+    std::string last_error_;
+};
+
+}  // namespace email
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace email {
+
+class MailboxIndex;
+struct Message;
+
+// One mailbox's listing as its index had it at one mod-sequence, a column
+// per attribute with row i the message of the i-th lowest UID. Never
+// changed once built, so every Maildir in the process that lists the same
+// mailbox at the same state shares one (see MailboxSnapshotCache) and
+// keeps only its own changes since.
+class MailboxSnapshot {
+public:
+    // From the index, which this brings up to date; nullptr when the
+    // index cannot be used.
+    static std::shared_ptr<const MailboxSnapshot> from_index(MailboxIndex& index);
+    // From a directory scan of a mailbox without an index, oldest first;
+    // UIDs and mod-sequences are then 0.
+    static std::shared_ptr<const MailboxSnapshot> from_messages(std::vector<Message> messages);
+
+    MailboxSnapshot(const MailboxSnapshot&) = delete;
+    MailboxSnapshot& operator=(const MailboxSnapshot&) = delete;
+
+    size_t size() const { return uids.size(); }
+    bool empty() const { return uids.empty(); }
+    // Built from the index, so with UIDs and mod-sequences.
+    bool indexed() const { return uid_validity != 0; }
+    // The row of `unique_id`, if the mailbox held it.
+    std::optional<size_t> find(std::string_view unique_id) const;
+    // Its name in cur/ or new/.
+    std::string filename(size_t row) const { return unique_ids[row] + infos[row]; }
+    // Heap held, as the cache counts it.
+    size_t footprint() const { return footprint_; }
+
+    std::vector<uint32_t> uids;
+    std::vector<std::string> unique_ids;
+    std::vector<std::string> infos;     // The rest of the file name, e.g. ":2,S"
+    std::vector<uint8_t> in_new;
+    std::vector<uint64_t> sizes;        // Logical
+    std::vector<int64_t> dates;         // Seconds since the epoch
+    std::vector<uint64_t> flags;        // MailboxIndex::flag_bit() per maildir flag
+    std::vector<uint32_t> body_offsets; // 0 where not known when listed
+    std::vector<uint64_t> modseqs;
+
+    uint32_t uid_validity = 0;
+    uint32_t uid_next = 0;
+    uint64_t highest_modseq = 0;  // 0 without an index
+    uint32_t changes = 0;         // MailboxIndex::changes()
+
+private:
+    MailboxSnapshot() = default;
+    // Builds rows_ and footprint_ once the columns are filled.
+    void finish();
+
+    std::unordered_map<std::string_view, uint32_t> rows_;  // Over unique_ids
+    size_t footprint_ = 0;
+};
+
+// The latest snapshot of each recently listed mailbox, process-wide and
+// keyed by mailbox directory, which names the domain, the user and the
+// mailbox. A snapshot is handed out again for as long as the index is at
+// the UIDVALIDITY, mod-sequence, change count and message count it was
+// built at, so N sessions on a mailbox cost one index walk and one copy of
+// its listing rather than N. Past the capacity the least recently used
+// snapshots are dropped; those still held elsewhere live on until released.
+class MailboxSnapshotCache {
+public:
+    static MailboxSnapshotCache& instance();
+
+    MailboxSnapshotCache() = default;
+    MailboxSnapshotCache(const MailboxSnapshotCache&) = delete;
+    MailboxSnapshotCache& operator=(const MailboxSnapshotCache&) = delete;
+
+    // Bytes of snapshots kept; 0 keeps none.
+    void set_capacity(size_t bytes);
+    size_t capacity() const;
+
+    // The snapshot of `key` if it shows the index as described, which
+    // makes it the most recently used.
+    std::shared_ptr<const MailboxSnapshot> find(const std::string& key, uint32_t uid_validity,
+                                                uint64_t highest_modseq, uint32_t changes,
+                                                uint64_t messages);
+    // Replaces any older snapshot of `key`.
+    void insert(const std::string& key, std::shared_ptr<const MailboxSnapshot> snapshot);
+    void erase(const std::string& key);
+    void clear();
+
+    size_t bytes() const;
+    size_t entries() const;
+
+private:
+    struct Entry {
+        std::shared_ptr<const MailboxSnapshot> snapshot;
+        std::list<std::string>::iterator recency;
+    };
+
+    void evict_locked();
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> recency_;  // Most recently used first
+    size_t bytes_ = 0;
+    size_t capacity_ = 64 * 1024 * 1024;
+};
+
+}  // namespace email
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace email {
+
+// Follows the files in one mailbox's cur/ and new/ so changes made by other
+// processes can be applied incrementally instead of by rescanning.
+//
+// On Linux this is an inotify instance watching both directories for files
+// moved or created into them and moved or deleted out of them. Where inotify
+// cannot be had (no kernel support, or the per-user watch limit is reached)
+// the watcher falls back to comparing directory listings, which it only
+// re-reads when a directory's mtime moved. fanotify is not used: it needs
+// CAP_SYS_ADMIN, which the servers do not run with.
+class MailboxWatcher {
+public:
+    // What became of one message file. A message that was renamed shows up
+    // once, under its new name; a removal names the file that went away so
+    // the caller can tell it from an older name of a message still present.
+    struct Event {
+        std::string unique_id;
+        std::string filename;  // Including any :2, info
+        bool in_new = false;
+        bool present = true;   // false: the file left cur/ or new/
+    };
+
+    explicit MailboxWatcher(std::filesystem::path mailbox_path);
+    ~MailboxWatcher();
+
+    MailboxWatcher(const MailboxWatcher&) = delete;
+    MailboxWatcher& operator=(const MailboxWatcher&) = delete;
+
+    // Appends what happened since the last call, one event per message.
+    // Returns false when events were lost (the inotify queue overflowed or
+    // a directory went away); the caller then has to rescan the mailbox,
+    // and the watcher starts over from the current state.
+    bool poll(std::vector<Event>& events);
+
+    // Readable when poll() has something to report; -1 while polling the
+    // directories, which has no descriptor to wait on.
+    int fd() const { return fd_; }
+    bool uses_inotify() const { return fd_ >= 0; }
+
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    bool start_inotify();
+    bool read_inotify(std::vector<Event>& events);
+    bool scan(std::vector<Event>& events);
+    void close();
+
+    std::filesystem::path mailbox_path_;
+    int fd_ = -1;
+    int cur_wd_ = -1;
+    int new_wd_ = -1;
+
+    // Polling fallback: the last listing of cur/ and new/ by unique_id, and
+    // the directory mtimes it was read at.
+    struct Listed {
+        std::string filename;
+        bool in_new = false;
+    };
+    std::unordered_map<std::string, Listed> listing_;
+    int64_t cur_mtime_ = -1;
+    int64_t new_mtime_ = -1;
+    int64_t scanned_at_ = 0;
+
+    std::string last_error_;
+};
+
+}  // namespace email
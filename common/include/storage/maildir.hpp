@@ -1,13 +1,29 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 #include <filesystem>
 #include <vector>
 #include <optional>
 #include <chrono>
 #include <set>
+#include <map>
+#include <functional>
+#include <memory>
+#include <span>
+#include <unordered_map>
 #include <cstdint>
 
+#include "storage/mailbox_events.hpp"
+#include "storage/mailbox_index.hpp"
+#include "storage/mailbox_snapshot.hpp"
+#include "storage/mailbox_watcher.hpp"
+#include "storage/message_structure.hpp"
+#include "storage/message_view.hpp"
+#include "storage/search_index.hpp"
+#include "storage/structure_cache.hpp"
+#include "storage/usage_file.hpp"
+
 namespace email {
 
 struct Message {
@@ -18,6 +34,9 @@ struct Message {
     std::set<char> flags;      // IMAP flags: S=seen, R=replied, F=flagged, T=trashed, D=draft
     bool is_new = true;        // In 'new' vs 'cur' directory
     std::string mailbox;       // Mailbox name (INBOX, Sent, etc.)
+    uint32_t uid = 0;          // Persistent IMAP UID; 0 when listed without the index
+    size_t body_offset = 0;    // Bytes before the body; 0 if nobody looked yet
+    uint64_t modseq = 0;       // Mod-sequence of its last change; 0 without the index
 
     bool has_flag(char flag) const { return flags.count(flag) > 0; }
     void add_flag(char flag) { flags.insert(flag); }
@@ -31,6 +50,31 @@ struct Message {
     bool is_draft() const { return has_flag('D'); }
 };
 
+// What a POP3 listing needs of a message (see Maildir::list_summaries).
+struct MessageSummary {
+    std::string unique_id;
+    uint64_t size = 0;  // Logical size
+    uint32_t uid = 0;   // 0 when listed without the index
+};
+
+// One message's part of a batch flag update (see Maildir::apply_flags).
+struct FlagChange {
+    enum class Mode { Replace, Add, Remove };
+
+    std::string unique_id;
+    Mode mode = Mode::Replace;
+    std::set<char> flags;
+};
+
+// One change to a watched mailbox (see Maildir::poll_changes). Removed
+// changes carry only the message's unique_id, mailbox and UID.
+struct MailboxChange {
+    enum class Kind { Added, Removed, FlagsChanged };
+
+    Kind kind = Kind::Added;
+    Message message;
+};
+
 struct MailboxInfo {
     std::string name;
     size_t total_messages = 0;
@@ -39,11 +83,45 @@ struct MailboxInfo {
     size_t total_size = 0;
     uint32_t uid_validity = 0;
     uint32_t uid_next = 0;
+    uint64_t highest_modseq = 0;  // 0 when the mailbox has no index
     bool is_selectable = true;
     bool has_children = false;
     std::vector<std::string> flags;
 };
 
+// A message stored once for delivery to many maildirs (see
+// Maildir::deliver_shared): a file in `directory` holding it as deliver()
+// would store it, with its structure and search terms worked out once.
+// Deliveries hard-link the file, so `directory` should be on the maildirs'
+// filesystem; elsewhere they fall back to a reflink or a copy. The file is
+// removed with the SharedMessage; the deliveries keep their own links.
+class SharedMessage {
+public:
+    static std::optional<SharedMessage> create(const std::filesystem::path& directory,
+                                               std::string_view content, std::string& error);
+
+    SharedMessage(SharedMessage&& other) noexcept;
+    SharedMessage& operator=(SharedMessage&& other) noexcept;
+    SharedMessage(const SharedMessage&) = delete;
+    SharedMessage& operator=(const SharedMessage&) = delete;
+    ~SharedMessage();
+
+    const std::filesystem::path& path() const { return path_; }
+    uint64_t size() const { return size_; }  // Logical, as delivered
+    uint32_t body_offset() const { return body_offset_; }
+    const MessageStructure& structure() const { return structure_; }
+    const SearchDocument& document() const { return document_; }
+
+private:
+    SharedMessage() = default;
+
+    std::filesystem::path path_;
+    uint64_t size_ = 0;
+    uint32_t body_offset_ = 0;
+    MessageStructure structure_;
+    SearchDocument document_;
+};
+
 class Maildir {
 public:
     Maildir(const std::filesystem::path& root, const std::string& domain,
@@ -61,58 +139,248 @@ public:
     std::optional<MailboxInfo> get_mailbox_info(const std::string& name);
 
     // Message operations
-    std::string deliver(const std::string& content, const std::string& mailbox = "INBOX");
+    // Delivers to new/, or with `flags` (e.g. an IMAP APPEND) to cur/.
+    std::string deliver(std::string_view content, const std::string& mailbox = "INBOX",
+                        const std::set<char>& flags = {});
+    // deliver() of a message already stored, by linking its file into tmp/.
+    std::string deliver_shared(const SharedMessage& message, const std::string& mailbox = "INBOX");
     std::optional<Message> get_message(const std::string& unique_id,
                                        const std::string& mailbox = "INBOX");
+    // The message file mapped read-only; bodies are read through this
+    // rather than copied.
+    std::optional<MessageView> map_message(const std::string& unique_id,
+                                           const std::string& mailbox = "INBOX");
     std::optional<std::string> get_message_content(const std::string& unique_id,
                                                    const std::string& mailbox = "INBOX");
+    // Reads the file only up to the blank line after the headers. Where
+    // the body starts is cached in the index, so later reads are a single
+    // pread() of exactly the header block.
     std::optional<std::string> get_message_headers(const std::string& unique_id,
                                                    const std::string& mailbox = "INBOX");
+    // The headers, the blank line and the first `lines` lines of the body,
+    // as stored; reading a page at a time stops once they are in.
+    std::optional<std::string> get_message_top(const std::string& unique_id, size_t lines,
+                                               const std::string& mailbox = "INBOX");
+    // The message's envelope and MIME tree, parsed at delivery or on first
+    // use and kept in the mailbox's StructureCache.
+    std::optional<MessageStructure> get_message_structure(const std::string& unique_id,
+                                                          const std::string& mailbox = "INBOX");
+    // The mailbox's search index, brought up to date and holding a document
+    // for each of `unique_ids` that still exists: any it lacks are indexed
+    // from their files first.
+    SearchIndex& prepare_search(const std::vector<std::string>& unique_ids,
+                                const std::string& mailbox = "INBOX");
     std::vector<Message> list_messages(const std::string& mailbox = "INBOX");
     std::vector<Message> list_new_messages(const std::string& mailbox = "INBOX");
+    // list_messages() cut down to what the index records, in UID order,
+    // without building a path or flag set per message.
+    std::vector<MessageSummary> list_summaries(const std::string& mailbox = "INBOX");
+    // The listing itself, shared with every other Maildir in the process
+    // that lists the mailbox at the same state (see MailboxSnapshotCache).
+    // Like list_messages() it drops pending changes.
+    std::shared_ptr<const MailboxSnapshot> snapshot(const std::string& mailbox = "INBOX");
 
     // Message manipulation
     bool delete_message(const std::string& unique_id, const std::string& mailbox = "INBOX");
+    // delete_message() for many messages with one update of the index and
+    // the usage totals; each message may appear only once. Returns how many
+    // were deleted.
+    size_t delete_messages(std::span<const std::string> unique_ids,
+                           const std::string& mailbox = "INBOX");
     bool move_message(const std::string& unique_id, const std::string& from_mailbox,
                       const std::string& to_mailbox);
+    // A copy shares the message file where the filesystem allows: it is a
+    // hard link into the destination's tmp/ (messages are never rewritten,
+    // so both names can keep the one inode), failing that a FICLONE
+    // reflink, and only across filesystems a byte copy. It is renamed into
+    // cur/ under a new unique_id, with its flags and date kept.
     bool copy_message(const std::string& unique_id, const std::string& from_mailbox,
                       const std::string& to_mailbox);
+    // copy_message() for many messages with one update of the destination's
+    // index. Returns the copies' unique_ids in the order of `unique_ids`;
+    // empty where a message could not be copied.
+    std::vector<std::string> copy_messages(std::span<const std::string> unique_ids,
+                                           const std::string& from_mailbox,
+                                           const std::string& to_mailbox);
     bool set_flags(const std::string& unique_id, const std::set<char>& flags,
                    const std::string& mailbox = "INBOX");
     bool add_flags(const std::string& unique_id, const std::set<char>& flags,
                    const std::string& mailbox = "INBOX");
     bool remove_flags(const std::string& unique_id, const std::set<char>& flags,
                       const std::string& mailbox = "INBOX");
+    // Applies many changes with one rename per changed message and a single
+    // index update. Returns each message's flags afterwards, in the order of
+    // `changes`; nullopt where the message is gone or could not be renamed.
+    std::vector<std::optional<std::set<char>>> apply_flags(std::span<const FlagChange> changes,
+                                                           const std::string& mailbox = "INBOX");
 
     // POP3 operations
     bool mark_as_seen(const std::string& unique_id, const std::string& mailbox = "INBOX");
     size_t expunge(const std::string& mailbox = "INBOX");  // Remove deleted messages
+    // Drops the cached structures and search documents of messages that
+    // are gone; for callers that delete messages one at a time.
+    void prune_caches(const std::string& mailbox = "INBOX");
+
+    // Change tracking. A watched mailbox follows its cur/ and new/ through a
+    // MailboxWatcher; poll_changes() returns what happened since the last
+    // call or list_messages(), with the index and location map already
+    // updated. This Maildir's own flag changes and deletions are not
+    // reported, but its deliveries into the mailbox are.
+    bool watch(const std::string& mailbox = "INBOX");
+    void unwatch(const std::string& mailbox = "INBOX");
+    std::vector<MailboxChange> poll_changes(const std::string& mailbox = "INBOX");
+    // Readable when a watched mailbox has changes to collect; -1 when it is
+    // not watched or is watched by polling.
+    int watch_fd(const std::string& mailbox = "INBOX");
+    // Calls `notify` (see MailboxEvents) whenever a Maildir in this process
+    // delivers to, removes from, copies into or re-flags the mailbox, until
+    // the subscription is dropped.
+    std::unique_ptr<MailboxEvents::Subscription> subscribe(const std::string& mailbox,
+                                                           std::function<void()> notify);
 
-    // Storage info
-    size_t get_total_size() const;
+    // Storage info. usage() reads the user's running totals (see UsageFile),
+    // counting the mailboxes only when there are none yet; reconcile_usage()
+    // recounts them from the mailbox indexes and replaces the totals.
+    StorageUsage usage();
+    StorageUsage reconcile_usage();
+    size_t get_total_size();  // usage().bytes
     size_t get_message_count(const std::string& mailbox = "INBOX") const;
 
+    // At-rest compression (see compression.hpp), process-wide: a zstd level
+    // for new deliveries, 0 to store them as they are. Sizes, quotas and
+    // body offsets are always the logical ones.
+    static void set_compression_level(int level);
+    static int compression_level();
+    // Compresses messages stored before compression was enabled, looking
+    // at no more than `limit` of them, in UID order; each mailbox's
+    // progress is kept in its email.recompress. Files keep their names.
+    // Returns how many were rewritten.
+    size_t recompress(size_t limit);
+
     std::string last_error() const { return last_error_; }
 
-    // UID management for IMAP
+    // UID management for IMAP. UIDs are persistent (see UidList); these
+    // only read them.
     uint32_t get_uid_validity(const std::string& mailbox = "INBOX");
-    uint32_t allocate_uid(const std::string& mailbox = "INBOX");
+    uint32_t get_uid_next(const std::string& mailbox = "INBOX");
+
+    // Mod-sequences for CONDSTORE (see MailboxIndex). The highest one is
+    // the index's as of the last listing, so it never runs ahead of what
+    // the listing showed; 0 when there is no index.
+    uint64_t get_highest_modseq(const std::string& mailbox = "INBOX");
+    // Each message's current mod-sequence, 0 where it is not known.
+    std::vector<uint64_t> get_modseqs(std::span<const std::string> unique_ids,
+                                      const std::string& mailbox = "INBOX");
+    // UIDs expunged after `modseq`, ascending; nullopt when that is no
+    // longer known.
+    std::optional<std::vector<uint32_t>> vanished_since(uint64_t modseq,
+                                                        const std::string& mailbox = "INBOX");
 
 private:
     std::filesystem::path get_mailbox_path(const std::string& mailbox) const;
     std::string generate_unique_name() const;
     std::string flags_to_info(const std::set<char>& flags) const;
     std::set<char> parse_flags(const std::string& filename) const;
+    // `size` is the logical size if known; otherwise it is read from the
+    // file, which for a compressed one means its first bytes.
     std::optional<Message> parse_message_file(const std::filesystem::path& path,
-                                              const std::string& mailbox) const;
+                                              const std::string& mailbox,
+                                              uint64_t size = 0) const;
     bool ensure_mailbox_dirs(const std::filesystem::path& mailbox_path);
-    bool move_to_cur(const std::string& unique_id, const std::string& mailbox);
+    // Moves a delivery from tmp/ into new/ (cur/ with `flags`) and records
+    // it in the index, totals and caches. Empty on failure, the file gone.
+    std::string commit_delivery(const std::string& mailbox, const std::string& unique_name,
+                                const std::set<char>& flags, uint64_t size,
+                                uint32_t body_offset, const MessageStructure& structure,
+                                const SearchDocument& document);
+    // Adds a change to the running totals.
+    void account(int64_t messages, int64_t bytes);
+    // Tells the mailbox's subscribers it changed.
+    void publish(const std::string& mailbox) const;
+
+    // Where a message's file is now: its current name (flags included) and
+    // whether it sits in new/.
+    struct MessageLocation {
+        std::string filename;
+        bool in_new = false;
+        uint32_t uid = 0;  // From the index; 0 if it had none
+        uint32_t body_offset = 0;
+        uint64_t size = 0;  // Logical size; 0 if not known
+    };
+
+    // unique_id -> location: the mailbox's snapshot as listed, under this
+    // Maildir's changes since, so only those are copied.
+    class LocationMap {
+    public:
+        std::optional<MessageLocation> find(const std::string& unique_id) const;
+        // The message's location for updating in place, or nullptr. Stays
+        // valid until the map is reset.
+        MessageLocation* edit(const std::string& unique_id);
+        void set(const std::string& unique_id, MessageLocation location);
+        void erase(const std::string& unique_id);
+        void reset(std::shared_ptr<const MailboxSnapshot> base = nullptr);
+        void for_each(const std::function<void(const std::string&,
+                                               const MessageLocation&)>& fn) const;
+
+    private:
+        std::shared_ptr<const MailboxSnapshot> base_;
+        // nullopt hides a message of base_ that is gone.
+        std::unordered_map<std::string, std::optional<MessageLocation>> changes_;
+    };
+
+    // Per-mailbox state, created on first use.
+    struct MailboxState {
+        std::unique_ptr<MailboxIndex> index;
+        std::unique_ptr<StructureCache> structures;  // Opened on first use
+        std::unique_ptr<SearchIndex> search;         // Likewise
+        // Maildir's own changes keep it current; a miss or a file that has
+        // gone reloads it from the index.
+        LocationMap locations;
+        bool locations_loaded = false;
+        // Set by watch(). While it is, misses catch up on its events instead
+        // of reloading the map, and what they find waits in `pending` for
+        // poll_changes().
+        std::unique_ptr<MailboxWatcher> watcher;
+        std::vector<MailboxChange> pending;
+    };
+
+    MailboxState& state_for(const std::string& mailbox);
+    MailboxIndex& index_for(const std::string& mailbox) { return *state_for(mailbox).index; }
+    StructureCache& structures_for(const std::string& mailbox);
+    SearchIndex& search_for(const std::string& mailbox);
+    void forget_mailbox(const std::string& mailbox);
+    void load_locations(const std::string& mailbox);
+    // The mailbox's snapshot, from the cache if the index has not moved on
+    // since, which the location map is then reset to.
+    std::shared_ptr<const MailboxSnapshot> load_snapshot(const std::string& mailbox);
+    // Brings the location map up to date after a miss: from the watcher's
+    // events if the mailbox is watched, otherwise by reloading it.
+    void refresh_locations(const std::string& mailbox);
+    // Applies the watcher's events to the map and index, queueing changes.
+    void catch_up(const std::string& mailbox);
+    // After lost events: relists the mailbox and queues the difference.
+    void resync(const std::string& mailbox);
+    // Records a file Maildir just created or moved in. Watched mailboxes
+    // leave it to the watcher, so the file is reported as added.
+    void remember(const std::string& mailbox, std::string unique_id,
+                  std::string filename, bool in_new, uint32_t body_offset = 0,
+                  uint64_t size = 0);
+    void forget(const std::string& mailbox, const std::string& unique_id);
+    std::optional<Message> find_located(const std::string& unique_id, const std::string& mailbox);
+
+    // list_messages() without dropping pending changes.
+    std::vector<Message> read_listing(const std::string& mailbox);
+    // Directory scan used when the index cannot be.
+    std::vector<Message> scan_messages(const std::string& mailbox);
 
     std::filesystem::path root_;
     std::string domain_;
     std::string username_;
     std::filesystem::path maildir_path_;
     std::string last_error_;
+    UsageFile usage_file_;
+
+    std::map<std::filesystem::path, MailboxState> mailboxes_;
 };
 
 }  // namespace email
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace email {
+
+// The header fields an IMAP ENVELOPE is made of, unfolded but otherwise as
+// they appear in the message; empty where the field is absent.
+struct Envelope {
+    std::string date;
+    std::string subject;
+    std::string from;
+    std::string sender;
+    std::string reply_to;
+    std::string to;
+    std::string cc;
+    std::string bcc;
+    std::string in_reply_to;
+    std::string message_id;
+};
+
+// One MIME entity. Offsets are into the whole message as delivered, which
+// for a compressed file is its decompressed form.
+struct MimePart {
+    using Params = std::vector<std::pair<std::string, std::string>>;
+
+    std::string type = "text";  // Type, subtype and parameter names in lower case
+    std::string subtype = "plain";
+    Params params;
+    std::string id;
+    std::string description;
+    std::string encoding = "7bit";
+    std::string md5;
+    std::string disposition;
+    Params disposition_params;
+    std::string language;
+    std::string location;
+
+    uint64_t offset = 0;       // Where its header starts
+    uint64_t body_offset = 0;  // Where its body starts, after the blank line
+    uint64_t end = 0;          // Where its body ends
+    uint64_t lines = 0;        // Lines in its body
+
+    // A multipart's parts, or a message/rfc822's encapsulated message.
+    std::vector<MimePart> parts;
+    // A message/rfc822's envelope.
+    Envelope envelope;
+
+    bool is_multipart() const { return type == "multipart"; }
+    bool is_message() const { return type == "message" && subtype == "rfc822"; }
+    uint64_t size() const { return end - body_offset; }
+};
+
+// A field of a header block: continuation lines unfolded, the value trimmed.
+struct HeaderField {
+    std::string_view name;
+    std::string value;
+};
+
+std::vector<HeaderField> parse_header_fields(std::string_view header);
+
+// What a message looks like to IMAP FETCH: its envelope and its MIME tree,
+// with `body` the message itself (offset 0, its header the message header).
+// Parsed once and kept in the mailbox's StructureCache, so ENVELOPE,
+// BODYSTRUCTURE and section fetches need no more than a ranged read.
+struct MessageStructure {
+    Envelope envelope;
+    MimePart body;
+
+    static MessageStructure parse(std::string_view message);
+
+    std::string serialize() const;
+    // nullopt if `data` is not something serialize() produced.
+    static std::optional<MessageStructure> deserialize(std::string_view data);
+};
+
+}  // namespace email
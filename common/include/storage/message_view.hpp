@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace email {
+
+// Where a message's header block ends: the offset of the blank line that
+// closes it, and of the first body byte after it. A message without a
+// blank line is all header, with both at its end.
+struct HeaderBounds {
+    std::size_t header_end = 0;
+    std::size_t body_start = 0;
+};
+
+// Finds the blank line in what is known of a message so far. nullopt if
+// `data` holds no blank line yet.
+std::optional<HeaderBounds> find_header_end(std::string_view data);
+
+// Read-only mapping of one message file. Maildir never rewrites a message
+// in place, so the view stays valid for as long as it lives, even if the
+// file is renamed or deleted meanwhile. The pages are the page cache's:
+// nothing is copied until a caller copies it. A compressed file (see
+// compression.hpp) is decompressed into memory the view owns instead.
+class MessageView {
+public:
+    static std::optional<MessageView> open(const std::filesystem::path& path);
+
+    MessageView() = default;
+    ~MessageView();
+
+    MessageView(MessageView&& other) noexcept;
+    MessageView& operator=(MessageView&& other) noexcept;
+    MessageView(const MessageView&) = delete;
+    MessageView& operator=(const MessageView&) = delete;
+
+    std::string_view data() const { return {data_, size_}; }
+    std::size_t size() const { return size_; }
+    HeaderBounds header_bounds() const;
+    std::string_view headers() const { return data().substr(0, header_bounds().header_end); }
+    std::string_view body() const { return data().substr(header_bounds().body_start); }
+
+private:
+    void release();
+
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+    std::string owned_;  // Decompressed contents; data_ points into it
+    bool mapped_ = false;
+};
+
+}  // namespace email
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace email {
+
+// An append-only file of keyed records shared by every process serving a
+// mailbox: a format line, then
+//
+//     <key length> <payload length> (little-endian uint32s) <key> <payload>
+//
+// per record. Writers append under an exclusive flock() after reading what
+// others appended; a record torn by a crash is cut off by the next writer.
+// A later record for a key supersedes earlier ones. rewrite() drops the
+// records of keys that are gone by writing a new file and renaming it into
+// place, and instances that read the old one start over on the new one.
+class RecordLog {
+public:
+    // Called for each record, in file order, as it is read. `payload` is
+    // only valid during the call; `offset` is where it is in the file.
+    using Visitor = std::function<void(std::string_view key, uint64_t offset,
+                                       std::string_view payload)>;
+
+    // `forget` is called before the records of a replacement file are
+    // visited: whatever was built from the old one is stale.
+    RecordLog(std::filesystem::path path, std::string_view format_line,
+              std::function<void()> forget);
+    ~RecordLog();
+
+    RecordLog(const RecordLog&) = delete;
+    RecordLog& operator=(const RecordLog&) = delete;
+
+    // Visits the records appended since the last look. False with
+    // last_error() empty when there is no file yet.
+    bool read(const Visitor& visit);
+    // Visits what others appended, then appends the record. Returns where
+    // its payload landed, or 0 on failure.
+    uint64_t append(std::string_view key, std::string_view payload, const Visitor& visit);
+    // Flushes what was appended to disk.
+    bool sync();
+    // Reads `size` bytes at `offset` of the file last read.
+    bool read_at(uint64_t offset, std::string& out, std::size_t size);
+    // Rewrites the file without the keys `keep` rejects, if they make up
+    // most of it.
+    bool rewrite(const std::function<bool(std::string_view key)>& keep);
+
+    const std::filesystem::path& path() const { return path_; }
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    // Opens the file, or reopens it if it was replaced; creates it if
+    // `create`. False with last_error_ empty when there is none.
+    bool open_file(bool create);
+    // open_file() and its exclusive lock.
+    bool lock();
+    void unlock();
+    void close_file();
+    // Visits the records appended since the last look. Returns where the
+    // last whole record ends.
+    uint64_t catch_up(const Visitor& visit);
+
+    std::filesystem::path path_;
+    std::string format_line_;
+    std::function<void()> forget_;
+    int fd_ = -1;
+    uint64_t loaded_ = 0;   // Bytes of the file read
+    uint64_t records_ = 0;  // Records among them, superseded ones included
+    std::string last_error_;
+};
+
+}  // namespace email
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <initializer_list>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "storage/message_structure.hpp"
+#include "storage/record_log.hpp"
+
+namespace email {
+
+// What SEARCH looks at in one message, taken out of it once.
+struct SearchDocument {
+    static constexpr int32_t no_date = INT32_MIN;
+
+    // Distinct "<field>:<word>" terms. The field is a header name in lower
+    // case, "*" for any header, or empty for the text of the body; a bare
+    // "<name>:" records that the header is there.
+    std::vector<std::string> terms;
+    int32_t sent_day = no_date;  // Date field, in days since the epoch
+    // Columns for matching substrings, as IMAP asks, after the words have
+    // narrowed things down. Unfolded, encoded-words decoded.
+    std::string from;
+    std::string to;
+    std::string cc;
+    std::string bcc;
+    std::string subject;
+
+    // `structure` is the message's, which tells its text parts apart.
+    static SearchDocument extract(std::string_view message, const MessageStructure& structure);
+
+    std::string serialize() const;
+    static std::optional<SearchDocument> deserialize(std::string_view data);
+};
+
+// The lower-case words of `text` as the index holds them.
+std::vector<std::string> search_words(std::string_view text);
+
+// The search index of one mailbox, kept beside its index as a RecordLog,
+// `email.search`, with a SearchDocument per unique_id. Reading the log
+// builds the inverted index in memory: per term, the documents holding it
+// as a posting list of delta-encoded varints. Documents are numbered in
+// the order they were read, so lists only ever grow at the end.
+class SearchIndex {
+public:
+    using DocId = uint32_t;
+    static constexpr const char* file_name = "email.search";
+
+    explicit SearchIndex(const std::filesystem::path& mailbox_path);
+
+    // Takes in what others appended since the last look.
+    void refresh();
+    std::optional<DocId> find(const std::string& unique_id) const;
+    bool add(const std::string& unique_id, const SearchDocument& document);
+    // Drops the records `keep` rejects, if they are most of the file.
+    bool retain(const std::function<bool(const std::string& unique_id)>& keep);
+
+    // The documents that have, for every word of `text`, a term in one of
+    // `fields` starting with that word; ascending. nullopt if `text` has no
+    // words, which narrows nothing down.
+    std::optional<std::vector<DocId>> lookup(std::initializer_list<std::string_view> fields,
+                                             std::string_view text) const;
+    // The documents holding exactly `term`; ascending.
+    std::vector<DocId> postings(std::string_view term) const;
+    // A document's columns; its terms are only in the posting lists.
+    const SearchDocument& document(DocId doc) const { return documents_[doc]; }
+
+    const std::string& last_error() const { return log_.last_error(); }
+
+private:
+    struct PostingList {
+        std::string deltas;  // Varint gaps; the first is the DocId itself
+        DocId last = 0;
+        bool empty = true;
+
+        void push_back(DocId doc);
+        void decode(std::vector<DocId>& out) const;
+    };
+
+    void take(std::string_view unique_id, std::string_view payload);
+    void forget();
+
+    std::map<std::string, PostingList, std::less<>> postings_;
+    std::vector<SearchDocument> documents_;
+    // unique_id -> its latest document; earlier ones are unreachable.
+    std::unordered_map<std::string, DocId> ids_;
+    RecordLog log_;
+};
+
+}  // namespace email
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "storage/message_structure.hpp"
+#include "storage/record_log.hpp"
+
+namespace email {
+
+// Parsed MessageStructures of one mailbox, kept beside its index as a
+// RecordLog, `email.structure`, keyed by unique_id with the payload from
+// MessageStructure::serialize(). Messages are never rewritten, so a record
+// stays true for as long as its message exists.
+class StructureCache {
+public:
+    static constexpr const char* file_name = "email.structure";
+
+    explicit StructureCache(const std::filesystem::path& mailbox_path);
+
+    // Looks in what was read, and on a miss in what was appended since.
+    std::optional<MessageStructure> find(const std::string& unique_id);
+    bool store(const std::string& unique_id, const MessageStructure& structure);
+    // Drops the records `keep` rejects, if they are most of the file.
+    bool retain(const std::function<bool(const std::string& unique_id)>& keep);
+
+    const std::string& last_error() const { return log_.last_error(); }
+
+private:
+    // Where a record's payload is in the file.
+    struct Location {
+        uint64_t offset = 0;
+        uint32_t size = 0;
+    };
+
+    void remember(std::string_view unique_id, uint64_t offset, std::string_view payload);
+    std::optional<MessageStructure> read(const Location& location);
+
+    // Only locations are held: payloads are read from the file, which the
+    // page cache keeps close at hand.
+    std::unordered_map<std::string, Location> entries_;
+    RecordLog log_;
+};
+
+}  // namespace email
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace email {
+
+// The authoritative unique_id -> IMAP UID map of one mailbox, kept beside
+// its index as `email.uidlist`:
+//
+//     V<uid validity> N<next uid>
+//     <uid> <unique_id>        one line per assigned UID
+//     -<unique_id>             the message left the mailbox
+//
+// UIDs are only ever appended, so a crash can at worst leave a torn last
+// line, which is ignored. Compaction writes a fresh list to a temporary
+// file and renames it into place. The list does not lock itself: callers
+// hold the mailbox index's exclusive lock for any change.
+class UidList {
+public:
+    static constexpr const char* file_name = "email.uidlist";
+
+    explicit UidList(std::filesystem::path path);
+
+    // Reads what was appended since the last call, or the whole list if it
+    // was replaced. Returns false with last_error() empty when there is no
+    // list yet.
+    bool load();
+
+    // Replaces the list (or starts one) with the given entries.
+    bool create(uint32_t uid_validity, uint32_t next_uid,
+                const std::vector<std::pair<uint32_t, std::string>>& entries);
+
+    std::optional<uint32_t> find(std::string_view unique_id) const;
+
+    // The message's UID, assigning the next one if it has none. New UIDs
+    // and forget() are written out by flush().
+    uint32_t assign(std::string_view unique_id);
+    void forget(std::string_view unique_id);
+    bool flush();
+
+    uint32_t uid_validity() const { return uid_validity_; }
+    uint32_t next_uid() const { return next_uid_; }
+    std::size_t size() const { return uids_.size(); }
+    // Lines in the file; the excess over size() is what compaction saves.
+    std::size_t lines() const { return lines_; }
+
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    void reset();
+    void parse_line(std::string_view line);
+
+    std::filesystem::path path_;
+    std::unordered_map<std::string, uint32_t> uids_;
+    uint32_t uid_validity_ = 0;
+    uint32_t next_uid_ = 1;
+    std::size_t lines_ = 0;
+
+    // What load() has consumed: the file's identity and the offset just
+    // past its last complete line.
+    uint64_t inode_ = 0;
+    uint64_t offset_ = 0;
+    bool torn_tail_ = false;
+
+    std::string pending_;
+    std::string last_error_;
+};
+
+}  // namespace email
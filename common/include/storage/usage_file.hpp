@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+
+namespace email {
+
+struct StorageUsage {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    int64_t reconciled_at = 0;  // Seconds since the epoch
+};
+
+// Running storage totals of one user, kept at the top of the maildir as
+// `email.usage`:
+//
+//     T<messages> <bytes> <reconciled at>
+//     <messages> <bytes>           one signed line per change since
+//
+// Deliveries and deletions append their change, so reading the totals costs
+// one small file instead of a walk over every mailbox. Once the changes
+// outgrow a few kilobytes the appender that noticed folds them into the
+// first line; reconciliation replaces the file with totals counted from the
+// mailbox indexes. Both write a temporary file and rename() it into place
+// under an exclusive flock() on the old one, which appenders take too and
+// re-check, so no change lands in a file that has just been replaced.
+//
+// A change racing a reconciliation may be counted twice or not at all; the
+// next reconciliation puts that right.
+class UsageFile {
+public:
+    static constexpr const char* file_name = "email.usage";
+
+    explicit UsageFile(std::filesystem::path path);
+
+    // The current totals. Returns false with last_error() empty when there
+    // is no file yet, and with an error when it cannot be read or its first
+    // line is damaged; either way it needs reconciling.
+    bool read(StorageUsage& usage);
+
+    // Records a change. Without a file this does nothing: the
+    // reconciliation that creates it will count the change anyway.
+    bool add(int64_t messages, int64_t bytes);
+
+    // Replaces the file (or starts one) with freshly counted totals.
+    bool replace(const StorageUsage& usage);
+
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    // Opens the file and takes its exclusive lock, reopening if it was
+    // replaced meanwhile. -1 with last_error_ empty when there is none.
+    int lock();
+    bool parse(std::string_view data, StorageUsage& usage);
+    bool write_replacement(const StorageUsage& usage);
+
+    std::filesystem::path path_;
+    std::string last_error_;
+};
+
+}  // namespace email
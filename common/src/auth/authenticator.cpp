@@ -1,5 +1,6 @@
 #include "auth/authenticator.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
 #include <sqlite3.h>
 #include <random>
 #include <sstream>
@@ -7,39 +8,93 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <algorithm>
 #include <cstring>
+#include <thread>
 
 namespace email {
 
-Authenticator::Authenticator(const std::filesystem::path& db_path)
-    : db_path_(db_path) {
+namespace {
+
+// Cached credentials kept at most; expired ones are dropped first.
+constexpr size_t max_verified_credentials = 65536;
+
+// Cached users or domains kept at most; the cache starts over past it.
+constexpr size_t max_cached_records = 100000;
+
+// How often the record cache looks for commits by other processes.
+constexpr std::chrono::seconds records_recheck{1};
+
+// Password checks by outcome: unknown or inactive user, wrong password,
+// verified by the KDF, or answered from the credential cache.
+struct AuthTimes {
+    Histogram& unknown;
+    Histogram& rejected;
+    Histogram& verified;
+    Histogram& cached;
+};
+
+AuthTimes& auth_times() {
+    auto histogram = [](const char* result) -> Histogram& {
+        return Metrics::instance().histogram("email_auth_duration_seconds",
+                                             "Time taken to check a password",
+                                             {{"result", result}});
+    };
+    static AuthTimes times{histogram("unknown"), histogram("rejected"), histogram("verified"),
+                           histogram("cached")};
+    return times;
 }
 
-Authenticator::~Authenticator() {
-    if (db_) {
-        sqlite3_close(db_);
-    }
+const char* const user_columns =
+    "SELECT id, username, domain, quota_bytes, used_bytes, active, created_at, password_hash "
+    "FROM users";
+
+User read_user(const Database::Statement& stmt) {
+    User u;
+    u.id = stmt.column_int64(0);
+    u.username = stmt.column_text(1);
+    u.domain = stmt.column_text(2);
+    u.quota_bytes = stmt.column_int64(3);
+    u.used_bytes = stmt.column_int64(4);
+    u.active = stmt.column_int64(5) != 0;
+    u.created_at = stmt.column_text(6);
+    return u;
 }
 
-bool Authenticator::initialize() {
-    std::lock_guard<std::mutex> lock(mutex_);
+Domain read_domain(const Database::Statement& stmt) {
+    Domain d;
+    d.id = stmt.column_int64(0);
+    d.domain = stmt.column_text(1);
+    d.active = stmt.column_int64(2) != 0;
+    return d;
+}
 
-    // Create parent directories if they don't exist
-    if (auto parent = db_path_.parent_path(); !parent.empty()) {
-        std::filesystem::create_directories(parent);
-    }
+}  // namespace
 
-    int rc = sqlite3_open(db_path_.string().c_str(), &db_);
-    if (rc != SQLITE_OK) {
-        last_error_ = std::string("Cannot open database: ") + sqlite3_errmsg(db_);
-        LOG_ERROR(last_error_);
-        return false;
+Authenticator::Authenticator(const std::filesystem::path& db_path, size_t readers)
+    : db_(db_path, readers) {
+    cache_key_valid_ = RAND_bytes(cache_key_, sizeof(cache_key_)) == 1;
+    if (!cache_key_valid_) {
+        // Without a secret key the tags could be brute-forced offline.
+        cache_ttl_ = std::chrono::seconds(0);
     }
+}
 
-    // Enable WAL mode for better concurrency
-    execute_sql("PRAGMA journal_mode=WAL;");
-    execute_sql("PRAGMA foreign_keys=ON;");
+Authenticator::~Authenticator() {
+    if (pool_) {
+        pool_->join();
+    }
+}
 
+bool Authenticator::initialize() {
+    if (!db_.open()) {
+        set_error(db_.last_error());
+        return false;
+    }
     return create_tables();
 }
 
@@ -76,22 +131,12 @@ bool Authenticator::create_tables() {
         CREATE INDEX IF NOT EXISTS idx_users_domain ON users(domain);
     )";
 
-    if (!execute_sql(domains_table)) return false;
-    if (!execute_sql(users_table)) return false;
-    if (!execute_sql(index_username)) return false;
-    if (!execute_sql(index_domain)) return false;
-
-    return true;
-}
-
-bool Authenticator::execute_sql(const std::string& sql) {
-    char* err_msg = nullptr;
-    int rc = sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &err_msg);
-    if (rc != SQLITE_OK) {
-        last_error_ = std::string("SQL error: ") + (err_msg ? err_msg : "unknown");
-        sqlite3_free(err_msg);
-        LOG_ERROR(last_error_);
-        return false;
+    auto db = db_.writer();
+    for (const char* sql : {domains_table, users_table, index_username, index_domain}) {
+        if (!db.execute(sql)) {
+            set_error("SQL error: " + db.error());
+            return false;
+        }
     }
     return true;
 }
@@ -101,33 +146,226 @@ bool Authenticator::authenticate(const std::string& username, const std::string&
 }
 
 bool Authenticator::authenticate_plain(const std::string& username, const std::string& password) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    const auto start = std::chrono::steady_clock::now();
+    auto& times = auth_times();
+    auto outcome = [&](Histogram& histogram, bool result) {
+        histogram.record(std::chrono::steady_clock::now() - start);
+        return result;
+    };
+
+    auto stored_hash = stored_password_hash(username);
+    if (!stored_hash) {
+        return outcome(times.unknown, false);
+    }
+
+    std::string tag = credential_tag(username, password, *stored_hash);
+    if (recently_verified(tag)) {
+        return outcome(times.cached, true);
+    }
+    if (!verify_password(password, *stored_hash)) {
+        return outcome(times.rejected, false);
+    }
+    remember_verified(std::move(tag));
+    return outcome(times.verified, true);
+}
+
+void Authenticator::authenticate_async(std::string username, std::string password,
+                                       std::function<void(bool)> done) {
+    std::call_once(pool_once_, [this]() {
+        pool_ = std::make_unique<boost::asio::thread_pool>(
+            std::max(1u, std::thread::hardware_concurrency()));
+    });
+    boost::asio::post(*pool_, [this, username = std::move(username),
+                               password = std::move(password), done = std::move(done)]() {
+        done(authenticate(username, password));
+    });
+}
+
+void Authenticator::set_credential_cache_ttl(std::chrono::seconds ttl) {
+    if (!cache_key_valid_) {
+        if (ttl.count() > 0) {
+            LOG_WARNING("Credential cache stays disabled: no random key for it");
+        }
+        return;
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    cache_ttl_ = ttl;
+    if (ttl.count() <= 0) {
+        verified_.clear();
+    }
+}
 
+std::optional<std::string> Authenticator::stored_password_hash(const std::string& username) {
     auto [user, domain] = parse_email(username);
+    auto record = find_user(user, domain);
+    if (!record || !record->user.active) {
+        return std::nullopt;
+    }
+    return record->password_hash;
+}
 
-    const char* sql = "SELECT password_hash, active FROM users WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
+std::optional<Authenticator::UserRecord> Authenticator::find_user(const std::string& user,
+                                                                  const std::string& domain) {
+    check_external_changes();
+    const std::string key = user + "@" + domain;
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(records_mutex_);
+        if (auto it = users_.find(key); it != users_.end()) {
+            return it->second;
+        }
+        generation = records_generation_;
+    }
 
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        last_error_ = sqlite3_errmsg(db_);
-        return false;
+    std::optional<UserRecord> record;
+    {
+        auto db = db_.reader();
+        auto stmt = db.prepare(std::string(user_columns) + " WHERE username = ? AND domain = ?;");
+        if (!stmt) {
+            set_error(db.error());
+            return std::nullopt;  // Not cached; the next lookup tries again
+        }
+        stmt.bind(1, user).bind(2, domain);
+        if (stmt.next()) {
+            record = UserRecord{read_user(stmt), stmt.column_text(7)};
+        }
     }
 
-    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, domain.c_str(), -1, SQLITE_TRANSIENT);
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    // A write since the lookup started may have made it stale.
+    if (generation == records_generation_) {
+        if (users_.size() >= max_cached_records) {
+            users_.clear();
+        }
+        users_.emplace(key, record);
+    }
+    return record;
+}
 
-    bool result = false;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        std::string stored_hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-        int active = sqlite3_column_int(stmt, 1);
+std::optional<Domain> Authenticator::find_domain(const std::string& domain) {
+    check_external_changes();
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(records_mutex_);
+        if (auto it = domains_.find(domain); it != domains_.end()) {
+            return it->second;
+        }
+        generation = records_generation_;
+    }
 
-        if (active && verify_password(password, stored_hash)) {
-            result = true;
+    std::optional<Domain> record;
+    {
+        auto db = db_.reader();
+        auto stmt = db.prepare("SELECT id, domain, active FROM domains WHERE domain = ?;");
+        if (!stmt) {
+            set_error(db.error());
+            return std::nullopt;
+        }
+        stmt.bind(1, domain);
+        if (stmt.next()) {
+            record = read_domain(stmt);
         }
     }
 
-    sqlite3_finalize(stmt);
-    return result;
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    if (generation == records_generation_) {
+        if (domains_.size() >= max_cached_records) {
+            domains_.clear();
+        }
+        domains_.emplace(domain, record);
+    }
+    return record;
+}
+
+void Authenticator::forget_user(const std::string& user, const std::string& domain) {
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    users_.erase(user + "@" + domain);
+    ++records_generation_;
+}
+
+void Authenticator::forget_domain(const std::string& domain, bool with_users) {
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    domains_.erase(domain);
+    if (with_users) {
+        users_.clear();
+    }
+    ++records_generation_;
+}
+
+void Authenticator::check_external_changes() {
+    const auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(records_mutex_);
+        if (now - version_checked_ < records_recheck) {
+            return;
+        }
+        version_checked_ = now;
+    }
+    const int64_t version = db_.data_version();
+    std::lock_guard<std::mutex> lock(records_mutex_);
+    if (version != data_version_) {
+        data_version_ = version;
+        users_.clear();
+        domains_.clear();
+        ++records_generation_;
+    }
+}
+
+void Authenticator::set_error(const std::string& error) {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    last_error_ = error;
+}
+
+std::string Authenticator::last_error() const {
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    return last_error_;
+}
+
+std::string Authenticator::credential_tag(const std::string& username, const std::string& password,
+                                          const std::string& stored_hash) const {
+    // Length-prefixed so no two credential triples share an input.
+    std::string input;
+    input.reserve(username.size() + password.size() + stored_hash.size() + 16);
+    for (const std::string* part : {&username, &password, &stored_hash}) {
+        input += std::to_string(part->size());
+        input += ':';
+        input += *part;
+    }
+
+    unsigned char tag[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    HMAC(EVP_sha256(), cache_key_, sizeof(cache_key_),
+         reinterpret_cast<const unsigned char*>(input.data()), input.size(), tag, &length);
+    OPENSSL_cleanse(input.data(), input.size());
+    return std::string(reinterpret_cast<const char*>(tag), length);
+}
+
+bool Authenticator::recently_verified(const std::string& tag) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    auto it = verified_.find(tag);
+    if (it == verified_.end()) {
+        return false;
+    }
+    if (it->second <= std::chrono::steady_clock::now()) {
+        verified_.erase(it);
+        return false;
+    }
+    return true;
+}
+
+void Authenticator::remember_verified(std::string tag) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (cache_ttl_.count() <= 0) {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (verified_.size() >= max_verified_credentials) {
+        std::erase_if(verified_, [now](const auto& entry) { return entry.second <= now; });
+        if (verified_.size() >= max_verified_credentials) {
+            verified_.clear();
+        }
+    }
+    verified_[std::move(tag)] = now + cache_ttl_;
 }
 
 bool Authenticator::authenticate_login(const std::string& username, const std::string& password) {
@@ -137,27 +375,16 @@ bool Authenticator::authenticate_login(const std::string& username, const std::s
 bool Authenticator::authenticate_cram_md5(const std::string& username,
                                           const std::string& challenge,
                                           const std::string& response) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
     auto [user, domain] = parse_email(username);
 
     // Get the stored password hash (we need the actual password for CRAM-MD5)
     // Note: CRAM-MD5 requires storing passwords in retrievable form, which is less secure
     // For this implementation, we store a secondary plain password for CRAM-MD5
     // In production, consider not supporting CRAM-MD5
-
-    const char* sql = "SELECT password_hash FROM users WHERE username = ? AND domain = ? AND active = 1;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
-    }
-
-    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, domain.c_str(), -1, SQLITE_TRANSIENT);
+    auto record = find_user(user, domain);
 
     bool result = false;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
+    if (record && record->user.active) {
         // For CRAM-MD5, compute HMAC-MD5(challenge, password)
         // This is a simplified implementation - in practice you'd need
         // to store passwords differently to support CRAM-MD5
@@ -166,347 +393,193 @@ bool Authenticator::authenticate_cram_md5(const std::string& username,
         // result = (computed_response == response);
     }
 
-    sqlite3_finalize(stmt);
     return result;
 }
 
 bool Authenticator::create_user(const std::string& username, const std::string& password,
                                 const std::string& domain, int64_t quota_bytes) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    // Ensure domain exists
-    if (!is_local_domain(domain)) {
-        // Create domain if it doesn't exist
-        const char* domain_sql = "INSERT OR IGNORE INTO domains (domain) VALUES (?);";
-        sqlite3_stmt* stmt;
-        if (sqlite3_prepare_v2(db_, domain_sql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, domain.c_str(), -1, SQLITE_TRANSIENT);
-            sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
-        }
-    }
-
+    // Hashed before taking the writer, which would otherwise stall writes.
     std::string password_hash = hash_password(password);
 
-    const char* sql = "INSERT INTO users (username, domain, password_hash, quota_bytes) VALUES (?, ?, ?, ?);";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        last_error_ = sqlite3_errmsg(db_);
-        return false;
-    }
+    bool result = false;
+    {
+        auto db = db_.writer();
 
-    sqlite3_bind_text(stmt, 1, username.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, domain.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, password_hash.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt, 4, quota_bytes);
+        // Ensure domain exists
+        if (auto stmt = db.prepare("INSERT OR IGNORE INTO domains (domain) VALUES (?);")) {
+            stmt.bind(1, domain).step();
+        }
 
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    if (!result) {
-        last_error_ = sqlite3_errmsg(db_);
+        auto stmt = db.prepare("INSERT INTO users (username, domain, password_hash, quota_bytes) "
+                               "VALUES (?, ?, ?, ?);");
+        if (!stmt) {
+            set_error(db.error());
+            return false;
+        }
+        stmt.bind(1, username).bind(2, domain).bind(3, password_hash).bind(4, quota_bytes);
+        result = stmt.step() == SQLITE_DONE;
+        if (!result) {
+            set_error(db.error());
+        }
     }
 
-    sqlite3_finalize(stmt);
+    forget_domain(domain, false);
+    forget_user(username, domain);
     return result;
 }
 
 bool Authenticator::delete_user(const std::string& username) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
     auto [user, domain] = parse_email(username);
-
-    const char* sql = "DELETE FROM users WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        last_error_ = sqlite3_errmsg(db_);
-        return false;
-    }
-
-    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
-    return result && sqlite3_changes(db_) > 0;
+    return update_user("DELETE FROM users WHERE username = ? AND domain = ?;",
+                       user, domain, [](Database::Statement&) {});
 }
 
 bool Authenticator::change_password(const std::string& username, const std::string& new_password) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    auto [user, domain] = parse_email(username);
     std::string password_hash = hash_password(new_password);
 
-    const char* sql = "UPDATE users SET password_hash = ? WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        last_error_ = sqlite3_errmsg(db_);
-        return false;
-    }
-
-    sqlite3_bind_text(stmt, 1, password_hash.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
-    return result && sqlite3_changes(db_) > 0;
+    auto [user, domain] = parse_email(username);
+    return update_user("UPDATE users SET password_hash = ?3 WHERE username = ?1 AND domain = ?2;",
+                       user, domain, [&](Database::Statement& stmt) { stmt.bind(3, password_hash); });
 }
 
 bool Authenticator::set_user_active(const std::string& username, bool active) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
     auto [user, domain] = parse_email(username);
-
-    const char* sql = "UPDATE users SET active = ? WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
-    }
-
-    sqlite3_bind_int(stmt, 1, active ? 1 : 0);
-    sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
-    return result;
+    return update_user("UPDATE users SET active = ?3 WHERE username = ?1 AND domain = ?2;",
+                       user, domain, [&](Database::Statement& stmt) {
+                           stmt.bind(3, int64_t{active ? 1 : 0});
+                       });
 }
 
 bool Authenticator::update_quota(const std::string& username, int64_t quota_bytes) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
     auto [user, domain] = parse_email(username);
-
-    const char* sql = "UPDATE users SET quota_bytes = ? WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
-    }
-
-    sqlite3_bind_int64(stmt, 1, quota_bytes);
-    sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
-    return result;
+    return update_user("UPDATE users SET quota_bytes = ?3 WHERE username = ?1 AND domain = ?2;",
+                       user, domain, [&](Database::Statement& stmt) { stmt.bind(3, quota_bytes); });
 }
 
 bool Authenticator::update_used_space(const std::string& username, int64_t used_bytes) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
     auto [user, domain] = parse_email(username);
+    return update_user("UPDATE users SET used_bytes = ?3 WHERE username = ?1 AND domain = ?2;",
+                       user, domain, [&](Database::Statement& stmt) { stmt.bind(3, used_bytes); });
+}
 
-    const char* sql = "UPDATE users SET used_bytes = ? WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
+bool Authenticator::update_user(const std::string& sql, const std::string& user,
+                                const std::string& domain,
+                                const std::function<void(Database::Statement&)>& bind) {
+    bool result = false;
+    {
+        auto db = db_.writer();
+        auto stmt = db.prepare(sql);
+        if (!stmt) {
+            set_error(db.error());
+            return false;
+        }
+        // The user and domain are parameters 1 and 2; `bind` sets the rest.
+        stmt.bind(1, user).bind(2, domain);
+        bind(stmt);
+        result = stmt.step() == SQLITE_DONE && db.changes() > 0;
     }
-
-    sqlite3_bind_int64(stmt, 1, used_bytes);
-    sqlite3_bind_text(stmt, 2, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 3, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
+    forget_user(user, domain);
     return result;
 }
 
 std::optional<User> Authenticator::get_user(const std::string& username) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
     auto [user, domain] = parse_email(username);
-
-    const char* sql = "SELECT id, username, domain, quota_bytes, used_bytes, active, created_at "
-                      "FROM users WHERE username = ? AND domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return std::nullopt;
+    if (auto record = find_user(user, domain)) {
+        return record->user;
     }
-
-    sqlite3_bind_text(stmt, 1, user.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt, 2, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    std::optional<User> result;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        User u;
-        u.id = sqlite3_column_int64(stmt, 0);
-        u.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        u.domain = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        u.quota_bytes = sqlite3_column_int64(stmt, 3);
-        u.used_bytes = sqlite3_column_int64(stmt, 4);
-        u.active = sqlite3_column_int(stmt, 5) != 0;
-        if (sqlite3_column_text(stmt, 6)) {
-            u.created_at = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6));
-        }
-        result = u;
-    }
-
-    sqlite3_finalize(stmt);
-    return result;
+    return std::nullopt;
 }
 
 std::vector<User> Authenticator::list_users(const std::string& domain) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    std::string sql = "SELECT id, username, domain, quota_bytes, used_bytes, active, created_at FROM users";
+    std::string sql = user_columns;
     if (!domain.empty()) {
         sql += " WHERE domain = ?";
     }
     sql += " ORDER BY username;";
 
-    sqlite3_stmt* stmt;
-    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+    auto db = db_.reader();
+    auto stmt = db.prepare(sql);
+    if (!stmt) {
         return {};
     }
-
     if (!domain.empty()) {
-        sqlite3_bind_text(stmt, 1, domain.c_str(), -1, SQLITE_TRANSIENT);
+        stmt.bind(1, domain);
     }
 
     std::vector<User> users;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        User u;
-        u.id = sqlite3_column_int64(stmt, 0);
-        u.username = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        u.domain = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-        u.quota_bytes = sqlite3_column_int64(stmt, 3);
-        u.used_bytes = sqlite3_column_int64(stmt, 4);
-        u.active = sqlite3_column_int(stmt, 5) != 0;
-        if (sqlite3_column_text(stmt, 6)) {
-            u.created_at = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 6));
-        }
-        users.push_back(u);
+    while (stmt.next()) {
+        users.push_back(read_user(stmt));
     }
-
-    sqlite3_finalize(stmt);
     return users;
 }
 
 bool Authenticator::create_domain(const std::string& domain) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    const char* sql = "INSERT INTO domains (domain) VALUES (?);";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        last_error_ = sqlite3_errmsg(db_);
-        return false;
-    }
-
-    sqlite3_bind_text(stmt, 1, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    if (!result) {
-        last_error_ = sqlite3_errmsg(db_);
+    bool result = false;
+    {
+        auto db = db_.writer();
+        auto stmt = db.prepare("INSERT INTO domains (domain) VALUES (?);");
+        if (!stmt) {
+            set_error(db.error());
+            return false;
+        }
+        result = stmt.bind(1, domain).step() == SQLITE_DONE;
+        if (!result) {
+            set_error(db.error());
+        }
     }
-
-    sqlite3_finalize(stmt);
+    forget_domain(domain, false);
     return result;
 }
 
 bool Authenticator::delete_domain(const std::string& domain) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    const char* sql = "DELETE FROM domains WHERE domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
+    bool result = false;
+    {
+        auto db = db_.writer();
+        auto stmt = db.prepare("DELETE FROM domains WHERE domain = ?;");
+        if (!stmt) {
+            return false;
+        }
+        result = stmt.bind(1, domain).step() == SQLITE_DONE && db.changes() > 0;
     }
-
-    sqlite3_bind_text(stmt, 1, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
-    return result && sqlite3_changes(db_) > 0;
+    // Its users went with it.
+    forget_domain(domain, true);
+    return result;
 }
 
 bool Authenticator::set_domain_active(const std::string& domain, bool active) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    const char* sql = "UPDATE domains SET active = ? WHERE domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
+    bool result = false;
+    {
+        auto db = db_.writer();
+        auto stmt = db.prepare("UPDATE domains SET active = ? WHERE domain = ?;");
+        if (!stmt) {
+            return false;
+        }
+        result = stmt.bind(1, int64_t{active ? 1 : 0}).bind(2, domain).step() == SQLITE_DONE;
     }
-
-    sqlite3_bind_int(stmt, 1, active ? 1 : 0);
-    sqlite3_bind_text(stmt, 2, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_DONE);
-    sqlite3_finalize(stmt);
+    forget_domain(domain, false);
     return result;
 }
 
 bool Authenticator::is_local_domain(const std::string& domain) {
-    // Note: Don't lock here since it's called from locked context
-    const char* sql = "SELECT 1 FROM domains WHERE domain = ? AND active = 1;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return false;
-    }
-
-    sqlite3_bind_text(stmt, 1, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    bool result = (sqlite3_step(stmt) == SQLITE_ROW);
-    sqlite3_finalize(stmt);
-    return result;
+    auto record = find_domain(domain);
+    return record && record->active;
 }
 
 std::optional<Domain> Authenticator::get_domain(const std::string& domain) {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    const char* sql = "SELECT id, domain, active FROM domains WHERE domain = ?;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-        return std::nullopt;
-    }
-
-    sqlite3_bind_text(stmt, 1, domain.c_str(), -1, SQLITE_TRANSIENT);
-
-    std::optional<Domain> result;
-    if (sqlite3_step(stmt) == SQLITE_ROW) {
-        Domain d;
-        d.id = sqlite3_column_int64(stmt, 0);
-        d.domain = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        d.active = sqlite3_column_int(stmt, 2) != 0;
-        result = d;
-    }
-
-    sqlite3_finalize(stmt);
-    return result;
+    return find_domain(domain);
 }
 
 std::vector<Domain> Authenticator::list_domains() {
-    std::lock_guard<std::mutex> lock(mutex_);
-
-    const char* sql = "SELECT id, domain, active FROM domains ORDER BY domain;";
-    sqlite3_stmt* stmt;
-
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+    auto db = db_.reader();
+    auto stmt = db.prepare("SELECT id, domain, active FROM domains ORDER BY domain;");
+    if (!stmt) {
         return {};
     }
 
     std::vector<Domain> domains;
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        Domain d;
-        d.id = sqlite3_column_int64(stmt, 0);
-        d.domain = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-        d.active = sqlite3_column_int(stmt, 2) != 0;
-        domains.push_back(d);
+    while (stmt.next()) {
+        domains.push_back(read_domain(stmt));
     }
-
-    sqlite3_finalize(stmt);
     return domains;
 }
 
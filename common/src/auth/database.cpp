@@ -0,0 +1,206 @@
+#include "auth/database.hpp"
+#include "logger.hpp"
+#include <sqlite3.h>
+#include <utility>
+
+namespace email {
+
+struct Database::Connection {
+    sqlite3* db = nullptr;
+    std::unordered_map<std::string, sqlite3_stmt*> statements;
+
+    ~Connection() {
+        for (auto& [sql, stmt] : statements) {
+            sqlite3_finalize(stmt);
+        }
+        if (db) {
+            sqlite3_close(db);
+        }
+    }
+};
+
+Database::Statement::~Statement() {
+    if (stmt_) {
+        sqlite3_reset(stmt_);
+        sqlite3_clear_bindings(stmt_);
+    }
+}
+
+Database::Statement::Statement(Statement&& other) noexcept
+    : stmt_(std::exchange(other.stmt_, nullptr)) {
+}
+
+Database::Statement& Database::Statement::bind(int index, std::string_view text) {
+    sqlite3_bind_text(stmt_, index, text.data(), static_cast<int>(text.size()), SQLITE_TRANSIENT);
+    return *this;
+}
+
+Database::Statement& Database::Statement::bind(int index, int64_t value) {
+    sqlite3_bind_int64(stmt_, index, value);
+    return *this;
+}
+
+int Database::Statement::step() {
+    return sqlite3_step(stmt_);
+}
+
+bool Database::Statement::next() {
+    return step() == SQLITE_ROW;
+}
+
+int64_t Database::Statement::column_int64(int index) const {
+    return sqlite3_column_int64(stmt_, index);
+}
+
+std::string Database::Statement::column_text(int index) const {
+    const auto* text = sqlite3_column_text(stmt_, index);
+    if (!text) {
+        return {};
+    }
+    return std::string(reinterpret_cast<const char*>(text),
+                       static_cast<size_t>(sqlite3_column_bytes(stmt_, index)));
+}
+
+Database::Lease::Lease(Database& database, Connection* connection, bool writer)
+    : database_(database), connection_(connection), writer_(writer) {
+    if (writer_) {
+        lock_ = std::unique_lock<std::mutex>(database_.writer_mutex_);
+    }
+}
+
+Database::Lease::~Lease() {
+    if (!writer_ && connection_) {
+        database_.release(connection_);
+    }
+}
+
+Database::Statement Database::Lease::prepare(const std::string& sql) {
+    auto& statements = connection_->statements;
+    if (auto it = statements.find(sql); it != statements.end()) {
+        return Statement(it->second);
+    }
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v3(connection_->db, sql.c_str(), -1, SQLITE_PREPARE_PERSISTENT,
+                           &stmt, nullptr) != SQLITE_OK) {
+        return Statement();
+    }
+    statements.emplace(sql, stmt);
+    return Statement(stmt);
+}
+
+bool Database::Lease::execute(const std::string& sql) {
+    char* err_msg = nullptr;
+    int rc = sqlite3_exec(connection_->db, sql.c_str(), nullptr, nullptr, &err_msg);
+    if (rc != SQLITE_OK) {
+        LOG_ERROR_FMT("SQL error: {}", err_msg ? err_msg : "unknown");
+        sqlite3_free(err_msg);
+        return false;
+    }
+    return true;
+}
+
+int Database::Lease::changes() const {
+    return sqlite3_changes(connection_->db);
+}
+
+std::string Database::Lease::error() const {
+    return sqlite3_errmsg(connection_->db);
+}
+
+Database::Database(std::filesystem::path path, size_t readers)
+    : path_(std::move(path)), max_readers_(readers) {
+}
+
+Database::~Database() = default;
+
+bool Database::open() {
+    if (auto parent = path_.parent_path(); !parent.empty()) {
+        std::error_code ec;
+        std::filesystem::create_directories(parent, ec);
+    }
+    writer_ = connect(false);
+    return writer_ != nullptr;
+}
+
+std::unique_ptr<Database::Connection> Database::connect(bool read_only) {
+    auto connection = std::make_unique<Connection>();
+    // Each connection is used by one thread at a time, under a lease.
+    const int flags = (read_only ? SQLITE_OPEN_READONLY : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE) |
+                      SQLITE_OPEN_NOMUTEX;
+    if (sqlite3_open_v2(path_.string().c_str(), &connection->db, flags, nullptr) != SQLITE_OK) {
+        last_error_ = std::string("Cannot open database: ") + sqlite3_errmsg(connection->db);
+        LOG_ERROR(last_error_);
+        return nullptr;
+    }
+
+    // Writers wait out each other's locks, e.g. the create_user tool's,
+    // instead of failing with SQLITE_BUSY.
+    sqlite3_busy_timeout(connection->db, 5000);
+    const char* pragmas = read_only
+        ? "PRAGMA cache_size=-2048;"
+          "PRAGMA temp_store=MEMORY;"
+        // NORMAL is durable in WAL mode except for the last commits before
+        // a power loss, and saves an fsync per write.
+        : "PRAGMA journal_mode=WAL;"
+          "PRAGMA synchronous=NORMAL;"
+          "PRAGMA foreign_keys=ON;"
+          "PRAGMA cache_size=-8192;"
+          "PRAGMA temp_store=MEMORY;";
+    char* err_msg = nullptr;
+    if (sqlite3_exec(connection->db, pragmas, nullptr, nullptr, &err_msg) != SQLITE_OK) {
+        LOG_WARNING_FMT("Cannot configure database connection: {}", err_msg ? err_msg : "unknown");
+        sqlite3_free(err_msg);
+    }
+    return connection;
+}
+
+Database::Lease Database::writer() {
+    return Lease(*this, writer_.get(), true);
+}
+
+Database::Lease Database::reader() {
+    std::unique_lock<std::mutex> lock(readers_mutex_);
+    for (;;) {
+        if (!idle_readers_.empty()) {
+            Connection* connection = idle_readers_.back();
+            idle_readers_.pop_back();
+            return Lease(*this, connection, false);
+        }
+        if (readers_.size() < max_readers_) {
+            auto connection = connect(true);
+            if (!connection) {
+                break;
+            }
+            readers_.push_back(std::move(connection));
+            return Lease(*this, readers_.back().get(), false);
+        }
+        if (max_readers_ == 0) {
+            break;
+        }
+        reader_free_.wait(lock);
+    }
+    lock.unlock();
+    return writer();
+}
+
+void Database::release(Connection* reader) {
+    {
+        std::lock_guard<std::mutex> lock(readers_mutex_);
+        idle_readers_.push_back(reader);
+    }
+    reader_free_.notify_one();
+}
+
+int64_t Database::data_version() {
+    auto lease = writer();
+    if (!lease) {
+        return -1;
+    }
+    auto stmt = lease.prepare("PRAGMA data_version;");
+    if (!stmt || !stmt.next()) {
+        return -1;
+    }
+    return stmt.column_int64(0);
+}
+
+}  // namespace email
@@ -91,6 +91,27 @@ void Config::parse_section(const std::string& section, const std::string& key,
         }
     };
 
+    // Threading and memory keys shared by the protocol sections
+    auto parse_server_common = [&](ServerConfig& server) {
+        if (key == "threads" || key == "thread_pool_size") {
+            server.thread_pool_size = static_cast<size_t>(to_int(value));
+        } else if (key == "per_core_io") {
+            server.per_core_io = to_bool(value);
+        } else if (key == "pin_threads") {
+            server.pin_threads = to_bool(value);
+        } else if (key == "memory_budget") {
+            server.memory_budget = static_cast<size_t>(to_int(value));
+        } else if (key == "connection_timeout") {
+            server.connection_timeout = std::chrono::seconds(to_int(value));
+        } else if (key == "idle_timeout") {
+            server.idle_timeout = std::chrono::seconds(to_int(value));
+        } else if (key == "metrics_port") {
+            server.metrics_port = static_cast<uint16_t>(to_int(value));
+        } else if (key == "metrics_address") {
+            server.metrics_address = value;
+        }
+    };
+
     if (section == "tls" || section == "ssl") {
         if (key == "certificate" || key == "cert_file") {
             tls_.certificate_file = value;
@@ -102,12 +123,22 @@ void Config::parse_section(const std::string& section, const std::string& key,
             tls_.ciphers = value;
         } else if (key == "verify_client") {
             tls_.verify_client = to_bool(value);
+        } else if (key == "session_cache_size") {
+            tls_.session_cache_size = static_cast<size_t>(to_int(value));
+        } else if (key == "session_timeout") {
+            tls_.session_timeout = to_int(value);
+        } else if (key == "ticket_key_lifetime") {
+            tls_.ticket_key_lifetime = to_int(value);
+        } else if (key == "ktls" || key == "enable_ktls") {
+            tls_.enable_ktls = to_bool(value);
         }
     } else if (section == "database") {
         if (key == "path") {
             database_.path = value;
         } else if (key == "pool_size") {
             database_.connection_pool_size = static_cast<size_t>(to_int(value));
+        } else if (key == "credential_cache_ttl") {
+            database_.credential_cache_ttl = to_int(value);
         }
     } else if (section == "storage") {
         if (key == "maildir_root" || key == "root") {
@@ -116,6 +147,14 @@ void Config::parse_section(const std::string& section, const std::string& key,
             storage_.default_quota_bytes = static_cast<size_t>(to_int(value));
         } else if (key == "create_directories") {
             storage_.create_directories = to_bool(value);
+        } else if (key == "usage_reconcile_interval") {
+            storage_.usage_reconcile_interval = to_int(value);
+        } else if (key == "compression_level") {
+            storage_.compression_level = to_int(value);
+        } else if (key == "recompress_batch") {
+            storage_.recompress_batch = static_cast<size_t>(to_int(value));
+        } else if (key == "snapshot_cache_size") {
+            storage_.snapshot_cache_size = static_cast<size_t>(to_int(value));
         }
     } else if (section == "log" || section == "logging") {
         if (key == "level") {
@@ -150,6 +189,8 @@ void Config::parse_section(const std::string& section, const std::string& key,
             smtp_.max_connections = static_cast<size_t>(to_int(value));
         } else if (key == "max_message_size") {
             smtp_.max_message_size = static_cast<size_t>(to_int(value));
+        } else if (key == "data_spool_threshold") {
+            smtp_.data_spool_threshold = static_cast<size_t>(to_int(value));
         } else if (key == "max_recipients") {
             smtp_.max_recipients = static_cast<size_t>(to_int(value));
         } else if (key == "require_auth") {
@@ -158,8 +199,27 @@ void Config::parse_section(const std::string& section, const std::string& key,
             smtp_.allow_relay = to_bool(value);
         } else if (key == "enable_starttls") {
             smtp_.enable_starttls = to_bool(value);
+        } else if (key == "spool_directory") {
+            smtp_.spool_directory = value;
+        } else if (key == "delivery_workers") {
+            smtp_.delivery_workers = static_cast<size_t>(to_int(value));
+        } else if (key == "max_per_destination") {
+            smtp_.max_per_destination = static_cast<size_t>(to_int(value));
+        } else if (key == "retry_interval") {
+            smtp_.retry_interval = to_int(value);
+        } else if (key == "max_retries") {
+            smtp_.max_retries = to_int(value);
+        } else if (key == "relay_connections_per_host") {
+            smtp_.relay_connections_per_host = static_cast<size_t>(to_int(value));
+        } else if (key == "relay_idle_connections") {
+            smtp_.relay_idle_connections = static_cast<size_t>(to_int(value));
+        } else if (key == "relay_idle_timeout") {
+            smtp_.relay_idle_timeout = to_int(value);
+        } else if (key == "relay_starttls") {
+            smtp_.relay_starttls = to_bool(value);
         } else if (key == "local_domains") {
             // Parse comma-separated list
+            smtp_.local_domains.clear();
             std::istringstream iss(value);
             std::string domain;
             while (std::getline(iss, domain, ',')) {
@@ -169,6 +229,8 @@ void Config::parse_section(const std::string& section, const std::string& key,
                     smtp_.local_domains.push_back(domain.substr(start, end - start + 1));
                 }
             }
+        } else {
+            parse_server_common(smtp_);
         }
     } else if (section == "pop3") {
         if (key == "bind_address" || key == "address") {
@@ -181,6 +243,8 @@ void Config::parse_section(const std::string& section, const std::string& key,
             pop3_.max_connections = static_cast<size_t>(to_int(value));
         } else if (key == "enable_starttls") {
             pop3_.enable_starttls = to_bool(value);
+        } else {
+            parse_server_common(pop3_);
         }
     } else if (section == "imap") {
         if (key == "bind_address" || key == "address") {
@@ -195,8 +259,36 @@ void Config::parse_section(const std::string& section, const std::string& key,
             imap_.enable_starttls = to_bool(value);
         } else if (key == "max_search_results") {
             imap_.max_search_results = static_cast<size_t>(to_int(value));
+        } else if (key == "max_command_size") {
+            imap_.max_command_size = static_cast<size_t>(to_int(value));
         } else if (key == "enable_idle") {
             imap_.enable_idle = to_bool(value);
+        } else if (key == "enable_compress") {
+            imap_.enable_compress = to_bool(value);
+        } else if (key == "compress_level") {
+            imap_.compress_level = to_int(value);
+        } else if (key == "compress_window_bits") {
+            imap_.compress_window_bits = to_int(value);
+        } else if (key == "compress_mem_level") {
+            imap_.compress_mem_level = to_int(value);
+        } else {
+            parse_server_common(imap_);
+        }
+    } else if (section == "daemon") {
+        if (key == "smtp") {
+            daemon_.smtp = to_bool(value);
+        } else if (key == "pop3") {
+            daemon_.pop3 = to_bool(value);
+        } else if (key == "imap") {
+            daemon_.imap = to_bool(value);
+        } else if (key == "io_threads" || key == "threads") {
+            daemon_.io_threads = static_cast<size_t>(to_int(value));
+        } else if (key == "pin_threads") {
+            daemon_.pin_threads = to_bool(value);
+        } else if (key == "metrics_port") {
+            daemon_.metrics_port = static_cast<uint16_t>(to_int(value));
+        } else if (key == "metrics_address") {
+            daemon_.metrics_address = value;
         }
     } else {
         // Store in custom values
@@ -1,94 +1,290 @@
 #include "logger.hpp"
-#include <iostream>
-#include <iomanip>
+#include <array>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
+#include <iostream>
+#include <iterator>
+#include <time.h>
 
 namespace email {
 
+struct Logger::Record {
+    LogLevel level = LogLevel::Info;
+    const char* file = "";
+    uint32_t line = 0;
+    std::chrono::system_clock::time_point time;
+    std::string message;
+};
+
+// A single-producer, single-consumer queue: the thread that owns it pushes,
+// the writer pops. Slots are reused, so their strings keep their capacity.
+struct Logger::Ring {
+    static constexpr size_t capacity = 1024;  // A power of two
+
+    std::array<Record, capacity> slots;
+    alignas(64) std::atomic<size_t> head{0};  // Next to push; owner's
+    alignas(64) std::atomic<size_t> tail{0};  // Next to pop; writer's
+    std::atomic<bool> orphaned{false};        // Owner has exited
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+namespace {
+
+// How long the writer sleeps when no one asks for it; producers only wake
+// it when their ring fills up or something must go out now.
+constexpr std::chrono::milliseconds writer_interval{20};
+
+// Keeps this thread's ring registered while it lives.
+struct RingOwner {
+    std::shared_ptr<void> ring;
+    std::atomic<bool>* orphaned = nullptr;
+
+    ~RingOwner() {
+        if (orphaned) {
+            orphaned->store(true, std::memory_order_release);
+        }
+    }
+};
+
+// The coarse clock is read from memory without a system call, and its few
+// milliseconds of resolution are plenty for log lines.
+std::chrono::system_clock::time_point coarse_now() {
+#ifdef CLOCK_REALTIME_COARSE
+    timespec ts;
+    if (clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+        return std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec)));
+    }
+#endif
+    return std::chrono::system_clock::now();
+}
+
+}  // namespace
+
 Logger& Logger::instance() {
     static Logger instance;
     return instance;
 }
 
+Logger::Logger() : writer_([this] { run(); }) {
+}
+
+Logger::~Logger() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+}
+
 void Logger::init(LogLevel level, bool console, const std::filesystem::path& file,
                   size_t max_file_size, size_t max_files) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    {
+        std::lock_guard<std::mutex> lock(output_mutex_);
 
-    level_ = level;
-    console_ = console;
-    max_file_size_ = max_file_size;
-    max_files_ = max_files;
+        set_level(level);
+        console_ = console;
+        max_file_size_ = max_file_size;
+        max_files_ = max_files;
 
-    if (!file.empty()) {
-        log_file_ = file;
-        // Create parent directories if they don't exist
-        if (auto parent = file.parent_path(); !parent.empty()) {
-            std::filesystem::create_directories(parent);
-        }
-        file_stream_.open(file, std::ios::app);
         if (file_stream_.is_open()) {
-            current_size_ = std::filesystem::file_size(file);
+            file_stream_.close();
         }
+        log_file_ = file;
+        current_size_ = 0;
+        if (!file.empty()) {
+            // Create parent directories if they don't exist
+            if (auto parent = file.parent_path(); !parent.empty()) {
+                std::filesystem::create_directories(parent);
+            }
+            file_stream_.open(file, std::ios::app);
+            if (file_stream_.is_open()) {
+                current_size_ = std::filesystem::file_size(file);
+            }
+        }
+    }
+
+    if (static_cast<int>(level) < EMAIL_LOG_MIN_LEVEL) {
+        LOG_WARNING_FMT("Log level {} requested, but this build leaves out messages below {}",
+                        level_to_string(level),
+                        level_to_string(static_cast<LogLevel>(EMAIL_LOG_MIN_LEVEL)));
     }
 }
 
 void Logger::trace(std::string_view msg, const std::source_location& loc) {
-    if (LogLevel::Trace >= level_) {
+    if (LogLevel::Trace >= level()) {
         write(LogLevel::Trace, loc, std::string(msg));
     }
 }
 
 void Logger::debug(std::string_view msg, const std::source_location& loc) {
-    if (LogLevel::Debug >= level_) {
+    if (LogLevel::Debug >= level()) {
         write(LogLevel::Debug, loc, std::string(msg));
     }
 }
 
 void Logger::info(std::string_view msg, const std::source_location& loc) {
-    if (LogLevel::Info >= level_) {
+    if (LogLevel::Info >= level()) {
         write(LogLevel::Info, loc, std::string(msg));
     }
 }
 
 void Logger::warning(std::string_view msg, const std::source_location& loc) {
-    if (LogLevel::Warning >= level_) {
+    if (LogLevel::Warning >= level()) {
         write(LogLevel::Warning, loc, std::string(msg));
     }
 }
 
 void Logger::error(std::string_view msg, const std::source_location& loc) {
-    if (LogLevel::Error >= level_) {
+    if (LogLevel::Error >= level()) {
         write(LogLevel::Error, loc, std::string(msg));
     }
 }
 
 void Logger::fatal(std::string_view msg, const std::source_location& loc) {
-    if (LogLevel::Fatal >= level_) {
+    if (LogLevel::Fatal >= level()) {
         write(LogLevel::Fatal, loc, std::string(msg));
     }
 }
 
-void Logger::write(LogLevel level, const std::source_location& loc, const std::string& message) {
-    std::lock_guard<std::mutex> lock(mutex_);
+Logger::Ring& Logger::local_ring() {
+    thread_local RingOwner owner;
+    if (!owner.ring) {
+        auto ring = std::make_shared<Ring>();
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            rings_.push_back(ring);
+        }
+        owner.orphaned = &ring->orphaned;
+        owner.ring = std::move(ring);
+    }
+    return *static_cast<Ring*>(owner.ring.get());
+}
+
+void Logger::write(LogLevel level, const std::source_location& loc, std::string message) {
+    Ring& ring = local_ring();
+    const size_t head = ring.head.load(std::memory_order_relaxed);
+    while (head - ring.tail.load(std::memory_order_acquire) >= Ring::capacity) {
+        if (level < LogLevel::Warning &&
+            overflow_.load(std::memory_order_relaxed) == LogOverflow::Drop) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        wake_writer();
+        std::this_thread::yield();
+    }
+
+    Record& record = ring.slots[head & (Ring::capacity - 1)];
+    record.level = level;
+    record.file = loc.file_name();
+    record.line = loc.line();
+    record.time = coarse_now();
+    record.message.swap(message);
+    ring.head.store(head + 1, std::memory_order_release);
+
+    if (level == LogLevel::Fatal) {
+        flush();
+    } else if (head - ring.tail.load(std::memory_order_relaxed) + 1 == Ring::capacity / 2) {
+        wake_writer();
+    }
+}
+
+void Logger::wake_writer() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex_);
+        wake_requested_ = true;
+    }
+    wake_.notify_one();
+}
+
+void Logger::flush() {
+    std::unique_lock<std::mutex> lock(wake_mutex_);
+    const uint64_t ticket = ++flush_requested_;
+    wake_.notify_one();
+    flushed_.wait(lock, [&] { return flush_done_ >= ticket || stopping_; });
+}
+
+void Logger::run() {
+    for (;;) {
+        uint64_t requested;
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(wake_mutex_);
+            wake_.wait_for(lock, writer_interval, [&] {
+                return stopping_ || wake_requested_ || flush_requested_ > flush_done_;
+            });
+            // Cleared before the drain, so a ring filling during it gets
+            // another pass rather than waiting out the interval.
+            wake_requested_ = false;
+            requested = flush_requested_;
+            stopping = stopping_;
+        }
+
+        std::vector<std::shared_ptr<Ring>> rings;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex_);
+            // Rings of exited threads go once the writer has emptied them.
+            std::erase_if(rings_, [](const auto& ring) {
+                return ring->orphaned.load(std::memory_order_acquire) && ring->empty();
+            });
+            rings = rings_;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(output_mutex_);
+            for (auto& ring : rings) {
+                size_t tail = ring->tail.load(std::memory_order_relaxed);
+                const size_t head = ring->head.load(std::memory_order_acquire);
+                for (; tail != head; ++tail) {
+                    format(ring->slots[tail & (Ring::capacity - 1)]);
+                    // Free each slot at once, so a producer waiting on a
+                    // full ring can go on.
+                    ring->tail.store(tail + 1, std::memory_order_release);
+                }
+            }
+            if (size_t dropped = dropped_.exchange(0, std::memory_order_relaxed)) {
+                Record record{LogLevel::Warning, __FILE__, __LINE__, coarse_now(),
+                              std::format("{} log messages dropped, queue full", dropped)};
+                format(record);
+            }
+            output();
+        }
 
-    std::string timestamp = get_timestamp();
-    std::string level_str = level_to_string(level);
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex_);
+            flush_done_ = requested;
+        }
+        flushed_.notify_all();
+        if (stopping) {
+            return;
+        }
+    }
+}
 
+void Logger::format(const Record& record) {
     // Extract just the filename from the full path
-    std::filesystem::path file_path(loc.file_name());
-    std::string filename = file_path.filename().string();
+    std::string_view filename = record.file;
+    if (auto slash = filename.rfind('/'); slash != std::string_view::npos) {
+        filename.remove_prefix(slash + 1);
+    }
 
-    std::string formatted = std::format("[{}] [{}] [{}:{}] {}",
-                                        timestamp, level_str,
-                                        filename, loc.line(),
-                                        message);
+    line_.clear();
+    std::format_to(std::back_inserter(line_), "[{}] [{}] [{}:{}] {}",
+                   timestamp(record.time), level_to_string(record.level),
+                   filename, record.line, record.message);
 
     if (console_) {
         // Color output for console
         const char* color = "";
         const char* reset = "\033[0m";
 
-        switch (level) {
+        switch (record.level) {
             case LogLevel::Trace:   color = "\033[90m"; break;  // Gray
             case LogLevel::Debug:   color = "\033[36m"; break;  // Cyan
             case LogLevel::Info:    color = "\033[32m"; break;  // Green
@@ -97,14 +293,28 @@ void Logger::write(LogLevel level, const std::source_location& loc, const std::s
             case LogLevel::Fatal:   color = "\033[35m"; break;  // Magenta
         }
 
-        std::cerr << color << formatted << reset << "\n";
+        console_batch_.append(color).append(line_).append(reset).append("\n");
     }
 
     if (file_stream_.is_open()) {
-        rotate_if_needed();
-        file_stream_ << formatted << "\n";
-        file_stream_.flush();
-        current_size_ += formatted.length() + 1;
+        file_batch_.append(line_).append("\n");
+    }
+}
+
+void Logger::output() {
+    if (!console_batch_.empty()) {
+        std::cerr.write(console_batch_.data(), static_cast<std::streamsize>(console_batch_.size()));
+        std::cerr.flush();
+        console_batch_.clear();
+    }
+    if (!file_batch_.empty()) {
+        if (file_stream_.is_open()) {
+            rotate_if_needed();
+            file_stream_.write(file_batch_.data(), static_cast<std::streamsize>(file_batch_.size()));
+            file_stream_.flush();
+            current_size_ += file_batch_.size();
+        }
+        file_batch_.clear();
     }
 }
 
@@ -152,23 +362,28 @@ std::string Logger::level_to_string(LogLevel level) const {
     return "UNKNOWN";
 }
 
-std::string Logger::get_timestamp() const {
-    auto now = std::chrono::system_clock::now();
-    auto time_t_now = std::chrono::system_clock::to_time_t(now);
-    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
-        now.time_since_epoch()) % 1000;
-
-    std::tm tm_now;
+std::string_view Logger::timestamp(std::chrono::system_clock::time_point time) {
+    const auto since_epoch = time.time_since_epoch();
+    const int64_t second = std::chrono::duration_cast<std::chrono::seconds>(since_epoch).count();
+    // The date and time are formatted once a second; only the milliseconds
+    // change in between.
+    if (second != stamped_second_) {
+        stamped_second_ = second;
+        const auto time_t_now = static_cast<std::time_t>(second);
+        std::tm tm_now;
 #ifdef _WIN32
-    localtime_s(&tm_now, &time_t_now);
+        localtime_s(&tm_now, &time_t_now);
 #else
-    localtime_r(&time_t_now, &tm_now);
+        localtime_r(&time_t_now, &tm_now);
 #endif
-
-    std::ostringstream oss;
-    oss << std::put_time(&tm_now, "%Y-%m-%d %H:%M:%S")
-        << '.' << std::setfill('0') << std::setw(3) << ms.count();
-    return oss.str();
+        std::strftime(stamp_, sizeof(stamp_), "%Y-%m-%d %H:%M:%S.000", &tm_now);
+    }
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count() % 1000;
+    const size_t length = std::strlen(stamp_);
+    stamp_[length - 3] = static_cast<char>('0' + ms / 100);
+    stamp_[length - 2] = static_cast<char>('0' + ms / 10 % 10);
+    stamp_[length - 1] = static_cast<char>('0' + ms % 10);
+    return {stamp_, length};
 }
 
 }  // namespace email
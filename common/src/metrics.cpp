@@ -0,0 +1,246 @@
+#include "metrics.hpp"
+#include <algorithm>
+#include <bit>
+#include <format>
+#include <iterator>
+
+namespace email {
+
+namespace {
+
+// Bucket bounds of exported histograms, in seconds.
+constexpr double export_bounds[] = {
+    0.00001, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+    0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10,
+};
+
+void append_escaped(std::string& out, const std::string& value) {
+    for (char c : value) {
+        switch (c) {
+            case '\\': out += "\\\\"; break;
+            case '"':  out += "\\\""; break;
+            case '\n': out += "\\n"; break;
+            default:   out += c;
+        }
+    }
+}
+
+// `{a="1",b="2"}` with `extra` added last, or nothing without labels.
+std::string format_labels(const MetricLabels& labels, const std::string& extra = {}) {
+    if (labels.empty() && extra.empty()) {
+        return {};
+    }
+    std::string out = "{";
+    for (const auto& [key, value] : labels) {
+        if (out.size() > 1) {
+            out += ',';
+        }
+        out += key;
+        out += "=\"";
+        append_escaped(out, value);
+        out += '"';
+    }
+    if (!extra.empty()) {
+        if (out.size() > 1) {
+            out += ',';
+        }
+        out += extra;
+    }
+    out += '}';
+    return out;
+}
+
+}  // namespace
+
+size_t metric_stripe() {
+    static std::atomic<size_t> next{0};
+    thread_local const size_t stripe = next.fetch_add(1, std::memory_order_relaxed) % metric_stripes;
+    return stripe;
+}
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const auto& stripe : stripes_) {
+        total += stripe.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+size_t Histogram::bucket_of(uint64_t ns) {
+    constexpr uint64_t sub_count = 1u << sub_bits;
+    if (ns < sub_count) {
+        return static_cast<size_t>(ns);
+    }
+    ns = std::min<uint64_t>(ns, (uint64_t{1} << max_bits) - 1);
+    const int exponent = std::bit_width(ns) - 1;
+    const uint64_t sub = (ns >> (exponent - sub_bits)) & (sub_count - 1);
+    return static_cast<size_t>(sub_count * (exponent - sub_bits + 1) + sub);
+}
+
+uint64_t Histogram::bucket_end(size_t bucket) {
+    constexpr uint64_t sub_count = 1u << sub_bits;
+    if (bucket < sub_count) {
+        return bucket + 1;
+    }
+    const uint64_t exponent = (bucket - sub_count) / sub_count + sub_bits;
+    const uint64_t sub = bucket % sub_count;
+    return (sub_count + sub + 1) << (exponent - sub_bits);
+}
+
+void Histogram::record(std::chrono::nanoseconds duration) {
+    const auto ns = static_cast<uint64_t>(std::max<int64_t>(duration.count(), 0));
+    Stripe& stripe = stripes_[metric_stripe()];
+    stripe.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    stripe.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snapshot;
+    for (const auto& stripe : stripes_) {
+        for (size_t i = 0; i < bucket_count; ++i) {
+            snapshot.buckets[i] += stripe.buckets[i].load(std::memory_order_relaxed);
+        }
+        snapshot.sum_ns += stripe.sum_ns.load(std::memory_order_relaxed);
+    }
+    for (uint64_t n : snapshot.buckets) {
+        snapshot.count += n;
+    }
+    return snapshot;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+    if (count == 0) {
+        return 0;
+    }
+    const auto rank = static_cast<uint64_t>(std::clamp(q, 0.0, 1.0) * static_cast<double>(count - 1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; ++i) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return bucket_end(i);
+        }
+    }
+    return bucket_end(bucket_count - 1);
+}
+
+Metrics::Probe::~Probe() {
+    if (id_) {
+        Metrics::instance().remove_probe(id_);
+    }
+}
+
+Metrics::Probe& Metrics::Probe::operator=(Probe&& other) noexcept {
+    if (this != &other) {
+        if (id_) {
+            Metrics::instance().remove_probe(id_);
+        }
+        id_ = std::exchange(other.id_, 0);
+    }
+    return *this;
+}
+
+Metrics& Metrics::instance() {
+    static Metrics instance;
+    return instance;
+}
+
+template<typename T>
+T& Metrics::find_or_add(const std::string& name, const std::string& help, const char* type,
+                        MetricLabels labels) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& family = families_[name];
+    if (family.type.empty()) {
+        family.help = help;
+        family.type = type;
+    }
+    for (auto& [existing, series] : family.series) {
+        if (auto* metric = std::get_if<std::unique_ptr<T>>(&series); metric && existing == labels) {
+            return **metric;
+        }
+    }
+    auto metric = std::make_unique<T>();
+    T& result = *metric;
+    family.series.emplace_back(std::move(labels), std::move(metric));
+    return result;
+}
+
+Counter& Metrics::counter(const std::string& name, const std::string& help, MetricLabels labels) {
+    return find_or_add<Counter>(name, help, "counter", std::move(labels));
+}
+
+Gauge& Metrics::gauge(const std::string& name, const std::string& help, MetricLabels labels) {
+    return find_or_add<Gauge>(name, help, "gauge", std::move(labels));
+}
+
+Histogram& Metrics::histogram(const std::string& name, const std::string& help, MetricLabels labels) {
+    return find_or_add<Histogram>(name, help, "histogram", std::move(labels));
+}
+
+Metrics::Probe Metrics::probe(const std::string& name, const std::string& help,
+                              MetricLabels labels, std::function<double()> read) {
+    // Probes are never shared: each gets a series of its own, even under
+    // the same labels.
+    std::lock_guard<std::mutex> lock(mutex_);
+    const uint64_t id = next_probe_++;
+    auto& family = families_[name];
+    if (family.type.empty()) {
+        family.help = help;
+        family.type = "gauge";
+    }
+    family.series.emplace_back(std::move(labels), ProbeFunction{id, std::move(read)});
+    return Probe(id);
+}
+
+void Metrics::remove_probe(uint64_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& [name, family] : families_) {
+        std::erase_if(family.series, [id](const auto& series) {
+            const auto* probe = std::get_if<ProbeFunction>(&series.second);
+            return probe && probe->id == id;
+        });
+    }
+}
+
+std::string Metrics::render() const {
+    std::string out;
+    auto line = std::back_inserter(out);
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [name, family] : families_) {
+        if (family.series.empty()) {
+            continue;
+        }
+        std::format_to(line, "# HELP {} {}\n# TYPE {} {}\n", name, family.help, name, family.type);
+        for (const auto& [labels, value] : family.series) {
+            if (const auto* counter = std::get_if<std::unique_ptr<Counter>>(&value)) {
+                std::format_to(line, "{}{} {}\n", name, format_labels(labels), (*counter)->value());
+            } else if (const auto* gauge = std::get_if<std::unique_ptr<Gauge>>(&value)) {
+                std::format_to(line, "{}{} {}\n", name, format_labels(labels), (*gauge)->value());
+            } else if (const auto* probe = std::get_if<ProbeFunction>(&value)) {
+                std::format_to(line, "{}{} {}\n", name, format_labels(labels), probe->read());
+            } else {
+                const auto snapshot = std::get<std::unique_ptr<Histogram>>(value)->snapshot();
+                // A bucket is counted under the first bound it lies wholly
+                // below, so the counts are as exact as the buckets.
+                size_t bucket = 0;
+                uint64_t cumulative = 0;
+                for (double bound : export_bounds) {
+                    const auto bound_ns = static_cast<uint64_t>(bound * 1e9);
+                    for (; bucket < Histogram::bucket_count &&
+                           Histogram::bucket_end(bucket) <= bound_ns + 1; ++bucket) {
+                        cumulative += snapshot.buckets[bucket];
+                    }
+                    std::format_to(line, "{}_bucket{} {}\n", name,
+                                   format_labels(labels, std::format("le=\"{}\"", bound)), cumulative);
+                }
+                std::format_to(line, "{}_bucket{} {}\n", name,
+                               format_labels(labels, "le=\"+Inf\""), snapshot.count);
+                std::format_to(line, "{}_sum{} {}\n", name, format_labels(labels),
+                               static_cast<double>(snapshot.sum_ns) / 1e9);
+                std::format_to(line, "{}_count{} {}\n", name, format_labels(labels), snapshot.count);
+            }
+        }
+    }
+    return out;
+}
+
+}  // namespace email
@@ -0,0 +1,193 @@
+#include "net/coro_session.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <exception>
+#include <thread>
+#include <boost/asio/redirect_error.hpp>
+
+namespace email {
+
+asio::thread_pool& blocking_pool() {
+    static asio::thread_pool pool(std::max(2u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+void CoroSession::stop() {
+    Session::stop();
+    // stop() may come from another thread (e.g. Server::stop()); the wakeup
+    // state belongs to the strand.
+    auto self = shared_from_this();
+    asio::dispatch(strand_, [this, self]() { wake(); });
+}
+
+void CoroSession::do_read() {
+    if (stopped_) return;
+
+    if (spawned_) {
+        wake();
+        return;
+    }
+    spawned_ = true;
+
+    auto self = std::static_pointer_cast<CoroSession>(shared_from_this());
+    asio::co_spawn(strand_, execute(self), [self](std::exception_ptr error) {
+        if (!error) return;
+        try {
+            std::rethrow_exception(error);
+        } catch (const std::exception& e) {
+            LOG_ERROR_FMT("Session coroutine failed: {}", e.what());
+        }
+        self->stop();
+    });
+}
+
+void CoroSession::on_write_drained() {
+    wake();
+}
+
+asio::awaitable<void> CoroSession::execute(std::shared_ptr<CoroSession> /* self */) {
+    // `self` keeps the session alive for as long as the coroutine runs.
+    co_await run();
+    if (!stopped_) {
+        close_after_flush();
+    }
+}
+
+void CoroSession::wake() {
+    if (waiting_) {
+        wakeup_.cancel();
+    } else {
+        wake_pending_ = true;
+    }
+}
+
+asio::awaitable<void> CoroSession::wait_for_wakeup() {
+    if (std::exchange(wake_pending_, false)) {
+        co_return;
+    }
+    waiting_ = true;
+    wakeup_.expires_at(asio::steady_timer::time_point::max());
+    boost::system::error_code ec;
+    co_await wakeup_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    waiting_ = false;
+    wake_pending_ = false;
+}
+
+asio::awaitable<std::optional<std::string>> CoroSession::read_line() {
+    for (;;) {
+        if (stopped_) {
+            co_return std::nullopt;
+        }
+
+        if (tls_handshake_pending_) {
+            // Anything pipelined behind STARTTLS was sent in the clear and
+            // must not be interpreted once the channel is encrypted.
+            read_begin_ = read_end_ = line_scanned_ = 0;
+            co_await wait_for_wakeup();
+            continue;
+        }
+        if (input_switch_pending_) {
+            line_scanned_ = 0;
+            if (!switch_input()) {
+                LOG_WARNING_FMT("Undecodable input from {}, closing connection",
+                                remote_address());
+                stop();
+                co_return std::nullopt;
+            }
+        }
+        if (write_backlogged()) {
+            co_await wait_for_wakeup();
+            continue;
+        }
+
+        std::string_view pending(read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+        auto newline = pending.find('\n', line_scanned_);
+        if (newline != std::string_view::npos) {
+            auto line = pending.substr(0, newline);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            std::string result(line);
+            read_begin_ += newline + 1;
+            line_scanned_ = 0;
+            co_return result;
+        }
+
+        line_scanned_ = pending.size();
+        if (line_scanned_ > max_line_length()) {
+            LOG_WARNING_FMT("Line from {} exceeds {} bytes, closing connection",
+                            remote_address(), max_line_length());
+            stop();
+            co_return std::nullopt;
+        }
+
+        if (trim_read_buffer()) {
+            // Idle under memory pressure: hold no buffer until there is
+            // something to read.
+            boost::system::error_code ec;
+#ifdef ENABLE_TLS
+            co_await std::get<PlainSocket>(socket_).async_wait(
+                tcp::socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+#else
+            co_await socket_.async_wait(
+                tcp::socket::wait_read, asio::redirect_error(asio::use_awaitable, ec));
+#endif
+            if (stopped_) {
+                co_return std::nullopt;
+            }
+            if (ec) {
+                on_error(ec);
+                stop();
+                co_return std::nullopt;
+            }
+        }
+
+        prepare_read_buffer();
+        auto buffer = read_target();
+
+        boost::system::error_code ec;
+        std::size_t bytes_transferred = 0;
+#ifdef ENABLE_TLS
+        if (is_tls_) {
+            bytes_transferred = co_await std::get<SSLSocket>(socket_).async_read_some(
+                buffer, asio::redirect_error(asio::use_awaitable, ec));
+        } else {
+            bytes_transferred = co_await std::get<PlainSocket>(socket_).async_read_some(
+                buffer, asio::redirect_error(asio::use_awaitable, ec));
+        }
+#else
+        bytes_transferred = co_await socket_.async_read_some(
+            buffer, asio::redirect_error(asio::use_awaitable, ec));
+#endif
+        if (stopped_) {
+            co_return std::nullopt;
+        }
+        if (ec) {
+            on_error(ec);
+            stop();
+            co_return std::nullopt;
+        }
+
+        reset_timeout();
+        if (!take_read(bytes_transferred)) {
+            LOG_WARNING_FMT("Undecodable input from {}, closing connection", remote_address());
+            stop();
+            co_return std::nullopt;
+        }
+    }
+}
+
+asio::awaitable<void> CoroSession::write(std::string data) {
+    send(std::move(data));
+    while (!stopped_ && write_backlogged()) {
+        co_await wait_for_wakeup();
+    }
+}
+
+asio::awaitable<void> CoroSession::write_line(std::string line) {
+    line.append("\r\n");
+    co_await write(std::move(line));
+}
+
+}  // namespace email
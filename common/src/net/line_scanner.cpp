@@ -0,0 +1,134 @@
+#include "net/line_scanner.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define EMAIL_SCAN_SSE2 1
+#if defined(__GNUC__)
+#define EMAIL_SCAN_AVX2 1
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define EMAIL_SCAN_NEON 1
+#endif
+
+namespace email {
+
+namespace {
+
+// Receives newline offsets in ascending order and turns them into lines.
+struct LineSink {
+    const char* data;
+    std::size_t line_start;
+    std::vector<std::string_view>& lines;
+
+    void operator()(std::size_t newline) {
+        std::size_t end = newline;
+        if (end > line_start && data[end - 1] == '\r') {
+            --end;
+        }
+        lines.emplace_back(data + line_start, end - line_start);
+        line_start = newline + 1;
+    }
+};
+
+inline void emit_mask(uint64_t mask, std::size_t base, LineSink& sink) {
+    while (mask) {
+        sink(base + static_cast<std::size_t>(__builtin_ctzll(mask)));
+        mask &= mask - 1;
+    }
+}
+
+std::size_t scan_scalar(const char* data, std::size_t pos, std::size_t size, LineSink& sink) {
+    while (pos < size) {
+        const void* hit = std::memchr(data + pos, '\n', size - pos);
+        if (!hit) break;
+        std::size_t newline = static_cast<std::size_t>(static_cast<const char*>(hit) - data);
+        sink(newline);
+        pos = newline + 1;
+    }
+    return size;
+}
+
+#ifdef EMAIL_SCAN_SSE2
+std::size_t scan_sse2(const char* data, std::size_t pos, std::size_t size, LineSink& sink) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline)));
+        emit_mask(mask, pos, sink);
+    }
+    return scan_scalar(data, pos, size, sink);
+}
+#endif
+
+#ifdef EMAIL_SCAN_AVX2
+__attribute__((target("avx2")))
+std::size_t scan_avx2(const char* data, std::size_t pos, std::size_t size, LineSink& sink) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; pos + 64 <= size; pos += 64) {
+        __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos + 32));
+        auto lo_mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, newline)));
+        auto hi_mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, newline)));
+        emit_mask((static_cast<uint64_t>(hi_mask) << 32) | lo_mask, pos, sink);
+    }
+    return scan_sse2(data, pos, size, sink);
+}
+
+bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+#endif
+
+#ifdef EMAIL_SCAN_NEON
+std::size_t scan_neon(const char* data, std::size_t pos, std::size_t size, LineSink& sink) {
+    const uint8x16_t newline = vdupq_n_u8('\n');
+    for (; pos + 16 <= size; pos += 16) {
+        uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t*>(data + pos));
+        uint8x16_t eq = vceqq_u8(chunk, newline);
+        // Narrow each byte to a nibble: bit 4*i is set when byte i matched.
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+        mask &= 0x1111111111111111ULL;
+        while (mask) {
+            sink(pos + static_cast<std::size_t>(__builtin_ctzll(mask)) / 4);
+            mask &= mask - 1;
+        }
+    }
+    return scan_scalar(data, pos, size, sink);
+}
+#endif
+
+std::size_t scan(const char* data, std::size_t pos, std::size_t size, LineSink& sink) {
+#if defined(EMAIL_SCAN_AVX2)
+    if (cpu_has_avx2()) {
+        return scan_avx2(data, pos, size, sink);
+    }
+    return scan_sse2(data, pos, size, sink);
+#elif defined(EMAIL_SCAN_SSE2)
+    return scan_sse2(data, pos, size, sink);
+#elif defined(EMAIL_SCAN_NEON)
+    return scan_neon(data, pos, size, sink);
+#else
+    return scan_scalar(data, pos, size, sink);
+#endif
+}
+
+}  // namespace
+
+std::size_t split_lines(std::string_view buffer,
+                        std::vector<std::string_view>& lines,
+                        std::size_t clean_prefix) {
+    if (clean_prefix > buffer.size()) {
+        clean_prefix = buffer.size();
+    }
+    LineSink sink{buffer.data(), 0, lines};
+    scan(buffer.data(), clean_prefix, buffer.size(), sink);
+    return sink.line_start;
+}
+
+}  // namespace email
@@ -0,0 +1,118 @@
+#include "net/metrics_exporter.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include <istream>
+#include <memory>
+
+namespace email {
+
+namespace {
+
+// A request larger than this, or slower than scrape_timeout, is dropped.
+constexpr std::size_t max_request_size = 8192;
+constexpr std::chrono::seconds scrape_timeout{10};
+
+struct Scrape {
+    explicit Scrape(tcp::socket s)
+        : socket(std::move(s)), timer(socket.get_executor()), request(max_request_size) {}
+
+    tcp::socket socket;
+    asio::steady_timer timer;
+    asio::streambuf request;
+    std::string response;
+};
+
+std::string http_response(const char* status, const std::string& body,
+                          const char* content_type = "text/plain; charset=utf-8") {
+    return std::string("HTTP/1.1 ") + status + "\r\n"
+           "Content-Type: " + content_type + "\r\n"
+           "Content-Length: " + std::to_string(body.size()) + "\r\n"
+           "Connection: close\r\n\r\n" + body;
+}
+
+}  // namespace
+
+MetricsExporter::MetricsExporter(std::string bind_address, uint16_t port)
+    : bind_address_(std::move(bind_address)), port_(port), acceptor_(io_context_) {
+}
+
+MetricsExporter::~MetricsExporter() {
+    stop();
+}
+
+bool MetricsExporter::start() {
+    boost::system::error_code ec;
+    tcp::endpoint endpoint(asio::ip::make_address(bind_address_, ec), port_);
+    if (!ec) acceptor_.open(endpoint.protocol(), ec);
+    if (!ec) acceptor_.set_option(asio::socket_base::reuse_address(true), ec);
+    if (!ec) acceptor_.bind(endpoint, ec);
+    if (!ec) acceptor_.listen(asio::socket_base::max_listen_connections, ec);
+    if (ec) {
+        last_error_ = "Cannot listen for metrics on " + bind_address_ + ":" +
+                      std::to_string(port_) + ": " + ec.message();
+        return false;
+    }
+    port_ = acceptor_.local_endpoint().port();
+
+    do_accept();
+    thread_ = std::thread([this]() { io_context_.run(); });
+    LOG_INFO_FMT("Metrics available at http://{}:{}/metrics", bind_address_, port_);
+    return true;
+}
+
+void MetricsExporter::stop() {
+    io_context_.stop();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void MetricsExporter::do_accept() {
+    acceptor_.async_accept([this](boost::system::error_code ec, tcp::socket socket) {
+        if (!ec) {
+            serve(std::move(socket));
+        }
+        if (acceptor_.is_open()) {
+            do_accept();
+        }
+    });
+}
+
+void MetricsExporter::serve(tcp::socket socket) {
+    auto scrape = std::make_shared<Scrape>(std::move(socket));
+    scrape->timer.expires_after(scrape_timeout);
+    scrape->timer.async_wait([scrape](boost::system::error_code ec) {
+        if (!ec) {
+            boost::system::error_code ignored;
+            scrape->socket.close(ignored);
+        }
+    });
+
+    asio::async_read_until(scrape->socket, scrape->request, "\r\n\r\n",
+        [scrape](boost::system::error_code ec, std::size_t) {
+            if (ec) {
+                scrape->timer.cancel();
+                return;
+            }
+            std::istream in(&scrape->request);
+            std::string method, target;
+            in >> method >> target;
+            if (method != "GET") {
+                scrape->response = http_response("405 Method Not Allowed", "Only GET\n");
+            } else if (target == "/metrics") {
+                scrape->response = http_response("200 OK", Metrics::instance().render(),
+                                                 "text/plain; version=0.0.4; charset=utf-8");
+            } else {
+                scrape->response = http_response("404 Not Found", "Try /metrics\n");
+            }
+            asio::async_write(scrape->socket, asio::buffer(scrape->response),
+                [scrape](boost::system::error_code, std::size_t) {
+                    scrape->timer.cancel();
+                    boost::system::error_code ignored;
+                    scrape->socket.shutdown(tcp::socket::shutdown_both, ignored);
+                    scrape->socket.close(ignored);
+                });
+        });
+}
+
+}  // namespace email
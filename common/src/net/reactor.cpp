@@ -0,0 +1,68 @@
+#include "net/reactor.hpp"
+#include <algorithm>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace email {
+
+Reactor::Reactor(size_t shard_count, bool pin_threads)
+    : pin_threads_(pin_threads) {
+    if (shard_count == 0) {
+        shard_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < shard_count; ++i) {
+        shards_.push_back(std::make_unique<asio::io_context>(1));
+    }
+}
+
+Reactor::~Reactor() {
+    stop();
+}
+
+void Reactor::start() {
+    if (running_) return;
+
+    running_ = true;
+    for (auto& shard : shards_) {
+        shard->restart();
+        work_.push_back(asio::make_work_guard(*shard));
+    }
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        threads_.emplace_back([this, i]() { run_thread(i); });
+    }
+}
+
+void Reactor::stop() {
+    if (!running_) return;
+
+    running_ = false;
+    work_.clear();
+    for (auto& shard : shards_) {
+        shard->stop();
+    }
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    threads_.clear();
+}
+
+void Reactor::run_thread(size_t index) {
+#ifdef __linux__
+    if (pin_threads_) {
+        unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(index % cpus, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#else
+    (void)index;
+#endif
+    shards_[index]->run();
+}
+
+}  // namespace email
@@ -1,44 +1,194 @@
 #include "net/session.hpp"
+#include "net/line_scanner.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 namespace email {
 
-Session::Session(asio::io_context& io_context, tcp::socket socket)
-    : io_context_(io_context)
+namespace {
+
+constexpr std::size_t initial_read_size = 4096;
+// Granularity of budget charges; see Session::update_footprint().
+constexpr std::size_t charge_page = 4096;
+
+// Traffic as it crosses the socket, so after TLS and compression.
+Counter& bytes_received() {
+    static Counter& counter = Metrics::instance().counter(
+        "email_network_received_bytes_total", "Bytes read from client connections");
+    return counter;
+}
+
+Counter& bytes_sent() {
+    static Counter& counter = Metrics::instance().counter(
+        "email_network_sent_bytes_total", "Bytes written to client connections");
+    return counter;
+}
+
 #ifdef ENABLE_TLS
-    , socket_(std::move(socket))
-#else
-    , socket_(std::move(socket))
+Counter& tls_handshakes(bool ok) {
+    static Counter& succeeded = Metrics::instance().counter(
+        "email_tls_handshakes_total", "TLS handshakes with clients", {{"result", "ok"}});
+    static Counter& failed = Metrics::instance().counter(
+        "email_tls_handshakes_total", "TLS handshakes with clients", {{"result", "failed"}});
+    return ok ? succeeded : failed;
+}
+#endif
+
+}  // namespace
+
+std::optional<OutboundFile> OutboundFile::open(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        ::close(fd);
+        return std::nullopt;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
-    , timeout_timer_(io_context) {
+    OutboundFile file(fd, static_cast<uint64_t>(st.st_size));
+
+    char prefix[compression::header_size];
+    ssize_t got = ::pread(fd, prefix, sizeof(prefix), 0);
+    if (got > 0 && compression::is_compressed({prefix, static_cast<std::size_t>(got)})) {
+        file.reader_ = compression::Reader::open(fd);
+        if (!file.reader_) {
+            LOG_ERROR_FMT("Cannot decompress {}", path.string());
+            errno = ENOTSUP;
+            return std::nullopt;
+        }
+        file.size_ = file.reader_->size();
+    }
+    return file;
+}
+
+OutboundFile::OutboundFile(OutboundFile&& other) noexcept
+    : fd_(std::exchange(other.fd_, -1))
+    , size_(other.size_)
+    , reader_(std::move(other.reader_)) {
+}
+
+OutboundFile& OutboundFile::operator=(OutboundFile&& other) noexcept {
+    if (this != &other) {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = std::exchange(other.fd_, -1);
+        size_ = other.size_;
+        reader_ = std::move(other.reader_);
+    }
+    return *this;
+}
+
+ssize_t OutboundFile::read(uint64_t offset, char* buffer, std::size_t length) {
+    if (reader_) {
+        return reader_->read(offset, buffer, length);
+    }
+    return ::pread(fd_, buffer, length, static_cast<off_t>(offset));
+}
+
+OutboundFile::~OutboundFile() {
+    if (fd_ >= 0) ::close(fd_);
+}
+
+Session::Session(asio::io_context& io_context, tcp::socket socket)
+    : io_context_(io_context)
+    , strand_(asio::make_strand(io_context))
+    , socket_(std::move(socket)) {
 }
 
 #ifdef ENABLE_TLS
 Session::Session(asio::io_context& io_context, tcp::socket socket, ssl::context& ssl_ctx)
     : io_context_(io_context)
+    , strand_(asio::make_strand(io_context))
     , socket_(SSLSocket(std::move(socket), ssl_ctx))
-    , is_tls_(true)
-    , timeout_timer_(io_context) {
+    , is_tls_(true) {
 }
 #endif
 
+Session::~Session() {
+    if (memory_budget_ && charged_ > 0) {
+        memory_budget_->release(charged_);
+    }
+}
+
+void Session::set_memory_budget(std::shared_ptr<MemoryBudget> budget, std::size_t object_size) {
+    if (memory_budget_ && charged_ > 0) {
+        memory_budget_->release(charged_);
+    }
+    charged_ = 0;
+    memory_budget_ = std::move(budget);
+    object_size_ = object_size;
+    update_footprint();
+}
+
+MemoryFootprint Session::footprint() const {
+    MemoryFootprint footprint;
+    footprint.session = object_size_ + (is_tls_ ? tls_state_estimate : 0) +
+                        (codec_ ? codec_->memory() : 0);
+    footprint.read_buffer = read_buffer_.capacity() + wire_in_.capacity();
+    footprint.write_queue = queued_memory_ + file_chunk_.capacity() + file_filtered_.capacity() +
+                            wire_out_.capacity() + write_queue_.size() * sizeof(OutboundBuffer);
+    footprint.messages = messages_footprint();
+    return footprint;
+}
+
+void Session::update_footprint() {
+    if (!memory_budget_) return;
+
+    // Charge in whole pages and only give pages back once the footprint
+    // fell two pages below the charge, so a request/response loop that
+    // hovers around a page boundary leaves the shared counter alone.
+    std::size_t total = footprint().total();
+    std::size_t target = (total + charge_page - 1) / charge_page * charge_page;
+    if (target > charged_) {
+        memory_budget_->charge(target - charged_);
+        charged_ = target;
+    } else if (total + 2 * charge_page <= charged_) {
+        memory_budget_->release(charged_ - target);
+        charged_ = target;
+    }
+}
+
 void Session::start() {
+#ifdef ENABLE_TLS
+    // Implicit TLS: hold back the greeting until the handshake is done.
+    tls_handshake_pending_ = is_tls_;
+#endif
     on_connect();
     reset_timeout();
+    schedule_idle_check();
 
 #ifdef ENABLE_TLS
     if (is_tls_) {
         auto self = shared_from_this();
         std::get<SSLSocket>(socket_).async_handshake(
             ssl::stream_base::server,
-            [this, self](const boost::system::error_code& ec) {
+            asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+                tls_handshakes(!ec).add();
                 if (!ec) {
+                    tls_handshake_pending_ = false;
                     on_tls_handshake_complete();
+                    do_write();
                     do_read();
                 } else {
                     on_error(ec);
+                    stop();
                 }
-            });
+            }));
     } else {
         do_read();
     }
@@ -51,9 +201,32 @@ void Session::stop() {
     if (stopped_) return;
     stopped_ = true;
 
-    timeout_timer_.cancel();
+    idle_generation_.fetch_add(1, std::memory_order_relaxed);  // drops the wheel entry
     on_disconnect();
     close_socket();
+
+    if (auto handler = std::move(close_handler_)) {
+        close_handler_ = nullptr;
+        handler();
+    }
+}
+
+void Session::close_after_flush() {
+    close_after_flush_ = true;
+    auto self = shared_from_this();
+    asio::post(strand_, [this, self]() {
+        if (!writing_ && write_queue_.empty()) {
+            stop();
+        }
+    });
+}
+
+void Session::stop_async(std::function<void()> done) {
+    auto self = shared_from_this();
+    asio::post(strand_, [this, self, done = std::move(done)]() {
+        stop();
+        done();
+    });
 }
 
 void Session::close_socket() {
@@ -62,6 +235,11 @@ void Session::close_socket() {
 #ifdef ENABLE_TLS
     if (is_tls_) {
         auto& ssl_socket = std::get<SSLSocket>(socket_);
+        if (!tls_handshake_pending_) {
+            // We close without a close_notify exchange; mark the connection
+            // as shut down so OpenSSL keeps its session resumable.
+            SSL_set_shutdown(ssl_socket.native_handle(), SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+        }
         ssl_socket.lowest_layer().close(ec);
     } else {
         std::get<PlainSocket>(socket_).close(ec);
@@ -102,47 +280,259 @@ uint16_t Session::remote_port() const {
 }
 
 void Session::set_timeout(std::chrono::seconds timeout) {
-    timeout_ = timeout;
+    timeout_.store(timeout.count(), std::memory_order_relaxed);
+    if (idle_registered_) {
+        schedule_idle_check();
+    }
 }
 
 void Session::reset_timeout() {
-    timeout_timer_.cancel();
-    timeout_timer_.expires_after(timeout_);
-    auto self = shared_from_this();
-    timeout_timer_.async_wait([this, self](const boost::system::error_code& ec) {
-        handle_timeout(ec);
-    });
+    // Only the activity stamp moves; the timing wheel notices on its tick.
+    last_activity_.store(TimingWheel::Clock::now().time_since_epoch().count(),
+                         std::memory_order_relaxed);
+}
+
+TimingWheel::Clock::time_point Session::idle_deadline() const {
+    TimingWheel::Clock::time_point last(
+        TimingWheel::Clock::duration(last_activity_.load(std::memory_order_relaxed)));
+    return last + std::chrono::seconds(timeout_.load(std::memory_order_relaxed));
 }
 
-void Session::handle_timeout(const boost::system::error_code& ec) {
-    if (ec == asio::error::operation_aborted) {
-        return;  // Timer was cancelled
+void Session::schedule_idle_check() {
+    idle_registered_ = true;
+    uint64_t generation = idle_generation_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (timeout_.load(std::memory_order_relaxed) <= 0) {
+        return;  // No timeout
     }
-    if (!stopped_) {
+    TimingWheel::get(io_context_).schedule(weak_from_this(), idle_deadline(), generation);
+}
+
+void Session::handle_idle_timeout() {
+    auto self = shared_from_this();
+    asio::post(strand_, [this, self]() {
+        if (stopped_) return;
+        if (idle_deadline() > TimingWheel::Clock::now()) {
+            schedule_idle_check();  // Activity raced with the tick
+            return;
+        }
         LOG_DEBUG("Session timeout");
         stop();
-    }
+    });
 }
 
 void Session::send(const std::string& data) {
+    send(std::string(data));
+}
+
+void Session::send(std::string&& data) {
+    if (data.empty()) return;
+    OutboundBuffer buffer;
+    buffer.owned = std::move(data);
+    enqueue(std::move(buffer));
+}
+
+void Session::send(std::shared_ptr<const std::string> data) {
+    if (!data || data->empty()) return;
+    OutboundBuffer buffer;
+    buffer.shared = std::move(data);
+    enqueue(std::move(buffer));
+}
+
+void Session::send_line(const std::string& line) {
+    std::string data;
+    data.reserve(line.size() + 2);
+    data.append(line).append("\r\n");
+    send(std::move(data));
+}
+
+void Session::send_line(std::string&& line) {
+    line.append("\r\n");
+    send(std::move(line));
+}
+
+void Session::send_file(OutboundFile file, uint64_t offset, uint64_t length, StreamFilter filter) {
+    uint64_t size = file.size();
+    offset = std::min(offset, size);
+    length = std::min(length, size - offset);
+    if (length == 0 && !filter) return;
+
+    OutboundBuffer buffer;
+    buffer.file = std::make_unique<FileTransfer>(
+        FileTransfer{std::move(file), offset, length, std::move(filter)});
+    enqueue(std::move(buffer));
+}
+
+bool Session::send_file(const std::filesystem::path& path, uint64_t offset, uint64_t length,
+                        StreamFilter filter) {
+    auto file = OutboundFile::open(path);
+    if (!file) {
+        LOG_ERROR_FMT("Cannot open {} for sending: {}", path.string(), std::strerror(errno));
+        return false;
+    }
+    send_file(std::move(*file), offset, length, std::move(filter));
+    return true;
+}
+
+void Session::enqueue(OutboundBuffer buffer) {
+    // Dispatch rather than post: protocol handlers already run on the
+    // strand, so their replies are queued (and counted against the
+    // watermarks) immediately.
     auto self = shared_from_this();
-    asio::post(io_context_, [this, self, data]() {
-        bool was_empty = write_queue_.empty();
-        write_queue_.push_back(data);
-        if (was_empty) {
+    asio::dispatch(strand_, [this, self, buffer = std::move(buffer)]() mutable {
+        queued_bytes_ += buffer.size();
+        queued_memory_ += buffer.owned.capacity();
+        if (queued_bytes_ >= write_high_watermark_) {
+            backlogged_ = true;
+        }
+        write_queue_.push_back(std::move(buffer));
+        update_footprint();
+        if (!writing_ && !corked_) {
             do_write();
         }
     });
 }
 
-void Session::send_line(const std::string& line) {
-    send(line + "\r\n");
+void Session::start_compression(std::unique_ptr<StreamCodec> codec) {
+    if (codec_ || !codec) return;
+    codec_ = std::move(codec);
+    input_switch_pending_ = true;
+    plain_ahead_ = write_queue_.size();
+    encoding_ = plain_ahead_ == 0;
+    update_footprint();
+}
+
+void Session::finish_entries(std::size_t count) {
+    if (!codec_ || encoding_) return;
+    plain_ahead_ -= std::min(count, plain_ahead_);
+    encoding_ = plain_ahead_ == 0;
+}
+
+void Session::account_written(std::size_t bytes) {
+    reset_timeout();  // a client draining a large response is not idle
+    queued_bytes_ -= std::min(bytes, queued_bytes_);
+    if (!backlogged_ || queued_bytes_ > write_low_watermark_) return;
+
+    backlogged_ = false;
+    on_write_drained();
+    if (read_paused_ && !stopped_) {
+        read_paused_ = false;
+        // Lines held back while backlogged are still in the read buffer.
+        process_read_buffer();
+        if (write_backlogged() || input_suspended_) {
+            read_paused_ = true;
+        } else {
+            do_read();
+        }
+    }
+}
+
+void Session::prepare_read_buffer() {
+    constexpr std::size_t min_free = 1024;
+
+    if (read_begin_ == read_end_) {
+        read_begin_ = read_end_ = 0;
+    } else if (read_begin_ > 0 && read_buffer_.size() - read_end_ < min_free) {
+        std::memmove(read_buffer_.data(), read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+        read_end_ -= read_begin_;
+        read_begin_ = 0;
+    }
+
+    if (read_buffer_.size() - read_end_ < min_free) {
+        read_buffer_.resize(std::max(initial_read_size, read_buffer_.size() * 2));
+        update_footprint();
+    }
+}
+
+asio::mutable_buffer Session::read_target() {
+    if (decoding_) {
+        if (wire_in_.empty()) {
+            wire_in_.resize(initial_read_size);
+            update_footprint();
+        }
+        return asio::buffer(wire_in_);
+    }
+    return asio::buffer(read_buffer_.data() + read_end_, read_buffer_.size() - read_end_);
+}
+
+bool Session::take_read(std::size_t bytes) {
+    if (!decoding_) {
+        read_end_ += bytes;
+        return true;
+    }
+    const std::size_t capacity = read_buffer_.capacity();
+    if (!codec_->decode({wire_in_.data(), bytes}, read_buffer_, read_end_)) {
+        return false;
+    }
+    if (read_buffer_.capacity() != capacity) {
+        update_footprint();
+    }
+    return true;
+}
+
+bool Session::switch_input() {
+    input_switch_pending_ = false;
+    decoding_ = true;
+    // The peer should have waited for the reply, but anything it sent after
+    // the command is compressed.
+    std::string pending(read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+    read_begin_ = read_end_ = scanned_ = 0;
+    return pending.empty() || codec_->decode(pending, read_buffer_, read_end_);
+}
+
+bool Session::trim_read_buffer() {
+    if (read_begin_ != read_end_) return false;
+
+    if (!is_tls_ && memory_budget_ && memory_budget_->under_pressure()) {
+        if (read_buffer_.capacity() > 0) {
+            std::vector<char>().swap(read_buffer_);
+            read_begin_ = read_end_ = scanned_ = 0;
+            update_footprint();
+        }
+        return true;
+    }
+
+    if (read_buffer_.capacity() > initial_read_size) {
+        // A burst (a pipelined batch, a long literal) is over; go back to
+        // the initial size instead of keeping the peak.
+        std::vector<char>(initial_read_size).swap(read_buffer_);
+        read_begin_ = read_end_ = scanned_ = 0;
+        update_footprint();
+    }
+    return false;
 }
 
 void Session::do_read() {
-    if (stopped_) return;
+    if (stopped_ || tls_handshake_pending_) return;
 
-    auto self = shared_from_this();
+    if (trim_read_buffer()) {
+        // No buffer while idle under memory pressure: allocate one only
+        // once there is something to read.
+        auto self = shared_from_this();
+        auto on_readable = asio::bind_executor(strand_,
+            [this, self](const boost::system::error_code& ec) {
+                if (stopped_) return;
+                if (ec) {
+                    on_error(ec);
+                    stop();
+                    return;
+                }
+                start_read();
+            });
+#ifdef ENABLE_TLS
+        std::get<PlainSocket>(socket_).async_wait(tcp::socket::wait_read, std::move(on_readable));
+#else
+        socket_.async_wait(tcp::socket::wait_read, std::move(on_readable));
+#endif
+        return;
+    }
+
+    start_read();
+}
+
+void Session::start_read() {
+    if (stopped_ || tls_handshake_pending_) return;
+
+    prepare_read_buffer();
 
 #ifdef ENABLE_TLS
     if (is_tls_) {
@@ -151,13 +541,13 @@ void Session::do_read() {
         do_read_impl(std::get<PlainSocket>(socket_));
     }
 #else
-    asio::async_read_until(
-        socket_,
-        read_buffer_,
-        "\r\n",
-        [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-            handle_read(ec, bytes_transferred);
-        });
+    auto self = shared_from_this();
+    socket_.async_read_some(
+        read_target(),
+        asio::bind_executor(strand_,
+            [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                handle_read(ec, bytes_transferred);
+            }));
 #endif
 }
 
@@ -165,13 +555,12 @@ void Session::do_read() {
 template<typename SocketType>
 void Session::do_read_impl(SocketType& socket) {
     auto self = shared_from_this();
-    asio::async_read_until(
-        socket,
-        read_buffer_,
-        "\r\n",
-        [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-            handle_read(ec, bytes_transferred);
-        });
+    socket.async_read_some(
+        read_target(),
+        asio::bind_executor(strand_,
+            [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                handle_read(ec, bytes_transferred);
+            }));
 }
 #endif
 
@@ -179,19 +568,18 @@ void Session::handle_read(const boost::system::error_code& ec, std::size_t bytes
     if (stopped_) return;
 
     if (!ec) {
+        bytes_received().add(bytes_transferred);
         reset_timeout();
-
-        std::istream is(&read_buffer_);
-        std::string line;
-        std::getline(is, line);
-
-        // Remove trailing \r if present
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+        if (!take_read(bytes_transferred)) {
+            LOG_WARNING_FMT("Undecodable input from {}, closing connection", remote_address());
+            stop();
+            return;
+        }
+        process_read_buffer();
+        if (write_backlogged() || input_suspended_) {
+            read_paused_ = true;  // resumed from account_written() or resume_input()
+            return;
         }
-
-        on_line(line);
-
         do_read();
     } else {
         on_error(ec);
@@ -199,8 +587,159 @@ void Session::handle_read(const boost::system::error_code& ec, std::size_t bytes
     }
 }
 
+void Session::read_bytes(std::size_t count) {
+    bytes_wanted_ = count;
+}
+
+void Session::resume_input() {
+    input_suspended_ = false;
+    if (!read_paused_ || stopped_ || write_backlogged()) {
+        return;
+    }
+    read_paused_ = false;
+    // Lines pipelined behind the suspending command are still buffered.
+    process_read_buffer();
+    if (write_backlogged() || input_suspended_) {
+        read_paused_ = true;
+    } else {
+        do_read();
+    }
+}
+
+void Session::process_read_buffer() {
+    // Replies to everything handled from this read are written together,
+    // so pipelined commands cost one write rather than one each.
+    corked_ = true;
+    consume_read_buffer();
+    corked_ = false;
+    do_write();
+}
+
+void Session::consume_read_buffer() {
+    for (;;) {
+        if (bytes_wanted_ > 0) {
+            const std::size_t count = std::min(bytes_wanted_, read_end_ - read_begin_);
+            if (count > 0) {
+                bytes_wanted_ -= count;
+                on_bytes({read_buffer_.data() + read_begin_, count}, bytes_wanted_ == 0);
+                read_begin_ += count;
+            }
+            scanned_ = 0;
+            if (bytes_wanted_ > 0) {
+                read_begin_ = read_end_ = 0;  // All taken; reuse the buffer
+                return;
+            }
+            if (stopped_) return;
+        }
+        if (streaming_) {
+            if (read_end_ > read_begin_) {
+                read_begin_ += on_stream({read_buffer_.data() + read_begin_, read_end_ - read_begin_});
+            }
+            scanned_ = 0;
+            if (streaming_) {
+                read_begin_ = read_end_ = 0;  // All taken; reuse the buffer
+                return;
+            }
+            if (stopped_) return;
+        }
+
+        std::string_view pending(read_buffer_.data() + read_begin_, read_end_ - read_begin_);
+        line_batch_.clear();
+        std::size_t consumed = split_lines(pending, line_batch_, scanned_);
+
+        std::size_t handled = line_batch_.empty() ? 0 : on_lines(line_batch_);
+        if ((input_switch_pending_ || bytes_wanted_ > 0 || streaming_) && !stopped_) {
+            // What follows the line just handled is raw bytes, or compressed.
+            read_begin_ = handled < line_batch_.size()
+                ? static_cast<std::size_t>(line_batch_[handled].data() - read_buffer_.data())
+                : read_begin_ + consumed;
+            scanned_ = 0;
+            line_batch_.clear();
+            if (input_switch_pending_ && !switch_input()) {
+                LOG_WARNING_FMT("Undecodable input from {}, closing connection", remote_address());
+                stop();
+                return;
+            }
+            continue;
+        }
+        if (handled < line_batch_.size() && (write_backlogged() || input_suspended_) &&
+            !stopped_ && !tls_handshake_pending_ && !close_after_flush_) {
+            // Held back by backpressure or a suspending command: resume at
+            // the first unhandled line.
+            read_begin_ = static_cast<std::size_t>(line_batch_[handled].data() - read_buffer_.data());
+            scanned_ = 0;
+            line_batch_.clear();
+            return;
+        }
+        read_begin_ += consumed;
+        scanned_ = read_end_ - read_begin_;
+        line_batch_.clear();
+
+        if (tls_handshake_pending_) {
+            // Anything pipelined behind STARTTLS was sent in the clear and must
+            // not be interpreted once the channel is encrypted.
+            read_begin_ = read_end_ = scanned_ = 0;
+            return;
+        }
+
+        if (!stopped_ && scanned_ > max_line_length_) {
+            LOG_WARNING_FMT("Line from {} exceeds {} bytes, closing connection",
+                            remote_address(), max_line_length_);
+            stop();
+        }
+        return;
+    }
+}
+
+bool Session::prepare_write_batch() {
+    // Gather as many queued buffers as fit under the cap so a multi-line
+    // response goes out in one writev (and one TLS record run) instead of
+    // one write per line.
+    write_batch_.clear();
+    std::size_t batch_bytes = 0;
+    for (const auto& queued : write_queue_) {
+        if (queued.file) break;  // files are streamed on their own
+        if (codec_ && !encoding_ && write_batch_.size() == plain_ahead_) break;
+        auto buffer = queued.buffer();
+        if (!write_batch_.empty() && batch_bytes + buffer.size() > max_write_batch_) {
+            break;
+        }
+        write_batch_.push_back(buffer);
+        batch_bytes += buffer.size();
+    }
+    write_batch_count_ = write_batch_.size();
+    write_batch_bytes_ = batch_bytes;
+
+    if (encoding_) {
+        // One flush per write, so each reply can be decoded on arrival.
+        wire_out_.clear();
+        for (std::size_t i = 0; i < write_batch_.size(); ++i) {
+            std::string_view plain(static_cast<const char*>(write_batch_[i].data()),
+                                   write_batch_[i].size());
+            if (!codec_->encode(plain, wire_out_, i + 1 == write_batch_.size())) {
+                return false;
+            }
+        }
+        write_batch_.assign(1, asio::buffer(wire_out_));
+    }
+    return true;
+}
+
 void Session::do_write() {
-    if (stopped_ || write_queue_.empty()) return;
+    if (stopped_ || writing_ || write_queue_.empty()) return;
+    if (is_tls_ && tls_handshake_pending_) return;  // resumed once the handshake completes
+
+    writing_ = true;
+    if (write_queue_.front().file) {
+        write_file();
+        return;
+    }
+    if (!prepare_write_batch()) {
+        writing_ = false;
+        LOG_ERROR("Cannot encode output, closing connection");
+        stop();
+        return;
+    }
 
     auto self = shared_from_this();
 
@@ -213,10 +752,11 @@ void Session::do_write() {
 #else
     asio::async_write(
         socket_,
-        asio::buffer(write_queue_.front()),
-        [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-            handle_write(ec, bytes_transferred);
-        });
+        write_batch_,
+        asio::bind_executor(strand_,
+            [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                handle_write(ec, bytes_transferred);
+            }));
 #endif
 }
 
@@ -226,31 +766,238 @@ void Session::do_write_impl(SocketType& socket) {
     auto self = shared_from_this();
     asio::async_write(
         socket,
-        asio::buffer(write_queue_.front()),
-        [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
-            handle_write(ec, bytes_transferred);
-        });
+        write_batch_,
+        asio::bind_executor(strand_,
+            [this, self](const boost::system::error_code& ec, std::size_t bytes_transferred) {
+                handle_write(ec, bytes_transferred);
+            }));
 }
 #endif
 
-void Session::handle_write(const boost::system::error_code& ec, std::size_t /* bytes_transferred */) {
+void Session::handle_write(const boost::system::error_code& ec, std::size_t bytes_transferred) {
+    writing_ = false;
     if (stopped_) return;
 
     if (!ec) {
-        write_queue_.pop_front();
-        if (!write_queue_.empty()) {
-            do_write();
+        bytes_sent().add(bytes_transferred);
+        auto written_end = write_queue_.begin() + static_cast<std::ptrdiff_t>(write_batch_count_);
+        for (auto it = write_queue_.begin(); it != written_end; ++it) {
+            queued_memory_ -= std::min(it->owned.capacity(), queued_memory_);
         }
+        write_queue_.erase(write_queue_.begin(), written_end);
+        finish_entries(write_batch_count_);
+        write_batch_.clear();
+        write_batch_count_ = 0;
+        // Encoded output is not what was queued; count what was.
+        account_written(write_batch_bytes_);
+        continue_writing();
     } else {
         on_error(ec);
         stop();
     }
 }
 
+void Session::continue_writing() {
+    if (stopped_ || writing_) return;
+    if (write_queue_.empty() && (file_chunk_.capacity() > 0 || file_filtered_.capacity() > 0)) {
+        // No file in flight any more; its chunk buffers can go.
+        std::string().swap(file_chunk_);
+        std::string().swap(file_filtered_);
+    }
+    if (write_queue_.empty() && wire_out_.capacity() > initial_read_size) {
+        std::string().swap(wire_out_);
+    }
+    update_footprint();
+    if (!write_queue_.empty()) {
+        do_write();
+    } else if (close_after_flush_) {
+        stop();
+    }
+#ifdef ENABLE_TLS
+    else if (pending_tls_context_) {
+        auto* ssl_ctx = std::exchange(pending_tls_context_, nullptr);
+        begin_tls_handshake(*ssl_ctx);
+    }
+#endif
+}
+
+void Session::write_file() {
+    auto& transfer = *write_queue_.front().file;
+#ifdef __linux__
+    if (!is_tls_ && !codec_ && !transfer.filter && !transfer.file.compressed()) {
+        if (!sendfile_chunk(transfer)) return;
+        // Wait for room in the socket buffer (or simply yield to other
+        // sessions between chunks) before sending more.
+        auto self = shared_from_this();
+        auto on_writable = asio::bind_executor(strand_,
+            [this, self](const boost::system::error_code& ec) {
+                if (stopped_) {
+                    writing_ = false;
+                    return;
+                }
+                if (ec) {
+                    writing_ = false;
+                    on_error(ec);
+                    stop();
+                    return;
+                }
+                write_file();
+            });
+#ifdef ENABLE_TLS
+        std::get<PlainSocket>(socket_).async_wait(tcp::socket::wait_write, std::move(on_writable));
+#else
+        socket_.async_wait(tcp::socket::wait_write, std::move(on_writable));
+#endif
+        return;
+    }
+#endif
+    read_file_chunk(transfer);
+}
+
+#ifdef __linux__
+bool Session::sendfile_chunk(FileTransfer& transfer) {
+    // Per-turn cap so one large file does not monopolise the io thread.
+    constexpr uint64_t max_chunk = 1024 * 1024;
+
+#ifdef ENABLE_TLS
+    auto& socket = std::get<PlainSocket>(socket_);
+#else
+    auto& socket = socket_;
+#endif
+    if (!socket.native_non_blocking()) {
+        boost::system::error_code ec;
+        socket.native_non_blocking(true, ec);
+    }
+
+    while (transfer.remaining > 0) {
+        off_t offset = static_cast<off_t>(transfer.offset);
+        ssize_t sent = ::sendfile(socket.native_handle(), transfer.file.native_handle(), &offset,
+                                  static_cast<std::size_t>(std::min(transfer.remaining, max_chunk)));
+        if (sent > 0) {
+            bytes_sent().add(static_cast<uint64_t>(sent));
+            transfer.offset += static_cast<uint64_t>(sent);
+            transfer.remaining -= static_cast<uint64_t>(sent);
+            account_written(static_cast<std::size_t>(sent));
+            if (stopped_) return false;
+            break;
+        }
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        writing_ = false;
+        if (sent == 0) {
+            LOG_ERROR("File shrank while being sent, closing connection");
+        } else {
+            on_error(boost::system::error_code(errno, boost::system::system_category()));
+        }
+        stop();
+        return false;
+    }
+
+    if (transfer.remaining == 0) {
+        writing_ = false;
+        write_queue_.pop_front();
+        finish_entries(1);
+        // Posted so a run of small files does not recurse.
+        auto self = shared_from_this();
+        asio::post(strand_, [this, self]() { continue_writing(); });
+        return false;
+    }
+    return true;
+}
+#else
+bool Session::sendfile_chunk(FileTransfer&) {
+    return false;
+}
+#endif
+
+void Session::read_file_chunk(FileTransfer& transfer) {
+    const auto want = static_cast<std::size_t>(
+        std::min<uint64_t>(transfer.remaining, std::max<std::size_t>(max_write_batch_, 16 * 1024)));
+
+    file_chunk_.resize(want);
+    ssize_t got = 0;
+    while (want > 0) {
+        got = transfer.file.read(transfer.offset, file_chunk_.data(), want);
+        if (got >= 0 || errno != EINTR) break;
+    }
+    if (got < 0 || (want > 0 && got == 0)) {
+        writing_ = false;
+        if (got == 0) {
+            LOG_ERROR("File shrank while being sent, closing connection");
+        } else {
+            on_error(boost::system::error_code(errno, boost::system::system_category()));
+        }
+        stop();
+        return;
+    }
+
+    const auto consumed = static_cast<std::size_t>(got);
+    transfer.offset += consumed;
+    transfer.remaining -= consumed;
+    const bool last = transfer.remaining == 0;
+
+    std::string_view chunk(file_chunk_.data(), consumed);
+    if (transfer.filter) {
+        file_filtered_.clear();
+        transfer.filter(chunk, last, file_filtered_);
+        chunk = file_filtered_;
+    }
+    if (encoding_) {
+        wire_out_.clear();
+        if (!codec_->encode(chunk, wire_out_, true)) {
+            writing_ = false;
+            LOG_ERROR("Cannot encode output, closing connection");
+            stop();
+            return;
+        }
+        chunk = wire_out_;
+    }
+
+    auto self = shared_from_this();
+    auto on_written = asio::bind_executor(strand_,
+        [this, self, consumed, last](const boost::system::error_code& ec, std::size_t written) {
+            writing_ = false;
+            if (stopped_) return;
+            if (ec) {
+                on_error(ec);
+                stop();
+                return;
+            }
+            bytes_sent().add(written);
+            if (last) {
+                write_queue_.pop_front();
+                finish_entries(1);
+            }
+            account_written(consumed);
+            continue_writing();
+        });
+
+#ifdef ENABLE_TLS
+    if (is_tls_) {
+        asio::async_write(std::get<SSLSocket>(socket_), asio::buffer(chunk), std::move(on_written));
+    } else {
+        asio::async_write(std::get<PlainSocket>(socket_), asio::buffer(chunk), std::move(on_written));
+    }
+#else
+    asio::async_write(socket_, asio::buffer(chunk), std::move(on_written));
+#endif
+}
+
 void Session::on_connect() {
     LOG_DEBUG_FMT("New connection from {}:{}", remote_address(), remote_port());
 }
 
+std::size_t Session::on_lines(std::span<const std::string_view> lines) {
+    std::size_t handled = 0;
+    for (auto line : lines) {
+        if (!accepting_lines()) break;
+        on_line(std::string(line));
+        ++handled;
+    }
+    return handled;
+}
+
 void Session::on_line(const std::string& line) {
     on_data(line);
 }
@@ -272,23 +1019,44 @@ void Session::on_tls_handshake_complete() {
 
 #ifdef ENABLE_TLS
 void Session::start_tls(ssl::context& ssl_ctx) {
-    if (is_tls_) return;  // Already TLS
+    if (is_tls_ || tls_handshake_pending_) return;  // Already TLS
+
+    // Stop interpreting plaintext input now; the socket is switched once the
+    // replies queued so far (normally the "begin TLS" response) are written.
+    tls_handshake_pending_ = true;
 
-    auto& plain_socket = std::get<PlainSocket>(socket_);
-    socket_ = SSLSocket(std::move(plain_socket), ssl_ctx);
+    auto self = shared_from_this();
+    asio::post(strand_, [this, self, &ssl_ctx]() {
+        if (writing_ || !write_queue_.empty()) {
+            pending_tls_context_ = &ssl_ctx;
+        } else {
+            begin_tls_handshake(ssl_ctx);
+        }
+    });
+}
+
+void Session::begin_tls_handshake(ssl::context& ssl_ctx) {
+    if (stopped_) return;
+
+    PlainSocket plain_socket(std::move(std::get<PlainSocket>(socket_)));
+    socket_.emplace<SSLSocket>(std::move(plain_socket), ssl_ctx);
     is_tls_ = true;
 
     auto self = shared_from_this();
     std::get<SSLSocket>(socket_).async_handshake(
         ssl::stream_base::server,
-        [this, self](const boost::system::error_code& ec) {
+        asio::bind_executor(strand_, [this, self](const boost::system::error_code& ec) {
+            tls_handshakes(!ec).add();
             if (!ec) {
+                tls_handshake_pending_ = false;
                 on_tls_handshake_complete();
+                do_write();
+                do_read();
             } else {
                 on_error(ec);
                 stop();
             }
-        });
+        }));
 }
 #endif
 
@@ -0,0 +1,187 @@
+#include "net/stream_codec.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+#ifdef ENABLE_DEFLATE
+#include <zlib.h>
+#endif
+
+namespace email {
+
+namespace {
+
+struct Totals {
+    std::atomic<uint64_t> plain_in{0};
+    std::atomic<uint64_t> wire_in{0};
+    std::atomic<uint64_t> plain_out{0};
+    std::atomic<uint64_t> wire_out{0};
+};
+
+Totals& all_connections() {
+    static Totals totals;
+    return totals;
+}
+
+}  // namespace
+
+StreamStats DeflateCodec::totals() {
+    auto& all = all_connections();
+    StreamStats stats;
+    stats.plain_in = all.plain_in.load(std::memory_order_relaxed);
+    stats.wire_in = all.wire_in.load(std::memory_order_relaxed);
+    stats.plain_out = all.plain_out.load(std::memory_order_relaxed);
+    stats.wire_out = all.wire_out.load(std::memory_order_relaxed);
+    return stats;
+}
+
+#ifdef ENABLE_DEFLATE
+
+struct DeflateCodec::Streams {
+    z_stream deflate{};
+    z_stream inflate{};
+    bool deflate_open = false;
+    bool inflate_open = false;
+    bool ended = false;  // The peer finished its stream
+
+    ~Streams() {
+        if (deflate_open) ::deflateEnd(&deflate);
+        if (inflate_open) ::inflateEnd(&inflate);
+    }
+};
+
+bool DeflateCodec::available() {
+    return true;
+}
+
+std::unique_ptr<DeflateCodec> DeflateCodec::create(const Options& options) {
+    // zlib takes 8 for 9 when compressing but then cannot be read back with
+    // a raw 8-bit window, so 9 is the floor.
+    const int window_bits = std::clamp(options.window_bits, 9, 15);
+    const int mem_level = std::clamp(options.mem_level, 1, 9);
+    const int level = std::clamp(options.level, 1, 9);
+
+    auto streams = std::make_unique<Streams>();
+    if (::deflateInit2(&streams->deflate, level, Z_DEFLATED, -window_bits, mem_level,
+                       Z_DEFAULT_STRATEGY) != Z_OK) {
+        return nullptr;
+    }
+    streams->deflate_open = true;
+    if (::inflateInit2(&streams->inflate, -15) != Z_OK) {
+        return nullptr;
+    }
+    streams->inflate_open = true;
+
+    // zlib's own estimates (zconf.h), plus its state structures.
+    const std::size_t memory = (std::size_t{1} << (window_bits + 2)) +
+                               (std::size_t{1} << (mem_level + 9)) + (std::size_t{1} << 15) +
+                               16 * 1024;
+    return std::unique_ptr<DeflateCodec>(new DeflateCodec(std::move(streams), memory));
+}
+
+DeflateCodec::DeflateCodec(std::unique_ptr<Streams> streams, std::size_t memory)
+    : streams_(std::move(streams)), memory_(memory) {
+}
+
+DeflateCodec::~DeflateCodec() = default;
+
+bool DeflateCodec::decode(std::string_view in, std::vector<char>& out, std::size_t& end) {
+    constexpr std::size_t min_room = 1024;
+
+    auto& z = streams_->inflate;
+    if (streams_->ended) {
+        return in.empty();
+    }
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in = static_cast<uInt>(in.size());
+    const std::size_t start = end;
+    for (;;) {
+        if (out.size() - end < min_room) {
+            out.resize(std::max(out.size() * 2, end + 4 * min_room));
+        }
+        z.next_out = reinterpret_cast<Bytef*>(out.data() + end);
+        z.avail_out = static_cast<uInt>(out.size() - end);
+        const int rc = ::inflate(&z, Z_SYNC_FLUSH);
+        end = out.size() - z.avail_out;
+        if (rc == Z_STREAM_END) {
+            streams_->ended = true;
+            break;
+        }
+        if (rc == Z_BUF_ERROR && z.avail_in == 0) {
+            break;  // Everything taken in; no more output without more input
+        }
+        if (rc != Z_OK) {
+            return false;
+        }
+        if (z.avail_in == 0 && z.avail_out > 0) {
+            break;
+        }
+    }
+
+    stats_.wire_in += in.size();
+    stats_.plain_in += end - start;
+    auto& all = all_connections();
+    all.wire_in.fetch_add(in.size(), std::memory_order_relaxed);
+    all.plain_in.fetch_add(end - start, std::memory_order_relaxed);
+    return true;
+}
+
+bool DeflateCodec::encode(std::string_view in, std::string& out, bool flush) {
+    constexpr std::size_t step = 4096;
+
+    auto& z = streams_->deflate;
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    z.avail_in = static_cast<uInt>(in.size());
+    const std::size_t start = out.size();
+    for (;;) {
+        const std::size_t used = out.size();
+        out.resize(used + std::max<std::size_t>(step, ::deflateBound(&z, z.avail_in)));
+        z.next_out = reinterpret_cast<Bytef*>(out.data() + used);
+        z.avail_out = static_cast<uInt>(out.size() - used);
+        const int rc = ::deflate(&z, flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        out.resize(out.size() - z.avail_out);
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            return false;
+        }
+        if (z.avail_out != 0) {
+            break;  // All taken in and, when flushing, all flushed
+        }
+    }
+
+    stats_.plain_out += in.size();
+    stats_.wire_out += out.size() - start;
+    auto& all = all_connections();
+    all.plain_out.fetch_add(in.size(), std::memory_order_relaxed);
+    all.wire_out.fetch_add(out.size() - start, std::memory_order_relaxed);
+    return true;
+}
+
+#else
+
+struct DeflateCodec::Streams {};
+
+bool DeflateCodec::available() {
+    return false;
+}
+
+std::unique_ptr<DeflateCodec> DeflateCodec::create(const Options&) {
+    return nullptr;
+}
+
+DeflateCodec::DeflateCodec(std::unique_ptr<Streams> streams, std::size_t memory)
+    : streams_(std::move(streams)), memory_(memory) {
+}
+
+DeflateCodec::~DeflateCodec() = default;
+
+bool DeflateCodec::decode(std::string_view, std::vector<char>&, std::size_t&) {
+    return false;
+}
+
+bool DeflateCodec::encode(std::string_view, std::string&, bool) {
+    return false;
+}
+
+#endif
+
+}  // namespace email
@@ -0,0 +1,165 @@
+#include "net/timing_wheel.hpp"
+#include "net/session.hpp"
+
+namespace email {
+
+asio::io_context::id TimingWheel::id;
+
+TimingWheel::TimingWheel(asio::io_context& io_context)
+    : asio::io_context::service(io_context)
+    , timer_(io_context)
+    , epoch_(Clock::now()) {
+}
+
+void TimingWheel::shutdown() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shut_down_ = true;
+    timer_.cancel();
+    for (auto& slot : level0_) slot.clear();
+    for (auto& level : upper_) {
+        for (auto& slot : level) slot.clear();
+    }
+    entries_ = 0;
+}
+
+size_t TimingWheel::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_;
+}
+
+uint64_t TimingWheel::to_tick(Clock::time_point time) const {
+    if (time <= epoch_) return 0;
+    auto elapsed = time - epoch_;
+    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(elapsed);
+    if (seconds < elapsed) ++seconds;  // round up so nothing expires early
+    return static_cast<uint64_t>(seconds.count());
+}
+
+void TimingWheel::schedule(std::weak_ptr<Session> session, Clock::time_point deadline,
+                           uint64_t generation) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (shut_down_) return;
+
+    if (entries_ == 0 && !timer_running_) {
+        // The wheel sat empty; jump forward instead of replaying idle ticks.
+        auto now = std::chrono::duration_cast<std::chrono::seconds>(Clock::now() - epoch_);
+        current_tick_ = static_cast<uint64_t>(now.count());
+    }
+
+    insert(Entry{std::move(session), generation}, to_tick(deadline));
+    ++entries_;
+    start_timer();
+}
+
+void TimingWheel::insert(Entry entry, uint64_t tick) {
+    if (tick <= current_tick_) {
+        tick = current_tick_ + 1;
+    }
+    entry.tick = tick;
+
+    if (tick - current_tick_ < level0_.size()) {
+        level0_[tick & (level0_.size() - 1)].push_back(std::move(entry));
+        return;
+    }
+
+    constexpr uint64_t slot_mask = (uint64_t{1} << level_bits) - 1;
+    for (size_t level = 0; level < upper_.size(); ++level) {
+        const size_t shift = level0_bits + level * level_bits;
+        uint64_t distance = (tick >> shift) - (current_tick_ >> shift);
+        bool last = level + 1 == upper_.size();
+        if (distance <= slot_mask || last) {
+            if (distance > slot_mask) {
+                // Beyond the wheel's range: park in the furthest slot; the
+                // entry is re-filed against its real deadline when it surfaces.
+                tick = ((current_tick_ >> shift) + slot_mask) << shift;
+            }
+            upper_[level][(tick >> shift) & slot_mask].push_back(std::move(entry));
+            return;
+        }
+    }
+}
+
+void TimingWheel::cascade(size_t level) {
+    const size_t shift = level0_bits + level * level_bits;
+    constexpr uint64_t slot_mask = (uint64_t{1} << level_bits) - 1;
+    Slot due;
+    due.swap(upper_[level][(current_tick_ >> shift) & slot_mask]);
+    for (auto& entry : due) {
+        uint64_t tick = entry.tick;
+        insert(std::move(entry), tick);
+    }
+}
+
+void TimingWheel::start_timer() {
+    if (timer_running_ || entries_ == 0) return;
+    timer_running_ = true;
+    timer_.expires_at(epoch_ + std::chrono::seconds(current_tick_ + 1));
+    timer_.async_wait([this](const boost::system::error_code& ec) {
+        on_tick(ec);
+    });
+}
+
+void TimingWheel::on_tick(const boost::system::error_code& ec) {
+    std::vector<std::shared_ptr<Session>> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        timer_running_ = false;
+        if (ec == asio::error::operation_aborted || shut_down_) {
+            return;
+        }
+        advance_locked(Clock::now(), expired);
+    }
+
+    for (auto& session : expired) {
+        session->handle_idle_timeout();
+    }
+}
+
+std::vector<std::shared_ptr<Session>> TimingWheel::advance(Clock::time_point now) {
+    std::vector<std::shared_ptr<Session>> expired;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!shut_down_) {
+        advance_locked(now, expired);
+    }
+    return expired;
+}
+
+void TimingWheel::advance_locked(Clock::time_point now,
+                                 std::vector<std::shared_ptr<Session>>& expired) {
+    const uint64_t now_tick = now <= epoch_ ? 0 : static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::seconds>(now - epoch_).count());
+
+    while (current_tick_ < now_tick) {
+        ++current_tick_;
+
+        for (size_t level = upper_.size(); level-- > 0;) {
+            const size_t shift = level0_bits + level * level_bits;
+            if ((current_tick_ & ((uint64_t{1} << shift) - 1)) == 0) {
+                cascade(level);
+            }
+        }
+
+        Slot due;
+        due.swap(level0_[current_tick_ & (level0_.size() - 1)]);
+        for (auto& entry : due) {
+            auto session = entry.session.lock();
+            if (!session ||
+                session->idle_generation_.load(std::memory_order_relaxed) != entry.generation) {
+                --entries_;
+                continue;
+            }
+
+            auto deadline = session->idle_deadline();
+            if (deadline <= now) {
+                --entries_;
+                expired.push_back(std::move(session));
+            } else {
+                insert(std::move(entry), to_tick(deadline));
+            }
+        }
+    }
+
+    start_timer();
+}
+
+}  // namespace email
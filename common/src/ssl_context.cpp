@@ -1,13 +1,219 @@
 #include "ssl_context.hpp"
+#include "config.hpp"
 #include "logger.hpp"
 
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <ctime>
+
 #ifdef ENABLE_TLS
 #include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 #include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
 #endif
 
 namespace email {
 
+struct SSLContext::TLSState {
+    std::atomic<uint64_t> full_handshakes{0};
+    std::atomic<uint64_t> resumed_handshakes{0};
+    std::atomic<uint64_t> failed_handshakes{0};
+    std::atomic<uint64_t> handshake_cpu_ns{0};
+    std::atomic<uint64_t> ktls_connections{0};
+    std::atomic<uint64_t> ticket_key_rotations{0};
+
+#ifdef ENABLE_TLS
+    struct TicketKey {
+        unsigned char name[16];
+        unsigned char aes_key[32];
+        unsigned char hmac_key[32];
+        std::chrono::steady_clock::time_point created;
+    };
+
+    // Newest key first; at most two are kept (current and previous).
+    std::mutex ticket_mutex;
+    std::deque<TicketKey> ticket_keys;
+    std::chrono::seconds ticket_key_lifetime{0};
+
+    // Returns a copy of the current ticket key, rotating it if it is due.
+    bool current_ticket_key(TicketKey& out) {
+        std::lock_guard<std::mutex> lock(ticket_mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (ticket_keys.empty() || now - ticket_keys.front().created >= ticket_key_lifetime) {
+            TicketKey key;
+            if (RAND_bytes(key.name, sizeof(key.name)) != 1 ||
+                RAND_bytes(key.aes_key, sizeof(key.aes_key)) != 1 ||
+                RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1) {
+                return false;
+            }
+            key.created = now;
+            ticket_keys.push_front(key);
+            while (ticket_keys.size() > 2) {
+                OPENSSL_cleanse(&ticket_keys.back(), sizeof(TicketKey));
+                ticket_keys.pop_back();
+            }
+            ticket_key_rotations.fetch_add(1, std::memory_order_relaxed);
+        }
+        out = ticket_keys.front();
+        return true;
+    }
+
+    // Looks up the key a ticket was issued under. Returns 0 if unknown or
+    // expired, 1 for the current key and 2 for the previous one.
+    int find_ticket_key(const unsigned char* name, TicketKey& out) {
+        std::lock_guard<std::mutex> lock(ticket_mutex);
+        auto now = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < ticket_keys.size(); ++i) {
+            const auto& key = ticket_keys[i];
+            if (std::memcmp(key.name, name, sizeof(key.name)) != 0) continue;
+            if (now - key.created >= 2 * ticket_key_lifetime) return 0;
+            out = key;
+            return i == 0 ? 1 : 2;
+        }
+        return 0;
+    }
+
+    ~TLSState() {
+        for (auto& key : ticket_keys) {
+            OPENSSL_cleanse(&key, sizeof(key));
+        }
+    }
+#endif
+};
+
+#ifdef ENABLE_TLS
+namespace {
+
+int ctx_state_index() {
+    static const int index = SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr);
+    return index;
+}
+
+int ssl_cpu_index() {
+    static const int index = SSL_get_ex_new_index(0, nullptr, nullptr, nullptr,
+        [](void*, void* ptr, CRYPTO_EX_DATA*, int, long, void*) {
+            delete static_cast<uint64_t*>(ptr);
+        });
+    return index;
+}
+
+uint64_t thread_cpu_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// Called by OpenSSL on every handshake state transition. The time between
+// two transitions is CPU spent on this connection's handshake, except after
+// the handshake returns to wait for the peer: the thread then serves other
+// sessions, so the clock is paused until the next transition. The first step
+// of each resumed flight goes uncounted, making the figure a slight
+// underestimate.
+void handshake_info_callback(const SSL* ssl, int where, int ret) {
+    auto* state = static_cast<SSLContext::TLSState*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_state_index()));
+    if (!state) return;
+
+    if ((where & SSL_CB_EXIT) && ret <= 0 && ERR_peek_error() != 0) {
+        // A queued error tells a failure from a pause for more input; this
+        // can arrive before SSL_CB_HANDSHAKE_START when the first record is bad.
+        state->failed_handshakes.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    auto* mark = static_cast<uint64_t*>(SSL_get_ex_data(ssl, ssl_cpu_index()));
+    const uint64_t now = thread_cpu_ns();
+
+    if (where & SSL_CB_HANDSHAKE_START) {
+        if (!mark) {
+            mark = new uint64_t(0);
+            SSL_set_ex_data(const_cast<SSL*>(ssl), ssl_cpu_index(), mark);
+        }
+        *mark = now;
+        return;
+    }
+    if (!mark) return;
+
+    if (*mark != 0 && now > *mark) {
+        state->handshake_cpu_ns.fetch_add(now - *mark, std::memory_order_relaxed);
+    }
+    *mark = now;
+
+    if (where & SSL_CB_HANDSHAKE_DONE) {
+        if (SSL_session_reused(const_cast<SSL*>(ssl))) {
+            state->resumed_handshakes.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            state->full_handshakes.fetch_add(1, std::memory_order_relaxed);
+        }
+#ifdef SSL_OP_ENABLE_KTLS
+        if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+            state->ktls_connections.fetch_add(1, std::memory_order_relaxed);
+        }
+#endif
+        *mark = 0;
+    } else if (where & SSL_CB_EXIT) {
+        if (ret > 0) return;
+        *mark = 0;  // waiting for the peer, or finished
+    }
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+int ticket_key_callback(SSL* ssl, unsigned char key_name[16], unsigned char* iv,
+                        EVP_CIPHER_CTX* cipher, EVP_MAC_CTX* mac, int enc) {
+#else
+int ticket_key_callback(SSL* ssl, unsigned char key_name[16], unsigned char* iv,
+                        EVP_CIPHER_CTX* cipher, HMAC_CTX* mac, int enc) {
+#endif
+    auto* state = static_cast<SSLContext::TLSState*>(
+        SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_state_index()));
+    if (!state) return -1;
+
+    SSLContext::TLSState::TicketKey key;
+    int result = 1;
+    if (enc) {
+        if (!state->current_ticket_key(key)) return -1;
+        if (RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) return -1;
+        std::memcpy(key_name, key.name, sizeof(key.name));
+        if (EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) {
+            result = -1;
+        }
+    } else {
+        result = state->find_ticket_key(key_name, key);
+        if (result == 0) return 0;  // unknown key: fall back to a full handshake
+        if (EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1) {
+            result = -1;
+        }
+    }
+
+    if (result > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        char digest[] = "SHA256";
+        OSSL_PARAM params[] = {
+            OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key)),
+            OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, digest, 0),
+            OSSL_PARAM_construct_end(),
+        };
+        if (EVP_MAC_CTX_set_params(mac, params) != 1) result = -1;
+#else
+        if (HMAC_Init_ex(mac, key.hmac_key, sizeof(key.hmac_key), EVP_sha256(), nullptr) != 1) {
+            result = -1;
+        }
+#endif
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+    return result;
+}
+
+}  // namespace
+#endif
+
 SSLContext::SSLContext(Mode mode, Protocol protocol)
     : mode_(mode), protocol_(protocol) {
 #ifdef ENABLE_TLS
@@ -52,13 +258,19 @@ SSLContext::SSLContext(Mode mode, Protocol protocol)
         ssl::context::no_tlsv1_1 |
         ssl::context::single_dh_use
     );
+    // Idle connections hand OpenSSL's record buffers back.
+    SSL_CTX_set_mode(context_->native_handle(), SSL_MODE_RELEASE_BUFFERS);
+
+    state_ = std::make_unique<TLSState>();
+    install_callbacks();
 #endif
 }
 
 SSLContext::~SSLContext() = default;
 
 SSLContext::SSLContext(SSLContext&& other) noexcept
-    : initialized_(other.initialized_)
+    : state_(std::move(other.state_))
+    , initialized_(other.initialized_)
     , last_error_(std::move(other.last_error_))
     , mode_(other.mode_)
     , protocol_(other.protocol_)
@@ -74,6 +286,7 @@ SSLContext& SSLContext::operator=(SSLContext&& other) noexcept {
 #ifdef ENABLE_TLS
         context_ = std::move(other.context_);
 #endif
+        state_ = std::move(other.state_);
         initialized_ = other.initialized_;
         last_error_ = std::move(other.last_error_);
         mode_ = other.mode_;
@@ -236,6 +449,94 @@ void SSLContext::set_password_callback(std::function<std::string()> callback) {
     password_callback_ = std::move(callback);
 }
 
+void SSLContext::install_callbacks() {
+#ifdef ENABLE_TLS
+    if (!context_ || !state_) return;
+    SSL_CTX* ctx = context_->native_handle();
+    SSL_CTX_set_ex_data(ctx, ctx_state_index(), state_.get());
+    if (mode_ == Mode::Server) {
+        SSL_CTX_set_info_callback(ctx, handshake_info_callback);
+    }
+#endif
+}
+
+bool SSLContext::enable_session_resumption(size_t cache_size,
+                                           std::chrono::seconds session_timeout,
+                                           std::chrono::seconds ticket_key_lifetime) {
+#ifdef ENABLE_TLS
+    if (!context_ || !state_) {
+        set_error("SSL context not initialized");
+        return false;
+    }
+    SSL_CTX* ctx = context_->native_handle();
+
+    static const unsigned char sid_context[] = "email_server";
+    SSL_CTX_set_session_id_context(ctx, sid_context, sizeof(sid_context) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, static_cast<long>(cache_size));
+    SSL_CTX_set_timeout(ctx, static_cast<long>(session_timeout.count()));
+
+    if (ticket_key_lifetime.count() <= 0) {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        return true;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(state_->ticket_mutex);
+        state_->ticket_key_lifetime = ticket_key_lifetime;
+    }
+    SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_callback) != 1) {
+#else
+    if (SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticket_key_callback) != 1) {
+#endif
+        set_error("Failed to install session ticket key callback");
+        return false;
+    }
+    return true;
+#else
+    (void)cache_size;
+    (void)session_timeout;
+    (void)ticket_key_lifetime;
+    set_error("TLS support not enabled");
+    return false;
+#endif
+}
+
+bool SSLContext::enable_ktls() {
+#if defined(ENABLE_TLS) && defined(SSL_OP_ENABLE_KTLS)
+    if (!context_) {
+        set_error("SSL context not initialized");
+        return false;
+    }
+    SSL_CTX_set_options(context_->native_handle(), SSL_OP_ENABLE_KTLS);
+    return true;
+#else
+    return false;
+#endif
+}
+
+TLSStats SSLContext::stats() const {
+    TLSStats stats;
+    if (!state_) return stats;
+    stats.full_handshakes = state_->full_handshakes.load(std::memory_order_relaxed);
+    stats.resumed_handshakes = state_->resumed_handshakes.load(std::memory_order_relaxed);
+    stats.failed_handshakes = state_->failed_handshakes.load(std::memory_order_relaxed);
+    stats.handshake_cpu_ns = state_->handshake_cpu_ns.load(std::memory_order_relaxed);
+    stats.ktls_connections = state_->ktls_connections.load(std::memory_order_relaxed);
+    stats.ticket_key_rotations = state_->ticket_key_rotations.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void SSLContext::log_stats(const std::string& protocol) const {
+    auto tls = stats();
+    uint64_t handshakes = tls.full_handshakes + tls.resumed_handshakes;
+    LOG_INFO_FMT("{} TLS handshakes: {} full, {} resumed, {} failed, {} us CPU average",
+                 protocol, tls.full_handshakes, tls.resumed_handshakes, tls.failed_handshakes,
+                 handshakes ? tls.handshake_cpu_ns / handshakes / 1000 : 0);
+}
+
 void SSLContext::set_error(const std::string& msg) {
     last_error_ = msg;
 #ifdef ENABLE_TLS
@@ -276,6 +577,23 @@ SSLContext SSLContext::create_server_context(
     return ctx;
 }
 
+SSLContext SSLContext::create_server_context(const TLSConfig& config) {
+    SSLContext ctx = create_server_context(config.certificate_file, config.private_key_file,
+                                           config.ca_file, config.ciphers);
+    if (!ctx.is_initialized()) {
+        LOG_ERROR_FMT("Failed to configure TLS: {}", ctx.last_error());
+        return ctx;
+    }
+
+    ctx.enable_session_resumption(config.session_cache_size,
+                                  std::chrono::seconds(config.session_timeout),
+                                  std::chrono::seconds(config.ticket_key_lifetime));
+    if (config.enable_ktls && !ctx.enable_ktls()) {
+        LOG_WARNING("Kernel TLS requested but not supported by this OpenSSL build");
+    }
+    return ctx;
+}
+
 SSLContext SSLContext::create_client_context(
     const std::filesystem::path& ca_file,
     bool verify_server) {
@@ -0,0 +1,192 @@
+#include "storage/compression.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#ifdef ENABLE_COMPRESSION
+#include <zstd.h>
+#endif
+
+namespace email {
+namespace compression {
+
+namespace {
+
+// ZSTD_MAGICNUMBER as it appears on disk.
+constexpr unsigned char frame_magic[] = {0x28, 0xB5, 0x2F, 0xFD};
+
+}  // namespace
+
+bool available() {
+#ifdef ENABLE_COMPRESSION
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool is_compressed(std::string_view prefix) {
+    return prefix.size() >= sizeof(frame_magic) &&
+           std::memcmp(prefix.data(), frame_magic, sizeof(frame_magic)) == 0;
+}
+
+#ifdef ENABLE_COMPRESSION
+
+std::optional<uint64_t> content_size(std::string_view prefix) {
+    if (!is_compressed(prefix)) {
+        return std::nullopt;
+    }
+    unsigned long long size = ZSTD_getFrameContentSize(prefix.data(), prefix.size());
+    if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR) {
+        return std::nullopt;
+    }
+    return static_cast<uint64_t>(size);
+}
+
+std::optional<std::string> compress(std::string_view data, int level) {
+    std::string out(ZSTD_compressBound(data.size()), '\0');
+    // The one-shot API records the content size in the frame header.
+    std::size_t size = ZSTD_compress(out.data(), out.size(), data.data(), data.size(), level);
+    if (ZSTD_isError(size)) {
+        return std::nullopt;
+    }
+    out.resize(size);
+    return out;
+}
+
+std::optional<std::string> decompress(std::string_view data) {
+    auto size = content_size(data);
+    if (!size) {
+        return std::nullopt;
+    }
+    std::string out(*size, '\0');
+    std::size_t produced = ZSTD_decompress(out.data(), out.size(), data.data(), data.size());
+    if (ZSTD_isError(produced) || produced != out.size()) {
+        return std::nullopt;
+    }
+    return out;
+}
+
+std::unique_ptr<Reader> Reader::open(int fd) {
+    char prefix[header_size];
+    ssize_t got;
+    do {
+        got = ::pread(fd, prefix, sizeof(prefix), 0);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        return nullptr;
+    }
+    auto size = content_size(std::string_view(prefix, static_cast<std::size_t>(got)));
+    if (!size) {
+        return nullptr;
+    }
+    std::unique_ptr<Reader> reader(new Reader(fd, *size));
+    if (!reader->stream_) {
+        return nullptr;
+    }
+    return reader;
+}
+
+Reader::Reader(int fd, uint64_t size) : fd_(fd), size_(size), stream_(ZSTD_createDStream()) {
+}
+
+Reader::~Reader() {
+    ZSTD_freeDStream(static_cast<ZSTD_DStream*>(stream_));
+}
+
+bool Reader::restart() {
+    input_.clear();
+    input_pos_ = 0;
+    file_offset_ = 0;
+    position_ = 0;
+    finished_ = false;
+    return !ZSTD_isError(ZSTD_DCtx_reset(static_cast<ZSTD_DStream*>(stream_),
+                                         ZSTD_reset_session_only));
+}
+
+ssize_t Reader::read(uint64_t offset, char* buffer, std::size_t length) {
+    if (offset < position_ && !restart()) {
+        errno = EIO;
+        return -1;
+    }
+
+    char discard[16 * 1024];
+    for (;;) {
+        // Up to `offset` the output is thrown away.
+        const bool skipping = position_ < offset;
+        ZSTD_outBuffer out{skipping ? discard : buffer,
+                           skipping ? std::min<uint64_t>(sizeof(discard), offset - position_)
+                                    : length,
+                           0};
+        while (out.pos < out.size && !finished_) {
+            if (input_pos_ == input_.size()) {
+                input_.resize(ZSTD_DStreamInSize());
+                ssize_t got = ::pread(fd_, input_.data(), input_.size(),
+                                      static_cast<off_t>(file_offset_));
+                if (got < 0) {
+                    input_.clear();
+                    if (errno == EINTR) continue;
+                    return -1;
+                }
+                input_.resize(static_cast<std::size_t>(got));
+                input_pos_ = 0;
+                file_offset_ += static_cast<uint64_t>(got);
+                if (got == 0) {
+                    errno = EIO;  // Truncated frame
+                    return -1;
+                }
+            }
+            ZSTD_inBuffer in{input_.data(), input_.size(), input_pos_};
+            std::size_t result = ZSTD_decompressStream(static_cast<ZSTD_DStream*>(stream_),
+                                                       &out, &in);
+            input_pos_ = in.pos;
+            if (ZSTD_isError(result)) {
+                errno = EIO;
+                return -1;
+            }
+            finished_ = result == 0;
+        }
+        position_ += out.pos;
+        if (!skipping || out.pos == 0) {
+            return skipping ? 0 : static_cast<ssize_t>(out.pos);
+        }
+    }
+}
+
+#else
+
+std::optional<uint64_t> content_size(std::string_view) {
+    return std::nullopt;
+}
+
+std::optional<std::string> compress(std::string_view, int) {
+    return std::nullopt;
+}
+
+std::optional<std::string> decompress(std::string_view) {
+    return std::nullopt;
+}
+
+std::unique_ptr<Reader> Reader::open(int) {
+    return nullptr;
+}
+
+Reader::Reader(int fd, uint64_t size) : fd_(fd), size_(size) {
+}
+
+Reader::~Reader() = default;
+
+bool Reader::restart() {
+    return false;
+}
+
+ssize_t Reader::read(uint64_t, char*, std::size_t) {
+    errno = ENOTSUP;
+    return -1;
+}
+
+#endif
+
+}  // namespace compression
+}  // namespace email
@@ -0,0 +1,101 @@
+#include "storage/group_commit.hpp"
+#include "logger.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+
+namespace email {
+
+namespace {
+
+bool fsync_directory(const std::string& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERROR_FMT("Cannot open {} to sync it: {}", dir, std::strerror(errno));
+        return false;
+    }
+    bool synced = ::fsync(fd) == 0;
+    if (!synced) {
+        LOG_ERROR_FMT("fsync of {} failed: {}", dir, std::strerror(errno));
+    }
+    ::close(fd);
+    return synced;
+}
+
+}  // namespace
+
+GroupCommit& GroupCommit::instance() {
+    static GroupCommit instance;
+    return instance;
+}
+
+GroupCommit::GroupCommit() : thread_([this] { run(); }) {
+}
+
+GroupCommit::~GroupCommit() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_.notify_all();
+    thread_.join();
+}
+
+bool GroupCommit::sync_directory(const std::filesystem::path& dir) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const std::string key = dir.string();
+    pending_.insert(key);
+    ++requests_;
+    const uint64_t batch = open_batch_;
+    work_.notify_one();
+    done_.wait(lock, [&] { return completed_batch_ >= batch; });
+
+    auto it = failed_.find(key);
+    return it == failed_.end() || it->second != batch;
+}
+
+void GroupCommit::run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        work_.wait(lock, [this] { return stopping_ || !pending_.empty(); });
+        if (pending_.empty()) {
+            return;  // Stopping with nobody waiting
+        }
+
+        // Later requests go into the next batch while this one syncs.
+        const uint64_t batch = open_batch_++;
+        std::vector<std::string> dirs(pending_.begin(), pending_.end());
+        pending_.clear();
+        lock.unlock();
+
+        std::vector<std::string> failed;
+        for (const auto& dir : dirs) {
+            if (!fsync_directory(dir)) {
+                failed.push_back(dir);
+            }
+        }
+
+        lock.lock();
+        for (auto& dir : failed) {
+            failed_[std::move(dir)] = batch;
+        }
+        syncs_ += dirs.size();
+        completed_batch_ = batch;
+        done_.notify_all();
+    }
+}
+
+uint64_t GroupCommit::syncs() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return syncs_;
+}
+
+uint64_t GroupCommit::requests() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return requests_;
+}
+
+}  // namespace email
@@ -0,0 +1,62 @@
+#include "storage/mailbox_events.hpp"
+
+#include <algorithm>
+
+namespace email {
+
+MailboxEvents::Subscription::~Subscription() {
+    events_.unsubscribe(this);
+}
+
+MailboxEvents& MailboxEvents::instance() {
+    static MailboxEvents instance;
+    return instance;
+}
+
+std::unique_ptr<MailboxEvents::Subscription> MailboxEvents::subscribe(
+        std::string key, std::function<void()> notify) {
+    std::unique_ptr<Subscription> subscription(
+        new Subscription(*this, std::move(key), std::move(notify)));
+    auto& shard = shard_for(subscription->key_);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.subscribers[subscription->key_].push_back(subscription.get());
+    count_.fetch_add(1, std::memory_order_relaxed);
+    return subscription;
+}
+
+void MailboxEvents::unsubscribe(Subscription* subscription) {
+    auto& shard = shard_for(subscription->key_);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.subscribers.find(subscription->key_);
+    if (it == shard.subscribers.end()) {
+        return;
+    }
+    auto& list = it->second;
+    auto pos = std::find(list.begin(), list.end(), subscription);
+    if (pos == list.end()) {
+        return;
+    }
+    *pos = list.back();
+    list.pop_back();
+    if (list.empty()) {
+        shard.subscribers.erase(it);
+    }
+    count_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void MailboxEvents::publish(const std::string& key) {
+    if (count_.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+    auto& shard = shard_for(key);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.subscribers.find(key);
+    if (it == shard.subscribers.end()) {
+        return;
+    }
+    for (Subscription* subscription : it->second) {
+        subscription->notify_();
+    }
+}
+
+}  // namespace email
@@ -0,0 +1,1070 @@
+#include "storage/mailbox_index.hpp"
+#include "storage/compression.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace email {
+
+struct MailboxIndex::Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t capacity;     // Record slots before the name heap
+    uint32_t count;        // Slots in use, expunged ones included
+    uint32_t live;         // Slots holding a message
+    uint32_t uid_validity; // Cached from the UID list
+    uint32_t next_uid;
+    uint32_t names_size;   // Bytes used in the name heap
+    uint32_t garbage;      // Heap bytes no live record refers to
+    uint32_t changes;      // Bumped by writes highest_modseq does not count
+    int64_t cur_mtime;     // Directory mtimes (ns) seen by the last sync
+    int64_t new_mtime;
+    int64_t synced_at;     // When that sync read them (ns)
+    uint64_t live_bytes;   // Sum of the live records' sizes
+    uint64_t highest_modseq;
+    uint64_t vanished_floor;  // email.vanished holds every removal after this
+};
+
+struct MailboxIndex::Record {
+    uint64_t size;
+    int64_t internal_date;
+    uint64_t flags;
+    uint32_t name_offset;  // Into the name heap
+    uint16_t name_length;
+    uint8_t state;
+    uint8_t reserved;
+    uint32_t uid;
+    uint32_t body_offset;  // Where the body starts; 0 until someone looked
+    uint64_t modseq;
+};
+
+struct MailboxIndex::Candidate {
+    std::string filename;
+    bool in_new = false;
+    uint64_t size = 0;
+    int64_t internal_date = 0;
+    uint32_t body_offset = 0;
+    uint32_t uid = 0;     // Filled in from the UID list by rewrite()
+    uint64_t modseq = 0;  // 0 for newcomers, numbered by rewrite()
+};
+
+namespace {
+
+constexpr char index_magic[4] = {'M', 'D', 'I', 'X'};
+constexpr uint32_t index_version = 4;
+constexpr uint32_t min_capacity = 64;
+
+constexpr uint8_t state_new = 1;
+constexpr uint8_t state_expunged = 2;
+
+// Filesystem timestamps are coarse: a change in the same tick as the mtime
+// we read does not move it. Directory mtimes this close to the moment they
+// were read are therefore re-checked by the next listing.
+constexpr int64_t mtime_slack_ns = 1'000'000'000;
+
+// Name heap garbage worth a compaction.
+constexpr uint64_t compact_garbage = 64 * 1024;
+
+// Removals email.vanished keeps before its older half is cut off.
+constexpr std::size_t max_vanished = 16384;
+
+constexpr std::string_view vanished_format = "email.vanished 1\n";
+
+int64_t mtime_ns(const struct stat& st) {
+    return int64_t{st.st_mtim.tv_sec} * 1'000'000'000 + st.st_mtim.tv_nsec;
+}
+
+int64_t dir_mtime(const std::filesystem::path& path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) ? mtime_ns(st) : -1;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Where a fresh index starts counting: microseconds since the epoch stay
+// ahead of any counter that only moves once per change.
+uint64_t fresh_modseq() {
+    return static_cast<uint64_t>(now_ns() / 1000);
+}
+
+uint64_t parse_u64(std::string_view text) {
+    uint64_t value = 0;
+    std::from_chars(text.data(), text.data() + text.size(), value);
+    return value;
+}
+
+// A newcomer's logical size; a compressed file's frame header has it.
+uint64_t logical_size(int dir_fd, const char* name, const struct stat& st) {
+    const auto file_size = static_cast<uint64_t>(st.st_size);
+    int fd = ::openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return file_size;
+    }
+    char prefix[compression::header_size];
+    ssize_t got = ::pread(fd, prefix, sizeof(prefix), 0);
+    ::close(fd);
+    if (got > 0) {
+        if (auto size = compression::content_size({prefix, static_cast<std::size_t>(got)})) {
+            return *size;
+        }
+    }
+    return file_size;
+}
+
+bool pwrite_all(int fd, const void* data, std::size_t size, off_t offset) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t written = ::pwrite(fd, bytes, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bytes += written;
+        size -= static_cast<std::size_t>(written);
+        offset += written;
+    }
+    return true;
+}
+
+}  // namespace
+
+MailboxIndex::MailboxIndex(std::filesystem::path mailbox_path)
+    : mailbox_path_(std::move(mailbox_path))
+    , index_path_(mailbox_path_ / file_name)
+    , uid_list_(mailbox_path_ / UidList::file_name)
+    , vanished_log_(mailbox_path_ / "email.vanished", vanished_format,
+                    [this] { vanished_.clear(); }) {
+    static_assert(sizeof(Header) == 88, "index header layout changed");
+    static_assert(sizeof(Record) == 48, "index record layout changed");
+}
+
+MailboxIndex::~MailboxIndex() {
+    close();
+}
+
+std::size_t MailboxIndex::heap_offset(uint32_t capacity) {
+    return sizeof(Header) + std::size_t{capacity} * sizeof(Record);
+}
+
+uint64_t MailboxIndex::flags_from_filename(std::string_view filename) {
+    uint64_t flags = 0;
+    auto pos = filename.find(":2,");
+    if (pos != std::string_view::npos) {
+        for (char flag : filename.substr(pos + 3)) {
+            flags |= flag_bit(flag);
+        }
+    }
+    return flags;
+}
+
+bool MailboxIndex::lock(int operation, bool create) {
+    last_error_.clear();
+
+    // Another process may replace the file between our open() and flock();
+    // a few retries cover even a busy mailbox.
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        if (fd_ < 0) {
+            int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0);
+            fd_ = ::open(index_path_.c_str(), flags, 0600);
+            if (fd_ < 0) {
+                if (errno != ENOENT || create) {
+                    last_error_ = std::string("open: ") + std::strerror(errno);
+                }
+                return false;
+            }
+        }
+
+        while (::flock(fd_, operation) != 0) {
+            if (errno != EINTR) {
+                last_error_ = std::string("flock: ") + std::strerror(errno);
+                return false;
+            }
+        }
+
+        struct stat by_path, by_fd;
+        if (::stat(index_path_.c_str(), &by_path) == 0 && ::fstat(fd_, &by_fd) == 0 &&
+            by_path.st_ino == by_fd.st_ino && by_path.st_dev == by_fd.st_dev) {
+            if (map()) {
+                return true;
+            }
+            unlock();
+            return false;
+        }
+        close();
+    }
+
+    last_error_ = "index keeps being replaced";
+    return false;
+}
+
+void MailboxIndex::unlock() {
+    if (fd_ >= 0) {
+        ::flock(fd_, LOCK_UN);
+    }
+}
+
+void MailboxIndex::close() {
+    if (map_) {
+        ::munmap(const_cast<char*>(map_), map_size_);
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    ids_.clear();
+    ids_indexed_ = 0;
+}
+
+bool MailboxIndex::map() {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+        last_error_ = std::string("fstat: ") + std::strerror(errno);
+        return false;
+    }
+
+    // Writers only ever append, so a mapping of the current size stays valid.
+    auto size = static_cast<std::size_t>(st.st_size);
+    if (map_ && size == map_size_) {
+        return true;
+    }
+    if (map_) {
+        ::munmap(const_cast<char*>(map_), map_size_);
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+    if (size == 0) {
+        return true;
+    }
+
+    void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+    if (mapped == MAP_FAILED) {
+        last_error_ = std::string("mmap: ") + std::strerror(errno);
+        return false;
+    }
+    map_ = static_cast<const char*>(mapped);
+    map_size_ = size;
+    return true;
+}
+
+const MailboxIndex::Header& MailboxIndex::header() const {
+    return *reinterpret_cast<const Header*>(map_);
+}
+
+const MailboxIndex::Record& MailboxIndex::record(uint32_t index) const {
+    return reinterpret_cast<const Record*>(map_ + sizeof(Header))[index];
+}
+
+std::string_view MailboxIndex::name_of(const Record& record) const {
+    const Header& h = header();
+    if (std::size_t{record.name_offset} + record.name_length > h.names_size) {
+        return {};  // Damaged record; never read past the heap
+    }
+    return {map_ + heap_offset(h.capacity) + record.name_offset, record.name_length};
+}
+
+IndexEntry MailboxIndex::entry_of(const Record& record) const {
+    IndexEntry entry;
+    entry.filename = name_of(record);
+    entry.in_new = (record.state & state_new) != 0;
+    entry.size = record.size;
+    entry.internal_date = record.internal_date;
+    entry.flags = record.flags;
+    entry.uid = record.uid;
+    entry.body_offset = record.body_offset;
+    entry.modseq = record.modseq;
+    return entry;
+}
+
+bool MailboxIndex::header_valid() const {
+    if (map_size_ < sizeof(Header)) {
+        return false;
+    }
+    const Header& h = header();
+    if (std::memcmp(h.magic, index_magic, sizeof(index_magic)) != 0 ||
+        h.version != index_version || h.count > h.capacity || h.live > h.count) {
+        return false;
+    }
+    return heap_offset(h.capacity) + h.names_size <= map_size_;
+}
+
+bool MailboxIndex::up_to_date(int64_t cur_mtime, int64_t new_mtime) const {
+    const Header& h = header();
+    return h.cur_mtime == cur_mtime && h.new_mtime == new_mtime &&
+           std::max(cur_mtime, new_mtime) + mtime_slack_ns <= h.synced_at;
+}
+
+bool MailboxIndex::write_header(const Header& h) {
+    if (!pwrite_all(fd_, &h, sizeof(h), 0)) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool MailboxIndex::lock_current() {
+    // Read before the directories are, so a change made during the sync
+    // leaves the index stale rather than silently missing it.
+    int64_t cur_mtime = dir_mtime(mailbox_path_ / "cur");
+    int64_t new_mtime = dir_mtime(mailbox_path_ / "new");
+    if (cur_mtime < 0 || new_mtime < 0) {
+        last_error_ = "not a maildir";
+        return false;
+    }
+
+    if (!lock(LOCK_SH, true)) {
+        return false;
+    }
+    if (!header_valid() || !up_to_date(cur_mtime, new_mtime)) {
+        unlock();
+        if (!lock(LOCK_EX, true)) {
+            return false;
+        }
+        // Someone else may have brought it up to date while we waited.
+        if ((!header_valid() || !up_to_date(cur_mtime, new_mtime)) &&
+            !sync(cur_mtime, new_mtime)) {
+            LOG_WARNING_FMT("Mailbox index {}: {}", index_path_.string(), last_error_);
+            unlock();
+            return false;
+        }
+    }
+    uid_validity_ = header().uid_validity;
+    uid_next_ = header().next_uid;
+    highest_modseq_ = header().highest_modseq;
+    changes_ = header().changes;
+    return true;
+}
+
+bool MailboxIndex::for_each(const std::function<void(const IndexEntry&)>& fn) {
+    if (!lock_current()) {
+        return false;
+    }
+    const uint32_t count = header().count;
+    for (uint32_t i = 0; i < count; ++i) {
+        const Record& r = record(i);
+        if (!(r.state & state_expunged)) {
+            fn(entry_of(r));
+        }
+    }
+    unlock();
+    return true;
+}
+
+bool MailboxIndex::totals(uint64_t& messages, uint64_t& bytes) {
+    if (!lock_current()) {
+        return false;
+    }
+    messages = header().live;
+    bytes = header().live_bytes;
+    unlock();
+    return true;
+}
+
+bool MailboxIndex::sync(int64_t cur_mtime, int64_t new_mtime) {
+    const bool valid = header_valid();
+    const uint32_t count = valid ? header().count : 0;
+
+    // Live records by file name, one table per directory.
+    std::unordered_map<std::string_view, uint32_t> known[2];
+    std::vector<bool> seen(count, false);
+    std::size_t found = 0;
+    for (uint32_t i = 0; i < count; ++i) {
+        const Record& r = record(i);
+        if (!(r.state & state_expunged)) {
+            known[(r.state & state_new) ? 1 : 0].emplace(name_of(r), i);
+        }
+    }
+
+    // readdir() rather than directory_iterator: only unknown names need a
+    // stat(), and no path is built for the others.
+    std::vector<Candidate> added;
+    for (bool in_new : {false, true}) {
+        auto dir_path = mailbox_path_ / (in_new ? "new" : "cur");
+        DIR* dir = ::opendir(dir_path.c_str());
+        if (!dir) {
+            last_error_ = std::string("opendir: ") + std::strerror(errno);
+            return false;
+        }
+        while (const dirent* entry = ::readdir(dir)) {
+            if (entry->d_name[0] == '.' ||
+                (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)) {
+                continue;
+            }
+            std::string_view name(entry->d_name);
+            auto it = known[in_new].find(name);
+            if (it != known[in_new].end()) {
+                if (!seen[it->second]) {
+                    seen[it->second] = true;
+                    ++found;
+                }
+                continue;
+            }
+
+            struct stat st;
+            if (::fstatat(::dirfd(dir), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)) {
+                continue;
+            }
+            Candidate candidate;
+            candidate.filename = name;
+            candidate.in_new = in_new;
+            candidate.size = logical_size(::dirfd(dir), entry->d_name, st);
+            candidate.internal_date = st.st_mtim.tv_sec;
+            added.push_back(std::move(candidate));
+        }
+        ::closedir(dir);
+    }
+
+    if (valid && found == header().live && added.empty()) {
+        Header h = header();
+        h.cur_mtime = cur_mtime;
+        h.new_mtime = new_mtime;
+        h.synced_at = now_ns();
+        return write_header(h);
+    }
+
+    // Keep what the index knew, in its order, then add newcomers oldest
+    // first so they get UIDs in arrival order. Messages that went away
+    // lose theirs; should they come back, they are new messages.
+    if (!load_uids()) {
+        return false;
+    }
+    std::vector<Candidate> entries;
+    entries.reserve(found + added.size());
+    std::vector<uint32_t> gone;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!seen[i] && !(record(i).state & state_expunged)) {
+            auto name = name_of(record(i));
+            uid_list_.forget(name.substr(0, name.find(':')));
+            gone.push_back(record(i).uid);
+        }
+        if (seen[i]) {
+            const Record& r = record(i);
+            Candidate candidate;
+            candidate.filename = name_of(r);
+            candidate.in_new = (r.state & state_new) != 0;
+            candidate.size = r.size;
+            candidate.internal_date = r.internal_date;
+            candidate.body_offset = r.body_offset;
+            candidate.modseq = r.modseq;
+            entries.push_back(std::move(candidate));
+        }
+    }
+    // Without a trustworthy header, nothing is known of earlier removals.
+    uint64_t highest_modseq = valid ? header().highest_modseq : fresh_modseq();
+    uint64_t vanished_floor = valid ? header().vanished_floor : highest_modseq;
+    if (!gone.empty() && !log_vanished(gone, highest_modseq, vanished_floor)) {
+        return false;
+    }
+    std::sort(added.begin(), added.end(), [](const Candidate& a, const Candidate& b) {
+        return a.internal_date != b.internal_date ? a.internal_date < b.internal_date
+                                                  : a.filename < b.filename;
+    });
+    std::move(added.begin(), added.end(), std::back_inserter(entries));
+
+    if (!valid && map_size_ > 0) {
+        LOG_INFO_FMT("Rebuilding mailbox index {}", index_path_.string());
+    }
+    return rewrite(std::move(entries), cur_mtime, new_mtime, now_ns(),
+                   highest_modseq, vanished_floor);
+}
+
+std::vector<MailboxIndex::Candidate> MailboxIndex::live_candidates() const {
+    std::vector<Candidate> entries;
+    entries.reserve(header().live);
+    const uint32_t count = header().count;
+    for (uint32_t i = 0; i < count; ++i) {
+        const Record& r = record(i);
+        if (r.state & state_expunged) continue;
+        Candidate candidate;
+        candidate.filename = name_of(r);
+        candidate.in_new = (r.state & state_new) != 0;
+        candidate.size = r.size;
+        candidate.internal_date = r.internal_date;
+        candidate.body_offset = r.body_offset;
+        candidate.modseq = r.modseq;
+        entries.push_back(std::move(candidate));
+    }
+    return entries;
+}
+
+bool MailboxIndex::rewrite(std::vector<Candidate> entries, int64_t cur_mtime,
+                           int64_t new_mtime, int64_t synced_at, uint64_t highest_modseq,
+                           uint64_t vanished_floor) {
+    if (!load_uids()) {
+        return false;
+    }
+    // The list is authoritative; it also hands out UIDs for newcomers.
+    for (auto& entry : entries) {
+        entry.uid = uid_list_.assign(entry.filename.substr(0, entry.filename.find(':')));
+        if (entry.modseq == 0) {
+            entry.modseq = ++highest_modseq;
+        }
+    }
+    bool uids_saved;
+    if (uid_list_.lines() > 2 * entries.size() + min_capacity) {
+        // Mostly departed messages: compact the list along with the index.
+        std::vector<std::pair<uint32_t, std::string>> live;
+        live.reserve(entries.size());
+        for (const auto& entry : entries) {
+            live.emplace_back(entry.uid, entry.filename.substr(0, entry.filename.find(':')));
+        }
+        uids_saved = uid_list_.create(uid_list_.uid_validity(), uid_list_.next_uid(), live);
+    } else {
+        uids_saved = uid_list_.flush();
+    }
+    if (!uids_saved) {
+        last_error_ = "uidlist: " + uid_list_.last_error();
+        return false;
+    }
+    // Listings come out in UID order.
+    std::sort(entries.begin(), entries.end(),
+              [](const Candidate& a, const Candidate& b) { return a.uid < b.uid; });
+
+    const auto capacity = static_cast<uint32_t>(
+        std::max<std::size_t>(min_capacity, entries.size() * 2));
+
+    std::string image(heap_offset(capacity), '\0');
+    std::size_t names_size = 0;
+    uint64_t live_bytes = 0;
+    for (const auto& entry : entries) {
+        names_size += entry.filename.size();
+        live_bytes += entry.size;
+    }
+    image.reserve(image.size() + names_size);
+
+    for (std::size_t i = 0; i < entries.size(); ++i) {
+        const auto& entry = entries[i];
+        Record r{};
+        r.size = entry.size;
+        r.internal_date = entry.internal_date;
+        r.flags = flags_from_filename(entry.filename);
+        r.name_offset = static_cast<uint32_t>(image.size() - heap_offset(capacity));
+        r.name_length = static_cast<uint16_t>(entry.filename.size());
+        r.state = entry.in_new ? state_new : 0;
+        r.uid = entry.uid;
+        r.body_offset = entry.body_offset;
+        r.modseq = entry.modseq;
+        std::memcpy(image.data() + sizeof(Header) + i * sizeof(Record), &r, sizeof(r));
+        image.append(entry.filename);
+    }
+
+    Header h{};
+    std::memcpy(h.magic, index_magic, sizeof(index_magic));
+    h.version = index_version;
+    h.capacity = capacity;
+    h.count = h.live = static_cast<uint32_t>(entries.size());
+    h.uid_validity = uid_list_.uid_validity();
+    h.next_uid = uid_list_.next_uid();
+    h.names_size = static_cast<uint32_t>(names_size);
+    h.cur_mtime = cur_mtime;
+    h.new_mtime = new_mtime;
+    h.synced_at = synced_at;
+    h.live_bytes = live_bytes;
+    h.highest_modseq = highest_modseq;
+    h.vanished_floor = vanished_floor;
+    // A sync can move messages between new/ and cur/ without new names.
+    h.changes = header_valid() ? header().changes + 1 : 0;
+    std::memcpy(image.data(), &h, sizeof(h));
+
+    auto tmp_path = index_path_;
+    tmp_path += ".tmp." + std::to_string(::getpid());
+    int tmp_fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd < 0) {
+        last_error_ = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    bool written = pwrite_all(tmp_fd, image.data(), image.size(), 0);
+    ::close(tmp_fd);
+    if (!written || ::rename(tmp_path.c_str(), index_path_.c_str()) != 0) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+
+    // Lock the new file before letting go of the old one; processes queued
+    // on the old lock notice the replacement and reopen.
+    int fd = ::open(index_path_.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        last_error_ = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    while (::flock(fd, LOCK_EX) != 0 && errno == EINTR) {
+    }
+    close();
+    fd_ = fd;
+    return map();
+}
+
+std::optional<uint32_t> MailboxIndex::find(std::string_view unique_id) {
+    const Header& h = header();
+    if (ids_indexed_ > h.count) {
+        ids_.clear();
+        ids_indexed_ = 0;
+    }
+    for (; ids_indexed_ < h.count; ++ids_indexed_) {
+        const Record& r = record(ids_indexed_);
+        if (!(r.state & state_expunged)) {
+            auto name = name_of(r);
+            ids_[std::string(name.substr(0, name.find(':')))] = ids_indexed_;
+        }
+    }
+
+    // A message has at most one live record and keeps its unique_id across
+    // renames, so an entry that fails the check was removed.
+    auto it = ids_.find(std::string(unique_id));
+    if (it == ids_.end()) {
+        return std::nullopt;
+    }
+    const Record& r = record(it->second);
+    auto name = name_of(r);
+    if ((r.state & state_expunged) || name.substr(0, name.find(':')) != unique_id) {
+        ids_.erase(it);
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+bool MailboxIndex::add(std::string_view filename, bool in_new, uint64_t size,
+                       int64_t internal_date, uint32_t body_offset) {
+    Addition one{filename, in_new, size, internal_date, body_offset};
+    return add_all(std::span<const Addition>(&one, 1));
+}
+
+bool MailboxIndex::add_all(std::span<const Addition> additions) {
+    if (!lock(LOCK_EX, false)) {
+        return last_error_.empty();
+    }
+    bool ok = true;
+    if (header_valid()) {
+        // A file the index already knows (seen by a sync before we got
+        // here) only needs its record brought up to date.
+        std::vector<Addition> appended;
+        appended.reserve(additions.size());
+        for (const auto& addition : additions) {
+            auto unique_id = addition.filename.substr(0, addition.filename.find(':'));
+            if (auto index = find(unique_id)) {
+                ok = update_record(*index, addition.filename, addition.in_new);
+                if (!ok) break;
+            } else {
+                appended.push_back(addition);
+            }
+        }
+        if (ok && !appended.empty()) {
+            ok = append_records(appended);
+        }
+    }
+    if (!ok) {
+        LOG_WARNING_FMT("Mailbox index {}: {}", index_path_.string(), last_error_);
+    }
+    unlock();
+    return ok;
+}
+
+bool MailboxIndex::rename(std::string_view unique_id, std::string_view filename, bool in_new) {
+    Rename one{unique_id, filename, in_new};
+    return rename_all(std::span<const Rename>(&one, 1));
+}
+
+bool MailboxIndex::rename_all(std::span<const Rename> renames) {
+    if (!lock(LOCK_EX, false)) {
+        return last_error_.empty();
+    }
+    bool ok = true;
+    if (header_valid()) {
+        Header h = header();
+        bool changed = false;
+        for (const auto& rename : renames) {
+            // Not indexed yet: the next sync picks the file up under its new name.
+            auto index = find(rename.unique_id);
+            if (!index) {
+                continue;
+            }
+            if (!stage_update(*index, rename.filename, rename.in_new, h)) {
+                ok = false;
+                break;
+            }
+            changed = true;
+        }
+        // Whatever was staged is only visible once the header says so.
+        if (changed) {
+            ok = write_header(h) && map() && compact_if_sparse() && ok;
+        }
+    }
+    if (!ok) {
+        LOG_WARNING_FMT("Mailbox index {}: {}", index_path_.string(), last_error_);
+    }
+    unlock();
+    return ok;
+}
+
+bool MailboxIndex::remove(std::string_view unique_id) {
+    if (!lock(LOCK_EX, false)) {
+        return last_error_.empty();
+    }
+    bool ok = true;
+    if (header_valid()) {
+        if (auto index = find(unique_id)) {
+            ok = remove_records(std::span<const uint32_t>(&*index, 1));
+        }
+    }
+    if (!ok) {
+        LOG_WARNING_FMT("Mailbox index {}: {}", index_path_.string(), last_error_);
+    }
+    unlock();
+    return ok;
+}
+
+bool MailboxIndex::remove_all(std::span<const std::string> unique_ids) {
+    if (!lock(LOCK_EX, false)) {
+        return last_error_.empty();
+    }
+    bool ok = true;
+    if (header_valid()) {
+        std::vector<uint32_t> indexes;
+        indexes.reserve(unique_ids.size());
+        for (const auto& unique_id : unique_ids) {
+            if (auto index = find(unique_id)) {
+                indexes.push_back(*index);
+            }
+        }
+        if (!indexes.empty()) {
+            ok = remove_records(indexes);
+        }
+    }
+    if (!ok) {
+        LOG_WARNING_FMT("Mailbox index {}: {}", index_path_.string(), last_error_);
+    }
+    unlock();
+    return ok;
+}
+
+bool MailboxIndex::set_body_offset(std::string_view unique_id, uint32_t body_offset) {
+    if (!lock(LOCK_EX, false)) {
+        return last_error_.empty();
+    }
+    bool ok = true;
+    if (header_valid()) {
+        if (auto index = find(unique_id)) {
+            Record r = record(*index);
+            r.body_offset = body_offset;
+            Header h = header();
+            ++h.changes;
+            ok = pwrite_all(fd_, &r, sizeof(r),
+                            static_cast<off_t>(sizeof(Header) + std::size_t{*index} * sizeof(Record))) &&
+                 write_header(h);
+            if (!ok) {
+                last_error_ = std::string("write: ") + std::strerror(errno);
+                LOG_WARNING_FMT("Mailbox index {}: {}", index_path_.string(), last_error_);
+            }
+        }
+    }
+    unlock();
+    return ok;
+}
+
+uint32_t MailboxIndex::uid_of(std::string_view unique_id) {
+    if (!lock(LOCK_SH, false)) {
+        return 0;
+    }
+    uint32_t uid = 0;
+    if (header_valid()) {
+        if (auto index = find(unique_id)) {
+            uid = record(*index).uid;
+        }
+    }
+    unlock();
+    return uid;
+}
+
+bool MailboxIndex::append_records(std::span<const Addition> additions) {
+    Header h = header();
+    if (additions.size() > h.capacity - h.count) {
+        // Out of slots: rewrite with room to grow.
+        auto entries = live_candidates();
+        for (const auto& addition : additions) {
+            Candidate candidate;
+            candidate.filename = addition.filename;
+            candidate.in_new = addition.in_new;
+            candidate.size = addition.size;
+            candidate.internal_date = addition.internal_date;
+            candidate.body_offset = addition.body_offset;
+            entries.push_back(std::move(candidate));
+        }
+        return rewrite(std::move(entries), h.cur_mtime, h.new_mtime, h.synced_at,
+                       h.highest_modseq, h.vanished_floor);
+    }
+
+    if (!load_uids()) {
+        return false;
+    }
+    std::string names;
+    std::vector<Record> records(additions.size());
+    for (std::size_t i = 0; i < additions.size(); ++i) {
+        const auto& addition = additions[i];
+        Record& r = records[i];
+        r.size = addition.size;
+        r.internal_date = addition.internal_date;
+        r.flags = flags_from_filename(addition.filename);
+        r.name_offset = static_cast<uint32_t>(h.names_size + names.size());
+        r.name_length = static_cast<uint16_t>(addition.filename.size());
+        r.state = addition.in_new ? state_new : 0;
+        r.body_offset = addition.body_offset;
+        r.uid = uid_list_.assign(addition.filename.substr(0, addition.filename.find(':')));
+        r.modseq = ++h.highest_modseq;
+        names.append(addition.filename);
+        h.live_bytes += addition.size;
+    }
+    if (!uid_list_.flush()) {
+        last_error_ = "uidlist: " + uid_list_.last_error();
+        return false;
+    }
+
+    // Names, then records, then the header that makes them visible.
+    if (!pwrite_all(fd_, names.data(), names.size(),
+                    static_cast<off_t>(heap_offset(h.capacity) + h.names_size)) ||
+        !pwrite_all(fd_, records.data(), records.size() * sizeof(Record),
+                    static_cast<off_t>(sizeof(Header) + std::size_t{h.count} * sizeof(Record)))) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        return false;
+    }
+    h.names_size += static_cast<uint32_t>(names.size());
+    h.count += static_cast<uint32_t>(records.size());
+    h.live += static_cast<uint32_t>(records.size());
+    h.uid_validity = uid_list_.uid_validity();
+    h.next_uid = uid_list_.next_uid();
+    return write_header(h) && map();
+}
+
+bool MailboxIndex::update_record(uint32_t index, std::string_view filename, bool in_new) {
+    Header h = header();
+    return stage_update(index, filename, in_new, h) &&
+           write_header(h) && map() && compact_if_sparse();
+}
+
+bool MailboxIndex::stage_update(uint32_t index, std::string_view filename, bool in_new,
+                                Header& h) {
+    Record r = record(index);
+
+    if (name_of(r) != filename) {
+        r.modseq = ++h.highest_modseq;
+        if (!pwrite_all(fd_, filename.data(), filename.size(),
+                        static_cast<off_t>(heap_offset(h.capacity) + h.names_size))) {
+            last_error_ = std::string("write: ") + std::strerror(errno);
+            return false;
+        }
+        h.garbage += r.name_length;
+        r.name_offset = static_cast<uint32_t>(h.names_size);
+        r.name_length = static_cast<uint16_t>(filename.size());
+        h.names_size += static_cast<uint32_t>(filename.size());
+    } else if (r.state != (in_new ? state_new : 0)) {
+        ++h.changes;  // Moved to cur/ under the same name
+    }
+    r.flags = flags_from_filename(filename);
+    r.state = in_new ? state_new : 0;
+
+    if (!pwrite_all(fd_, &r, sizeof(r),
+                    static_cast<off_t>(sizeof(Header) + std::size_t{index} * sizeof(Record)))) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool MailboxIndex::remove_records(std::span<const uint32_t> indexes) {
+    if (!load_uids()) {
+        return false;
+    }
+    Header h = header();
+    for (uint32_t index : indexes) {
+        auto name = name_of(record(index));
+        uid_list_.forget(name.substr(0, name.find(':')));
+    }
+    if (!uid_list_.flush()) {
+        last_error_ = "uidlist: " + uid_list_.last_error();
+        return false;
+    }
+
+    std::vector<uint32_t> uids;
+    uids.reserve(indexes.size());
+    for (uint32_t index : indexes) {
+        Record r = record(index);
+        r.state |= state_expunged;
+        if (!pwrite_all(fd_, &r, sizeof(r),
+                        static_cast<off_t>(sizeof(Header) + std::size_t{index} * sizeof(Record)))) {
+            last_error_ = std::string("write: ") + std::strerror(errno);
+            return false;
+        }
+        uids.push_back(r.uid);
+        --h.live;
+        h.live_bytes -= std::min(h.live_bytes, r.size);
+        h.garbage += r.name_length;
+    }
+    if (!log_vanished(uids, h.highest_modseq, h.vanished_floor)) {
+        return false;
+    }
+    return write_header(h) && compact_if_sparse();
+}
+
+bool MailboxIndex::compact_if_sparse() {
+    const Header& h = header();
+    bool sparse_records = h.count >= min_capacity && h.count - h.live > h.live;
+    bool sparse_names = h.garbage >= compact_garbage && h.garbage > h.names_size / 2;
+    if (!sparse_records && !sparse_names) {
+        return true;
+    }
+    return rewrite(live_candidates(), h.cur_mtime, h.new_mtime, h.synced_at,
+                   h.highest_modseq, h.vanished_floor);
+}
+
+void MailboxIndex::take_vanished(std::string_view modseq, std::string_view uids) {
+    const uint64_t at = parse_u64(modseq);
+    while (!uids.empty()) {
+        auto end = uids.find(' ');
+        vanished_.emplace_back(at, static_cast<uint32_t>(parse_u64(uids.substr(0, end))));
+        uids.remove_prefix(end == std::string_view::npos ? uids.size() : end + 1);
+    }
+}
+
+bool MailboxIndex::log_vanished(std::span<const uint32_t> uids, uint64_t& highest_modseq,
+                                uint64_t& vanished_floor) {
+    const uint64_t modseq = ++highest_modseq;
+    std::string payload;
+    for (uint32_t uid : uids) {
+        if (!payload.empty()) payload.push_back(' ');
+        payload.append(std::to_string(uid));
+    }
+    auto visit = [this](std::string_view key, uint64_t, std::string_view data) {
+        take_vanished(key, data);
+    };
+    if (vanished_log_.append(std::to_string(modseq), payload, visit) == 0) {
+        last_error_ = "vanished: " + vanished_log_.last_error();
+        return false;
+    }
+    take_vanished(std::to_string(modseq), payload);
+
+    // Cut the older half off once the log covers more than it needs to.
+    auto live = std::upper_bound(vanished_.begin(), vanished_.end(),
+                                 std::pair<uint64_t, uint32_t>{vanished_floor, UINT32_MAX});
+    if (static_cast<std::size_t>(vanished_.end() - live) > max_vanished) {
+        vanished_floor = (vanished_.end() - max_vanished / 2 - 1)->first;
+        const uint64_t floor = vanished_floor;
+        if (!vanished_log_.rewrite([floor](std::string_view key) { return parse_u64(key) > floor; })) {
+            LOG_WARNING_FMT("Mailbox index {}: vanished: {}", index_path_.string(),
+                            vanished_log_.last_error());
+        }
+    }
+    return true;
+}
+
+bool MailboxIndex::modseqs(std::span<const std::string> unique_ids, std::vector<uint64_t>& out) {
+    out.assign(unique_ids.size(), 0);
+    if (!lock(LOCK_SH, false)) {
+        return false;
+    }
+    bool ok = header_valid();
+    if (ok) {
+        for (std::size_t i = 0; i < unique_ids.size(); ++i) {
+            if (auto index = find(unique_ids[i])) {
+                out[i] = record(*index).modseq;
+            }
+        }
+    }
+    unlock();
+    return ok;
+}
+
+bool MailboxIndex::vanished_since(uint64_t modseq, std::vector<uint32_t>& uids) {
+    uids.clear();
+    if (!lock(LOCK_SH, false)) {
+        return false;
+    }
+    bool ok = header_valid() && modseq >= header().vanished_floor;
+    if (ok) {
+        // Appended under the exclusive lock only, so what is there is whole.
+        vanished_log_.read([this](std::string_view key, uint64_t, std::string_view data) {
+            take_vanished(key, data);
+        });
+        ok = vanished_log_.last_error().empty();
+        for (auto it = std::upper_bound(vanished_.begin(), vanished_.end(),
+                                        std::pair<uint64_t, uint32_t>{modseq, UINT32_MAX});
+             it != vanished_.end(); ++it) {
+            uids.push_back(it->second);
+        }
+        std::sort(uids.begin(), uids.end());
+    }
+    unlock();
+    return ok;
+}
+
+bool MailboxIndex::load_uids() {
+    if (uid_list_.load()) {
+        return true;
+    }
+    if (!uid_list_.last_error().empty()) {
+        last_error_ = "uidlist: " + uid_list_.last_error();
+        return false;
+    }
+
+    // No list: recover it from the index if that is intact, otherwise the
+    // mailbox starts numbering afresh and clients must drop what they cached.
+    uint32_t validity = 0;
+    uint32_t next_uid = 1;
+    std::vector<std::pair<uint32_t, std::string>> entries;
+    if (header_valid() && header().uid_validity != 0) {
+        validity = header().uid_validity;
+        next_uid = header().next_uid;
+        const uint32_t count = header().count;
+        for (uint32_t i = 0; i < count; ++i) {
+            const Record& r = record(i);
+            if (!(r.state & state_expunged)) {
+                auto name = name_of(r);
+                entries.emplace_back(r.uid, std::string(name.substr(0, name.find(':'))));
+            }
+        }
+        LOG_WARNING_FMT("Recovering UID list of {} from its index", mailbox_path_.string());
+    } else {
+        validity = fresh_uid_validity();
+    }
+
+    if (!uid_list_.create(validity, next_uid, entries)) {
+        last_error_ = "uidlist: " + uid_list_.last_error();
+        return false;
+    }
+    // UIDs used to be numbered per session next to .uidvalidity.
+    std::error_code ec;
+    std::filesystem::remove(mailbox_path_ / ".uidvalidity", ec);
+    return true;
+}
+
+uint32_t MailboxIndex::fresh_uid_validity() const {
+    auto validity = static_cast<uint32_t>(
+        std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+
+    // Must differ from whatever clients saw before, including the value of
+    // the per-session numbering this list replaces.
+    uint32_t previous = header_valid() ? header().uid_validity : 0;
+    if (previous == 0) {
+        std::ifstream legacy(mailbox_path_ / ".uidvalidity");
+        legacy >> previous;
+    }
+    return validity == previous ? validity + 1 : validity;
+}
+
+}  // namespace email
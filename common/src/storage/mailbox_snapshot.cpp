@@ -0,0 +1,240 @@
+#include "storage/mailbox_snapshot.hpp"
+#include "storage/mailbox_index.hpp"
+#include "storage/maildir.hpp"
+#include "net/memory_budget.hpp"
+#include "metrics.hpp"
+#include <algorithm>
+
+namespace email {
+
+namespace {
+
+Counter& lookups(bool hit) {
+    static Counter& hits = Metrics::instance().counter(
+        "email_snapshot_cache_lookups_total", "Mailbox snapshot cache lookups",
+        {{"result", "hit"}});
+    static Counter& misses = Metrics::instance().counter(
+        "email_snapshot_cache_lookups_total", "Mailbox snapshot cache lookups",
+        {{"result", "miss"}});
+    return hit ? hits : misses;
+}
+
+Counter& evictions() {
+    static Counter& counter = Metrics::instance().counter(
+        "email_snapshot_cache_evictions_total",
+        "Mailbox snapshots dropped from the cache to stay under its capacity");
+    return counter;
+}
+
+Gauge& cached_bytes() {
+    static Gauge& gauge = Metrics::instance().gauge(
+        "email_snapshot_cache_bytes", "Heap held by the mailbox snapshot cache");
+    return gauge;
+}
+
+}  // namespace
+
+std::shared_ptr<const MailboxSnapshot> MailboxSnapshot::from_index(MailboxIndex& index) {
+    struct Row {
+        IndexEntry entry;
+        std::string filename;
+    };
+    std::vector<Row> rows;
+    bool indexed = index.for_each([&rows](const IndexEntry& entry) {
+        rows.push_back(Row{entry, std::string(entry.filename)});
+    });
+    if (!indexed) {
+        return nullptr;
+    }
+    // UIDs must ascend with sequence numbers.
+    std::sort(rows.begin(), rows.end(),
+              [](const Row& a, const Row& b) { return a.entry.uid < b.entry.uid; });
+
+    std::shared_ptr<MailboxSnapshot> snapshot(new MailboxSnapshot());
+    auto& s = *snapshot;
+    s.uids.reserve(rows.size());
+    s.unique_ids.reserve(rows.size());
+    s.infos.reserve(rows.size());
+    s.in_new.reserve(rows.size());
+    s.sizes.reserve(rows.size());
+    s.dates.reserve(rows.size());
+    s.flags.reserve(rows.size());
+    s.body_offsets.reserve(rows.size());
+    s.modseqs.reserve(rows.size());
+    for (auto& row : rows) {
+        const auto colon = std::min(row.filename.find(':'), row.filename.size());
+        s.uids.push_back(row.entry.uid);
+        s.infos.push_back(row.filename.substr(colon));
+        row.filename.resize(colon);
+        s.unique_ids.push_back(std::move(row.filename));
+        s.in_new.push_back(row.entry.in_new);
+        s.sizes.push_back(row.entry.size);
+        s.dates.push_back(row.entry.internal_date);
+        s.flags.push_back(row.entry.flags);
+        s.body_offsets.push_back(row.entry.body_offset);
+        s.modseqs.push_back(row.entry.modseq);
+    }
+    s.uid_validity = index.uid_validity();
+    s.uid_next = index.uid_next();
+    s.highest_modseq = index.highest_modseq();
+    s.changes = index.changes();
+    s.finish();
+    return snapshot;
+}
+
+std::shared_ptr<const MailboxSnapshot> MailboxSnapshot::from_messages(
+        std::vector<Message> messages) {
+    // Oldest first
+    std::stable_sort(messages.begin(), messages.end(), [](const Message& a, const Message& b) {
+        return a.timestamp < b.timestamp;
+    });
+
+    std::shared_ptr<MailboxSnapshot> snapshot(new MailboxSnapshot());
+    auto& s = *snapshot;
+    for (auto& msg : messages) {
+        uint64_t flags = 0;
+        for (char flag : msg.flags) {
+            flags |= MailboxIndex::flag_bit(flag);
+        }
+        s.uids.push_back(0);
+        s.infos.push_back(msg.path.filename().string().substr(msg.unique_id.size()));
+        s.unique_ids.push_back(std::move(msg.unique_id));
+        s.in_new.push_back(msg.is_new);
+        s.sizes.push_back(msg.size);
+        s.dates.push_back(std::chrono::duration_cast<std::chrono::seconds>(
+                              msg.timestamp.time_since_epoch()).count());
+        s.flags.push_back(flags);
+        s.body_offsets.push_back(0);
+        s.modseqs.push_back(0);
+    }
+    s.finish();
+    return snapshot;
+}
+
+std::optional<size_t> MailboxSnapshot::find(std::string_view unique_id) const {
+    auto it = rows_.find(unique_id);
+    if (it == rows_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void MailboxSnapshot::finish() {
+    rows_.reserve(unique_ids.size());
+    for (size_t row = 0; row < unique_ids.size(); ++row) {
+        rows_.emplace(unique_ids[row], static_cast<uint32_t>(row));
+    }
+
+    footprint_ = sizeof(MailboxSnapshot) +
+                 uids.capacity() * sizeof(uint32_t) +
+                 (unique_ids.capacity() + infos.capacity()) * sizeof(std::string) +
+                 in_new.capacity() + sizes.capacity() * sizeof(uint64_t) +
+                 dates.capacity() * sizeof(int64_t) + flags.capacity() * sizeof(uint64_t) +
+                 body_offsets.capacity() * sizeof(uint32_t) +
+                 modseqs.capacity() * sizeof(uint64_t) +
+                 rows_.bucket_count() * sizeof(void*) +
+                 rows_.size() * hash_node_bytes<std::pair<const std::string_view, uint32_t>>;
+    for (size_t row = 0; row < unique_ids.size(); ++row) {
+        footprint_ += string_heap_bytes(unique_ids[row]) + string_heap_bytes(infos[row]);
+    }
+}
+
+MailboxSnapshotCache& MailboxSnapshotCache::instance() {
+    static MailboxSnapshotCache instance;
+    return instance;
+}
+
+void MailboxSnapshotCache::set_capacity(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capacity_ = bytes;
+    evict_locked();
+}
+
+size_t MailboxSnapshotCache::capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return capacity_;
+}
+
+std::shared_ptr<const MailboxSnapshot> MailboxSnapshotCache::find(
+        const std::string& key, uint32_t uid_validity, uint64_t highest_modseq, uint32_t changes,
+        uint64_t messages) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        lookups(false).add();
+        return nullptr;
+    }
+    const auto& snapshot = *it->second.snapshot;
+    if (snapshot.uid_validity != uid_validity || snapshot.highest_modseq != highest_modseq ||
+        snapshot.changes != changes || snapshot.size() != messages) {
+        // Superseded; whoever rebuilds it inserts the new one.
+        bytes_ -= snapshot.footprint();
+        recency_.erase(it->second.recency);
+        entries_.erase(it);
+        cached_bytes().set(static_cast<int64_t>(bytes_));
+        lookups(false).add();
+        return nullptr;
+    }
+    recency_.splice(recency_.begin(), recency_, it->second.recency);
+    lookups(true).add();
+    return it->second.snapshot;
+}
+
+void MailboxSnapshotCache::insert(const std::string& key,
+                                  std::shared_ptr<const MailboxSnapshot> snapshot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        bytes_ -= it->second.snapshot->footprint();
+        it->second.snapshot = std::move(snapshot);
+        recency_.splice(recency_.begin(), recency_, it->second.recency);
+    } else {
+        recency_.push_front(key);
+        it = entries_.emplace(key, Entry{std::move(snapshot), recency_.begin()}).first;
+    }
+    bytes_ += it->second.snapshot->footprint();
+    evict_locked();
+}
+
+void MailboxSnapshotCache::erase(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        return;
+    }
+    bytes_ -= it->second.snapshot->footprint();
+    recency_.erase(it->second.recency);
+    entries_.erase(it);
+    cached_bytes().set(static_cast<int64_t>(bytes_));
+}
+
+void MailboxSnapshotCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    recency_.clear();
+    bytes_ = 0;
+    cached_bytes().set(0);
+}
+
+size_t MailboxSnapshotCache::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+size_t MailboxSnapshotCache::entries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+}
+
+void MailboxSnapshotCache::evict_locked() {
+    while (bytes_ > capacity_ && !recency_.empty()) {
+        auto it = entries_.find(recency_.back());
+        bytes_ -= it->second.snapshot->footprint();
+        entries_.erase(it);
+        recency_.pop_back();
+        evictions().add();
+    }
+    cached_bytes().set(static_cast<int64_t>(bytes_));
+}
+
+}  // namespace email
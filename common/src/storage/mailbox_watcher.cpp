@@ -0,0 +1,210 @@
+#include "storage/mailbox_watcher.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace email {
+
+namespace {
+
+// As for the mailbox index: a change in the same tick as a directory mtime
+// we read does not move it, so listings this close to it are re-read.
+constexpr int64_t mtime_slack_ns = 1'000'000'000;
+
+constexpr uint32_t watch_mask = IN_MOVED_TO | IN_CREATE | IN_MOVED_FROM | IN_DELETE |
+                                IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+int64_t dir_mtime(const std::filesystem::path& path) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        return -1;
+    }
+    return int64_t{st.st_mtim.tv_sec} * 1'000'000'000 + st.st_mtim.tv_nsec;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+std::string_view unique_id_of(std::string_view filename) {
+    return filename.substr(0, filename.find(':'));
+}
+
+// Folds one file event into `events`, which holds at most one event per
+// message; `positions` maps unique ids to their event. A removal loses to a
+// later name already recorded, so link-then-unlink renames come out as the
+// new name.
+void record(std::vector<MailboxWatcher::Event>& events,
+            std::unordered_map<std::string, std::size_t>& positions,
+            std::string_view filename, bool in_new, bool present) {
+    auto unique_id = unique_id_of(filename);
+    auto [it, inserted] = positions.try_emplace(std::string(unique_id), events.size());
+    if (inserted) {
+        events.push_back({it->first, std::string(filename), in_new, present});
+        return;
+    }
+    auto& event = events[it->second];
+    if (!present && event.present &&
+        (event.filename != filename || event.in_new != in_new)) {
+        return;
+    }
+    event.filename = filename;
+    event.in_new = in_new;
+    event.present = present;
+}
+
+}  // namespace
+
+MailboxWatcher::MailboxWatcher(std::filesystem::path mailbox_path)
+    : mailbox_path_(std::move(mailbox_path)) {
+    if (!start_inotify()) {
+        LOG_DEBUG_FMT("Watching {} by polling: {}", mailbox_path_.string(), last_error_);
+        std::vector<Event> ignored;
+        scan(ignored);
+    }
+}
+
+MailboxWatcher::~MailboxWatcher() {
+    close();
+}
+
+void MailboxWatcher::close() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = cur_wd_ = new_wd_ = -1;
+}
+
+bool MailboxWatcher::start_inotify() {
+    fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd_ < 0) {
+        last_error_ = std::string("inotify_init1: ") + std::strerror(errno);
+        return false;
+    }
+    cur_wd_ = ::inotify_add_watch(fd_, (mailbox_path_ / "cur").c_str(), watch_mask);
+    new_wd_ = ::inotify_add_watch(fd_, (mailbox_path_ / "new").c_str(), watch_mask);
+    if (cur_wd_ < 0 || new_wd_ < 0) {
+        last_error_ = std::string("inotify_add_watch: ") + std::strerror(errno);
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool MailboxWatcher::poll(std::vector<Event>& events) {
+    return uses_inotify() ? read_inotify(events) : scan(events);
+}
+
+bool MailboxWatcher::read_inotify(std::vector<Event>& events) {
+    std::unordered_map<std::string, std::size_t> positions;
+    bool lost = false;
+    bool gone = false;
+
+    alignas(inotify_event) char buffer[16 * 1024];
+    for (;;) {
+        ssize_t length = ::read(fd_, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                last_error_ = std::string("read: ") + std::strerror(errno);
+                gone = true;
+            }
+            break;
+        }
+
+        for (ssize_t offset = 0; offset < length;) {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                last_error_ = "inotify queue overflow";
+                lost = true;
+                continue;
+            }
+            if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT)) {
+                last_error_ = "mailbox directory went away";
+                gone = true;
+                continue;
+            }
+            if ((event->mask & IN_ISDIR) || event->len == 0 || event->name[0] == '.') {
+                continue;
+            }
+            record(events, positions, event->name, event->wd == new_wd_,
+                   (event->mask & (IN_MOVED_TO | IN_CREATE)) != 0);
+        }
+    }
+
+    if (gone) {
+        // Start over on whatever is there now; the caller rescans.
+        close();
+        if (!start_inotify()) {
+            listing_.clear();
+            std::vector<Event> ignored;
+            scan(ignored);
+        }
+    }
+    return !lost && !gone;
+}
+
+bool MailboxWatcher::scan(std::vector<Event>& events) {
+    int64_t cur_mtime = dir_mtime(mailbox_path_ / "cur");
+    int64_t new_mtime = dir_mtime(mailbox_path_ / "new");
+    if (cur_mtime < 0 || new_mtime < 0) {
+        last_error_ = "not a maildir";
+        return false;
+    }
+    if (cur_mtime == cur_mtime_ && new_mtime == new_mtime_ &&
+        std::max(cur_mtime, new_mtime) + mtime_slack_ns <= scanned_at_) {
+        return true;
+    }
+    const int64_t scanned_at = now_ns();
+
+    std::unordered_map<std::string, Listed> listing;
+    listing.reserve(listing_.size());
+    for (bool in_new : {false, true}) {
+        auto dir_path = mailbox_path_ / (in_new ? "new" : "cur");
+        DIR* dir = ::opendir(dir_path.c_str());
+        if (!dir) {
+            last_error_ = std::string("opendir: ") + std::strerror(errno);
+            return false;
+        }
+        while (const dirent* entry = ::readdir(dir)) {
+            if (entry->d_name[0] == '.' ||
+                (entry->d_type != DT_REG && entry->d_type != DT_UNKNOWN)) {
+                continue;
+            }
+            std::string_view name(entry->d_name);
+            listing[std::string(unique_id_of(name))] = Listed{std::string(name), in_new};
+        }
+        ::closedir(dir);
+    }
+
+    for (const auto& [unique_id, now] : listing) {
+        auto it = listing_.find(unique_id);
+        if (it == listing_.end() || it->second.filename != now.filename ||
+            it->second.in_new != now.in_new) {
+            events.push_back({unique_id, now.filename, now.in_new, true});
+        }
+    }
+    for (const auto& [unique_id, was] : listing_) {
+        if (!listing.count(unique_id)) {
+            events.push_back({unique_id, was.filename, was.in_new, false});
+        }
+    }
+
+    listing_ = std::move(listing);
+    cur_mtime_ = cur_mtime;
+    new_mtime_ = new_mtime;
+    scanned_at_ = scanned_at;
+    return true;
+}
+
+}  // namespace email
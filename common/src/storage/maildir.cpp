@@ -1,21 +1,265 @@
 #include "storage/maildir.hpp"
+#include "storage/compression.hpp"
+#include "storage/group_commit.hpp"
 #include "logger.hpp"
+#include "metrics.hpp"
 #include <fstream>
 #include <sstream>
-#include <random>
 #include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
+#include <cstdio>
 #include <regex>
+#include <unordered_set>
+#include <utility>
 
 namespace email {
 
+namespace {
+
+enum class StorageOp { Deliver, Read, List, Flags, Copy, Move, Delete, Expunge, Count };
+
+// Time spent in each kind of mailbox operation, nearly all of it in file
+// system calls.
+Histogram& storage_time(StorageOp op) {
+    static const auto histograms = [] {
+        constexpr const char* names[] = {
+            "deliver", "read", "list", "flags", "copy", "move", "delete", "expunge",
+        };
+        std::array<Histogram*, static_cast<size_t>(StorageOp::Count)> result{};
+        for (size_t i = 0; i < result.size(); ++i) {
+            result[i] = &Metrics::instance().histogram(
+                "email_maildir_duration_seconds", "Time spent in Maildir operations",
+                {{"operation", names[i]}});
+        }
+        return result;
+    }();
+    return *histograms[static_cast<size_t>(op)];
+}
+
+int64_t to_seconds(std::chrono::system_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::seconds>(time.time_since_epoch()).count();
+}
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return true;
+}
+
+// The host part of unique names, with the characters maildir reserves
+// ('/' and ':') escaped as the convention has it.
+std::string maildir_hostname() {
+    char hostname[256] = {};
+    if (::gethostname(hostname, sizeof(hostname) - 1) != 0 || hostname[0] == '\0') {
+        return "localhost";
+    }
+    std::string escaped;
+    for (const char* c = hostname; *c; ++c) {
+        if (*c == '/') {
+            escaped += "\\057";
+        } else if (*c == ':') {
+            escaped += "\\072";
+        } else {
+            escaped += *c;
+        }
+    }
+    return escaped;
+}
+
+// Byte copy of what is left of `src` into `dst`, in the kernel where it can.
+bool copy_contents(int src, int dst) {
+    for (;;) {
+        ssize_t n = ::copy_file_range(src, nullptr, dst, nullptr, 1 << 20, 0);
+        if (n == 0) return true;
+        if (n > 0) continue;
+        if (errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return false;
+        }
+        break;
+    }
+
+    char buffer[64 * 1024];
+    for (;;) {
+        ssize_t n = ::read(src, buffer, sizeof(buffer));
+        if (n == 0) return true;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t written = ::write(dst, buffer + done, static_cast<std::size_t>(n - done));
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            done += written;
+        }
+    }
+}
+
+// Makes `to` a copy of the message file `from`: a hard link where possible,
+// otherwise a reflink, otherwise a byte copy. Copies get the original's
+// mtime, which is the message's internal date.
+bool clone_file(const std::filesystem::path& from, const std::filesystem::path& to,
+                std::string& error) {
+    if (::link(from.c_str(), to.c_str()) == 0) {
+        return true;
+    }
+
+    int src = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+    if (src < 0) {
+        error = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    int dst = ::open(to.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (dst < 0) {
+        error = std::string("open: ") + std::strerror(errno);
+        ::close(src);
+        return false;
+    }
+
+    // Unlike a link, a new file has to reach the disk by itself.
+    bool copied = (::ioctl(dst, FICLONE, src) == 0 || copy_contents(src, dst)) &&
+                  ::fsync(dst) == 0;
+    struct stat st;
+    if (copied && ::fstat(src, &st) == 0) {
+        const struct timespec times[2] = {st.st_atim, st.st_mtim};
+        ::futimens(dst, times);
+    }
+    if (!copied) {
+        error = std::string("copy: ") + std::strerror(errno);
+    }
+    ::close(src);
+    ::close(dst);
+    if (!copied) {
+        ::unlink(to.c_str());
+    }
+    return copied;
+}
+
+std::atomic<int> compression_level_{0};
+
+// Messages smaller than this are stored as they are: the few bytes saved
+// are not worth a frame header and a decompression on every read.
+constexpr std::size_t min_compressed_size = 1024;
+// Where each mailbox's recompression got to.
+constexpr const char* recompress_file_name = "email.recompress";
+
+// `content` as it should be stored: compressed if that is enabled and
+// saves at least an eighth, otherwise nullopt.
+std::optional<std::string> compress_for_storage(std::string_view content) {
+    const int level = compression_level_.load(std::memory_order_relaxed);
+    if (level <= 0 || content.size() < min_compressed_size) {
+        return std::nullopt;
+    }
+    auto compressed = compression::compress(content, level);
+    if (!compressed || compressed->size() > content.size() - content.size() / 8) {
+        return std::nullopt;
+    }
+    return compressed;
+}
+
+// A message file's logical size: a compressed file's frame header has it.
+uint64_t stored_size(int fd, uint64_t file_size) {
+    char prefix[compression::header_size];
+    ssize_t got = ::pread(fd, prefix, sizeof(prefix), 0);
+    if (got > 0) {
+        if (auto size = compression::content_size({prefix, static_cast<std::size_t>(got)})) {
+            return *size;
+        }
+    }
+    return file_size;
+}
+
+// Rewrites a message file compressed under the same name. The new file is
+// written in `tmp_dir` and swapped in with RENAME_EXCHANGE, which fails
+// instead of recreating the name if the message was renamed or deleted
+// meanwhile; readers holding the old file keep it. True if it was replaced.
+bool compress_file(const std::filesystem::path& file, const std::filesystem::path& tmp_dir,
+                   const std::string& unique_name, std::string& error) {
+    struct stat st;
+    if (::stat(file.c_str(), &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) < min_compressed_size) {
+        return false;
+    }
+    std::optional<std::string> compressed;
+    {
+        int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        char prefix[compression::header_size];
+        ssize_t got = ::pread(fd, prefix, sizeof(prefix), 0);
+        ::close(fd);
+        if (got <= 0 || compression::is_compressed({prefix, static_cast<std::size_t>(got)})) {
+            return false;
+        }
+        auto view = MessageView::open(file);
+        if (!view) {
+            return false;
+        }
+        compressed = compress_for_storage(view->data());
+    }
+    if (!compressed) {
+        return false;
+    }
+
+    auto tmp_path = tmp_dir / unique_name;
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        error = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    bool written = write_all(fd, *compressed) && ::fsync(fd) == 0;
+    if (written) {
+        // The mtime is the message's internal date.
+        const struct timespec times[2] = {st.st_atim, st.st_mtim};
+        ::futimens(fd, times);
+    } else {
+        error = std::string("write: ") + std::strerror(errno);
+    }
+    ::close(fd);
+
+    bool replaced = written && ::renameat2(AT_FDCWD, tmp_path.c_str(), AT_FDCWD, file.c_str(),
+                                           RENAME_EXCHANGE) == 0;
+    if (written && !replaced && errno != ENOENT) {
+        error = std::string("rename: ") + std::strerror(errno);
+    }
+    // After an exchange this is the original.
+    ::unlink(tmp_path.c_str());
+    return replaced;
+}
+
+// Without an index UIDs are only numbered per session; a new UIDVALIDITY
+// every time tells clients not to keep them.
+uint32_t unindexed_uid_validity() {
+    return static_cast<uint32_t>(to_seconds(std::chrono::system_clock::now()));
+}
+
+}  // namespace
+
 Maildir::Maildir(const std::filesystem::path& root, const std::string& domain,
                  const std::string& username)
     : root_(root)
     , domain_(domain)
     , username_(username)
-    , maildir_path_(root / domain / username) {
+    , maildir_path_(root / domain / username)
+    , usage_file_(maildir_path_ / UsageFile::file_name) {
 }
 
 bool Maildir::initialize() {
@@ -85,8 +329,15 @@ bool Maildir::delete_mailbox(const std::string& name) {
     }
 
     auto path = get_mailbox_path(name);
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    bool counted = index_for(name).totals(messages, bytes);
+    forget_mailbox(name);
     try {
         std::filesystem::remove_all(path);
+        if (counted) {
+            account(-static_cast<int64_t>(messages), -static_cast<int64_t>(bytes));
+        }
         return true;
     } catch (const std::exception& e) {
         last_error_ = e.what();
@@ -102,6 +353,8 @@ bool Maildir::rename_mailbox(const std::string& old_name, const std::string& new
 
     auto old_path = get_mailbox_path(old_name);
     auto new_path = get_mailbox_path(new_name);
+    forget_mailbox(old_name);
+    forget_mailbox(new_name);
 
     try {
         std::filesystem::rename(old_path, new_path);
@@ -157,20 +410,38 @@ std::optional<MailboxInfo> Maildir::get_mailbox_info(const std::string& name) {
 
     MailboxInfo info;
     info.name = name.empty() ? "INBOX" : name;
-    info.uid_validity = get_uid_validity(name);
-    info.uid_next = allocate_uid(name);
 
-    auto messages = list_messages(name);
-    info.total_messages = messages.size();
-
-    for (const auto& msg : messages) {
-        info.total_size += msg.size;
-        if (msg.is_new) {
+    auto& index = index_for(name);
+    bool indexed = index.for_each([&info](const IndexEntry& entry) {
+        info.total_messages++;
+        info.total_size += entry.size;
+        if (entry.in_new) {
             info.recent_messages++;
         }
-        if (!msg.is_seen()) {
+        if (!(entry.flags & MailboxIndex::flag_bit('S'))) {
             info.unseen_messages++;
         }
+    });
+
+    if (indexed) {
+        info.uid_validity = index.uid_validity();
+        info.uid_next = index.uid_next();
+        info.highest_modseq = index.highest_modseq();
+    } else {
+        auto messages = scan_messages(name);
+        info.total_messages = messages.size();
+        info.uid_validity = unindexed_uid_validity();
+        info.uid_next = static_cast<uint32_t>(messages.size() + 1);
+
+        for (const auto& msg : messages) {
+            info.total_size += msg.size;
+            if (msg.is_new) {
+                info.recent_messages++;
+            }
+            if (!msg.is_seen()) {
+                info.unseen_messages++;
+            }
+        }
     }
 
     info.flags = {"\\Seen", "\\Answered", "\\Flagged", "\\Deleted", "\\Draft"};
@@ -179,22 +450,26 @@ std::optional<MailboxInfo> Maildir::get_mailbox_info(const std::string& name) {
 }
 
 std::string Maildir::generate_unique_name() const {
-    auto now = std::chrono::system_clock::now();
-    auto duration = now.time_since_epoch();
+    // <seconds>.M<microseconds>P<pid>T<thread>Q<count>.<host>, with the
+    // thread numbered within the process and the count per thread, so
+    // names are unique without a random number or a system call.
+    static const std::string pid = std::to_string(::getpid());
+    static const std::string host = maildir_hostname();
+    static std::atomic<uint64_t> next_thread{0};
+    thread_local const uint64_t thread = next_thread++;
+    thread_local uint64_t count = 0;
+
+    auto duration = std::chrono::system_clock::now().time_since_epoch();
     auto seconds = std::chrono::duration_cast<std::chrono::seconds>(duration).count();
     auto micros = std::chrono::duration_cast<std::chrono::microseconds>(duration).count() % 1000000;
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 999999);
-
-    char hostname[256];
-    gethostname(hostname, sizeof(hostname));
-
-    std::ostringstream oss;
-    oss << seconds << ".M" << micros << "P" << getpid() << "R" << dis(gen) << "." << hostname;
-
-    return oss.str();
+    std::string name = std::to_string(seconds);
+    name.append(".M").append(std::to_string(micros));
+    name.append("P").append(pid);
+    name.append("T").append(std::to_string(thread));
+    name.append("Q").append(std::to_string(++count));
+    name.append(".").append(host);
+    return name;
 }
 
 std::string Maildir::flags_to_info(const std::set<char>& flags) const {
@@ -222,7 +497,72 @@ std::set<char> Maildir::parse_flags(const std::string& filename) const {
     return flags;
 }
 
-std::string Maildir::deliver(const std::string& content, const std::string& mailbox) {
+std::optional<SharedMessage> SharedMessage::create(const std::filesystem::path& directory,
+                                                  std::string_view content,
+                                                  std::string& error) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    std::string path = (directory / "shared.XXXXXX").string();
+    int fd = ::mkostemp(path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        error = "Cannot create " + path + ": " + std::strerror(errno);
+        return std::nullopt;
+    }
+    // Stored as deliver() would, so the links need no more than a rename.
+    auto compressed = compress_for_storage(content);
+    bool written = write_all(fd, compressed ? std::string_view(*compressed) : content) &&
+                   ::fsync(fd) == 0;
+    if (!written) {
+        error = std::string("Failed to write message: ") + std::strerror(errno);
+    }
+    ::close(fd);
+    if (!written) {
+        ::unlink(path.c_str());
+        return std::nullopt;
+    }
+
+    SharedMessage message;
+    message.path_ = path;
+    message.size_ = content.size();
+    auto bounds = find_header_end(content);
+    message.body_offset_ = static_cast<uint32_t>(std::min<std::size_t>(
+        bounds ? bounds->body_start : content.size(), UINT32_MAX));
+    message.structure_ = MessageStructure::parse(content);
+    message.document_ = SearchDocument::extract(content, message.structure_);
+    return message;
+}
+
+SharedMessage::SharedMessage(SharedMessage&& other) noexcept
+    : path_(std::exchange(other.path_, {}))
+    , size_(other.size_)
+    , body_offset_(other.body_offset_)
+    , structure_(std::move(other.structure_))
+    , document_(std::move(other.document_)) {
+}
+
+SharedMessage& SharedMessage::operator=(SharedMessage&& other) noexcept {
+    if (this != &other) {
+        if (!path_.empty()) {
+            ::unlink(path_.c_str());
+        }
+        path_ = std::exchange(other.path_, {});
+        size_ = other.size_;
+        body_offset_ = other.body_offset_;
+        structure_ = std::move(other.structure_);
+        document_ = std::move(other.document_);
+    }
+    return *this;
+}
+
+SharedMessage::~SharedMessage() {
+    if (!path_.empty()) {
+        ::unlink(path_.c_str());
+    }
+}
+
+std::string Maildir::deliver(std::string_view content, const std::string& mailbox,
+                             const std::set<char>& flags) {
+    ScopedTimer timer(storage_time(StorageOp::Deliver));
     auto path = get_mailbox_path(mailbox);
 
     if (!std::filesystem::exists(path / "tmp")) {
@@ -233,39 +573,102 @@ std::string Maildir::deliver(const std::string& content, const std::string& mail
 
     std::string unique_name = generate_unique_name();
     auto tmp_path = path / "tmp" / unique_name;
-    auto new_path = path / "new" / unique_name;
 
-    try {
-        // Write to tmp first (atomic delivery)
-        {
-            std::ofstream file(tmp_path, std::ios::binary);
-            if (!file) {
-                last_error_ = "Failed to create temporary file";
-                return "";
-            }
-            file << content;
-            file.flush();
-            if (!file) {
-                last_error_ = "Failed to write message";
-                std::filesystem::remove(tmp_path);
-                return "";
-            }
+    // Write to tmp first (atomic delivery), and make the file durable
+    // before it is visible in new/.
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        last_error_ = std::string("Failed to create temporary file: ") + std::strerror(errno);
+        return "";
+    }
+    auto compressed = compress_for_storage(content);
+    bool written = write_all(fd, compressed ? std::string_view(*compressed) : content) &&
+                   ::fsync(fd) == 0;
+    if (!written) {
+        last_error_ = std::string("Failed to write message: ") + std::strerror(errno);
+    }
+    ::close(fd);
+    if (!written) {
+        ::unlink(tmp_path.c_str());
+        return "";
+    }
+
+    // The headers are at hand, so header-only reads never need to look.
+    auto bounds = find_header_end(content);
+    auto body_offset = static_cast<uint32_t>(std::min<std::size_t>(
+        bounds ? bounds->body_start : content.size(), UINT32_MAX));
+    const auto structure = MessageStructure::parse(content);
+    return commit_delivery(mailbox, unique_name, flags, content.size(), body_offset, structure,
+                           SearchDocument::extract(content, structure));
+}
+
+std::string Maildir::deliver_shared(const SharedMessage& message, const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Deliver));
+    auto path = get_mailbox_path(mailbox);
+
+    if (!std::filesystem::exists(path / "tmp")) {
+        if (!ensure_mailbox_dirs(path)) {
+            return "";
         }
+    }
 
-        // Move to new
-        std::filesystem::rename(tmp_path, new_path);
+    // A link is durable once the rename that follows it is synced; a copy
+    // across filesystems is synced by clone_file().
+    std::string unique_name = generate_unique_name();
+    if (!clone_file(message.path(), path / "tmp" / unique_name, last_error_)) {
+        return "";
+    }
+    return commit_delivery(mailbox, unique_name, {}, message.size(), message.body_offset(),
+                           message.structure(), message.document());
+}
 
-        return unique_name;
-    } catch (const std::exception& e) {
-        last_error_ = e.what();
-        std::filesystem::remove(tmp_path);
+std::string Maildir::commit_delivery(const std::string& mailbox, const std::string& unique_name,
+                                     const std::set<char>& flags, uint64_t size,
+                                     uint32_t body_offset, const MessageStructure& structure,
+                                     const SearchDocument& document) {
+    auto path = get_mailbox_path(mailbox);
+    // Flagged deliveries (IMAP APPEND) have been seen by a client, so they
+    // go straight to cur/.
+    const bool in_new = flags.empty();
+    const std::string filename = unique_name + flags_to_info(flags);
+    auto tmp_path = path / "tmp" / unique_name;
+    auto new_path = path / (in_new ? "new" : "cur") / filename;
+
+    // Move to new; the delivery counts once the rename is on disk too.
+    if (::rename(tmp_path.c_str(), new_path.c_str()) != 0) {
+        last_error_ = std::string("Failed to move message to new: ") + std::strerror(errno);
+        ::unlink(tmp_path.c_str());
         return "";
     }
+    if (!GroupCommit::instance().sync_directory(new_path.parent_path())) {
+        last_error_ = "Failed to sync " + new_path.parent_path().filename().string() + "/";
+        ::unlink(new_path.c_str());
+        return "";
+    }
+
+    index_for(mailbox).add(filename, in_new, size, to_seconds(std::chrono::system_clock::now()),
+                           body_offset);
+    remember(mailbox, unique_name, filename, in_new, body_offset, size);
+    account(1, static_cast<int64_t>(size));
+    publish(mailbox);
+    // Both are built again on first use if they cannot be stored now.
+    if (!structures_for(mailbox).store(unique_name, structure)) {
+        LOG_WARNING_FMT("Structure cache of {}: {}", path.string(),
+                        structures_for(mailbox).last_error());
+    }
+    auto& search = search_for(mailbox);
+    if (!search.add(unique_name, document)) {
+        LOG_WARNING_FMT("Search index of {}: {}", path.string(), search.last_error());
+    }
+
+    return unique_name;
 }
 
 std::optional<Message> Maildir::parse_message_file(const std::filesystem::path& path,
-                                                   const std::string& mailbox) const {
-    if (!std::filesystem::exists(path)) {
+                                                   const std::string& mailbox,
+                                                   uint64_t size) const {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         return std::nullopt;
     }
 
@@ -286,81 +689,340 @@ std::optional<Message> Maildir::parse_message_file(const std::filesystem::path&
     msg.flags = parse_flags(filename);
     msg.is_new = (path.parent_path().filename() == "new");
 
-    try {
-        msg.size = std::filesystem::file_size(path);
-        msg.timestamp = std::chrono::system_clock::from_time_t(
-            std::chrono::duration_cast<std::chrono::seconds>(
-                std::filesystem::last_write_time(path).time_since_epoch()
-            ).count()
-        );
-    } catch (...) {
-        // Ignore errors getting file metadata
+    struct stat st;
+    if (::fstat(fd, &st) == 0) {
+        msg.size = size ? size : stored_size(fd, static_cast<uint64_t>(st.st_size));
+        msg.timestamp = std::chrono::system_clock::from_time_t(st.st_mtime);
     }
+    ::close(fd);
 
     return msg;
 }
 
 std::optional<Message> Maildir::get_message(const std::string& unique_id,
                                             const std::string& mailbox) {
-    auto path = get_mailbox_path(mailbox);
+    auto& state = state_for(mailbox);
+    bool fresh = false;
+    if (!state.locations_loaded) {
+        load_locations(mailbox);
+        fresh = true;
+    }
+    if (auto msg = find_located(unique_id, mailbox)) {
+        return msg;
+    }
+    if (fresh) {
+        return std::nullopt;
+    }
 
-    // Search in cur directory
-    for (const auto& entry : std::filesystem::directory_iterator(path / "cur")) {
-        std::string filename = entry.path().filename().string();
-        if (filename.find(unique_id) == 0) {
-            return parse_message_file(entry.path(), mailbox);
-        }
+    // Unknown or gone: the mailbox changed behind our back.
+    refresh_locations(mailbox);
+    return find_located(unique_id, mailbox);
+}
+
+std::optional<Maildir::MessageLocation> Maildir::LocationMap::find(
+        const std::string& unique_id) const {
+    if (auto it = changes_.find(unique_id); it != changes_.end()) {
+        return it->second;
     }
+    auto row = base_ ? base_->find(unique_id) : std::nullopt;
+    if (!row) {
+        return std::nullopt;
+    }
+    return MessageLocation{base_->filename(*row), base_->in_new[*row] != 0, base_->uids[*row],
+                           base_->body_offsets[*row], base_->sizes[*row]};
+}
 
-    // Search in new directory
-    for (const auto& entry : std::filesystem::directory_iterator(path / "new")) {
-        std::string filename = entry.path().filename().string();
-        if (filename.find(unique_id) == 0) {
-            return parse_message_file(entry.path(), mailbox);
+Maildir::MessageLocation* Maildir::LocationMap::edit(const std::string& unique_id) {
+    if (auto it = changes_.find(unique_id); it != changes_.end()) {
+        return it->second ? &*it->second : nullptr;
+    }
+    auto location = find(unique_id);
+    if (!location) {
+        return nullptr;
+    }
+    return &*changes_.emplace(unique_id, std::move(location)).first->second;
+}
+
+void Maildir::LocationMap::set(const std::string& unique_id, MessageLocation location) {
+    changes_.insert_or_assign(unique_id, std::move(location));
+}
+
+void Maildir::LocationMap::erase(const std::string& unique_id) {
+    if (base_ && base_->find(unique_id)) {
+        changes_.insert_or_assign(unique_id, std::nullopt);
+    } else {
+        changes_.erase(unique_id);
+    }
+}
+
+void Maildir::LocationMap::reset(std::shared_ptr<const MailboxSnapshot> base) {
+    base_ = std::move(base);
+    changes_.clear();
+}
+
+void Maildir::LocationMap::for_each(
+        const std::function<void(const std::string&, const MessageLocation&)>& fn) const {
+    if (base_) {
+        for (size_t row = 0; row < base_->size(); ++row) {
+            if (!changes_.count(base_->unique_ids[row])) {
+                fn(base_->unique_ids[row],
+                   MessageLocation{base_->filename(row), base_->in_new[row] != 0, base_->uids[row],
+                                   base_->body_offsets[row], base_->sizes[row]});
+            }
         }
     }
+    for (const auto& [unique_id, location] : changes_) {
+        if (location) {
+            fn(unique_id, *location);
+        }
+    }
+}
+
+std::optional<Message> Maildir::find_located(const std::string& unique_id,
+                                             const std::string& mailbox) {
+    auto location = state_for(mailbox).locations.find(unique_id);
+    if (!location) {
+        return std::nullopt;
+    }
+    auto path = get_mailbox_path(mailbox) / (location->in_new ? "new" : "cur") / location->filename;
+    auto msg = parse_message_file(path, mailbox, location->size);
+    if (msg) {
+        msg->body_offset = location->body_offset;
+    }
+    return msg;
+}
 
-    return std::nullopt;
+std::optional<MessageView> Maildir::map_message(const std::string& unique_id,
+                                                const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Read));
+    auto msg = get_message(unique_id, mailbox);
+    if (!msg) {
+        return std::nullopt;
+    }
+    return MessageView::open(msg->path);
 }
 
 std::optional<std::string> Maildir::get_message_content(const std::string& unique_id,
                                                         const std::string& mailbox) {
+    auto view = map_message(unique_id, mailbox);
+    if (!view) {
+        return std::nullopt;
+    }
+    return std::string(view->data());
+}
+
+std::optional<std::string> Maildir::get_message_headers(const std::string& unique_id,
+                                                        const std::string& mailbox) {
     auto msg = get_message(unique_id, mailbox);
     if (!msg) {
         return std::nullopt;
     }
 
-    std::ifstream file(msg->path, std::ios::binary);
-    if (!file) {
+    int fd = ::open(msg->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    // Without a cached offset, read a page at a time until the blank line.
+    // A compressed file is decoded only as far as that.
+    const bool cached = msg->body_offset > 0;
+    std::unique_ptr<compression::Reader> reader;
+    std::string data;
+    std::optional<HeaderBounds> bounds;
+    bool failed = false;
+    while (!bounds) {
+        std::size_t done = data.size();
+        data.resize(cached ? std::max(msg->body_offset, compression::header_size) : done + 4096);
+        ssize_t n = reader ? reader->read(done, data.data() + done, data.size() - done)
+                           : ::pread(fd, data.data() + done, data.size() - done,
+                                     static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            data.resize(done);
+            continue;
+        }
+        data.resize(done + static_cast<std::size_t>(std::max<ssize_t>(n, 0)));
+        failed = n < 0;
+        if (!reader && done == 0 && compression::is_compressed(data)) {
+            reader = compression::Reader::open(fd);
+            failed = !reader;
+            if (failed) {
+                break;
+            }
+            data.clear();
+            continue;
+        }
+        bounds = find_header_end(data);
+        if (n <= 0 || cached) {
+            break;  // End of file: the whole message is header
+        }
+    }
+    ::close(fd);
+    if (failed) {
         return std::nullopt;
     }
 
-    std::ostringstream oss;
-    oss << file.rdbuf();
-    return oss.str();
+    if (!cached) {
+        auto body_offset = static_cast<uint32_t>(
+            std::min<std::size_t>(bounds ? bounds->body_start : data.size(), UINT32_MAX));
+        auto& state = state_for(mailbox);
+        state.index->set_body_offset(msg->unique_id, body_offset);
+        if (auto* location = state.locations.edit(msg->unique_id)) {
+            location->body_offset = body_offset;
+        }
+    }
+    data.resize(bounds ? bounds->header_end : data.size());
+    return data;
 }
 
-std::optional<std::string> Maildir::get_message_headers(const std::string& unique_id,
-                                                        const std::string& mailbox) {
-    auto content = get_message_content(unique_id, mailbox);
-    if (!content) {
+std::optional<std::string> Maildir::get_message_top(const std::string& unique_id, size_t lines,
+                                                    const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Read));
+    auto msg = get_message(unique_id, mailbox);
+    if (!msg) {
         return std::nullopt;
     }
 
-    // Headers end at the first empty line
-    auto pos = content->find("\r\n\r\n");
-    if (pos == std::string::npos) {
-        pos = content->find("\n\n");
+    int fd = ::open(msg->path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
     }
 
-    if (pos != std::string::npos) {
-        return content->substr(0, pos);
+    // With a cached offset the first read takes in the whole header block.
+    std::size_t chunk = std::max<std::size_t>(msg->body_offset + (lines > 0 ? 4096 : 0), 4096);
+    std::unique_ptr<compression::Reader> reader;
+    std::string data;
+    std::optional<HeaderBounds> bounds;
+    std::size_t end = std::string::npos;
+    std::size_t scanned = 0;
+    std::size_t found = 0;
+    bool failed = false;
+    for (;;) {
+        std::size_t done = data.size();
+        data.resize(done + chunk);
+        ssize_t n = reader ? reader->read(done, data.data() + done, chunk)
+                           : ::pread(fd, data.data() + done, chunk, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) {
+            data.resize(done);
+            continue;
+        }
+        data.resize(done + static_cast<std::size_t>(std::max<ssize_t>(n, 0)));
+        failed = n < 0;
+        if (!reader && done == 0 && compression::is_compressed(data)) {
+            reader = compression::Reader::open(fd);
+            failed = !reader;
+            if (failed) {
+                break;
+            }
+            data.clear();
+            continue;
+        }
+        chunk = 4096;
+        if (!bounds) {
+            bounds = find_header_end(data);
+        }
+        if (bounds) {
+            scanned = std::max(scanned, bounds->body_start);
+            for (; found < lines; ++found) {
+                auto newline = data.find('\n', scanned);
+                if (newline == std::string::npos) {
+                    scanned = data.size();
+                    break;
+                }
+                scanned = newline + 1;
+            }
+            if (found == lines) {
+                end = scanned;
+                break;
+            }
+        }
+        if (n <= 0) {
+            break;  // End of file: the top is the whole message
+        }
     }
+    ::close(fd);
+    if (failed) {
+        return std::nullopt;
+    }
+    data.resize(std::min(end, data.size()));
+    return data;
+}
 
-    return content;
+std::optional<MessageStructure> Maildir::get_message_structure(const std::string& unique_id,
+                                                               const std::string& mailbox) {
+    auto& cache = structures_for(mailbox);
+    if (auto structure = cache.find(unique_id)) {
+        return structure;
+    }
+
+    auto view = map_message(unique_id, mailbox);
+    if (!view) {
+        return std::nullopt;
+    }
+    auto structure = MessageStructure::parse(view->data());
+    if (!cache.store(unique_id, structure)) {
+        LOG_WARNING_FMT("Structure cache of {}: {}", get_mailbox_path(mailbox).string(),
+                        cache.last_error());
+    }
+    return structure;
+}
+
+SearchIndex& Maildir::prepare_search(const std::vector<std::string>& unique_ids,
+                                    const std::string& mailbox) {
+    auto& search = search_for(mailbox);
+    search.refresh();
+    for (const auto& unique_id : unique_ids) {
+        if (search.find(unique_id)) {
+            continue;
+        }
+        auto view = map_message(unique_id, mailbox);
+        if (!view) {
+            continue;  // Gone; nothing will match it
+        }
+        const auto structure = MessageStructure::parse(view->data());
+        if (!search.add(unique_id, SearchDocument::extract(view->data(), structure))) {
+            LOG_WARNING_FMT("Search index of {}: {}", get_mailbox_path(mailbox).string(),
+                            search.last_error());
+            break;
+        }
+    }
+    return search;
 }
 
 std::vector<Message> Maildir::list_messages(const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::List));
+    // The caller starts over from this listing.
+    state_for(mailbox).pending.clear();
+    return read_listing(mailbox);
+}
+
+std::vector<MessageSummary> Maildir::list_summaries(const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::List));
+    auto& state = state_for(mailbox);
+    state.pending.clear();
+    std::vector<MessageSummary> summaries;
+    if (!std::filesystem::exists(get_mailbox_path(mailbox))) {
+        return summaries;
+    }
+
+    auto snapshot = load_snapshot(mailbox);
+    summaries.reserve(snapshot->size());
+    for (size_t row = 0; row < snapshot->size(); ++row) {
+        summaries.push_back(
+            MessageSummary{snapshot->unique_ids[row], snapshot->sizes[row], snapshot->uids[row]});
+    }
+    return summaries;
+}
+
+std::shared_ptr<const MailboxSnapshot> Maildir::snapshot(const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::List));
+    state_for(mailbox).pending.clear();
+    if (!std::filesystem::exists(get_mailbox_path(mailbox))) {
+        return MailboxSnapshot::from_messages({});
+    }
+    return load_snapshot(mailbox);
+}
+
+std::vector<Message> Maildir::read_listing(const std::string& mailbox) {
     std::vector<Message> messages;
     auto path = get_mailbox_path(mailbox);
 
@@ -368,6 +1030,34 @@ std::vector<Message> Maildir::list_messages(const std::string& mailbox) {
         return messages;
     }
 
+    const std::string mailbox_name = mailbox.empty() ? "INBOX" : mailbox;
+    auto snapshot = load_snapshot(mailbox);
+    messages.reserve(snapshot->size());
+    for (size_t row = 0; row < snapshot->size(); ++row) {
+        Message msg;
+        msg.unique_id = snapshot->unique_ids[row];
+        msg.path = path / (snapshot->in_new[row] ? "new" : "cur") / snapshot->filename(row);
+        msg.size = snapshot->sizes[row];
+        msg.timestamp = std::chrono::system_clock::from_time_t(snapshot->dates[row]);
+        for (char flag = 'A'; flag <= 'z'; ++flag) {
+            if (snapshot->flags[row] & MailboxIndex::flag_bit(flag)) {
+                msg.flags.insert(flag);
+            }
+        }
+        msg.is_new = snapshot->in_new[row];
+        msg.mailbox = mailbox_name;
+        msg.uid = snapshot->uids[row];
+        msg.body_offset = snapshot->body_offsets[row];
+        msg.modseq = snapshot->modseqs[row];
+        messages.push_back(std::move(msg));
+    }
+    return messages;
+}
+
+std::vector<Message> Maildir::scan_messages(const std::string& mailbox) {
+    std::vector<Message> messages;
+    auto path = get_mailbox_path(mailbox);
+
     // List messages in cur
     if (std::filesystem::exists(path / "cur")) {
         for (const auto& entry : std::filesystem::directory_iterator(path / "cur")) {
@@ -390,12 +1080,6 @@ std::vector<Message> Maildir::list_messages(const std::string& mailbox) {
         }
     }
 
-    // Sort by timestamp (oldest first)
-    std::sort(messages.begin(), messages.end(),
-              [](const Message& a, const Message& b) {
-                  return a.timestamp < b.timestamp;
-              });
-
     return messages;
 }
 
@@ -418,27 +1102,8 @@ std::vector<Message> Maildir::list_new_messages(const std::string& mailbox) {
     return messages;
 }
 
-bool Maildir::move_to_cur(const std::string& unique_id, const std::string& mailbox) {
-    auto path = get_mailbox_path(mailbox);
-    auto new_dir = path / "new";
-    auto cur_dir = path / "cur";
-
-    for (const auto& entry : std::filesystem::directory_iterator(new_dir)) {
-        std::string filename = entry.path().filename().string();
-        if (filename.find(unique_id) == 0) {
-            auto new_filename = filename;
-            if (new_filename.find(":2,") == std::string::npos) {
-                new_filename += ":2,";
-            }
-            std::filesystem::rename(entry.path(), cur_dir / new_filename);
-            return true;
-        }
-    }
-
-    return false;
-}
-
 bool Maildir::delete_message(const std::string& unique_id, const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Delete));
     auto msg = get_message(unique_id, mailbox);
     if (!msg) {
         return false;
@@ -446,6 +1111,10 @@ bool Maildir::delete_message(const std::string& unique_id, const std::string& ma
 
     try {
         std::filesystem::remove(msg->path);
+        index_for(mailbox).remove(msg->unique_id);
+        forget(mailbox, msg->unique_id);
+        account(-1, -static_cast<int64_t>(msg->size));
+        publish(mailbox);
         return true;
     } catch (const std::exception& e) {
         last_error_ = e.what();
@@ -453,8 +1122,41 @@ bool Maildir::delete_message(const std::string& unique_id, const std::string& ma
     }
 }
 
+size_t Maildir::delete_messages(std::span<const std::string> unique_ids,
+                                const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Delete));
+    std::vector<std::string> deleted;
+    int64_t bytes = 0;
+    for (const auto& unique_id : unique_ids) {
+        auto msg = get_message(unique_id, mailbox);
+        if (!msg) {
+            continue;
+        }
+        std::error_code ec;
+        std::filesystem::remove(msg->path, ec);
+        if (ec) {
+            last_error_ = ec.message();
+            continue;
+        }
+        bytes += static_cast<int64_t>(msg->size);
+        deleted.push_back(msg->unique_id);
+    }
+    if (deleted.empty()) {
+        return 0;
+    }
+
+    index_for(mailbox).remove_all(deleted);
+    for (const auto& unique_id : deleted) {
+        forget(mailbox, unique_id);
+    }
+    account(-static_cast<int64_t>(deleted.size()), -bytes);
+    publish(mailbox);
+    return deleted.size();
+}
+
 bool Maildir::move_message(const std::string& unique_id, const std::string& from_mailbox,
                            const std::string& to_mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Move));
     auto msg = get_message(unique_id, from_mailbox);
     if (!msg) {
         return false;
@@ -470,6 +1172,15 @@ bool Maildir::move_message(const std::string& unique_id, const std::string& from
     try {
         auto new_path = dest_path / "cur" / msg->path.filename();
         std::filesystem::rename(msg->path, new_path);
+        index_for(from_mailbox).remove(msg->unique_id);
+        const auto body_offset = static_cast<uint32_t>(msg->body_offset);
+        index_for(to_mailbox).add(new_path.filename().string(), false, msg->size,
+                                  to_seconds(msg->timestamp), body_offset);
+        forget(from_mailbox, msg->unique_id);
+        remember(to_mailbox, msg->unique_id, new_path.filename().string(), false, body_offset,
+                 msg->size);
+        publish(from_mailbox);
+        publish(to_mailbox);
         return true;
     } catch (const std::exception& e) {
         last_error_ = e.what();
@@ -479,64 +1190,194 @@ bool Maildir::move_message(const std::string& unique_id, const std::string& from
 
 bool Maildir::copy_message(const std::string& unique_id, const std::string& from_mailbox,
                            const std::string& to_mailbox) {
-    auto content = get_message_content(unique_id, from_mailbox);
-    if (!content) {
-        return false;
-    }
-
-    return !deliver(*content, to_mailbox).empty();
+    return !copy_messages(std::span<const std::string>(&unique_id, 1), from_mailbox,
+                          to_mailbox).front().empty();
 }
 
-bool Maildir::set_flags(const std::string& unique_id, const std::set<char>& flags,
-                        const std::string& mailbox) {
-    auto msg = get_message(unique_id, mailbox);
-    if (!msg) {
-        return false;
-    }
+std::vector<std::string> Maildir::copy_messages(std::span<const std::string> unique_ids,
+                                                const std::string& from_mailbox,
+                                                const std::string& to_mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Copy));
+    std::vector<std::string> copies(unique_ids.size());
 
-    // Move from new to cur if necessary
-    if (msg->is_new) {
-        move_to_cur(unique_id, mailbox);
-        msg = get_message(unique_id, mailbox);
-        if (!msg) return false;
+    auto dest_path = get_mailbox_path(to_mailbox);
+    if (!std::filesystem::exists(dest_path / "tmp")) {
+        if (!ensure_mailbox_dirs(dest_path)) {
+            return copies;
+        }
     }
 
-    std::string new_filename = msg->unique_id + flags_to_info(flags);
-    auto new_path = msg->path.parent_path() / new_filename;
+    // Reserved up front: the additions point into the file names.
+    std::vector<std::string> filenames;
+    std::vector<MailboxIndex::Addition> additions;
+    filenames.reserve(unique_ids.size());
+    additions.reserve(unique_ids.size());
+    int64_t bytes = 0;
+
+    for (std::size_t i = 0; i < unique_ids.size(); ++i) {
+        auto msg = get_message(unique_ids[i], from_mailbox);
+        if (!msg) {
+            continue;
+        }
 
-    try {
-        std::filesystem::rename(msg->path, new_path);
-        return true;
-    } catch (const std::exception& e) {
-        last_error_ = e.what();
-        return false;
+        // Through tmp/ like a delivery, so no reader sees a partial copy.
+        std::string unique_name = generate_unique_name();
+        auto tmp_path = dest_path / "tmp" / unique_name;
+        auto& filename = filenames.emplace_back(unique_name + flags_to_info(msg->flags));
+        if (!clone_file(msg->path, tmp_path, last_error_)) {
+            filenames.pop_back();
+            continue;
+        }
+        if (::rename(tmp_path.c_str(), (dest_path / "cur" / filename).c_str()) != 0) {
+            last_error_ = std::string("rename: ") + std::strerror(errno);
+            ::unlink(tmp_path.c_str());
+            filenames.pop_back();
+            continue;
+        }
+
+        additions.push_back({filename, false, msg->size, to_seconds(msg->timestamp),
+                             static_cast<uint32_t>(msg->body_offset)});
+        bytes += static_cast<int64_t>(msg->size);
+        copies[i] = std::move(unique_name);
+    }
+
+    if (!additions.empty() && !GroupCommit::instance().sync_directory(dest_path / "cur")) {
+        // Left in place: the copies exist, they may just not survive a crash.
+        last_error_ = "Failed to sync cur/";
+    }
+    index_for(to_mailbox).add_all(additions);
+    for (const auto& addition : additions) {
+        auto filename = std::string(addition.filename);
+        remember(to_mailbox, filename.substr(0, filename.find(':')), filename, false,
+                 addition.body_offset, addition.size);
     }
+    account(static_cast<int64_t>(additions.size()), bytes);
+    if (!additions.empty()) {
+        publish(to_mailbox);
+    }
+    return copies;
 }
 
-bool Maildir::add_flags(const std::string& unique_id, const std::set<char>& flags,
+bool Maildir::set_flags(const std::string& unique_id, const std::set<char>& flags,
                         const std::string& mailbox) {
-    auto msg = get_message(unique_id, mailbox);
-    if (!msg) {
-        return false;
-    }
+    const FlagChange change{unique_id, FlagChange::Mode::Replace, flags};
+    return apply_flags({&change, 1}, mailbox).front().has_value();
+}
 
-    std::set<char> new_flags = msg->flags;
-    new_flags.insert(flags.begin(), flags.end());
-    return set_flags(unique_id, new_flags, mailbox);
+bool Maildir::add_flags(const std::string& unique_id, const std::set<char>& flags,
+                        const std::string& mailbox) {
+    const FlagChange change{unique_id, FlagChange::Mode::Add, flags};
+    return apply_flags({&change, 1}, mailbox).front().has_value();
 }
 
 bool Maildir::remove_flags(const std::string& unique_id, const std::set<char>& flags,
                            const std::string& mailbox) {
-    auto msg = get_message(unique_id, mailbox);
-    if (!msg) {
-        return false;
+    const FlagChange change{unique_id, FlagChange::Mode::Remove, flags};
+    return apply_flags({&change, 1}, mailbox).front().has_value();
+}
+
+std::vector<std::optional<std::set<char>>> Maildir::apply_flags(
+        std::span<const FlagChange> changes, const std::string& mailbox) {
+    ScopedTimer timer(storage_time(StorageOp::Flags));
+    std::vector<std::optional<std::set<char>>> results(changes.size());
+    auto& state = state_for(mailbox);
+    bool reloaded = false;
+    if (!state.locations_loaded) {
+        load_locations(mailbox);
+        reloaded = true;
     }
 
-    std::set<char> new_flags = msg->flags;
-    for (char flag : flags) {
-        new_flags.erase(flag);
+    const auto path = get_mailbox_path(mailbox);
+    // Renamed messages, each once however often it appears in `changes`.
+    std::vector<std::string_view> renamed;
+    std::unordered_set<std::string_view> seen;
+    std::vector<std::size_t> missing;
+    bool changed = false;
+
+    auto apply = [&](std::size_t i) {
+        const auto& change = changes[i];
+        auto found = state.locations.find(change.unique_id);
+        if (!found) {
+            missing.push_back(i);
+            return;
+        }
+        auto& location = *found;
+
+        std::set<char> flags = parse_flags(location.filename);
+        switch (change.mode) {
+            case FlagChange::Mode::Replace:
+                flags = change.flags;
+                break;
+            case FlagChange::Mode::Add:
+                flags.insert(change.flags.begin(), change.flags.end());
+                break;
+            case FlagChange::Mode::Remove:
+                for (char flag : change.flags) {
+                    flags.erase(flag);
+                }
+                break;
+        }
+
+        // Flagged messages belong in cur/; one rename moves and re-flags.
+        std::string filename = change.unique_id + flags_to_info(flags);
+        if (location.in_new || filename != location.filename) {
+            std::error_code ec;
+            std::filesystem::rename(path / (location.in_new ? "new" : "cur") / location.filename,
+                                    path / "cur" / filename, ec);
+            if (ec) {
+                if (ec == std::errc::no_such_file_or_directory) {
+                    missing.push_back(i);
+                } else {
+                    last_error_ = ec.message();
+                }
+                return;
+            }
+            location.filename = std::move(filename);
+            location.in_new = false;
+            state.locations.set(change.unique_id, std::move(location));
+            if (seen.insert(change.unique_id).second) {
+                renamed.push_back(change.unique_id);
+            }
+        }
+        results[i] = std::move(flags);
+    };
+
+    auto update_index = [&] {
+        if (renamed.empty()) {
+            return;
+        }
+        std::vector<MailboxIndex::Rename> renames;
+        renames.reserve(renamed.size());
+        for (auto unique_id : renamed) {
+            // Set above, so already this Maildir's own and not copied.
+            const auto* location = state.locations.edit(std::string(unique_id));
+            renames.push_back({unique_id, location->filename, location->in_new});
+        }
+        state.index->rename_all(renames);
+        renamed.clear();
+        seen.clear();
+        changed = true;
+    };
+
+    for (std::size_t i = 0; i < changes.size(); ++i) {
+        apply(i);
+    }
+    update_index();
+
+    // Whatever was not where we thought has been moved by someone else.
+    if (!missing.empty() && !reloaded) {
+        refresh_locations(mailbox);
+        auto retry = std::move(missing);
+        missing.clear();
+        for (auto i : retry) {
+            apply(i);
+        }
+        update_index();
     }
-    return set_flags(unique_id, new_flags, mailbox);
+    if (changed) {
+        publish(mailbox);
+    }
+    return results;
 }
 
 bool Maildir::mark_as_seen(const std::string& unique_id, const std::string& mailbox) {
@@ -544,34 +1385,96 @@ bool Maildir::mark_as_seen(const std::string& unique_id, const std::string& mail
 }
 
 size_t Maildir::expunge(const std::string& mailbox) {
-    auto messages = list_messages(mailbox);
-    size_t count = 0;
-
-    for (const auto& msg : messages) {
+    ScopedTimer timer(storage_time(StorageOp::Expunge));
+    std::vector<std::string> trashed;
+    for (const auto& msg : list_messages(mailbox)) {
         if (msg.is_deleted()) {
-            if (delete_message(msg.unique_id, mailbox)) {
-                count++;
-            }
+            trashed.push_back(msg.unique_id);
         }
     }
 
+    size_t count = delete_messages(trashed, mailbox);
+    if (count > 0) {
+        prune_caches(mailbox);
+    }
     return count;
 }
 
-size_t Maildir::get_total_size() const {
-    size_t total = 0;
+void Maildir::prune_caches(const std::string& mailbox) {
+    // Whatever the index no longer lists is of no more use to them.
+    std::unordered_set<std::string> live;
+    if (!index_for(mailbox).for_each([&live](const IndexEntry& entry) {
+            live.emplace(entry.unique_id());
+        })) {
+        return;
+    }
+    auto keep = [&live](const std::string& id) { return live.count(id) > 0; };
+    auto& structures = structures_for(mailbox);
+    if (!structures.retain(keep)) {
+        LOG_WARNING_FMT("Structure cache of {}: {}", get_mailbox_path(mailbox).string(),
+                        structures.last_error());
+    }
+    auto& search = search_for(mailbox);
+    if (!search.retain(keep)) {
+        LOG_WARNING_FMT("Search index of {}: {}", get_mailbox_path(mailbox).string(),
+                        search.last_error());
+    }
+}
 
-    try {
-        for (const auto& entry : std::filesystem::recursive_directory_iterator(maildir_path_)) {
-            if (entry.is_regular_file()) {
-                total += entry.file_size();
-            }
+void Maildir::publish(const std::string& mailbox) const {
+    auto& events = MailboxEvents::instance();
+    if (events.subscribers() > 0) {
+        events.publish(get_mailbox_path(mailbox).string());
+    }
+}
+
+void Maildir::account(int64_t messages, int64_t bytes) {
+    if (!usage_file_.add(messages, bytes)) {
+        // Left for the next reconciliation to correct.
+        LOG_WARNING_FMT("Usage of {}: {}", maildir_path_.string(), usage_file_.last_error());
+    }
+}
+
+StorageUsage Maildir::usage() {
+    StorageUsage usage;
+    if (usage_file_.read(usage)) {
+        return usage;
+    }
+    if (!usage_file_.last_error().empty()) {
+        LOG_WARNING_FMT("Usage of {}: {}", maildir_path_.string(), usage_file_.last_error());
+    }
+    return reconcile_usage();
+}
+
+StorageUsage Maildir::reconcile_usage() {
+    StorageUsage usage;
+    if (!exists()) {
+        return usage;
+    }
+
+    for (const auto& mailbox : list_mailboxes()) {
+        uint64_t messages = 0;
+        uint64_t bytes = 0;
+        if (index_for(mailbox).totals(messages, bytes)) {
+            usage.messages += messages;
+            usage.bytes += bytes;
+            continue;
+        }
+        for (const auto& msg : scan_messages(mailbox)) {
+            ++usage.messages;
+            usage.bytes += msg.size;
         }
-    } catch (...) {
-        // Ignore errors
     }
 
-    return total;
+    usage.reconciled_at = to_seconds(std::chrono::system_clock::now());
+    if (!usage_file_.replace(usage)) {
+        LOG_WARNING_FMT("Usage of {}: {}", maildir_path_.string(), usage_file_.last_error());
+    }
+    return usage;
+}
+
+size_t Maildir::get_total_size() {
+    return static_cast<size_t>(usage().bytes);
 }
 
 size_t Maildir::get_message_count(const std::string& mailbox) const {
@@ -596,46 +1499,332 @@ size_t Maildir::get_message_count(const std::string& mailbox) const {
     return count;
 }
 
-uint32_t Maildir::get_uid_validity(const std::string& mailbox) {
+void Maildir::set_compression_level(int level) {
+    if (level > 0 && !compression::available()) {
+        LOG_WARNING("Compression requested but not built in; storing messages uncompressed");
+        level = 0;
+    }
+    compression_level_.store(level, std::memory_order_relaxed);
+}
+
+int Maildir::compression_level() {
+    return compression_level_.load(std::memory_order_relaxed);
+}
+
+size_t Maildir::recompress(size_t limit) {
+    size_t rewritten = 0;
+    if (compression_level() <= 0 || !exists()) {
+        return rewritten;
+    }
+
+    for (const auto& mailbox : list_mailboxes()) {
+        if (limit == 0) {
+            break;
+        }
+        auto messages = read_listing(mailbox);
+        if (messages.empty() || messages.front().uid == 0) {
+            continue;  // Nothing there, or no index to number the work by
+        }
+
+        // "<uidvalidity> <uid>": every message up to that UID was looked at.
+        const auto path = get_mailbox_path(mailbox);
+        const uint32_t uid_validity = index_for(mailbox).uid_validity();
+        uint32_t stored_validity = 0;
+        uint32_t done = 0;
+        {
+            std::ifstream in(path / recompress_file_name);
+            in >> stored_validity >> done;
+        }
+        if (stored_validity != uid_validity) {
+            done = 0;
+        }
+
+        const uint32_t before = done;
+        for (const auto& msg : messages) {
+            if (msg.uid <= done) {
+                continue;
+            }
+            if (limit == 0) {
+                break;
+            }
+            --limit;
+            if (compress_file(msg.path, path / "tmp", generate_unique_name(), last_error_)) {
+                ++rewritten;
+            }
+            done = msg.uid;
+        }
+
+        if (done != before) {
+            auto tmp = path / (std::string(recompress_file_name) + ".tmp");
+            {
+                std::ofstream out(tmp, std::ios::trunc);
+                out << uid_validity << ' ' << done << '\n';
+            }
+            std::error_code ec;
+            std::filesystem::rename(tmp, path / recompress_file_name, ec);
+        }
+    }
+    return rewritten;
+}
+
+Maildir::MailboxState& Maildir::state_for(const std::string& mailbox) {
     auto path = get_mailbox_path(mailbox);
-    auto uidvalidity_file = path / ".uidvalidity";
+    auto& state = mailboxes_[path];
+    if (!state.index) {
+        state.index = std::make_unique<MailboxIndex>(path);
+    }
+    return state;
+}
+
+StructureCache& Maildir::structures_for(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    if (!state.structures) {
+        state.structures = std::make_unique<StructureCache>(get_mailbox_path(mailbox));
+    }
+    return *state.structures;
+}
+
+SearchIndex& Maildir::search_for(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    if (!state.search) {
+        state.search = std::make_unique<SearchIndex>(get_mailbox_path(mailbox));
+    }
+    return *state.search;
+}
+
+void Maildir::forget_mailbox(const std::string& mailbox) {
+    MailboxSnapshotCache::instance().erase(get_mailbox_path(mailbox).string());
+    mailboxes_.erase(get_mailbox_path(mailbox));
+}
+
+void Maildir::load_locations(const std::string& mailbox) {
+    load_snapshot(mailbox);
+}
 
-    if (std::filesystem::exists(uidvalidity_file)) {
-        std::ifstream file(uidvalidity_file);
-        uint32_t validity;
-        if (file >> validity) {
-            return validity;
+std::shared_ptr<const MailboxSnapshot> Maildir::load_snapshot(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    auto& cache = MailboxSnapshotCache::instance();
+    const auto key = get_mailbox_path(mailbox).string();
+    std::shared_ptr<const MailboxSnapshot> snapshot;
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    if (state.index->totals(messages, bytes)) {
+        snapshot = cache.find(key, state.index->uid_validity(), state.index->highest_modseq(),
+                              state.index->changes(), messages);
+        if (!snapshot) {
+            snapshot = MailboxSnapshot::from_index(*state.index);
+            if (snapshot) {
+                cache.insert(key, snapshot);
+            }
         }
     }
+    if (!snapshot) {
+        // Without an index there is nothing to tell a snapshot is current.
+        snapshot = MailboxSnapshot::from_messages(scan_messages(mailbox));
+    }
+    state.locations.reset(snapshot);
+    state.locations_loaded = true;
+    return snapshot;
+}
 
-    // Create new UID validity
-    auto now = std::chrono::system_clock::now();
-    uint32_t validity = static_cast<uint32_t>(
-        std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count()
-    );
+void Maildir::remember(const std::string& mailbox, std::string unique_id,
+                       std::string filename, bool in_new, uint32_t body_offset,
+                       uint64_t size) {
+    auto& state = state_for(mailbox);
+    if (state.locations_loaded && !state.watcher) {
+        state.locations.set(unique_id,
+                            MessageLocation{std::move(filename), in_new, 0, body_offset, size});
+    }
+}
+
+void Maildir::forget(const std::string& mailbox, const std::string& unique_id) {
+    state_for(mailbox).locations.erase(unique_id);
+}
 
-    std::ofstream file(uidvalidity_file);
-    file << validity << "\n1\n";  // validity and next UID
-    return validity;
+void Maildir::refresh_locations(const std::string& mailbox) {
+    if (state_for(mailbox).watcher) {
+        catch_up(mailbox);
+    } else {
+        load_locations(mailbox);
+    }
 }
 
-uint32_t Maildir::allocate_uid(const std::string& mailbox) {
+bool Maildir::watch(const std::string& mailbox) {
     auto path = get_mailbox_path(mailbox);
-    auto uidvalidity_file = path / ".uidvalidity";
+    if (!std::filesystem::exists(path / "cur")) {
+        return false;
+    }
+    auto& state = state_for(mailbox);
+    if (!state.watcher) {
+        state.watcher = std::make_unique<MailboxWatcher>(path);
+    }
+    return true;
+}
 
-    uint32_t validity = 0;
-    uint32_t next_uid = 1;
+void Maildir::unwatch(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    state.watcher.reset();
+    state.pending.clear();
+}
+
+int Maildir::watch_fd(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    return state.watcher ? state.watcher->fd() : -1;
+}
 
-    if (std::filesystem::exists(uidvalidity_file)) {
-        std::ifstream file(uidvalidity_file);
-        file >> validity >> next_uid;
+std::unique_ptr<MailboxEvents::Subscription> Maildir::subscribe(const std::string& mailbox,
+                                                                std::function<void()> notify) {
+    return MailboxEvents::instance().subscribe(get_mailbox_path(mailbox).string(),
+                                               std::move(notify));
+}
+
+std::vector<MailboxChange> Maildir::poll_changes(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    if (!state.watcher) {
+        return {};
+    }
+    if (!state.locations_loaded) {
+        load_locations(mailbox);
     }
+    catch_up(mailbox);
+    return std::exchange(state.pending, {});
+}
 
-    // Write back incremented UID
-    std::ofstream file(uidvalidity_file);
-    file << validity << "\n" << (next_uid + 1) << "\n";
+void Maildir::catch_up(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    std::vector<MailboxWatcher::Event> events;
+    if (!state.watcher->poll(events)) {
+        LOG_WARNING_FMT("Rescanning {}: {}", get_mailbox_path(mailbox).string(),
+                        state.watcher->last_error());
+        resync(mailbox);
+        return;
+    }
+
+    const auto path = get_mailbox_path(mailbox);
+    const std::string mailbox_name = mailbox.empty() ? "INBOX" : mailbox;
+    std::vector<MailboxIndex::Rename> renames;
+    const std::size_t first_change = state.pending.size();
+
+    for (const auto& event : events) {
+        auto location = state.locations.find(event.unique_id);
+        const bool known = location && location->filename == event.filename &&
+                           location->in_new == event.in_new;
+
+        if (!event.present) {
+            // Only the name we know going away means the message left; an
+            // older name vanishing is the tail of a rename.
+            if (known) {
+                MailboxChange change{MailboxChange::Kind::Removed, {}};
+                change.message.unique_id = event.unique_id;
+                change.message.mailbox = mailbox_name;
+                change.message.uid = location->uid;
+                state.index->remove(event.unique_id);
+                state.locations.erase(event.unique_id);
+                state.pending.push_back(std::move(change));
+            }
+            continue;
+        }
+        if (known) {
+            continue;  // Our own change
+        }
 
-    return next_uid;
+        // Gone again already: a later event says where to, if anywhere.
+        auto msg = parse_message_file(path / (event.in_new ? "new" : "cur") / event.filename,
+                                      mailbox);
+        if (!msg) {
+            continue;
+        }
+
+        if (!location) {
+            state.index->add(event.filename, event.in_new, msg->size, to_seconds(msg->timestamp));
+            msg->uid = state.index->uid_of(event.unique_id);
+            state.locations.set(event.unique_id,
+                                MessageLocation{event.filename, event.in_new, msg->uid, 0,
+                                                msg->size});
+            state.pending.push_back({MailboxChange::Kind::Added, std::move(*msg)});
+        } else {
+            renames.push_back({event.unique_id, event.filename, event.in_new});
+            msg->uid = location->uid;
+            location->filename = event.filename;
+            location->in_new = event.in_new;
+            state.locations.set(event.unique_id, std::move(*location));
+            state.pending.push_back({MailboxChange::Kind::FlagsChanged, std::move(*msg)});
+        }
+    }
+    if (!renames.empty()) {
+        state.index->rename_all(renames);
+    }
+
+    // New messages in UID order, as sequence numbers must follow it.
+    auto added = std::stable_partition(
+        state.pending.begin() + static_cast<std::ptrdiff_t>(first_change), state.pending.end(),
+        [](const MailboxChange& change) { return change.kind != MailboxChange::Kind::Added; });
+    std::stable_sort(added, state.pending.end(),
+                     [](const MailboxChange& a, const MailboxChange& b) {
+                         return a.message.uid < b.message.uid;
+                     });
+}
+
+void Maildir::resync(const std::string& mailbox) {
+    auto& state = state_for(mailbox);
+    auto before = std::move(state.locations);
+    state.locations.reset();
+
+    for (auto& msg : read_listing(mailbox)) {
+        auto location = before.find(msg.unique_id);
+        if (!location) {
+            state.pending.push_back({MailboxChange::Kind::Added, std::move(msg)});
+            continue;
+        }
+        before.erase(msg.unique_id);
+        if (location->filename != msg.path.filename().string() ||
+            location->in_new != msg.is_new) {
+            state.pending.push_back({MailboxChange::Kind::FlagsChanged, std::move(msg)});
+        }
+    }
+
+    const std::string mailbox_name = mailbox.empty() ? "INBOX" : mailbox;
+    before.for_each([&](const std::string& unique_id, const MessageLocation& location) {
+        MailboxChange change{MailboxChange::Kind::Removed, {}};
+        change.message.unique_id = unique_id;
+        change.message.mailbox = mailbox_name;
+        change.message.uid = location.uid;
+        state.pending.push_back(std::move(change));
+    });
+}
+
+uint32_t Maildir::get_uid_validity(const std::string& mailbox) {
+    auto& index = index_for(mailbox);
+    return index.for_each([](const IndexEntry&) {}) ? index.uid_validity()
+                                                    : unindexed_uid_validity();
+}
+
+uint32_t Maildir::get_uid_next(const std::string& mailbox) {
+    auto& index = index_for(mailbox);
+    if (index.for_each([](const IndexEntry&) {})) {
+        return index.uid_next();
+    }
+    return static_cast<uint32_t>(scan_messages(mailbox).size() + 1);
+}
+
+uint64_t Maildir::get_highest_modseq(const std::string& mailbox) {
+    return index_for(mailbox).highest_modseq();
+}
+
+std::vector<uint64_t> Maildir::get_modseqs(std::span<const std::string> unique_ids,
+                                           const std::string& mailbox) {
+    std::vector<uint64_t> modseqs;
+    index_for(mailbox).modseqs(unique_ids, modseqs);
+    return modseqs;
+}
+
+std::optional<std::vector<uint32_t>> Maildir::vanished_since(uint64_t modseq,
+                                                             const std::string& mailbox) {
+    std::vector<uint32_t> uids;
+    if (!index_for(mailbox).vanished_since(modseq, uids)) {
+        return std::nullopt;
+    }
+    return uids;
 }
 
 }  // namespace email
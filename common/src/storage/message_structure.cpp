@@ -0,0 +1,397 @@
+#include "storage/message_structure.hpp"
+#include "storage/message_view.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+namespace email {
+
+namespace {
+
+// Nesting beyond this is left unparsed; no real message gets near it.
+constexpr int max_depth = 32;
+constexpr uint8_t format_version = 1;
+
+std::string lower(std::string_view text) {
+    std::string result(text);
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return result;
+}
+
+std::string_view trim(std::string_view text) {
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+bool iequals(std::string_view a, std::string_view b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) ==
+                      std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// "value; name=value; name="quoted"" into the value and its parameters.
+std::string parse_parameterised(std::string_view text, MimePart::Params& params) {
+    std::vector<std::string> pieces(1);
+    bool quoted = false;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (quoted && c == '\\' && i + 1 < text.size()) {
+            pieces.back() += text[++i];
+        } else if (c == '"') {
+            quoted = !quoted;
+            pieces.back() += c;
+        } else if (c == ';' && !quoted) {
+            pieces.emplace_back();
+        } else {
+            pieces.back() += c;
+        }
+    }
+
+    for (std::size_t i = 1; i < pieces.size(); ++i) {
+        std::string_view piece = pieces[i];
+        auto equals = piece.find('=');
+        if (equals == std::string_view::npos) {
+            continue;
+        }
+        auto name = trim(piece.substr(0, equals));
+        auto value = trim(piece.substr(equals + 1));
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+            value = value.substr(1, value.size() - 2);
+        }
+        if (!name.empty()) {
+            params.emplace_back(lower(name), std::string(value));
+        }
+    }
+    return std::string(trim(pieces[0]));
+}
+
+std::string_view param(const MimePart::Params& params, std::string_view name) {
+    for (const auto& [key, value] : params) {
+        if (key == name) {
+            return value;
+        }
+    }
+    return {};
+}
+
+void assign_once(std::string& target, const std::string& value) {
+    if (target.empty()) {
+        target = value;
+    }
+}
+
+void parse_entity(std::string_view message, uint64_t start, uint64_t end, bool in_digest,
+                  int depth, MimePart& part, Envelope* envelope);
+
+void parse_multipart(std::string_view message, int depth, MimePart& part) {
+    const std::string delimiter = "--" + std::string(param(part.params, "boundary"));
+    if (delimiter.size() > 2) {
+        // Delimiters are only looked for up to this part's end.
+        const std::string_view scope = message.substr(0, part.end);
+        const bool digest = part.subtype == "digest";
+        std::optional<uint64_t> part_start;
+        std::size_t pos = part.body_offset;
+
+        while ((pos = scope.find(delimiter, pos)) != std::string_view::npos) {
+            std::size_t line_start = pos;
+            pos += delimiter.size();
+            if (line_start != part.body_offset && scope[line_start - 1] != '\n') {
+                continue;
+            }
+            bool close = scope.compare(pos, 2, "--") == 0;
+            std::size_t line_end = scope.find('\n', pos);
+            if (line_end == std::string_view::npos) {
+                line_end = scope.size();
+            }
+            if (!trim(scope.substr(close ? pos + 2 : pos, line_end - (close ? pos + 2 : pos))).empty()) {
+                continue;  // Only starts like a delimiter
+            }
+
+            if (part_start) {
+                // The line break before a delimiter belongs to it.
+                std::size_t content_end = line_start;
+                if (content_end > *part_start && scope[content_end - 1] == '\n') --content_end;
+                if (content_end > *part_start && scope[content_end - 1] == '\r') --content_end;
+                parse_entity(message, *part_start, std::max<uint64_t>(content_end, *part_start),
+                             digest, depth + 1, part.parts.emplace_back(), nullptr);
+            }
+            part_start = std::min<std::size_t>(line_end + 1, scope.size());
+            if (close) {
+                part_start.reset();
+                break;
+            }
+            pos = *part_start;
+        }
+        if (part_start) {
+            // No closing delimiter: the last part runs to the end.
+            parse_entity(message, *part_start, part.end, digest, depth + 1,
+                         part.parts.emplace_back(), nullptr);
+        }
+    }
+
+    if (part.parts.empty()) {
+        // Without a usable boundary the body is opaque.
+        part.type = "application";
+        part.subtype = "octet-stream";
+        part.params.clear();
+    }
+}
+
+void parse_entity(std::string_view message, uint64_t start, uint64_t end, bool in_digest,
+                  int depth, MimePart& part, Envelope* envelope) {
+    const std::string_view entity = message.substr(start, end - start);
+    // MIME parts often have no header at all: the blank line comes first.
+    const auto bounds = entity.starts_with("\r\n") ? std::optional(HeaderBounds{0, 2})
+                        : entity.starts_with("\n") ? std::optional(HeaderBounds{0, 1})
+                                                   : find_header_end(entity);
+    part.offset = start;
+    part.body_offset = start + (bounds ? bounds->body_start : entity.size());
+    part.end = end;
+    if (in_digest) {
+        part.type = "message";
+        part.subtype = "rfc822";
+    }
+
+    for (const auto& field : parse_header_fields(entity.substr(0, bounds ? bounds->header_end
+                                                                  : entity.size()))) {
+        const auto& name = field.name;
+        if (iequals(name, "Content-Type")) {
+            MimePart::Params params;
+            auto type = lower(parse_parameterised(field.value, params));
+            auto slash = type.find('/');
+            if (slash != std::string::npos && slash > 0 && slash + 1 < type.size()) {
+                part.type = std::string(trim(type.substr(0, slash)));
+                part.subtype = std::string(trim(type.substr(slash + 1)));
+                part.params = std::move(params);
+            }
+        } else if (iequals(name, "Content-Transfer-Encoding")) {
+            part.encoding = lower(field.value);
+        } else if (iequals(name, "Content-ID")) {
+            part.id = field.value;
+        } else if (iequals(name, "Content-Description")) {
+            part.description = field.value;
+        } else if (iequals(name, "Content-MD5")) {
+            part.md5 = field.value;
+        } else if (iequals(name, "Content-Disposition")) {
+            part.disposition = lower(parse_parameterised(field.value, part.disposition_params));
+        } else if (iequals(name, "Content-Language")) {
+            part.language = field.value;
+        } else if (iequals(name, "Content-Location")) {
+            part.location = field.value;
+        } else if (envelope) {
+            if (iequals(name, "Date")) assign_once(envelope->date, field.value);
+            else if (iequals(name, "Subject")) assign_once(envelope->subject, field.value);
+            else if (iequals(name, "From")) assign_once(envelope->from, field.value);
+            else if (iequals(name, "Sender")) assign_once(envelope->sender, field.value);
+            else if (iequals(name, "Reply-To")) assign_once(envelope->reply_to, field.value);
+            else if (iequals(name, "To")) assign_once(envelope->to, field.value);
+            else if (iequals(name, "Cc")) assign_once(envelope->cc, field.value);
+            else if (iequals(name, "Bcc")) assign_once(envelope->bcc, field.value);
+            else if (iequals(name, "In-Reply-To")) assign_once(envelope->in_reply_to, field.value);
+            else if (iequals(name, "Message-ID")) assign_once(envelope->message_id, field.value);
+        }
+    }
+
+    const auto body = message.substr(part.body_offset, part.end - part.body_offset);
+    part.lines = static_cast<uint64_t>(std::count(body.begin(), body.end(), '\n'));
+
+    if (depth >= max_depth) {
+        if (part.is_multipart() || part.is_message()) {
+            part.type = "application";
+            part.subtype = "octet-stream";
+            part.params.clear();
+        }
+        return;
+    }
+    if (part.is_multipart()) {
+        parse_multipart(message, depth, part);
+    } else if (part.is_message()) {
+        parse_entity(message, part.body_offset, part.end, false, depth + 1,
+                     part.parts.emplace_back(), &part.envelope);
+    }
+}
+
+// Fixed-width little-endian numbers and length-prefixed strings.
+class Encoder {
+public:
+    void number(uint64_t value) {
+        char bytes[8];
+        for (int i = 0; i < 8; ++i) bytes[i] = static_cast<char>(value >> (8 * i));
+        out_.append(bytes, sizeof(bytes));
+    }
+    void string(std::string_view value) {
+        number(value.size());
+        out_.append(value);
+    }
+    void params(const MimePart::Params& params) {
+        number(params.size());
+        for (const auto& [name, value] : params) {
+            string(name);
+            string(value);
+        }
+    }
+    void envelope(const Envelope& e) {
+        for (const auto* field : {&e.date, &e.subject, &e.from, &e.sender, &e.reply_to, &e.to,
+                                  &e.cc, &e.bcc, &e.in_reply_to, &e.message_id}) {
+            string(*field);
+        }
+    }
+    void part(const MimePart& p) {
+        for (const auto* field : {&p.type, &p.subtype, &p.id, &p.description, &p.encoding,
+                                  &p.md5, &p.disposition, &p.language, &p.location}) {
+            string(*field);
+        }
+        params(p.params);
+        params(p.disposition_params);
+        for (uint64_t value : {p.offset, p.body_offset, p.end, p.lines}) {
+            number(value);
+        }
+        envelope(p.envelope);
+        number(p.parts.size());
+        for (const auto& child : p.parts) {
+            part(child);
+        }
+    }
+
+    std::string& out() { return out_; }
+
+private:
+    std::string out_;
+};
+
+class Decoder {
+public:
+    explicit Decoder(std::string_view in) : in_(in) {}
+
+    bool ok() const { return ok_; }
+    bool done() const { return in_.empty(); }
+
+    uint64_t number() {
+        if (in_.size() < 8) {
+            ok_ = false;
+            return 0;
+        }
+        uint64_t value = 0;
+        for (int i = 0; i < 8; ++i) {
+            value |= static_cast<uint64_t>(static_cast<unsigned char>(in_[i])) << (8 * i);
+        }
+        in_.remove_prefix(8);
+        return value;
+    }
+    std::string string() {
+        uint64_t size = number();
+        if (!ok_ || size > in_.size()) {
+            ok_ = false;
+            return {};
+        }
+        std::string value(in_.substr(0, size));
+        in_.remove_prefix(size);
+        return value;
+    }
+    void params(MimePart::Params& params) {
+        uint64_t count = number();
+        for (uint64_t i = 0; ok_ && i < count; ++i) {
+            auto name = string();
+            params.emplace_back(std::move(name), string());
+        }
+    }
+    void envelope(Envelope& e) {
+        for (auto* field : {&e.date, &e.subject, &e.from, &e.sender, &e.reply_to, &e.to, &e.cc,
+                            &e.bcc, &e.in_reply_to, &e.message_id}) {
+            *field = string();
+        }
+    }
+    void part(MimePart& p, int depth) {
+        if (depth > max_depth) {
+            ok_ = false;
+            return;
+        }
+        for (auto* field : {&p.type, &p.subtype, &p.id, &p.description, &p.encoding, &p.md5,
+                            &p.disposition, &p.language, &p.location}) {
+            *field = string();
+        }
+        params(p.params);
+        params(p.disposition_params);
+        for (auto* value : {&p.offset, &p.body_offset, &p.end, &p.lines}) {
+            *value = number();
+        }
+        envelope(p.envelope);
+        uint64_t count = number();
+        for (uint64_t i = 0; ok_ && i < count; ++i) {
+            part(p.parts.emplace_back(), depth + 1);
+        }
+    }
+
+private:
+    std::string_view in_;
+    bool ok_ = true;
+};
+
+}  // namespace
+
+std::vector<HeaderField> parse_header_fields(std::string_view header) {
+    std::vector<HeaderField> fields;
+    while (!header.empty()) {
+        auto newline = header.find('\n');
+        auto line = header.substr(0, newline);
+        header.remove_prefix(newline == std::string_view::npos ? header.size() : newline + 1);
+        if (!line.empty() && line.back() == '\r') {
+            line.remove_suffix(1);
+        }
+
+        if (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+            if (!fields.empty()) {
+                fields.back().value.append(line);
+            }
+            continue;
+        }
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) {
+            continue;
+        }
+        fields.push_back({trim(line.substr(0, colon)), std::string(line.substr(colon + 1))});
+    }
+    for (auto& field : fields) {
+        field.value = std::string(trim(field.value));
+    }
+    return fields;
+}
+
+MessageStructure MessageStructure::parse(std::string_view message) {
+    MessageStructure structure;
+    parse_entity(message, 0, message.size(), false, 0, structure.body, &structure.envelope);
+    return structure;
+}
+
+std::string MessageStructure::serialize() const {
+    Encoder encoder;
+    encoder.out().push_back(static_cast<char>(format_version));
+    encoder.envelope(envelope);
+    encoder.part(body);
+    return std::move(encoder.out());
+}
+
+std::optional<MessageStructure> MessageStructure::deserialize(std::string_view data) {
+    if (data.empty() || static_cast<uint8_t>(data.front()) != format_version) {
+        return std::nullopt;
+    }
+    Decoder decoder(data.substr(1));
+    MessageStructure structure;
+    decoder.envelope(structure.envelope);
+    decoder.part(structure.body, 0);
+    if (!decoder.ok() || !decoder.done()) {
+        return std::nullopt;
+    }
+    return structure;
+}
+
+}  // namespace email
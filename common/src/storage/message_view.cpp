@@ -0,0 +1,107 @@
+#include "storage/message_view.hpp"
+#include "storage/compression.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace email {
+
+std::optional<HeaderBounds> find_header_end(std::string_view data) {
+    // The first empty line, whichever terminator the message uses.
+    for (std::size_t pos = data.find('\n'); pos != std::string_view::npos;
+         pos = data.find('\n', pos + 1)) {
+        std::size_t next = pos + 1;
+        if (next < data.size() && data[next] == '\n') {
+            return HeaderBounds{pos, next + 1};
+        }
+        if (next + 1 < data.size() && data[next] == '\r' && data[next + 1] == '\n') {
+            return HeaderBounds{pos > 0 && data[pos - 1] == '\r' ? pos - 1 : pos, next + 2};
+        }
+    }
+    return std::nullopt;
+}
+
+std::optional<MessageView> MessageView::open(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return std::nullopt;
+    }
+
+    MessageView view;
+    if (st.st_size > 0) {
+        void* mapped = ::mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ,
+                              MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            return std::nullopt;
+        }
+        view.data_ = static_cast<const char*>(mapped);
+        view.size_ = static_cast<std::size_t>(st.st_size);
+        view.mapped_ = true;
+    }
+    // The mapping keeps the file alive on its own.
+    ::close(fd);
+
+    if (compression::is_compressed(view.data())) {
+        auto contents = compression::decompress(view.data());
+        if (!contents) {
+            return std::nullopt;
+        }
+        view.release();
+        view.owned_ = std::move(*contents);
+        view.data_ = view.owned_.data();
+        view.size_ = view.owned_.size();
+    }
+    return view;
+}
+
+MessageView::~MessageView() {
+    release();
+}
+
+MessageView::MessageView(MessageView&& other) noexcept {
+    *this = std::move(other);
+}
+
+MessageView& MessageView::operator=(MessageView&& other) noexcept {
+    if (this != &other) {
+        release();
+        mapped_ = std::exchange(other.mapped_, false);
+        size_ = std::exchange(other.size_, 0);
+        if (mapped_) {
+            data_ = std::exchange(other.data_, nullptr);
+        } else {
+            owned_ = std::move(other.owned_);
+            data_ = owned_.data();
+            other.data_ = nullptr;
+        }
+    }
+    return *this;
+}
+
+void MessageView::release() {
+    if (mapped_) {
+        ::munmap(const_cast<char*>(data_), size_);
+        mapped_ = false;
+    }
+    std::string().swap(owned_);
+    data_ = nullptr;
+    size_ = 0;
+}
+
+HeaderBounds MessageView::header_bounds() const {
+    if (auto bounds = find_header_end(data())) {
+        return *bounds;
+    }
+    return HeaderBounds{size_, size_};
+}
+
+}  // namespace email
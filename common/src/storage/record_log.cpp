@@ -0,0 +1,289 @@
+#include "storage/record_log.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace email {
+
+namespace {
+
+// Records of gone keys a rewrite has to save before it is worth it.
+constexpr uint64_t min_stale_records = 64;
+
+uint32_t get_le32(const char* bytes) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= static_cast<uint32_t>(static_cast<unsigned char>(bytes[i])) << (8 * i);
+    }
+    return value;
+}
+
+void put_le32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+}
+
+void append_record(std::string& out, std::string_view key, std::string_view payload) {
+    put_le32(out, static_cast<uint32_t>(key.size()));
+    put_le32(out, static_cast<uint32_t>(payload.size()));
+    out.append(key);
+    out.append(payload);
+}
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return true;
+}
+
+bool pread_all(int fd, char* buffer, std::size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t n = ::pread(fd, buffer, size, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer += n;
+        size -= static_cast<std::size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+bool same_file(int fd, const std::filesystem::path& path) {
+    struct stat by_path, by_fd;
+    return ::stat(path.c_str(), &by_path) == 0 && ::fstat(fd, &by_fd) == 0 &&
+           by_path.st_ino == by_fd.st_ino && by_path.st_dev == by_fd.st_dev;
+}
+
+}  // namespace
+
+RecordLog::RecordLog(std::filesystem::path path, std::string_view format_line,
+                     std::function<void()> forget)
+    : path_(std::move(path)), format_line_(format_line), forget_(std::move(forget)) {
+}
+
+RecordLog::~RecordLog() {
+    close_file();
+}
+
+void RecordLog::close_file() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    if (loaded_ > 0 && forget_) {
+        forget_();
+    }
+    loaded_ = 0;
+    records_ = 0;
+}
+
+bool RecordLog::open_file(bool create) {
+    last_error_.clear();
+    if (fd_ >= 0 && same_file(fd_, path_)) {
+        return true;
+    }
+    close_file();
+    fd_ = ::open(path_.c_str(), O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+    if (fd_ < 0 && errno != ENOENT) {
+        last_error_ = std::string("open: ") + std::strerror(errno);
+    }
+    return fd_ >= 0;
+}
+
+bool RecordLog::lock() {
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        if (!open_file(true)) {
+            return false;
+        }
+        while (::flock(fd_, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                last_error_ = std::string("flock: ") + std::strerror(errno);
+                return false;
+            }
+        }
+        if (same_file(fd_, path_)) {
+            return true;
+        }
+        close_file();  // Replaced while we waited
+    }
+    last_error_ = path_.filename().string() + " keeps being replaced";
+    return false;
+}
+
+void RecordLog::unlock() {
+    ::flock(fd_, LOCK_UN);
+}
+
+uint64_t RecordLog::catch_up(const Visitor& visit) {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0 || static_cast<uint64_t>(st.st_size) <= loaded_) {
+        return loaded_;
+    }
+
+    std::string data(static_cast<std::size_t>(st.st_size) - loaded_, '\0');
+    if (!pread_all(fd_, data.data(), data.size(), loaded_)) {
+        return loaded_;
+    }
+    std::string_view rest = data;
+    uint64_t offset = loaded_;
+    if (offset == 0) {
+        if (rest.substr(0, format_line_.size()) != format_line_) {
+            return 0;  // Another format, or a first line still being written
+        }
+        rest.remove_prefix(format_line_.size());
+        offset = format_line_.size();
+    }
+
+    // A record still being written, or torn, ends the scan.
+    while (rest.size() >= 8) {
+        const uint64_t key_size = get_le32(rest.data());
+        const uint64_t payload_size = get_le32(rest.data() + 4);
+        if (rest.size() - 8 < key_size + payload_size) {
+            break;
+        }
+        if (visit) {
+            visit(rest.substr(8, key_size), offset + 8 + key_size,
+                  rest.substr(8 + key_size, payload_size));
+        }
+        ++records_;
+        rest.remove_prefix(8 + key_size + payload_size);
+        offset += 8 + key_size + payload_size;
+    }
+    loaded_ = offset;
+    return loaded_;
+}
+
+bool RecordLog::read(const Visitor& visit) {
+    if (!open_file(false)) {
+        return false;
+    }
+    catch_up(visit);
+    return true;
+}
+
+uint64_t RecordLog::append(std::string_view key, std::string_view payload,
+                           const Visitor& visit) {
+    if (!lock()) {
+        return 0;
+    }
+
+    struct stat st;
+    const uint64_t end = catch_up(visit);
+    if (::fstat(fd_, &st) == 0 && static_cast<uint64_t>(st.st_size) > end) {
+        // Whoever left this held the lock and is gone.
+        if (::ftruncate(fd_, static_cast<off_t>(end)) != 0) {
+            last_error_ = std::string("ftruncate: ") + std::strerror(errno);
+            unlock();
+            return 0;
+        }
+    }
+
+    std::string record;
+    if (end == 0) {
+        record.append(format_line_);
+    }
+    append_record(record, key, payload);
+    uint64_t payload_offset = 0;
+    if (write_all(fd_, record)) {
+        loaded_ = end + record.size();
+        payload_offset = loaded_ - payload.size();
+        ++records_;
+    } else {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+    }
+    unlock();
+    return payload_offset;
+}
+
+bool RecordLog::sync() {
+    if (fd_ >= 0 && ::fdatasync(fd_) != 0) {
+        last_error_ = std::string("fdatasync: ") + std::strerror(errno);
+        return false;
+    }
+    return fd_ >= 0;
+}
+
+bool RecordLog::read_at(uint64_t offset, std::string& out, std::size_t size) {
+    out.resize(size);
+    return fd_ >= 0 && pread_all(fd_, out.data(), size, offset);
+}
+
+bool RecordLog::rewrite(const std::function<bool(std::string_view key)>& keep) {
+    if (!lock()) {
+        return last_error_.empty();
+    }
+
+    // The whole file, so that nothing read before counts twice.
+    struct Location {
+        uint64_t offset;
+        uint32_t size;
+    };
+    std::unordered_map<std::string, Location> latest;
+    const uint64_t before = records_;
+    records_ = 0;
+    const uint64_t resume = loaded_;
+    loaded_ = 0;
+    std::vector<std::string> order;
+    catch_up([&](std::string_view key, uint64_t offset, std::string_view payload) {
+        auto [it, added] = latest.try_emplace(std::string(key));
+        if (added) order.push_back(it->first);
+        it->second = Location{offset, static_cast<uint32_t>(payload.size())};
+    });
+    // Only what was new to this instance is left to the next read().
+    const uint64_t total = records_;
+    loaded_ = resume;
+    records_ = before;
+
+    std::vector<const std::string*> kept;
+    for (const auto& key : order) {
+        if (keep(key)) {
+            kept.push_back(&key);
+        }
+    }
+    if (total < 2 * kept.size() + min_stale_records) {
+        unlock();
+        return true;
+    }
+
+    std::string content(format_line_);
+    std::string payload;
+    for (const auto* key : kept) {
+        const auto& location = latest[*key];
+        payload.resize(location.size);
+        if (pread_all(fd_, payload.data(), payload.size(), location.offset)) {
+            append_record(content, *key, payload);
+        }
+    }
+
+    // Renamed into place under the old file's lock; writers waiting for it
+    // notice the replacement and move over.
+    auto tmp = path_;
+    tmp += ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool ok = fd >= 0 && write_all(fd, content) && ::fsync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    ok = ok && ::rename(tmp.c_str(), path_.c_str()) == 0;
+    if (!ok) {
+        last_error_ = std::string("rewrite: ") + std::strerror(errno);
+        ::unlink(tmp.c_str());
+    }
+    close_file();
+    return ok;
+}
+
+}  // namespace email
@@ -0,0 +1,455 @@
+#include "storage/search_index.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <iterator>
+#include <set>
+
+namespace email {
+
+namespace {
+
+// Longer words are cut to this, in the index and in queries alike.
+constexpr std::size_t max_word = 64;
+
+bool is_word_byte(unsigned char c) {
+    return std::isalnum(c) || c >= 0x80;
+}
+
+std::string lower(std::string_view text) {
+    std::string result(text);
+    std::transform(result.begin(), result.end(), result.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return result;
+}
+
+int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+// Quoted-printable; in an encoded-word `_` stands for a space.
+std::string decode_quoted_printable(std::string_view text, bool encoded_word) {
+    std::string out;
+    out.reserve(text.size());
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        char c = text[i];
+        if (c == '=' && i + 2 < text.size() && hex_value(text[i + 1]) >= 0 &&
+            hex_value(text[i + 2]) >= 0) {
+            out += static_cast<char>(hex_value(text[i + 1]) * 16 + hex_value(text[i + 2]));
+            i += 2;
+        } else if (c == '=' && !encoded_word) {
+            // A soft line break
+            while (i + 1 < text.size() && (text[i + 1] == '\r' || text[i + 1] == '\n')) ++i;
+        } else if (c == '_' && encoded_word) {
+            out += ' ';
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string decode_base64(std::string_view text) {
+    std::string out;
+    out.reserve(text.size() / 4 * 3);
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : text) {
+        int value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '+') value = 62;
+        else if (c == '/') value = 63;
+        else continue;  // Line breaks and padding
+        buffer = (buffer << 6) | static_cast<uint32_t>(value);
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out += static_cast<char>((buffer >> bits) & 0xFF);
+        }
+    }
+    return out;
+}
+
+// RFC 2047 encoded-words into their bytes, whatever the charset.
+std::string decode_encoded_words(std::string_view value) {
+    std::string out;
+    std::size_t pos = 0;
+    bool after_word = false;
+    while (pos < value.size()) {
+        auto start = value.find("=?", pos);
+        auto charset_end = start == std::string_view::npos ? start : value.find('?', start + 2);
+        auto text_start = charset_end == std::string_view::npos ? charset_end : charset_end + 3;
+        auto end = text_start >= value.size() ? std::string_view::npos
+                                              : value.find("?=", text_start);
+        if (end == std::string_view::npos || value[charset_end + 2] != '?') {
+            out.append(value.substr(pos));
+            break;
+        }
+        // Whitespace between two encoded-words is not part of the text.
+        auto between = value.substr(pos, start - pos);
+        if (!after_word || between.find_first_not_of(" \t") != std::string_view::npos) {
+            out.append(between);
+        }
+        auto text = value.substr(text_start, end - text_start);
+        char encoding = static_cast<char>(std::toupper(static_cast<unsigned char>(value[charset_end + 1])));
+        out += encoding == 'B' ? decode_base64(text) : decode_quoted_printable(text, true);
+        pos = end + 2;
+        after_word = true;
+    }
+    return out;
+}
+
+// What a reader of an HTML part sees: the text between the tags.
+std::string strip_tags(std::string_view html) {
+    std::string out;
+    out.reserve(html.size());
+    bool in_tag = false;
+    for (char c : html) {
+        if (c == '<') {
+            in_tag = true;
+            out += ' ';
+        } else if (c == '>') {
+            in_tag = false;
+        } else if (!in_tag) {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// "Mon, 15 Oct 2026 10:00:00 +0000" as days since the epoch, ignoring the
+// time of day and zone as SENTON and friends do.
+int32_t parse_sent_day(std::string_view date) {
+    static constexpr std::string_view months[] = {"jan", "feb", "mar", "apr", "may", "jun",
+                                                  "jul", "aug", "sep", "oct", "nov", "dec"};
+    auto comma = date.find(',');
+    if (comma != std::string_view::npos) {
+        date.remove_prefix(comma + 1);
+    }
+    unsigned day = 0;
+    int year = 0;
+    unsigned month = 0;
+    std::size_t field = 0;
+    std::size_t pos = 0;
+    while (field < 3 && pos < date.size()) {
+        while (pos < date.size() && std::isspace(static_cast<unsigned char>(date[pos]))) ++pos;
+        std::size_t end = pos;
+        while (end < date.size() && !std::isspace(static_cast<unsigned char>(date[end]))) ++end;
+        auto word = date.substr(pos, end - pos);
+        if (field == 0 || field == 2) {
+            int value = 0;
+            for (char c : word) {
+                if (!std::isdigit(static_cast<unsigned char>(c))) return SearchDocument::no_date;
+                value = value * 10 + (c - '0');
+            }
+            if (field == 0) day = static_cast<unsigned>(value);
+            else year = word.size() == 2 ? value + (value < 50 ? 2000 : 1900) : value;
+        } else {
+            auto name = lower(word.substr(0, 3));
+            auto it = std::find(std::begin(months), std::end(months), name);
+            if (it == std::end(months)) return SearchDocument::no_date;
+            month = static_cast<unsigned>(it - std::begin(months)) + 1;
+        }
+        ++field;
+        pos = end;
+    }
+    std::chrono::year_month_day ymd{std::chrono::year(year), std::chrono::month(month),
+                                    std::chrono::day(day)};
+    if (field < 3 || !ymd.ok()) {
+        return SearchDocument::no_date;
+    }
+    return static_cast<int32_t>(std::chrono::sys_days(ymd).time_since_epoch().count());
+}
+
+void add_words(std::set<std::string>& terms, std::string_view field, std::string_view text) {
+    for (const auto& word : search_words(text)) {
+        std::string term(field);
+        term += ':';
+        term += word;
+        terms.insert(std::move(term));
+    }
+}
+
+void add_header(std::set<std::string>& terms, SearchDocument* document, std::string_view header) {
+    for (const auto& field : parse_header_fields(header)) {
+        const auto name = lower(field.name);
+        const auto value = decode_encoded_words(field.value);
+        if (!document) {
+            // An encapsulated message's header is text of the body.
+            add_words(terms, "", value);
+            continue;
+        }
+        terms.insert(name + ":");
+        add_words(terms, name, value);
+        add_words(terms, "*", value);
+
+        std::string* column = name == "from"      ? &document->from
+                              : name == "to"      ? &document->to
+                              : name == "cc"      ? &document->cc
+                              : name == "bcc"     ? &document->bcc
+                              : name == "subject" ? &document->subject
+                                                  : nullptr;
+        if (column && column->empty()) {
+            *column = value;
+        } else if (name == "date" && document->sent_day == SearchDocument::no_date) {
+            document->sent_day = parse_sent_day(value);
+        }
+    }
+}
+
+void add_part(std::set<std::string>& terms, std::string_view message, const MimePart& part) {
+    if (part.is_multipart()) {
+        for (const auto& child : part.parts) {
+            add_part(terms, message, child);
+        }
+    } else if (part.is_message() && !part.parts.empty()) {
+        const auto& inner = part.parts.front();
+        add_header(terms, nullptr, message.substr(inner.offset, inner.body_offset - inner.offset));
+        add_part(terms, message, inner);
+    } else if (part.type == "text") {
+        auto content = message.substr(part.body_offset, part.size());
+        std::string decoded = part.encoding == "base64"             ? decode_base64(content)
+                              : part.encoding == "quoted-printable" ? decode_quoted_printable(content, false)
+                                                                    : std::string(content);
+        if (part.subtype == "html") {
+            decoded = strip_tags(decoded);
+        }
+        add_words(terms, "", decoded);
+    }
+}
+
+void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool get_varint(std::string_view& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && !in.empty(); shift += 7) {
+        auto byte = static_cast<unsigned char>(in.front());
+        in.remove_prefix(1);
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void put_string(std::string& out, std::string_view value) {
+    put_varint(out, value.size());
+    out.append(value);
+}
+
+bool get_string(std::string_view& in, std::string& value) {
+    uint64_t size = 0;
+    if (!get_varint(in, size) || size > in.size()) {
+        return false;
+    }
+    value.assign(in.substr(0, size));
+    in.remove_prefix(size);
+    return true;
+}
+
+}  // namespace
+
+std::vector<std::string> search_words(std::string_view text) {
+    std::vector<std::string> words;
+    std::size_t pos = 0;
+    while (pos < text.size()) {
+        while (pos < text.size() && !is_word_byte(static_cast<unsigned char>(text[pos]))) ++pos;
+        std::size_t end = pos;
+        while (end < text.size() && is_word_byte(static_cast<unsigned char>(text[end]))) ++end;
+        if (end > pos) {
+            words.push_back(lower(text.substr(pos, std::min(end - pos, max_word))));
+        }
+        pos = end;
+    }
+    return words;
+}
+
+SearchDocument SearchDocument::extract(std::string_view message,
+                                       const MessageStructure& structure) {
+    SearchDocument document;
+    std::set<std::string> terms;
+    add_header(terms, &document, message.substr(0, structure.body.body_offset));
+    add_part(terms, message, structure.body);
+    document.terms.assign(std::make_move_iterator(terms.begin()),
+                          std::make_move_iterator(terms.end()));
+    return document;
+}
+
+std::string SearchDocument::serialize() const {
+    std::string out;
+    put_varint(out, static_cast<uint32_t>(sent_day));
+    for (const auto* column : {&from, &to, &cc, &bcc, &subject}) {
+        put_string(out, *column);
+    }
+    put_varint(out, terms.size());
+    for (const auto& term : terms) {
+        put_string(out, term);
+    }
+    return out;
+}
+
+std::optional<SearchDocument> SearchDocument::deserialize(std::string_view data) {
+    SearchDocument document;
+    uint64_t value = 0;
+    if (!get_varint(data, value)) {
+        return std::nullopt;
+    }
+    document.sent_day = static_cast<int32_t>(static_cast<uint32_t>(value));
+    for (auto* column : {&document.from, &document.to, &document.cc, &document.bcc,
+                         &document.subject}) {
+        if (!get_string(data, *column)) {
+            return std::nullopt;
+        }
+    }
+    if (!get_varint(data, value) || value > data.size()) {
+        return std::nullopt;
+    }
+    document.terms.resize(value);
+    for (auto& term : document.terms) {
+        if (!get_string(data, term)) {
+            return std::nullopt;
+        }
+    }
+    if (!data.empty()) {
+        return std::nullopt;
+    }
+    return document;
+}
+
+void SearchIndex::PostingList::push_back(DocId doc) {
+    put_varint(deltas, empty ? doc : doc - last);
+    last = doc;
+    empty = false;
+}
+
+void SearchIndex::PostingList::decode(std::vector<DocId>& out) const {
+    std::string_view in = deltas;
+    DocId doc = 0;
+    uint64_t gap = 0;
+    while (get_varint(in, gap)) {
+        doc += static_cast<DocId>(gap);
+        out.push_back(doc);
+    }
+}
+
+SearchIndex::SearchIndex(const std::filesystem::path& mailbox_path)
+    : log_(mailbox_path / file_name, "email.search 1\n", [this] { forget(); }) {
+}
+
+void SearchIndex::forget() {
+    postings_.clear();
+    documents_.clear();
+    ids_.clear();
+}
+
+void SearchIndex::take(std::string_view unique_id, std::string_view payload) {
+    auto document = SearchDocument::deserialize(payload);
+    if (!document) {
+        return;
+    }
+    const auto doc = static_cast<DocId>(documents_.size());
+    for (auto& term : document->terms) {
+        auto it = postings_.find(term);
+        if (it == postings_.end()) {
+            it = postings_.emplace(std::move(term), PostingList{}).first;
+        }
+        it->second.push_back(doc);
+    }
+    document->terms.clear();
+    document->terms.shrink_to_fit();
+    documents_.push_back(std::move(*document));
+    ids_[std::string(unique_id)] = doc;
+}
+
+void SearchIndex::refresh() {
+    log_.read([this](std::string_view unique_id, uint64_t, std::string_view payload) {
+        take(unique_id, payload);
+    });
+}
+
+std::optional<SearchIndex::DocId> SearchIndex::find(const std::string& unique_id) const {
+    auto it = ids_.find(unique_id);
+    if (it == ids_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+bool SearchIndex::add(const std::string& unique_id, const SearchDocument& document) {
+    const auto payload = document.serialize();
+    auto visit = [this](std::string_view id, uint64_t, std::string_view data) {
+        take(id, data);
+    };
+    if (log_.append(unique_id, payload, visit) == 0) {
+        return false;
+    }
+    take(unique_id, payload);
+    return true;
+}
+
+bool SearchIndex::retain(const std::function<bool(const std::string& unique_id)>& keep) {
+    return log_.rewrite([&keep](std::string_view unique_id) {
+        return keep(std::string(unique_id));
+    });
+}
+
+std::vector<SearchIndex::DocId> SearchIndex::postings(std::string_view term) const {
+    std::vector<DocId> docs;
+    auto it = postings_.find(term);
+    if (it != postings_.end()) {
+        it->second.decode(docs);
+    }
+    return docs;
+}
+
+std::optional<std::vector<SearchIndex::DocId>> SearchIndex::lookup(
+    std::initializer_list<std::string_view> fields, std::string_view text) const {
+    const auto words = search_words(text);
+    if (words.empty()) {
+        return std::nullopt;
+    }
+
+    std::optional<std::vector<DocId>> result;
+    std::vector<DocId> matches;
+    std::string prefix;
+    for (const auto& word : words) {
+        matches.clear();
+        for (auto field : fields) {
+            prefix.assign(field).append(":").append(word);
+            for (auto it = postings_.lower_bound(prefix);
+                 it != postings_.end() && it->first.starts_with(prefix); ++it) {
+                it->second.decode(matches);
+            }
+        }
+        std::sort(matches.begin(), matches.end());
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+
+        if (!result) {
+            result = matches;
+        } else {
+            std::vector<DocId> both;
+            std::set_intersection(result->begin(), result->end(), matches.begin(), matches.end(),
+                                  std::back_inserter(both));
+            result = std::move(both);
+        }
+        if (result->empty()) {
+            break;
+        }
+    }
+    return result;
+}
+
+}  // namespace email
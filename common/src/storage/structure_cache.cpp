@@ -0,0 +1,58 @@
+#include "storage/structure_cache.hpp"
+
+namespace email {
+
+StructureCache::StructureCache(const std::filesystem::path& mailbox_path)
+    : log_(mailbox_path / file_name, "email.structure 1\n", [this] { entries_.clear(); }) {
+}
+
+void StructureCache::remember(std::string_view unique_id, uint64_t offset,
+                              std::string_view payload) {
+    entries_[std::string(unique_id)] = Location{offset, static_cast<uint32_t>(payload.size())};
+}
+
+std::optional<MessageStructure> StructureCache::read(const Location& location) {
+    std::string payload;
+    if (!log_.read_at(location.offset, payload, location.size)) {
+        return std::nullopt;
+    }
+    return MessageStructure::deserialize(payload);
+}
+
+std::optional<MessageStructure> StructureCache::find(const std::string& unique_id) {
+    auto it = entries_.find(unique_id);
+    if (it == entries_.end()) {
+        auto visit = [this](std::string_view id, uint64_t offset, std::string_view payload) {
+            remember(id, offset, payload);
+        };
+        if (!log_.read(visit)) {
+            return std::nullopt;
+        }
+        it = entries_.find(unique_id);
+        if (it == entries_.end()) {
+            return std::nullopt;
+        }
+    }
+    return read(it->second);
+}
+
+bool StructureCache::store(const std::string& unique_id, const MessageStructure& structure) {
+    const auto payload = structure.serialize();
+    uint64_t offset = log_.append(unique_id, payload,
+                                  [this](std::string_view id, uint64_t at, std::string_view data) {
+                                      remember(id, at, data);
+                                  });
+    if (offset == 0) {
+        return false;
+    }
+    remember(unique_id, offset, payload);
+    return true;
+}
+
+bool StructureCache::retain(const std::function<bool(const std::string& unique_id)>& keep) {
+    return log_.rewrite([&keep](std::string_view unique_id) {
+        return keep(std::string(unique_id));
+    });
+}
+
+}  // namespace email
@@ -0,0 +1,214 @@
+#include "storage/uid_list.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace email {
+
+namespace {
+
+template<typename T>
+bool parse_number(std::string_view text, T& value) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return true;
+}
+
+}  // namespace
+
+UidList::UidList(std::filesystem::path path) : path_(std::move(path)) {
+}
+
+void UidList::reset() {
+    uids_.clear();
+    uid_validity_ = 0;
+    next_uid_ = 1;
+    lines_ = 0;
+    inode_ = 0;
+    offset_ = 0;
+    torn_tail_ = false;
+}
+
+void UidList::parse_line(std::string_view line) {
+    ++lines_;
+    if (line.empty()) {
+        return;
+    }
+
+    if (line[0] == 'V') {
+        auto space = line.find(" N");
+        uint32_t validity = 0;
+        uint32_t next = 0;
+        if (space != std::string_view::npos &&
+            parse_number(line.substr(1, space - 1), validity) &&
+            parse_number(line.substr(space + 2), next)) {
+            uid_validity_ = validity;
+            next_uid_ = std::max(next_uid_, next);
+        }
+        return;
+    }
+
+    if (line[0] == '-') {
+        uids_.erase(std::string(line.substr(1)));
+        return;
+    }
+
+    auto space = line.find(' ');
+    uint32_t uid = 0;
+    if (space == std::string_view::npos || !parse_number(line.substr(0, space), uid) || uid == 0) {
+        return;  // Malformed; its UID, if any, is simply never handed out again
+    }
+    uids_[std::string(line.substr(space + 1))] = uid;
+    next_uid_ = std::max(next_uid_, uid + 1);
+}
+
+bool UidList::load() {
+    last_error_.clear();
+
+    int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            last_error_ = std::string("open: ") + std::strerror(errno);
+        }
+        reset();
+        return false;
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        last_error_ = std::string("fstat: ") + std::strerror(errno);
+        ::close(fd);
+        return false;
+    }
+    if (static_cast<uint64_t>(st.st_ino) != inode_ || static_cast<uint64_t>(st.st_size) < offset_) {
+        // Replaced by a compaction: start over.
+        reset();
+        inode_ = static_cast<uint64_t>(st.st_ino);
+    }
+
+    std::string data(static_cast<std::size_t>(st.st_size) - offset_, '\0');
+    std::size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::pread(fd, data.data() + done, data.size() - done,
+                            static_cast<off_t>(offset_ + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += static_cast<std::size_t>(n);
+    }
+    ::close(fd);
+    data.resize(done);
+
+    std::string_view rest(data);
+    while (true) {
+        auto newline = rest.find('\n');
+        if (newline == std::string_view::npos) break;
+        parse_line(rest.substr(0, newline));
+        offset_ += newline + 1;
+        rest.remove_prefix(newline + 1);
+    }
+    torn_tail_ = !rest.empty();
+    return true;
+}
+
+bool UidList::create(uint32_t uid_validity, uint32_t next_uid,
+                     const std::vector<std::pair<uint32_t, std::string>>& entries) {
+    std::string content = "V" + std::to_string(uid_validity) + " N" + std::to_string(next_uid) + "\n";
+    for (const auto& [uid, unique_id] : entries) {
+        content.append(std::to_string(uid)).append(" ").append(unique_id).append("\n");
+    }
+
+    auto tmp_path = path_;
+    tmp_path += ".tmp." + std::to_string(::getpid());
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        last_error_ = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    // Unlike the index this cannot be rebuilt from the messages, so it is
+    // on disk before it replaces the old list.
+    bool written = write_all(fd, content) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!written || ::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+
+    pending_.clear();
+    reset();
+    return load();
+}
+
+std::optional<uint32_t> UidList::find(std::string_view unique_id) const {
+    auto it = uids_.find(std::string(unique_id));
+    if (it == uids_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+uint32_t UidList::assign(std::string_view unique_id) {
+    auto [it, inserted] = uids_.try_emplace(std::string(unique_id), next_uid_);
+    if (inserted) {
+        ++next_uid_;
+        pending_.append(std::to_string(it->second)).append(" ").append(unique_id).append("\n");
+    }
+    return it->second;
+}
+
+void UidList::forget(std::string_view unique_id) {
+    if (uids_.erase(std::string(unique_id)) > 0) {
+        pending_.append("-").append(unique_id).append("\n");
+    }
+}
+
+bool UidList::flush() {
+    if (pending_.empty()) {
+        return true;
+    }
+
+    int fd = ::open(path_.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        last_error_ = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    if (torn_tail_) {
+        // Terminate the half-written line so ours parse on their own.
+        pending_.insert(0, "\n");
+    }
+    // A UID must never be handed out twice, so the assignment is durable
+    // before the caller reports it.
+    bool written = write_all(fd, pending_) && ::fdatasync(fd) == 0;
+    struct stat st;
+    if (written && ::fstat(fd, &st) == 0) {
+        // Nobody else appends while the caller holds the index lock.
+        offset_ = static_cast<uint64_t>(st.st_size);
+        lines_ += static_cast<std::size_t>(std::count(pending_.begin(), pending_.end(), '\n'));
+        torn_tail_ = false;
+    }
+    ::close(fd);
+    if (!written) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        return false;
+    }
+    pending_.clear();
+    return true;
+}
+
+}  // namespace email
@@ -0,0 +1,224 @@
+#include "storage/usage_file.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <thread>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace email {
+
+namespace {
+
+// Changes worth folding into the first line.
+constexpr off_t compact_size = 4096;
+
+template<typename T>
+bool parse_number(std::string_view text, T& value) {
+    auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == std::errc() && result.ptr == text.data() + text.size();
+}
+
+// Splits "<a> <b>" and parses both halves.
+template<typename T>
+bool parse_pair(std::string_view line, T& first, T& second) {
+    auto space = line.find(' ');
+    return space != std::string_view::npos &&
+           parse_number(line.substr(0, space), first) &&
+           parse_number(line.substr(space + 1), second);
+}
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return true;
+}
+
+bool read_all(int fd, std::string& data) {
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        return false;
+    }
+    data.assign(static_cast<std::size_t>(st.st_size), '\0');
+    std::size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::pread(fd, data.data() + done, data.size() - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) break;
+        done += static_cast<std::size_t>(n);
+    }
+    data.resize(done);
+    return true;
+}
+
+}  // namespace
+
+UsageFile::UsageFile(std::filesystem::path path) : path_(std::move(path)) {
+}
+
+bool UsageFile::parse(std::string_view data, StorageUsage& usage) {
+    auto newline = data.find('\n');
+    int64_t messages = 0;
+    int64_t bytes = 0;
+    auto first = data.substr(0, newline);
+    auto space = first.rfind(' ');
+    if (newline == std::string_view::npos || first.empty() || first[0] != 'T' ||
+        space == std::string_view::npos ||
+        !parse_pair(first.substr(1, space - 1), messages, bytes) ||
+        !parse_number(first.substr(space + 1), usage.reconciled_at)) {
+        last_error_ = "damaged usage file";
+        return false;
+    }
+    data.remove_prefix(newline + 1);
+
+    // A torn last line is a change that was never reported as made.
+    while ((newline = data.find('\n')) != std::string_view::npos) {
+        int64_t delta_messages = 0;
+        int64_t delta_bytes = 0;
+        if (parse_pair(data.substr(0, newline), delta_messages, delta_bytes)) {
+            messages += delta_messages;
+            bytes += delta_bytes;
+        }
+        data.remove_prefix(newline + 1);
+    }
+    usage.messages = static_cast<uint64_t>(std::max<int64_t>(messages, 0));
+    usage.bytes = static_cast<uint64_t>(std::max<int64_t>(bytes, 0));
+    return true;
+}
+
+bool UsageFile::read(StorageUsage& usage) {
+    last_error_.clear();
+
+    // Replacements are renamed into place, so whatever file we open is
+    // complete apart from perhaps a line being appended.
+    int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            last_error_ = std::string("open: ") + std::strerror(errno);
+        }
+        return false;
+    }
+    std::string data;
+    bool ok = read_all(fd, data);
+    ::close(fd);
+    if (!ok) {
+        last_error_ = std::string("read: ") + std::strerror(errno);
+        return false;
+    }
+    return parse(data, usage);
+}
+
+int UsageFile::lock() {
+    last_error_.clear();
+
+    for (int attempt = 0; attempt < 8; ++attempt) {
+        int fd = ::open(path_.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+        if (fd < 0) {
+            if (errno != ENOENT) {
+                last_error_ = std::string("open: ") + std::strerror(errno);
+            }
+            return -1;
+        }
+        while (::flock(fd, LOCK_EX) != 0) {
+            if (errno != EINTR) {
+                last_error_ = std::string("flock: ") + std::strerror(errno);
+                ::close(fd);
+                return -1;
+            }
+        }
+
+        struct stat by_path, by_fd;
+        if (::stat(path_.c_str(), &by_path) == 0 && ::fstat(fd, &by_fd) == 0 &&
+            by_path.st_ino == by_fd.st_ino && by_path.st_dev == by_fd.st_dev) {
+            return fd;
+        }
+        ::close(fd);
+    }
+
+    last_error_ = "usage file keeps being replaced";
+    return -1;
+}
+
+bool UsageFile::add(int64_t messages, int64_t bytes) {
+    if (messages == 0 && bytes == 0) {
+        return true;
+    }
+    int fd = lock();
+    if (fd < 0) {
+        return last_error_.empty();
+    }
+
+    std::string line = std::to_string(messages) + " " + std::to_string(bytes) + "\n";
+    struct stat st;
+    char last = '\n';
+    if (::fstat(fd, &st) == 0 && st.st_size > 0 &&
+        ::pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n') {
+        // Terminate a torn line so ours parses on its own.
+        line.insert(0, "\n");
+    }
+
+    bool ok = write_all(fd, line);
+    if (!ok) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+    } else if (::fstat(fd, &st) == 0 && st.st_size > compact_size) {
+        std::string data;
+        StorageUsage usage;
+        ok = read_all(fd, data) && parse(data, usage) && write_replacement(usage);
+    }
+    ::close(fd);
+    return ok;
+}
+
+bool UsageFile::replace(const StorageUsage& usage) {
+    // Hold the old file's lock, if there is one, so appenders waiting on it
+    // move over to the replacement.
+    int fd = lock();
+    if (fd < 0 && !last_error_.empty()) {
+        return false;
+    }
+    bool ok = write_replacement(usage);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return ok;
+}
+
+bool UsageFile::write_replacement(const StorageUsage& usage) {
+    std::string content = "T" + std::to_string(usage.messages) + " " +
+                          std::to_string(usage.bytes) + " " +
+                          std::to_string(usage.reconciled_at) + "\n";
+
+    auto tmp_path = path_;
+    // Servers reconcile from a thread of their own, so the pid alone does
+    // not keep temporary files apart.
+    tmp_path += ".tmp." + std::to_string(::getpid()) + "." +
+                std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        last_error_ = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    // Not fsync()ed: a lost file is simply reconciled again.
+    bool written = write_all(fd, content);
+    ::close(fd);
+    if (!written || ::rename(tmp_path.c_str(), path_.c_str()) != 0) {
+        last_error_ = std::string("write: ") + std::strerror(errno);
+        ::unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+}  // namespace email
@@ -0,0 +1,162 @@
+#include "pop3_server.hpp"
+#include "imap_server.hpp"
+#include "smtp_server.hpp"
+#include "config.hpp"
+#include "logger.hpp"
+#include "auth/authenticator.hpp"
+#include "net/metrics_exporter.hpp"
+#include "net/reactor.hpp"
+#include <iostream>
+#include <csignal>
+#include <atomic>
+
+namespace {
+    std::atomic<bool> g_running{true};
+}
+
+void signal_handler(int signal) {
+    std::cout << "\nReceived signal " << signal << ", shutting down...\n";
+    g_running = false;
+}
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [options]\n"
+              << "Runs the SMTP, POP3 and IMAP servers enabled under [daemon] in one process.\n"
+              << "Options:\n"
+              << "  -c, --config <file>    Configuration file path\n"
+              << "  -h, --help             Show this help message\n"
+              << "  -v, --version          Show version information\n";
+}
+
+int main(int argc, char* argv[]) {
+    std::string config_file = "/etc/email_server/server.conf";
+
+    // Parse command line arguments
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg == "-v" || arg == "--version") {
+            std::cout << "Email Server v1.0.0\n";
+            return 0;
+        } else if ((arg == "-c" || arg == "--config") && i + 1 < argc) {
+            config_file = argv[++i];
+        }
+    }
+
+    // Initialize logger
+    email::Logger::instance().init(
+        email::LogLevel::Info,
+        true,
+        "/var/log/email_server/email_server.log"
+    );
+
+    LOG_INFO("Email Server starting...");
+
+    // Load configuration
+    auto& config = email::Config::instance();
+    if (!config.load(config_file)) {
+        LOG_WARNING_FMT("Could not load config file: {}, using defaults", config_file);
+    }
+    const auto& daemon = config.daemon();
+    if (!daemon.smtp && !daemon.pop3 && !daemon.imap) {
+        LOG_FATAL("No protocol enabled under [daemon]");
+        return 1;
+    }
+
+    // One authenticator, so every protocol shares its credential and
+    // domain caches and its database connections.
+    auto auth = std::make_shared<email::Authenticator>(
+        config.database().path, config.database().connection_pool_size);
+    if (!auth->initialize()) {
+        LOG_FATAL("Failed to initialize authenticator");
+        return 1;
+    }
+    auth->set_credential_cache_ttl(std::chrono::seconds(config.database().credential_cache_ttl));
+    email::Maildir::set_compression_level(config.storage().compression_level);
+    email::MailboxSnapshotCache::instance().set_capacity(config.storage().snapshot_cache_size);
+
+    // Every listener accepts and serves on these threads. Mailbox change
+    // events and group commits are per process, so here a local delivery
+    // wakes IMAP IDLE sessions directly rather than through the watcher.
+    auto reactor = std::make_shared<email::Reactor>(daemon.io_threads, daemon.pin_threads);
+
+    std::unique_ptr<email::smtp::SMTPServer> smtp;
+    std::unique_ptr<email::pop3::POP3Server> pop3;
+    std::unique_ptr<email::imap::IMAPServer> imap;
+    if (daemon.smtp) {
+        smtp = std::make_unique<email::smtp::SMTPServer>(config.smtp(), auth,
+                                                         config.storage().maildir_root);
+        smtp->set_usage_reconcile_interval(
+            std::chrono::seconds(config.storage().usage_reconcile_interval));
+        smtp->set_recompress_batch(config.storage().recompress_batch);
+    }
+    if (daemon.pop3) {
+        pop3 = std::make_unique<email::pop3::POP3Server>(config.pop3(), auth,
+                                                         config.storage().maildir_root);
+    }
+    if (daemon.imap) {
+        imap = std::make_unique<email::imap::IMAPServer>(config.imap(), auth,
+                                                         config.storage().maildir_root);
+    }
+
+    const bool tls = !config.tls().certificate_file.empty() &&
+                     !config.tls().private_key_file.empty();
+    auto prepare = [&](auto& server, const char* name) {
+        if (!server) return;
+        server->set_reactor(reactor);
+        // Configure TLS if available
+        if (tls && !server->configure_tls(config.tls())) {
+            LOG_WARNING_FMT("{} TLS configuration failed, continuing without TLS", name);
+        }
+    };
+    prepare(smtp, "SMTP");
+    prepare(pop3, "POP3");
+    prepare(imap, "IMAP");
+
+    // Serve metrics if configured
+    std::unique_ptr<email::MetricsExporter> metrics;
+    if (daemon.metrics_port != 0) {
+        metrics = std::make_unique<email::MetricsExporter>(daemon.metrics_address,
+                                                           daemon.metrics_port);
+        if (!metrics->start()) {
+            LOG_WARNING_FMT("{}, continuing without metrics", metrics->last_error());
+        }
+    }
+
+    // Set up signal handlers
+    std::signal(SIGINT, signal_handler);
+    std::signal(SIGTERM, signal_handler);
+
+    auto any_running = [&]() {
+        return (smtp && smtp->is_running()) || (pop3 && pop3->is_running()) ||
+               (imap && imap->is_running());
+    };
+
+    // Start servers
+    try {
+        reactor->start();
+        if (smtp) smtp->start();
+        if (pop3) pop3->start();
+        if (imap) imap->start();
+        LOG_INFO_FMT("Email server started on {} I/O threads", reactor->size());
+
+        // Wait for shutdown signal
+        while (g_running && any_running()) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+    } catch (const std::exception& e) {
+        LOG_FATAL_FMT("Server error: {}", e.what());
+        return 1;
+    }
+
+    // Servers first, while the reactor still runs their sessions' stops.
+    smtp.reset();
+    pop3.reset();
+    imap.reset();
+    reactor->stop();
+
+    LOG_INFO("Email server shutdown complete");
+    return 0;
+}
@@ -1,9 +1,15 @@
 #pragma once
 
-#include <string>
-#include <vector>
+#include "metrics.hpp"
+#include <array>
+#include <format>
 #include <functional>
+#include <iterator>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 namespace email::imap {
 
@@ -14,6 +20,7 @@ enum class CommandType {
     CAPABILITY,
     NOOP,
     LOGOUT,
+    ENABLE,
 
     // Not authenticated state
     STARTTLS,
@@ -32,6 +39,8 @@ enum class CommandType {
     LSUB,
     STATUS,
     APPEND,
+    IDLE,
+    COMPRESS,
 
     // Selected state
     CHECK,
@@ -46,75 +55,137 @@ enum class CommandType {
     UNKNOWN
 };
 
+// The lines answering one command, without CRLF. Handlers allocate them from
+// the command's allocator, so during a session they live in its CommandArena
+// until IMAPSession has copied them into the write queue.
+using Responses = std::pmr::vector<std::pmr::string>;
+
 struct Command {
-    std::string tag;
-    CommandType type;
-    std::string name;
-    std::string arguments;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
 
-    static Command parse(const std::string& line);
-    static CommandType string_to_type(const std::string& name);
+    explicit Command(allocator_type alloc = {}) : tag(alloc), name(alloc), arguments(alloc) {}
+
+    std::pmr::string tag;
+    CommandType type = CommandType::UNKNOWN;
+    std::pmr::string name;
+    std::pmr::string arguments;
+    // Wrapped by UID: sequence sets are UIDs, and so are SEARCH results.
+    bool uid = false;
+
+    allocator_type get_allocator() const { return tag.get_allocator(); }
+
+    // Single tagged replies, allocated like the command.
+    Responses ok(std::string_view msg) const;
+    Responses no(std::string_view msg) const;
+    Responses bad(std::string_view msg) const;
+
+    // The command and everything derived from it allocate from `alloc`.
+    static Command parse(std::string_view line, allocator_type alloc = {});
+    static CommandType string_to_type(std::string_view name);
     static std::string type_to_string(CommandType type);
 };
 
 class CommandHandler {
 public:
-    using Handler = std::function<std::vector<std::string>(IMAPSession&, const Command&)>;
+    using Handler = std::function<Responses(IMAPSession&, const Command&)>;
 
     static CommandHandler& instance();
 
     void register_handler(CommandType type, Handler handler);
-    std::vector<std::string> execute(IMAPSession& session, const Command& cmd);
+    Responses execute(IMAPSession& session, const Command& cmd);
 
     // Individual command handlers
-    static std::vector<std::string> handle_capability(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_noop(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_logout(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_starttls(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_login(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_select(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_examine(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_create(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_delete(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_rename(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_list(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_lsub(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_status(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_append(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_check(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_close(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_expunge(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_search(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_fetch(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_store(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_copy(IMAPSession& session, const Command& cmd);
-    static std::vector<std::string> handle_uid(IMAPSession& session, const Command& cmd);
+    static Responses handle_capability(IMAPSession& session, const Command& cmd);
+    static Responses handle_noop(IMAPSession& session, const Command& cmd);
+    static Responses handle_logout(IMAPSession& session, const Command& cmd);
+    static Responses handle_enable(IMAPSession& session, const Command& cmd);
+    static Responses handle_starttls(IMAPSession& session, const Command& cmd);
+    static Responses handle_login(IMAPSession& session, const Command& cmd);
+    static Responses handle_select(IMAPSession& session, const Command& cmd);
+    static Responses handle_examine(IMAPSession& session, const Command& cmd);
+    static Responses handle_create(IMAPSession& session, const Command& cmd);
+    static Responses handle_delete(IMAPSession& session, const Command& cmd);
+    static Responses handle_rename(IMAPSession& session, const Command& cmd);
+    static Responses handle_list(IMAPSession& session, const Command& cmd);
+    static Responses handle_lsub(IMAPSession& session, const Command& cmd);
+    static Responses handle_status(IMAPSession& session, const Command& cmd);
+    static Responses handle_append(IMAPSession& session, const Command& cmd);
+    static Responses handle_idle(IMAPSession& session, const Command& cmd);
+    static Responses handle_compress(IMAPSession& session, const Command& cmd);
+    static Responses handle_check(IMAPSession& session, const Command& cmd);
+    static Responses handle_close(IMAPSession& session, const Command& cmd);
+    static Responses handle_expunge(IMAPSession& session, const Command& cmd);
+    static Responses handle_search(IMAPSession& session, const Command& cmd);
+    static Responses handle_fetch(IMAPSession& session, const Command& cmd);
+    static Responses handle_store(IMAPSession& session, const Command& cmd);
+    static Responses handle_copy(IMAPSession& session, const Command& cmd);
+    static Responses handle_uid(IMAPSession& session, const Command& cmd);
 
 private:
     CommandHandler();
     std::unordered_map<CommandType, Handler> handlers_;
+    // Time spent in execute(), by command type.
+    std::array<Histogram*, static_cast<size_t>(CommandType::UNKNOWN) + 1> latency_{};
 };
 
-// Response helpers
+// Response helpers. The single-line forms return a string from `alloc`; the
+// forms taking `out` append the line to it, built in out's allocator.
 namespace response {
-    inline std::string ok(const std::string& tag, const std::string& msg = "Completed") {
-        return tag + " OK " + msg;
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    inline std::pmr::string tagged(std::string_view tag, std::string_view status,
+                                   std::string_view msg, allocator_type alloc = {}) {
+        std::pmr::string line(alloc);
+        line.reserve(tag.size() + status.size() + msg.size() + 2);
+        line.append(tag).append(" ").append(status).append(" ").append(msg);
+        return line;
+    }
+
+    inline std::pmr::string ok(std::string_view tag, std::string_view msg = "Completed",
+                               allocator_type alloc = {}) {
+        return tagged(tag, "OK", msg, alloc);
+    }
+
+    inline std::pmr::string no(std::string_view tag, std::string_view msg, allocator_type alloc = {}) {
+        return tagged(tag, "NO", msg, alloc);
+    }
+
+    inline std::pmr::string bad(std::string_view tag, std::string_view msg, allocator_type alloc = {}) {
+        return tagged(tag, "BAD", msg, alloc);
+    }
+
+    inline std::pmr::string untagged(std::string_view data, allocator_type alloc = {}) {
+        std::pmr::string line(alloc);
+        line.reserve(data.size() + 2);
+        line.append("* ").append(data);
+        return line;
+    }
+
+    inline std::pmr::string bye(std::string_view msg = "Logging out", allocator_type alloc = {}) {
+        std::pmr::string line(alloc);
+        line.reserve(msg.size() + 6);
+        line.append("* BYE ").append(msg);
+        return line;
     }
 
-    inline std::string no(const std::string& tag, const std::string& msg) {
-        return tag + " NO " + msg;
+    inline void ok(Responses& out, std::string_view tag, std::string_view msg = "Completed") {
+        out.push_back(ok(tag, msg, out.get_allocator()));
     }
 
-    inline std::string bad(const std::string& tag, const std::string& msg) {
-        return tag + " BAD " + msg;
+    inline void no(Responses& out, std::string_view tag, std::string_view msg) {
+        out.push_back(no(tag, msg, out.get_allocator()));
     }
 
-    inline std::string untagged(const std::string& data) {
-        return "* " + data;
+    inline void bad(Responses& out, std::string_view tag, std::string_view msg) {
+        out.push_back(bad(tag, msg, out.get_allocator()));
     }
 
-    inline std::string bye(const std::string& msg = "Logging out") {
-        return "* BYE " + msg;
+    // Appends "* " followed by the formatted data.
+    template<typename... Args>
+    void untagged(Responses& out, std::format_string<Args...> fmt, Args&&... args) {
+        auto& line = out.emplace_back();
+        line.append("* ");
+        std::format_to(std::back_inserter(line), fmt, std::forward<Args>(args)...);
     }
 }
 
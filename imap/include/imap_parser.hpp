@@ -2,12 +2,16 @@
 
 #include <chrono>
 #include <cstdint>
+#include <memory_resource>
 #include <optional>
 #include <set>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
+#include "storage/message_structure.hpp"
+
 namespace email::imap {
 
 // IMAP data types
@@ -22,11 +26,41 @@ struct SequenceSet {
     };
     std::vector<Range> ranges;
 
+    // Linear in the ranges; on a normalized set, covers() is logarithmic.
     bool contains(uint32_t num) const;
-    static SequenceSet parse(const std::string& str);
+    // The set with * standing for `largest`, each range ascending.
+    SequenceSet resolved(uint32_t largest) const;
+    // resolved(), with the ranges sorted and those that overlap or touch
+    // merged, so they are disjoint and ascending.
+    SequenceSet normalized(uint32_t largest) const;
+    // contains() for a normalized set.
+    bool covers(uint32_t num) const;
+    // Adds `first` through `last`, which must exceed every number already
+    // in the set.
+    void push_back(uint32_t first, uint32_t last);
+    void push_back(uint32_t num) { push_back(num, num); }
+    // Appends the set in IMAP syntax, "1:3,7"; a resolved set only.
+    void append_to(std::pmr::string& out) const;
+    static SequenceSet parse(std::string_view str);
 };
 
+// FetchItem and SearchCriteria keep their strings in the allocator they are
+// constructed with, normally the arena of the command they were parsed from.
 struct FetchItem {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    explicit FetchItem(allocator_type alloc = {}) : section(alloc) {}
+    FetchItem(const FetchItem& other, allocator_type alloc)
+        : type(other.type), section(other.section, alloc), has_section(other.has_section)
+        , partial(other.partial) {}
+    FetchItem(FetchItem&& other, allocator_type alloc)
+        : type(other.type), section(std::move(other.section), alloc)
+        , has_section(other.has_section), partial(other.partial) {}
+    FetchItem(const FetchItem&) = default;
+    FetchItem(FetchItem&&) = default;
+    FetchItem& operator=(const FetchItem&) = default;
+    FetchItem& operator=(FetchItem&&) = default;
+
     enum class Type {
         ALL,
         FAST,
@@ -41,15 +75,33 @@ struct FetchItem {
         BODY,
         BODY_PEEK,
         BODYSTRUCTURE,
-        UID
+        UID,
+        MODSEQ
     };
 
-    Type type;
-    std::string section;      // For BODY[section]
+    Type type = Type::ALL;
+    std::pmr::string section;  // For BODY[section], as sent
+    bool has_section = false;  // BODY[...]; a bare BODY asks for the structure
     std::optional<std::pair<size_t, size_t>> partial;  // <start.count>
 };
 
 struct SearchCriteria {
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    explicit SearchCriteria(allocator_type alloc = {})
+        : value(alloc), header_name(alloc), sub_criteria(alloc) {}
+    SearchCriteria(const SearchCriteria& other, allocator_type alloc)
+        : type(other.type), value(other.value, alloc), header_name(other.header_name, alloc)
+        , sub_criteria(other.sub_criteria, alloc) {}
+    SearchCriteria(SearchCriteria&& other, allocator_type alloc)
+        : type(other.type), value(std::move(other.value), alloc)
+        , header_name(std::move(other.header_name), alloc)
+        , sub_criteria(std::move(other.sub_criteria), alloc) {}
+    SearchCriteria(const SearchCriteria&) = default;
+    SearchCriteria(SearchCriteria&&) = default;
+    SearchCriteria& operator=(const SearchCriteria&) = default;
+    SearchCriteria& operator=(SearchCriteria&&) = default;
+
     enum class Type {
         ALL,
         ANSWERED,
@@ -85,13 +137,22 @@ struct SearchCriteria {
         TEXT,
         TO,
         UID,
-        UNKEYWORD
+        UNKEYWORD,
+        MODSEQ,   // value is the mod-sequence; the entry name is ignored
+        SEQUENCE  // A bare sequence set
     };
 
-    Type type;
-    std::string value;
-    std::string header_name;  // For HEADER searches
-    std::vector<SearchCriteria> sub_criteria;  // For NOT, OR
+    Type type = Type::ALL;
+    std::pmr::string value;
+    std::pmr::string header_name;  // For HEADER searches
+    // For NOT and OR; for ALL, a parenthesized list that must all match.
+    std::pmr::vector<SearchCriteria> sub_criteria;
+};
+
+// The parenthesized modifiers after the FETCH items (RFC 7162).
+struct FetchModifiers {
+    std::optional<uint64_t> changed_since;
+    bool vanished = false;
 };
 
 struct StoreAction {
@@ -108,27 +169,124 @@ struct StoreAction {
     std::set<std::string> flags;
 };
 
+// A literal announced at the end of a line: "{n}", which waits for a
+// continuation, or with LITERAL+ (RFC 7888) "{n+}", which does not. Its
+// bytes follow the line's CRLF, and the command goes on after them.
+struct LiteralPrefix {
+    uint64_t size = 0;
+    bool synchronizing = true;
+};
+
+// One token of IMAP arguments, viewing the buffer it was read from.
+struct Token {
+    enum class Kind {
+        End,        // Nothing but whitespace left
+        Atom,       // Or a flag, backslash included
+        Quoted,     // text is between the quotes, still escaped
+        Literal,    // text is the literal's bytes
+        ListOpen,
+        ListClose,
+        Invalid     // A character no token starts with; text is that character
+    };
+
+    Kind kind = Kind::End;
+    std::string_view text;
+    bool escaped = false;  // A Quoted text with backslashes in it
+
+    bool is_string() const {
+        return kind == Kind::Atom || kind == Kind::Quoted || kind == Kind::Literal;
+    }
+};
+
+// Splits IMAP arguments into tokens without copying or allocating. The
+// input must outlive the tokens.
+class Tokenizer {
+public:
+    explicit Tokenizer(std::string_view input, size_t pos = 0) : input_(input), pos_(pos) {}
+
+    Token next();
+    // Where the next token's whitespace starts.
+    size_t position() const { return pos_; }
+    std::string_view rest() const { return input_.substr(pos_); }
+
+    // The token's string value: quoted text is unescaped into `out`,
+    // anything else is copied.
+    static void append_value(const Token& token, std::string& out);
+
+private:
+    std::string_view input_;
+    size_t pos_;
+};
+
+// The system flags, \Recent among them, as bits of a message's flag byte,
+// in the order they are listed; keywords stay strings.
+namespace system_flag {
+constexpr uint8_t answered = 1 << 0;
+constexpr uint8_t deleted = 1 << 1;
+constexpr uint8_t draft = 1 << 2;
+constexpr uint8_t flagged = 1 << 3;
+constexpr uint8_t recent = 1 << 4;
+constexpr uint8_t seen = 1 << 5;
+}  // namespace system_flag
+
 class IMAPParser {
 public:
-    // Parse a complete IMAP command line
-    static bool parse_command(const std::string& line, std::string& tag,
-                              std::string& command, std::string& arguments);
+    using allocator_type = std::pmr::polymorphic_allocator<>;
+
+    // Split a complete IMAP command line. The views point into `line`; the
+    // command name is returned as sent.
+    static bool parse_command(std::string_view line, std::string_view& tag,
+                              std::string_view& command, std::string_view& arguments);
 
-    // Parse specific argument types
-    static std::optional<SequenceSet> parse_sequence_set(const std::string& str);
-    static std::vector<FetchItem> parse_fetch_items(const std::string& str);
-    static std::vector<SearchCriteria> parse_search_criteria(const std::string& str);
-    static std::optional<StoreAction> parse_store_action(const std::string& str);
+    // The literal `line` (without CRLF) ends with, if any.
+    static std::optional<LiteralPrefix> literal_at_end(std::string_view line);
 
-    // Parse IMAP literals and quoted strings
-    static std::optional<std::string> parse_string(const std::string& str, size_t& pos);
-    static std::optional<std::string> parse_atom(const std::string& str, size_t& pos);
-    static std::optional<IMAPList> parse_list(const std::string& str, size_t& pos);
+    // Splits off the next whitespace-delimited token of `rest`; empty once
+    // `rest` holds nothing but whitespace.
+    static std::string_view next_token(std::string_view& rest);
+
+    // Parse specific argument types. The item lists allocate from `alloc`.
+    static std::optional<SequenceSet> parse_sequence_set(std::string_view str);
+    static std::pmr::vector<FetchItem> parse_fetch_items(std::string_view str,
+                                                         allocator_type alloc = {});
+    static std::pmr::vector<SearchCriteria> parse_search_criteria(std::string_view str,
+                                                                  allocator_type alloc = {});
+    static std::optional<StoreAction> parse_store_action(std::string_view str);
+    // Splits FETCH arguments after the sequence set into the items and the
+    // modifiers that may follow them; nullopt if the modifiers are malformed.
+    static std::optional<FetchModifiers> split_fetch_modifiers(std::string_view& items);
+    // Takes "(UNCHANGEDSINCE n)" off the front of STORE arguments after the
+    // sequence set. False if there is a modifier list but it is malformed.
+    static bool take_unchanged_since(std::string_view& rest, std::optional<uint64_t>& modseq);
+
+    // Parse IMAP literals and quoted strings. A literal is read from a
+    // command as assembled by IMAPSession: "{n}" (or "{n+}"), CRLF, then
+    // the n bytes. Owning wrappers over Tokenizer; `pos` only moves on
+    // success.
+    static std::optional<std::string> parse_string(std::string_view str, size_t& pos);
+    static std::optional<std::string> parse_atom(std::string_view str, size_t& pos);
+    static std::optional<IMAPList> parse_list(std::string_view str, size_t& pos);
 
     // Utility functions
     static std::string quote_string(const std::string& str);
     static std::string format_flags(const std::set<std::string>& flags);
-    static std::set<std::string> parse_flag_list(const std::string& str);
+    // Appends the parenthesized flag list to `out`.
+    static void append_flags(std::pmr::string& out, const std::set<std::string>& flags);
+    // The same for the system flags in `system` and then `keywords`.
+    static void append_flags(std::pmr::string& out, uint8_t system,
+                             const std::set<std::string>& keywords);
+    // The system_flag bit of `flag`; 0 for a keyword.
+    static uint8_t system_flag_bit(std::string_view flag);
+    static std::set<std::string> parse_flag_list(std::string_view str);
+
+    // FETCH response data. An nstring is NIL when empty, a literal when it
+    // cannot be quoted. Envelope fields are the raw header values; sender
+    // and reply-to default to from. `extensions` adds BODYSTRUCTURE's
+    // extension data to what BODY returns.
+    static void append_nstring(std::pmr::string& out, std::string_view value);
+    static void append_envelope(std::pmr::string& out, const Envelope& envelope);
+    static void append_body_structure(std::pmr::string& out, const MimePart& part,
+                                      bool extensions);
 
     // Date parsing/formatting
     static std::optional<std::chrono::system_clock::time_point> parse_date(const std::string& str);
@@ -136,7 +294,15 @@ public:
     static std::string format_internal_date(std::chrono::system_clock::time_point tp);
 
 private:
-    static void skip_whitespace(const std::string& str, size_t& pos);
+    // One search key, with its arguments and sub-keys; nullopt at the end
+    // of the input or of a parenthesized list.
+    static std::optional<SearchCriteria> parse_search_key(std::string_view& rest,
+                                                          allocator_type alloc);
+    // A search atom, or a lone parenthesis.
+    static std::string_view next_search_word(std::string_view& rest);
+    // A quoted string or atom argument.
+    static void next_search_string(std::string_view& rest, std::pmr::string& out);
+    static void skip_whitespace(std::string_view str, size_t& pos);
     static bool is_atom_char(char c);
     static bool is_list_wildcard(char c);
 };
@@ -26,6 +26,10 @@ public:
     // Configure TLS
     bool configure_tls(const TLSConfig& tls_config);
 
+    // Serve on a reactor shared with other servers (see Server::set_reactor)
+    // instead of this protocol's own threads. Must be called before start().
+    void set_reactor(std::shared_ptr<Reactor> reactor) { reactor_ = std::move(reactor); }
+
 private:
     IMAPConfig config_;
     std::shared_ptr<Authenticator> auth_;
@@ -36,6 +40,10 @@ private:
 
     SSLContext ssl_context_;
     bool tls_configured_ = false;
+
+    // Shared by all of this protocol's listeners.
+    std::shared_ptr<MemoryBudget> memory_budget_ = std::make_shared<MemoryBudget>();
+    std::shared_ptr<Reactor> reactor_;
 };
 
 }  // namespace email::imap
@@ -1,13 +1,17 @@
 #pragma once
 
 #include "net/session.hpp"
+#include "net/command_arena.hpp"
 #include "auth/authenticator.hpp"
 #include "storage/maildir.hpp"
 #include "imap_commands.hpp"
 #include "imap_parser.hpp"
+#include <atomic>
+#include <functional>
 #include <memory>
 #include <vector>
 #include <set>
+#include <span>
 #include <map>
 
 namespace email::imap {
@@ -24,6 +28,9 @@ struct SelectedMailbox {
     bool read_only = false;
     uint32_t uid_validity = 0;
     uint32_t uid_next = 0;
+    // The highest mod-sequence the session has shown; 0 when the mailbox
+    // has none (NOMODSEQ).
+    uint64_t highest_modseq = 0;
     size_t exists = 0;
     size_t recent = 0;
     size_t unseen = 0;
@@ -31,13 +38,78 @@ struct SelectedMailbox {
     std::vector<std::string> permanent_flags;
 };
 
-struct CachedMessage {
-    uint32_t sequence_number;
-    uint32_t uid;
-    std::string unique_id;
-    size_t size;
-    std::set<std::string> flags;
-    std::chrono::system_clock::time_point internal_date;
+// The selected mailbox's messages, a column per attribute, so that SEARCH
+// runs down plain arrays. Row i is sequence number i + 1; UIDs ascend.
+// Loaded from a mailbox snapshot, the UID, unique_id, size and date
+// columns are the snapshot's own, shared with every session that selected
+// the mailbox at that state, until the first row is added or removed.
+// Flags and mod-sequences are always the session's.
+class MessageTable {
+public:
+    size_t size() const { return uids().size(); }
+    bool empty() const { return uids().empty(); }
+    void clear();
+    // Replaces the rows with an indexed snapshot's; `flags` holds their
+    // system_flag bits.
+    void assign(std::shared_ptr<const MailboxSnapshot> snapshot, std::vector<uint8_t> flags);
+    void push_back(uint32_t uid, std::string unique_id, uint64_t size,
+                   std::chrono::system_clock::time_point internal_date, uint8_t flags,
+                   uint64_t modseq);
+    // Drops the rows in `rows`, which ascend.
+    void erase(std::span<const size_t> rows);
+    // The row holding `uid`.
+    std::optional<size_t> find_uid(uint32_t uid) const;
+    // The rows `set` names, as disjoint ascending [first, second) runs: by
+    // sequence number, or with `by_uid` by UID. * is the last message.
+    // Each range costs a binary search at most, whatever it spans.
+    std::vector<std::pair<size_t, size_t>> row_spans(const SequenceSet& set, bool by_uid) const;
+
+    uint32_t uid(size_t row) const { return uids()[row]; }
+    const std::string& unique_id(size_t row) const { return unique_ids()[row]; }
+    uint64_t message_size(size_t row) const { return sizes()[row]; }
+    std::chrono::system_clock::time_point internal_date(size_t row) const {
+        return std::chrono::system_clock::time_point(std::chrono::seconds(dates()[row]));
+    }
+    // system_flag bits.
+    uint8_t flags(size_t row) const { return flags_[row]; }
+    void set_flags(size_t row, uint8_t flags) { flags_[row] = flags; }
+    uint64_t modseq(size_t row) const { return modseqs_[row]; }
+    void set_modseq(size_t row, uint64_t modseq) { modseqs_[row] = modseq; }
+    // The keywords the session keeps for the message; few have any.
+    const std::set<std::string>& keywords(size_t row) const;
+    void set_keywords(size_t row, std::set<std::string> keywords);
+
+    // Whole columns, for scans.
+    std::span<const uint32_t> uid_column() const { return uids(); }
+    std::span<const uint64_t> size_column() const { return sizes(); }
+    std::span<const int64_t> date_column() const { return dates(); }  // Seconds since the epoch
+    std::span<const uint8_t> flag_column() const { return flags_; }
+    std::span<const uint64_t> modseq_column() const { return modseqs_; }
+    // Keywords by UID.
+    const std::map<uint32_t, std::set<std::string>>& keyword_map() const { return keywords_; }
+
+    // Heap held by the columns, not counting a shared snapshot's.
+    std::size_t heap_bytes() const;
+
+private:
+    const std::vector<uint32_t>& uids() const { return shared_ ? shared_->uids : uids_; }
+    const std::vector<std::string>& unique_ids() const {
+        return shared_ ? shared_->unique_ids : unique_ids_;
+    }
+    const std::vector<uint64_t>& sizes() const { return shared_ ? shared_->sizes : sizes_; }
+    const std::vector<int64_t>& dates() const { return shared_ ? shared_->dates : dates_; }
+    // Copies the shared columns, before rows change.
+    void detach();
+
+    std::shared_ptr<const MailboxSnapshot> shared_;
+    std::vector<uint32_t> uids_;
+    std::vector<std::string> unique_ids_;
+    std::vector<uint64_t> sizes_;
+    std::vector<int64_t> dates_;
+    std::vector<uint8_t> flags_;
+    std::vector<uint64_t> modseqs_;
+    std::map<uint32_t, std::set<std::string>> keywords_;
+    std::size_t node_bytes_ = 0;  // Behind unique_ids_ and keywords_
 };
 
 class IMAPSession : public Session {
@@ -55,7 +127,7 @@ public:
                 const std::string& hostname);
 #endif
 
-    ~IMAPSession() override = default;
+    ~IMAPSession() override;
 
     // State
     SessionState state() const { return state_; }
@@ -63,6 +135,9 @@ public:
 
     // Authentication
     Authenticator& authenticator() { return *auth_; }
+    // Completes LOGIN: verifies the credentials off the io thread, opens
+    // the maildir and sends the tagged reply. Later commands wait for it.
+    void login(std::string tag, std::string username, std::string password);
 
     // Maildir
     Maildir* maildir() { return maildir_.get(); }
@@ -79,22 +154,83 @@ public:
                                             const std::string& pattern);
 
     // Message operations
-    const std::vector<CachedMessage>& messages() const { return messages_; }
-    std::optional<CachedMessage> get_message_by_sequence(uint32_t seq) const;
-    std::optional<CachedMessage> get_message_by_uid(uint32_t uid) const;
-    std::optional<std::string> get_message_content(uint32_t seq) const;
+    const MessageTable& messages() const { return messages_; }
+    // The message mapped read-only, for reads that need the body.
+    std::optional<MessageView> map_message(uint32_t seq) const;
+    // Opens the message file for streaming with send_file().
+    std::optional<OutboundFile> open_message_file(uint32_t seq) const;
     std::optional<std::string> get_message_headers(uint32_t seq) const;
+    std::optional<MessageStructure> get_message_structure(uint32_t seq) const;
 
-    // Flag operations
-    bool set_flags(uint32_t seq, const std::set<std::string>& flags);
-    bool add_flags(uint32_t seq, const std::set<std::string>& flags);
-    bool remove_flags(uint32_t seq, const std::set<std::string>& flags);
+    // Flag operations. Applies one STORE to all of `seqs` in a single Maildir
+    // batch and returns the sequence numbers whose cached flags now reflect
+    // it. With `unchanged_since` (UNCHANGEDSINCE), messages changed after
+    // that mod-sequence are left alone and added to `modified` instead.
+    std::vector<uint32_t> store_flags(std::span<const uint32_t> seqs, FlagChange::Mode mode,
+                                      const std::set<std::string>& flags,
+                                      std::optional<uint64_t> unchanged_since = std::nullopt,
+                                      std::vector<uint32_t>* modified = nullptr);
+
+    // APPEND: delivers `content` to `mailbox` with the system flags among
+    // `flags`; keywords are not stored. False if it could not be written.
+    bool append_message(const std::string& mailbox, const std::string& content,
+                        const std::set<std::string>& flags);
 
     // Search
-    std::vector<uint32_t> search(const std::vector<SearchCriteria>& criteria, bool use_uid = false);
+    std::vector<uint32_t> search(const std::pmr::vector<SearchCriteria>& criteria, bool use_uid = false);
+
+    // Removes the messages flagged \Deleted, appending the EXPUNGE or
+    // VANISHED responses for them to `out` if given.
+    void expunge(Responses* out = nullptr);
+
+    // Applies what other sessions and deliveries changed in the selected
+    // mailbox to the cache and appends the untagged EXPUNGE, FETCH, EXISTS
+    // and RECENT responses that tell the client. Only for commands that may
+    // renumber messages (RFC 3501 7.4.1).
+    void report_changes(Responses& out);
 
-    // Expunge
-    std::vector<uint32_t> expunge();
+    // CONDSTORE and QRESYNC (RFC 7162), on from the first command that
+    // uses them until logout. Enabling QRESYNC enables CONDSTORE.
+    bool condstore_enabled() const { return condstore_; }
+    bool qresync_enabled() const { return qresync_; }
+    void enable_condstore() { condstore_ = true; }
+    void enable_qresync() { condstore_ = qresync_ = true; }
+    // The untagged FETCH telling the client of row's new flags, with its
+    // UID when `with_uid` or QRESYNC asks for it and its mod-sequence once
+    // CONDSTORE is on. `flags` false leaves the flags out.
+    void append_flag_update(Responses& out, size_t row, bool with_uid, bool flags = true) const;
+    // UIDs expunged since `modseq` among `candidates`, which is normalized:
+    // from the mailbox's log, or when that does not reach back so far,
+    // every candidate up to UIDNEXT that no message holds.
+    SequenceSet vanished_since(uint64_t modseq, const SequenceSet& candidates) const;
+
+    // IDLE (RFC 2177). start_idle() is called once the continuation is
+    // queued; from then on changes to the selected mailbox are pushed as
+    // they happen, woken by MailboxEvents for this process's own changes
+    // and by the mailbox watcher for everyone else's, until the client
+    // sends DONE. The idle timeout replaces the usual one meanwhile.
+    void start_idle(std::string_view tag);
+    bool idling() const { return !idle_tag_.empty(); }
+    bool idle_enabled() const { return idle_enabled_; }
+    void set_idle_enabled(bool enabled) { idle_enabled_ = enabled; }
+    void set_idle_timeout(std::chrono::seconds timeout) { idle_timeout_ = timeout; }
+
+    // COMPRESS=DEFLATE (RFC 4978): the command creates the codec with the
+    // configured options and hands it to start_compression() after its reply.
+    bool compression_available() const {
+        return compress_enabled_ && !compressing() && DeflateCodec::available();
+    }
+    void set_compression(bool enabled, const DeflateCodec::Options& options) {
+        compress_enabled_ = enabled;
+        compress_options_ = options;
+    }
+    std::unique_ptr<DeflateCodec> create_codec() const {
+        return DeflateCodec::create(compress_options_);
+    }
+
+    // Largest command accepted, its literals included; bigger literals are
+    // refused before they are read.
+    void set_max_command_size(size_t bytes) { max_command_size_ = bytes; }
 
     // STARTTLS
     bool starttls_available() const { return starttls_available_ && !is_tls(); }
@@ -107,23 +243,60 @@ public:
 
     const std::string& hostname() const { return hostname_; }
 
+    // Queues the lines, each CRLF-terminated, as one write. The bytes are
+    // copied out, so the lines may live in the command arena.
+    void send_responses(const Responses& lines);
+    // Parks a command that stopped because write_backlogged(): `resume` is
+    // called again each time the output drains, until it returns true, and
+    // no other command runs meanwhile.
+    void defer(std::function<bool()> resume) { resume_ = std::move(resume); }
+
     // UID handling
     uint32_t get_uid_for_sequence(uint32_t seq) const;
     uint32_t get_sequence_for_uid(uint32_t uid) const;
 
 protected:
     void on_connect() override;
+    // Assembles commands that carry literals: a line announcing one is
+    // kept, the literal's bytes arrive through on_bytes(), and the command
+    // runs once a line ends without another.
     void on_data(const std::string& data) override;
+    void on_bytes(std::string_view bytes, bool last) override;
     void on_tls_handshake_complete() override;
+    void on_write_drained() override;
+    void on_disconnect() override;
+    std::size_t messages_footprint() const override {
+        return cache_bytes_ + pending_command_.capacity();
+    }
 
 private:
     void process_command(const std::string& line);
+    // The line ending an IDLE, which should be DONE.
+    void finish_idle(const std::string& line);
+    // Arms the wait for the watcher's descriptor, or while the mailbox is
+    // watched by polling a timer, to wake the IDLE.
+    void watch_idle();
+    void stop_idle_waits();
+    // Pushes whatever changed to an idling client.
+    void idle_wake();
     void load_messages();
     void update_mailbox_counts();
+    // Recomputes cache_bytes_ from messages_.
+    void account_cache();
+    // The unique_id of message `seq`; nullptr if there is none.
+    const std::string* unique_id_of(uint32_t seq) const;
+    // Reads the index's mod-sequences for `rows` into the table.
+    void refresh_modseqs(std::span<const size_t> rows);
+    // EXPUNGE from the highest row down, or once QRESYNC is on a VANISHED
+    // of their UIDs; before the rows are erased.
+    void report_expunged(std::span<const size_t> rows, Responses& out) const;
 
-    // Convert maildir flags to IMAP flags
-    static std::set<std::string> maildir_to_imap_flags(const std::set<char>& flags);
-    static std::set<char> imap_to_maildir_flags(const std::set<std::string>& flags);
+    // Convert between maildir flags and system_flag bits. \Recent has no
+    // maildir flag; only the session keeps it, as it does keywords.
+    static uint8_t maildir_to_imap_flags(const std::set<char>& flags);
+    // From MailboxIndex::flag_bit() bits.
+    static uint8_t index_to_imap_flags(uint64_t bits);
+    static std::set<char> imap_to_maildir_flags(uint8_t flags);
 
     SessionState state_ = SessionState::NOT_AUTHENTICATED;
 
@@ -133,18 +306,45 @@ private:
     std::string hostname_;
 
     std::optional<SelectedMailbox> selected_;
-    std::vector<CachedMessage> messages_;
+    MessageTable messages_;
 
     bool starttls_available_ = true;
+    bool condstore_ = false;
+    bool qresync_ = false;
+
+    // A command whose literals are still arriving, in wire form.
+    std::string pending_command_;
+    size_t max_command_size_ = 32 * 1024 * 1024;
+
+    bool compress_enabled_ = true;
+    DeflateCodec::Options compress_options_;
+
+    std::string idle_tag_;
+    bool idle_enabled_ = true;
+    std::chrono::seconds idle_timeout_{1800};
+    std::chrono::seconds saved_timeout_{0};
+    std::unique_ptr<MailboxEvents::Subscription> idle_subscription_;
+    // A duplicate of the watcher's descriptor, so its lifetime is ours;
+    // only held while idling.
+    std::unique_ptr<asio::posix::stream_descriptor> idle_watch_;
+    std::unique_ptr<asio::steady_timer> idle_timer_;
+    // Drops wakeups armed for an IDLE that has ended.
+    uint64_t idle_generation_ = 0;
+    // Set while a wakeup from MailboxEvents is posted, so a burst of
+    // changes posts one.
+    std::atomic<bool> idle_wake_posted_{false};
+
+    // Backs the command being processed and its responses; reset once the
+    // tagged response is queued.
+    CommandArena arena_;
+    std::function<bool()> resume_;
 
 #ifdef ENABLE_TLS
     ssl::context* ssl_context_ = nullptr;
 #endif
 
-    // UID mapping
-    std::map<uint32_t, uint32_t> seq_to_uid_;
-    std::map<uint32_t, uint32_t> uid_to_seq_;
-    uint32_t next_uid_ = 1;
+    // Heap held by messages_; keyword changes adjust it in place.
+    std::size_t cache_bytes_ = 0;
 };
 
 }  // namespace email::imap
@@ -3,59 +3,609 @@
 #include "imap_parser.hpp"
 #include "logger.hpp"
 #include <algorithm>
-#include <sstream>
+#include <array>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
 
 namespace email::imap {
 
-Command Command::parse(const std::string& line) {
-    Command cmd;
-    cmd.type = CommandType::UNKNOWN;
+namespace {
+
+// Command names hash into a table of 64 slots without colliding, so looking
+// one up takes a hash and a single comparison. The seed is the FNV-1a offset
+// basis plus the first increment that separates all the names; adding a
+// command may need a new one, which the static_assert below points out.
+struct CommandName {
+    std::string_view name;
+    CommandType type = CommandType::UNKNOWN;
+};
+
+constexpr CommandName command_names[] = {
+    {"CAPABILITY", CommandType::CAPABILITY},
+    {"NOOP", CommandType::NOOP},
+    {"LOGOUT", CommandType::LOGOUT},
+    {"ENABLE", CommandType::ENABLE},
+    {"STARTTLS", CommandType::STARTTLS},
+    {"AUTHENTICATE", CommandType::AUTHENTICATE},
+    {"LOGIN", CommandType::LOGIN},
+    {"SELECT", CommandType::SELECT},
+    {"EXAMINE", CommandType::EXAMINE},
+    {"CREATE", CommandType::CREATE},
+    {"DELETE", CommandType::DELETE},
+    {"RENAME", CommandType::RENAME},
+    {"SUBSCRIBE", CommandType::SUBSCRIBE},
+    {"UNSUBSCRIBE", CommandType::UNSUBSCRIBE},
+    {"LIST", CommandType::LIST},
+    {"LSUB", CommandType::LSUB},
+    {"STATUS", CommandType::STATUS},
+    {"APPEND", CommandType::APPEND},
+    {"IDLE", CommandType::IDLE},
+    {"COMPRESS", CommandType::COMPRESS},
+    {"CHECK", CommandType::CHECK},
+    {"CLOSE", CommandType::CLOSE},
+    {"EXPUNGE", CommandType::EXPUNGE},
+    {"SEARCH", CommandType::SEARCH},
+    {"FETCH", CommandType::FETCH},
+    {"STORE", CommandType::STORE},
+    {"COPY", CommandType::COPY},
+    {"UID", CommandType::UID}
+};
+
+constexpr uint32_t command_seed = 2166136261u + 429;
+constexpr int command_slot_bits = 6;
+
+constexpr size_t command_slot(std::string_view name) {
+    uint32_t hash = command_seed;
+    for (char c : name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 16777619u;
+    }
+    return hash >> (32 - command_slot_bits);
+}
+
+struct CommandTable {
+    std::array<CommandName, size_t{1} << command_slot_bits> slots{};
+    bool collides = false;
+};
+
+constexpr CommandTable make_command_table() {
+    CommandTable table;
+    for (const auto& command : command_names) {
+        auto& slot = table.slots[command_slot(command.name)];
+        table.collides = table.collides || !slot.name.empty();
+        slot = command;
+    }
+    return table;
+}
+
+constexpr CommandTable command_table = make_command_table();
+static_assert(!command_table.collides, "command names collide; search for a new command_seed");
+
+// What `istream >> std::ws` would leave of `str`.
+std::string_view trim_leading_space(std::string_view str) {
+    while (!str.empty() && std::isspace(static_cast<unsigned char>(str.front()))) {
+        str.remove_prefix(1);
+    }
+    return str;
+}
+
+// Where a BODY[section] lies in the message, as its structure describes it.
+// A HEADER.FIELDS section is the header it filters, with `fields` the list
+// after the keyword.
+struct SectionRange {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    std::string_view fields;
+    bool exclude_fields = false;
+};
+
+bool starts_with_nocase(std::string_view text, std::string_view prefix) {
+    return text.size() >= prefix.size() &&
+           std::equal(prefix.begin(), prefix.end(), text.begin(), [](char a, char b) {
+               return std::toupper(static_cast<unsigned char>(a)) ==
+                      std::toupper(static_cast<unsigned char>(b));
+           });
+}
+
+std::optional<SectionRange> locate_section(const MessageStructure& structure,
+                                           std::string_view section) {
+    // Part numbers walk down the tree; within an encapsulated message they
+    // count that message's parts.
+    const MimePart* part = &structure.body;
+    bool numbered = false;
+    while (!section.empty() && std::isdigit(static_cast<unsigned char>(section.front()))) {
+        size_t n = 0;
+        auto [end, ec] = std::from_chars(section.data(), section.data() + section.size(), n);
+        if (ec != std::errc()) {
+            return std::nullopt;
+        }
+        section.remove_prefix(static_cast<size_t>(end - section.data()));
+        if (numbered && part->is_message()) {
+            if (part->parts.empty()) return std::nullopt;
+            part = &part->parts.front();
+        }
+        if (part->is_multipart()) {
+            if (n < 1 || n > part->parts.size()) return std::nullopt;
+            part = &part->parts[n - 1];
+        } else if (n != 1) {
+            return std::nullopt;
+        }
+        numbered = true;
+        if (!section.empty()) {
+            if (section.front() != '.') return std::nullopt;
+            section.remove_prefix(1);
+        }
+    }
+
+    SectionRange range;
+    if (section.empty()) {
+        range.offset = numbered ? part->body_offset : 0;
+        range.length = part->end - range.offset;
+        return range;
+    }
+    if (starts_with_nocase(section, "MIME")) {
+        if (!numbered || section.size() != 4) return std::nullopt;
+        range.offset = part->offset;
+        range.length = part->body_offset - part->offset;
+        return range;
+    }
+
+    // HEADER and TEXT are of a message: the whole one, or an encapsulated one.
+    const MimePart* message = part;
+    if (numbered) {
+        if (!part->is_message() || part->parts.empty()) return std::nullopt;
+        message = &part->parts.front();
+    }
+    if (starts_with_nocase(section, "TEXT") && section.size() == 4) {
+        range.offset = message->body_offset;
+        range.length = message->end - message->body_offset;
+        return range;
+    }
+    if (!starts_with_nocase(section, "HEADER")) {
+        return std::nullopt;
+    }
+    range.offset = message->offset;
+    range.length = message->body_offset - message->offset;
+    section.remove_prefix(6);
+    if (section.empty()) {
+        return range;
+    }
+    if (starts_with_nocase(section, ".FIELDS.NOT")) {
+        range.exclude_fields = true;
+        section.remove_prefix(11);
+    } else if (starts_with_nocase(section, ".FIELDS")) {
+        section.remove_prefix(7);
+    } else {
+        return std::nullopt;
+    }
+    range.fields = trim_leading_space(section);
+    return range;
+}
+
+// The fields of `header` named in `list`, "(FROM TO)", or with
+// `exclude`, all the others; followed by the blank line.
+std::string filter_header(std::string_view header, std::string_view list, bool exclude) {
+    std::vector<std::string_view> names;
+    for (size_t i = 0; i < list.size();) {
+        while (i < list.size() && (list[i] == '(' || list[i] == ')' || list[i] == '"' ||
+                                   std::isspace(static_cast<unsigned char>(list[i])))) {
+            ++i;
+        }
+        size_t start = i;
+        while (i < list.size() && list[i] != ')' && list[i] != '"' &&
+               !std::isspace(static_cast<unsigned char>(list[i]))) {
+            ++i;
+        }
+        if (i > start) names.push_back(list.substr(start, i - start));
+    }
+
+    std::string result;
+    bool keep = false;
+    while (!header.empty()) {
+        auto newline = header.find('\n');
+        auto line = header.substr(0, newline == std::string_view::npos ? header.size() : newline + 1);
+        header.remove_prefix(line.size());
+        if (line == "\r\n" || line == "\n") {
+            break;
+        }
+        if (line.front() != ' ' && line.front() != '\t') {
+            auto name = line.substr(0, line.find(':'));
+            bool named = std::any_of(names.begin(), names.end(), [name](std::string_view wanted) {
+                return wanted.size() == name.size() && starts_with_nocase(name, wanted);
+            });
+            keep = named != exclude;
+        }
+        if (keep) {
+            result.append(line);
+        }
+    }
+    result.append("\r\n");
+    return result;
+}
+
+// A whole token as a number; nullopt if it is anything else.
+std::optional<uint64_t> parse_number(std::string_view token) {
+    uint64_t value = 0;
+    auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (token.empty() || ec != std::errc() || end != token.data() + token.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+std::string to_upper(std::string_view text) {
+    std::string upper(text);
+    std::transform(upper.begin(), upper.end(), upper.begin(), ::toupper);
+    return upper;
+}
+
+// The rows `set` names, ascending: by sequence number, or with `by_uid`
+// by UID. * is the last message.
+std::vector<size_t> rows_of(const MessageTable& messages, const SequenceSet& set, bool by_uid) {
+    auto spans = messages.row_spans(set, by_uid);
+    size_t total = 0;
+    for (auto [begin, end] : spans) total += end - begin;
+    std::vector<size_t> rows;
+    rows.reserve(total);
+    for (auto [begin, end] : spans) {
+        for (size_t row = begin; row < end; ++row) {
+            rows.push_back(row);
+        }
+    }
+    return rows;
+}
+
+bool uses_modseq(std::span<const SearchCriteria> criteria) {
+    return std::any_of(criteria.begin(), criteria.end(), [](const SearchCriteria& crit) {
+        return crit.type == SearchCriteria::Type::MODSEQ || uses_modseq(crit.sub_criteria);
+    });
+}
 
-    std::string tag, command, arguments;
+// SELECT and EXAMINE: the mailbox name, then optionally (CONDSTORE) or
+// (QRESYNC (uidvalidity modseq [known-uids])), RFC 7162.
+Responses open_mailbox(IMAPSession& session, const Command& cmd, bool read_only) {
+    if (session.state() != SessionState::AUTHENTICATED &&
+        session.state() != SessionState::SELECTED) {
+        return cmd.bad("Not authenticated");
+    }
+
+    size_t pos = 0;
+    auto mailbox = IMAPParser::parse_string(cmd.arguments, pos);
+    if (!mailbox || mailbox->empty()) {
+        return cmd.bad("Mailbox name required");
+    }
+
+    bool condstore = false;
+    std::optional<uint64_t> qresync_validity;
+    uint64_t qresync_modseq = 0;
+    std::optional<SequenceSet> known_uids;
+    std::string_view params = trim_leading_space(std::string_view(cmd.arguments).substr(pos));
+    if (!params.empty()) {
+        if (params.front() != '(' || params.back() != ')') {
+            return cmd.bad("Invalid parameters");
+        }
+        params = params.substr(1, params.size() - 2);
+        for (auto name = IMAPParser::next_token(params); !name.empty();
+             name = IMAPParser::next_token(params)) {
+            const auto upper = to_upper(name);
+            if (upper == "CONDSTORE") {
+                condstore = true;
+                continue;
+            }
+            if (upper != "QRESYNC") {
+                return cmd.bad("Unknown parameter");
+            }
+            if (!session.qresync_enabled()) {
+                return cmd.bad("QRESYNC is not enabled");
+            }
+            // Its list ends at the matching parenthesis: a sequence match
+            // data list may be nested inside.
+            params = trim_leading_space(params);
+            size_t end = 0;
+            for (int depth = 0; end < params.size(); ++end) {
+                if (params[end] == '(') ++depth;
+                if (params[end] == ')' && --depth == 0) break;
+            }
+            if (params.empty() || params.front() != '(' || end == params.size()) {
+                return cmd.bad("Invalid QRESYNC parameters");
+            }
+            std::string_view args = params.substr(1, end - 1);
+            params.remove_prefix(end + 1);
+            qresync_validity = parse_number(IMAPParser::next_token(args));
+            auto modseq = parse_number(IMAPParser::next_token(args));
+            if (!qresync_validity || !modseq) {
+                return cmd.bad("Invalid QRESYNC parameters");
+            }
+            qresync_modseq = *modseq;
+            args = trim_leading_space(args);
+            if (!args.empty() && args.front() != '(') {
+                known_uids = IMAPParser::parse_sequence_set(IMAPParser::next_token(args));
+            }
+        }
+    }
+
+    if (!session.select_mailbox(*mailbox, read_only)) {
+        return cmd.no("Mailbox does not exist");
+    }
+    if (condstore) {
+        session.enable_condstore();
+    }
+
+    auto* selected = session.selected_mailbox();
+    Responses responses(cmd.get_allocator());
+    response::untagged(responses, "{} EXISTS", selected->exists);
+    response::untagged(responses, "{} RECENT", selected->recent);
+
+    if (selected->unseen > 0) {
+        response::untagged(responses, "OK [UNSEEN {}]", selected->unseen);
+    }
+
+    response::untagged(responses, "OK [UIDVALIDITY {}]", selected->uid_validity);
+    response::untagged(responses, "OK [UIDNEXT {}]", selected->uid_next);
+    response::untagged(responses, "FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)");
+    if (read_only) {
+        response::untagged(responses, "OK [PERMANENTFLAGS ()]");
+    } else {
+        response::untagged(responses, "OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft \\*)]");
+    }
+    if (selected->highest_modseq != 0) {
+        response::untagged(responses, "OK [HIGHESTMODSEQ {}]", selected->highest_modseq);
+    } else {
+        response::untagged(responses, "OK [NOMODSEQ]");
+    }
+
+    // What changed since the client last looked, if it still can be told.
+    if (qresync_validity && *qresync_validity == selected->uid_validity &&
+        selected->highest_modseq != 0) {
+        const uint32_t last_uid = selected->uid_next > 0 ? selected->uid_next - 1 : 0;
+        SequenceSet candidates;
+        if (known_uids) {
+            candidates = known_uids->normalized(last_uid);
+        } else if (last_uid > 0) {
+            candidates.push_back(1, last_uid);
+        }
+        auto vanished = session.vanished_since(qresync_modseq, candidates);
+        if (!vanished.ranges.empty()) {
+            response::untagged(responses, "VANISHED (EARLIER) ");
+            vanished.append_to(responses.back());
+        }
+        auto modseqs = session.messages().modseq_column();
+        for (size_t row = 0; row < modseqs.size(); ++row) {
+            if (modseqs[row] > qresync_modseq) {
+                session.append_flag_update(responses, row, true);
+            }
+        }
+    }
+
+    if (read_only) {
+        response::ok(responses, cmd.tag, "[READ-ONLY] EXAMINE completed");
+    } else {
+        response::ok(responses, cmd.tag, "[READ-WRITE] SELECT completed");
+    }
+    return responses;
+}
+
+std::string read_range(OutboundFile& file, uint64_t offset, uint64_t length) {
+    std::string data(length, '\0');
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = file.read(offset + done, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += static_cast<size_t>(n);
+    }
+    data.resize(done);
+    return data;
+}
+
+// One message's FETCH response. Literals from the message file are queued
+// on the session as they come up, after what `responses` held so far, and
+// the rest is left in `responses`. `add_flags` appends FLAGS, which the
+// fetch changed, unless the items ask for them anyway.
+void fetch_message(IMAPSession& session, size_t row, std::span<const FetchItem> items,
+                   bool add_flags, Responses& responses) {
+    const auto& messages = session.messages();
+    const auto seq = static_cast<uint32_t>(row + 1);
+    response::untagged(responses, "{} FETCH (", seq);
+    auto* line = &responses.back();
+
+    // Loaded for the first item that needs it.
+    std::optional<MessageStructure> structure;
+    bool structure_loaded = false;
+    auto get_structure = [&]() -> const MessageStructure* {
+        if (!structure_loaded) {
+            structure = session.get_message_structure(seq);
+            structure_loaded = true;
+        }
+        return structure ? &*structure : nullptr;
+    };
+
+    // Flush everything produced so far, then stream the literal from
+    // disk instead of buffering it. The rest of this response continues
+    // on a fresh line.
+    auto stream = [&](OutboundFile file, uint64_t offset, uint64_t length) {
+        std::format_to(std::back_inserter(*line), "{{{}}}", length);
+        if (length == 0) {
+            line->append("\r\n");
+            return;
+        }
+        session.send_responses(responses);
+        responses.clear();
+        session.send_file(std::move(file), offset, length);
+        line = &responses.emplace_back();
+    };
+
+    // BODY[section]<partial> and RFC822.TEXT, from the structure and a
+    // ranged read.
+    auto send_section = [&](std::string_view section,
+                            const std::optional<std::pair<size_t, size_t>>& partial) {
+        const auto* found = get_structure();
+        auto range = found ? locate_section(*found, section) : std::nullopt;
+        auto file = range ? session.open_message_file(seq) : std::nullopt;
+        if (partial) {
+            std::format_to(std::back_inserter(*line), "<{}> ", partial->first);
+        } else {
+            *line += ' ';
+        }
+        if (!file) {
+            line->append("NIL");
+            return;
+        }
+        auto clip = [&partial](uint64_t& offset, uint64_t& length) {
+            if (partial) {
+                uint64_t skip = std::min<uint64_t>(partial->first, length);
+                offset += skip;
+                length = std::min<uint64_t>(length - skip, partial->second);
+            }
+        };
+        if (!range->fields.empty()) {
+            auto header = filter_header(read_range(*file, range->offset, range->length),
+                                        range->fields, range->exclude_fields);
+            uint64_t offset = 0;
+            uint64_t length = header.size();
+            clip(offset, length);
+            std::format_to(std::back_inserter(*line), "{{{}}}\r\n", length);
+            line->append(header, offset, length);
+            return;
+        }
+        uint64_t offset = range->offset;
+        uint64_t length = std::min(range->length, file->size() - std::min(offset, file->size()));
+        clip(offset, length);
+        stream(std::move(*file), offset, length);
+    };
+
+    bool first = true;
+    for (const auto& item : items) {
+        if (!first) *line += ' ';
+        first = false;
+
+        switch (item.type) {
+            case FetchItem::Type::FLAGS:
+                line->append("FLAGS ");
+                IMAPParser::append_flags(*line, messages.flags(row), messages.keywords(row));
+                break;
+            case FetchItem::Type::UID:
+                std::format_to(std::back_inserter(*line), "UID {}", messages.uid(row));
+                break;
+            case FetchItem::Type::MODSEQ:
+                std::format_to(std::back_inserter(*line), "MODSEQ ({})", messages.modseq(row));
+                break;
+            case FetchItem::Type::RFC822_SIZE:
+                std::format_to(std::back_inserter(*line), "RFC822.SIZE {}", messages.message_size(row));
+                break;
+            case FetchItem::Type::INTERNALDATE:
+                line->append("INTERNALDATE ").append(IMAPParser::format_internal_date(messages.internal_date(row)));
+                break;
+            case FetchItem::Type::ENVELOPE:
+                if (const auto* found = get_structure()) {
+                    line->append("ENVELOPE ");
+                    IMAPParser::append_envelope(*line, found->envelope);
+                }
+                break;
+            case FetchItem::Type::BODYSTRUCTURE:
+                if (const auto* found = get_structure()) {
+                    line->append("BODYSTRUCTURE ");
+                    IMAPParser::append_body_structure(*line, found->body, true);
+                }
+                break;
+            case FetchItem::Type::RFC822_TEXT:
+                line->append("RFC822.TEXT");
+                send_section("TEXT", std::nullopt);
+                break;
+            case FetchItem::Type::RFC822:
+            case FetchItem::Type::BODY:
+            case FetchItem::Type::BODY_PEEK: {
+                if (item.type == FetchItem::Type::BODY && !item.has_section) {
+                    if (const auto* found = get_structure()) {
+                        line->append("BODY ");
+                        IMAPParser::append_body_structure(*line, found->body, false);
+                    }
+                    break;
+                }
+                if (item.type != FetchItem::Type::RFC822 &&
+                    (!item.section.empty() || item.partial)) {
+                    std::format_to(std::back_inserter(*line), "BODY[{}]", item.section);
+                    send_section(item.section, item.partial);
+                    break;
+                }
+                // The whole message needs no structure.
+                auto file = session.open_message_file(seq);
+                if (file) {
+                    line->append(item.type == FetchItem::Type::RFC822 ? "RFC822 " : "BODY[] ");
+                    uint64_t size = file->size();
+                    stream(std::move(*file), 0, size);
+                }
+                break;
+            }
+            case FetchItem::Type::RFC822_HEADER: {
+                auto headers = session.get_message_headers(seq);
+                if (headers) {
+                    std::format_to(std::back_inserter(*line), "RFC822.HEADER {{{}}}\r\n", headers->size());
+                    line->append(*headers);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    auto requested = [&items](FetchItem::Type type) {
+        return std::any_of(items.begin(), items.end(),
+                           [type](const FetchItem& item) { return item.type == type; });
+    };
+    if (add_flags && !requested(FetchItem::Type::FLAGS)) {
+        *line += first ? "FLAGS " : " FLAGS ";
+        IMAPParser::append_flags(*line, messages.flags(row), messages.keywords(row));
+        first = false;
+    }
+    if (add_flags && session.condstore_enabled() && !requested(FetchItem::Type::MODSEQ)) {
+        std::format_to(std::back_inserter(*line), "{}MODSEQ ({})", first ? "" : " ",
+                       messages.modseq(row));
+    }
+    *line += ')';
+}
+
+}  // namespace
+
+Command Command::parse(std::string_view line, allocator_type alloc) {
+    Command cmd(alloc);
+
+    std::string_view tag, command, arguments;
     if (!IMAPParser::parse_command(line, tag, command, arguments)) {
         return cmd;
     }
 
     cmd.tag = tag;
     cmd.name = command;
+    std::transform(cmd.name.begin(), cmd.name.end(), cmd.name.begin(), ::toupper);
     cmd.arguments = arguments;
-    cmd.type = string_to_type(command);
+    cmd.type = string_to_type(cmd.name);
 
     return cmd;
 }
 
-CommandType Command::string_to_type(const std::string& name) {
-    static const std::unordered_map<std::string, CommandType> mapping = {
-        {"CAPABILITY", CommandType::CAPABILITY},
-        {"NOOP", CommandType::NOOP},
-        {"LOGOUT", CommandType::LOGOUT},
-        {"STARTTLS", CommandType::STARTTLS},
-        {"AUTHENTICATE", CommandType::AUTHENTICATE},
-        {"LOGIN", CommandType::LOGIN},
-        {"SELECT", CommandType::SELECT},
-        {"EXAMINE", CommandType::EXAMINE},
-        {"CREATE", CommandType::CREATE},
-        {"DELETE", CommandType::DELETE},
-        {"RENAME", CommandType::RENAME},
-        {"SUBSCRIBE", CommandType::SUBSCRIBE},
-        {"UNSUBSCRIBE", CommandType::UNSUBSCRIBE},
-        {"LIST", CommandType::LIST},
-        {"LSUB", CommandType::LSUB},
-        {"STATUS", CommandType::STATUS},
-        {"APPEND", CommandType::APPEND},
-        {"CHECK", CommandType::CHECK},
-        {"CLOSE", CommandType::CLOSE},
-        {"EXPUNGE", CommandType::EXPUNGE},
-        {"SEARCH", CommandType::SEARCH},
-        {"FETCH", CommandType::FETCH},
-        {"STORE", CommandType::STORE},
-        {"COPY", CommandType::COPY},
-        {"UID", CommandType::UID}
-    };
+Responses Command::ok(std::string_view msg) const {
+    Responses responses(get_allocator());
+    response::ok(responses, tag, msg);
+    return responses;
+}
 
-    auto it = mapping.find(name);
-    return it != mapping.end() ? it->second : CommandType::UNKNOWN;
+Responses Command::no(std::string_view msg) const {
+    Responses responses(get_allocator());
+    response::no(responses, tag, msg);
+    return responses;
+}
+
+Responses Command::bad(std::string_view msg) const {
+    Responses responses(get_allocator());
+    response::bad(responses, tag, msg);
+    return responses;
+}
+
+CommandType Command::string_to_type(std::string_view name) {
+    const auto& entry = command_table.slots[command_slot(name)];
+    return entry.name == name ? entry.type : CommandType::UNKNOWN;
 }
 
 std::string Command::type_to_string(CommandType type) {
@@ -63,6 +613,7 @@ std::string Command::type_to_string(CommandType type) {
         case CommandType::CAPABILITY: return "CAPABILITY";
         case CommandType::NOOP: return "NOOP";
         case CommandType::LOGOUT: return "LOGOUT";
+        case CommandType::ENABLE: return "ENABLE";
         case CommandType::STARTTLS: return "STARTTLS";
         case CommandType::AUTHENTICATE: return "AUTHENTICATE";
         case CommandType::LOGIN: return "LOGIN";
@@ -77,6 +628,8 @@ std::string Command::type_to_string(CommandType type) {
         case CommandType::LSUB: return "LSUB";
         case CommandType::STATUS: return "STATUS";
         case CommandType::APPEND: return "APPEND";
+        case CommandType::IDLE: return "IDLE";
+        case CommandType::COMPRESS: return "COMPRESS";
         case CommandType::CHECK: return "CHECK";
         case CommandType::CLOSE: return "CLOSE";
         case CommandType::EXPUNGE: return "EXPUNGE";
@@ -98,6 +651,7 @@ CommandHandler::CommandHandler() {
     handlers_[CommandType::CAPABILITY] = handle_capability;
     handlers_[CommandType::NOOP] = handle_noop;
     handlers_[CommandType::LOGOUT] = handle_logout;
+    handlers_[CommandType::ENABLE] = handle_enable;
     handlers_[CommandType::STARTTLS] = handle_starttls;
     handlers_[CommandType::LOGIN] = handle_login;
     handlers_[CommandType::SELECT] = handle_select;
@@ -109,6 +663,8 @@ CommandHandler::CommandHandler() {
     handlers_[CommandType::LSUB] = handle_lsub;
     handlers_[CommandType::STATUS] = handle_status;
     handlers_[CommandType::APPEND] = handle_append;
+    handlers_[CommandType::IDLE] = handle_idle;
+    handlers_[CommandType::COMPRESS] = handle_compress;
     handlers_[CommandType::CHECK] = handle_check;
     handlers_[CommandType::CLOSE] = handle_close;
     handlers_[CommandType::EXPUNGE] = handle_expunge;
@@ -117,85 +673,128 @@ CommandHandler::CommandHandler() {
     handlers_[CommandType::STORE] = handle_store;
     handlers_[CommandType::COPY] = handle_copy;
     handlers_[CommandType::UID] = handle_uid;
+
+    for (size_t i = 0; i < latency_.size(); ++i) {
+        latency_[i] = &Metrics::instance().histogram(
+            "email_command_duration_seconds", "Time spent executing client commands",
+            {{"protocol", "imap"}, {"command", Command::type_to_string(static_cast<CommandType>(i))}});
+    }
 }
 
 void CommandHandler::register_handler(CommandType type, Handler handler) {
     handlers_[type] = std::move(handler);
 }
 
-std::vector<std::string> CommandHandler::execute(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::execute(IMAPSession& session, const Command& cmd) {
     auto it = handlers_.find(cmd.type);
     if (it != handlers_.end()) {
+        ScopedTimer timer(*latency_[static_cast<size_t>(cmd.type)]);
         return it->second(session, cmd);
     }
-    return {response::bad(cmd.tag, "Unknown command")};
+    return cmd.bad("Unknown command");
 }
 
-std::vector<std::string> CommandHandler::handle_capability(IMAPSession& session, const Command& cmd) {
-    std::vector<std::string> responses;
+Responses CommandHandler::handle_capability(IMAPSession& session, const Command& cmd) {
+    Responses responses(cmd.get_allocator());
 
-    std::string caps = "CAPABILITY IMAP4rev1 AUTH=PLAIN AUTH=LOGIN";
+    std::string caps = "CAPABILITY IMAP4rev1 LITERAL+ AUTH=PLAIN AUTH=LOGIN";
 
     if (session.starttls_available()) {
         caps += " STARTTLS";
     }
 
+    if (session.idle_enabled()) {
+        caps += " IDLE";
+    }
+
     if (session.state() == SessionState::AUTHENTICATED ||
         session.state() == SessionState::SELECTED) {
-        caps += " CHILDREN NAMESPACE";
+        caps += " CHILDREN NAMESPACE ENABLE CONDSTORE QRESYNC";
+        if (session.compression_available()) {
+            caps += " COMPRESS=DEFLATE";
+        }
     }
 
-    responses.push_back(response::untagged(caps));
-    responses.push_back(response::ok(cmd.tag, "CAPABILITY completed"));
+    responses.push_back(response::untagged(caps, responses.get_allocator()));
+    response::ok(responses, cmd.tag, "CAPABILITY completed");
 
     return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_noop(IMAPSession& /* session */, const Command& cmd) {
-    return {response::ok(cmd.tag, "NOOP completed")};
+Responses CommandHandler::handle_noop(IMAPSession& session, const Command& cmd) {
+    Responses responses(cmd.get_allocator());
+    if (session.state() == SessionState::SELECTED) {
+        session.report_changes(responses);
+    }
+    response::ok(responses, cmd.tag, "NOOP completed");
+    return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_logout(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_logout(IMAPSession& session, const Command& cmd) {
     session.set_state(SessionState::LOGOUT);
-    return {
-        response::bye("Logging out"),
-        response::ok(cmd.tag, "LOGOUT completed")
-    };
+    Responses responses(cmd.get_allocator());
+    responses.push_back(response::bye("Logging out", responses.get_allocator()));
+    response::ok(responses, cmd.tag, "LOGOUT completed");
+    return responses;
+}
+
+Responses CommandHandler::handle_enable(IMAPSession& session, const Command& cmd) {
+    if (session.state() != SessionState::AUTHENTICATED &&
+        session.state() != SessionState::SELECTED) {
+        return cmd.bad("Not authenticated");
+    }
+
+    // ENABLED lists what this command turned on; the rest is ignored.
+    Responses responses(cmd.get_allocator());
+    response::untagged(responses, "ENABLED");
+    std::string_view rest = cmd.arguments;
+    for (auto name = IMAPParser::next_token(rest); !name.empty();
+         name = IMAPParser::next_token(rest)) {
+        const auto upper = to_upper(name);
+        if (upper == "CONDSTORE" && !session.condstore_enabled()) {
+            session.enable_condstore();
+            responses.back() += " CONDSTORE";
+        } else if (upper == "QRESYNC" && !session.qresync_enabled()) {
+            session.enable_qresync();
+            responses.back() += " QRESYNC";
+        }
+    }
+    response::ok(responses, cmd.tag, "ENABLE completed");
+    return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_starttls(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_starttls(IMAPSession& session, const Command& cmd) {
 #ifdef ENABLE_TLS
     if (session.is_tls()) {
-        return {response::bad(cmd.tag, "Already using TLS")};
+        return cmd.bad("Already using TLS");
     }
 
     if (session.state() != SessionState::NOT_AUTHENTICATED) {
-        return {response::bad(cmd.tag, "STARTTLS only allowed before authentication")};
+        return cmd.bad("STARTTLS only allowed before authentication");
     }
 
     auto* ssl_ctx = session.ssl_context();
     if (!ssl_ctx) {
-        return {response::no(cmd.tag, "TLS not configured")};
+        return cmd.no("TLS not configured");
     }
 
     // Send response before TLS handshake
-    session.send_line(response::ok(cmd.tag, "Begin TLS negotiation"));
+    session.send_line(std::string(response::ok(cmd.tag, "Begin TLS negotiation")));
     session.start_tls(*ssl_ctx);
 
     return {};  // Response already sent
 #else
     (void)session;
-    return {response::no(cmd.tag, "TLS not supported")};
+    return cmd.no("TLS not supported");
 #endif
 }
 
-std::vector<std::string> CommandHandler::handle_login(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_login(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::NOT_AUTHENTICATED) {
-        return {response::bad(cmd.tag, "Already authenticated")};
+        return cmd.bad("Already authenticated");
     }
 
     // Parse username and password
-    std::istringstream iss(cmd.arguments);
     std::string username, password;
 
     size_t pos = 0;
@@ -204,113 +803,37 @@ std::vector<std::string> CommandHandler::handle_login(IMAPSession& session, cons
 
     if (!user_opt || !pass_opt) {
         // Try simple space-separated
-        iss >> username >> password;
+        std::string_view rest = cmd.arguments;
+        username = IMAPParser::next_token(rest);
+        password = IMAPParser::next_token(rest);
     } else {
         username = *user_opt;
         password = *pass_opt;
     }
 
     if (username.empty() || password.empty()) {
-        return {response::bad(cmd.tag, "Missing username or password")};
-    }
-
-    if (session.authenticator().authenticate(username, password)) {
-        session.set_authenticated(true);
-        auto [user, domain] = Authenticator::parse_email(username);
-        session.set_username(user);
-        session.set_domain(domain);
-
-        if (!session.open_maildir()) {
-            return {response::no(cmd.tag, "Unable to open mailbox")};
-        }
-
-        session.set_state(SessionState::AUTHENTICATED);
-        return {response::ok(cmd.tag, "LOGIN completed")};
+        return cmd.bad("Missing username or password");
     }
 
-    return {response::no(cmd.tag, "[AUTHENTICATIONFAILED] Authentication failed")};
+    session.login(std::string(cmd.tag), std::move(username), std::move(password));
+    return {};  // Replied once verified
 }
 
-std::vector<std::string> CommandHandler::handle_select(IMAPSession& session, const Command& cmd) {
-    if (session.state() != SessionState::AUTHENTICATED &&
-        session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
-    }
-
-    std::string mailbox = cmd.arguments;
-    // Remove quotes if present
-    if (!mailbox.empty() && mailbox.front() == '"') {
-        size_t pos = 0;
-        auto parsed = IMAPParser::parse_string(cmd.arguments, pos);
-        if (parsed) mailbox = *parsed;
-    }
-
-    if (mailbox.empty()) {
-        return {response::bad(cmd.tag, "Mailbox name required")};
-    }
-
-    if (!session.select_mailbox(mailbox, false)) {
-        return {response::no(cmd.tag, "Mailbox does not exist")};
-    }
-
-    auto* selected = session.selected_mailbox();
-    if (!selected) {
-        return {response::no(cmd.tag, "Failed to select mailbox")};
-    }
-
-    std::vector<std::string> responses;
-    responses.push_back(response::untagged(std::to_string(selected->exists) + " EXISTS"));
-    responses.push_back(response::untagged(std::to_string(selected->recent) + " RECENT"));
-
-    if (selected->unseen > 0) {
-        responses.push_back(response::untagged("OK [UNSEEN " + std::to_string(selected->unseen) + "]"));
-    }
-
-    responses.push_back(response::untagged("OK [UIDVALIDITY " + std::to_string(selected->uid_validity) + "]"));
-    responses.push_back(response::untagged("OK [UIDNEXT " + std::to_string(selected->uid_next) + "]"));
-    responses.push_back(response::untagged("FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)"));
-    responses.push_back(response::untagged("OK [PERMANENTFLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft \\*)]"));
-
-    responses.push_back(response::ok(cmd.tag, "[READ-WRITE] SELECT completed"));
-
-    return responses;
+Responses CommandHandler::handle_select(IMAPSession& session, const Command& cmd) {
+    return open_mailbox(session, cmd, false);
 }
 
-std::vector<std::string> CommandHandler::handle_examine(IMAPSession& session, const Command& cmd) {
-    if (session.state() != SessionState::AUTHENTICATED &&
-        session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
-    }
-
-    std::string mailbox = cmd.arguments;
-    if (!mailbox.empty() && mailbox.front() == '"') {
-        size_t pos = 0;
-        auto parsed = IMAPParser::parse_string(cmd.arguments, pos);
-        if (parsed) mailbox = *parsed;
-    }
-
-    if (!session.select_mailbox(mailbox, true)) {
-        return {response::no(cmd.tag, "Mailbox does not exist")};
-    }
-
-    auto* selected = session.selected_mailbox();
-    std::vector<std::string> responses;
-    responses.push_back(response::untagged(std::to_string(selected->exists) + " EXISTS"));
-    responses.push_back(response::untagged(std::to_string(selected->recent) + " RECENT"));
-    responses.push_back(response::untagged("FLAGS (\\Answered \\Flagged \\Deleted \\Seen \\Draft)"));
-
-    responses.push_back(response::ok(cmd.tag, "[READ-ONLY] EXAMINE completed"));
-
-    return responses;
+Responses CommandHandler::handle_examine(IMAPSession& session, const Command& cmd) {
+    return open_mailbox(session, cmd, true);
 }
 
-std::vector<std::string> CommandHandler::handle_create(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_create(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHENTICATED &&
         session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
+        return cmd.bad("Not authenticated");
     }
 
-    std::string mailbox = cmd.arguments;
+    std::string mailbox(cmd.arguments);
     if (!mailbox.empty() && mailbox.front() == '"') {
         size_t pos = 0;
         auto parsed = IMAPParser::parse_string(cmd.arguments, pos);
@@ -318,19 +841,19 @@ std::vector<std::string> CommandHandler::handle_create(IMAPSession& session, con
     }
 
     if (session.maildir()->create_mailbox(mailbox)) {
-        return {response::ok(cmd.tag, "CREATE completed")};
+        return cmd.ok("CREATE completed");
     }
 
-    return {response::no(cmd.tag, "Failed to create mailbox")};
+    return cmd.no("Failed to create mailbox");
 }
 
-std::vector<std::string> CommandHandler::handle_delete(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_delete(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHENTICATED &&
         session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
+        return cmd.bad("Not authenticated");
     }
 
-    std::string mailbox = cmd.arguments;
+    std::string mailbox(cmd.arguments);
     if (!mailbox.empty() && mailbox.front() == '"') {
         size_t pos = 0;
         auto parsed = IMAPParser::parse_string(cmd.arguments, pos);
@@ -338,16 +861,16 @@ std::vector<std::string> CommandHandler::handle_delete(IMAPSession& session, con
     }
 
     if (session.maildir()->delete_mailbox(mailbox)) {
-        return {response::ok(cmd.tag, "DELETE completed")};
+        return cmd.ok("DELETE completed");
     }
 
-    return {response::no(cmd.tag, "Failed to delete mailbox")};
+    return cmd.no("Failed to delete mailbox");
 }
 
-std::vector<std::string> CommandHandler::handle_rename(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_rename(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHENTICATED &&
         session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
+        return cmd.bad("Not authenticated");
     }
 
     size_t pos = 0;
@@ -355,20 +878,20 @@ std::vector<std::string> CommandHandler::handle_rename(IMAPSession& session, con
     auto new_name = IMAPParser::parse_string(cmd.arguments, pos);
 
     if (!old_name || !new_name) {
-        return {response::bad(cmd.tag, "Usage: RENAME old-name new-name")};
+        return cmd.bad("Usage: RENAME old-name new-name");
     }
 
     if (session.maildir()->rename_mailbox(*old_name, *new_name)) {
-        return {response::ok(cmd.tag, "RENAME completed")};
+        return cmd.ok("RENAME completed");
     }
 
-    return {response::no(cmd.tag, "Failed to rename mailbox")};
+    return cmd.no("Failed to rename mailbox");
 }
 
-std::vector<std::string> CommandHandler::handle_list(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_list(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHENTICATED &&
         session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
+        return cmd.bad("Not authenticated");
     }
 
     size_t pos = 0;
@@ -380,331 +903,488 @@ std::vector<std::string> CommandHandler::handle_list(IMAPSession& session, const
 
     auto mailboxes = session.list_mailboxes(ref, pat);
 
-    std::vector<std::string> responses;
+    Responses responses(cmd.get_allocator());
     for (const auto& mbox : mailboxes) {
-        std::string flags = "()";
+        std::string_view flags = "()";
         if (mbox == "INBOX") {
             flags = "(\\HasNoChildren)";
         }
-        responses.push_back(response::untagged("LIST " + flags + " \"/\" " + IMAPParser::quote_string(mbox)));
+        response::untagged(responses, "LIST {} \"/\" {}", flags, IMAPParser::quote_string(mbox));
     }
 
-    responses.push_back(response::ok(cmd.tag, "LIST completed"));
+    response::ok(responses, cmd.tag, "LIST completed");
     return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_lsub(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_lsub(IMAPSession& session, const Command& cmd) {
     // LSUB is like LIST but for subscribed mailboxes
     // For simplicity, return same as LIST
     return handle_list(session, cmd);
 }
 
-std::vector<std::string> CommandHandler::handle_status(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_status(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHENTICATED &&
         session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
+        return cmd.bad("Not authenticated");
     }
 
     size_t pos = 0;
     auto mailbox = IMAPParser::parse_string(cmd.arguments, pos);
     if (!mailbox) {
-        return {response::bad(cmd.tag, "Mailbox name required")};
+        return cmd.bad("Mailbox name required");
     }
 
     auto info = session.maildir()->get_mailbox_info(*mailbox);
     if (!info) {
-        return {response::no(cmd.tag, "Mailbox does not exist")};
+        return cmd.no("Mailbox does not exist");
     }
 
-    std::ostringstream oss;
-    oss << "STATUS " << IMAPParser::quote_string(*mailbox) << " (";
-    oss << "MESSAGES " << info->total_messages << " ";
-    oss << "RECENT " << info->recent_messages << " ";
-    oss << "UNSEEN " << info->unseen_messages << " ";
-    oss << "UIDVALIDITY " << info->uid_validity << " ";
-    oss << "UIDNEXT " << info->uid_next;
-    oss << ")";
+    Responses responses(cmd.get_allocator());
+    response::untagged(responses, "STATUS {} (MESSAGES {} RECENT {} UNSEEN {} UIDVALIDITY {} UIDNEXT {}",
+                       IMAPParser::quote_string(*mailbox), info->total_messages,
+                       info->recent_messages, info->unseen_messages,
+                       info->uid_validity, info->uid_next);
+    if (to_upper(std::string_view(cmd.arguments).substr(pos)).find("HIGHESTMODSEQ") !=
+        std::string::npos) {
+        session.enable_condstore();
+        std::format_to(std::back_inserter(responses.back()), " HIGHESTMODSEQ {}",
+                       info->highest_modseq);
+    }
+    responses.back() += ')';
+    response::ok(responses, cmd.tag, "STATUS completed");
+    return responses;
+}
 
-    return {
-        response::untagged(oss.str()),
-        response::ok(cmd.tag, "STATUS completed")
-    };
+Responses CommandHandler::handle_append(IMAPSession& session, const Command& cmd) {
+    if (session.state() != SessionState::AUTHENTICATED &&
+        session.state() != SessionState::SELECTED) {
+        return cmd.bad("Not authenticated");
+    }
+
+    // mailbox [flag-list] [date-time] literal; the date is not kept.
+    std::string_view args = cmd.arguments;
+    size_t pos = 0;
+    auto mailbox = IMAPParser::parse_string(args, pos);
+    if (!mailbox) {
+        return cmd.bad("Mailbox name required");
+    }
+    std::set<std::string> flags;
+    args.remove_prefix(pos);
+    args = trim_leading_space(args);
+    if (!args.empty() && args.front() == '(') {
+        const auto close = args.find(')');
+        if (close == std::string_view::npos) {
+            return cmd.bad("Invalid flag list");
+        }
+        flags = IMAPParser::parse_flag_list(args.substr(0, close + 1));
+        args = trim_leading_space(args.substr(close + 1));
+    }
+    pos = 0;
+    if (!args.empty() && args.front() == '"') {
+        IMAPParser::parse_string(args, pos);
+        args = trim_leading_space(args.substr(pos));
+        pos = 0;
+    }
+    if (args.empty() || args.front() != '{') {
+        return cmd.bad("Message literal required");
+    }
+    auto content = IMAPParser::parse_string(args, pos);
+    if (!content) {
+        return cmd.bad("Invalid literal");
+    }
+
+    if (!session.maildir()->get_mailbox_info(*mailbox)) {
+        return cmd.no("[TRYCREATE] Mailbox does not exist");
+    }
+    if (!session.append_message(*mailbox, *content, flags)) {
+        return cmd.no("APPEND failed");
+    }
+
+    Responses responses(cmd.get_allocator());
+    if (session.state() == SessionState::SELECTED) {
+        session.report_changes(responses);
+    }
+    response::ok(responses, cmd.tag, "APPEND completed");
+    return responses;
+}
+
+Responses CommandHandler::handle_idle(IMAPSession& session, const Command& cmd) {
+    if (!session.idle_enabled()) {
+        return cmd.bad("IDLE not enabled");
+    }
+    if (session.state() != SessionState::AUTHENTICATED &&
+        session.state() != SessionState::SELECTED) {
+        return cmd.bad("Not authenticated");
+    }
+
+    // The tagged reply waits for DONE; see IMAPSession::finish_idle().
+    Responses responses(cmd.get_allocator());
+    responses.emplace_back("+ idling");
+    session.report_changes(responses);
+    session.start_idle(cmd.tag);
+    return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_append(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_compress(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHENTICATED &&
         session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "Not authenticated")};
+        return cmd.bad("Not authenticated");
+    }
+    std::string_view rest = cmd.arguments;
+    const auto mechanism = to_upper(IMAPParser::next_token(rest));
+    if (mechanism != "DEFLATE" || !IMAPParser::next_token(rest).empty()) {
+        return cmd.bad("Unsupported compression mechanism");
+    }
+    if (session.compressing()) {
+        return cmd.no("[COMPRESSIONACTIVE] DEFLATE active via COMPRESS");
+    }
+    if (!session.compression_available()) {
+        return cmd.no("Compression not available");
     }
 
-    // APPEND requires literal handling which is complex
-    // For now, return a basic response
-    return {response::no(cmd.tag, "APPEND not yet implemented")};
+    auto codec = session.create_codec();
+    if (!codec) {
+        return cmd.no("Cannot start compression");
+    }
+    // The reply is the last thing sent uncompressed.
+    session.send_line(std::string(response::ok(cmd.tag, "DEFLATE active")));
+    session.start_compression(std::move(codec));
+    return {};
 }
 
-std::vector<std::string> CommandHandler::handle_check(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_check(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
-    return {response::ok(cmd.tag, "CHECK completed")};
+    Responses responses(cmd.get_allocator());
+    session.report_changes(responses);
+    response::ok(responses, cmd.tag, "CHECK completed");
+    return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_close(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_close(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
     session.expunge();
     session.close_mailbox();
 
-    return {response::ok(cmd.tag, "CLOSE completed")};
+    return cmd.ok("CLOSE completed");
 }
 
-std::vector<std::string> CommandHandler::handle_expunge(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_expunge(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
-    auto deleted = session.expunge();
-
-    std::vector<std::string> responses;
-    for (uint32_t seq : deleted) {
-        responses.push_back(response::untagged(std::to_string(seq) + " EXPUNGE"));
-    }
-
-    responses.push_back(response::ok(cmd.tag, "EXPUNGE completed"));
+    Responses responses(cmd.get_allocator());
+    session.expunge(&responses);
+    response::ok(responses, cmd.tag, "EXPUNGE completed");
     return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_search(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_search(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
-    auto criteria = IMAPParser::parse_search_criteria(cmd.arguments);
-    auto results = session.search(criteria, false);
+    auto criteria = IMAPParser::parse_search_criteria(cmd.arguments, cmd.get_allocator());
+    auto results = session.search(criteria, cmd.uid);
 
-    std::ostringstream oss;
-    oss << "SEARCH";
-    for (uint32_t seq : results) {
-        oss << " " << seq;
+    Responses responses(cmd.get_allocator());
+    response::untagged(responses, "SEARCH");
+    auto out = std::back_inserter(responses.back());
+    for (uint32_t number : results) {
+        std::format_to(out, " {}", number);
     }
 
-    return {
-        response::untagged(oss.str()),
-        response::ok(cmd.tag, "SEARCH completed")
-    };
+    // A MODSEQ search reports the highest mod-sequence among the matches.
+    if (uses_modseq(criteria)) {
+        session.enable_condstore();
+        const auto& messages = session.messages();
+        uint64_t highest = 0;
+        for (uint32_t number : results) {
+            auto row = cmd.uid ? messages.find_uid(number) : std::optional<size_t>(number - 1);
+            if (row) highest = std::max(highest, messages.modseq(*row));
+        }
+        if (!results.empty()) {
+            std::format_to(out, " (MODSEQ {})", highest);
+        }
+    }
+
+    response::ok(responses, cmd.tag, cmd.uid ? "UID SEARCH completed" : "SEARCH completed");
+    return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_fetch(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_fetch(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
     // Parse sequence set and fetch items
-    std::istringstream iss(cmd.arguments);
-    std::string seq_str, items_str;
-    iss >> seq_str;
-    std::getline(iss >> std::ws, items_str);
+    std::string_view items_str = cmd.arguments;
+    auto seq_str = IMAPParser::next_token(items_str);
 
     auto seq_set = IMAPParser::parse_sequence_set(seq_str);
     if (!seq_set) {
-        return {response::bad(cmd.tag, "Invalid sequence set")};
+        return cmd.bad("Invalid sequence set");
     }
 
-    auto items = IMAPParser::parse_fetch_items(items_str);
-
-    std::vector<std::string> responses;
+    auto modifiers = IMAPParser::split_fetch_modifiers(items_str);
+    if (!modifiers ||
+        (modifiers->vanished &&
+         (!cmd.uid || !modifiers->changed_since || !session.qresync_enabled()))) {
+        return cmd.bad("Invalid FETCH modifiers");
+    }
 
-    for (const auto& msg : session.messages()) {
-        if (!seq_set->contains(msg.sequence_number)) {
-            continue;
+    auto items = IMAPParser::parse_fetch_items(items_str, cmd.get_allocator());
+    // The macros stand for the items they abbreviate.
+    if (items.size() == 1 && (items[0].type == FetchItem::Type::ALL ||
+                              items[0].type == FetchItem::Type::FAST ||
+                              items[0].type == FetchItem::Type::FULL)) {
+        const auto macro = items[0].type;
+        items.clear();
+        for (auto type : {FetchItem::Type::FLAGS, FetchItem::Type::INTERNALDATE,
+                          FetchItem::Type::RFC822_SIZE, FetchItem::Type::ENVELOPE,
+                          FetchItem::Type::BODY}) {
+            if ((type == FetchItem::Type::ENVELOPE && macro == FetchItem::Type::FAST) ||
+                (type == FetchItem::Type::BODY && macro != FetchItem::Type::FULL)) {
+                continue;
+            }
+            items.emplace_back().type = type;
         }
+    }
+    auto requested = [&items](FetchItem::Type type) {
+        return std::any_of(items.begin(), items.end(),
+                           [type](const FetchItem& item) { return item.type == type; });
+    };
+    // UID FETCH always answers with UIDs, CHANGEDSINCE with mod-sequences.
+    if (cmd.uid && !requested(FetchItem::Type::UID)) {
+        items.emplace(items.begin())->type = FetchItem::Type::UID;
+    }
+    if (modifiers->changed_since && !requested(FetchItem::Type::MODSEQ)) {
+        items.emplace_back().type = FetchItem::Type::MODSEQ;
+    }
+    if (requested(FetchItem::Type::MODSEQ)) {
+        session.enable_condstore();
+    }
 
-        std::ostringstream oss;
-        oss << msg.sequence_number << " FETCH (";
-
-        bool first = true;
-        for (const auto& item : items) {
-            if (!first) oss << " ";
-            first = false;
-
-            switch (item.type) {
-                case FetchItem::Type::FLAGS:
-                    oss << "FLAGS " << IMAPParser::format_flags(msg.flags);
-                    break;
-                case FetchItem::Type::UID:
-                    oss << "UID " << msg.uid;
-                    break;
-                case FetchItem::Type::RFC822_SIZE:
-                    oss << "RFC822.SIZE " << msg.size;
-                    break;
-                case FetchItem::Type::INTERNALDATE:
-                    oss << "INTERNALDATE " << IMAPParser::format_internal_date(msg.internal_date);
-                    break;
-                case FetchItem::Type::RFC822:
-                case FetchItem::Type::BODY:
-                case FetchItem::Type::BODY_PEEK: {
-                    auto content = session.get_message_content(msg.sequence_number);
-                    if (content) {
-                        oss << "BODY[] {" << content->size() << "}\r\n" << *content;
-                    }
-                    break;
-                }
-                case FetchItem::Type::RFC822_HEADER: {
-                    auto headers = session.get_message_headers(msg.sequence_number);
-                    if (headers) {
-                        oss << "RFC822.HEADER {" << headers->size() << "}\r\n" << *headers;
-                    }
-                    break;
-                }
-                default:
-                    break;
+    const auto& messages = session.messages();
+    auto rows = rows_of(messages, *seq_set, cmd.uid);
+    Responses responses(cmd.get_allocator());
+    if (modifiers->changed_since) {
+        const uint64_t since = *modifiers->changed_since;
+        std::erase_if(rows, [&](size_t row) { return messages.modseq(row) <= since; });
+        if (modifiers->vanished) {
+            const uint32_t uid_next = session.selected_mailbox()->uid_next;
+            auto vanished = session.vanished_since(
+                since, seq_set->normalized(uid_next > 0 ? uid_next - 1 : 0));
+            if (!vanished.ranges.empty()) {
+                response::untagged(responses, "VANISHED (EARLIER) ");
+                vanished.append_to(responses.back());
             }
         }
+    }
 
-        oss << ")";
-        responses.push_back(response::untagged(oss.str()));
+    // Fetching a body sets \\Seen, in one batch up front; the messages
+    // that change report their flags.
+    std::vector<uint32_t> seen;
+    const bool reads_body = std::any_of(items.begin(), items.end(), [](const FetchItem& item) {
+        return item.type == FetchItem::Type::RFC822 || item.type == FetchItem::Type::RFC822_TEXT ||
+               (item.type == FetchItem::Type::BODY && item.has_section);
+    });
+    if (reads_body && !session.selected_mailbox()->read_only) {
+        std::vector<uint32_t> unseen;
+        for (size_t row : rows) {
+            if (!(messages.flags(row) & system_flag::seen)) {
+                unseen.push_back(static_cast<uint32_t>(row + 1));
+            }
+        }
+        if (!unseen.empty()) {
+            seen = session.store_flags(unseen, FlagChange::Mode::Add, {"\\Seen"});
+        }
     }
 
-    responses.push_back(response::ok(cmd.tag, "FETCH completed"));
-    return responses;
+    // One message at a time goes to the session. Once its output backs up,
+    // the rest continues from IMAPSession::on_write_drained(), by when the
+    // command's arena is gone; hence the owned copies.
+    struct Fetch {
+        std::string tag;
+        std::string completed;
+        std::vector<size_t> rows;
+        std::vector<FetchItem> items;
+        std::vector<uint32_t> seen;
+        size_t next = 0;
+    };
+    auto fetch = std::make_shared<Fetch>(
+        Fetch{std::string(cmd.tag), cmd.uid ? "UID FETCH completed" : "FETCH completed",
+              std::move(rows), std::vector<FetchItem>(items.begin(), items.end()),
+              std::move(seen)});
+    session.send_responses(responses);
+    auto resume = [&session, fetch]() {
+        Responses responses;
+        while (fetch->next < fetch->rows.size()) {
+            const size_t row = fetch->rows[fetch->next++];
+            const auto seq = static_cast<uint32_t>(row + 1);
+            fetch_message(session, row, fetch->items,
+                          std::binary_search(fetch->seen.begin(), fetch->seen.end(), seq),
+                          responses);
+            session.send_responses(responses);
+            responses.clear();
+            if (session.write_backlogged()) {
+                return false;
+            }
+        }
+        response::ok(responses, fetch->tag, fetch->completed);
+        session.send_responses(responses);
+        return true;
+    };
+    if (!resume()) {
+        session.defer(std::move(resume));
+    }
+    return Responses(cmd.get_allocator());
 }
 
-std::vector<std::string> CommandHandler::handle_store(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_store(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
-    std::istringstream iss(cmd.arguments);
-    std::string seq_str, action_str;
-    iss >> seq_str;
-    std::getline(iss >> std::ws, action_str);
+    std::string_view action_str = cmd.arguments;
+    auto seq_str = IMAPParser::next_token(action_str);
 
     auto seq_set = IMAPParser::parse_sequence_set(seq_str);
     if (!seq_set) {
-        return {response::bad(cmd.tag, "Invalid sequence set")};
+        return cmd.bad("Invalid sequence set");
+    }
+
+    std::optional<uint64_t> unchanged_since;
+    if (!IMAPParser::take_unchanged_since(action_str, unchanged_since)) {
+        return cmd.bad("Invalid STORE modifier");
+    }
+    if (unchanged_since) {
+        session.enable_condstore();
     }
 
     auto action = IMAPParser::parse_store_action(action_str);
     if (!action) {
-        return {response::bad(cmd.tag, "Invalid STORE action")};
+        return cmd.bad("Invalid STORE action");
     }
 
-    std::vector<std::string> responses;
+    Responses responses(cmd.get_allocator());
     bool silent = (action->type == StoreAction::Type::FLAGS_SILENT ||
                    action->type == StoreAction::Type::PLUS_FLAGS_SILENT ||
                    action->type == StoreAction::Type::MINUS_FLAGS_SILENT);
 
-    for (const auto& msg : session.messages()) {
-        if (!seq_set->contains(msg.sequence_number)) {
-            continue;
-        }
+    FlagChange::Mode mode = FlagChange::Mode::Replace;
+    switch (action->type) {
+        case StoreAction::Type::FLAGS:
+        case StoreAction::Type::FLAGS_SILENT:
+            mode = FlagChange::Mode::Replace;
+            break;
+        case StoreAction::Type::PLUS_FLAGS:
+        case StoreAction::Type::PLUS_FLAGS_SILENT:
+            mode = FlagChange::Mode::Add;
+            break;
+        case StoreAction::Type::MINUS_FLAGS:
+        case StoreAction::Type::MINUS_FLAGS_SILENT:
+            mode = FlagChange::Mode::Remove;
+            break;
+    }
 
-        switch (action->type) {
-            case StoreAction::Type::FLAGS:
-            case StoreAction::Type::FLAGS_SILENT:
-                session.set_flags(msg.sequence_number, action->flags);
-                break;
-            case StoreAction::Type::PLUS_FLAGS:
-            case StoreAction::Type::PLUS_FLAGS_SILENT:
-                session.add_flags(msg.sequence_number, action->flags);
-                break;
-            case StoreAction::Type::MINUS_FLAGS:
-            case StoreAction::Type::MINUS_FLAGS_SILENT:
-                session.remove_flags(msg.sequence_number, action->flags);
-                break;
-        }
+    std::vector<uint32_t> seqs;
+    for (size_t row : rows_of(session.messages(), *seq_set, cmd.uid)) {
+        seqs.push_back(static_cast<uint32_t>(row + 1));
+    }
 
-        if (!silent) {
-            auto updated = session.get_message_by_sequence(msg.sequence_number);
-            if (updated) {
-                responses.push_back(response::untagged(
-                    std::to_string(msg.sequence_number) + " FETCH (FLAGS " +
-                    IMAPParser::format_flags(updated->flags) + ")"
-                ));
-            }
+    // One batch for the whole set; the answers come from the updated cache.
+    // Once CONDSTORE is on, even a silent STORE reports the mod-sequences.
+    std::vector<uint32_t> modified;
+    auto updated = session.store_flags(seqs, mode, action->flags, unchanged_since, &modified);
+    if (!silent || session.condstore_enabled()) {
+        for (uint32_t seq : updated) {
+            session.append_flag_update(responses, seq - 1, cmd.uid, !silent);
         }
     }
 
-    responses.push_back(response::ok(cmd.tag, "STORE completed"));
+    if (!modified.empty()) {
+        SequenceSet set;
+        for (uint32_t seq : modified) {
+            set.push_back(cmd.uid ? session.messages().uid(seq - 1) : seq);
+        }
+        std::pmr::string text("[MODIFIED ", responses.get_allocator());
+        set.append_to(text);
+        text += "] Conditional STORE failed";
+        response::ok(responses, cmd.tag, text);
+        return responses;
+    }
+    response::ok(responses, cmd.tag, "STORE completed");
     return responses;
 }
 
-std::vector<std::string> CommandHandler::handle_copy(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_copy(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
+    std::string_view rest = cmd.arguments;
+    auto seq_str = IMAPParser::next_token(rest);
     size_t pos = 0;
-    auto seq_str_opt = IMAPParser::parse_atom(cmd.arguments, pos);
-    auto mailbox = IMAPParser::parse_string(cmd.arguments, pos);
+    auto mailbox = IMAPParser::parse_string(rest, pos);
 
-    if (!seq_str_opt || !mailbox) {
-        return {response::bad(cmd.tag, "Usage: COPY sequence mailbox")};
+    if (seq_str.empty() || !mailbox) {
+        return cmd.bad("Usage: COPY sequence mailbox");
     }
 
-    auto seq_set = IMAPParser::parse_sequence_set(*seq_str_opt);
+    auto seq_set = IMAPParser::parse_sequence_set(seq_str);
     if (!seq_set) {
-        return {response::bad(cmd.tag, "Invalid sequence set")};
+        return cmd.bad("Invalid sequence set");
     }
 
     auto* selected = session.selected_mailbox();
     if (!selected) {
-        return {response::no(cmd.tag, "No mailbox selected")};
+        return cmd.no("No mailbox selected");
     }
 
-    for (const auto& msg : session.messages()) {
-        if (seq_set->contains(msg.sequence_number)) {
-            session.maildir()->copy_message(msg.unique_id, selected->name, *mailbox);
-        }
+    std::vector<std::string> unique_ids;
+    const auto& messages = session.messages();
+    for (size_t row : rows_of(messages, *seq_set, cmd.uid)) {
+        unique_ids.push_back(messages.unique_id(row));
     }
 
-    return {response::ok(cmd.tag, "COPY completed")};
+    auto copies = session.maildir()->copy_messages(unique_ids, selected->name, *mailbox);
+    if (std::any_of(copies.begin(), copies.end(), [](const auto& copy) { return copy.empty(); })) {
+        return cmd.no("COPY failed");
+    }
+    return cmd.ok("COPY completed");
 }
 
-std::vector<std::string> CommandHandler::handle_uid(IMAPSession& session, const Command& cmd) {
+Responses CommandHandler::handle_uid(IMAPSession& session, const Command& cmd) {
     if (session.state() != SessionState::SELECTED) {
-        return {response::bad(cmd.tag, "No mailbox selected")};
+        return cmd.bad("No mailbox selected");
     }
 
     // UID command wraps another command
-    std::istringstream iss(cmd.arguments);
-    std::string sub_cmd;
-    std::string sub_args;
-    iss >> sub_cmd;
-    std::getline(iss >> std::ws, sub_args);
+    std::string_view sub_args = cmd.arguments;
+    Command wrapped_cmd(cmd.get_allocator());
+    wrapped_cmd.name = IMAPParser::next_token(sub_args);
+    sub_args = trim_leading_space(sub_args);
 
+    auto& sub_cmd = wrapped_cmd.name;
     std::transform(sub_cmd.begin(), sub_cmd.end(), sub_cmd.begin(), ::toupper);
 
-    Command wrapped_cmd;
     wrapped_cmd.tag = cmd.tag;
-    wrapped_cmd.name = sub_cmd;
     wrapped_cmd.arguments = sub_args;
     wrapped_cmd.type = Command::string_to_type(sub_cmd);
+    wrapped_cmd.uid = true;
 
-    if (sub_cmd == "SEARCH") {
-        auto criteria = IMAPParser::parse_search_criteria(sub_args);
-        auto results = session.search(criteria, true);  // Use UIDs
-
-        std::ostringstream oss;
-        oss << "SEARCH";
-        for (uint32_t uid : results) {
-            oss << " " << uid;
-        }
-
-        return {
-            response::untagged(oss.str()),
-            response::ok(cmd.tag, "UID SEARCH completed")
-        };
-    } else if (sub_cmd == "FETCH" || sub_cmd == "STORE" || sub_cmd == "COPY") {
-        // These need UID-based sequence set handling
-        // For simplicity, delegate to regular handlers
+    if (sub_cmd == "SEARCH" || sub_cmd == "FETCH" || sub_cmd == "STORE" || sub_cmd == "COPY") {
         return CommandHandler::instance().execute(session, wrapped_cmd);
     }
 
-    return {response::bad(cmd.tag, "Unknown UID command")};
+    return cmd.bad("Unknown UID command");
 }
 
 }  // namespace email::imap
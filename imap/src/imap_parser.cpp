@@ -1,9 +1,13 @@
 #include "imap_parser.hpp"
 #include <algorithm>
+#include <array>
+#include <charconv>
 #include <sstream>
 #include <cctype>
 #include <iomanip>
 #include <ctime>
+#include <format>
+#include <iterator>
 
 namespace email::imap {
 
@@ -17,35 +21,214 @@ bool SequenceSet::contains(uint32_t num) const {
     return false;
 }
 
-SequenceSet SequenceSet::parse(const std::string& str) {
+SequenceSet SequenceSet::resolved(uint32_t largest) const {
     SequenceSet set;
+    set.ranges.reserve(ranges.size());
+    for (auto range : ranges) {
+        if (range.start == UINT32_MAX) range.start = largest;
+        if (range.end == 0 || range.end == UINT32_MAX) range.end = largest;
+        if (range.start > range.end) std::swap(range.start, range.end);
+        set.ranges.push_back(range);
+    }
+    return set;
+}
 
-    std::istringstream iss(str);
-    std::string token;
+SequenceSet SequenceSet::normalized(uint32_t largest) const {
+    SequenceSet set = resolved(largest);
+    auto& sorted = set.ranges;
+    std::sort(sorted.begin(), sorted.end(),
+              [](const Range& a, const Range& b) { return a.start < b.start; });
+    size_t kept = 0;
+    for (const auto& range : sorted) {
+        if (kept > 0 && uint64_t{sorted[kept - 1].end} + 1 >= range.start) {
+            sorted[kept - 1].end = std::max(sorted[kept - 1].end, range.end);
+        } else {
+            sorted[kept++] = range;
+        }
+    }
+    sorted.resize(kept);
+    return set;
+}
+
+bool SequenceSet::covers(uint32_t num) const {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), num,
+                               [](uint32_t n, const Range& range) { return n < range.start; });
+    return it != ranges.begin() && num <= std::prev(it)->end;
+}
+
+void SequenceSet::push_back(uint32_t first, uint32_t last) {
+    if (!ranges.empty() && ranges.back().end + 1 == first) {
+        ranges.back().end = last;
+    } else {
+        ranges.push_back(Range{first, last});
+    }
+}
+
+void SequenceSet::append_to(std::pmr::string& out) const {
+    auto it = std::back_inserter(out);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        if (i > 0) out += ',';
+        if (ranges[i].start == ranges[i].end) {
+            std::format_to(it, "{}", ranges[i].start);
+        } else {
+            std::format_to(it, "{}:{}", ranges[i].start, ranges[i].end);
+        }
+    }
+}
+
+namespace {
+
+// Character classes for the tokenizer, one byte per character. Whitespace
+// is what isspace() takes in the C locale; atom characters are those of
+// RFC 3501's ATOM-CHAR, plus the 8-bit bytes of UTF-8 mailbox names.
+namespace char_class {
+constexpr uint8_t space = 1 << 0;
+constexpr uint8_t atom = 1 << 1;
+constexpr uint8_t list_wildcard = 1 << 2;
+}  // namespace char_class
+
+constexpr std::array<uint8_t, 256> make_char_classes() {
+    std::array<uint8_t, 256> classes{};
+    for (int c = 0x21; c < 0x7f; ++c) {
+        classes[c] = char_class::atom;
+    }
+    for (int c = 0x80; c < 0x100; ++c) {
+        classes[c] = char_class::atom;
+    }
+    for (unsigned char c : std::string_view("(){\"%*\\[]")) {
+        classes[c] = 0;
+    }
+    for (unsigned char c : std::string_view(" \t\n\v\f\r")) {
+        classes[c] = char_class::space;
+    }
+    classes['%'] = classes['*'] = char_class::list_wildcard;
+    return classes;
+}
+
+constexpr auto char_classes = make_char_classes();
+
+constexpr bool has_class(char c, uint8_t mask) {
+    return (char_classes[static_cast<unsigned char>(c)] & mask) != 0;
+}
+
+static_assert(has_class('A', char_class::atom) && has_class('\xe4', char_class::atom));
+static_assert(!has_class(']', char_class::atom) && !has_class('\x7f', char_class::atom));
+
+void read_list_items(Tokenizer& tokens, IMAPList& list) {
+    for (;;) {
+        const Token token = tokens.next();
+        switch (token.kind) {
+        case Token::Kind::End:
+        case Token::Kind::ListClose:
+            return;
+        case Token::Kind::ListOpen:
+            read_list_items(tokens, std::get<IMAPList>(list.items.emplace_back(IMAPList{})));
+            break;
+        case Token::Kind::Invalid:
+            break;
+        default: {
+            auto& item = std::get<std::string>(list.items.emplace_back(std::string()));
+            Tokenizer::append_value(token, item);
+            break;
+        }
+        }
+    }
+}
+
+// A whole token as a number; nullopt if it is anything else.
+std::optional<uint64_t> parse_number(std::string_view token) {
+    uint64_t value = 0;
+    auto [end, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (token.empty() || ec != std::errc() || end != token.data() + token.size()) {
+        return std::nullopt;
+    }
+    return value;
+}
+
+bool equals_nocase(std::string_view a, std::string_view b) {
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return std::toupper(static_cast<unsigned char>(x)) ==
+               std::toupper(static_cast<unsigned char>(y));
+    });
+}
+
+// Parses a sequence number, "*" included; malformed numbers read as 0, which
+// no message has.
+uint32_t parse_seq_number(std::string_view str, uint32_t star) {
+    if (str == "*") return star;
+    uint32_t value = 0;
+    std::from_chars(str.data(), str.data() + str.size(), value);
+    return value;
+}
+
+// Like IMAPParser::next_token(), but a bracketed section such as
+// BODY[HEADER.FIELDS (FROM TO)] stays in one token.
+std::string_view next_fetch_token(std::string_view& rest) {
+    size_t start = 0;
+    while (start < rest.size() && has_class(rest[start], char_class::space)) {
+        start++;
+    }
+    size_t end = start;
+    int depth = 0;
+    while (end < rest.size() &&
+           (depth > 0 || !has_class(rest[end], char_class::space))) {
+        if (rest[end] == '[') depth++;
+        if (rest[end] == ']' && depth > 0) depth--;
+        end++;
+    }
+    auto token = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return token;
+}
+
+// "<start.count>" after a section.
+std::optional<std::pair<size_t, size_t>> parse_partial(std::string_view text) {
+    if (text.size() < 5 || text.front() != '<' || text.back() != '>') {
+        return std::nullopt;
+    }
+    text = text.substr(1, text.size() - 2);
+    auto dot = text.find('.');
+    if (dot == std::string_view::npos) {
+        return std::nullopt;
+    }
+    size_t start = 0;
+    size_t count = 0;
+    auto first = std::from_chars(text.data(), text.data() + dot, start);
+    auto second = std::from_chars(text.data() + dot + 1, text.data() + text.size(), count);
+    if (first.ec != std::errc() || first.ptr != text.data() + dot ||
+        second.ec != std::errc() || second.ptr != text.data() + text.size()) {
+        return std::nullopt;
+    }
+    return std::make_pair(start, count);
+}
+
+}  // namespace
+
+SequenceSet SequenceSet::parse(std::string_view str) {
+    SequenceSet set;
+
+    while (!str.empty()) {
+        auto comma = str.find(',');
+        auto token = str.substr(0, comma);
+        str.remove_prefix(comma == std::string_view::npos ? str.size() : comma + 1);
 
-    while (std::getline(iss, token, ',')) {
         Range range;
 
         auto colon_pos = token.find(':');
-        if (colon_pos != std::string::npos) {
-            std::string start_str = token.substr(0, colon_pos);
-            std::string end_str = token.substr(colon_pos + 1);
-
-            range.start = (start_str == "*") ? UINT32_MAX : std::stoul(start_str);
-            range.end = (end_str == "*") ? 0 : std::stoul(end_str);
+        if (colon_pos != std::string_view::npos) {
+            range.start = parse_seq_number(token.substr(0, colon_pos), UINT32_MAX);
+            range.end = parse_seq_number(token.substr(colon_pos + 1), 0);
 
             // Normalize: start should be <= end
             if (range.end != 0 && range.start > range.end) {
                 std::swap(range.start, range.end);
             }
+        } else if (token == "*") {
+            range.start = UINT32_MAX;
+            range.end = 0;
         } else {
-            if (token == "*") {
-                range.start = UINT32_MAX;
-                range.end = 0;
-            } else {
-                range.start = std::stoul(token);
-                range.end = range.start;
-            }
+            range.start = parse_seq_number(token, UINT32_MAX);
+            range.end = range.start;
         }
 
         set.ranges.push_back(range);
@@ -54,61 +237,89 @@ SequenceSet SequenceSet::parse(const std::string& str) {
     return set;
 }
 
-bool IMAPParser::parse_command(const std::string& line, std::string& tag,
-                               std::string& command, std::string& arguments) {
-    if (line.empty()) {
-        return false;
-    }
-
-    std::istringstream iss(line);
-
-    // Read tag
-    iss >> tag;
+bool IMAPParser::parse_command(std::string_view line, std::string_view& tag,
+                               std::string_view& command, std::string_view& arguments) {
+    tag = next_token(line);
     if (tag.empty()) {
         return false;
     }
 
-    // Read command
-    iss >> command;
+    command = next_token(line);
     if (command.empty()) {
         return false;
     }
 
-    // Convert command to uppercase
-    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
-
     // Rest is arguments
-    std::getline(iss >> std::ws, arguments);
+    size_t pos = 0;
+    skip_whitespace(line, pos);
+    arguments = line.substr(pos);
 
     return true;
 }
 
-std::optional<SequenceSet> IMAPParser::parse_sequence_set(const std::string& str) {
+std::optional<LiteralPrefix> IMAPParser::literal_at_end(std::string_view line) {
+    if (line.empty() || line.back() != '}') {
+        return std::nullopt;
+    }
+    const auto open = line.rfind('{');
+    if (open == std::string_view::npos) {
+        return std::nullopt;
+    }
+    std::string_view digits = line.substr(open + 1, line.size() - open - 2);
+    LiteralPrefix literal;
+    if (!digits.empty() && digits.back() == '+') {
+        literal.synchronizing = false;
+        digits.remove_suffix(1);
+    }
+    auto size = parse_number(digits);
+    if (!size) {
+        return std::nullopt;
+    }
+    literal.size = *size;
+    return literal;
+}
+
+std::string_view IMAPParser::next_token(std::string_view& rest) {
+    size_t start = 0;
+    skip_whitespace(rest, start);
+    size_t end = start;
+    while (end < rest.size() && !has_class(rest[end], char_class::space)) {
+        end++;
+    }
+    auto token = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return token;
+}
+
+std::optional<SequenceSet> IMAPParser::parse_sequence_set(std::string_view str) {
     if (str.empty()) {
         return std::nullopt;
     }
     return SequenceSet::parse(str);
 }
 
-std::vector<FetchItem> IMAPParser::parse_fetch_items(const std::string& str) {
-    std::vector<FetchItem> items;
+std::pmr::vector<FetchItem> IMAPParser::parse_fetch_items(std::string_view str,
+                                                          allocator_type alloc) {
+    std::pmr::vector<FetchItem> items(alloc);
 
-    std::string s = str;
+    std::string_view s = str;
     // Remove parentheses if present
     if (!s.empty() && s.front() == '(') {
-        s = s.substr(1);
+        s.remove_prefix(1);
         if (!s.empty() && s.back() == ')') {
-            s.pop_back();
+            s.remove_suffix(1);
         }
     }
 
-    std::istringstream iss(s);
-    std::string token;
+    std::pmr::string token(alloc);
 
-    while (iss >> token) {
+    for (auto word = next_fetch_token(s); !word.empty(); word = next_fetch_token(s)) {
+        // The name is what comes before the section and partial.
+        auto name = word.substr(0, word.find_first_of("[<"));
+        token.assign(name);
         std::transform(token.begin(), token.end(), token.begin(), ::toupper);
 
-        FetchItem item;
+        FetchItem item(alloc);
 
         if (token == "ALL") {
             item.type = FetchItem::Type::ALL;
@@ -130,51 +341,108 @@ std::vector<FetchItem> IMAPParser::parse_fetch_items(const std::string& str) {
             item.type = FetchItem::Type::RFC822_SIZE;
         } else if (token == "RFC822.TEXT") {
             item.type = FetchItem::Type::RFC822_TEXT;
-        } else if (token.find("BODY.PEEK") == 0) {
-            item.type = FetchItem::Type::BODY_PEEK;
-            // Parse section if present
-            auto bracket_pos = token.find('[');
-            if (bracket_pos != std::string::npos) {
-                auto end_bracket = token.find(']', bracket_pos);
-                if (end_bracket != std::string::npos) {
-                    item.section = token.substr(bracket_pos + 1, end_bracket - bracket_pos - 1);
-                }
-            }
-        } else if (token.find("BODY") == 0) {
-            item.type = FetchItem::Type::BODY;
-            auto bracket_pos = token.find('[');
-            if (bracket_pos != std::string::npos) {
-                auto end_bracket = token.find(']', bracket_pos);
-                if (end_bracket != std::string::npos) {
-                    item.section = token.substr(bracket_pos + 1, end_bracket - bracket_pos - 1);
-                }
+        } else if (token == "BODY.PEEK" || token == "BODY") {
+            item.type = token == "BODY" ? FetchItem::Type::BODY : FetchItem::Type::BODY_PEEK;
+            auto bracket_pos = word.find('[');
+            auto end_bracket = word.rfind(']');
+            if (bracket_pos != std::string_view::npos && end_bracket != std::string_view::npos &&
+                end_bracket > bracket_pos) {
+                item.section = word.substr(bracket_pos + 1, end_bracket - bracket_pos - 1);
+                item.has_section = true;
+                item.partial = parse_partial(word.substr(end_bracket + 1));
+            } else if (item.type == FetchItem::Type::BODY_PEEK) {
+                continue;  // BODY.PEEK needs a section
             }
         } else if (token == "BODYSTRUCTURE") {
             item.type = FetchItem::Type::BODYSTRUCTURE;
         } else if (token == "UID") {
             item.type = FetchItem::Type::UID;
+        } else if (token == "MODSEQ") {
+            item.type = FetchItem::Type::MODSEQ;
         } else {
             continue;  // Unknown item, skip
         }
 
-        items.push_back(item);
+        items.push_back(std::move(item));
     }
 
     return items;
 }
 
-std::vector<SearchCriteria> IMAPParser::parse_search_criteria(const std::string& str) {
-    std::vector<SearchCriteria> criteria;
+std::pmr::vector<SearchCriteria> IMAPParser::parse_search_criteria(std::string_view str,
+                                                                   allocator_type alloc) {
+    std::pmr::vector<SearchCriteria> criteria(alloc);
+
+    std::string_view rest = str;
+    std::pmr::string token(alloc);
+
+    // A leading CHARSET names the charset of the strings; they are
+    // matched as bytes whatever it is.
+    std::string_view peek = rest;
+    token.assign(next_search_word(peek));
+    std::transform(token.begin(), token.end(), token.begin(), ::toupper);
+    if (token == "CHARSET") {
+        next_search_word(peek);
+        rest = peek;
+    }
 
-    std::istringstream iss(str);
-    std::string token;
+    while (auto crit = parse_search_key(rest, alloc)) {
+        criteria.push_back(std::move(*crit));
+    }
 
-    while (iss >> token) {
+    return criteria;
+}
+
+std::string_view IMAPParser::next_search_word(std::string_view& rest) {
+    size_t start = 0;
+    skip_whitespace(rest, start);
+    size_t end = start;
+    if (end < rest.size() && (rest[end] == '(' || rest[end] == ')')) {
+        end++;
+    } else {
+        while (end < rest.size() && !has_class(rest[end], char_class::space) &&
+               rest[end] != '(' && rest[end] != ')') {
+            end++;
+        }
+    }
+    auto token = rest.substr(start, end - start);
+    rest.remove_prefix(end);
+    return token;
+}
+
+void IMAPParser::next_search_string(std::string_view& rest, std::pmr::string& out) {
+    size_t pos = 0;
+    skip_whitespace(rest, pos);
+    if (pos < rest.size() && rest[pos] == '"') {
+        auto value = parse_string(rest, pos);
+        out.assign(value ? *value : std::string());
+        rest.remove_prefix(pos);
+    } else {
+        out.assign(next_search_word(rest));
+    }
+}
+
+std::optional<SearchCriteria> IMAPParser::parse_search_key(std::string_view& rest,
+                                                           allocator_type alloc) {
+    std::pmr::string token(alloc);
+
+    for (;;) {
+        auto word = next_search_word(rest);
+        if (word.empty() || word == ")") {
+            return std::nullopt;
+        }
+        token.assign(word);
         std::transform(token.begin(), token.end(), token.begin(), ::toupper);
 
-        SearchCriteria crit;
+        SearchCriteria crit(alloc);
 
-        if (token == "ALL") {
+        if (token == "(") {
+            // A parenthesized list: ALL of the keys in it.
+            crit.type = SearchCriteria::Type::ALL;
+            while (auto sub = parse_search_key(rest, alloc)) {
+                crit.sub_criteria.push_back(std::move(*sub));
+            }
+        } else if (token == "ALL") {
             crit.type = SearchCriteria::Type::ALL;
         } else if (token == "ANSWERED") {
             crit.type = SearchCriteria::Type::ANSWERED;
@@ -202,59 +470,73 @@ std::vector<SearchCriteria> IMAPParser::parse_search_criteria(const std::string&
             crit.type = SearchCriteria::Type::UNFLAGGED;
         } else if (token == "UNSEEN") {
             crit.type = SearchCriteria::Type::UNSEEN;
-        } else if (token == "FROM") {
-            crit.type = SearchCriteria::Type::FROM;
-            iss >> crit.value;
-        } else if (token == "TO") {
-            crit.type = SearchCriteria::Type::TO;
-            iss >> crit.value;
-        } else if (token == "CC") {
-            crit.type = SearchCriteria::Type::CC;
-            iss >> crit.value;
-        } else if (token == "BCC") {
-            crit.type = SearchCriteria::Type::BCC;
-            iss >> crit.value;
-        } else if (token == "SUBJECT") {
-            crit.type = SearchCriteria::Type::SUBJECT;
-            iss >> crit.value;
-        } else if (token == "BODY") {
-            crit.type = SearchCriteria::Type::BODY;
-            iss >> crit.value;
-        } else if (token == "TEXT") {
-            crit.type = SearchCriteria::Type::TEXT;
-            iss >> crit.value;
-        } else if (token == "LARGER") {
-            crit.type = SearchCriteria::Type::LARGER;
-            iss >> crit.value;
-        } else if (token == "SMALLER") {
-            crit.type = SearchCriteria::Type::SMALLER;
-            iss >> crit.value;
-        } else if (token == "BEFORE") {
-            crit.type = SearchCriteria::Type::BEFORE;
-            iss >> crit.value;
-        } else if (token == "ON") {
-            crit.type = SearchCriteria::Type::ON;
-            iss >> crit.value;
-        } else if (token == "SINCE") {
-            crit.type = SearchCriteria::Type::SINCE;
-            iss >> crit.value;
-        } else if (token == "UID") {
-            crit.type = SearchCriteria::Type::UID;
-            iss >> crit.value;
+        } else if (token == "NOT") {
+            crit.type = SearchCriteria::Type::NOT;
+            auto sub = parse_search_key(rest, alloc);
+            if (!sub) return std::nullopt;
+            crit.sub_criteria.push_back(std::move(*sub));
+        } else if (token == "OR") {
+            crit.type = SearchCriteria::Type::OR;
+            auto first = parse_search_key(rest, alloc);
+            auto second = first ? parse_search_key(rest, alloc) : std::nullopt;
+            if (!second) return std::nullopt;
+            crit.sub_criteria.push_back(std::move(*first));
+            crit.sub_criteria.push_back(std::move(*second));
+        } else if (token == "HEADER") {
+            crit.type = SearchCriteria::Type::HEADER;
+            next_search_string(rest, crit.header_name);
+            next_search_string(rest, crit.value);
+        } else if (token == "FROM" || token == "TO" || token == "CC" || token == "BCC" ||
+                   token == "SUBJECT" || token == "BODY" || token == "TEXT" ||
+                   token == "KEYWORD" || token == "UNKEYWORD") {
+            crit.type = token == "FROM"      ? SearchCriteria::Type::FROM
+                        : token == "TO"      ? SearchCriteria::Type::TO
+                        : token == "CC"      ? SearchCriteria::Type::CC
+                        : token == "BCC"     ? SearchCriteria::Type::BCC
+                        : token == "SUBJECT" ? SearchCriteria::Type::SUBJECT
+                        : token == "BODY"    ? SearchCriteria::Type::BODY
+                        : token == "TEXT"    ? SearchCriteria::Type::TEXT
+                        : token == "KEYWORD" ? SearchCriteria::Type::KEYWORD
+                                             : SearchCriteria::Type::UNKEYWORD;
+            next_search_string(rest, crit.value);
+        } else if (token == "LARGER" || token == "SMALLER" || token == "BEFORE" ||
+                   token == "ON" || token == "SINCE" || token == "SENTBEFORE" ||
+                   token == "SENTON" || token == "SENTSINCE" || token == "UID") {
+            crit.type = token == "LARGER"       ? SearchCriteria::Type::LARGER
+                        : token == "SMALLER"    ? SearchCriteria::Type::SMALLER
+                        : token == "BEFORE"     ? SearchCriteria::Type::BEFORE
+                        : token == "ON"         ? SearchCriteria::Type::ON
+                        : token == "SINCE"      ? SearchCriteria::Type::SINCE
+                        : token == "SENTBEFORE" ? SearchCriteria::Type::SENTBEFORE
+                        : token == "SENTON"     ? SearchCriteria::Type::SENTON
+                        : token == "SENTSINCE"  ? SearchCriteria::Type::SENTSINCE
+                                                : SearchCriteria::Type::UID;
+            next_search_string(rest, crit.value);
+        } else if (token == "MODSEQ") {
+            // An entry name and type may come first; only flags have
+            // mod-sequences here, so they narrow nothing.
+            crit.type = SearchCriteria::Type::MODSEQ;
+            size_t pos = 0;
+            skip_whitespace(rest, pos);
+            if (pos < rest.size() && rest[pos] == '"') {
+                next_search_string(rest, crit.value);
+                next_search_word(rest);
+            }
+            crit.value.assign(next_search_word(rest));
+        } else if (std::isdigit(static_cast<unsigned char>(token.front())) || token.front() == '*') {
+            crit.type = SearchCriteria::Type::SEQUENCE;
+            crit.value.assign(word);
         } else {
             continue;  // Unknown criteria
         }
 
-        criteria.push_back(crit);
+        return crit;
     }
-
-    return criteria;
 }
 
-std::optional<StoreAction> IMAPParser::parse_store_action(const std::string& str) {
-    std::istringstream iss(str);
-    std::string action;
-    iss >> action;
+std::optional<StoreAction> IMAPParser::parse_store_action(std::string_view str) {
+    std::string_view rest = str;
+    std::string action(next_token(rest));
 
     std::transform(action.begin(), action.end(), action.begin(), ::toupper);
 
@@ -271,78 +553,193 @@ std::optional<StoreAction> IMAPParser::parse_store_action(const std::string& str
     }
 
     // Parse flag list
-    std::string rest;
-    std::getline(iss >> std::ws, rest);
     store.flags = parse_flag_list(rest);
 
     return store;
 }
 
-std::optional<std::string> IMAPParser::parse_string(const std::string& str, size_t& pos) {
-    skip_whitespace(str, pos);
-    if (pos >= str.length()) {
-        return std::nullopt;
+std::optional<FetchModifiers> IMAPParser::split_fetch_modifiers(std::string_view& items) {
+    size_t pos = 0;
+    skip_whitespace(items, pos);
+    // The items end with their list, or with the one item, whose section
+    // may hold spaces.
+    int parens = 0;
+    int brackets = 0;
+    size_t end = pos;
+    for (; end < items.size(); ++end) {
+        const char c = items[end];
+        if (c == '(') ++parens;
+        if (c == ')' && --parens == 0 && items[pos] == '(') {
+            ++end;
+            break;
+        }
+        if (c == '[') ++brackets;
+        if (c == ']') --brackets;
+        if (parens == 0 && brackets == 0 && has_class(c, char_class::space)) break;
     }
 
-    if (str[pos] == '"') {
-        // Quoted string
-        pos++;
-        std::string result;
-        while (pos < str.length() && str[pos] != '"') {
-            if (str[pos] == '\\' && pos + 1 < str.length()) {
-                pos++;
-            }
-            result += str[pos++];
-        }
-        if (pos < str.length()) pos++;  // Skip closing quote
-        return result;
-    } else if (str[pos] == '{') {
-        // Literal (we don't support this in simple parsing)
+    FetchModifiers modifiers;
+    std::string_view rest = items.substr(end);
+    items = items.substr(pos, end - pos);
+    size_t start = 0;
+    skip_whitespace(rest, start);
+    rest.remove_prefix(start);
+    if (rest.empty()) {
+        return modifiers;
+    }
+    if (rest.front() != '(' || rest.back() != ')') {
         return std::nullopt;
-    } else {
-        // Atom
-        return parse_atom(str, pos);
     }
+    rest = rest.substr(1, rest.size() - 2);
+    for (auto name = next_token(rest); !name.empty(); name = next_token(rest)) {
+        if (equals_nocase(name, "CHANGEDSINCE")) {
+            modifiers.changed_since = parse_number(next_token(rest));
+            if (!modifiers.changed_since) return std::nullopt;
+        } else if (equals_nocase(name, "VANISHED")) {
+            modifiers.vanished = true;
+        } else {
+            return std::nullopt;
+        }
+    }
+    return modifiers;
 }
 
-std::optional<std::string> IMAPParser::parse_atom(const std::string& str, size_t& pos) {
-    skip_whitespace(str, pos);
-
-    std::string result;
-    while (pos < str.length() && is_atom_char(str[pos])) {
-        result += str[pos++];
+bool IMAPParser::take_unchanged_since(std::string_view& rest, std::optional<uint64_t>& modseq) {
+    size_t pos = 0;
+    skip_whitespace(rest, pos);
+    if (pos >= rest.size() || rest[pos] != '(') {
+        return true;
     }
-
-    return result.empty() ? std::nullopt : std::optional<std::string>(result);
+    auto close = rest.find(')', pos);
+    if (close == std::string_view::npos) {
+        return false;
+    }
+    std::string_view list = rest.substr(pos + 1, close - pos - 1);
+    rest.remove_prefix(close + 1);
+    for (auto name = next_token(list); !name.empty(); name = next_token(list)) {
+        if (!equals_nocase(name, "UNCHANGEDSINCE")) return false;
+        modseq = parse_number(next_token(list));
+        if (!modseq) return false;
+    }
+    return true;
 }
 
-std::optional<IMAPList> IMAPParser::parse_list(const std::string& str, size_t& pos) {
-    skip_whitespace(str, pos);
-    if (pos >= str.length() || str[pos] != '(') {
-        return std::nullopt;
+Token Tokenizer::next() {
+    while (pos_ < input_.size() && has_class(input_[pos_], char_class::space)) {
+        pos_++;
+    }
+    Token token;
+    if (pos_ >= input_.size()) {
+        return token;
     }
 
-    pos++;  // Skip (
-    IMAPList list;
+    const size_t start = pos_;
+    switch (input_[start]) {
+    case '(':
+        token.kind = Token::Kind::ListOpen;
+        break;
+    case ')':
+        token.kind = Token::Kind::ListClose;
+        break;
+    case '"': {
+        // An unterminated string runs to the end of the input.
+        size_t end = start + 1;
+        while (end < input_.size() && input_[end] != '"') {
+            if (input_[end] == '\\' && end + 1 < input_.size()) {
+                token.escaped = true;
+                end++;
+            }
+            end++;
+        }
+        token.kind = Token::Kind::Quoted;
+        token.text = input_.substr(start + 1, end - start - 1);
+        pos_ = std::min(end + 1, input_.size());
+        return token;
+    }
+    case '{': {
+        const auto header_end = input_.find("}\r\n", start);
+        if (header_end == std::string_view::npos) {
+            break;
+        }
+        auto literal = IMAPParser::literal_at_end(input_.substr(start, header_end + 1 - start));
+        const size_t data = header_end + 3;
+        if (!literal || literal->size > input_.size() - data) {
+            break;
+        }
+        token.kind = Token::Kind::Literal;
+        token.text = input_.substr(data, literal->size);
+        pos_ = data + literal->size;
+        return token;
+    }
+    default: {
+        // A flag, \Seen, is an atom after its backslash.
+        size_t end = input_[start] == '\\' ? start + 1 : start;
+        while (end < input_.size() && has_class(input_[end], char_class::atom)) {
+            end++;
+        }
+        if (end == start || input_[end - 1] == '\\') {
+            break;
+        }
+        token.kind = Token::Kind::Atom;
+        token.text = input_.substr(start, end - start);
+        pos_ = end;
+        return token;
+    }
+    }
 
-    while (pos < str.length() && str[pos] != ')') {
-        skip_whitespace(str, pos);
-        if (pos >= str.length()) break;
+    // A parenthesis, or a character no token starts with.
+    if (token.kind == Token::Kind::End) {
+        token.kind = Token::Kind::Invalid;
+    }
+    token.text = input_.substr(start, 1);
+    pos_ = start + 1;
+    return token;
+}
 
-        if (str[pos] == '(') {
-            auto sublist = parse_list(str, pos);
-            if (sublist) {
-                list.items.push_back(*sublist);
-            }
-        } else {
-            auto item = parse_string(str, pos);
-            if (item) {
-                list.items.push_back(*item);
-            }
+void Tokenizer::append_value(const Token& token, std::string& out) {
+    if (!token.escaped) {
+        out += token.text;
+        return;
+    }
+    out.reserve(out.size() + token.text.size());
+    for (size_t i = 0; i < token.text.size(); ++i) {
+        if (token.text[i] == '\\' && i + 1 < token.text.size()) {
+            i++;
         }
+        out += token.text[i];
     }
+}
 
-    if (pos < str.length()) pos++;  // Skip )
+std::optional<std::string> IMAPParser::parse_string(std::string_view str, size_t& pos) {
+    Tokenizer tokens(str, pos);
+    const Token token = tokens.next();
+    if (!token.is_string()) {
+        return std::nullopt;
+    }
+    pos = tokens.position();
+    std::string value;
+    Tokenizer::append_value(token, value);
+    return value;
+}
+
+std::optional<std::string> IMAPParser::parse_atom(std::string_view str, size_t& pos) {
+    Tokenizer tokens(str, pos);
+    const Token token = tokens.next();
+    if (token.kind != Token::Kind::Atom) {
+        return std::nullopt;
+    }
+    pos = tokens.position();
+    return std::string(token.text);
+}
+
+std::optional<IMAPList> IMAPParser::parse_list(std::string_view str, size_t& pos) {
+    Tokenizer tokens(str, pos);
+    if (tokens.next().kind != Token::Kind::ListOpen) {
+        return std::nullopt;
+    }
+    IMAPList list;
+    read_list_items(tokens, list);
+    pos = tokens.position();
     return list;
 }
 
@@ -386,22 +783,342 @@ std::string IMAPParser::format_flags(const std::set<std::string>& flags) {
     return result;
 }
 
-std::set<std::string> IMAPParser::parse_flag_list(const std::string& str) {
+void IMAPParser::append_flags(std::pmr::string& out, const std::set<std::string>& flags) {
+    out += '(';
+    bool first = true;
+
+    for (const auto& flag : flags) {
+        if (!first) out += ' ';
+        out += flag;
+        first = false;
+    }
+
+    out += ')';
+}
+
+namespace {
+
+constexpr std::pair<uint8_t, std::string_view> system_flag_names[] = {
+    {system_flag::answered, "\\Answered"},
+    {system_flag::deleted, "\\Deleted"},
+    {system_flag::draft, "\\Draft"},
+    {system_flag::flagged, "\\Flagged"},
+    {system_flag::recent, "\\Recent"},
+    {system_flag::seen, "\\Seen"},
+};
+
+}  // namespace
+
+void IMAPParser::append_flags(std::pmr::string& out, uint8_t system,
+                              const std::set<std::string>& keywords) {
+    out += '(';
+    bool first = true;
+
+    for (const auto& [bit, name] : system_flag_names) {
+        if (system & bit) {
+            if (!first) out += ' ';
+            out += name;
+            first = false;
+        }
+    }
+    for (const auto& keyword : keywords) {
+        if (!first) out += ' ';
+        out += keyword;
+        first = false;
+    }
+
+    out += ')';
+}
+
+uint8_t IMAPParser::system_flag_bit(std::string_view flag) {
+    for (const auto& [bit, name] : system_flag_names) {
+        if (flag == name) {
+            return bit;
+        }
+    }
+    return 0;
+}
+
+void IMAPParser::append_nstring(std::pmr::string& out, std::string_view value) {
+    if (value.empty()) {
+        out += "NIL";
+        return;
+    }
+    bool quotable = value.size() < 1024;
+    for (char c : value) {
+        if (c == '\r' || c == '\n' || c == '\0' || static_cast<unsigned char>(c) >= 0x80) {
+            quotable = false;
+            break;
+        }
+    }
+    if (!quotable) {
+        std::format_to(std::back_inserter(out), "{{{}}}\r\n", value.size());
+        out.append(value);
+        return;
+    }
+    out += '"';
+    for (char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+namespace {
+
+std::string_view trim_view(std::string_view text) {
+    while (!text.empty() && has_class(text.front(), char_class::space)) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && has_class(text.back(), char_class::space)) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+// A display name or group name without its quotes and escapes.
+std::string unquote_phrase(std::string_view text) {
+    std::string result;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\\' && i + 1 < text.size()) {
+            result += text[++i];
+        } else if (text[i] != '"') {
+            result += text[i];
+        }
+    }
+    return std::string(trim_view(result));
+}
+
+// One mailbox: "Name <local@host>", "local@host (Name)" or "local@host".
+void append_address(std::pmr::string& out, std::string_view text) {
+    std::string name;
+    std::string_view spec;
+    auto open = text.rfind('<');
+    auto close = text.rfind('>');
+    if (open != std::string_view::npos && close != std::string_view::npos && open < close) {
+        name = unquote_phrase(text.substr(0, open));
+        spec = trim_view(text.substr(open + 1, close - open - 1));
+    } else {
+        auto comment = text.find('(');
+        spec = trim_view(text.substr(0, comment));
+        if (comment != std::string_view::npos) {
+            auto comment_end = text.rfind(')');
+            name = unquote_phrase(text.substr(comment + 1, comment_end == std::string_view::npos ||
+                                                               comment_end < comment
+                                                           ? std::string_view::npos
+                                                           : comment_end - comment - 1));
+        }
+    }
+    // A source route is obsolete and dropped.
+    if (auto route_end = spec.find(':'); !spec.empty() && spec.front() == '@' &&
+                                         route_end != std::string_view::npos) {
+        spec.remove_prefix(route_end + 1);
+    }
+    auto at = spec.rfind('@');
+    auto local = spec.substr(0, at);
+    auto host = at == std::string_view::npos ? std::string_view() : spec.substr(at + 1);
+
+    out += '(';
+    IMAPParser::append_nstring(out, name);
+    out += " NIL ";
+    IMAPParser::append_nstring(out, unquote_phrase(local));
+    out += ' ';
+    // Host NIL marks group syntax, so a bare local part gets an empty one.
+    if (host.empty()) {
+        out += "\"\"";
+    } else {
+        IMAPParser::append_nstring(out, host);
+    }
+    out += ')';
+}
+
+// An address header as a parenthesized list of addresses, groups spelled
+// out as RFC 3501 does; NIL when it holds none.
+void append_address_list(std::pmr::string& out, std::string_view value) {
+    const size_t start = out.size();
+    out += '(';
+    auto emit = [&out](std::string_view text) {
+        if (!trim_view(text).empty()) {
+            append_address(out, trim_view(text));
+        }
+    };
+
+    bool quoted = false;
+    int comment = 0;
+    bool angle = false;
+    bool in_group = false;
+    size_t begin = 0;
+    for (size_t i = 0; i < value.size(); ++i) {
+        char c = value[i];
+        if (quoted) {
+            if (c == '\\') ++i;
+            else if (c == '"') quoted = false;
+        } else if (comment > 0) {
+            if (c == '(') ++comment;
+            else if (c == ')') --comment;
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == '(') {
+            ++comment;
+        } else if (c == '<') {
+            angle = true;
+        } else if (c == '>') {
+            angle = false;
+        } else if (angle) {
+            continue;
+        } else if (c == ',') {
+            emit(value.substr(begin, i - begin));
+            begin = i + 1;
+        } else if (c == ':' && !in_group) {
+            out += "(NIL NIL ";
+            IMAPParser::append_nstring(out, unquote_phrase(value.substr(begin, i - begin)));
+            out += " NIL)";
+            in_group = true;
+            begin = i + 1;
+        } else if (c == ';' && in_group) {
+            emit(value.substr(begin, i - begin));
+            out += "(NIL NIL NIL NIL)";
+            in_group = false;
+            begin = i + 1;
+        }
+    }
+    emit(value.substr(begin));
+    if (in_group) {
+        out += "(NIL NIL NIL NIL)";
+    }
+
+    if (out.size() == start + 1) {
+        out.resize(start);
+        out += "NIL";
+    } else {
+        out += ')';
+    }
+}
+
+void append_params(std::pmr::string& out, const MimePart::Params& params) {
+    if (params.empty()) {
+        out += "NIL";
+        return;
+    }
+    out += '(';
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (i > 0) out += ' ';
+        IMAPParser::append_nstring(out, params[i].first);
+        out += ' ';
+        IMAPParser::append_nstring(out, params[i].second);
+    }
+    out += ')';
+}
+
+// Disposition, language and location, which end both kinds of extension data.
+void append_part_extensions(std::pmr::string& out, const MimePart& part) {
+    out += ' ';
+    if (part.disposition.empty()) {
+        out += "NIL";
+    } else {
+        out += '(';
+        IMAPParser::append_nstring(out, part.disposition);
+        out += ' ';
+        append_params(out, part.disposition_params);
+        out += ')';
+    }
+    out += ' ';
+    IMAPParser::append_nstring(out, part.language);
+    out += ' ';
+    IMAPParser::append_nstring(out, part.location);
+}
+
+}  // namespace
+
+void IMAPParser::append_envelope(std::pmr::string& out, const Envelope& envelope) {
+    out += '(';
+    append_nstring(out, envelope.date);
+    out += ' ';
+    append_nstring(out, envelope.subject);
+    out += ' ';
+    append_address_list(out, envelope.from);
+    out += ' ';
+    append_address_list(out, envelope.sender.empty() ? envelope.from : envelope.sender);
+    out += ' ';
+    append_address_list(out, envelope.reply_to.empty() ? envelope.from : envelope.reply_to);
+    out += ' ';
+    append_address_list(out, envelope.to);
+    out += ' ';
+    append_address_list(out, envelope.cc);
+    out += ' ';
+    append_address_list(out, envelope.bcc);
+    out += ' ';
+    append_nstring(out, envelope.in_reply_to);
+    out += ' ';
+    append_nstring(out, envelope.message_id);
+    out += ')';
+}
+
+void IMAPParser::append_body_structure(std::pmr::string& out, const MimePart& part,
+                                       bool extensions) {
+    out += '(';
+    if (part.is_multipart()) {
+        for (const auto& child : part.parts) {
+            append_body_structure(out, child, extensions);
+        }
+        out += ' ';
+        append_nstring(out, part.subtype);
+        if (extensions) {
+            out += ' ';
+            append_params(out, part.params);
+            append_part_extensions(out, part);
+        }
+        out += ')';
+        return;
+    }
+
+    append_nstring(out, part.type);
+    out += ' ';
+    append_nstring(out, part.subtype);
+    out += ' ';
+    append_params(out, part.params);
+    out += ' ';
+    append_nstring(out, part.id);
+    out += ' ';
+    append_nstring(out, part.description);
+    out += ' ';
+    append_nstring(out, part.encoding);
+    std::format_to(std::back_inserter(out), " {}", part.size());
+    if (part.is_message() && !part.parts.empty()) {
+        out += ' ';
+        append_envelope(out, part.envelope);
+        out += ' ';
+        append_body_structure(out, part.parts.front(), extensions);
+        std::format_to(std::back_inserter(out), " {}", part.lines);
+    } else if (part.type == "text") {
+        std::format_to(std::back_inserter(out), " {}", part.lines);
+    }
+    if (extensions) {
+        out += ' ';
+        append_nstring(out, part.md5);
+        append_part_extensions(out, part);
+    }
+    out += ')';
+}
+
+std::set<std::string> IMAPParser::parse_flag_list(std::string_view str) {
     std::set<std::string> flags;
 
-    std::string s = str;
+    size_t pos = 0;
+    skip_whitespace(str, pos);
+    std::string_view s = str.substr(pos);
     // Remove parentheses
     if (!s.empty() && s.front() == '(') {
-        s = s.substr(1);
+        s.remove_prefix(1);
         if (!s.empty() && s.back() == ')') {
-            s.pop_back();
+            s.remove_suffix(1);
         }
     }
 
-    std::istringstream iss(s);
-    std::string flag;
-    while (iss >> flag) {
-        flags.insert(flag);
+    for (auto flag = next_token(s); !flag.empty(); flag = next_token(s)) {
+        flags.emplace(flag);
     }
 
     return flags;
@@ -448,24 +1165,18 @@ std::string IMAPParser::format_internal_date(std::chrono::system_clock::time_poi
     return oss.str();
 }
 
-void IMAPParser::skip_whitespace(const std::string& str, size_t& pos) {
-    while (pos < str.length() && std::isspace(str[pos])) {
+void IMAPParser::skip_whitespace(std::string_view str, size_t& pos) {
+    while (pos < str.length() && has_class(str[pos], char_class::space)) {
         pos++;
     }
 }
 
 bool IMAPParser::is_atom_char(char c) {
-    // IMAP atom-char excludes: ( ) { SP CTL list-wildcards quoted-specials resp-specials
-    if (std::isspace(c) || std::iscntrl(c)) return false;
-    if (c == '(' || c == ')' || c == '{') return false;
-    if (c == '"' || c == '\\') return false;
-    if (c == '%' || c == '*') return false;
-    if (c == '[' || c == ']') return false;
-    return true;
+    return has_class(c, char_class::atom);
 }
 
 bool IMAPParser::is_list_wildcard(char c) {
-    return c == '%' || c == '*';
+    return has_class(c, char_class::list_wildcard);
 }
 
 }  // namespace email::imap
@@ -3,6 +3,18 @@
 
 namespace email::imap {
 
+namespace {
+
+DeflateCodec::Options compress_options(const IMAPConfig& config) {
+    DeflateCodec::Options options;
+    options.level = config.compress_level;
+    options.window_bits = config.compress_window_bits;
+    options.mem_level = config.compress_mem_level;
+    return options;
+}
+
+}  // namespace
+
 IMAPServer::IMAPServer(const IMAPConfig& config,
                        std::shared_ptr<Authenticator> auth,
                        const std::filesystem::path& maildir_root)
@@ -17,15 +29,8 @@ IMAPServer::~IMAPServer() {
 
 bool IMAPServer::configure_tls(const TLSConfig& tls_config) {
 #ifdef ENABLE_TLS
-    ssl_context_ = SSLContext::create_server_context(
-        tls_config.certificate_file,
-        tls_config.private_key_file,
-        tls_config.ca_file,
-        tls_config.ciphers
-    );
-
+    ssl_context_ = SSLContext::create_server_context(tls_config);
     if (!ssl_context_.is_initialized()) {
-        LOG_ERROR_FMT("Failed to configure TLS: {}", ssl_context_.last_error());
         return false;
     }
 
@@ -39,6 +44,8 @@ bool IMAPServer::configure_tls(const TLSConfig& tls_config) {
 }
 
 void IMAPServer::start() {
+    memory_budget_->set_limit(config_.memory_budget);
+
     // Create plain server
     plain_server_ = std::make_unique<Server<IMAPSession>>(
         "IMAP",
@@ -53,6 +60,10 @@ void IMAPServer::start() {
             auto session = std::make_shared<IMAPSession>(
                 io_ctx, std::move(socket), auth_, maildir_root_, "mail.example.com"
             );
+            session->set_idle_enabled(config_.enable_idle);
+            session->set_idle_timeout(config_.idle_timeout);
+            session->set_max_command_size(config_.max_command_size);
+            session->set_compression(config_.enable_compress, compress_options(config_));
 #ifdef ENABLE_TLS
             if (tls_configured_) {
                 session->set_ssl_context(&ssl_context_.native());
@@ -63,7 +74,12 @@ void IMAPServer::start() {
     );
 
     plain_server_->set_max_connections(config_.max_connections);
+    plain_server_->set_memory_budget(memory_budget_);
     plain_server_->set_connection_timeout(config_.connection_timeout);
+    plain_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                          : ExecutionMode::Shared);
+    plain_server_->set_cpu_affinity(config_.pin_threads);
+    plain_server_->set_reactor(reactor_);
 
     LOG_INFO_FMT("Starting IMAP server on {}:{}", config_.bind_address, config_.port);
     plain_server_->start();
@@ -81,19 +97,26 @@ void IMAPServer::start() {
 
         tls_server_->set_session_factory(
             [this](asio::io_context& io_ctx, tcp::socket socket, ssl::context* ssl_ctx) {
-                if (ssl_ctx) {
-                    return std::make_shared<IMAPSession>(
-                        io_ctx, std::move(socket), *ssl_ctx, auth_, maildir_root_, "mail.example.com"
-                    );
-                }
-                return std::make_shared<IMAPSession>(
-                    io_ctx, std::move(socket), auth_, maildir_root_, "mail.example.com"
-                );
+                auto session = ssl_ctx
+                    ? std::make_shared<IMAPSession>(
+                          io_ctx, std::move(socket), *ssl_ctx, auth_, maildir_root_, "mail.example.com")
+                    : std::make_shared<IMAPSession>(
+                          io_ctx, std::move(socket), auth_, maildir_root_, "mail.example.com");
+                session->set_idle_enabled(config_.enable_idle);
+                session->set_idle_timeout(config_.idle_timeout);
+                session->set_max_command_size(config_.max_command_size);
+                session->set_compression(config_.enable_compress, compress_options(config_));
+                return session;
             }
         );
 
         tls_server_->set_max_connections(config_.max_connections);
+        tls_server_->set_memory_budget(memory_budget_);
         tls_server_->set_connection_timeout(config_.connection_timeout);
+        tls_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                            : ExecutionMode::Shared);
+        tls_server_->set_cpu_affinity(config_.pin_threads);
+        tls_server_->set_reactor(reactor_);
 
         LOG_INFO_FMT("Starting IMAPS server on {}:{}", config_.bind_address, config_.tls_port);
         tls_server_->start();
@@ -102,16 +125,36 @@ void IMAPServer::start() {
 }
 
 void IMAPServer::stop() {
+    const bool running = plain_server_ || tls_server_;
+    size_t refused = 0;
+
     if (plain_server_) {
+        refused += plain_server_->memory_refusals();
         plain_server_->stop();
         plain_server_.reset();
     }
 
     if (tls_server_) {
+        refused += tls_server_->memory_refusals();
         tls_server_->stop();
         tls_server_.reset();
     }
 
+    if (tls_configured_ && running) {
+        ssl_context_.log_stats("IMAP");
+    }
+
+    auto deflate = DeflateCodec::totals();
+    if (running && deflate.plain_out > 0) {
+        LOG_INFO_FMT("IMAP COMPRESS: {} bytes out as {}, {} bytes in from {}",
+                     deflate.plain_out, deflate.wire_out, deflate.plain_in, deflate.wire_in);
+    }
+
+    if (refused > 0) {
+        LOG_WARNING_FMT("IMAP refused {} connections over the memory budget of {} bytes",
+                        refused, memory_budget_->limit());
+    }
+
     LOG_INFO("IMAP server stopped");
 }
 
@@ -2,9 +2,565 @@
 #include "logger.hpp"
 #include <sstream>
 #include <algorithm>
+#include <bit>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <fcntl.h>
+#include <functional>
+#include <limits>
+#include <unistd.h>
 
 namespace email::imap {
 
+namespace {
+
+// How often an IDLE looks at a mailbox watched by polling, which has no
+// descriptor to wait on.
+constexpr auto idle_poll_interval = std::chrono::seconds(5);
+
+// A LARGER, SMALLER or MODSEQ argument; anything unparsable reads as 0.
+size_t parse_size(std::string_view str) {
+    size_t value = 0;
+    std::from_chars(str.data(), str.data() + str.size(), value);
+    return value;
+}
+
+// A SEARCH date, "1-Feb-1994", in days since the epoch.
+std::optional<int32_t> parse_search_day(std::string_view str) {
+    static constexpr std::string_view months[] = {"JAN", "FEB", "MAR", "APR", "MAY", "JUN",
+                                                  "JUL", "AUG", "SEP", "OCT", "NOV", "DEC"};
+    auto first = str.find('-');
+    auto second = first == std::string_view::npos ? first : str.find('-', first + 1);
+    if (second == std::string_view::npos || second - first != 4) {
+        return std::nullopt;
+    }
+    unsigned day = 0;
+    int year = 0;
+    auto day_end = std::from_chars(str.data(), str.data() + first, day).ptr;
+    auto year_end = std::from_chars(str.data() + second + 1, str.data() + str.size(), year).ptr;
+    std::string month(str.substr(first + 1, 3));
+    std::transform(month.begin(), month.end(), month.begin(), ::toupper);
+    auto it = std::find(std::begin(months), std::end(months), month);
+    if (day_end != str.data() + first || year_end != str.data() + str.size() ||
+        it == std::end(months)) {
+        return std::nullopt;
+    }
+    std::chrono::year_month_day ymd{std::chrono::year(year),
+                                    std::chrono::month(static_cast<unsigned>(it - months) + 1),
+                                    std::chrono::day(day)};
+    if (!ymd.ok()) {
+        return std::nullopt;
+    }
+    return static_cast<int32_t>(std::chrono::sys_days(ymd).time_since_epoch().count());
+}
+
+bool contains_nocase(std::string_view haystack, std::string_view needle) {
+    auto it = std::search(haystack.begin(), haystack.end(), needle.begin(), needle.end(),
+                          [](char a, char b) {
+                              return std::tolower(static_cast<unsigned char>(a)) ==
+                                     std::tolower(static_cast<unsigned char>(b));
+                          });
+    return it != haystack.end() || needle.empty();
+}
+
+// SEARCH keys compiled once against the message table: arguments parsed,
+// flag names turned into bits, flag keys under one AND merged into a single
+// mask test. Running it fills a byte per message, 1 for a match, in loops
+// down whole columns that the compiler vectorizes. A key on the text costs
+// one look at the search index rather than one per message, and the index
+// is only prepared once such a key runs.
+class SearchProgram {
+public:
+    using Matches = std::vector<uint8_t>;
+
+    // All of `criteria` must match.
+    SearchProgram(std::span<const SearchCriteria> criteria, const MessageTable& messages,
+                  std::function<SearchIndex*()> open_index)
+        : messages_(messages), open_index_(std::move(open_index)), root_(compile_all(criteria)) {}
+
+    Matches run() {
+        Matches matches(messages_.size());
+        run(root_, matches);
+        return matches;
+    }
+
+private:
+    struct Step {
+        enum class Op {
+            And, Or, Not, Flags, Keyword, Larger, Smaller, ModSeq, Dates, Uids, Sequences, Text
+        };
+
+        Op op = Op::And;
+        std::vector<Step> children;
+        uint8_t mask = 0;  // Flags: (flags & mask) == want
+        uint8_t want = 0;
+        uint64_t size = 0;                              // Larger, Smaller; ModSeq's least
+        int64_t from = std::numeric_limits<int64_t>::min();  // Dates: [from, to), in seconds
+        int64_t to = std::numeric_limits<int64_t>::max();
+        SequenceSet set;                                // Uids, Sequences
+        const SearchCriteria* key = nullptr;            // Keyword, Text
+    };
+
+    static Step flags(uint8_t mask, uint8_t want) {
+        Step step;
+        step.op = Step::Op::Flags;
+        step.mask = mask;
+        step.want = want;
+        return step;
+    }
+
+    static Step negate(Step child) {
+        if (child.op == Step::Op::Flags && std::has_single_bit(child.mask)) {
+            child.want ^= child.mask;
+            return child;
+        }
+        Step step;
+        step.op = Step::Op::Not;
+        step.children.push_back(std::move(child));
+        return step;
+    }
+
+    // Adds `child` to the AND `step`, merging it into a flag test there if
+    // it is one on other flags.
+    static void add_to_and(Step& step, Step child) {
+        if (child.op == Step::Op::And) {
+            for (auto& grandchild : child.children) {
+                add_to_and(step, std::move(grandchild));
+            }
+            return;
+        }
+        if (child.op == Step::Op::Flags) {
+            for (auto& other : step.children) {
+                if (other.op == Step::Op::Flags && !(other.mask & child.mask)) {
+                    other.mask |= child.mask;
+                    other.want |= child.want;
+                    return;
+                }
+            }
+        }
+        step.children.push_back(std::move(child));
+    }
+
+    static Step compile_all(std::span<const SearchCriteria> criteria) {
+        Step step;
+        for (const auto& crit : criteria) {
+            add_to_and(step, compile(crit));
+        }
+        if (step.children.size() == 1) {
+            return std::move(step.children.front());
+        }
+        return step;
+    }
+
+    static Step compile(const SearchCriteria& crit) {
+        using Type = SearchCriteria::Type;
+        Step step;
+        switch (crit.type) {
+            case Type::ALL: return compile_all(crit.sub_criteria);
+            case Type::NOT: return negate(compile_all(crit.sub_criteria));
+            case Type::OR:
+                step.op = Step::Op::Or;
+                step.children.push_back(compile(crit.sub_criteria.at(0)));
+                step.children.push_back(compile(crit.sub_criteria.at(1)));
+                return step;
+            case Type::SEEN: return flags(system_flag::seen, system_flag::seen);
+            case Type::UNSEEN: return flags(system_flag::seen, 0);
+            case Type::ANSWERED: return flags(system_flag::answered, system_flag::answered);
+            case Type::UNANSWERED: return flags(system_flag::answered, 0);
+            case Type::DELETED: return flags(system_flag::deleted, system_flag::deleted);
+            case Type::UNDELETED: return flags(system_flag::deleted, 0);
+            case Type::FLAGGED: return flags(system_flag::flagged, system_flag::flagged);
+            case Type::UNFLAGGED: return flags(system_flag::flagged, 0);
+            case Type::DRAFT: return flags(system_flag::draft, system_flag::draft);
+            case Type::UNDRAFT: return flags(system_flag::draft, 0);
+            case Type::RECENT: return flags(system_flag::recent, system_flag::recent);
+            case Type::OLD: return flags(system_flag::recent, 0);
+            case Type::NEW:
+                return flags(system_flag::recent | system_flag::seen, system_flag::recent);
+            case Type::KEYWORD:
+            case Type::UNKEYWORD: {
+                const bool set = crit.type == Type::KEYWORD;
+                if (uint8_t bit = IMAPParser::system_flag_bit(crit.value)) {
+                    return flags(bit, set ? bit : 0);
+                }
+                step.op = Step::Op::Keyword;
+                step.key = &crit;
+                return set ? step : negate(std::move(step));
+            }
+            case Type::LARGER:
+            case Type::SMALLER:
+                step.op = crit.type == Type::LARGER ? Step::Op::Larger : Step::Op::Smaller;
+                step.size = parse_size(crit.value);
+                return step;
+            case Type::MODSEQ:
+                step.op = Step::Op::ModSeq;
+                step.size = parse_size(crit.value);
+                return step;
+            case Type::UID:
+            case Type::SEQUENCE:
+                step.op = crit.type == Type::UID ? Step::Op::Uids : Step::Op::Sequences;
+                step.set = SequenceSet::parse(crit.value);
+                return step;
+            case Type::BEFORE:
+            case Type::ON:
+            case Type::SINCE: {
+                step.op = Step::Op::Dates;
+                auto day = parse_search_day(crit.value);
+                if (!day) {
+                    step.from = 1;  // Nothing
+                    step.to = 0;
+                    return step;
+                }
+                const int64_t start = int64_t{*day} * 86400;
+                if (crit.type != Type::BEFORE) step.from = start;
+                if (crit.type == Type::BEFORE) step.to = start;
+                if (crit.type == Type::ON) step.to = start + 86400;
+                return step;
+            }
+            default:
+                step.op = Step::Op::Text;
+                step.key = &crit;
+                return step;
+        }
+    }
+
+    void run(const Step& step, Matches& out) {
+        const size_t n = messages_.size();
+        switch (step.op) {
+            case Step::Op::And:
+            case Step::Op::Or: {
+                const bool all = step.op == Step::Op::And;
+                std::fill(out.begin(), out.end(), all ? 1 : 0);
+                Matches part(n);
+                for (const auto& child : step.children) {
+                    run(child, part);
+                    if (all) {
+                        for (size_t i = 0; i < n; ++i) out[i] &= part[i];
+                    } else {
+                        for (size_t i = 0; i < n; ++i) out[i] |= part[i];
+                    }
+                }
+                return;
+            }
+            case Step::Op::Not:
+                run(step.children.front(), out);
+                for (size_t i = 0; i < n; ++i) out[i] ^= 1;
+                return;
+            case Step::Op::Flags: {
+                const uint8_t* flags = messages_.flag_column().data();
+                const uint8_t mask = step.mask;
+                const uint8_t want = step.want;
+                for (size_t i = 0; i < n; ++i) out[i] = (flags[i] & mask) == want;
+                return;
+            }
+            case Step::Op::Larger:
+            case Step::Op::Smaller: {
+                const uint64_t* sizes = messages_.size_column().data();
+                const uint64_t size = step.size;
+                if (step.op == Step::Op::Larger) {
+                    for (size_t i = 0; i < n; ++i) out[i] = sizes[i] > size;
+                } else {
+                    for (size_t i = 0; i < n; ++i) out[i] = sizes[i] < size;
+                }
+                return;
+            }
+            case Step::Op::ModSeq: {
+                const uint64_t* modseqs = messages_.modseq_column().data();
+                const uint64_t least = step.size;
+                for (size_t i = 0; i < n; ++i) out[i] = modseqs[i] >= least;
+                return;
+            }
+            case Step::Op::Dates: {
+                const int64_t* dates = messages_.date_column().data();
+                const int64_t from = step.from;
+                const int64_t to = step.to;
+                for (size_t i = 0; i < n; ++i) out[i] = (dates[i] >= from) & (dates[i] < to);
+                return;
+            }
+            case Step::Op::Uids:
+            case Step::Op::Sequences: {
+                std::fill(out.begin(), out.end(), 0);
+                for (auto [begin, end] : messages_.row_spans(step.set, step.op == Step::Op::Uids)) {
+                    std::fill(out.begin() + begin, out.begin() + end, 1);
+                }
+                return;
+            }
+            case Step::Op::Keyword: {
+                std::fill(out.begin(), out.end(), 0);
+                const std::string keyword(step.key->value);
+                for (const auto& [uid, keywords] : messages_.keyword_map()) {
+                    auto row = messages_.find_uid(uid);
+                    if (row && keywords.count(keyword)) {
+                        out[*row] = 1;
+                    }
+                }
+                return;
+            }
+            case Step::Op::Text:
+                out = text(*step.key);
+                return;
+        }
+    }
+
+    static bool compare_day(SearchCriteria::Type type, int32_t day, int32_t wanted) {
+        switch (type) {
+            case SearchCriteria::Type::SENTBEFORE: return day < wanted;
+            case SearchCriteria::Type::SENTON: return day == wanted;
+            default: return day >= wanted;
+        }
+    }
+
+    Matches text(const SearchCriteria& crit) {
+        using Type = SearchCriteria::Type;
+        switch (crit.type) {
+            case Type::SENTBEFORE:
+            case Type::SENTON:
+            case Type::SENTSINCE: {
+                auto day = parse_search_day(crit.value);
+                return each_document([day, type = crit.type](const SearchDocument& doc) {
+                    return day && doc.sent_day != SearchDocument::no_date &&
+                           compare_day(type, doc.sent_day, *day);
+                });
+            }
+            case Type::FROM: return column(&SearchDocument::from, crit.value);
+            case Type::TO: return column(&SearchDocument::to, crit.value);
+            case Type::CC: return column(&SearchDocument::cc, crit.value);
+            case Type::BCC: return column(&SearchDocument::bcc, crit.value);
+            case Type::SUBJECT: return column(&SearchDocument::subject, crit.value);
+            case Type::HEADER: return header(crit.header_name, crit.value);
+            case Type::BODY: return words({""}, crit.value);
+            case Type::TEXT: return words({"", "*"}, crit.value);
+            default: return Matches(messages_.size(), 0);
+        }
+    }
+
+    // Messages without a document (gone, or unreadable) match nothing.
+    template <typename Predicate>
+    Matches each_document(Predicate predicate) {
+        Matches matches(messages_.size(), 0);
+        if (!index()) {
+            return matches;
+        }
+        for (size_t i = 0; i < messages_.size(); ++i) {
+            matches[i] = docs_[i] && predicate(index_->document(*docs_[i]));
+        }
+        return matches;
+    }
+
+    // Address and subject keys are substring matches, as IMAP has them, on
+    // the columns the index keeps in memory.
+    Matches column(std::string SearchDocument::*field, std::string_view value) {
+        return each_document([field, value](const SearchDocument& doc) {
+            return contains_nocase(doc.*field, value);
+        });
+    }
+
+    Matches header(std::string_view name, std::string_view value) {
+        std::string field(name);
+        std::transform(field.begin(), field.end(), field.begin(), ::tolower);
+        if (field == "from") return column(&SearchDocument::from, value);
+        if (field == "to") return column(&SearchDocument::to, value);
+        if (field == "cc") return column(&SearchDocument::cc, value);
+        if (field == "bcc") return column(&SearchDocument::bcc, value);
+        if (field == "subject") return column(&SearchDocument::subject, value);
+        if (!index()) {
+            return Matches(messages_.size(), 0);
+        }
+        if (search_words(value).empty()) {
+            // Any message that has the field.
+            return from_docs(index_->postings(field + ":"));
+        }
+        return words({field}, value);
+    }
+
+    // Other text keys match words by prefix through the inverted index.
+    Matches words(std::initializer_list<std::string_view> fields, std::string_view value) {
+        if (!index()) {
+            return Matches(messages_.size(), 0);
+        }
+        auto docs = index_->lookup(fields, value);
+        if (!docs) {
+            return each_document([](const SearchDocument&) { return true; });
+        }
+        return from_docs(*docs);
+    }
+
+    Matches from_docs(const std::vector<SearchIndex::DocId>& docs) {
+        Matches matches(messages_.size(), 0);
+        for (size_t i = 0; i < messages_.size(); ++i) {
+            matches[i] = docs_[i] && std::binary_search(docs.begin(), docs.end(), *docs_[i]);
+        }
+        return matches;
+    }
+
+    SearchIndex* index() {
+        if (!opened_) {
+            opened_ = true;
+            index_ = open_index_();
+            if (index_) {
+                docs_.reserve(messages_.size());
+                for (size_t i = 0; i < messages_.size(); ++i) {
+                    docs_.push_back(index_->find(messages_.unique_id(i)));
+                }
+            }
+        }
+        return index_;
+    }
+
+    const MessageTable& messages_;
+    std::function<SearchIndex*()> open_index_;
+    Step root_;
+    bool opened_ = false;
+    SearchIndex* index_ = nullptr;
+    std::vector<std::optional<SearchIndex::DocId>> docs_;  // Per message
+};
+
+}  // namespace
+
+void MessageTable::clear() {
+    shared_.reset();
+    uids_.clear();
+    unique_ids_.clear();
+    sizes_.clear();
+    dates_.clear();
+    flags_.clear();
+    modseqs_.clear();
+    keywords_.clear();
+    node_bytes_ = 0;
+}
+
+void MessageTable::assign(std::shared_ptr<const MailboxSnapshot> snapshot,
+                          std::vector<uint8_t> flags) {
+    clear();
+    flags_ = std::move(flags);
+    modseqs_ = snapshot->modseqs;
+    shared_ = std::move(snapshot);
+}
+
+void MessageTable::detach() {
+    if (!shared_) {
+        return;
+    }
+    uids_ = shared_->uids;
+    unique_ids_ = shared_->unique_ids;
+    sizes_ = shared_->sizes;
+    dates_ = shared_->dates;
+    for (const auto& unique_id : unique_ids_) {
+        node_bytes_ += string_heap_bytes(unique_id);
+    }
+    shared_.reset();
+}
+
+void MessageTable::push_back(uint32_t uid, std::string unique_id, uint64_t size,
+                             std::chrono::system_clock::time_point internal_date, uint8_t flags,
+                             uint64_t modseq) {
+    detach();
+    node_bytes_ += string_heap_bytes(unique_id);
+    uids_.push_back(uid);
+    unique_ids_.push_back(std::move(unique_id));
+    sizes_.push_back(size);
+    dates_.push_back(
+        std::chrono::duration_cast<std::chrono::seconds>(internal_date.time_since_epoch()).count());
+    flags_.push_back(flags);
+    modseqs_.push_back(modseq);
+}
+
+void MessageTable::erase(std::span<const size_t> rows) {
+    detach();
+    size_t kept = 0;
+    auto next = rows.begin();
+    for (size_t row = 0; row < size(); ++row) {
+        if (next != rows.end() && *next == row) {
+            ++next;
+            set_keywords(row, {});
+            node_bytes_ -= string_heap_bytes(unique_ids_[row]);
+            continue;
+        }
+        if (kept != row) {
+            uids_[kept] = uids_[row];
+            unique_ids_[kept] = std::move(unique_ids_[row]);
+            sizes_[kept] = sizes_[row];
+            dates_[kept] = dates_[row];
+            flags_[kept] = flags_[row];
+            modseqs_[kept] = modseqs_[row];
+        }
+        ++kept;
+    }
+    uids_.resize(kept);
+    unique_ids_.resize(kept);
+    sizes_.resize(kept);
+    dates_.resize(kept);
+    flags_.resize(kept);
+    modseqs_.resize(kept);
+}
+
+std::optional<size_t> MessageTable::find_uid(uint32_t uid) const {
+    const auto& uids = this->uids();
+    auto it = std::lower_bound(uids.begin(), uids.end(), uid);
+    if (it == uids.end() || *it != uid) {
+        return std::nullopt;
+    }
+    return static_cast<size_t>(it - uids.begin());
+}
+
+std::vector<std::pair<size_t, size_t>> MessageTable::row_spans(const SequenceSet& set,
+                                                               bool by_uid) const {
+    const auto& uids = this->uids();
+    const size_t n = uids.size();
+    const uint32_t largest = by_uid ? (uids.empty() ? 0 : uids.back()) : static_cast<uint32_t>(n);
+    std::vector<std::pair<size_t, size_t>> spans;
+    auto from = uids.begin();  // The ranges ascend, and so do their rows
+    for (const auto& range : set.normalized(largest).ranges) {
+        size_t begin, end;
+        if (by_uid) {
+            from = std::lower_bound(from, uids.end(), range.start);
+            begin = static_cast<size_t>(from - uids.begin());
+            from = std::upper_bound(from, uids.end(), range.end);
+            end = static_cast<size_t>(from - uids.begin());
+        } else {
+            begin = std::min<size_t>(std::max<uint32_t>(range.start, 1) - 1, n);
+            end = std::min<size_t>(range.end, n);
+        }
+        if (begin < end) {
+            spans.emplace_back(begin, end);
+        }
+    }
+    return spans;
+}
+
+const std::set<std::string>& MessageTable::keywords(size_t row) const {
+    static const std::set<std::string> none;
+    auto it = keywords_.find(uid(row));
+    return it != keywords_.end() ? it->second : none;
+}
+
+void MessageTable::set_keywords(size_t row, std::set<std::string> keywords) {
+    using Entry = std::pair<const uint32_t, std::set<std::string>>;
+    auto bytes = [](const std::set<std::string>& set) {
+        std::size_t total = tree_node_bytes<Entry>;
+        for (const auto& keyword : set) {
+            total += tree_node_bytes<std::string> + string_heap_bytes(keyword);
+        }
+        return total;
+    };
+    auto it = keywords_.find(uid(row));
+    if (it != keywords_.end()) {
+        node_bytes_ -= bytes(it->second);
+        keywords_.erase(it);
+    }
+    if (!keywords.empty()) {
+        node_bytes_ += bytes(keywords);
+        keywords_.emplace(uid(row), std::move(keywords));
+    }
+}
+
+std::size_t MessageTable::heap_bytes() const {
+    return uids_.capacity() * sizeof(uint32_t) + unique_ids_.capacity() * sizeof(std::string) +
+           sizes_.capacity() * sizeof(uint64_t) + dates_.capacity() * sizeof(int64_t) +
+           flags_.capacity() + modseqs_.capacity() * sizeof(uint64_t) + node_bytes_;
+}
+
 IMAPSession::IMAPSession(asio::io_context& io_context, tcp::socket socket,
                          std::shared_ptr<Authenticator> auth,
                          const std::filesystem::path& maildir_root,
@@ -29,6 +585,10 @@ IMAPSession::IMAPSession(asio::io_context& io_context, tcp::socket socket,
 }
 #endif
 
+IMAPSession::~IMAPSession() {
+    stop_idle_waits();
+}
+
 void IMAPSession::on_connect() {
     Session::on_connect();
     LOG_INFO_FMT("IMAP connection from {}:{}", remote_address(), remote_port());
@@ -38,7 +598,56 @@ void IMAPSession::on_connect() {
 }
 
 void IMAPSession::on_data(const std::string& data) {
-    process_command(data);
+    if (idling()) {
+        process_command(data);
+        return;
+    }
+
+    auto literal = IMAPParser::literal_at_end(data);
+    if (!literal) {
+        if (pending_command_.empty()) {
+            process_command(data);
+            return;
+        }
+        pending_command_ += data;
+        process_command(pending_command_);
+        pending_command_.clear();
+        if (pending_command_.capacity() > 64 * 1024) {
+            std::string().swap(pending_command_);
+        }
+        update_footprint();
+        return;
+    }
+
+    pending_command_.append(data).append("\r\n");
+    if (literal->size > max_command_size_ ||
+        pending_command_.size() > max_command_size_ - literal->size) {
+        std::string_view rest = pending_command_;
+        const std::string tag(IMAPParser::next_token(rest));
+        std::string().swap(pending_command_);
+        if (literal->synchronizing) {
+            // The client waits for a continuation, so it sends nothing more.
+            send_line(tag + " NO [TOOBIG] Command too large");
+        } else {
+            send_line("* BYE [TOOBIG] Command too large");
+            close_after_flush();
+        }
+        return;
+    }
+    if (literal->size == 0) {
+        return;  // The command goes on with the next line
+    }
+
+    pending_command_.reserve(pending_command_.size() + literal->size);
+    update_footprint();
+    if (literal->synchronizing) {
+        send_line("+ Ready for literal data");
+    }
+    read_bytes(literal->size);
+}
+
+void IMAPSession::on_bytes(std::string_view bytes, bool /* last */) {
+    pending_command_.append(bytes);
 }
 
 void IMAPSession::on_tls_handshake_complete() {
@@ -46,26 +655,179 @@ void IMAPSession::on_tls_handshake_complete() {
     LOG_INFO("IMAP TLS handshake completed");
 }
 
+void IMAPSession::on_write_drained() {
+    if (resume_ && resume_()) {
+        resume_ = nullptr;
+    }
+}
+
+void IMAPSession::on_disconnect() {
+    stop_idle_waits();
+    Session::on_disconnect();
+}
+
 void IMAPSession::process_command(const std::string& line) {
-    LOG_DEBUG_FMT("IMAP command: {}", line);
+    LOG_DEBUG_FMT("IMAP command: {}", std::string_view(line).substr(0, line.find('\r')));
+    if (idling()) {
+        finish_idle(line);
+        return;
+    }
+
+    bool logout = false;
+    {
+        Command cmd = Command::parse(line, arena_.resource());
+
+        if (cmd.type == CommandType::UNKNOWN) {
+            Responses responses(cmd.get_allocator());
+            response::bad(responses, cmd.tag.empty() ? "*" : cmd.tag, "Unknown command");
+            send_responses(responses);
+        } else {
+            send_responses(CommandHandler::instance().execute(*this, cmd));
+            logout = cmd.type == CommandType::LOGOUT;
+        }
+    }
+    // Everything parsed or built for this command is gone from here on.
+    arena_.reset();
+
+    // Handle LOGOUT
+    if (logout) {
+        close_after_flush();
+    }
+}
+
+void IMAPSession::start_idle(std::string_view tag) {
+    idle_tag_ = tag;
+    saved_timeout_ = timeout();
+    set_timeout(idle_timeout_);
+    if (!maildir_ || !selected_) {
+        return;  // Nothing to report until DONE
+    }
+
+    auto weak = weak_from_this();
+    idle_subscription_ = maildir_->subscribe(selected_->name, [this, weak] {
+        if (idle_wake_posted_.exchange(true, std::memory_order_relaxed)) {
+            return;
+        }
+        if (auto self = weak.lock()) {
+            asio::post(strand_, [this, self = std::move(self)] {
+                idle_wake_posted_.store(false, std::memory_order_relaxed);
+                idle_wake();
+            });
+        }
+    });
+    watch_idle();
+}
+
+void IMAPSession::watch_idle() {
+    auto self = shared_from_this();
+    const uint64_t generation = idle_generation_;
+    auto wake = [this, self, generation](const boost::system::error_code& ec) {
+        if (ec || generation != idle_generation_) {
+            return;
+        }
+        idle_wake();
+        watch_idle();
+    };
+
+    // A fresh registration each time: epoll reports a descriptor that is
+    // already readable when it is added, so nothing slips in between.
+    idle_watch_.reset();
+    const int fd = maildir_->watch_fd(selected_->name);
+    const int copy = fd >= 0 ? ::fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (copy >= 0) {
+        idle_watch_ = std::make_unique<asio::posix::stream_descriptor>(strand_, copy);
+        idle_watch_->async_wait(asio::posix::stream_descriptor::wait_read, std::move(wake));
+        return;
+    }
+    if (!idle_timer_) {
+        idle_timer_ = std::make_unique<asio::steady_timer>(strand_);
+    }
+    idle_timer_->expires_after(idle_poll_interval);
+    idle_timer_->async_wait(std::move(wake));
+}
 
-    Command cmd = Command::parse(line);
+void IMAPSession::stop_idle_waits() {
+    ++idle_generation_;
+    idle_subscription_.reset();
+    idle_watch_.reset();
+    if (idle_timer_) {
+        idle_timer_->cancel();
+    }
+}
 
-    if (cmd.type == CommandType::UNKNOWN) {
-        send_line(response::bad(cmd.tag.empty() ? "*" : cmd.tag, "Unknown command"));
+void IMAPSession::idle_wake() {
+    if (!idling() || stopped_) {
         return;
     }
+    {
+        Responses responses(arena_.resource());
+        report_changes(responses);
+        send_responses(responses);
+    }
+    arena_.reset();
+}
+
+void IMAPSession::finish_idle(const std::string& line) {
+    const std::string tag = std::exchange(idle_tag_, {});
+    stop_idle_waits();
+    set_timeout(saved_timeout_);
 
-    auto responses = CommandHandler::instance().execute(*this, cmd);
+    std::string_view done = line;
+    while (!done.empty() && std::isspace(static_cast<unsigned char>(done.back()))) {
+        done.remove_suffix(1);
+    }
+    const bool is_done = done.size() == 4 &&
+                         std::equal(done.begin(), done.end(), "DONE", [](char a, char b) {
+                             return std::toupper(static_cast<unsigned char>(a)) == b;
+                         });
+    {
+        Responses responses(arena_.resource());
+        if (is_done) {
+            report_changes(responses);
+            response::ok(responses, tag, "IDLE terminated");
+        } else {
+            response::bad(responses, tag, "Expected DONE");
+        }
+        send_responses(responses);
+    }
+    arena_.reset();
+}
 
-    for (const auto& response : responses) {
-        send_line(response);
+void IMAPSession::send_responses(const Responses& lines) {
+    size_t total = 0;
+    for (const auto& line : lines) {
+        total += line.size() + 2;
     }
+    if (total == 0) return;
 
-    // Handle LOGOUT
-    if (cmd.type == CommandType::LOGOUT) {
-        stop();
+    std::string data;
+    data.reserve(total);
+    for (const auto& line : lines) {
+        data.append(line).append("\r\n");
     }
+    send(std::move(data));
+}
+
+void IMAPSession::login(std::string tag, std::string username, std::string password) {
+    suspend_input();
+    auth_->authenticate_async(username, std::move(password),
+        on_strand([this, tag = std::move(tag), username](bool valid) {
+            if (!valid) {
+                send_line(std::string(response::no(tag, "[AUTHENTICATIONFAILED] Authentication failed")));
+            } else {
+                set_authenticated(true);
+                auto [user, domain] = Authenticator::parse_email(username);
+                set_username(user);
+                set_domain(domain);
+                if (open_maildir()) {
+                    set_state(SessionState::AUTHENTICATED);
+                    send_line(std::string(response::ok(tag, "LOGIN completed")));
+                } else {
+                    send_line(std::string(response::no(tag, "Unable to open mailbox")));
+                }
+            }
+            resume_input();
+        }));
 }
 
 bool IMAPSession::open_maildir() {
@@ -96,6 +858,12 @@ bool IMAPSession::select_mailbox(const std::string& name, bool read_only) {
         return false;
     }
 
+    if (selected_) {
+        maildir_->unwatch(selected_->name);
+    }
+    // Watch before listing, so nothing falls between the two.
+    maildir_->watch(mailbox_name);
+
     selected_ = SelectedMailbox{};
     selected_->name = mailbox_name;
     selected_->read_only = read_only;
@@ -115,10 +883,12 @@ bool IMAPSession::select_mailbox(const std::string& name, bool read_only) {
 }
 
 void IMAPSession::close_mailbox() {
+    if (selected_ && maildir_) {
+        maildir_->unwatch(selected_->name);
+    }
     selected_.reset();
     messages_.clear();
-    seq_to_uid_.clear();
-    uid_to_seq_.clear();
+    account_cache();
     set_state(SessionState::AUTHENTICATED);
 }
 
@@ -130,37 +900,43 @@ std::vector<std::string> IMAPSession::list_mailboxes(const std::string& /* refer
 
 void IMAPSession::load_messages() {
     messages_.clear();
-    seq_to_uid_.clear();
-    uid_to_seq_.clear();
 
     if (!maildir_ || !selected_) return;
 
-    auto msgs = maildir_->list_messages(selected_->name);
-    uint32_t seq = 1;
-
-    for (const auto& msg : msgs) {
-        CachedMessage cached;
-        cached.sequence_number = seq;
-        cached.uid = next_uid_++;
-        cached.unique_id = msg.unique_id;
-        cached.size = msg.size;
-        cached.flags = maildir_to_imap_flags(msg.flags);
-        cached.internal_date = msg.timestamp;
-
-        if (msg.is_new) {
-            cached.flags.insert("\\Recent");
+    auto snapshot = maildir_->snapshot(selected_->name);
+    std::vector<uint8_t> flags(snapshot->size());
+    for (size_t row = 0; row < snapshot->size(); ++row) {
+        flags[row] = index_to_imap_flags(snapshot->flags[row]) |
+                     (snapshot->in_new[row] ? system_flag::recent : 0);
+    }
+    if (snapshot->indexed()) {
+        messages_.assign(std::move(snapshot), std::move(flags));
+    } else {
+        // Without the index there are no persistent UIDs; number by
+        // position, as get_mailbox_info() reports UIDNEXT then.
+        for (size_t row = 0; row < snapshot->size(); ++row) {
+            messages_.push_back(
+                static_cast<uint32_t>(row + 1), snapshot->unique_ids[row], snapshot->sizes[row],
+                std::chrono::system_clock::time_point(std::chrono::seconds(snapshot->dates[row])),
+                flags[row], 0);
         }
-
-        seq_to_uid_[seq] = cached.uid;
-        uid_to_seq_[cached.uid] = seq;
-
-        messages_.push_back(cached);
-        seq++;
     }
-
+    // Read with the listing, so it covers exactly what the listing shows.
+    const auto modseqs = messages_.modseq_column();
+    selected_->highest_modseq =
+        std::find(modseqs.begin(), modseqs.end(), 0) == modseqs.end()
+            ? maildir_->get_highest_modseq(selected_->name)
+            : 0;
+
+    account_cache();
     update_mailbox_counts();
 }
 
+void IMAPSession::account_cache() {
+    cache_bytes_ = messages_.heap_bytes();
+    update_footprint();
+}
+
 void IMAPSession::update_mailbox_counts() {
     if (!selected_) return;
 
@@ -168,226 +944,452 @@ void IMAPSession::update_mailbox_counts() {
     selected_->recent = 0;
     selected_->unseen = 0;
 
-    for (const auto& msg : messages_) {
-        if (msg.flags.count("\\Recent")) {
-            selected_->recent++;
-        }
-        if (!msg.flags.count("\\Seen")) {
-            selected_->unseen++;
-        }
+    for (uint8_t flags : messages_.flag_column()) {
+        selected_->recent += (flags & system_flag::recent) != 0;
+        selected_->unseen += (flags & system_flag::seen) == 0;
     }
 }
 
-std::optional<CachedMessage> IMAPSession::get_message_by_sequence(uint32_t seq) const {
+const std::string* IMAPSession::unique_id_of(uint32_t seq) const {
     if (seq < 1 || seq > messages_.size()) {
-        return std::nullopt;
+        return nullptr;
     }
-    return messages_[seq - 1];
+    return &messages_.unique_id(seq - 1);
 }
 
-std::optional<CachedMessage> IMAPSession::get_message_by_uid(uint32_t uid) const {
-    auto it = uid_to_seq_.find(uid);
-    if (it == uid_to_seq_.end()) {
+std::optional<MessageView> IMAPSession::map_message(uint32_t seq) const {
+    const auto* unique_id = unique_id_of(seq);
+    if (!unique_id || !maildir_ || !selected_) {
         return std::nullopt;
     }
-    return get_message_by_sequence(it->second);
+    return maildir_->map_message(*unique_id, selected_->name);
 }
 
-std::optional<std::string> IMAPSession::get_message_content(uint32_t seq) const {
-    auto msg = get_message_by_sequence(seq);
-    if (!msg || !maildir_ || !selected_) {
+std::optional<OutboundFile> IMAPSession::open_message_file(uint32_t seq) const {
+    const auto* unique_id = unique_id_of(seq);
+    if (!unique_id || !maildir_ || !selected_) {
         return std::nullopt;
     }
-    return maildir_->get_message_content(msg->unique_id, selected_->name);
-}
 
-std::optional<std::string> IMAPSession::get_message_headers(uint32_t seq) const {
-    auto msg = get_message_by_sequence(seq);
-    if (!msg || !maildir_ || !selected_) {
+    auto stored = maildir_->get_message(*unique_id, selected_->name);
+    if (!stored) {
         return std::nullopt;
     }
-    return maildir_->get_message_headers(msg->unique_id, selected_->name);
+    return OutboundFile::open(stored->path);
 }
 
-bool IMAPSession::set_flags(uint32_t seq, const std::set<std::string>& flags) {
-    if (seq < 1 || seq > messages_.size() || !maildir_ || !selected_) {
-        return false;
-    }
-
-    auto maildir_flags = imap_to_maildir_flags(flags);
-    if (maildir_->set_flags(messages_[seq - 1].unique_id, maildir_flags, selected_->name)) {
-        messages_[seq - 1].flags = flags;
-        return true;
+std::optional<std::string> IMAPSession::get_message_headers(uint32_t seq) const {
+    const auto* unique_id = unique_id_of(seq);
+    if (!unique_id || !maildir_ || !selected_) {
+        return std::nullopt;
     }
-    return false;
+    return maildir_->get_message_headers(*unique_id, selected_->name);
 }
 
-bool IMAPSession::add_flags(uint32_t seq, const std::set<std::string>& flags) {
-    if (seq < 1 || seq > messages_.size()) {
-        return false;
+std::optional<MessageStructure> IMAPSession::get_message_structure(uint32_t seq) const {
+    const auto* unique_id = unique_id_of(seq);
+    if (!unique_id || !maildir_ || !selected_) {
+        return std::nullopt;
     }
-
-    auto new_flags = messages_[seq - 1].flags;
-    new_flags.insert(flags.begin(), flags.end());
-    return set_flags(seq, new_flags);
+    return maildir_->get_message_structure(*unique_id, selected_->name);
 }
 
-bool IMAPSession::remove_flags(uint32_t seq, const std::set<std::string>& flags) {
-    if (seq < 1 || seq > messages_.size()) {
-        return false;
+std::vector<uint32_t> IMAPSession::store_flags(std::span<const uint32_t> seqs,
+                                               FlagChange::Mode mode,
+                                               const std::set<std::string>& flags,
+                                               std::optional<uint64_t> unchanged_since,
+                                               std::vector<uint32_t>* modified) {
+    std::vector<uint32_t> updated;
+    if (!maildir_ || !selected_) {
+        return updated;
     }
 
-    auto new_flags = messages_[seq - 1].flags;
+    // \Recent is the server's to set; STORE leaves it be.
+    uint8_t system = 0;
+    std::set<std::string> keywords;
     for (const auto& flag : flags) {
-        new_flags.erase(flag);
+        if (uint8_t bit = IMAPParser::system_flag_bit(flag)) {
+            system |= bit & ~system_flag::recent;
+        } else {
+            keywords.insert(flag);
+        }
     }
-    return set_flags(seq, new_flags);
-}
 
-std::vector<uint32_t> IMAPSession::search(const std::vector<SearchCriteria>& criteria, bool use_uid) {
-    std::vector<uint32_t> results;
+    const auto maildir_flags = imap_to_maildir_flags(system);
+    std::vector<FlagChange> changes;
+    std::vector<uint32_t> targets;
+    changes.reserve(seqs.size());
+    targets.reserve(seqs.size());
+    for (uint32_t seq : seqs) {
+        if (seq < 1 || seq > messages_.size()) {
+            continue;
+        }
+        changes.push_back({messages_.unique_id(seq - 1), mode, maildir_flags});
+        targets.push_back(seq);
+    }
 
-    for (const auto& msg : messages_) {
-        bool matches = true;
+    // The index has changes other sessions made that this one has not
+    // reported yet; they count against UNCHANGEDSINCE too.
+    if (unchanged_since) {
+        std::vector<std::string> unique_ids;
+        unique_ids.reserve(changes.size());
+        for (const auto& change : changes) {
+            unique_ids.push_back(change.unique_id);
+        }
+        const auto current = maildir_->get_modseqs(unique_ids, selected_->name);
+        size_t kept = 0;
+        for (size_t i = 0; i < changes.size(); ++i) {
+            const uint64_t modseq = current[i] ? current[i] : messages_.modseq(targets[i] - 1);
+            if (modseq > *unchanged_since) {
+                if (modified) modified->push_back(targets[i]);
+                continue;
+            }
+            changes[kept] = std::move(changes[i]);
+            targets[kept++] = targets[i];
+        }
+        changes.resize(kept);
+        targets.resize(kept);
+    }
 
-        for (const auto& crit : criteria) {
-            switch (crit.type) {
-                case SearchCriteria::Type::ALL:
-                    // Always matches
-                    break;
-                case SearchCriteria::Type::SEEN:
-                    matches = msg.flags.count("\\Seen") > 0;
-                    break;
-                case SearchCriteria::Type::UNSEEN:
-                    matches = msg.flags.count("\\Seen") == 0;
-                    break;
-                case SearchCriteria::Type::ANSWERED:
-                    matches = msg.flags.count("\\Answered") > 0;
-                    break;
-                case SearchCriteria::Type::UNANSWERED:
-                    matches = msg.flags.count("\\Answered") == 0;
-                    break;
-                case SearchCriteria::Type::DELETED:
-                    matches = msg.flags.count("\\Deleted") > 0;
-                    break;
-                case SearchCriteria::Type::UNDELETED:
-                    matches = msg.flags.count("\\Deleted") == 0;
-                    break;
-                case SearchCriteria::Type::FLAGGED:
-                    matches = msg.flags.count("\\Flagged") > 0;
-                    break;
-                case SearchCriteria::Type::UNFLAGGED:
-                    matches = msg.flags.count("\\Flagged") == 0;
-                    break;
-                case SearchCriteria::Type::DRAFT:
-                    matches = msg.flags.count("\\Draft") > 0;
-                    break;
-                case SearchCriteria::Type::UNDRAFT:
-                    matches = msg.flags.count("\\Draft") == 0;
-                    break;
-                case SearchCriteria::Type::RECENT:
-                    matches = msg.flags.count("\\Recent") > 0;
-                    break;
-                case SearchCriteria::Type::NEW:
-                    matches = msg.flags.count("\\Recent") > 0 && msg.flags.count("\\Seen") == 0;
-                    break;
-                case SearchCriteria::Type::OLD:
-                    matches = msg.flags.count("\\Recent") == 0;
-                    break;
-                case SearchCriteria::Type::LARGER:
-                    matches = msg.size > std::stoul(crit.value);
+    auto results = maildir_->apply_flags(changes, selected_->name);
+    updated.reserve(targets.size());
+    for (std::size_t i = 0; i < targets.size(); ++i) {
+        if (!results[i]) {
+            continue;
+        }
+        const size_t row = targets[i] - 1;
+
+        // Flags the maildir stores come from its answer; the session-only
+        // ones (\Recent, keywords) follow the STORE in memory.
+        messages_.set_flags(row, maildir_to_imap_flags(*results[i]) |
+                                     (messages_.flags(row) & system_flag::recent));
+        if (!keywords.empty() || mode == FlagChange::Mode::Replace) {
+            auto next = messages_.keywords(row);
+            switch (mode) {
+                case FlagChange::Mode::Replace:
+                    next = keywords;
                     break;
-                case SearchCriteria::Type::SMALLER:
-                    matches = msg.size < std::stoul(crit.value);
+                case FlagChange::Mode::Add:
+                    next.insert(keywords.begin(), keywords.end());
                     break;
-                case SearchCriteria::Type::UID: {
-                    auto set = SequenceSet::parse(crit.value);
-                    matches = set.contains(msg.uid);
-                    break;
-                }
-                default:
-                    // For complex criteria like BODY, FROM, etc.
-                    // Would need to read and parse message content
+                case FlagChange::Mode::Remove:
+                    for (const auto& keyword : keywords) {
+                        next.erase(keyword);
+                    }
                     break;
             }
+            messages_.set_keywords(row, std::move(next));
+        }
+        updated.push_back(targets[i]);
+    }
+
+    std::vector<size_t> rows;
+    rows.reserve(updated.size());
+    for (uint32_t seq : updated) {
+        rows.push_back(seq - 1);
+    }
+    refresh_modseqs(rows);
+    account_cache();
+    return updated;
+}
 
-            if (!matches) break;
+bool IMAPSession::append_message(const std::string& mailbox, const std::string& content,
+                                 const std::set<std::string>& flags) {
+    uint8_t system = 0;
+    for (const auto& flag : flags) {
+        system |= IMAPParser::system_flag_bit(flag);
+    }
+    return !maildir_->deliver(content, mailbox, imap_to_maildir_flags(system)).empty();
+}
+
+std::vector<uint32_t> IMAPSession::search(const std::pmr::vector<SearchCriteria>& criteria, bool use_uid) {
+    std::vector<uint32_t> results;
+
+    SearchProgram program(criteria, messages_, [this]() -> SearchIndex* {
+        if (!maildir_ || !selected_) {
+            return nullptr;
+        }
+        std::vector<std::string> unique_ids;
+        unique_ids.reserve(messages_.size());
+        for (size_t i = 0; i < messages_.size(); ++i) {
+            unique_ids.push_back(messages_.unique_id(i));
         }
+        return &maildir_->prepare_search(unique_ids, selected_->name);
+    });
+    auto matches = program.run();
 
-        if (matches) {
-            results.push_back(use_uid ? msg.uid : msg.sequence_number);
+    for (size_t i = 0; i < messages_.size(); ++i) {
+        if (matches[i]) {
+            results.push_back(use_uid ? messages_.uid(i) : static_cast<uint32_t>(i + 1));
         }
     }
 
     return results;
 }
 
-std::vector<uint32_t> IMAPSession::expunge() {
-    std::vector<uint32_t> deleted_seqs;
-
+void IMAPSession::expunge(Responses* out) {
     if (!maildir_ || !selected_) {
-        return deleted_seqs;
+        return;
     }
 
     // Collect messages to delete
     std::vector<size_t> to_delete;
-    for (size_t i = 0; i < messages_.size(); ++i) {
-        if (messages_[i].flags.count("\\Deleted")) {
+    auto flags = messages_.flag_column();
+    for (size_t i = 0; i < flags.size(); ++i) {
+        if (flags[i] & system_flag::deleted) {
             to_delete.push_back(i);
         }
     }
 
-    // Delete in reverse order to maintain correct sequence numbers
-    for (auto it = to_delete.rbegin(); it != to_delete.rend(); ++it) {
-        size_t idx = *it;
-        maildir_->delete_message(messages_[idx].unique_id, selected_->name);
-        deleted_seqs.push_back(static_cast<uint32_t>(idx + 1));
+    for (size_t idx : to_delete) {
+        maildir_->delete_message(messages_.unique_id(idx), selected_->name);
     }
 
-    // Reload messages
-    load_messages();
+    if (!to_delete.empty()) {
+        if (out) {
+            report_expunged(to_delete, *out);
+        }
+        messages_.erase(to_delete);
+        maildir_->prune_caches(selected_->name);
+        account_cache();
+        update_mailbox_counts();
+    }
+}
+
+void IMAPSession::report_expunged(std::span<const size_t> rows, Responses& out) const {
+    if (qresync_) {
+        SequenceSet uids;
+        for (size_t row : rows) {
+            uids.push_back(messages_.uid(row));
+        }
+        response::untagged(out, "VANISHED ");
+        uids.append_to(out.back());
+        return;
+    }
+    for (auto it = rows.rbegin(); it != rows.rend(); ++it) {
+        response::untagged(out, "{} EXPUNGE", *it + 1);
+    }
+}
+
+void IMAPSession::refresh_modseqs(std::span<const size_t> rows) {
+    if (rows.empty() || !maildir_ || !selected_) {
+        return;
+    }
+    std::vector<std::string> unique_ids;
+    unique_ids.reserve(rows.size());
+    for (size_t row : rows) {
+        unique_ids.push_back(messages_.unique_id(row));
+    }
+    const auto modseqs = maildir_->get_modseqs(unique_ids, selected_->name);
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (modseqs[i] != 0) {
+            messages_.set_modseq(rows[i], modseqs[i]);
+            if (selected_->highest_modseq != 0) {
+                selected_->highest_modseq = std::max(selected_->highest_modseq, modseqs[i]);
+            }
+        }
+    }
+}
+
+void IMAPSession::append_flag_update(Responses& out, size_t row, bool with_uid,
+                                     bool flags) const {
+    response::untagged(out, "{} FETCH (", row + 1);
+    auto& line = out.back();
+    const char* separator = "";
+    if (with_uid || qresync_) {
+        std::format_to(std::back_inserter(line), "UID {}", messages_.uid(row));
+        separator = " ";
+    }
+    if (flags) {
+        line.append(separator).append("FLAGS ");
+        IMAPParser::append_flags(line, messages_.flags(row), messages_.keywords(row));
+        separator = " ";
+    }
+    if (condstore_) {
+        std::format_to(std::back_inserter(line), "{}MODSEQ ({})", separator, messages_.modseq(row));
+    }
+    line += ')';
+}
+
+SequenceSet IMAPSession::vanished_since(uint64_t modseq, const SequenceSet& candidates) const {
+    SequenceSet vanished;
+    if (!maildir_ || !selected_) {
+        return vanished;
+    }
+    if (auto logged = maildir_->vanished_since(modseq, selected_->name)) {
+        for (uint32_t uid : *logged) {
+            if (candidates.covers(uid) && !messages_.find_uid(uid)) {
+                vanished.push_back(uid);
+            }
+        }
+        return vanished;
+    }
 
-    // Return in correct order (lowest first)
-    std::reverse(deleted_seqs.begin(), deleted_seqs.end());
-    return deleted_seqs;
+    // Every gap between the UIDs still here, within the candidates.
+    auto uids = messages_.uid_column();
+    const uint32_t last = selected_->uid_next > 0 ? selected_->uid_next - 1 : 0;
+    uint32_t next = 1;  // Lowest UID not yet considered
+    for (const auto& range : candidates.ranges) {
+        uint32_t uid = std::max(range.start, next);
+        const uint32_t end = std::min(range.end, last);
+        auto held = std::lower_bound(uids.begin(), uids.end(), uid);
+        while (uid <= end) {
+            const bool stops = held != uids.end() && *held <= end;
+            const uint32_t gap_end = stops ? *held - 1 : end;
+            if (gap_end >= uid) {
+                vanished.push_back(uid, gap_end);
+            }
+            uid = gap_end + 1;
+            if (stops) {
+                ++uid;
+                ++held;
+            }
+        }
+        next = std::max(next, uid);
+    }
+    return vanished;
+}
+
+void IMAPSession::report_changes(Responses& out) {
+    if (!maildir_ || !selected_) {
+        return;
+    }
+    auto changes = maildir_->poll_changes(selected_->name);
+    if (changes.empty()) {
+        return;
+    }
+
+    // Each EXPUNGE renumbers the messages after it, so they go out from the
+    // highest sequence number down; FETCH and EXISTS then use the new ones.
+    std::vector<size_t> expunged;
+    std::vector<const Message*> changed;
+    std::vector<const Message*> added;
+    bool reload = false;
+    const uint32_t last_uid = messages_.empty() ? 0 : messages_.uid(messages_.size() - 1);
+    for (const auto& change : changes) {
+        const auto row = messages_.find_uid(change.message.uid);
+        if (change.message.uid == 0) {
+            reload = true;  // No index: nothing to match the change with
+        } else if (change.kind == MailboxChange::Kind::Removed) {
+            if (row) {
+                expunged.push_back(*row);
+            }
+        } else if (row) {
+            changed.push_back(&change.message);
+        } else if (change.message.uid > last_uid &&
+                   (added.empty() || change.message.uid > added.back()->uid)) {
+            added.push_back(&change.message);
+        } else {
+            reload = true;  // Would break UID order
+        }
+    }
+
+    const size_t exists = messages_.size();
+    if (reload) {
+        load_messages();
+        if (messages_.size() != exists) {
+            response::untagged(out, "{} EXISTS", messages_.size());
+        }
+        return;
+    }
+
+    std::sort(expunged.begin(), expunged.end());
+    expunged.erase(std::unique(expunged.begin(), expunged.end()), expunged.end());
+    report_expunged(expunged, out);
+    messages_.erase(expunged);
+
+    // Changes carry no mod-sequences; the index has them.
+    std::vector<size_t> rows;
+    std::vector<uint8_t> flags;
+    for (const Message* msg : changed) {
+        if (auto row = messages_.find_uid(msg->uid)) {
+            rows.push_back(*row);
+            // The session's own flags (\Recent, keywords) stay as they were.
+            flags.push_back(maildir_to_imap_flags(msg->flags) |
+                            (messages_.flags(*row) & system_flag::recent));
+        }
+    }
+    for (const Message* msg : added) {
+        rows.push_back(messages_.size());
+        messages_.push_back(msg->uid, msg->unique_id, msg->size, msg->timestamp,
+                            maildir_to_imap_flags(msg->flags) |
+                                (msg->is_new ? system_flag::recent : 0),
+                            0);
+    }
+    std::vector<uint64_t> modseqs(flags.size());
+    for (size_t i = 0; i < flags.size(); ++i) {
+        modseqs[i] = messages_.modseq(rows[i]);
+    }
+    refresh_modseqs(rows);
+    for (size_t i = 0; i < flags.size(); ++i) {
+        const size_t row = rows[i];
+        if (flags[i] == messages_.flags(row) &&
+            (!condstore_ || modseqs[i] == messages_.modseq(row))) {
+            continue;
+        }
+        messages_.set_flags(row, flags[i]);
+        append_flag_update(out, row, false);
+    }
+    if (!added.empty()) {
+        selected_->uid_next = std::max(selected_->uid_next, added.back()->uid + 1);
+    }
+
+    const size_t recent = selected_->recent;
+    account_cache();
+    update_mailbox_counts();
+    if (!added.empty() || !expunged.empty()) {
+        response::untagged(out, "{} EXISTS", messages_.size());
+    }
+    if (selected_->recent != recent) {
+        response::untagged(out, "{} RECENT", selected_->recent);
+    }
 }
 
 uint32_t IMAPSession::get_uid_for_sequence(uint32_t seq) const {
-    auto it = seq_to_uid_.find(seq);
-    return it != seq_to_uid_.end() ? it->second : 0;
+    return seq >= 1 && seq <= messages_.size() ? messages_.uid(seq - 1) : 0;
 }
 
 uint32_t IMAPSession::get_sequence_for_uid(uint32_t uid) const {
-    auto it = uid_to_seq_.find(uid);
-    return it != uid_to_seq_.end() ? it->second : 0;
+    auto row = messages_.find_uid(uid);
+    return row ? static_cast<uint32_t>(*row + 1) : 0;
 }
 
-std::set<std::string> IMAPSession::maildir_to_imap_flags(const std::set<char>& flags) {
-    std::set<std::string> imap_flags;
+uint8_t IMAPSession::maildir_to_imap_flags(const std::set<char>& flags) {
+    uint8_t imap_flags = 0;
 
     for (char flag : flags) {
         switch (flag) {
-            case 'S': imap_flags.insert("\\Seen"); break;
-            case 'R': imap_flags.insert("\\Answered"); break;
-            case 'F': imap_flags.insert("\\Flagged"); break;
-            case 'T': imap_flags.insert("\\Deleted"); break;
-            case 'D': imap_flags.insert("\\Draft"); break;
+            case 'S': imap_flags |= system_flag::seen; break;
+            case 'R': imap_flags |= system_flag::answered; break;
+            case 'F': imap_flags |= system_flag::flagged; break;
+            case 'T': imap_flags |= system_flag::deleted; break;
+            case 'D': imap_flags |= system_flag::draft; break;
         }
     }
 
     return imap_flags;
 }
 
-std::set<char> IMAPSession::imap_to_maildir_flags(const std::set<std::string>& flags) {
+uint8_t IMAPSession::index_to_imap_flags(uint64_t bits) {
+    uint8_t imap_flags = 0;
+
+    if (bits & MailboxIndex::flag_bit('S')) imap_flags |= system_flag::seen;
+    if (bits & MailboxIndex::flag_bit('R')) imap_flags |= system_flag::answered;
+    if (bits & MailboxIndex::flag_bit('F')) imap_flags |= system_flag::flagged;
+    if (bits & MailboxIndex::flag_bit('T')) imap_flags |= system_flag::deleted;
+    if (bits & MailboxIndex::flag_bit('D')) imap_flags |= system_flag::draft;
+
+    return imap_flags;
+}
+
+std::set<char> IMAPSession::imap_to_maildir_flags(uint8_t flags) {
     std::set<char> maildir_flags;
 
-    for (const auto& flag : flags) {
-        if (flag == "\\Seen") maildir_flags.insert('S');
-        else if (flag == "\\Answered") maildir_flags.insert('R');
-        else if (flag == "\\Flagged") maildir_flags.insert('F');
-        else if (flag == "\\Deleted") maildir_flags.insert('T');
-        else if (flag == "\\Draft") maildir_flags.insert('D');
-    }
+    if (flags & system_flag::seen) maildir_flags.insert('S');
+    if (flags & system_flag::answered) maildir_flags.insert('R');
+    if (flags & system_flag::flagged) maildir_flags.insert('F');
+    if (flags & system_flag::deleted) maildir_flags.insert('T');
+    if (flags & system_flag::draft) maildir_flags.insert('D');
 
     return maildir_flags;
 }
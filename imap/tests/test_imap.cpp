@@ -1,6 +1,9 @@
 #include <catch2/catch_test_macros.hpp>
+#include <chrono>
 #include "imap_commands.hpp"
 #include "imap_parser.hpp"
+#include "imap_session.hpp"
+#include "net/command_arena.hpp"
 
 using namespace email::imap;
 
@@ -120,6 +123,18 @@ TEST_CASE("IMAP parser - fetch items", "[imap][parser]") {
         REQUIRE(items.size() == 1);
         REQUIRE(items[0].type == FetchItem::Type::ALL);
     }
+
+    SECTION("Sections with spaces and partials") {
+        auto items = IMAPParser::parse_fetch_items(
+            "(UID BODY.PEEK[HEADER.FIELDS (From To)] BODY[1.2]<10.200> BODY)");
+        REQUIRE(items.size() == 4);
+        REQUIRE(items[1].type == FetchItem::Type::BODY_PEEK);
+        REQUIRE(items[1].section == "HEADER.FIELDS (From To)");
+        REQUIRE(items[2].section == "1.2");
+        REQUIRE(items[2].partial == std::make_pair(size_t{10}, size_t{200}));
+        REQUIRE(items[3].type == FetchItem::Type::BODY);
+        REQUIRE_FALSE(items[3].has_section);
+    }
 }
 
 TEST_CASE("IMAP parser - search criteria", "[imap][parser]") {
@@ -149,6 +164,24 @@ TEST_CASE("IMAP parser - search criteria", "[imap][parser]") {
         REQUIRE(criteria[0].type == SearchCriteria::Type::LARGER);
         REQUIRE(criteria[0].value == "1024");
     }
+
+    SECTION("Nested keys and quoted strings") {
+        auto criteria = IMAPParser::parse_search_criteria(
+            "CHARSET UTF-8 OR (FROM alice SUBJECT \"q3 \\\"plan\\\"\") NOT HEADER X-Spam yes 2:4");
+        REQUIRE(criteria.size() == 2);
+        REQUIRE(criteria[0].type == SearchCriteria::Type::OR);
+        const auto& group = criteria[0].sub_criteria[0];
+        REQUIRE(group.type == SearchCriteria::Type::ALL);
+        REQUIRE(group.sub_criteria.size() == 2);
+        REQUIRE(group.sub_criteria[1].value == "q3 \"plan\"");
+        const auto& negated = criteria[0].sub_criteria[1];
+        REQUIRE(negated.type == SearchCriteria::Type::NOT);
+        REQUIRE(negated.sub_criteria[0].type == SearchCriteria::Type::HEADER);
+        REQUIRE(negated.sub_criteria[0].header_name == "X-Spam");
+        REQUIRE(negated.sub_criteria[0].value == "yes");
+        REQUIRE(criteria[1].type == SearchCriteria::Type::SEQUENCE);
+        REQUIRE(criteria[1].value == "2:4");
+    }
 }
 
 TEST_CASE("IMAP parser - store action", "[imap][parser]") {
@@ -174,6 +207,81 @@ TEST_CASE("IMAP parser - store action", "[imap][parser]") {
     }
 }
 
+TEST_CASE("IMAP parser - mod-sequences", "[imap][parser]") {
+    SECTION("Fetch modifiers") {
+        std::string_view items = "(FLAGS BODY.PEEK[HEADER.FIELDS (From)]) (CHANGEDSINCE 5 VANISHED)";
+        auto modifiers = IMAPParser::split_fetch_modifiers(items);
+        REQUIRE(modifiers.has_value());
+        REQUIRE(items == "(FLAGS BODY.PEEK[HEADER.FIELDS (From)])");
+        REQUIRE(modifiers->changed_since == 5);
+        REQUIRE(modifiers->vanished);
+
+        items = "BODY[HEADER.FIELDS (To Cc)]";
+        modifiers = IMAPParser::split_fetch_modifiers(items);
+        REQUIRE(modifiers.has_value());
+        REQUIRE(items == "BODY[HEADER.FIELDS (To Cc)]");
+        REQUIRE_FALSE(modifiers->changed_since);
+
+        items = "FLAGS (CHANGEDSINCE x)";
+        REQUIRE_FALSE(IMAPParser::split_fetch_modifiers(items));
+        items = "FLAGS CHANGEDSINCE 5";
+        REQUIRE_FALSE(IMAPParser::split_fetch_modifiers(items));
+    }
+
+    SECTION("Store modifier") {
+        std::string_view rest = "(UNCHANGEDSINCE 12) +FLAGS (\\Seen)";
+        std::optional<uint64_t> modseq;
+        REQUIRE(IMAPParser::take_unchanged_since(rest, modseq));
+        REQUIRE(modseq == 12);
+        REQUIRE(IMAPParser::parse_store_action(rest).has_value());
+
+        rest = "FLAGS (\\Seen)";
+        modseq.reset();
+        REQUIRE(IMAPParser::take_unchanged_since(rest, modseq));
+        REQUIRE_FALSE(modseq);
+        rest = "(UNCHANGEDSINCE) FLAGS (\\Seen)";
+        REQUIRE_FALSE(IMAPParser::take_unchanged_since(rest, modseq));
+    }
+
+    SECTION("MODSEQ items and keys") {
+        auto items = IMAPParser::parse_fetch_items("(UID MODSEQ)");
+        REQUIRE(items.size() == 2);
+        REQUIRE(items[1].type == FetchItem::Type::MODSEQ);
+
+        auto criteria = IMAPParser::parse_search_criteria(
+            "MODSEQ \"/flags/\\\\draft\" all 620162338 UNSEEN");
+        REQUIRE(criteria.size() == 2);
+        REQUIRE(criteria[0].type == SearchCriteria::Type::MODSEQ);
+        REQUIRE(criteria[0].value == "620162338");
+        REQUIRE(criteria[1].type == SearchCriteria::Type::UNSEEN);
+    }
+
+    SECTION("Resolved sets") {
+        auto set = IMAPParser::parse_sequence_set("5:*,9:7");
+        REQUIRE(set.has_value());
+        std::pmr::string out;
+        set->resolved(12).append_to(out);
+        REQUIRE(out == "5:12,7:9");
+
+        out.clear();
+        auto normalized = IMAPParser::parse_sequence_set("9:7,1,5:*,2,14")->normalized(12);
+        normalized.append_to(out);
+        REQUIRE(out == "1:2,5:12,14");
+        REQUIRE(normalized.covers(2));
+        REQUIRE(normalized.covers(14));
+        REQUIRE_FALSE(normalized.covers(3));
+        REQUIRE_FALSE(normalized.covers(13));
+        REQUIRE_FALSE(normalized.covers(0));
+
+        SequenceSet built;
+        built.push_back(1, 3);
+        built.push_back(7);
+        out.clear();
+        built.append_to(out);
+        REQUIRE(out == "1:3,7");
+    }
+}
+
 TEST_CASE("IMAP parser - string parsing", "[imap][parser]") {
     SECTION("Quoted string") {
         size_t pos = 0;
@@ -189,6 +297,27 @@ TEST_CASE("IMAP parser - string parsing", "[imap][parser]") {
         REQUIRE(*str == "INBOX");
     }
 
+    SECTION("Literals") {
+        auto literal = IMAPParser::literal_at_end("a APPEND INBOX (\\Seen) {12}");
+        REQUIRE(literal.has_value());
+        REQUIRE(literal->size == 12);
+        REQUIRE(literal->synchronizing);
+        literal = IMAPParser::literal_at_end("a LOGIN {4+}");
+        REQUIRE(literal.has_value());
+        REQUIRE(literal->size == 4);
+        REQUIRE_FALSE(literal->synchronizing);
+        REQUIRE_FALSE(IMAPParser::literal_at_end("a LOGIN {x}"));
+        REQUIRE_FALSE(IMAPParser::literal_at_end("a SELECT INBOX"));
+
+        std::string_view command = "{4+}\r\nuser {5}\r\nx y\r\n";
+        size_t pos = 0;
+        REQUIRE(IMAPParser::parse_string(command, pos) == "user");
+        REQUIRE(IMAPParser::parse_string(command, pos) == "x y\r\n");
+        REQUIRE(pos == command.size());
+        pos = 0;
+        REQUIRE_FALSE(IMAPParser::parse_string("{9}\r\nshort", pos));
+    }
+
     SECTION("Quote string utility") {
         REQUIRE(IMAPParser::quote_string("simple") == "simple");
         REQUIRE(IMAPParser::quote_string("with space") == "\"with space\"");
@@ -222,6 +351,137 @@ TEST_CASE("IMAP parser - flag formatting", "[imap][parser]") {
         REQUIRE(flags.count("\\Answered") == 1);
         REQUIRE(flags.count("\\Flagged") == 1);
     }
+
+    SECTION("Format flag bits and keywords") {
+        std::pmr::string out;
+        IMAPParser::append_flags(out, system_flag::seen | system_flag::answered, {"$Label1"});
+        REQUIRE(out == "(\\Answered \\Seen $Label1)");
+        REQUIRE(IMAPParser::system_flag_bit("\\Recent") == system_flag::recent);
+        REQUIRE(IMAPParser::system_flag_bit("$Label1") == 0);
+    }
+}
+
+TEST_CASE("IMAP message table", "[imap][session]") {
+    MessageTable table;
+    const auto now = std::chrono::system_clock::now();
+    for (uint32_t uid : {3u, 5u, 8u, 13u}) {
+        table.push_back(uid, "id" + std::to_string(uid), uid * 100, now,
+                        uid % 2 ? system_flag::seen : 0, uid * 10);
+    }
+    table.set_keywords(2, {"$Work"});
+    const auto bytes = table.heap_bytes();
+
+    REQUIRE(table.find_uid(8) == 2);
+    REQUIRE_FALSE(table.find_uid(4));
+    REQUIRE(table.message_size(1) == 500);
+    REQUIRE(table.keywords(2).count("$Work") == 1);
+    REQUIRE(table.keywords(0).empty());
+
+    // Rows after the erased ones move up; their keywords go with the UID.
+    const size_t rows[] = {0, 1};
+    table.erase(rows);
+    REQUIRE(table.size() == 2);
+    REQUIRE(table.uid(0) == 8);
+    REQUIRE(table.unique_id(1) == "id13");
+    REQUIRE(table.flags(1) == system_flag::seen);
+    REQUIRE(table.modseq(1) == 130);
+    REQUIRE(table.keywords(0).count("$Work") == 1);
+    REQUIRE(table.find_uid(13) == 1);
+
+    table.set_keywords(0, {});
+    REQUIRE(table.keyword_map().empty());
+    REQUIRE(table.heap_bytes() < bytes);
+}
+
+TEST_CASE("IMAP parser - structure formatting", "[imap][parser]") {
+    std::pmr::string out;
+
+    SECTION("Envelope addresses and defaults") {
+        email::Envelope envelope;
+        envelope.subject = "Hi \"there\"";
+        envelope.from = "\"Smith, Jo\" <jo@example.com>";
+        envelope.to = "team: a@example.com, b@example.org;, c@example.net (Cee)";
+        IMAPParser::append_envelope(out, envelope);
+        REQUIRE(out ==
+                "(NIL \"Hi \\\"there\\\"\" "
+                "((\"Smith, Jo\" NIL \"jo\" \"example.com\")) "
+                "((\"Smith, Jo\" NIL \"jo\" \"example.com\")) "
+                "((\"Smith, Jo\" NIL \"jo\" \"example.com\")) "
+                "((NIL NIL \"team\" NIL)(NIL NIL \"a\" \"example.com\")"
+                "(NIL NIL \"b\" \"example.org\")(NIL NIL NIL NIL)"
+                "(\"Cee\" NIL \"c\" \"example.net\")) NIL NIL NIL NIL)");
+    }
+
+    SECTION("Body structure of a multipart message") {
+        auto structure = email::MessageStructure::parse(
+            "Content-Type: multipart/alternative; boundary=b\r\n\r\n"
+            "--b\r\n\r\nplain\r\n"
+            "--b\r\nContent-Type: text/html\r\n\r\n<p>html</p>\r\n--b--\r\n");
+        IMAPParser::append_body_structure(out, structure.body, false);
+        REQUIRE(out == "((\"text\" \"plain\" NIL NIL NIL \"7bit\" 5 0)"
+                       "(\"text\" \"html\" NIL NIL NIL \"7bit\" 11 0) \"alternative\")");
+
+        out.clear();
+        IMAPParser::append_body_structure(out, structure.body, true);
+        REQUIRE(out.ends_with("\"alternative\" (\"boundary\" \"b\") NIL NIL NIL)"));
+    }
+
+    SECTION("Values that cannot be quoted become literals") {
+        IMAPParser::append_nstring(out, "line\r\nbreak");
+        REQUIRE(out == "{11}\r\nline\r\nbreak");
+    }
+}
+
+TEST_CASE("IMAP parser - tokenizer", "[imap][parser]") {
+    SECTION("Tokens view the input") {
+        const std::string_view input = "INBOX \"a \\\"b\\\"\" (\\Seen {3}\r\nx y) ]";
+        Tokenizer tokens(input);
+
+        auto token = tokens.next();
+        REQUIRE(token.kind == Token::Kind::Atom);
+        REQUIRE(token.text == "INBOX");
+        REQUIRE(token.text.data() == input.data());
+
+        token = tokens.next();
+        REQUIRE(token.kind == Token::Kind::Quoted);
+        REQUIRE(token.escaped);
+        std::string value;
+        Tokenizer::append_value(token, value);
+        REQUIRE(value == "a \"b\"");
+
+        REQUIRE(tokens.next().kind == Token::Kind::ListOpen);
+        token = tokens.next();
+        REQUIRE(token.kind == Token::Kind::Atom);
+        REQUIRE(token.text == "\\Seen");
+        token = tokens.next();
+        REQUIRE(token.kind == Token::Kind::Literal);
+        REQUIRE(token.text == "x y");
+        REQUIRE(tokens.next().kind == Token::Kind::ListClose);
+        REQUIRE(tokens.next().kind == Token::Kind::Invalid);
+        REQUIRE(tokens.next().kind == Token::Kind::End);
+    }
+
+    SECTION("Owning wrappers") {
+        size_t pos = 0;
+        auto list = IMAPParser::parse_list("(\\Seen (a \"b c\") *) rest", pos);
+        REQUIRE(list.has_value());
+        REQUIRE(list->items.size() == 2);
+        REQUIRE(std::get<std::string>(list->items[0]) == "\\Seen");
+        const auto& nested = std::get<IMAPList>(list->items[1]);
+        REQUIRE(std::get<std::string>(nested.items[1]) == "b c");
+        REQUIRE(pos == 19);
+
+        pos = 0;
+        REQUIRE_FALSE(IMAPParser::parse_string("  * x", pos).has_value());
+        REQUIRE(pos == 0);
+    }
+
+    SECTION("Command names") {
+        REQUIRE(Command::string_to_type("UNSUBSCRIBE") == CommandType::UNSUBSCRIBE);
+        REQUIRE(Command::string_to_type("UID") == CommandType::UID);
+        REQUIRE(Command::string_to_type("") == CommandType::UNKNOWN);
+        REQUIRE(Command::string_to_type("FETCHX") == CommandType::UNKNOWN);
+    }
 }
 
 TEST_CASE("IMAP responses", "[imap][responses]") {
@@ -245,3 +505,99 @@ TEST_CASE("IMAP responses", "[imap][responses]") {
         REQUIRE(response::bye("Goodbye") == "* BYE Goodbye");
     }
 }
+
+TEST_CASE("IMAP arena allocation", "[imap][arena]") {
+    email::CommandArena arena;
+    std::pmr::memory_resource* mr = arena.resource();
+
+    SECTION("Command and its items come from the arena") {
+        auto cmd = Command::parse("A001 FETCH 1:* (FLAGS BODY.PEEK[HEADER])", mr);
+        REQUIRE(cmd.type == CommandType::FETCH);
+        REQUIRE(cmd.get_allocator().resource() == mr);
+
+        auto items = IMAPParser::parse_fetch_items("(FLAGS BODY.PEEK[HEADER])", cmd.get_allocator());
+        REQUIRE(items.size() == 2);
+        REQUIRE(items.get_allocator().resource() == mr);
+        REQUIRE(items[1].section == "HEADER");
+        REQUIRE(items[1].section.get_allocator().resource() == mr);
+    }
+
+    SECTION("Responses are built in the arena") {
+        auto cmd = Command::parse("A002 NOOP", mr);
+        auto responses = cmd.ok("NOOP completed");
+        REQUIRE(responses.size() == 1);
+        REQUIRE(responses[0] == "A002 OK NOOP completed");
+        REQUIRE(responses[0].get_allocator().resource() == mr);
+
+        response::untagged(responses, "{} EXISTS", 17);
+        REQUIRE(responses[1] == "* 17 EXISTS");
+        REQUIRE(responses[1].get_allocator().resource() == mr);
+    }
+
+    SECTION("Reset rewinds the arena") {
+        void* first = mr->allocate(64);
+        arena.reset();
+        REQUIRE(mr->allocate(64) == first);
+    }
+}
+
+TEST_CASE("IMAP FETCH under write backpressure", "[imap][session]") {
+    const auto root = std::filesystem::temp_directory_path() / "email_server_test" /
+                      std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
+    std::filesystem::create_directories(root);
+    email::Maildir maildir(root, "example.com", "u");
+    REQUIRE(maildir.initialize());
+    for (int i = 0; i < 20; ++i) {
+        maildir.deliver("Subject: " + std::to_string(i) + "\r\n\r\n" + std::string(2000, 'a' + i) +
+                        "\r\n");
+    }
+
+    namespace asio = email::asio;
+    using email::tcp;
+    asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+    auto session = std::make_shared<IMAPSession>(io, acceptor.accept(), nullptr, root,
+                                                 "localhost");
+    session->set_timeout(std::chrono::seconds(0));
+    session->set_write_watermarks(4096, 1024);
+    session->set_username("u");
+    session->set_domain("example.com");
+    REQUIRE(session->open_maildir());
+    session->set_state(SessionState::AUTHENTICATED);
+    session->start();
+
+    // The NOOP waits for the whole FETCH, which a message at a time has to
+    // wait for the client.
+    asio::write(client, asio::buffer(std::string("a SELECT INBOX\r\n"
+                                                 "b FETCH 1:* (BODY[TEXT]<0.1000>)\r\n"
+                                                 "c NOOP\r\n")));
+    std::string received;
+    std::array<char, 1024> buffer;
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (received.find("c OK") == std::string::npos &&
+           std::chrono::steady_clock::now() < deadline) {
+        io.poll();
+        if (client.available()) {
+            received.append(buffer.data(), client.read_some(asio::buffer(buffer)));
+        }
+    }
+
+    // Sequence numbers follow the index, not the order of delivery.
+    size_t pos = 0;
+    std::set<char> bodies;
+    for (int i = 0; i < 20; ++i) {
+        pos = received.find(std::to_string(i + 1) + " FETCH (BODY[TEXT]<0> {1000}\r\n", pos);
+        REQUIRE(pos != std::string::npos);
+        const auto body = received.substr(received.find('\n', pos) + 1, 1000);
+        REQUIRE(body == std::string(1000, body.front()));
+        bodies.insert(body.front());
+    }
+    REQUIRE(bodies.size() == 20);
+    REQUIRE(received.find("FLAGS (\\Recent \\Seen)", pos) != std::string::npos);
+    REQUIRE(received.find("b OK", pos) < received.find("c OK"));
+
+    session->stop();
+    std::filesystem::remove_all(root);
+}
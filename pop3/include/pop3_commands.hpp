@@ -1,5 +1,7 @@
 #pragma once
 
+#include "metrics.hpp"
+#include <array>
 #include <string>
 #include <vector>
 #include <functional>
@@ -52,6 +54,12 @@ public:
     // Individual command handlers
     static std::string handle_user(POP3Session& session, const Command& cmd);
     static std::string handle_pass(POP3Session& session, const Command& cmd);
+    // handle_pass() in two halves around the password check, so that the
+    // check alone can run off the session's strand: check_pass() gives the
+    // error reply, if the check is not to be made, and finish_pass() the
+    // reply to its result.
+    static std::optional<std::string> check_pass(POP3Session& session, const Command& cmd);
+    static std::string finish_pass(POP3Session& session, bool valid);
     static std::string handle_stat(POP3Session& session, const Command& cmd);
     static std::string handle_list(POP3Session& session, const Command& cmd);
     static std::string handle_retr(POP3Session& session, const Command& cmd);
@@ -68,6 +76,8 @@ public:
 private:
     CommandHandler();
     std::unordered_map<CommandType, Handler> handlers_;
+    // Time spent in execute(), by command type.
+    std::array<Histogram*, static_cast<size_t>(CommandType::UNKNOWN) + 1> latency_{};
 };
 
 // Response helpers
@@ -1,12 +1,11 @@
 #pragma once
 
-#include "net/session.hpp"
+#include "net/coro_session.hpp"
 #include "auth/authenticator.hpp"
 #include "storage/maildir.hpp"
 #include "pop3_commands.hpp"
 #include <memory>
 #include <vector>
-#include <set>
 
 namespace email::pop3 {
 
@@ -18,12 +17,12 @@ enum class SessionState {
 
 struct MessageInfo {
     size_t number;           // 1-based message number
-    std::string unique_id;   // Unique identifier
+    std::string_view unique_id;  // Into the session's listing snapshot
     size_t size;             // Size in bytes
     bool deleted;            // Marked for deletion
 };
 
-class POP3Session : public Session {
+class POP3Session : public CoroSession {
 public:
     POP3Session(asio::io_context& io_context, tcp::socket socket,
                 std::shared_ptr<Authenticator> auth,
@@ -57,7 +56,9 @@ public:
     // Message operations
     const std::vector<MessageInfo>& messages() const { return messages_; }
     std::optional<MessageInfo> get_message(size_t number) const;
-    std::optional<std::string> get_message_content(size_t number) const;
+    // Opens the message file for streaming with send_file().
+    std::optional<OutboundFile> open_message_file(size_t number) const;
+    // Headers, blank line and `lines` body lines, read no further.
     std::optional<std::string> get_message_top(size_t number, size_t lines) const;
 
     bool mark_deleted(size_t number);
@@ -81,11 +82,11 @@ public:
 
 protected:
     void on_connect() override;
-    void on_data(const std::string& data) override;
     void on_tls_handshake_complete() override;
+    asio::awaitable<void> run() override;
+    std::size_t messages_footprint() const override;
 
 private:
-    void process_command(const std::string& line);
     void load_messages();
 
     SessionState state_ = SessionState::AUTHORIZATION;
@@ -96,8 +97,15 @@ private:
     std::unique_ptr<Maildir> maildir_;
     std::string hostname_;
 
+    // The maildrop as of login; DELE only marks entries, QUIT removes them.
+    // The unique_ids are listing_'s, which is shared with other sessions.
+    std::shared_ptr<const MailboxSnapshot> listing_;
     std::vector<MessageInfo> messages_;
-    std::set<size_t> deleted_messages_;
+    size_t total_bytes_ = 0;
+    size_t deleted_count_ = 0;
+    size_t deleted_bytes_ = 0;
+    // Heap held by messages_, computed when the listing is loaded.
+    std::size_t listing_bytes_ = 0;
 
     bool starttls_available_ = true;
 
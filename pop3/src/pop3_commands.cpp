@@ -7,6 +7,51 @@
 
 namespace email::pop3 {
 
+namespace {
+
+// Byte-stuffs lines starting with '.', turns bare LF into CRLF and appends
+// the terminating ".\r\n", across arbitrary chunk boundaries.
+Session::StreamFilter make_dot_stuffer() {
+    struct State {
+        bool line_start = true;
+        char last = '\0';
+    };
+    return [state = State{}](std::string_view chunk, bool last, std::string& out) mutable {
+        out.reserve(out.size() + chunk.size() + chunk.size() / 32 + 8);
+        std::size_t pos = 0;
+        while (pos < chunk.size()) {
+            if (state.line_start && chunk[pos] == '.') {
+                out += '.';
+            }
+            state.line_start = false;
+
+            auto newline = chunk.find('\n', pos);
+            if (newline == std::string_view::npos) {
+                out.append(chunk.substr(pos));
+                break;
+            }
+            char before = newline > pos ? chunk[newline - 1] : state.last;
+            out.append(chunk.substr(pos, newline - pos));
+            out.append(before == '\r' ? "\n" : "\r\n");
+            state.line_start = true;
+            state.last = '\n';
+            pos = newline + 1;
+        }
+        if (!chunk.empty()) {
+            state.last = chunk.back();
+        }
+
+        if (last) {
+            if (!state.line_start) {
+                out.append(state.last == '\r' ? "\n" : "\r\n");
+            }
+            out.append(".\r\n");
+        }
+    };
+}
+
+}  // namespace
+
 Command Command::parse(const std::string& line) {
     Command cmd;
     cmd.type = CommandType::UNKNOWN;
@@ -101,6 +146,12 @@ CommandHandler::CommandHandler() {
     handlers_[CommandType::CAPA] = handle_capa;
     handlers_[CommandType::STLS] = handle_stls;
     handlers_[CommandType::AUTH] = handle_auth;
+
+    for (size_t i = 0; i < latency_.size(); ++i) {
+        latency_[i] = &Metrics::instance().histogram(
+            "email_command_duration_seconds", "Time spent executing client commands",
+            {{"protocol", "pop3"}, {"command", Command::type_to_string(static_cast<CommandType>(i))}});
+    }
 }
 
 void CommandHandler::register_handler(CommandType type, Handler handler) {
@@ -110,6 +161,7 @@ void CommandHandler::register_handler(CommandType type, Handler handler) {
 std::string CommandHandler::execute(POP3Session& session, const Command& cmd) {
     auto it = handlers_.find(cmd.type);
     if (it != handlers_.end()) {
+        ScopedTimer timer(*latency_[static_cast<size_t>(cmd.type)]);
         return it->second(session, cmd);
     }
     return response::err("Unknown command");
@@ -129,6 +181,15 @@ std::string CommandHandler::handle_user(POP3Session& session, const Command& cmd
 }
 
 std::string CommandHandler::handle_pass(POP3Session& session, const Command& cmd) {
+    if (auto error = check_pass(session, cmd)) {
+        return std::move(*error);
+    }
+    return finish_pass(session,
+                       session.authenticator().authenticate(session.pending_username(),
+                                                            cmd.argument));
+}
+
+std::optional<std::string> CommandHandler::check_pass(POP3Session& session, const Command& cmd) {
     if (session.state() != SessionState::AUTHORIZATION) {
         return response::err("Already authenticated");
     }
@@ -141,7 +202,11 @@ std::string CommandHandler::handle_pass(POP3Session& session, const Command& cmd
         return response::err("Password required");
     }
 
-    if (session.authenticator().authenticate(session.pending_username(), cmd.argument)) {
+    return std::nullopt;
+}
+
+std::string CommandHandler::finish_pass(POP3Session& session, bool valid) {
+    if (valid) {
         session.set_authenticated(true);
         auto [user, domain] = Authenticator::parse_email(session.pending_username());
         session.set_username(user);
@@ -214,30 +279,16 @@ std::string CommandHandler::handle_retr(POP3Session& session, const Command& cmd
         return response::err("No such message");
     }
 
-    auto content = session.get_message_content(msg_num);
-    if (!content) {
+    auto file = session.open_message_file(msg_num);
+    if (!file) {
         return response::err("Unable to retrieve message");
     }
 
-    std::ostringstream oss;
-    oss << response::ok(std::to_string(content->size()) + " octets") << "\r\n";
-
-    // Byte-stuff lines starting with .
-    std::istringstream iss(*content);
-    std::string line;
-    while (std::getline(iss, line)) {
-        if (!line.empty() && line[0] == '.') {
-            oss << ".";
-        }
-        // Remove trailing \r if present (we'll add \r\n)
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
-        }
-        oss << line << "\r\n";
-    }
-    oss << ".";
-
-    return oss.str();
+    // The message is streamed from disk after the status line; the reply
+    // is queued here, so nothing is returned.
+    session.send_line(response::ok(std::to_string(file->size()) + " octets"));
+    session.send_file(std::move(*file), 0, Session::to_end, make_dot_stuffer());
+    return {};
 }
 
 std::string CommandHandler::handle_dele(POP3Session& session, const Command& cmd) {
@@ -313,24 +364,27 @@ std::string CommandHandler::handle_top(POP3Session& session, const Command& cmd)
         return response::err("Unable to retrieve message");
     }
 
-    std::ostringstream oss;
-    oss << response::ok() << "\r\n";
+    std::string out = response::ok();
+    out.reserve(content->size() + 16);
+    out += "\r\n";
 
-    // Byte-stuff lines starting with .
-    std::istringstream iss(*content);
-    std::string line;
-    while (std::getline(iss, line)) {
-        if (!line.empty() && line[0] == '.') {
-            oss << ".";
-        }
+    // Byte-stuff lines starting with ., with every line ending a CRLF
+    std::string_view rest = *content;
+    while (!rest.empty()) {
+        auto newline = rest.find('\n');
+        std::string_view line = rest.substr(0, newline);
+        rest.remove_prefix(newline == std::string_view::npos ? rest.size() : newline + 1);
         if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+            line.remove_suffix(1);
         }
-        oss << line << "\r\n";
+        if (!line.empty() && line.front() == '.') {
+            out += '.';
+        }
+        out.append(line).append("\r\n");
     }
-    oss << ".";
+    out += ".";
 
-    return oss.str();
+    return out;
 }
 
 std::string CommandHandler::handle_uidl(POP3Session& session, const Command& cmd) {
@@ -345,7 +399,7 @@ std::string CommandHandler::handle_uidl(POP3Session& session, const Command& cmd
         if (!msg || msg->deleted) {
             return response::err("No such message");
         }
-        return response::ok(std::to_string(msg->number) + " " + msg->unique_id);
+        return response::ok(std::to_string(msg->number) + " " + std::string(msg->unique_id));
     }
 
     // Multi-line response
@@ -17,15 +17,8 @@ POP3Server::~POP3Server() {
 
 bool POP3Server::configure_tls(const TLSConfig& tls_config) {
 #ifdef ENABLE_TLS
-    ssl_context_ = SSLContext::create_server_context(
-        tls_config.certificate_file,
-        tls_config.private_key_file,
-        tls_config.ca_file,
-        tls_config.ciphers
-    );
-
+    ssl_context_ = SSLContext::create_server_context(tls_config);
     if (!ssl_context_.is_initialized()) {
-        LOG_ERROR_FMT("Failed to configure TLS: {}", ssl_context_.last_error());
         return false;
     }
 
@@ -39,6 +32,8 @@ bool POP3Server::configure_tls(const TLSConfig& tls_config) {
 }
 
 void POP3Server::start() {
+    memory_budget_->set_limit(config_.memory_budget);
+
     // Create plain server
     plain_server_ = std::make_unique<Server<POP3Session>>(
         "POP3",
@@ -63,7 +58,12 @@ void POP3Server::start() {
     );
 
     plain_server_->set_max_connections(config_.max_connections);
+    plain_server_->set_memory_budget(memory_budget_);
     plain_server_->set_connection_timeout(config_.connection_timeout);
+    plain_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                          : ExecutionMode::Shared);
+    plain_server_->set_cpu_affinity(config_.pin_threads);
+    plain_server_->set_reactor(reactor_);
 
     LOG_INFO_FMT("Starting POP3 server on {}:{}", config_.bind_address, config_.port);
     plain_server_->start();
@@ -93,7 +93,12 @@ void POP3Server::start() {
         );
 
         tls_server_->set_max_connections(config_.max_connections);
+        tls_server_->set_memory_budget(memory_budget_);
         tls_server_->set_connection_timeout(config_.connection_timeout);
+        tls_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                            : ExecutionMode::Shared);
+        tls_server_->set_cpu_affinity(config_.pin_threads);
+        tls_server_->set_reactor(reactor_);
 
         LOG_INFO_FMT("Starting POP3S server on {}:{}", config_.bind_address, config_.tls_port);
         tls_server_->start();
@@ -102,16 +107,30 @@ void POP3Server::start() {
 }
 
 void POP3Server::stop() {
+    const bool running = plain_server_ || tls_server_;
+    size_t refused = 0;
+
     if (plain_server_) {
+        refused += plain_server_->memory_refusals();
         plain_server_->stop();
         plain_server_.reset();
     }
 
     if (tls_server_) {
+        refused += tls_server_->memory_refusals();
         tls_server_->stop();
         tls_server_.reset();
     }
 
+    if (tls_configured_ && running) {
+        ssl_context_.log_stats("POP3");
+    }
+
+    if (refused > 0) {
+        LOG_WARNING_FMT("POP3 refused {} connections over the memory budget of {} bytes",
+                        refused, memory_budget_->limit());
+    }
+
     LOG_INFO("POP3 server stopped");
 }
 
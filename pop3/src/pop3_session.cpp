@@ -1,6 +1,5 @@
 #include "pop3_session.hpp"
 #include "logger.hpp"
-#include <sstream>
 
 namespace email::pop3 {
 
@@ -8,7 +7,7 @@ POP3Session::POP3Session(asio::io_context& io_context, tcp::socket socket,
                          std::shared_ptr<Authenticator> auth,
                          const std::filesystem::path& maildir_root,
                          const std::string& hostname)
-    : Session(io_context, std::move(socket))
+    : CoroSession(io_context, std::move(socket))
     , auth_(std::move(auth))
     , maildir_root_(maildir_root)
     , hostname_(hostname) {
@@ -20,7 +19,7 @@ POP3Session::POP3Session(asio::io_context& io_context, tcp::socket socket,
                          std::shared_ptr<Authenticator> auth,
                          const std::filesystem::path& maildir_root,
                          const std::string& hostname)
-    : Session(io_context, std::move(socket), ssl_ctx)
+    : CoroSession(io_context, std::move(socket), ssl_ctx)
     , auth_(std::move(auth))
     , maildir_root_(maildir_root)
     , hostname_(hostname)
@@ -31,13 +30,6 @@ POP3Session::POP3Session(asio::io_context& io_context, tcp::socket socket,
 void POP3Session::on_connect() {
     Session::on_connect();
     LOG_INFO_FMT("POP3 connection from {}:{}", remote_address(), remote_port());
-
-    // Send greeting
-    send_line(response::ok(hostname_ + " POP3 server ready"));
-}
-
-void POP3Session::on_data(const std::string& data) {
-    process_command(data);
 }
 
 void POP3Session::on_tls_handshake_complete() {
@@ -45,30 +37,45 @@ void POP3Session::on_tls_handshake_complete() {
     LOG_INFO("POP3 TLS handshake completed");
 }
 
-void POP3Session::process_command(const std::string& line) {
-    LOG_DEBUG_FMT("POP3 command: {}", line);
+asio::awaitable<void> POP3Session::run() {
+    co_await write_line(response::ok(hostname_ + " POP3 server ready"));
 
-    Command cmd = Command::parse(line);
+    while (auto line = co_await read_line()) {
+        LOG_DEBUG_FMT("POP3 command: {}", *line);
 
-    if (cmd.type == CommandType::UNKNOWN) {
-        send_line(response::err("Unknown command"));
-        return;
-    }
+        Command cmd = Command::parse(*line);
 
-    std::string response = CommandHandler::instance().execute(*this, cmd);
+        if (cmd.type == CommandType::UNKNOWN) {
+            co_await write_line(response::err("Unknown command"));
+            continue;
+        }
 
-    if (!response.empty()) {
-        // Check if it's a multi-line response
-        if (response.find("\r\n") != std::string::npos) {
-            send(response + "\r\n");
+        std::string response;
+        if (cmd.type == CommandType::PASS) {
+            // Password hashing takes milliseconds; run it off the io thread
+            // while this session waits. The rest touches session state and
+            // so stays on the strand, where the coroutine resumes.
+            if (auto error = CommandHandler::check_pass(*this, cmd)) {
+                response = std::move(*error);
+            } else {
+                const bool valid = co_await offload(blocking_pool(), [this, &cmd]() {
+                    return auth_->authenticate(pending_username(), cmd.argument);
+                });
+                response = CommandHandler::finish_pass(*this, valid);
+            }
         } else {
-            send_line(response);
+            response = CommandHandler::instance().execute(*this, cmd);
         }
-    }
 
-    // Handle QUIT
-    if (cmd.type == CommandType::QUIT) {
-        stop();
+        if (!response.empty()) {
+            // Multi-line responses already carry their inner line breaks
+            response.append("\r\n");
+            co_await write(std::move(response));
+        }
+
+        if (cmd.type == CommandType::QUIT) {
+            co_return;  // closes once the reply is written
+        }
     }
 }
 
@@ -92,82 +99,65 @@ bool POP3Session::open_maildir() {
 
 void POP3Session::load_messages() {
     messages_.clear();
-    deleted_messages_.clear();
+    listing_.reset();
+    total_bytes_ = 0;
+    deleted_count_ = 0;
+    deleted_bytes_ = 0;
 
     if (!maildir_) return;
 
-    auto msgs = maildir_->list_messages("INBOX");
-    size_t number = 1;
+    // STAT, LIST and UIDL need no more than the index holds.
+    listing_ = maildir_->snapshot("INBOX");
+    messages_.reserve(listing_->size());
 
-    for (const auto& msg : msgs) {
+    for (size_t row = 0; row < listing_->size(); ++row) {
         MessageInfo info;
-        info.number = number++;
-        info.unique_id = msg.unique_id;
-        info.size = msg.size;
+        info.number = row + 1;
+        info.unique_id = listing_->unique_ids[row];
+        info.size = listing_->sizes[row];
         info.deleted = false;
+        total_bytes_ += info.size;
         messages_.push_back(info);
     }
 
+    listing_bytes_ = messages_.capacity() * sizeof(MessageInfo);
+    update_footprint();
+
     LOG_DEBUG_FMT("Loaded {} messages for {}@{}", messages_.size(), username(), domain());
 }
 
+std::size_t POP3Session::messages_footprint() const {
+    return listing_bytes_;
+}
+
 std::optional<MessageInfo> POP3Session::get_message(size_t number) const {
     if (number < 1 || number > messages_.size()) {
         return std::nullopt;
     }
 
-    MessageInfo info = messages_[number - 1];
-    info.deleted = deleted_messages_.count(number) > 0;
-    return info;
+    return messages_[number - 1];
 }
 
-std::optional<std::string> POP3Session::get_message_content(size_t number) const {
+std::optional<OutboundFile> POP3Session::open_message_file(size_t number) const {
     auto msg = get_message(number);
     if (!msg || !maildir_) {
         return std::nullopt;
     }
 
-    return maildir_->get_message_content(msg->unique_id, "INBOX");
+    auto stored = maildir_->get_message(std::string(msg->unique_id), "INBOX");
+    if (!stored) {
+        return std::nullopt;
+    }
+    return OutboundFile::open(stored->path);
 }
 
 std::optional<std::string> POP3Session::get_message_top(size_t number, size_t lines) const {
-    auto content = get_message_content(number);
-    if (!content) {
+    auto msg = get_message(number);
+    if (!msg || !maildir_) {
         return std::nullopt;
     }
 
-    // Find end of headers
-    auto header_end = content->find("\r\n\r\n");
-    if (header_end == std::string::npos) {
-        header_end = content->find("\n\n");
-        if (header_end == std::string::npos) {
-            return content;  // No body
-        }
-    }
-
-    std::string result = content->substr(0, header_end + 2);  // Include blank line
-
-    if (lines == 0) {
-        return result;
-    }
-
-    // Add requested body lines
-    std::string body = content->substr(header_end + 4);  // Skip \r\n\r\n
-    std::istringstream iss(body);
-    std::string line;
-    size_t count = 0;
-
-    result += "\r\n";  // Blank line between headers and body
-
-    while (std::getline(iss, line) && count < lines) {
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
-        }
-        result += line + "\r\n";
-        count++;
-    }
-
-    return result;
+    return maildir_->get_message_top(std::string(msg->unique_id), lines, "INBOX");
 }
 
 bool POP3Session::mark_deleted(size_t number) {
@@ -175,47 +165,49 @@ bool POP3Session::mark_deleted(size_t number) {
         return false;
     }
 
-    deleted_messages_.insert(number);
+    auto& info = messages_[number - 1];
+    if (!info.deleted) {
+        info.deleted = true;
+        ++deleted_count_;
+        deleted_bytes_ += info.size;
+    }
     return true;
 }
 
 void POP3Session::reset_deleted() {
-    deleted_messages_.clear();
+    for (auto& info : messages_) {
+        info.deleted = false;
+    }
+    deleted_count_ = 0;
+    deleted_bytes_ = 0;
 }
 
 size_t POP3Session::expunge() {
-    if (!maildir_) return 0;
-
-    size_t count = 0;
-    for (size_t num : deleted_messages_) {
-        if (num <= messages_.size()) {
-            if (maildir_->delete_message(messages_[num - 1].unique_id, "INBOX")) {
-                count++;
-            }
+    if (!maildir_ || deleted_count_ == 0) return 0;
+
+    // One pass: the files go, then the index loses them all in one update.
+    std::vector<std::string> unique_ids;
+    unique_ids.reserve(deleted_count_);
+    for (const auto& info : messages_) {
+        if (info.deleted) {
+            unique_ids.emplace_back(info.unique_id);
         }
     }
 
+    size_t count = maildir_->delete_messages(unique_ids, "INBOX");
+    if (count > 0) {
+        maildir_->prune_caches("INBOX");
+    }
+
     return count;
 }
 
 size_t POP3Session::total_messages() const {
-    size_t count = 0;
-    for (size_t i = 0; i < messages_.size(); ++i) {
-        if (deleted_messages_.count(i + 1) == 0) {
-            count++;
-        }
-    }
-    return count;
+    return messages_.size() - deleted_count_;
 }
 
 size_t POP3Session::total_size() const {
-    size_t size = 0;
-    for (size_t i = 0; i < messages_.size(); ++i) {
-        if (deleted_messages_.count(i + 1) == 0) {
-            size += messages_[i].size;
-        }
-    }
-    return size;
+    return total_bytes_ - deleted_bytes_;
 }
 
 }  // namespace email::pop3
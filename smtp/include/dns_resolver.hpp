@@ -0,0 +1,130 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace email::smtp {
+
+namespace asio = boost::asio;
+
+struct MXRecord {
+    std::string hostname;
+    int priority;
+
+    bool operator<(const MXRecord& other) const {
+        return priority < other.priority;
+    }
+};
+
+struct DNSAnswer {
+    enum class Status {
+        Found,
+        NoRecords,  // The name exists without records of the type
+        NoDomain,   // NXDOMAIN
+        Failed      // No usable answer; worth asking again later
+    };
+
+    Status status = Status::Failed;
+    std::vector<MXRecord> exchangers;          // MX, by priority
+    std::vector<asio::ip::address> addresses;  // A and AAAA
+};
+
+// A stub resolver on an io_context, asking the nameservers of
+// /etc/resolv.conf itself instead of blocking in res_query(). Queries go
+// over UDP with EDNS0 and are repeated over TCP when the answer comes back
+// truncated.
+//
+// Answers are cached for as long as their TTLs allow, NXDOMAIN and empty
+// answers for the SOA's negative TTL, in shards so lookups from many
+// threads seldom meet on a lock. A lookup for a name already being asked
+// about waits for that query instead of sending its own. Failures are
+// not cached.
+//
+// Queries are sent from the io_context's thread; run it on exactly one.
+class DNSResolver {
+public:
+    enum class Type { MX, Address };
+
+    struct Options {
+        std::vector<asio::ip::udp::endpoint> servers;  // Empty for resolv.conf's
+        std::chrono::milliseconds timeout{2000};       // For each query
+        int attempts = 2;                              // Rounds over the servers
+        std::chrono::seconds max_ttl{86400};
+        std::chrono::seconds negative_ttl{900};        // Without an SOA, and the cap
+    };
+
+    struct Stats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t coalesced = 0;  // Misses that waited for another's query
+        uint64_t queries = 0;    // Sent, UDP or TCP
+        uint64_t truncated = 0;  // Repeated over TCP
+        uint64_t failures = 0;
+    };
+
+    DNSResolver(asio::io_context& io_context, Options options);
+    ~DNSResolver();
+
+    DNSResolver(const DNSResolver&) = delete;
+    DNSResolver& operator=(const DNSResolver&) = delete;
+
+    asio::awaitable<DNSAnswer> lookup(std::string name, Type type);
+    // lookup() for threads other than the io_context's, which must be running.
+    DNSAnswer lookup_sync(const std::string& name, Type type);
+
+    Stats stats() const;
+    size_t cached() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Pending;
+    struct Entry {
+        DNSAnswer answer;
+        Clock::time_point expires;
+    };
+    struct Shard {
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, Entry> entries;
+        std::unordered_map<std::string, std::shared_ptr<Pending>> pending;
+    };
+    // A parsed response, and how long it may be cached.
+    struct Response {
+        DNSAnswer answer;
+        std::chrono::seconds ttl{0};
+    };
+
+    Shard& shard_of(const std::string& key);
+    // Asks the servers in turn until one answers.
+    asio::awaitable<Response> resolve(const std::string& name, Type type);
+    asio::awaitable<Response> query(const std::string& name, uint16_t qtype);
+    // The raw response from `server`, over TCP if `tcp`; empty on timeout.
+    asio::awaitable<std::vector<unsigned char>> exchange(const std::vector<unsigned char>& request,
+                                                         const asio::ip::udp::endpoint& server,
+                                                         bool tcp);
+    Response parse(const std::vector<unsigned char>& response, uint16_t qtype) const;
+
+    asio::io_context& io_context_;
+    Options options_;
+    std::array<Shard, 16> shards_;
+    std::mt19937 random_;  // Query ids
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> coalesced_{0};
+    std::atomic<uint64_t> queries_{0};
+    std::atomic<uint64_t> truncated_{0};
+    std::atomic<uint64_t> failures_{0};
+};
+
+}  // namespace email::smtp
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace email::smtp {
+
+// The transparency procedure of DATA (RFC 5321, 4.5.2), applied to whole
+// buffers rather than line by line. Only two kinds of byte need attention:
+// a dot starting a line, and a LF without its CR. Both codecs find them
+// with a SIMD scan and pass everything in between on in one piece, so a
+// body of ordinary CRLF lines costs a scan and a copy. Input may be cut
+// anywhere; what the last buffer ended with is carried to the next.
+
+// Encodes a message for DATA: lines end in CRLF, leading dots are doubled,
+// and finish() adds the terminating ".\r\n".
+class DotStuffer {
+public:
+    // Appends the encoding of `input` to `out`.
+    void encode(std::string_view input, std::string& out);
+    // Ends the last line if the message did not, then adds the terminator.
+    // The stuffer is ready for the next message.
+    void finish(std::string& out);
+
+    // The whole DATA payload for `content`.
+    static std::string encode_all(std::string_view content);
+
+private:
+    char prev_ = '\n';  // Last byte encoded; a message starts on a new line
+};
+
+// Decodes a DATA body as it arrives, up to and including the line holding
+// a single dot. Leading dots are removed and bare LFs become CRLF.
+class DotUnstuffer {
+public:
+    using Sink = std::function<void(std::string_view)>;
+
+    // Passes the body in `input` to `sink`, in pieces as large as the input
+    // allows. Returns how much of `input` was taken: all of it, unless it
+    // holds the terminating line, after which done() is true and the rest
+    // is whatever the client sent next.
+    std::size_t decode(std::string_view input, const Sink& sink);
+    bool done() const { return state_ == State::Done; }
+    void reset();
+
+private:
+    enum class State {
+        Body,
+        Dot,    // Input ended on a dot starting a line
+        DotCR,  // ... followed by CR
+        Done,
+    };
+
+    State state_ = State::Body;
+    char prev_ = '\n';
+};
+
+}  // namespace email::smtp
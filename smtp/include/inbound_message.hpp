@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace email::smtp {
+
+// A message as it arrives over DATA or BDAT. Up to `threshold` bytes are
+// kept in memory; past that the message moves to an unlinked file in
+// `directory` (the system's temporary directory if empty) and the rest is
+// written there through a fixed buffer. A connection so holds about
+// max(threshold, 64 KiB) whatever the size of the message, and contents()
+// maps the file back for delivery instead of reading it in.
+class InboundMessage {
+public:
+    static constexpr std::size_t write_buffer_size = 64 * 1024;
+
+    InboundMessage() = default;
+    InboundMessage(std::filesystem::path directory, std::size_t threshold);
+    ~InboundMessage();
+
+    InboundMessage(const InboundMessage&) = delete;
+    InboundMessage& operator=(const InboundMessage&) = delete;
+
+    void set_spool(std::filesystem::path directory, std::size_t threshold);
+
+    // False once the spool file could not be written; the message is lost
+    // and further appends are ignored.
+    bool append(std::string_view data);
+    // A line of a DATA body, its CRLF put back.
+    bool append_line(std::string_view line);
+
+    // The whole message, valid until the next append() or reset(). nullopt
+    // if it failed or the spool file cannot be mapped.
+    std::optional<std::string_view> contents();
+
+    std::size_t size() const { return size_; }
+    bool spooled() const { return fd_ >= 0; }
+    bool failed() const { return failed_; }
+    // Held in memory: the message itself, or the write buffer once spooled.
+    std::size_t memory() const { return buffer_.capacity(); }
+
+    // Empties the message, closing its spool file and releasing the memory.
+    void reset();
+
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    // Moves what is in memory to a new spool file.
+    bool spill();
+    bool write(std::string_view data);
+    bool flush();
+    void fail(const std::string& error);
+    void unmap();
+
+    std::filesystem::path directory_;
+    std::size_t threshold_ = 256 * 1024;
+
+    std::string buffer_;  // The message, or once spooled what is not yet written
+    std::size_t size_ = 0;
+    int fd_ = -1;
+    bool failed_ = false;
+
+    void* map_ = nullptr;
+    std::size_t mapped_ = 0;
+
+    std::string last_error_;
+};
+
+}  // namespace email::smtp
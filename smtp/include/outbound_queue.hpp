@@ -0,0 +1,121 @@
+#pragma once
+
+#include "smtp_relay.hpp"
+#include "metrics.hpp"
+#include "storage/record_log.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace email::smtp {
+
+// Mail accepted for other hosts, kept on disk until it is delivered or
+// bounced. Each message is a file under `messages/`; what is left to do
+// for it lives in `index`, a RecordLog keyed by message id whose latest
+// record lists the recipients still pending with their attempts, so a
+// restart reads the index and never lists the directory.
+//
+// Delivery runs on a pool of worker threads, one destination (recipient
+// domain) of one message at a time, with at most `per_destination` of them
+// talking to any one domain. A destination that fails temporarily is
+// retried after retry_interval, doubling each time; after max_retries, or
+// on a permanent (5xx) reply, its recipients are bounced to the sender.
+class OutboundQueue {
+public:
+    // Delivers `content` to `recipients`, all in one domain, returning a
+    // result per recipient in the same order.
+    using Deliver = std::function<std::vector<DeliveryResult>(
+        const std::string& sender, const std::vector<std::string>& recipients,
+        const std::string& content)>;
+
+    struct Options {
+        size_t workers = 4;
+        size_t per_destination = 2;
+        std::chrono::seconds retry_interval{300};
+        int max_retries = 3;
+        std::string hostname = "localhost";  // Names the bouncing host
+    };
+
+    OutboundQueue(std::filesystem::path spool, Options options, Deliver deliver);
+    ~OutboundQueue();
+
+    OutboundQueue(const OutboundQueue&) = delete;
+    OutboundQueue& operator=(const OutboundQueue&) = delete;
+
+    // Creates the spool or recovers what its index lists.
+    bool open();
+    void start();
+    // Waits for deliveries in progress; the rest stays queued.
+    void stop();
+
+    // Stores the message and its envelope durably before returning its id,
+    // so the client can be told it was accepted.
+    std::optional<std::string> enqueue(const std::string& sender,
+                                       const std::vector<std::string>& recipients,
+                                       std::string_view content);
+    // Makes everything waiting for a retry due now.
+    void flush();
+    // Delivers what is due on the calling thread, without the workers;
+    // returns the destinations attempted.
+    size_t run_due();
+
+    // Destinations waiting or in progress.
+    size_t pending() const;
+    std::vector<QueuedMessage> snapshot() const;
+
+    const std::filesystem::path& spool() const { return spool_; }
+    const std::string& last_error() const { return last_error_; }
+
+private:
+    using Clock = std::chrono::system_clock;
+    // A destination of a message: its id and domain.
+    using Key = std::pair<std::string, std::string>;
+
+    void worker_loop();
+    // The first due destination whose domain is under its limit, taken out
+    // of waiting_ and counted as active; nullopt if none.
+    std::optional<QueuedMessage> take_due(Clock::time_point now);
+    // Attempts `job` and records the outcome.
+    void attempt(QueuedMessage job);
+
+    // Replays an index record; an empty payload means the message is done.
+    void load(std::string_view id, std::string_view payload);
+    // Queues a report of the failed recipients to the sender of `content`.
+    void bounce(const QueuedMessage& job, const std::vector<std::string>& recipients,
+                const std::vector<std::string>& errors, const std::string& content);
+    std::filesystem::path message_path(const std::string& id) const;
+    std::string next_id();
+
+    std::filesystem::path spool_;
+    Options options_;
+    Deliver deliver_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wakeup_;
+    // Every destination not yet done, by message id.
+    std::unordered_map<std::string, std::vector<QueuedMessage>> messages_;
+    std::multimap<Clock::time_point, Key> waiting_;
+    std::unordered_map<std::string, size_t> active_;  // By domain
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+
+    std::mutex journal_mutex_;
+    RecordLog index_;
+    std::unordered_set<std::string> live_;  // Ids the index still needs
+    size_t finished_ = 0;  // Messages done since the index was compacted
+    int dir_fd_ = -1;      // messages/, synced after each new file
+    std::string last_error_;  // Set under journal_mutex_ once workers run
+
+    Metrics::Probe depth_probe_;  // Reports pending(); last, so it goes first
+};
+
+}  // namespace email::smtp
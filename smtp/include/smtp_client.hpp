@@ -0,0 +1,156 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#ifdef ENABLE_TLS
+#include <boost/asio/ssl.hpp>
+#endif
+
+namespace email::smtp {
+
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+
+class DNSResolver;
+
+struct DeliveryResult {
+    bool success = false;
+    int reply_code = 0;
+    std::string reply_message;
+    std::string error;
+};
+
+// Outbound SMTP, asynchronous on one io_context. A message goes to all its
+// recipients behind one host in a single transaction, MAIL, the RCPTs and
+// DATA pipelined when the host offers PIPELINING, over TLS when it offers
+// STARTTLS. Connections stay open after a transaction, up to
+// max_idle_per_host of them for idle_ttl, and the next message to that host
+// skips the connect, greeting and EHLO. What each host advertised is
+// remembered too, so a host that only speaks HELO, or whose TLS failed, is
+// not asked again on every connection, and a message over its SIZE limit
+// fails without one.
+//
+// Connections, pool and cache belong to the io_context's thread; run it on
+// exactly one.
+class SMTPClient {
+public:
+    struct Options {
+        std::string hostname = "localhost";  // Sent in EHLO
+        size_t max_connections_per_host = 4; // Idle and busy; more wait
+        size_t max_idle_per_host = 2;
+        std::chrono::seconds idle_ttl{60};
+        std::chrono::seconds capability_ttl{3600};
+        std::chrono::seconds timeout{300};   // For each reply
+        bool starttls = true;
+        DNSResolver* resolver = nullptr;     // For host names; else getaddrinfo()
+    };
+
+    // What a host said it supports in its EHLO reply.
+    struct Capabilities {
+        bool esmtp = false;  // EHLO accepted at all
+        bool pipelining = false;
+        bool starttls = false;
+        bool tls_failed = false;  // STARTTLS offered but the handshake failed
+        size_t size_limit = 0;    // 0 if none announced
+    };
+
+    struct Stats {
+        uint64_t connections = 0;  // Opened
+        uint64_t reused = 0;       // Transactions on a pooled connection
+        uint64_t transactions = 0;
+    };
+
+    SMTPClient(asio::io_context& io_context, Options options);
+    ~SMTPClient();
+
+    SMTPClient(const SMTPClient&) = delete;
+    SMTPClient& operator=(const SMTPClient&) = delete;
+
+    // Sends `content` from `sender` to `recipients` through host:port,
+    // returning a result per recipient in the same order. Never throws;
+    // network failures come back as results without a reply code.
+    // `content` must outlive the call.
+    asio::awaitable<std::vector<DeliveryResult>> send(std::string host, uint16_t port,
+                                                      std::string sender,
+                                                      std::vector<std::string> recipients,
+                                                      std::string_view content);
+    // send() for threads other than the io_context's, which must be running.
+    std::vector<DeliveryResult> send_sync(const std::string& host, uint16_t port,
+                                          const std::string& sender,
+                                          const std::vector<std::string>& recipients,
+                                          std::string_view content);
+
+    std::optional<Capabilities> capabilities(const std::string& host, uint16_t port) const;
+    size_t idle_connections() const;
+    Stats stats() const;
+
+    // The DATA payload for `content`: lines ending in CRLF, leading dots
+    // doubled, and the terminating ".\r\n".
+    static std::string encode_data(std::string_view content);
+
+private:
+    // Of the message, encoded for DATA per write.
+    static constexpr size_t data_piece_size = 64 * 1024;
+
+    struct Connection;
+    struct Host {
+        size_t open = 0;  // Connections, idle or busy
+        std::vector<std::shared_ptr<Connection>> idle;  // Most recently used last
+        std::deque<asio::steady_timer*> waiters;        // For a free slot
+        std::optional<Capabilities> capabilities;
+        std::chrono::steady_clock::time_point learned;
+    };
+    struct Reply {
+        int code = 0;
+        std::string text;
+    };
+
+    // A connection to `key` ready for MAIL: from the pool, or opened, taken
+    // through EHLO and STARTTLS. Waits while the host is at its limit.
+    asio::awaitable<std::shared_ptr<Connection>> acquire(const std::string& host, uint16_t port,
+                                                         const std::string& key);
+    asio::awaitable<std::shared_ptr<Connection>> connect(const std::string& host, uint16_t port,
+                                                         const std::string& key);
+    asio::awaitable<Capabilities> ehlo(Connection& conn, const std::optional<Capabilities>& cached);
+    std::optional<Capabilities> known(const std::string& key) const;
+    void remember(const std::string& key, const Capabilities& capabilities);
+    // Pools `conn` if `reusable`, closes it otherwise, and wakes a waiter.
+    void release(const std::string& key, std::shared_ptr<Connection> conn, bool reusable);
+
+    asio::awaitable<void> transaction(Connection& conn, const std::string& sender,
+                                      const std::vector<std::string>& recipients,
+                                      std::string_view content,
+                                      std::vector<DeliveryResult>& results, bool& reusable);
+
+    asio::awaitable<Reply> read_reply(Connection& conn);
+    asio::awaitable<void> write(Connection& conn, const std::string& data);
+    asio::awaitable<void> quit(std::shared_ptr<Connection> conn);
+    // Closes idle connections past idle_ttl; runs while any are pooled.
+    void reap(const boost::system::error_code& ec);
+
+    asio::io_context& io_context_;
+    Options options_;
+
+    mutable std::mutex mutex_;  // For the accessors; coroutines hold it briefly
+    std::unordered_map<std::string, Host> hosts_;  // By "host:port"
+    Stats stats_;
+    asio::steady_timer reaper_;
+    bool reaping_ = false;
+
+#ifdef ENABLE_TLS
+    std::unique_ptr<asio::ssl::context> tls_context_;
+#endif
+};
+
+}  // namespace email::smtp
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "metrics.hpp"
+#include <array>
 #include <string>
 #include <vector>
 #include <functional>
@@ -16,6 +18,7 @@ enum class CommandType {
     MAIL,      // MAIL FROM:
     RCPT,      // RCPT TO:
     DATA,
+    BDAT,      // RFC 3030 CHUNKING
     RSET,
     NOOP,
     QUIT,
@@ -51,6 +54,7 @@ public:
     static std::string handle_mail(SMTPSession& session, const Command& cmd);
     static std::string handle_rcpt(SMTPSession& session, const Command& cmd);
     static std::string handle_data(SMTPSession& session, const Command& cmd);
+    static std::string handle_bdat(SMTPSession& session, const Command& cmd);
     static std::string handle_rset(SMTPSession& session, const Command& cmd);
     static std::string handle_noop(SMTPSession& session, const Command& cmd);
     static std::string handle_quit(SMTPSession& session, const Command& cmd);
@@ -62,6 +66,8 @@ public:
 private:
     CommandHandler();
     std::unordered_map<CommandType, Handler> handlers_;
+    // Time spent in execute(), by command type.
+    std::array<Histogram*, static_cast<size_t>(CommandType::UNKNOWN) + 1> latency_{};
 };
 
 // SMTP Reply codes and messages
@@ -1,90 +1,119 @@
 #pragma once
 
+#include "dns_resolver.hpp"
+#include "smtp_client.hpp"
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <chrono>
 #include <filesystem>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <boost/asio.hpp>
 
 namespace email::smtp {
 
-namespace asio = boost::asio;
-using tcp = asio::ip::tcp;
-
-struct DeliveryResult {
-    bool success = false;
-    int reply_code = 0;
-    std::string reply_message;
-    std::string error;
+// One destination of a queued message: those of its recipients in one
+// domain still to be delivered, and how attempts went so far.
+struct QueuedMessage {
+    std::string id;
+    std::string sender;
+    std::string destination;
+    std::vector<std::string> recipients;
+    std::chrono::system_clock::time_point queued_at;
+    std::chrono::system_clock::time_point next_retry;
+    int retry_count = 0;
+    std::string last_error;
 };
 
-struct MXRecord {
-    std::string hostname;
-    int priority;
-
-    bool operator<(const MXRecord& other) const {
-        return priority < other.priority;
-    }
-};
+class OutboundQueue;
 
 class SMTPRelay {
 public:
     SMTPRelay(asio::io_context& io_context);
+    ~SMTPRelay();
 
     // Local delivery to maildir
     bool deliver_local(const std::string& recipient_domain,
                        const std::string& recipient_local,
-                       const std::string& message_content,
+                       std::string_view message_content,
                        const std::filesystem::path& maildir_root);
-
-    // Remote delivery via SMTP
-    DeliveryResult deliver_remote(const std::string& recipient,
-                                  const std::string& sender,
-                                  const std::string& message_content);
-
-    // DNS MX lookup
+    // Local delivery to many: the message is stored once under the maildir
+    // root and hard-linked into each maildir (see SharedMessage), the
+    // recipients spread over blocking_pool(). One result per recipient.
+    std::vector<DeliveryResult> deliver_local(const std::vector<std::string>& recipients,
+                                              std::string_view message_content,
+                                              const std::filesystem::path& maildir_root);
+
+    // Remote delivery via SMTP: recipients whose domains share mail
+    // exchangers go in one transaction. One result per recipient.
+    std::vector<DeliveryResult> deliver_remote(const std::vector<std::string>& recipients,
+                                               const std::string& sender,
+                                               std::string_view message_content);
+
+    // DNS MX lookup, through resolver()
     std::vector<MXRecord> lookup_mx(const std::string& domain);
 
-    // Queue management
+    // Delivers locally to recipients in domains `is_local` says are ours,
+    // through deliver_remote() to the rest; one result per recipient.
+    std::vector<DeliveryResult> deliver(const std::string& sender,
+                                        const std::vector<std::string>& recipients,
+                                        const std::string& content);
+
+    // Queue management. Once start_queue() has opened the spool,
+    // queue_message() stores a message there for its delivery workers and
+    // process_queue() retries whatever waits now.
+    bool start_queue(const std::filesystem::path& spool, size_t workers,
+                     size_t per_destination);
+    void stop_queue();
+    bool queue_enabled() const { return queue_ != nullptr; }
+    OutboundQueue* queue() { return queue_.get(); }
+
     bool queue_message(const std::string& sender,
                        const std::vector<std::string>& recipients,
-                       const std::string& content);
+                       std::string_view content);
 
     void process_queue();
 
-    void set_hostname(const std::string& hostname) { hostname_ = hostname; }
+    void set_hostname(const std::string& hostname) {
+        hostname_ = hostname;
+        client_options_.hostname = hostname;
+    }
+    // Takes effect with the first remote delivery.
+    void set_client_options(const SMTPClient::Options& options) {
+        client_options_ = options;
+        client_options_.hostname = hostname_;
+    }
+    // The outbound client and its resolver, started on first use.
+    SMTPClient& client();
+    DNSResolver& resolver();
     void set_retry_interval(std::chrono::seconds interval) { retry_interval_ = interval; }
     void set_max_retries(int retries) { max_retries_ = retries; }
+    // Where deliver() puts mail for domains `is_local` accepts.
+    void set_local_delivery(std::filesystem::path maildir_root,
+                            std::function<bool(const std::string& domain)> is_local) {
+        maildir_root_ = std::move(maildir_root);
+        is_local_ = std::move(is_local);
+    }
 
 private:
-    DeliveryResult send_to_server(const std::string& server,
-                                  uint16_t port,
-                                  const std::string& sender,
-                                  const std::string& recipient,
-                                  const std::string& content);
-
-    std::string read_response(tcp::socket& socket);
-    bool send_command(tcp::socket& socket, const std::string& command);
-    bool expect_code(const std::string& response, int expected_code);
-
     asio::io_context& io_context_;
+    SMTPClient::Options client_options_;
+    std::once_flag client_started_;
+    std::unique_ptr<DNSResolver> resolver_;
+    std::unique_ptr<SMTPClient> client_;
+    // Runs io_context_ for resolver_ and client_ until destruction.
+    std::optional<asio::executor_work_guard<asio::io_context::executor_type>> client_work_;
+    std::thread client_thread_;
     std::string hostname_ = "localhost";
     std::chrono::seconds retry_interval_{300};
     int max_retries_ = 3;
-};
-
-// Message queue entry
-struct QueuedMessage {
-    std::string id;
-    std::string sender;
-    std::vector<std::string> recipients;
-    std::string content;
-    std::chrono::system_clock::time_point queued_at;
-    std::chrono::system_clock::time_point next_retry;
-    int retry_count = 0;
-    std::string last_error;
+    std::filesystem::path maildir_root_;
+    std::function<bool(const std::string& domain)> is_local_;
+    std::unique_ptr<OutboundQueue> queue_;
 };
 
 }  // namespace email::smtp
@@ -6,8 +6,12 @@
 #include "config.hpp"
 #include "smtp_session.hpp"
 #include "smtp_relay.hpp"
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <filesystem>
+#include <thread>
 
 namespace email::smtp {
 
@@ -27,21 +31,54 @@ public:
     // Configure TLS
     bool configure_tls(const TLSConfig& tls_config);
 
+    // Serve on a reactor shared with other servers (see Server::set_reactor)
+    // instead of this protocol's own threads. Must be called before start().
+    void set_reactor(std::shared_ptr<Reactor> reactor) { reactor_ = std::move(reactor); }
+
+    // How often start() has a background thread recount every user's
+    // storage and store it as their used space; zero disables it.
+    void set_usage_reconcile_interval(std::chrono::seconds interval) {
+        usage_reconcile_interval_ = interval;
+    }
+    // Messages per user that thread also compresses each pass when
+    // compression is enabled (see Maildir::recompress); zero disables it.
+    void set_recompress_batch(size_t batch) { recompress_batch_ = batch; }
+
 private:
+    void reconcile_usage_loop();
+    // One pass over all users; recounts those not reconciled for an interval.
+    void reconcile_usage();
+    // One pass over all users compressing older mail.
+    void recompress_messages();
+
     SMTPConfig config_;
     std::shared_ptr<Authenticator> auth_;
     std::filesystem::path maildir_root_;
+    // Where messages past data_spool_threshold are received; empty for the
+    // system's temporary directory.
+    std::filesystem::path incoming_directory_;
 
+    // Runs the relay's outbound client, so it must outlive relay_.
+    std::unique_ptr<asio::io_context> relay_io_context_;
     std::shared_ptr<SMTPRelay> relay_;
 
     std::unique_ptr<Server<SMTPSession>> smtp_server_;      // Port 25
     std::unique_ptr<Server<SMTPSession>> submission_server_; // Port 587
     std::unique_ptr<Server<SMTPSession>> smtps_server_;      // Port 465
 
-    std::unique_ptr<asio::io_context> relay_io_context_;
-
     SSLContext ssl_context_;
     bool tls_configured_ = false;
+
+    // Shared by all of this protocol's listeners.
+    std::shared_ptr<MemoryBudget> memory_budget_ = std::make_shared<MemoryBudget>();
+    std::shared_ptr<Reactor> reactor_;
+
+    std::chrono::seconds usage_reconcile_interval_{0};
+    size_t recompress_batch_ = 0;
+    std::thread usage_thread_;
+    std::mutex usage_mutex_;
+    std::condition_variable usage_wakeup_;
+    bool usage_stopping_ = false;
 };
 
 }  // namespace email::smtp
@@ -5,6 +5,8 @@
 #include "storage/maildir.hpp"
 #include "smtp_commands.hpp"
 #include "smtp_relay.hpp"
+#include "dot_stuffing.hpp"
+#include "inbound_message.hpp"
 #include <memory>
 #include <vector>
 #include <set>
@@ -17,6 +19,7 @@ enum class SessionState {
     MAIL,           // After MAIL FROM
     RCPT,           // After at least one RCPT TO
     DATA,           // During DATA reception
+    BDAT,           // Between BDAT chunks
     QUIT            // After QUIT
 };
 
@@ -31,12 +34,13 @@ enum class AuthState {
 struct Envelope {
     std::string mail_from;
     std::vector<std::string> rcpt_to;
-    std::string data;
+    // Quota each recipient had left when accepted; UINT64_MAX for none.
+    std::vector<uint64_t> room;
 
     void clear() {
         mail_from.clear();
         rcpt_to.clear();
-        data.clear();
+        room.clear();
     }
 };
 
@@ -88,8 +92,25 @@ public:
     // Relay
     SMTPRelay& relay() { return *relay_; }
 
-    // Message delivery
+    // Message reception. begin_message() starts the message with its
+    // Received header, for DATA or the first BDAT chunk.
+    void begin_message();
+    // Reads a DATA body up to its terminating dot, then replies, delivering
+    // the message.
+    void receive_data();
+    // Drops the message in progress, e.g. on RSET.
+    void reset_message();
+    // Reads the `size` bytes of a BDAT chunk, then replies, delivering the
+    // message after the LAST one. A chunk the client should not have sent
+    // is still read, then answered with `refusal`.
+    void receive_chunk(size_t size, bool last, std::string refusal);
+
+    // Message delivery. Runs on blocking_pool() while input is suspended,
+    // so it has the envelope and message to itself.
     bool deliver_message();
+    // What is left of the local user's quota, going by the running usage
+    // totals of their maildir; UINT64_MAX if the quota is 0, unlimited.
+    uint64_t room_left(const User& user);
 
     // Configuration
     const std::string& hostname() const { return hostname_; }
@@ -99,6 +120,11 @@ public:
     void set_max_recipients(size_t max) { max_recipients_ = max; }
     bool allow_relay() const { return allow_relay_; }
     void set_allow_relay(bool allow) { allow_relay_ = allow; }
+    // Messages over `threshold` bytes are spooled to `directory` as they
+    // arrive (see InboundMessage).
+    void set_message_spool(const std::filesystem::path& directory, size_t threshold) {
+        message_.set_spool(directory, threshold);
+    }
 
     // STARTTLS
     bool starttls_available() const { return starttls_available_ && !is_tls(); }
@@ -111,6 +137,8 @@ public:
 
     // AUTH state handling
     void set_auth_username(const std::string& username) { auth_username_ = username; }
+    // Verifies the credentials off the io thread, then replies 235 or 535.
+    void login(std::string username, std::string password);
     const std::string& auth_username() const { return auth_username_; }
 
     const std::filesystem::path& maildir_root() const { return maildir_root_; }
@@ -118,12 +146,23 @@ public:
 protected:
     void on_connect() override;
     void on_data(const std::string& data) override;
+    void on_bytes(std::string_view bytes, bool last) override;
+    std::size_t on_stream(std::string_view bytes) override;
     void on_tls_handshake_complete() override;
+    std::size_t messages_footprint() const override { return message_.memory(); }
 
 private:
     void process_command(const std::string& line);
-    void process_data_line(const std::string& line);
+    // Whether `more` bytes of body stay within max_message_size_; if not,
+    // the message is dropped and refused at its end.
+    bool body_fits(size_t more);
+    // Replies to the end of the message, delivering it if it was received
+    // whole, and ends the transaction.
+    void finish_message();
+    // Ends the transaction, dropping the message.
+    void end_message();
     void process_auth_response(const std::string& line);
+    bool recipients_have_room();
 
     SessionState state_ = SessionState::CONNECTED;
     AuthState auth_state_ = AuthState::NONE;
@@ -148,7 +187,14 @@ private:
 #endif
 
     std::string auth_username_;
-    std::string data_buffer_;
+    InboundMessage message_;
+    size_t header_size_ = 0;  // Of the Received header leading message_
+    bool data_too_large_ = false;
+    DotUnstuffer unstuffer_;  // For DATA
+    // The BDAT chunk being read.
+    size_t chunk_size_ = 0;
+    bool chunk_last_ = false;
+    std::string chunk_refusal_;
 };
 
 }  // namespace email::smtp
@@ -0,0 +1,395 @@
+#include "dns_resolver.hpp"
+#include <algorithm>
+#include <cctype>
+#include <exception>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/use_future.hpp>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <resolv.h>
+
+namespace email::smtp {
+
+using udp = asio::ip::udp;
+using tcp = asio::ip::tcp;
+
+struct DNSResolver::Pending {
+    explicit Pending(asio::io_context& io_context)
+        : done(io_context, asio::steady_timer::time_point::max()) {}
+
+    asio::steady_timer done;  // Cancelled once `answer` is set
+    DNSAnswer answer;
+};
+
+namespace {
+
+// What we can take in over UDP; RFC 9715's size, below common MTUs, so
+// large answers come by TCP rather than as fragments.
+constexpr uint16_t udp_payload = 1232;
+// Entries per shard before expired ones are swept out.
+constexpr size_t shard_capacity = 4096;
+
+// A recursive query for `name` with an EDNS0 OPT record; empty if `name`
+// cannot be encoded.
+std::vector<unsigned char> make_query(uint16_t id, const std::string& name, uint16_t qtype) {
+    std::vector<unsigned char> query = {
+        static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id),
+        0x01, 0x00,  // RD
+        0, 1,        // QDCOUNT
+        0, 0,
+        0, 0,
+        0, 1,        // ARCOUNT: the OPT record
+    };
+    if (name.empty() || name.size() > 253) {
+        return {};
+    }
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = name.find('.', start);
+        if (dot == std::string::npos) {
+            dot = name.size();
+        }
+        const size_t length = dot - start;
+        if (length == 0 || length > 63) {
+            return {};
+        }
+        query.push_back(static_cast<unsigned char>(length));
+        query.insert(query.end(), name.begin() + start, name.begin() + dot);
+        start = dot + 1;
+    }
+    query.push_back(0);
+    query.insert(query.end(), {static_cast<unsigned char>(qtype >> 8),
+                               static_cast<unsigned char>(qtype), 0, ns_c_in});
+    // OPT: root owner, type 41, our UDP payload size as its class.
+    query.insert(query.end(), {0, 0, ns_t_opt, static_cast<unsigned char>(udp_payload >> 8),
+                               static_cast<unsigned char>(udp_payload & 0xff), 0, 0, 0, 0, 0, 0});
+    return query;
+}
+
+std::vector<udp::endpoint> system_servers() {
+    std::vector<udp::endpoint> servers;
+    struct __res_state state {};
+    if (res_ninit(&state) == 0) {
+        for (int i = 0; i < state.nscount; ++i) {
+            if (state.nsaddr_list[i].sin_family == AF_INET) {
+                const auto& in = state.nsaddr_list[i];
+                servers.emplace_back(asio::ip::address_v4(ntohl(in.sin_addr.s_addr)),
+                                     ntohs(in.sin_port));
+            } else if (const auto* in6 = state._u._ext.nsaddrs[i]) {
+                asio::ip::address_v6::bytes_type bytes;
+                std::copy_n(in6->sin6_addr.s6_addr, bytes.size(), bytes.begin());
+                servers.emplace_back(asio::ip::address_v6(bytes), ntohs(in6->sin6_port));
+            }
+        }
+        res_nclose(&state);
+    }
+    if (servers.empty()) {
+        servers.emplace_back(asio::ip::address_v4::loopback(), 53);
+    }
+    return servers;
+}
+
+}  // namespace
+
+DNSResolver::DNSResolver(asio::io_context& io_context, Options options)
+    : io_context_(io_context)
+    , options_(std::move(options))
+    , random_(std::random_device{}()) {
+    if (options_.servers.empty()) {
+        options_.servers = system_servers();
+    }
+}
+
+DNSResolver::~DNSResolver() = default;
+
+DNSAnswer DNSResolver::lookup_sync(const std::string& name, Type type) {
+    return asio::co_spawn(io_context_, lookup(name, type), asio::use_future).get();
+}
+
+asio::awaitable<DNSAnswer> DNSResolver::lookup(std::string name, Type type) {
+    std::transform(name.begin(), name.end(), name.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (!name.empty() && name.back() == '.') {
+        name.pop_back();
+    }
+    const std::string key = (type == Type::MX ? "mx:" : "a:") + name;
+    Shard& shard = shard_of(key);
+
+    std::shared_ptr<Pending> pending;
+    bool asking = false;
+    {
+        std::lock_guard lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end() && Clock::now() < it->second.expires) {
+            hits_.fetch_add(1, std::memory_order_relaxed);
+            co_return it->second.answer;
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        auto in_flight = shard.pending.find(key);
+        if (in_flight != shard.pending.end()) {
+            pending = in_flight->second;
+            coalesced_.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            pending = std::make_shared<Pending>(io_context_);
+            shard.pending.emplace(key, pending);
+            asking = true;
+        }
+    }
+    if (!asking) {
+        boost::system::error_code ec;
+        co_await pending->done.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+        co_return pending->answer;
+    }
+
+    Response response;
+    try {
+        response = co_await resolve(name, type);
+    } catch (const std::exception&) {
+    }
+    if (response.answer.status == DNSAnswer::Status::Failed) {
+        failures_.fetch_add(1, std::memory_order_relaxed);
+    }
+    {
+        std::lock_guard lock(shard.mutex);
+        const auto now = Clock::now();
+        if (response.answer.status != DNSAnswer::Status::Failed && response.ttl.count() > 0) {
+            if (shard.entries.size() >= shard_capacity) {
+                std::erase_if(shard.entries,
+                              [now](const auto& entry) { return entry.second.expires <= now; });
+                if (shard.entries.size() >= shard_capacity) {
+                    shard.entries.erase(shard.entries.begin());
+                }
+            }
+            shard.entries[key] = Entry{response.answer, now + response.ttl};
+        }
+        shard.pending.erase(key);
+    }
+    pending->answer = response.answer;
+    pending->done.cancel();
+    co_return std::move(response.answer);
+}
+
+DNSResolver::Shard& DNSResolver::shard_of(const std::string& key) {
+    return shards_[std::hash<std::string>{}(key) % shards_.size()];
+}
+
+asio::awaitable<DNSResolver::Response> DNSResolver::resolve(const std::string& name, Type type) {
+    if (type == Type::MX) {
+        co_return co_await query(name, ns_t_mx);
+    }
+
+    Response v4 = co_await query(name, ns_t_a);
+    if (v4.answer.status == DNSAnswer::Status::NoDomain) {
+        co_return v4;
+    }
+    Response v6 = co_await query(name, ns_t_aaaa);
+
+    Response both;
+    both.answer.addresses = std::move(v4.answer.addresses);
+    both.answer.addresses.insert(both.answer.addresses.end(), v6.answer.addresses.begin(),
+                                 v6.answer.addresses.end());
+    if (!both.answer.addresses.empty()) {
+        both.answer.status = DNSAnswer::Status::Found;
+        both.ttl = options_.max_ttl;
+        for (const Response* part : {&v4, &v6}) {
+            if (part->answer.status == DNSAnswer::Status::Found) {
+                both.ttl = std::min(both.ttl, part->ttl);
+            }
+        }
+    } else if (v4.answer.status != DNSAnswer::Status::Failed &&
+               v6.answer.status != DNSAnswer::Status::Failed) {
+        both.answer.status = DNSAnswer::Status::NoRecords;
+        both.ttl = std::min(v4.ttl, v6.ttl);
+    }
+    co_return both;
+}
+
+asio::awaitable<DNSResolver::Response> DNSResolver::query(const std::string& name,
+                                                          uint16_t qtype) {
+    const auto request = make_query(static_cast<uint16_t>(random_()), name, qtype);
+    if (request.empty()) {
+        Response response;
+        response.answer.status = DNSAnswer::Status::NoDomain;
+        response.ttl = options_.negative_ttl;
+        co_return response;
+    }
+
+    for (int attempt = 0; attempt < options_.attempts; ++attempt) {
+        for (const auto& server : options_.servers) {
+            queries_.fetch_add(1, std::memory_order_relaxed);
+            auto reply = co_await exchange(request, server, false);
+            if (!reply.empty() && (reply[2] & 0x02)) {  // TC
+                truncated_.fetch_add(1, std::memory_order_relaxed);
+                queries_.fetch_add(1, std::memory_order_relaxed);
+                reply = co_await exchange(request, server, true);
+            }
+            if (reply.empty()) {
+                continue;
+            }
+            Response response = parse(reply, qtype);
+            if (response.answer.status != DNSAnswer::Status::Failed) {
+                co_return response;
+            }
+        }
+    }
+    co_return Response{};
+}
+
+asio::awaitable<std::vector<unsigned char>> DNSResolver::exchange(
+    const std::vector<unsigned char>& request, const udp::endpoint& server, bool tcp) {
+    std::vector<unsigned char> reply;
+    // The timer closes the socket, so both are shared with its handler.
+    asio::steady_timer timer(io_context_);
+    timer.expires_after(options_.timeout);
+
+    try {
+        if (!tcp) {
+            auto socket = std::make_shared<udp::socket>(io_context_, server.protocol());
+            timer.async_wait([socket](const boost::system::error_code& ec) {
+                if (!ec) {
+                    boost::system::error_code ignored;
+                    socket->close(ignored);
+                }
+            });
+            co_await socket->async_send_to(asio::buffer(request), server, asio::use_awaitable);
+            reply.resize(udp_payload);
+            for (;;) {
+                udp::endpoint from;
+                const size_t n = co_await socket->async_receive_from(asio::buffer(reply), from,
+                                                                     asio::use_awaitable);
+                // Anything else is stale or spoofed.
+                if (from == server && n >= 12 && reply[0] == request[0] &&
+                    reply[1] == request[1]) {
+                    reply.resize(n);
+                    break;
+                }
+            }
+        } else {
+            auto socket = std::make_shared<tcp::socket>(io_context_);
+            timer.async_wait([socket](const boost::system::error_code& ec) {
+                if (!ec) {
+                    boost::system::error_code ignored;
+                    socket->close(ignored);
+                }
+            });
+            co_await socket->async_connect(tcp::endpoint(server.address(), server.port()),
+                                           asio::use_awaitable);
+            std::vector<unsigned char> framed = {static_cast<unsigned char>(request.size() >> 8),
+                                                 static_cast<unsigned char>(request.size())};
+            framed.insert(framed.end(), request.begin(), request.end());
+            co_await asio::async_write(*socket, asio::buffer(framed), asio::use_awaitable);
+            unsigned char length[2];
+            co_await asio::async_read(*socket, asio::buffer(length), asio::use_awaitable);
+            reply.resize(length[0] << 8 | length[1]);
+            co_await asio::async_read(*socket, asio::buffer(reply), asio::use_awaitable);
+            if (reply.size() < 12 || reply[0] != request[0] || reply[1] != request[1]) {
+                reply.clear();
+            }
+        }
+    } catch (const boost::system::system_error&) {
+        reply.clear();
+    }
+    timer.cancel();
+    co_return reply;
+}
+
+DNSResolver::Response DNSResolver::parse(const std::vector<unsigned char>& reply,
+                                         uint16_t qtype) const {
+    Response response;
+    ns_msg msg;
+    if (ns_initparse(reply.data(), static_cast<int>(reply.size()), &msg) < 0) {
+        return response;
+    }
+
+    const int rcode = ns_msg_getflag(msg, ns_f_rcode);
+    if (rcode == ns_r_nxdomain) {
+        response.answer.status = DNSAnswer::Status::NoDomain;
+    } else if (rcode != ns_r_noerror) {
+        return response;
+    } else {
+        uint32_t ttl = static_cast<uint32_t>(options_.max_ttl.count());
+        const int count = ns_msg_count(msg, ns_s_an);
+        for (int i = 0; i < count; ++i) {
+            ns_rr rr;
+            if (ns_parserr(&msg, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != qtype) {
+                continue;  // CNAMEs on the way, for one
+            }
+            const unsigned char* rdata = ns_rr_rdata(rr);
+            const size_t length = ns_rr_rdlen(rr);
+            if (qtype == ns_t_mx) {
+                char exchange[NS_MAXDNAME];
+                if (length < 3 || dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 2, exchange,
+                                            sizeof(exchange)) < 0) {
+                    continue;
+                }
+                response.answer.exchangers.push_back({exchange, static_cast<int>(ns_get16(rdata))});
+            } else if (qtype == ns_t_a && length == 4) {
+                asio::ip::address_v4::bytes_type bytes;
+                std::copy_n(rdata, 4, bytes.begin());
+                response.answer.addresses.emplace_back(asio::ip::address_v4(bytes));
+            } else if (qtype == ns_t_aaaa && length == 16) {
+                asio::ip::address_v6::bytes_type bytes;
+                std::copy_n(rdata, 16, bytes.begin());
+                response.answer.addresses.emplace_back(asio::ip::address_v6(bytes));
+            } else {
+                continue;
+            }
+            ttl = std::min(ttl, ns_rr_ttl(rr));
+        }
+        if (!response.answer.exchangers.empty() || !response.answer.addresses.empty()) {
+            std::stable_sort(response.answer.exchangers.begin(), response.answer.exchangers.end());
+            response.answer.status = DNSAnswer::Status::Found;
+            response.ttl = std::chrono::seconds(ttl);
+            return response;
+        }
+        response.answer.status = DNSAnswer::Status::NoRecords;
+    }
+
+    // Negative answers last as long as the zone's SOA says (RFC 2308).
+    response.ttl = options_.negative_ttl;
+    const int authority = ns_msg_count(msg, ns_s_ns);
+    for (int i = 0; i < authority; ++i) {
+        ns_rr rr;
+        if (ns_parserr(&msg, ns_s_ns, i, &rr) < 0 || ns_rr_type(rr) != ns_t_soa) {
+            continue;
+        }
+        const unsigned char* p = ns_rr_rdata(rr);
+        const unsigned char* end = p + ns_rr_rdlen(rr);
+        for (int name = 0; name < 2 && p; ++name) {  // MNAME, RNAME
+            const int skipped = dn_skipname(p, end);
+            p = skipped < 0 ? nullptr : p + skipped;
+        }
+        if (p && end - p >= 20) {
+            const auto minimum = std::min<uint32_t>(ns_get32(p + 16), ns_rr_ttl(rr));
+            response.ttl = std::min(response.ttl, std::chrono::seconds(minimum));
+        }
+        break;
+    }
+    return response;
+}
+
+DNSResolver::Stats DNSResolver::stats() const {
+    Stats stats;
+    stats.hits = hits_.load(std::memory_order_relaxed);
+    stats.misses = misses_.load(std::memory_order_relaxed);
+    stats.coalesced = coalesced_.load(std::memory_order_relaxed);
+    stats.queries = queries_.load(std::memory_order_relaxed);
+    stats.truncated = truncated_.load(std::memory_order_relaxed);
+    stats.failures = failures_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+size_t DNSResolver::cached() const {
+    size_t entries = 0;
+    for (const auto& shard : shards_) {
+        std::lock_guard lock(shard.mutex);
+        entries += shard.entries.size();
+    }
+    return entries;
+}
+
+}  // namespace email::smtp
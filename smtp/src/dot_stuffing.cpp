@@ -0,0 +1,253 @@
+#include "dot_stuffing.hpp"
+
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define EMAIL_SCAN_SSE2 1
+#if defined(__GNUC__)
+#define EMAIL_SCAN_AVX2 1
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define EMAIL_SCAN_NEON 1
+#endif
+
+namespace email::smtp {
+
+namespace {
+
+// A byte the codecs stop at, given the one before it: a dot starting a
+// line, or a LF not preceded by CR.
+inline bool is_event(char c, char prev) {
+    return (c == '.' && prev == '\n') || (c == '\n' && prev != '\r');
+}
+
+// Each scan returns the offset of the first event in data[pos, size), or
+// size. `prev` stands for the byte before data[pos], which may lie in an
+// earlier buffer; past the first byte the vector loops compare each block
+// with itself shifted by one.
+
+std::size_t find_scalar(const char* data, std::size_t pos, std::size_t size, char prev) {
+    for (; pos < size; ++pos) {
+        if (is_event(data[pos], prev)) {
+            return pos;
+        }
+        prev = data[pos];
+    }
+    return size;
+}
+
+#ifdef EMAIL_SCAN_SSE2
+std::size_t find_sse2(const char* data, std::size_t pos, std::size_t size, char prev) {
+    if (pos >= size || is_event(data[pos], prev)) {
+        return pos;
+    }
+    ++pos;
+    const __m128i dot = _mm_set1_epi8('.');
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i cr = _mm_set1_epi8('\r');
+    for (; pos + 16 <= size; pos += 16) {
+        __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+        __m128i before = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos - 1));
+        __m128i dots = _mm_and_si128(_mm_cmpeq_epi8(cur, dot), _mm_cmpeq_epi8(before, lf));
+        __m128i bare = _mm_andnot_si128(_mm_cmpeq_epi8(before, cr), _mm_cmpeq_epi8(cur, lf));
+        auto mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_or_si128(dots, bare)));
+        if (mask) {
+            return pos + static_cast<std::size_t>(__builtin_ctz(mask));
+        }
+    }
+    return find_scalar(data, pos, size, data[pos - 1]);
+}
+#endif
+
+#ifdef EMAIL_SCAN_AVX2
+__attribute__((target("avx2")))
+std::size_t find_avx2(const char* data, std::size_t pos, std::size_t size, char prev) {
+    if (pos >= size || is_event(data[pos], prev)) {
+        return pos;
+    }
+    ++pos;
+    const __m256i dot = _mm256_set1_epi8('.');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i cr = _mm256_set1_epi8('\r');
+    for (; pos + 32 <= size; pos += 32) {
+        __m256i cur = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos));
+        __m256i before = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + pos - 1));
+        __m256i dots = _mm256_and_si256(_mm256_cmpeq_epi8(cur, dot), _mm256_cmpeq_epi8(before, lf));
+        __m256i bare = _mm256_andnot_si256(_mm256_cmpeq_epi8(before, cr),
+                                           _mm256_cmpeq_epi8(cur, lf));
+        auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_or_si256(dots, bare)));
+        if (mask) {
+            return pos + static_cast<std::size_t>(__builtin_ctz(mask));
+        }
+    }
+    return find_sse2(data, pos, size, data[pos - 1]);
+}
+
+bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2;
+}
+#endif
+
+#ifdef EMAIL_SCAN_NEON
+std::size_t find_neon(const char* data, std::size_t pos, std::size_t size, char prev) {
+    if (pos >= size || is_event(data[pos], prev)) {
+        return pos;
+    }
+    ++pos;
+    const uint8x16_t dot = vdupq_n_u8('.');
+    const uint8x16_t lf = vdupq_n_u8('\n');
+    const uint8x16_t cr = vdupq_n_u8('\r');
+    for (; pos + 16 <= size; pos += 16) {
+        uint8x16_t cur = vld1q_u8(reinterpret_cast<const uint8_t*>(data + pos));
+        uint8x16_t before = vld1q_u8(reinterpret_cast<const uint8_t*>(data + pos - 1));
+        uint8x16_t dots = vandq_u8(vceqq_u8(cur, dot), vceqq_u8(before, lf));
+        uint8x16_t bare = vbicq_u8(vceqq_u8(cur, lf), vceqq_u8(before, cr));
+        // Narrow each byte to a nibble: bit 4*i is set when byte i matched.
+        uint64_t mask = vget_lane_u64(
+            vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(vorrq_u8(dots, bare)), 4)), 0);
+        mask &= 0x1111111111111111ULL;
+        if (mask) {
+            return pos + static_cast<std::size_t>(__builtin_ctzll(mask)) / 4;
+        }
+    }
+    return find_scalar(data, pos, size, data[pos - 1]);
+}
+#endif
+
+std::size_t find_event(const char* data, std::size_t pos, std::size_t size, char prev) {
+#if defined(EMAIL_SCAN_AVX2)
+    if (cpu_has_avx2()) {
+        return find_avx2(data, pos, size, prev);
+    }
+    return find_sse2(data, pos, size, prev);
+#elif defined(EMAIL_SCAN_SSE2)
+    return find_sse2(data, pos, size, prev);
+#elif defined(EMAIL_SCAN_NEON)
+    return find_neon(data, pos, size, prev);
+#else
+    return find_scalar(data, pos, size, prev);
+#endif
+}
+
+}  // namespace
+
+void DotStuffer::encode(std::string_view input, std::string& out) {
+    const char* data = input.data();
+    const std::size_t size = input.size();
+    std::size_t span = 0;  // Start of what is yet to be copied
+    std::size_t pos = 0;
+    char prev = prev_;
+    while ((pos = find_event(data, pos, size, prev)) < size) {
+        out.append(data + span, pos - span);
+        // The byte itself goes out with the next span.
+        out += data[pos] == '.' ? '.' : '\r';
+        span = pos;
+        prev = data[pos++];
+    }
+    out.append(data + span, size - span);
+    if (size > 0) {
+        prev_ = data[size - 1];
+    }
+}
+
+void DotStuffer::finish(std::string& out) {
+    if (prev_ == '\r') {
+        out += '\n';
+    } else if (prev_ != '\n') {
+        out += "\r\n";
+    }
+    out += ".\r\n";
+    prev_ = '\n';
+}
+
+std::string DotStuffer::encode_all(std::string_view content) {
+    std::string data;
+    data.reserve(content.size() + content.size() / 32 + 8);
+    DotStuffer stuffer;
+    stuffer.encode(content, data);
+    stuffer.finish(data);
+    return data;
+}
+
+std::size_t DotUnstuffer::decode(std::string_view input, const Sink& sink) {
+    const char* data = input.data();
+    const std::size_t size = input.size();
+    std::size_t pos = 0;
+
+    // A dot the last buffer ended on: the terminator, or a stuffed dot.
+    if (state_ == State::Dot && pos < size) {
+        if (data[pos] == '\n') {
+            state_ = State::Done;
+            return pos + 1;
+        }
+        if (data[pos] == '\r') {
+            state_ = State::DotCR;
+            ++pos;
+        } else {
+            state_ = State::Body;
+            prev_ = '.';
+        }
+    }
+    if (state_ == State::DotCR && pos < size) {
+        if (data[pos] == '\n') {
+            state_ = State::Done;
+            return pos + 1;
+        }
+        sink("\r");
+        state_ = State::Body;
+        prev_ = '\r';
+    }
+    if (state_ != State::Body || pos == size) {
+        return pos;
+    }
+
+    std::size_t span = pos;
+    char prev = prev_;
+    while ((pos = find_event(data, pos, size, prev)) < size) {
+        if (pos > span) {
+            sink({data + span, pos - span});
+        }
+        if (data[pos] == '\n') {
+            sink("\r");
+            span = pos;
+            prev = data[pos++];
+            continue;
+        }
+        // A dot starting a line: dropped, unless it is the whole line.
+        span = pos + 1;
+        if (pos + 1 == size) {
+            state_ = State::Dot;
+            return size;
+        }
+        if (data[pos + 1] == '\n') {
+            state_ = State::Done;
+            return pos + 2;
+        }
+        if (data[pos + 1] == '\r') {
+            if (pos + 2 == size) {
+                state_ = State::DotCR;
+                return size;
+            }
+            if (data[pos + 2] == '\n') {
+                state_ = State::Done;
+                return pos + 3;
+            }
+        }
+        prev = data[pos++];
+    }
+    if (size > span) {
+        sink({data + span, size - span});
+    }
+    prev_ = data[size - 1];
+    return size;
+}
+
+void DotUnstuffer::reset() {
+    state_ = State::Body;
+    prev_ = '\n';
+}
+
+}  // namespace email::smtp
@@ -0,0 +1,151 @@
+#include "inbound_message.hpp"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace email::smtp {
+
+InboundMessage::InboundMessage(std::filesystem::path directory, std::size_t threshold)
+    : directory_(std::move(directory))
+    , threshold_(threshold) {
+}
+
+InboundMessage::~InboundMessage() {
+    reset();
+}
+
+void InboundMessage::set_spool(std::filesystem::path directory, std::size_t threshold) {
+    directory_ = std::move(directory);
+    threshold_ = threshold;
+}
+
+bool InboundMessage::append(std::string_view data) {
+    if (failed_) {
+        return false;
+    }
+    unmap();
+    if (!spooled() && size_ + data.size() > threshold_ && !spill()) {
+        return false;
+    }
+    size_ += data.size();
+    if (!spooled()) {
+        buffer_.append(data);
+        return true;
+    }
+    return write(data);
+}
+
+bool InboundMessage::append_line(std::string_view line) {
+    return append(line) && append("\r\n");
+}
+
+std::optional<std::string_view> InboundMessage::contents() {
+    if (failed_) {
+        return std::nullopt;
+    }
+    if (!spooled()) {
+        return std::string_view(buffer_);
+    }
+    if (!map_) {
+        if (!flush()) {
+            return std::nullopt;
+        }
+        void* map = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+        if (map == MAP_FAILED) {
+            last_error_ = std::string("Cannot map spooled message: ") + std::strerror(errno);
+            return std::nullopt;
+        }
+        map_ = map;
+        mapped_ = size_;
+    }
+    return std::string_view(static_cast<const char*>(map_), mapped_);
+}
+
+void InboundMessage::reset() {
+    unmap();
+    if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+    std::string().swap(buffer_);
+    size_ = 0;
+    failed_ = false;
+    last_error_.clear();
+}
+
+bool InboundMessage::spill() {
+    std::error_code ec;
+    auto directory = directory_.empty() ? std::filesystem::temp_directory_path(ec) : directory_;
+    std::filesystem::create_directories(directory, ec);
+    std::string path = (directory / "inbound.XXXXXX").string();
+    int fd = ::mkostemp(path.data(), O_CLOEXEC);
+    if (fd < 0) {
+        fail("Cannot create spool file in " + directory.string() + ": " + std::strerror(errno));
+        return false;
+    }
+    // Nothing else needs the name, and the file goes away with the session.
+    ::unlink(path.c_str());
+    fd_ = fd;
+
+    std::string held;
+    held.swap(buffer_);
+    buffer_.reserve(write_buffer_size);
+    return write(held);
+}
+
+bool InboundMessage::write(std::string_view data) {
+    if (buffer_.size() + data.size() <= write_buffer_size) {
+        buffer_.append(data);
+        return true;
+    }
+    if (!flush()) {
+        return false;
+    }
+    if (data.size() < write_buffer_size) {
+        buffer_.append(data);
+        return true;
+    }
+    while (!data.empty()) {
+        ssize_t n = ::write(fd_, data.data(), data.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fail(std::string("Cannot write spool file: ") + std::strerror(errno));
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(n));
+    }
+    return true;
+}
+
+bool InboundMessage::flush() {
+    std::string_view pending(buffer_);
+    while (!pending.empty()) {
+        ssize_t n = ::write(fd_, pending.data(), pending.size());
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            fail(std::string("Cannot write spool file: ") + std::strerror(errno));
+            return false;
+        }
+        pending.remove_prefix(static_cast<std::size_t>(n));
+    }
+    buffer_.clear();
+    return true;
+}
+
+void InboundMessage::fail(const std::string& error) {
+    reset();
+    failed_ = true;
+    last_error_ = error;
+}
+
+void InboundMessage::unmap() {
+    if (map_) {
+        ::munmap(map_, mapped_);
+        map_ = nullptr;
+        mapped_ = 0;
+    }
+}
+
+}  // namespace email::smtp
@@ -2,6 +2,7 @@
 #include "config.hpp"
 #include "logger.hpp"
 #include "auth/authenticator.hpp"
+#include "net/metrics_exporter.hpp"
 #include <iostream>
 #include <csignal>
 #include <atomic>
@@ -60,15 +61,21 @@ int main(int argc, char* argv[]) {
     }
 
     // Initialize authenticator
-    auto auth = std::make_shared<email::Authenticator>(config.database().path);
+    auto auth = std::make_shared<email::Authenticator>(
+        config.database().path, config.database().connection_pool_size);
     if (!auth->initialize()) {
         LOG_FATAL("Failed to initialize authenticator");
         return 1;
     }
+    auth->set_credential_cache_ttl(std::chrono::seconds(config.database().credential_cache_ttl));
 
     // Create server
     email::smtp::SMTPServer server(config.smtp(), auth, config.storage().maildir_root);
     g_server = &server;
+    server.set_usage_reconcile_interval(
+        std::chrono::seconds(config.storage().usage_reconcile_interval));
+    email::Maildir::set_compression_level(config.storage().compression_level);
+    server.set_recompress_batch(config.storage().recompress_batch);
 
     // Configure TLS if available
     if (!config.tls().certificate_file.empty() && !config.tls().private_key_file.empty()) {
@@ -77,6 +84,16 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Serve metrics if configured
+    std::unique_ptr<email::MetricsExporter> metrics;
+    if (config.smtp().metrics_port != 0) {
+        metrics = std::make_unique<email::MetricsExporter>(config.smtp().metrics_address,
+                                                           config.smtp().metrics_port);
+        if (!metrics->start()) {
+            LOG_WARNING_FMT("{}, continuing without metrics", metrics->last_error());
+        }
+    }
+
     // Set up signal handlers
     std::signal(SIGINT, signal_handler);
     std::signal(SIGTERM, signal_handler);
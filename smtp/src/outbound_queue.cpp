@@ -0,0 +1,567 @@
+#include "outbound_queue.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace email::smtp {
+
+namespace {
+
+constexpr std::string_view index_format = "email.queue 1\n";
+// Messages finished between attempts to compact the index.
+constexpr size_t compact_every = 256;
+// Retry intervals stop doubling after this many attempts.
+constexpr int max_doublings = 10;
+
+int64_t to_seconds(std::chrono::system_clock::time_point tp) {
+    return std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count();
+}
+
+std::chrono::system_clock::time_point from_seconds(int64_t seconds) {
+    return std::chrono::system_clock::time_point(std::chrono::seconds(seconds));
+}
+
+int64_t to_number(std::string_view text) {
+    int64_t value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') break;
+        value = value * 10 + (c - '0');
+    }
+    return value;
+}
+
+std::string domain_of(const std::string& address) {
+    auto at = address.rfind('@');
+    std::string domain = at == std::string::npos ? std::string() : address.substr(at + 1);
+    std::transform(domain.begin(), domain.end(), domain.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return domain;
+}
+
+// Index records are lines of tab-separated fields; errors are the only
+// free text in them.
+std::string as_field(std::string_view text) {
+    std::string field(text);
+    std::replace_if(field.begin(), field.end(),
+                    [](char c) { return c == '\t' || c == '\r' || c == '\n'; }, ' ');
+    return field;
+}
+
+std::vector<std::string_view> split(std::string_view text, char separator) {
+    std::vector<std::string_view> parts;
+    size_t start = 0;
+    for (;;) {
+        auto end = text.find(separator, start);
+        parts.push_back(text.substr(start, end - start));
+        if (end == std::string_view::npos) break;
+        start = end + 1;
+    }
+    return parts;
+}
+
+// One record: the sender and time queued, then a line per pending
+// recipient with its destination's attempts, next retry and last error.
+std::string serialize(const std::vector<QueuedMessage>& destinations) {
+    if (destinations.empty()) {
+        return {};
+    }
+    const auto& first = destinations.front();
+    std::string payload = first.sender + "\n" + std::to_string(to_seconds(first.queued_at)) + "\n";
+    for (const auto& destination : destinations) {
+        for (const auto& recipient : destination.recipients) {
+            payload += recipient;
+            payload += '\t';
+            payload += std::to_string(destination.retry_count);
+            payload += '\t';
+            payload += std::to_string(to_seconds(destination.next_retry));
+            payload += '\t';
+            payload += as_field(destination.last_error);
+            payload += '\n';
+        }
+    }
+    return payload;
+}
+
+bool write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data.remove_prefix(static_cast<std::size_t>(written));
+    }
+    return true;
+}
+
+bool read_file(const std::filesystem::path& path, std::string& out) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char buffer[65536];
+    ssize_t n;
+    while ((n = ::read(fd, buffer, sizeof(buffer))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            ::close(fd);
+            return false;
+        }
+        out.append(buffer, static_cast<std::size_t>(n));
+    }
+    ::close(fd);
+    return true;
+}
+
+std::string rfc2822_date(std::chrono::system_clock::time_point tp) {
+    const std::time_t time = std::chrono::system_clock::to_time_t(tp);
+    std::tm tm;
+    localtime_r(&time, &tm);
+    char buffer[64];
+    std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S %z", &tm);
+    return buffer;
+}
+
+}  // namespace
+
+OutboundQueue::OutboundQueue(std::filesystem::path spool, Options options, Deliver deliver)
+    : spool_(std::move(spool))
+    , options_(std::move(options))
+    , deliver_(std::move(deliver))
+    , index_(spool_ / "index", index_format, {}) {
+    depth_probe_ = Metrics::instance().probe(
+        "email_queue_destinations", "Relay destinations waiting or being delivered", {},
+        [this]() { return static_cast<double>(pending()); });
+}
+
+OutboundQueue::~OutboundQueue() {
+    stop();
+    if (dir_fd_ >= 0) {
+        ::close(dir_fd_);
+    }
+}
+
+std::filesystem::path OutboundQueue::message_path(const std::string& id) const {
+    return spool_ / "messages" / id;
+}
+
+std::string OutboundQueue::next_id() {
+    static std::atomic<uint64_t> counter{0};
+    static const std::string pid = std::to_string(::getpid());
+    const auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now().time_since_epoch()).count();
+    return std::to_string(micros) + "." + pid + "." +
+           std::to_string(counter.fetch_add(1, std::memory_order_relaxed));
+}
+
+bool OutboundQueue::open() {
+    std::error_code ec;
+    std::filesystem::create_directories(spool_ / "messages", ec);
+    if (ec) {
+        last_error_ = "create spool: " + ec.message();
+        return false;
+    }
+    dir_fd_ = ::open((spool_ / "messages").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd_ < 0) {
+        last_error_ = std::string("open spool: ") + std::strerror(errno);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> journal_lock(journal_mutex_);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!index_.read([this](std::string_view id, uint64_t, std::string_view payload) {
+            load(id, payload);
+        }) && !index_.last_error().empty()) {
+        last_error_ = index_.last_error();
+        return false;
+    }
+
+    for (auto it = messages_.begin(); it != messages_.end();) {
+        if (!std::filesystem::exists(message_path(it->first), ec)) {
+            LOG_ERROR_FMT("Queued message {} has no file; dropping it", it->first);
+            it = messages_.erase(it);
+            continue;
+        }
+        live_.insert(it->first);
+        for (const auto& destination : it->second) {
+            waiting_.emplace(destination.next_retry, Key{it->first, destination.destination});
+        }
+        ++it;
+    }
+    if (!index_.rewrite([this](std::string_view id) { return live_.count(std::string(id)) > 0; })) {
+        LOG_WARNING_FMT("Could not compact the queue index: {}", index_.last_error());
+    }
+    if (!messages_.empty()) {
+        LOG_INFO_FMT("Recovered {} queued messages ({} destinations)", messages_.size(),
+                     waiting_.size());
+    }
+    return true;
+}
+
+void OutboundQueue::load(std::string_view id, std::string_view payload) {
+    std::string key(id);
+    if (payload.empty()) {
+        messages_.erase(key);
+        return;
+    }
+
+    auto lines = split(payload, '\n');
+    if (lines.size() < 2) {
+        return;
+    }
+    std::vector<QueuedMessage> destinations;
+    for (size_t i = 2; i < lines.size(); ++i) {
+        auto fields = split(lines[i], '\t');
+        if (fields.size() < 4 || fields[0].empty()) {
+            continue;
+        }
+        std::string recipient(fields[0]);
+        std::string domain = domain_of(recipient);
+        auto it = std::find_if(destinations.begin(), destinations.end(),
+                               [&](const QueuedMessage& d) { return d.destination == domain; });
+        if (it == destinations.end()) {
+            QueuedMessage destination;
+            destination.id = key;
+            destination.sender = std::string(lines[0]);
+            destination.destination = domain;
+            destination.queued_at = from_seconds(to_number(lines[1]));
+            destination.retry_count = static_cast<int>(to_number(fields[1]));
+            destination.next_retry = from_seconds(to_number(fields[2]));
+            destination.last_error = std::string(fields[3]);
+            it = destinations.insert(destinations.end(), std::move(destination));
+        }
+        it->recipients.push_back(std::move(recipient));
+    }
+    if (destinations.empty()) {
+        messages_.erase(key);
+    } else {
+        messages_[key] = std::move(destinations);
+    }
+}
+
+void OutboundQueue::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = false;
+    for (size_t i = 0; i < std::max<size_t>(options_.workers, 1); ++i) {
+        workers_.emplace_back([this] { worker_loop(); });
+    }
+}
+
+void OutboundQueue::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeup_.notify_all();
+    for (auto& worker : workers_) {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    workers_.clear();
+}
+
+std::optional<std::string> OutboundQueue::enqueue(const std::string& sender,
+                                                  const std::vector<std::string>& recipients,
+                                                  std::string_view content) {
+    if (recipients.empty()) {
+        return std::nullopt;
+    }
+
+    const std::string id = next_id();
+    const auto path = message_path(id);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    bool written = fd >= 0 && write_all(fd, content) && ::fsync(fd) == 0;
+    int error = written ? 0 : errno;  // close() may overwrite errno
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (written && ::fsync(dir_fd_) != 0) {
+        written = false;
+        error = errno;
+    }
+    if (!written) {
+        std::lock_guard<std::mutex> journal_lock(journal_mutex_);
+        last_error_ = std::string("spool: ") + std::strerror(error);
+        ::unlink(path.c_str());
+        return std::nullopt;
+    }
+
+    const auto now = Clock::now();
+    std::vector<QueuedMessage> destinations;
+    for (const auto& recipient : recipients) {
+        std::string domain = domain_of(recipient);
+        auto it = std::find_if(destinations.begin(), destinations.end(),
+                               [&](const QueuedMessage& d) { return d.destination == domain; });
+        if (it == destinations.end()) {
+            QueuedMessage destination;
+            destination.id = id;
+            destination.sender = sender;
+            destination.destination = domain;
+            destination.queued_at = now;
+            destination.next_retry = now;
+            it = destinations.insert(destinations.end(), std::move(destination));
+        }
+        it->recipients.push_back(recipient);
+    }
+
+    {
+        std::lock_guard<std::mutex> journal_lock(journal_mutex_);
+        if (index_.append(id, serialize(destinations), {}) == 0 || !index_.sync()) {
+            last_error_ = index_.last_error();
+            ::unlink(path.c_str());
+            return std::nullopt;
+        }
+        live_.insert(id);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& destination : destinations) {
+            waiting_.emplace(now, Key{id, destination.destination});
+        }
+        messages_[id] = std::move(destinations);
+    }
+    wakeup_.notify_all();
+    return id;
+}
+
+void OutboundQueue::flush() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto now = Clock::now();
+        std::multimap<Clock::time_point, Key> due;
+        for (auto& [when, key] : waiting_) {
+            due.emplace(now, std::move(key));
+        }
+        waiting_ = std::move(due);
+    }
+    wakeup_.notify_all();
+}
+
+size_t OutboundQueue::run_due() {
+    size_t attempted = 0;
+    for (;;) {
+        std::optional<QueuedMessage> job;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            job = take_due(Clock::now());
+        }
+        if (!job) {
+            return attempted;
+        }
+        attempt(std::move(*job));
+        ++attempted;
+    }
+}
+
+size_t OutboundQueue::pending() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t count = 0;
+    for (const auto& [id, destinations] : messages_) {
+        count += destinations.size();
+    }
+    return count;
+}
+
+std::vector<QueuedMessage> OutboundQueue::snapshot() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<QueuedMessage> all;
+    for (const auto& [id, destinations] : messages_) {
+        all.insert(all.end(), destinations.begin(), destinations.end());
+    }
+    return all;
+}
+
+void OutboundQueue::worker_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        const auto now = Clock::now();
+        if (auto job = take_due(now)) {
+            lock.unlock();
+            attempt(std::move(*job));
+            lock.lock();
+            continue;
+        }
+        if (waiting_.empty() || waiting_.begin()->first <= now) {
+            // Nothing queued, or what is due waits for its domain's limit.
+            wakeup_.wait(lock);
+        } else {
+            const auto next = waiting_.begin()->first;  // The node may go while waiting
+            wakeup_.wait_until(lock, next);
+        }
+    }
+}
+
+std::optional<QueuedMessage> OutboundQueue::take_due(Clock::time_point now) {
+    const size_t limit = std::max<size_t>(options_.per_destination, 1);
+    for (auto it = waiting_.begin(); it != waiting_.end() && it->first <= now;) {
+        const auto& [id, domain] = it->second;
+        const QueuedMessage* destination = nullptr;
+        if (auto message = messages_.find(id); message != messages_.end()) {
+            for (const auto& candidate : message->second) {
+                if (candidate.destination == domain) {
+                    destination = &candidate;
+                }
+            }
+        }
+        if (!destination) {
+            it = waiting_.erase(it);
+            continue;
+        }
+        auto active = active_.find(domain);
+        if (active != active_.end() && active->second >= limit) {
+            ++it;
+            continue;
+        }
+        ++active_[domain];
+        QueuedMessage job = *destination;
+        waiting_.erase(it);
+        return job;
+    }
+    return std::nullopt;
+}
+
+void OutboundQueue::attempt(QueuedMessage job) {
+    std::string content;
+    std::vector<DeliveryResult> results;
+    if (read_file(message_path(job.id), content)) {
+        results = deliver_(job.sender, job.recipients, content);
+    } else {
+        LOG_ERROR_FMT("Queued message {} is unreadable", job.id);
+        DeliveryResult missing;
+        missing.reply_code = 550;
+        missing.error = "Queued message lost";
+        results.assign(job.recipients.size(), missing);
+    }
+    results.resize(job.recipients.size());
+
+    std::vector<std::string> remaining;
+    std::vector<std::string> bounced;
+    std::vector<std::string> errors;
+    for (size_t i = 0; i < job.recipients.size(); ++i) {
+        const auto& result = results[i];
+        if (result.success) {
+            LOG_INFO_FMT("Queued message {} delivered to {}", job.id, job.recipients[i]);
+        } else if (result.reply_code >= 500 && result.reply_code < 600) {
+            bounced.push_back(job.recipients[i]);
+            errors.push_back(result.error);
+        } else {
+            remaining.push_back(job.recipients[i]);
+            job.last_error = result.error;
+        }
+    }
+
+    if (!remaining.empty()) {
+        ++job.retry_count;
+        if (job.retry_count > options_.max_retries) {
+            for (auto& recipient : remaining) {
+                bounced.push_back(std::move(recipient));
+                errors.push_back("Gave up after " + std::to_string(job.retry_count) +
+                                 " attempts: " + job.last_error);
+            }
+            remaining.clear();
+        } else {
+            const int doublings = std::min(job.retry_count - 1, max_doublings);
+            job.next_retry = Clock::now() + options_.retry_interval * (1 << doublings);
+            LOG_INFO_FMT("Queued message {} deferred for {} until retry {}: {}", job.id,
+                         job.destination, job.retry_count, job.last_error);
+        }
+    }
+    job.recipients = std::move(remaining);
+
+    // The index record is written in the order the states change.
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto message = messages_.find(job.id);
+    bool done = false;
+    std::string payload;
+    if (message != messages_.end()) {
+        auto& destinations = message->second;
+        auto it = std::find_if(destinations.begin(), destinations.end(),
+                               [&](const QueuedMessage& d) { return d.destination == job.destination; });
+        if (it != destinations.end()) {
+            if (job.recipients.empty()) {
+                destinations.erase(it);
+            } else {
+                *it = job;
+                waiting_.emplace(job.next_retry, Key{job.id, job.destination});
+            }
+        }
+        payload = serialize(destinations);
+        if (destinations.empty()) {
+            messages_.erase(message);
+            done = true;
+        }
+    }
+    if (--active_[job.destination] == 0) {
+        active_.erase(job.destination);
+    }
+    std::unique_lock<std::mutex> journal_lock(journal_mutex_);
+    lock.unlock();
+    wakeup_.notify_all();
+
+    if (index_.append(job.id, payload, {}) == 0 || !index_.sync()) {
+        LOG_ERROR_FMT("Could not record queue state of {}: {}", job.id, index_.last_error());
+    }
+    if (done) {
+        live_.erase(job.id);
+        ::unlink(message_path(job.id).c_str());
+        if (++finished_ >= compact_every) {
+            finished_ = 0;
+            index_.rewrite([this](std::string_view id) { return live_.count(std::string(id)) > 0; });
+        }
+    }
+    journal_lock.unlock();
+
+    if (!bounced.empty()) {
+        bounce(job, bounced, errors, content);
+    }
+}
+
+void OutboundQueue::bounce(const QueuedMessage& job, const std::vector<std::string>& recipients,
+                           const std::vector<std::string>& errors, const std::string& content) {
+    static Counter& bounced = Metrics::instance().counter(
+        "email_queue_bounced_total", "Queued recipients given up on and reported to the sender");
+    bounced.add(recipients.size());
+    for (size_t i = 0; i < recipients.size(); ++i) {
+        LOG_WARNING_FMT("Queued message {} bounced for {}: {}", job.id, recipients[i], errors[i]);
+    }
+    if (job.sender.empty()) {
+        return;  // A bounce itself; nobody to tell
+    }
+
+    std::string text;
+    text += "From: Mail Delivery System <MAILER-DAEMON@" + options_.hostname + ">\r\n";
+    text += "To: <" + job.sender + ">\r\n";
+    text += "Subject: Undelivered Mail Returned to Sender\r\n";
+    text += "Date: " + rfc2822_date(Clock::now()) + "\r\n";
+    text += "Auto-Submitted: auto-replied\r\n";
+    text += "Content-Type: text/plain; charset=utf-8\r\n";
+    text += "\r\n";
+    text += "This is the mail system at " + options_.hostname + ".\r\n\r\n";
+    text += "Your message could not be delivered to the following recipients:\r\n\r\n";
+    for (size_t i = 0; i < recipients.size(); ++i) {
+        text += "<" + recipients[i] + ">: " + as_field(errors[i]) + "\r\n";
+    }
+    text += "\r\n--- Header of the original message ---\r\n\r\n";
+    auto header_end = content.find("\r\n\r\n");
+    text += content.substr(0, header_end == std::string::npos ? content.size() : header_end + 2);
+
+    if (!enqueue("", {job.sender}, text)) {
+        std::string error;
+        {
+            // Other workers set it too.
+            std::lock_guard<std::mutex> journal_lock(journal_mutex_);
+            error = last_error_;
+        }
+        LOG_ERROR_FMT("Could not queue bounce of {} to {}: {}", job.id, job.sender, error);
+    }
+}
+
+}  // namespace email::smtp
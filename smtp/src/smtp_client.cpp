@@ -0,0 +1,639 @@
+#include "smtp_client.hpp"
+#include "dns_resolver.hpp"
+#include "dot_stuffing.hpp"
+#include "logger.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <exception>
+#include <stdexcept>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <boost/asio/use_future.hpp>
+
+#include <sys/socket.h>
+
+namespace email::smtp {
+
+struct SMTPClient::Connection : std::enable_shared_from_this<Connection> {
+    explicit Connection(asio::io_context& io_context)
+        : socket(io_context), deadline(io_context) {}
+
+    tcp::socket socket;
+#ifdef ENABLE_TLS
+    std::unique_ptr<asio::ssl::stream<tcp::socket&>> tls;
+#endif
+    asio::steady_timer deadline;
+    uint64_t deadline_generation = 0;
+    std::string input;  // Read past the last reply
+    Capabilities capabilities;
+    uint64_t replies = 0;
+    uint64_t transactions = 0;
+    std::chrono::steady_clock::time_point idle_since;
+};
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// A reply that ends the attempt for every recipient, such as a 554 greeting.
+class Refusal : public std::runtime_error {
+public:
+    Refusal(int code, const std::string& what) : std::runtime_error(what), code(code) {}
+    int code;
+};
+
+// Closes the socket if the operation in scope outlives the timeout.
+template<typename Conn>
+class Deadline {
+public:
+    Deadline(Conn& conn, std::chrono::seconds timeout) : conn_(conn) {
+        const uint64_t generation = ++conn.deadline_generation;
+        conn.deadline.expires_after(timeout);
+        conn.deadline.async_wait(
+            [weak = conn.weak_from_this(), generation](const boost::system::error_code& ec) {
+                auto conn = weak.lock();
+                if (!ec && conn && conn->deadline_generation == generation) {
+                    boost::system::error_code ignored;
+                    conn->socket.close(ignored);
+                }
+            });
+    }
+    ~Deadline() {
+        ++conn_.deadline_generation;
+        conn_.deadline.cancel();
+    }
+
+    Deadline(const Deadline&) = delete;
+    Deadline& operator=(const Deadline&) = delete;
+
+private:
+    Conn& conn_;
+};
+
+// Whether a pooled connection is still usable: nothing to read, not even
+// the end of the stream, which is what a server that hung up looks like.
+bool still_open(tcp::socket& socket) {
+    if (!socket.is_open()) {
+        return false;
+    }
+    char byte;
+    const auto n = ::recv(socket.native_handle(), &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+SMTPClient::Capabilities parse_ehlo(const std::string& text) {
+    SMTPClient::Capabilities capabilities;
+    capabilities.esmtp = true;
+
+    size_t pos = text.find('\n');  // The first line greets
+    while (pos != std::string::npos) {
+        const size_t start = pos + 1;
+        pos = text.find('\n', start);
+        std::string line = text.substr(start, pos == std::string::npos ? pos : pos - start);
+        if (line.size() <= 4) {
+            continue;
+        }
+        line.erase(0, 4);
+        std::transform(line.begin(), line.end(), line.begin(),
+                       [](unsigned char c) { return std::toupper(c); });
+        if (line == "PIPELINING") {
+            capabilities.pipelining = true;
+        } else if (line == "STARTTLS") {
+            capabilities.starttls = true;
+        } else if (line.rfind("SIZE ", 0) == 0) {
+            try {
+                capabilities.size_limit = std::stoull(line.substr(5));
+            } catch (const std::exception&) {
+            }
+        }
+    }
+    return capabilities;
+}
+
+bool positive(int code) {
+    return code >= 200 && code < 300;
+}
+
+void fail(DeliveryResult& result, int code, std::string error) {
+    result.success = false;
+    result.reply_code = code;
+    result.error = std::move(error);
+}
+
+}  // namespace
+
+SMTPClient::SMTPClient(asio::io_context& io_context, Options options)
+    : io_context_(io_context)
+    , options_(std::move(options))
+    , reaper_(io_context) {
+#ifdef ENABLE_TLS
+    if (options_.starttls) {
+        // Opportunistic: MX hosts rarely have certificates for the name
+        // they are reached by, and plaintext would be the alternative.
+        tls_context_ = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_client);
+        tls_context_->set_options(asio::ssl::context::default_workarounds |
+                                  asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3);
+        tls_context_->set_verify_mode(asio::ssl::verify_none);
+    }
+#endif
+}
+
+SMTPClient::~SMTPClient() = default;
+
+std::vector<DeliveryResult> SMTPClient::send_sync(const std::string& host, uint16_t port,
+                                                  const std::string& sender,
+                                                  const std::vector<std::string>& recipients,
+                                                  std::string_view content) {
+    return asio::co_spawn(io_context_, send(host, port, sender, recipients, content),
+                          asio::use_future)
+        .get();
+}
+
+asio::awaitable<std::vector<DeliveryResult>> SMTPClient::send(std::string host, uint16_t port,
+                                                              std::string sender,
+                                                              std::vector<std::string> recipients,
+                                                              std::string_view content) {
+    std::vector<DeliveryResult> results(recipients.size());
+    if (recipients.empty()) {
+        co_return results;
+    }
+    const std::string key = host + ":" + std::to_string(port);
+
+    if (auto cached = known(key); cached && cached->size_limit && content.size() > cached->size_limit) {
+        for (auto& result : results) {
+            fail(result, 552, host + " accepts messages up to " +
+                                  std::to_string(cached->size_limit) + " bytes");
+        }
+        co_return results;
+    }
+
+    for (int attempt = 0;; ++attempt) {
+        std::shared_ptr<Connection> conn;
+        bool reused = false;
+        uint64_t replies = 0;
+        int code = 0;
+        std::string error;
+        try {
+            conn = co_await acquire(host, port, key);
+            reused = conn->transactions > 0;
+            replies = conn->replies;
+            bool reusable = false;
+            co_await transaction(*conn, sender, recipients, content, results, reusable);
+            ++conn->transactions;
+            {
+                std::lock_guard lock(mutex_);
+                ++stats_.transactions;
+                stats_.reused += reused;
+            }
+            release(key, std::move(conn), reusable);
+            co_return results;
+        } catch (const Refusal& refusal) {
+            code = refusal.code;
+            error = refusal.what();
+        } catch (const std::exception& e) {
+            error = host + ": " + e.what();
+        }
+
+        // A pooled connection the server closed in the meantime fails
+        // before any reply; that is worth one more try on a new one.
+        const bool stale = conn && reused && conn->replies == replies;
+        if (conn) {
+            release(key, std::move(conn), false);
+        }
+        if (stale && attempt == 0) {
+            continue;
+        }
+        for (auto& result : results) {
+            if (!result.success && result.reply_code == 0) {
+                fail(result, code, error);
+            }
+        }
+        co_return results;
+    }
+}
+
+asio::awaitable<std::shared_ptr<SMTPClient::Connection>> SMTPClient::acquire(
+    const std::string& host, uint16_t port, const std::string& key) {
+    for (;;) {
+        asio::steady_timer slot(io_context_, asio::steady_timer::time_point::max());
+        std::vector<std::shared_ptr<Connection>> expired;
+        {
+            std::lock_guard lock(mutex_);
+            Host& entry = hosts_[key];
+            const auto now = Clock::now();
+            while (!entry.idle.empty()) {
+                auto conn = std::move(entry.idle.back());
+                entry.idle.pop_back();
+                if (now - conn->idle_since < options_.idle_ttl && conn->input.empty() &&
+                    still_open(conn->socket)) {
+                    co_return conn;
+                }
+                --entry.open;
+                expired.push_back(std::move(conn));
+            }
+            if (entry.open < options_.max_connections_per_host) {
+                ++entry.open;
+                break;
+            }
+            entry.waiters.push_back(&slot);
+        }
+        expired.clear();
+
+        // release() cancels the timer when a connection to the host closes
+        // or returns to the pool.
+        boost::system::error_code ec;
+        co_await slot.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+
+    std::exception_ptr failure;
+    try {
+        co_return co_await connect(host, port, key);
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    release(key, nullptr, false);
+    std::rethrow_exception(failure);
+}
+
+asio::awaitable<std::shared_ptr<SMTPClient::Connection>> SMTPClient::connect(
+    const std::string& host, uint16_t port, const std::string& key) {
+    auto conn = std::make_shared<Connection>(io_context_);
+    const auto cached = known(key);
+
+    std::vector<tcp::endpoint> endpoints;
+    boost::system::error_code literal;
+    const auto address = asio::ip::make_address(host, literal);
+    if (!literal) {
+        endpoints.emplace_back(address, port);
+    } else if (options_.resolver) {
+        auto answer = co_await options_.resolver->lookup(host, DNSResolver::Type::Address);
+        for (const auto& resolved : answer.addresses) {
+            endpoints.emplace_back(resolved, port);
+        }
+        if (endpoints.empty()) {
+            throw std::runtime_error("No address for " + host);
+        }
+    } else {
+        tcp::resolver resolver(io_context_);
+        for (const auto& entry : co_await resolver.async_resolve(host, std::to_string(port),
+                                                                 asio::use_awaitable)) {
+            endpoints.push_back(entry.endpoint());
+        }
+    }
+    {
+        Deadline deadline(*conn, options_.timeout);
+        co_await asio::async_connect(conn->socket, endpoints, asio::use_awaitable);
+    }
+    {
+        std::lock_guard lock(mutex_);
+        ++stats_.connections;
+    }
+
+    Reply greeting = co_await read_reply(*conn);
+    if (greeting.code != 220) {
+        throw Refusal(greeting.code, "Server rejected connection: " + greeting.text);
+    }
+    Capabilities capabilities = co_await ehlo(*conn, cached);
+
+#ifdef ENABLE_TLS
+    if (tls_context_ && capabilities.starttls && !(cached && cached->tls_failed)) {
+        co_await write(*conn, "STARTTLS\r\n");
+        Reply reply = co_await read_reply(*conn);
+        if (reply.code == 220) {
+            conn->tls = std::make_unique<asio::ssl::stream<tcp::socket&>>(conn->socket,
+                                                                          *tls_context_);
+            ::SSL_set_tlsext_host_name(conn->tls->native_handle(), host.c_str());
+            bool handshaken = false;
+            try {
+                Deadline deadline(*conn, options_.timeout);
+                co_await conn->tls->async_handshake(asio::ssl::stream_base::client,
+                                                    asio::use_awaitable);
+                handshaken = true;
+            } catch (const std::exception& e) {
+                LOG_WARNING_FMT("TLS with {} failed, delivering in plaintext: {}", host, e.what());
+            }
+            if (!handshaken) {
+                capabilities.tls_failed = true;
+                remember(key, capabilities);
+                co_return co_await connect(host, port, key);
+            }
+            // What was offered in plaintext may change over TLS.
+            capabilities = co_await ehlo(*conn, capabilities);
+            capabilities.starttls = true;
+        }
+    }
+#endif
+
+    if (cached && cached->tls_failed) {
+        capabilities.tls_failed = true;
+    }
+    conn->capabilities = capabilities;
+    remember(key, capabilities);
+    co_return conn;
+}
+
+asio::awaitable<SMTPClient::Capabilities> SMTPClient::ehlo(
+    Connection& conn, const std::optional<Capabilities>& cached) {
+    if (!cached || cached->esmtp) {
+        co_await write(conn, "EHLO " + options_.hostname + "\r\n");
+        Reply reply = co_await read_reply(conn);
+        if (reply.code == 250) {
+            co_return parse_ehlo(reply.text);
+        }
+    }
+    co_await write(conn, "HELO " + options_.hostname + "\r\n");
+    Reply reply = co_await read_reply(conn);
+    if (reply.code != 250) {
+        throw Refusal(reply.code, "HELO rejected: " + reply.text);
+    }
+    co_return Capabilities{};
+}
+
+std::optional<SMTPClient::Capabilities> SMTPClient::known(const std::string& key) const {
+    std::lock_guard lock(mutex_);
+    auto it = hosts_.find(key);
+    if (it == hosts_.end() || !it->second.capabilities ||
+        Clock::now() - it->second.learned >= options_.capability_ttl) {
+        return std::nullopt;
+    }
+    return it->second.capabilities;
+}
+
+void SMTPClient::remember(const std::string& key, const Capabilities& capabilities) {
+    std::lock_guard lock(mutex_);
+    Host& entry = hosts_[key];
+    entry.capabilities = capabilities;
+    entry.learned = Clock::now();
+}
+
+void SMTPClient::release(const std::string& key, std::shared_ptr<Connection> conn,
+                         bool reusable) {
+    std::shared_ptr<Connection> surplus;
+    {
+        std::lock_guard lock(mutex_);
+        Host& entry = hosts_[key];
+        if (conn && reusable && entry.idle.size() < options_.max_idle_per_host) {
+            conn->idle_since = Clock::now();
+            entry.idle.push_back(std::move(conn));
+            if (!reaping_) {
+                reaping_ = true;
+                reaper_.expires_after(options_.idle_ttl);
+                reaper_.async_wait([this](const boost::system::error_code& ec) { reap(ec); });
+            }
+        } else {
+            --entry.open;
+            if (reusable) {
+                surplus = std::move(conn);
+            }
+        }
+        if (!entry.waiters.empty()) {
+            entry.waiters.front()->cancel();
+            entry.waiters.pop_front();
+        }
+    }
+    if (surplus) {
+        asio::co_spawn(io_context_, quit(std::move(surplus)), asio::detached);
+    }
+}
+
+void SMTPClient::reap(const boost::system::error_code& ec) {
+    if (ec) {
+        return;
+    }
+    std::vector<std::shared_ptr<Connection>> expired;
+    {
+        std::lock_guard lock(mutex_);
+        const auto now = Clock::now();
+        bool pooled = false;
+        for (auto& [key, entry] : hosts_) {
+            auto keep = std::partition(entry.idle.begin(), entry.idle.end(), [&](const auto& conn) {
+                return now - conn->idle_since >= options_.idle_ttl;
+            });
+            for (auto it = entry.idle.begin(); it != keep; ++it) {
+                expired.push_back(std::move(*it));
+                --entry.open;
+                if (!entry.waiters.empty()) {
+                    entry.waiters.front()->cancel();
+                    entry.waiters.pop_front();
+                }
+            }
+            entry.idle.erase(entry.idle.begin(), keep);
+            pooled |= !entry.idle.empty();
+        }
+        reaping_ = pooled;
+        if (pooled) {
+            reaper_.expires_after(options_.idle_ttl);
+            reaper_.async_wait([this](const boost::system::error_code& ec) { reap(ec); });
+        }
+    }
+    for (auto& conn : expired) {
+        asio::co_spawn(io_context_, quit(std::move(conn)), asio::detached);
+    }
+}
+
+asio::awaitable<void> SMTPClient::quit(std::shared_ptr<Connection> conn) {
+    try {
+        co_await write(*conn, "QUIT\r\n");
+        co_await read_reply(*conn);
+    } catch (const std::exception&) {
+    }
+    boost::system::error_code ignored;
+    conn->socket.close(ignored);
+}
+
+asio::awaitable<void> SMTPClient::transaction(Connection& conn, const std::string& sender,
+                                              const std::vector<std::string>& recipients,
+                                              std::string_view content,
+                                              std::vector<DeliveryResult>& results,
+                                              bool& reusable) {
+    std::string mail = "MAIL FROM:<" + sender + ">";
+    if (conn.capabilities.size_limit) {
+        mail += " SIZE=" + std::to_string(content.size());
+    }
+    mail += "\r\n";
+
+    Reply mail_reply;
+    std::vector<Reply> rcpt_replies;
+    rcpt_replies.reserve(recipients.size());
+    Reply data_reply;
+
+    if (conn.capabilities.pipelining) {
+        // One write for the envelope and DATA; the replies come back in order.
+        std::string batch = mail;
+        for (const auto& recipient : recipients) {
+            batch += "RCPT TO:<" + recipient + ">\r\n";
+        }
+        batch += "DATA\r\n";
+        co_await write(conn, batch);
+        mail_reply = co_await read_reply(conn);
+        for (size_t i = 0; i < recipients.size(); ++i) {
+            rcpt_replies.push_back(co_await read_reply(conn));
+        }
+        data_reply = co_await read_reply(conn);
+    } else {
+        co_await write(conn, mail);
+        mail_reply = co_await read_reply(conn);
+        if (positive(mail_reply.code)) {
+            bool any = false;
+            for (const auto& recipient : recipients) {
+                co_await write(conn, "RCPT TO:<" + recipient + ">\r\n");
+                rcpt_replies.push_back(co_await read_reply(conn));
+                any |= positive(rcpt_replies.back().code);
+            }
+            if (any) {
+                co_await write(conn, "DATA\r\n");
+                data_reply = co_await read_reply(conn);
+            }
+        }
+    }
+    reusable = mail_reply.code != 421 && data_reply.code != 421;
+
+    if (!positive(mail_reply.code)) {
+        for (auto& result : results) {
+            fail(result, mail_reply.code, "MAIL FROM rejected: " + mail_reply.text);
+        }
+    }
+    std::vector<size_t> accepted;
+    for (size_t i = 0; i < rcpt_replies.size(); ++i) {
+        reusable &= rcpt_replies[i].code != 421;
+        if (!positive(mail_reply.code)) {
+            continue;
+        }
+        if (positive(rcpt_replies[i].code)) {
+            accepted.push_back(i);
+        } else {
+            fail(results[i], rcpt_replies[i].code, "RCPT TO rejected: " + rcpt_replies[i].text);
+        }
+    }
+
+    if (data_reply.code != 354) {
+        for (size_t i : accepted) {
+            fail(results[i], data_reply.code, "DATA rejected: " + data_reply.text);
+        }
+        if (!accepted.empty() && reusable) {
+            // The envelope is still open on the server.
+            co_await write(conn, "RSET\r\n");
+            reusable = positive((co_await read_reply(conn)).code);
+        }
+        co_return;
+    }
+    if (accepted.empty()) {
+        // A pipelined DATA the server took without a valid recipient: end
+        // it empty, and nothing is delivered.
+        co_await write(conn, ".\r\n");
+        reusable &= (co_await read_reply(conn)).code != 421;
+        co_return;
+    }
+
+    // Encoded and written a piece at a time instead of as one copy of the
+    // whole message.
+    DotStuffer stuffer;
+    std::string piece;
+    size_t pos = 0;
+    do {
+        const std::string_view input = content.substr(pos, data_piece_size);
+        pos += input.size();
+        piece.clear();
+        stuffer.encode(input, piece);
+        if (pos == content.size()) {
+            stuffer.finish(piece);
+        }
+        co_await write(conn, piece);
+    } while (pos < content.size());
+    Reply final_reply = co_await read_reply(conn);
+    reusable &= final_reply.code != 421;
+    for (size_t i : accepted) {
+        if (final_reply.code == 250) {
+            results[i].success = true;
+            results[i].reply_code = 250;
+            results[i].reply_message = final_reply.text;
+        } else {
+            fail(results[i], final_reply.code, "Message rejected: " + final_reply.text);
+        }
+    }
+}
+
+asio::awaitable<SMTPClient::Reply> SMTPClient::read_reply(Connection& conn) {
+    Reply reply;
+    size_t scanned = 0;
+    for (;;) {
+        const size_t end = conn.input.find("\r\n", scanned);
+        if (end == std::string::npos) {
+            scanned = conn.input.empty() ? 0 : conn.input.size() - 1;
+            char buffer[4096];
+            Deadline deadline(conn, options_.timeout);
+            size_t n = 0;
+#ifdef ENABLE_TLS
+            if (conn.tls) {
+                n = co_await conn.tls->async_read_some(asio::buffer(buffer), asio::use_awaitable);
+            } else
+#endif
+            {
+                n = co_await conn.socket.async_read_some(asio::buffer(buffer),
+                                                         asio::use_awaitable);
+            }
+            conn.input.append(buffer, n);
+            continue;
+        }
+
+        const std::string_view line(conn.input.data(), end);
+        if (line.size() < 3 || !std::isdigit(static_cast<unsigned char>(line[0])) ||
+            !std::isdigit(static_cast<unsigned char>(line[1])) ||
+            !std::isdigit(static_cast<unsigned char>(line[2]))) {
+            throw std::runtime_error("Malformed reply: " + std::string(line));
+        }
+        if (!reply.text.empty()) {
+            reply.text += '\n';
+        }
+        reply.text += line;
+        const bool last = line.size() == 3 || line[3] != '-';
+        if (last) {
+            reply.code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+        }
+        conn.input.erase(0, end + 2);
+        scanned = 0;
+        if (last) {
+            ++conn.replies;
+            co_return reply;
+        }
+    }
+}
+
+asio::awaitable<void> SMTPClient::write(Connection& conn, const std::string& data) {
+    Deadline deadline(conn, options_.timeout);
+#ifdef ENABLE_TLS
+    if (conn.tls) {
+        co_await asio::async_write(*conn.tls, asio::buffer(data), asio::use_awaitable);
+        co_return;
+    }
+#endif
+    co_await asio::async_write(conn.socket, asio::buffer(data), asio::use_awaitable);
+}
+
+std::optional<SMTPClient::Capabilities> SMTPClient::capabilities(const std::string& host,
+                                                                 uint16_t port) const {
+    return known(host + ":" + std::to_string(port));
+}
+
+size_t SMTPClient::idle_connections() const {
+    std::lock_guard lock(mutex_);
+    size_t idle = 0;
+    for (const auto& [key, entry] : hosts_) {
+        idle += entry.idle.size();
+    }
+    return idle;
+}
+
+SMTPClient::Stats SMTPClient::stats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+std::string SMTPClient::encode_data(std::string_view content) {
+    return DotStuffer::encode_all(content);
+}
+
+}  // namespace email::smtp
@@ -117,6 +117,7 @@ CommandType Command::string_to_type(const std::string& name) {
         {"RCPT TO:", CommandType::RCPT},
         {"RCPT", CommandType::RCPT},
         {"DATA", CommandType::DATA},
+        {"BDAT", CommandType::BDAT},
         {"RSET", CommandType::RSET},
         {"NOOP", CommandType::NOOP},
         {"QUIT", CommandType::QUIT},
@@ -137,6 +138,7 @@ std::string Command::type_to_string(CommandType type) {
         case CommandType::MAIL: return "MAIL";
         case CommandType::RCPT: return "RCPT";
         case CommandType::DATA: return "DATA";
+        case CommandType::BDAT: return "BDAT";
         case CommandType::RSET: return "RSET";
         case CommandType::NOOP: return "NOOP";
         case CommandType::QUIT: return "QUIT";
@@ -194,6 +196,7 @@ CommandHandler::CommandHandler() {
     handlers_[CommandType::MAIL] = handle_mail;
     handlers_[CommandType::RCPT] = handle_rcpt;
     handlers_[CommandType::DATA] = handle_data;
+    handlers_[CommandType::BDAT] = handle_bdat;
     handlers_[CommandType::RSET] = handle_rset;
     handlers_[CommandType::NOOP] = handle_noop;
     handlers_[CommandType::QUIT] = handle_quit;
@@ -201,6 +204,12 @@ CommandHandler::CommandHandler() {
     handlers_[CommandType::AUTH] = handle_auth;
     handlers_[CommandType::STARTTLS] = handle_starttls;
     handlers_[CommandType::HELP] = handle_help;
+
+    for (size_t i = 0; i < latency_.size(); ++i) {
+        latency_[i] = &Metrics::instance().histogram(
+            "email_command_duration_seconds", "Time spent executing client commands",
+            {{"protocol", "smtp"}, {"command", Command::type_to_string(static_cast<CommandType>(i))}});
+    }
 }
 
 void CommandHandler::register_handler(CommandType type, Handler handler) {
@@ -210,6 +219,7 @@ void CommandHandler::register_handler(CommandType type, Handler handler) {
 std::string CommandHandler::execute(SMTPSession& session, const Command& cmd) {
     auto it = handlers_.find(cmd.type);
     if (it != handlers_.end()) {
+        ScopedTimer timer(*latency_[static_cast<size_t>(cmd.type)]);
         return it->second(session, cmd);
     }
     return reply::make(reply::COMMAND_NOT_IMPLEMENTED, "Command not implemented");
@@ -223,6 +233,7 @@ std::string CommandHandler::handle_helo(SMTPSession& session, const Command& cmd
     session.set_client_hostname(cmd.argument);
     session.set_state(SessionState::GREETED);
     session.envelope().clear();
+    session.reset_message();
 
     return reply::make(reply::OK, session.hostname() + " Hello " + cmd.argument);
 }
@@ -235,12 +246,14 @@ std::string CommandHandler::handle_ehlo(SMTPSession& session, const Command& cmd
     session.set_client_hostname(cmd.argument);
     session.set_state(SessionState::GREETED);
     session.envelope().clear();
+    session.reset_message();
 
     std::vector<std::string> capabilities;
     capabilities.push_back(session.hostname() + " Hello " + cmd.argument);
     capabilities.push_back("SIZE " + std::to_string(session.max_message_size()));
     capabilities.push_back("8BITMIME");
     capabilities.push_back("PIPELINING");
+    capabilities.push_back("CHUNKING");
 
     if (session.starttls_available()) {
         capabilities.push_back("STARTTLS");
@@ -254,6 +267,9 @@ std::string CommandHandler::handle_ehlo(SMTPSession& session, const Command& cmd
 }
 
 std::string CommandHandler::handle_mail(SMTPSession& session, const Command& cmd) {
+    if (session.state() == SessionState::BDAT) {
+        return reply::make(reply::BAD_SEQUENCE, "Message in progress; send BDAT LAST or RSET");
+    }
     if (session.state() != SessionState::GREETED &&
         session.state() != SessionState::MAIL &&
         session.state() != SessionState::RCPT) {
@@ -295,6 +311,7 @@ std::string CommandHandler::handle_rcpt(SMTPSession& session, const Command& cmd
 
     // Check if we can accept mail for this recipient
     bool is_local = session.is_local_domain(addr->domain);
+    uint64_t room = UINT64_MAX;
 
     if (!is_local && !session.allow_relay()) {
         if (!session.is_authenticated()) {
@@ -308,15 +325,26 @@ std::string CommandHandler::handle_rcpt(SMTPSession& session, const Command& cmd
         if (!user) {
             return reply::make(reply::MAILBOX_NOT_FOUND, "User not found");
         }
+        // A full mailbox is refused before the body is sent; temporarily,
+        // so the sender retries once the user has made room. What is left
+        // is kept for checking the message's size against at the end.
+        room = session.room_left(*user);
+        if (room == 0) {
+            return reply::make(reply::INSUFFICIENT_STORAGE, "Mailbox full");
+        }
     }
 
     session.envelope().rcpt_to.push_back(addr->full_address);
+    session.envelope().room.push_back(room);
     session.set_state(SessionState::RCPT);
 
     return reply::make(reply::OK, "OK");
 }
 
 std::string CommandHandler::handle_data(SMTPSession& session, const Command& /* cmd */) {
+    if (session.state() == SessionState::BDAT) {
+        return reply::make(reply::BAD_SEQUENCE, "DATA cannot follow BDAT");
+    }
     if (session.state() != SessionState::RCPT) {
         return reply::make(reply::BAD_SEQUENCE, "Send RCPT TO first");
     }
@@ -325,12 +353,39 @@ std::string CommandHandler::handle_data(SMTPSession& session, const Command& /*
         return reply::make(reply::BAD_SEQUENCE, "No recipients");
     }
 
-    session.set_state(SessionState::DATA);
+    session.receive_data();
     return reply::make(reply::START_MAIL_INPUT, "Start mail input; end with <CRLF>.<CRLF>");
 }
 
+std::string CommandHandler::handle_bdat(SMTPSession& session, const Command& cmd) {
+    // BDAT <size> [LAST]
+    std::istringstream args(cmd.argument);
+    std::string size_text, last_text, extra;
+    args >> size_text >> last_text >> extra;
+    std::transform(last_text.begin(), last_text.end(), last_text.begin(), ::toupper);
+    bool valid = !size_text.empty() && size_text.size() <= 19 &&
+                 std::all_of(size_text.begin(), size_text.end(), ::isdigit) &&
+                 (last_text.empty() || last_text == "LAST") && extra.empty();
+    if (!valid) {
+        return reply::make(reply::SYNTAX_ERROR_PARAMS, "Syntax: BDAT <size> [LAST]");
+    }
+    const size_t size = std::stoull(size_text);
+
+    // The chunk follows the command regardless, so it is read even when
+    // refused; otherwise it would be taken for commands.
+    std::string refusal;
+    if (session.state() != SessionState::RCPT && session.state() != SessionState::BDAT) {
+        refusal = reply::make(reply::BAD_SEQUENCE, session.state() == SessionState::MAIL
+                                                       ? "Send RCPT TO first"
+                                                       : "Send MAIL FROM first");
+    }
+    session.receive_chunk(size, last_text == "LAST", std::move(refusal));
+    return "";
+}
+
 std::string CommandHandler::handle_rset(SMTPSession& session, const Command& /* cmd */) {
     session.envelope().clear();
+    session.reset_message();
     if (session.state() != SessionState::CONNECTED) {
         session.set_state(SessionState::GREETED);
     }
@@ -402,19 +457,9 @@ std::string CommandHandler::handle_auth(SMTPSession& session, const Command& cmd
             return reply::make(reply::AUTH_INVALID, "Invalid credentials");
         }
 
-        std::string username = decoded.substr(first_null + 1, second_null - first_null - 1);
-        std::string password = decoded.substr(second_null + 1);
-
-        if (session.authenticator().authenticate(username, password)) {
-            session.set_authenticated(true);
-            auto [user, domain] = Authenticator::parse_email(username);
-            session.set_username(user);
-            session.set_domain(domain);
-            session.set_auth_state(AuthState::AUTHENTICATED);
-            return reply::make(reply::AUTH_SUCCESS, "Authentication successful");
-        }
-
-        return reply::make(reply::AUTH_INVALID, "Authentication failed");
+        session.login(decoded.substr(first_null + 1, second_null - first_null - 1),
+                      decoded.substr(second_null + 1));
+        return "";  // Replied once verified
     } else if (mechanism == "LOGIN") {
         session.set_auth_state(AuthState::LOGIN_WAITING_USERNAME);
         return reply::make(reply::AUTH_CONTINUE, base64_encode("Username:"));
@@ -456,7 +501,7 @@ std::string CommandHandler::handle_starttls(SMTPSession& session, const Command&
 std::string CommandHandler::handle_help(SMTPSession& session, const Command& /* cmd */) {
     std::vector<std::string> help;
     help.push_back(session.hostname() + " supports:");
-    help.push_back("HELO EHLO MAIL RCPT DATA RSET NOOP QUIT VRFY AUTH STARTTLS HELP");
+    help.push_back("HELO EHLO MAIL RCPT DATA BDAT RSET NOOP QUIT VRFY AUTH STARTTLS HELP");
 
     return reply::make_multi(reply::HELP, help);
 }
@@ -1,276 +1,343 @@
 #include "smtp_relay.hpp"
+#include "outbound_queue.hpp"
 #include "storage/maildir.hpp"
 #include "logger.hpp"
-#include <sstream>
-#include <random>
-#include <chrono>
-#include <fstream>
-
-// For DNS resolution (simplified - in production use a proper DNS library)
-#include <netdb.h>
-#include <arpa/inet.h>
-#include <resolv.h>
-#include <arpa/nameser.h>
+#include "metrics.hpp"
+#include "net/coro_session.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <unordered_map>
 
 namespace email::smtp {
 
-SMTPRelay::SMTPRelay(asio::io_context& io_context)
-    : io_context_(io_context) {
-}
+namespace {
 
-bool SMTPRelay::deliver_local(const std::string& recipient_domain,
-                              const std::string& recipient_local,
-                              const std::string& message_content,
-                              const std::filesystem::path& maildir_root) {
-    Maildir maildir(maildir_root, recipient_domain, recipient_local);
+// Under the maildir root, so deliveries can hard-link what is stored there.
+constexpr const char* shared_directory = ".shared";
 
-    if (!maildir.exists()) {
-        if (!maildir.initialize()) {
-            LOG_ERROR_FMT("Failed to initialize maildir for {}@{}", recipient_local, recipient_domain);
-            return false;
-        }
+// Calls fn(i) for each i below `count`, spread over blocking_pool() with
+// the calling thread taking part, and returns when all calls have. The
+// caller's share means it never waits on a pool that is busy elsewhere.
+template <typename Fn>
+void parallel_for(size_t count, Fn&& fn) {
+    if (count <= 1) {
+        if (count == 1) fn(0);
+        return;
     }
-
-    std::string unique_id = maildir.deliver(message_content, "INBOX");
-    if (unique_id.empty()) {
-        LOG_ERROR_FMT("Failed to deliver message to {}@{}", recipient_local, recipient_domain);
-        return false;
+    struct Shared {
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto state = std::make_shared<Shared>();
+    auto work = [state, count, &fn] {
+        for (;;) {
+            const size_t i = state->next.fetch_add(1);
+            if (i >= count) {
+                return;  // Late helpers find nothing left and never touch fn
+            }
+            fn(i);
+            if (state->done.fetch_add(1) + 1 == count) {
+                std::lock_guard lock(state->mutex);
+                state->finished.notify_all();
+            }
+        }
+    };
+    const size_t helpers = std::min<size_t>(count - 1, std::thread::hardware_concurrency());
+    for (size_t h = 0; h < helpers; ++h) {
+        asio::post(blocking_pool(), work);
     }
-
-    LOG_INFO_FMT("Delivered message to {}@{}", recipient_local, recipient_domain);
-    return true;
+    work();
+    std::unique_lock lock(state->mutex);
+    state->finished.wait(lock, [&] { return state->done.load() == count; });
 }
 
-DeliveryResult SMTPRelay::deliver_remote(const std::string& recipient,
-                                         const std::string& sender,
-                                         const std::string& message_content) {
-    DeliveryResult result;
+Counter& local_deliveries(bool ok) {
+    static Counter& delivered = Metrics::instance().counter(
+        "email_local_deliveries_total", "Messages stored in local mailboxes, per recipient",
+        {{"result", "delivered"}});
+    static Counter& failed = Metrics::instance().counter(
+        "email_local_deliveries_total", "Messages stored in local mailboxes, per recipient",
+        {{"result", "failed"}});
+    return ok ? delivered : failed;
+}
 
-    // Extract domain from recipient
-    auto at_pos = recipient.find('@');
-    if (at_pos == std::string::npos) {
-        result.error = "Invalid recipient address";
-        return result;
+// Outcome of each remote recipient: accepted, or refused temporarily (4xx,
+// or no answer) or permanently (5xx).
+Counter& relay_results(const DeliveryResult& result) {
+    auto counter = [](const char* outcome) -> Counter& {
+        return Metrics::instance().counter(
+            "email_relay_results_total", "Recipients relayed to other hosts, by outcome",
+            {{"result", outcome}});
+    };
+    static Counter& sent = counter("sent");
+    static Counter& deferred = counter("deferred");
+    static Counter& rejected = counter("rejected");
+    if (result.success) {
+        return sent;
     }
+    return result.reply_code >= 500 ? rejected : deferred;
+}
 
-    std::string domain = recipient.substr(at_pos + 1);
+}  // namespace
 
-    // Look up MX records
-    auto mx_records = lookup_mx(domain);
-    if (mx_records.empty()) {
-        // Fall back to A record
-        mx_records.push_back({domain, 0});
-    }
+SMTPRelay::SMTPRelay(asio::io_context& io_context)
+    : io_context_(io_context) {
+}
 
-    // Try each MX in priority order
-    for (const auto& mx : mx_records) {
-        result = send_to_server(mx.hostname, 25, sender, recipient, message_content);
-        if (result.success) {
-            break;
-        }
+SMTPRelay::~SMTPRelay() {
+    stop_queue();
+    if (client_thread_.joinable()) {
+        client_work_.reset();
+        io_context_.stop();
+        client_thread_.join();
     }
-
-    return result;
 }
 
-std::vector<MXRecord> SMTPRelay::lookup_mx(const std::string& domain) {
-    std::vector<MXRecord> records;
+SMTPClient& SMTPRelay::client() {
+    std::call_once(client_started_, [this] {
+        resolver_ = std::make_unique<DNSResolver>(io_context_, DNSResolver::Options{});
+        client_options_.resolver = resolver_.get();
+        client_ = std::make_unique<SMTPClient>(io_context_, client_options_);
+        client_work_.emplace(io_context_.get_executor());
+        client_thread_ = std::thread([this] { io_context_.run(); });
+    });
+    return *client_;
+}
 
-    unsigned char answer[NS_PACKETSZ];
-    int len = res_query(domain.c_str(), ns_c_in, ns_t_mx, answer, sizeof(answer));
+DNSResolver& SMTPRelay::resolver() {
+    client();
+    return *resolver_;
+}
 
-    if (len < 0) {
-        LOG_WARNING_FMT("MX lookup failed for {}", domain);
-        return records;
-    }
+bool SMTPRelay::deliver_local(const std::string& recipient_domain,
+                              const std::string& recipient_local,
+                              std::string_view message_content,
+                              const std::filesystem::path& maildir_root) {
+    return deliver_local({recipient_local + "@" + recipient_domain}, message_content,
+                         maildir_root).front().success;
+}
 
-    ns_msg msg;
-    if (ns_initparse(answer, len, &msg) < 0) {
-        return records;
+std::vector<DeliveryResult> SMTPRelay::deliver_local(const std::vector<std::string>& recipients,
+                                                     std::string_view message_content,
+                                                     const std::filesystem::path& maildir_root) {
+    std::vector<DeliveryResult> results(recipients.size());
+
+    // Stored once and linked to everyone. Without the shared file each
+    // delivery writes its own copy, as a single recipient's does anyway.
+    std::optional<SharedMessage> shared;
+    if (recipients.size() > 1) {
+        std::string error;
+        shared = SharedMessage::create(maildir_root / shared_directory, message_content, error);
+        if (!shared) {
+            LOG_WARNING_FMT("Cannot store message for {} recipients once: {}",
+                            recipients.size(), error);
+        }
     }
 
-    int count = ns_msg_count(msg, ns_s_an);
-    for (int i = 0; i < count; ++i) {
-        ns_rr rr;
-        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
-            continue;
+    parallel_for(recipients.size(), [&](size_t i) {
+        auto& result = results[i];
+        const auto at_pos = recipients[i].rfind('@');
+        if (at_pos == std::string::npos) {
+            result.error = "Invalid recipient address";
+            return;
         }
-
-        if (ns_rr_type(rr) != ns_t_mx) {
-            continue;
+        const std::string local = recipients[i].substr(0, at_pos);
+        const std::string domain = recipients[i].substr(at_pos + 1);
+        Maildir maildir(maildir_root, domain, local);
+
+        if (!maildir.exists() && !maildir.initialize()) {
+            LOG_ERROR_FMT("Failed to initialize maildir for {}@{}", local, domain);
+            result.error = "Cannot create mailbox";
+            return;
         }
 
-        const unsigned char* rdata = ns_rr_rdata(rr);
-        int priority = ns_get16(rdata);
-
-        char exchange[NS_MAXDNAME];
-        if (dn_expand(answer, answer + len, rdata + 2, exchange, sizeof(exchange)) < 0) {
-            continue;
+        std::string unique_id = shared ? maildir.deliver_shared(*shared, "INBOX")
+                                       : maildir.deliver(message_content, "INBOX");
+        if (unique_id.empty()) {
+            LOG_ERROR_FMT("Failed to deliver message to {}@{}: {}", local, domain,
+                          maildir.last_error());
+            result.reply_code = 451;
+            result.error = maildir.last_error();
+            return;
         }
 
-        records.push_back({exchange, priority});
+        LOG_INFO_FMT("Delivered message to {}@{}", local, domain);
+        result.success = true;
+        result.reply_code = 250;
+    });
+    for (const auto& result : results) {
+        local_deliveries(result.success).add();
     }
-
-    // Sort by priority
-    std::sort(records.begin(), records.end());
-
-    return records;
+    return results;
 }
 
-DeliveryResult SMTPRelay::send_to_server(const std::string& server,
-                                         uint16_t port,
-                                         const std::string& sender,
-                                         const std::string& recipient,
-                                         const std::string& content) {
-    DeliveryResult result;
-
-    try {
-        tcp::resolver resolver(io_context_);
-        auto endpoints = resolver.resolve(server, std::to_string(port));
-
-        tcp::socket socket(io_context_);
-        boost::asio::connect(socket, endpoints);
-
-        // Read greeting
-        std::string response = read_response(socket);
-        if (!expect_code(response, 220)) {
-            result.error = "Server rejected connection: " + response;
-            return result;
+std::vector<DeliveryResult> SMTPRelay::deliver_remote(const std::vector<std::string>& recipients,
+                                                      const std::string& sender,
+                                                      std::string_view message_content) {
+    std::vector<DeliveryResult> results(recipients.size());
+
+    // Recipients by the exchangers of their domain, in priority order.
+    std::map<std::vector<std::string>, std::vector<size_t>> routes;
+    std::unordered_map<std::string, std::pair<DNSAnswer::Status, std::vector<std::string>>> domains;
+    for (size_t i = 0; i < recipients.size(); ++i) {
+        auto at_pos = recipients[i].rfind('@');
+        if (at_pos == std::string::npos) {
+            results[i].reply_code = 553;
+            results[i].error = "Invalid recipient address";
+            continue;
         }
-
-        // EHLO
-        send_command(socket, "EHLO " + hostname_);
-        response = read_response(socket);
-        if (!expect_code(response, 250)) {
-            // Try HELO
-            send_command(socket, "HELO " + hostname_);
-            response = read_response(socket);
-            if (!expect_code(response, 250)) {
-                result.error = "HELO rejected: " + response;
-                return result;
+        const std::string domain = recipients[i].substr(at_pos + 1);
+        auto it = domains.find(domain);
+        if (it == domains.end()) {
+            auto answer = resolver().lookup_sync(domain, DNSResolver::Type::MX);
+            std::vector<std::string> hosts;
+            for (const auto& mx : answer.exchangers) {
+                hosts.push_back(mx.hostname);
             }
+            if (answer.status == DNSAnswer::Status::NoRecords) {
+                hosts.push_back(domain);  // Fall back to the A record
+            } else if (answer.status == DNSAnswer::Status::Failed) {
+                LOG_WARNING_FMT("MX lookup failed for {}", domain);
+            }
+            it = domains.emplace(domain, std::make_pair(answer.status, std::move(hosts))).first;
         }
-
-        // MAIL FROM
-        send_command(socket, "MAIL FROM:<" + sender + ">");
-        response = read_response(socket);
-        if (!expect_code(response, 250)) {
-            result.error = "MAIL FROM rejected: " + response;
-            return result;
-        }
-
-        // RCPT TO
-        send_command(socket, "RCPT TO:<" + recipient + ">");
-        response = read_response(socket);
-        if (!expect_code(response, 250) && !expect_code(response, 251)) {
-            result.error = "RCPT TO rejected: " + response;
-            return result;
-        }
-
-        // DATA
-        send_command(socket, "DATA");
-        response = read_response(socket);
-        if (!expect_code(response, 354)) {
-            result.error = "DATA rejected: " + response;
-            return result;
+        const auto& [status, hosts] = it->second;
+        if (status == DNSAnswer::Status::NoDomain) {
+            results[i].reply_code = 550;
+            results[i].error = "Domain not found: " + domain;
+        } else if (hosts.empty()) {
+            results[i].error = "DNS lookup failed for " + domain;  // Retried later
+        } else {
+            routes[hosts].push_back(i);
         }
+    }
 
-        // Send message content
-        std::istringstream iss(content);
-        std::string line;
-        while (std::getline(iss, line)) {
-            // Remove trailing \r if present
-            if (!line.empty() && line.back() == '\r') {
-                line.pop_back();
+    // Each exchanger in turn gets what the ones before failed temporarily.
+    for (const auto& [hosts, indexes] : routes) {
+        std::vector<size_t> pending = indexes;
+        for (const auto& host : hosts) {
+            std::vector<std::string> batch;
+            batch.reserve(pending.size());
+            for (size_t i : pending) {
+                batch.push_back(recipients[i]);
             }
-            // Byte-stuff lines starting with .
-            if (!line.empty() && line[0] == '.') {
-                line = "." + line;
+            auto sent = client().send_sync(host, 25, sender, batch, message_content);
+            std::vector<size_t> retry;
+            for (size_t k = 0; k < pending.size(); ++k) {
+                if (!sent[k].success && sent[k].reply_code < 500) {
+                    retry.push_back(pending[k]);
+                }
+                results[pending[k]] = std::move(sent[k]);
+            }
+            pending = std::move(retry);
+            if (pending.empty()) {
+                break;
             }
-            send_command(socket, line);
-        }
-
-        // End of data
-        send_command(socket, ".");
-        response = read_response(socket);
-        if (!expect_code(response, 250)) {
-            result.error = "Message rejected: " + response;
-            return result;
         }
-
-        // QUIT
-        send_command(socket, "QUIT");
-        read_response(socket);  // Ignore response
-
-        result.success = true;
-        result.reply_code = 250;
-        result.reply_message = "Message delivered";
-
-    } catch (const std::exception& e) {
-        result.error = e.what();
     }
 
-    return result;
+    for (const auto& result : results) {
+        relay_results(result).add();
+    }
+    return results;
 }
 
-std::string SMTPRelay::read_response(tcp::socket& socket) {
-    boost::asio::streambuf buffer;
-    std::string response;
-
-    while (true) {
-        boost::asio::read_until(socket, buffer, "\r\n");
-
-        std::istream is(&buffer);
-        std::string line;
-        std::getline(is, line);
+std::vector<MXRecord> SMTPRelay::lookup_mx(const std::string& domain) {
+    auto answer = resolver().lookup_sync(domain, DNSResolver::Type::MX);
+    if (answer.status == DNSAnswer::Status::Failed) {
+        LOG_WARNING_FMT("MX lookup failed for {}", domain);
+    }
+    return std::move(answer.exchangers);
+}
 
-        if (!line.empty() && line.back() == '\r') {
-            line.pop_back();
+std::vector<DeliveryResult> SMTPRelay::deliver(const std::string& sender,
+                                               const std::vector<std::string>& recipients,
+                                               const std::string& content) {
+    std::vector<DeliveryResult> results(recipients.size());
+    std::vector<size_t> local;
+    std::vector<size_t> remote;
+    for (size_t i = 0; i < recipients.size(); ++i) {
+        const auto& recipient = recipients[i];
+        auto at_pos = recipient.rfind('@');
+        const std::string domain = at_pos == std::string::npos ? "" : recipient.substr(at_pos + 1);
+        (is_local_ && is_local_(domain) ? local : remote).push_back(i);
+    }
+    auto deliver_batch = [&](const std::vector<size_t>& indexes, auto&& send) {
+        if (indexes.empty()) {
+            return;
         }
-
-        response += line;
-
-        // Check if this is the last line (no continuation)
-        if (line.length() >= 4 && line[3] == ' ') {
-            break;
+        std::vector<std::string> batch;
+        batch.reserve(indexes.size());
+        for (size_t i : indexes) {
+            batch.push_back(recipients[i]);
+        }
+        auto sent = send(batch);
+        for (size_t k = 0; k < indexes.size(); ++k) {
+            results[indexes[k]] = std::move(sent[k]);
         }
+    };
+    deliver_batch(local, [&](const std::vector<std::string>& batch) {
+        return deliver_local(batch, content, maildir_root_);
+    });
+    deliver_batch(remote, [&](const std::vector<std::string>& batch) {
+        return deliver_remote(batch, sender, content);
+    });
+    return results;
+}
 
-        response += "\n";
+bool SMTPRelay::start_queue(const std::filesystem::path& spool, size_t workers,
+                            size_t per_destination) {
+    OutboundQueue::Options options;
+    options.workers = workers;
+    options.per_destination = per_destination;
+    options.retry_interval = retry_interval_;
+    options.max_retries = max_retries_;
+    options.hostname = hostname_;
+
+    auto queue = std::make_unique<OutboundQueue>(
+        spool, options,
+        [this](const std::string& sender, const std::vector<std::string>& recipients,
+               const std::string& content) { return deliver(sender, recipients, content); });
+    if (!queue->open()) {
+        LOG_ERROR_FMT("Cannot open the mail queue in {}: {}", spool.string(), queue->last_error());
+        return false;
     }
-
-    return response;
+    queue->start();
+    queue_ = std::move(queue);
+    LOG_INFO_FMT("Mail queue in {} started with {} delivery workers", spool.string(), workers);
+    return true;
 }
 
-bool SMTPRelay::send_command(tcp::socket& socket, const std::string& command) {
-    std::string cmd = command + "\r\n";
-    boost::asio::write(socket, boost::asio::buffer(cmd));
-    return true;
+void SMTPRelay::stop_queue() {
+    if (queue_) {
+        queue_->stop();
+        queue_.reset();
+    }
 }
 
-bool SMTPRelay::expect_code(const std::string& response, int expected_code) {
-    if (response.length() < 3) {
+bool SMTPRelay::queue_message(const std::string& sender,
+                              const std::vector<std::string>& recipients,
+                              std::string_view content) {
+    if (!queue_) {
         return false;
     }
-
-    try {
-        int code = std::stoi(response.substr(0, 3));
-        return code == expected_code;
-    } catch (...) {
+    auto id = queue_->enqueue(sender, recipients, content);
+    if (!id) {
+        LOG_ERROR_FMT("Cannot queue message from <{}>: {}", sender, queue_->last_error());
         return false;
     }
-}
-
-bool SMTPRelay::queue_message(const std::string& /* sender */,
-                              const std::vector<std::string>& /* recipients */,
-                              const std::string& /* content */) {
-    // Queue implementation would store messages for later delivery
-    // This is a placeholder for a full queue implementation
+    LOG_INFO_FMT("Queued message {} from <{}> for {} recipients", *id, sender, recipients.size());
     return true;
 }
 
 void SMTPRelay::process_queue() {
-    // Process queued messages
-    // This would be called periodically by a background thread
+    if (queue_) {
+        queue_->flush();
+    }
 }
 
 }  // namespace email::smtp
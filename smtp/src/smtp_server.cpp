@@ -1,5 +1,6 @@
 #include "smtp_server.hpp"
 #include "logger.hpp"
+#include <algorithm>
 
 namespace email::smtp {
 
@@ -13,6 +14,19 @@ SMTPServer::SMTPServer(const SMTPConfig& config,
     relay_io_context_ = std::make_unique<asio::io_context>();
     relay_ = std::make_shared<SMTPRelay>(*relay_io_context_);
     relay_->set_hostname(config_.hostname);
+    relay_->set_retry_interval(std::chrono::seconds(config_.retry_interval));
+    relay_->set_max_retries(config_.max_retries);
+    SMTPClient::Options client;
+    client.max_connections_per_host = config_.relay_connections_per_host;
+    client.max_idle_per_host = config_.relay_idle_connections;
+    client.idle_ttl = std::chrono::seconds(config_.relay_idle_timeout);
+    client.starttls = config_.relay_starttls;
+    relay_->set_client_options(client);
+    relay_->set_local_delivery(maildir_root_, [this](const std::string& domain) {
+        return std::find(config_.local_domains.begin(), config_.local_domains.end(), domain) !=
+                   config_.local_domains.end() ||
+               auth_->is_local_domain(domain);
+    });
 }
 
 SMTPServer::~SMTPServer() {
@@ -21,15 +35,8 @@ SMTPServer::~SMTPServer() {
 
 bool SMTPServer::configure_tls(const TLSConfig& tls_config) {
 #ifdef ENABLE_TLS
-    ssl_context_ = SSLContext::create_server_context(
-        tls_config.certificate_file,
-        tls_config.private_key_file,
-        tls_config.ca_file,
-        tls_config.ciphers
-    );
-
+    ssl_context_ = SSLContext::create_server_context(tls_config);
     if (!ssl_context_.is_initialized()) {
-        LOG_ERROR_FMT("Failed to configure TLS: {}", ssl_context_.last_error());
         return false;
     }
 
@@ -43,6 +50,17 @@ bool SMTPServer::configure_tls(const TLSConfig& tls_config) {
 }
 
 void SMTPServer::start() {
+    memory_budget_->set_limit(config_.memory_budget);
+
+    if (!config_.spool_directory.empty() &&
+        !relay_->start_queue(config_.spool_directory, config_.delivery_workers,
+                             config_.max_per_destination)) {
+        LOG_WARNING("Mail queue unavailable; relaying while clients wait");
+    }
+    if (!config_.spool_directory.empty()) {
+        incoming_directory_ = config_.spool_directory / "incoming";
+    }
+
     // Create SMTP server on port 25
     smtp_server_ = std::make_unique<Server<SMTPSession>>(
         "SMTP",
@@ -59,6 +77,7 @@ void SMTPServer::start() {
             );
             session->set_max_message_size(config_.max_message_size);
             session->set_max_recipients(config_.max_recipients);
+            session->set_message_spool(incoming_directory_, config_.data_spool_threshold);
             session->set_require_auth(config_.require_auth);
             session->set_allow_relay(config_.allow_relay);
 #ifdef ENABLE_TLS
@@ -71,7 +90,12 @@ void SMTPServer::start() {
     );
 
     smtp_server_->set_max_connections(config_.max_connections);
+    smtp_server_->set_memory_budget(memory_budget_);
     smtp_server_->set_connection_timeout(config_.connection_timeout);
+    smtp_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                         : ExecutionMode::Shared);
+    smtp_server_->set_cpu_affinity(config_.pin_threads);
+    smtp_server_->set_reactor(reactor_);
 
     LOG_INFO_FMT("Starting SMTP server on {}:{}", config_.bind_address, config_.port);
     smtp_server_->start();
@@ -93,6 +117,7 @@ void SMTPServer::start() {
             );
             session->set_max_message_size(config_.max_message_size);
             session->set_max_recipients(config_.max_recipients);
+            session->set_message_spool(incoming_directory_, config_.data_spool_threshold);
             session->set_require_auth(true);  // Always require auth on submission
             session->set_allow_relay(true);   // Allow relay for authenticated users
 #ifdef ENABLE_TLS
@@ -105,7 +130,12 @@ void SMTPServer::start() {
     );
 
     submission_server_->set_max_connections(config_.max_connections);
+    submission_server_->set_memory_budget(memory_budget_);
     submission_server_->set_connection_timeout(config_.connection_timeout);
+    submission_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                               : ExecutionMode::Shared);
+    submission_server_->set_cpu_affinity(config_.pin_threads);
+    submission_server_->set_reactor(reactor_);
 
     LOG_INFO_FMT("Starting SMTP submission server on {}:{}", config_.bind_address, submission_port);
     submission_server_->start();
@@ -130,6 +160,7 @@ void SMTPServer::start() {
                     );
                     session->set_max_message_size(config_.max_message_size);
                     session->set_max_recipients(config_.max_recipients);
+                    session->set_message_spool(incoming_directory_, config_.data_spool_threshold);
                     session->set_require_auth(true);
                     session->set_allow_relay(true);
                     return session;
@@ -143,30 +174,128 @@ void SMTPServer::start() {
         );
 
         smtps_server_->set_max_connections(config_.max_connections);
+        smtps_server_->set_memory_budget(memory_budget_);
         smtps_server_->set_connection_timeout(config_.connection_timeout);
+        smtps_server_->set_execution_mode(config_.per_core_io ? ExecutionMode::PerCore
+                                                              : ExecutionMode::Shared);
+        smtps_server_->set_cpu_affinity(config_.pin_threads);
+        smtps_server_->set_reactor(reactor_);
 
         LOG_INFO_FMT("Starting SMTPS server on {}:{}", config_.bind_address, config_.tls_port);
         smtps_server_->start();
     }
 #endif
+
+    if (usage_reconcile_interval_.count() > 0) {
+        usage_stopping_ = false;
+        usage_thread_ = std::thread([this] { reconcile_usage_loop(); });
+    }
+}
+
+void SMTPServer::reconcile_usage_loop() {
+    std::unique_lock<std::mutex> lock(usage_mutex_);
+    while (!usage_wakeup_.wait_for(lock, usage_reconcile_interval_,
+                                   [this] { return usage_stopping_; })) {
+        lock.unlock();
+        try {
+            reconcile_usage();
+        } catch (const std::exception& e) {
+            LOG_ERROR_FMT("Usage reconciliation failed: {}", e.what());
+        }
+        try {
+            recompress_messages();
+        } catch (const std::exception& e) {
+            LOG_ERROR_FMT("Recompression failed: {}", e.what());
+        }
+        lock.lock();
+    }
+}
+
+void SMTPServer::reconcile_usage() {
+    const int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    size_t reconciled = 0;
+
+    for (const auto& user : auth_->list_users()) {
+        Maildir maildir(maildir_root_, user.domain, user.username);
+        if (!maildir.exists()) {
+            continue;
+        }
+        // Deliveries keep the totals current; only drift needs a recount.
+        StorageUsage usage = maildir.usage();
+        if (now - usage.reconciled_at >= usage_reconcile_interval_.count()) {
+            usage = maildir.reconcile_usage();
+            ++reconciled;
+        }
+        if (static_cast<int64_t>(usage.bytes) != user.used_bytes) {
+            auth_->update_used_space(user.username + "@" + user.domain,
+                                     static_cast<int64_t>(usage.bytes));
+        }
+    }
+
+    if (reconciled > 0) {
+        LOG_INFO_FMT("Reconciled storage usage of {} users", reconciled);
+    }
+}
+
+void SMTPServer::recompress_messages() {
+    if (recompress_batch_ == 0 || Maildir::compression_level() <= 0) {
+        return;
+    }
+
+    size_t rewritten = 0;
+    for (const auto& user : auth_->list_users()) {
+        Maildir maildir(maildir_root_, user.domain, user.username);
+        rewritten += maildir.recompress(recompress_batch_);
+    }
+
+    if (rewritten > 0) {
+        LOG_INFO_FMT("Compressed {} stored messages", rewritten);
+    }
 }
 
 void SMTPServer::stop() {
+    const bool running = smtp_server_ || submission_server_ || smtps_server_;
+    size_t refused = 0;
+
+    if (usage_thread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(usage_mutex_);
+            usage_stopping_ = true;
+        }
+        usage_wakeup_.notify_all();
+        usage_thread_.join();
+    }
+
     if (smtp_server_) {
+        refused += smtp_server_->memory_refusals();
         smtp_server_->stop();
         smtp_server_.reset();
     }
 
     if (submission_server_) {
+        refused += submission_server_->memory_refusals();
         submission_server_->stop();
         submission_server_.reset();
     }
 
     if (smtps_server_) {
+        refused += smtps_server_->memory_refusals();
         smtps_server_->stop();
         smtps_server_.reset();
     }
 
+    relay_->stop_queue();
+
+    if (tls_configured_ && running) {
+        ssl_context_.log_stats("SMTP");
+    }
+
+    if (refused > 0) {
+        LOG_WARNING_FMT("SMTP refused {} connections over the memory budget of {} bytes",
+                        refused, memory_budget_->limit());
+    }
+
     LOG_INFO("SMTP server stopped");
 }
 
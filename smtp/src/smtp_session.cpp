@@ -1,8 +1,10 @@
 #include "smtp_session.hpp"
 #include "logger.hpp"
+#include "net/coro_session.hpp"
 #include <sstream>
 #include <chrono>
 #include <iomanip>
+#include <utility>
 
 // Base64 helpers
 #include <openssl/bio.h>
@@ -107,9 +109,7 @@ void SMTPSession::on_connect() {
 }
 
 void SMTPSession::on_data(const std::string& data) {
-    if (state_ == SessionState::DATA) {
-        process_data_line(data);
-    } else if (auth_state_ == AuthState::PLAIN_WAITING ||
+    if (auth_state_ == AuthState::PLAIN_WAITING ||
                auth_state_ == AuthState::LOGIN_WAITING_USERNAME ||
                auth_state_ == AuthState::LOGIN_WAITING_PASSWORD) {
         process_auth_response(data);
@@ -136,47 +136,145 @@ void SMTPSession::process_command(const std::string& line) {
     std::string response = CommandHandler::instance().execute(*this, cmd);
 
     if (!response.empty()) {
-        send_line(response);
+        send_line(std::move(response));
     }
 
     // Handle QUIT
     if (cmd.type == CommandType::QUIT) {
-        stop();
+        close_after_flush();
     }
 }
 
-void SMTPSession::process_data_line(const std::string& line) {
-    // Check for end of data
-    if (line == ".") {
-        // Deliver message
-        if (deliver_message()) {
-            send_line(reply::make(reply::OK, "Message accepted for delivery"));
-        } else {
-            send_line(reply::make(reply::LOCAL_ERROR, "Delivery failed"));
+void SMTPSession::begin_message() {
+    message_.reset();
+    data_too_large_ = false;
+
+    // Stamped as the transfer starts, so the body streams in behind it.
+    std::ostringstream received;
+    received << "Received: from " << client_hostname_
+             << " (" << remote_address() << ")\r\n"
+             << "\tby " << hostname_ << " with "
+             << (is_tls() ? "ESMTPS" : "ESMTP") << ";\r\n"
+             << "\t" << get_timestamp() << "\r\n";
+    const std::string header = received.str();
+    header_size_ = header.size();
+    message_.append(header);
+    update_footprint();
+}
+
+void SMTPSession::receive_data() {
+    begin_message();
+    state_ = SessionState::DATA;
+    unstuffer_.reset();
+    read_stream();
+}
+
+std::size_t SMTPSession::on_stream(std::string_view bytes) {
+    const std::size_t taken = unstuffer_.decode(bytes, [this](std::string_view body) {
+        // The rest of an oversized body is discarded up to the terminating
+        // dot so it is not mistaken for commands.
+        if (!data_too_large_ && body_fits(body.size())) {
+            message_.append(body);
         }
+    });
+    update_footprint();
+    if (unstuffer_.done()) {
+        end_stream();
+        finish_message();
+    }
+    return taken;
+}
+
+void SMTPSession::reset_message() {
+    message_.reset();
+    data_too_large_ = false;
+    update_footprint();
+}
 
-        envelope_.clear();
-        state_ = SessionState::GREETED;
-        data_buffer_.clear();
+bool SMTPSession::body_fits(size_t more) {
+    if (message_.failed()) {
+        return false;  // Refused as a local error instead
+    }
+    if (message_.size() - header_size_ + more <= max_message_size_) {
+        return true;
+    }
+    data_too_large_ = true;
+    message_.reset();
+    return false;
+}
+
+void SMTPSession::finish_message() {
+    if (data_too_large_) {
+        send_line(reply::make(reply::EXCEEDED_STORAGE, "Message too large"));
+    } else if (message_.failed()) {
+        LOG_ERROR_FMT("Cannot receive message: {}", message_.last_error());
+        send_line(reply::make(reply::LOCAL_ERROR, "Cannot store message"));
+    } else if (!recipients_have_room()) {
+        send_line(reply::make(reply::EXCEEDED_STORAGE, "Mailbox full"));
+    } else {
+        // Storing for every recipient and syncing them takes long enough
+        // to stall the other sessions of this io thread; no further command
+        // is read until the pool has done it and the reply is sent.
+        suspend_input();
+        auto done = on_strand([this](bool delivered) {
+            if (delivered) {
+                send_line(reply::make(reply::OK, "Message accepted for delivery"));
+            } else {
+                send_line(reply::make(reply::LOCAL_ERROR, "Delivery failed"));
+            }
+            end_message();
+            resume_input();
+        });
+        asio::post(blocking_pool(), [this, done = std::move(done)] {
+            done(deliver_message());
+        });
         return;
     }
+    end_message();
+}
+
+void SMTPSession::end_message() {
+    envelope_.clear();
+    state_ = SessionState::GREETED;
+    // Give the body back rather than pinning the largest message seen
+    // for the rest of the connection.
+    reset_message();
+}
 
-    // Handle byte-stuffing (lines starting with . have extra . prepended)
-    std::string content_line = line;
-    if (!content_line.empty() && content_line[0] == '.') {
-        content_line = content_line.substr(1);
+void SMTPSession::receive_chunk(size_t size, bool last, std::string refusal) {
+    if (refusal.empty() && state_ == SessionState::RCPT) {
+        begin_message();
+        state_ = SessionState::BDAT;
+    }
+    chunk_size_ = size;
+    chunk_last_ = last;
+    chunk_refusal_ = std::move(refusal);
+    if (size > 0) {
+        read_bytes(size);
+    } else {
+        on_bytes({}, true);
     }
+}
 
-    // Check message size
-    if (data_buffer_.size() + content_line.size() + 2 > max_message_size_) {
-        send_line(reply::make(reply::EXCEEDED_STORAGE, "Message too large"));
-        envelope_.clear();
-        state_ = SessionState::GREETED;
-        data_buffer_.clear();
+void SMTPSession::on_bytes(std::string_view bytes, bool last) {
+    // Chunks are taken as they are: no lines, no dot-stuffing.
+    if (chunk_refusal_.empty() && !data_too_large_ && body_fits(bytes.size())) {
+        message_.append(bytes);
+    }
+    update_footprint();
+    if (!last) {
         return;
     }
 
-    data_buffer_ += content_line + "\r\n";
+    if (!chunk_refusal_.empty()) {
+        send_line(std::exchange(chunk_refusal_, {}));
+    } else if (chunk_last_ || data_too_large_ || message_.failed()) {
+        // A chunk that cannot be kept fails the transaction; the client
+        // sends no more of it (RFC 3030, 4.2).
+        finish_message();
+    } else {
+        send_line(reply::make(reply::OK, std::to_string(chunk_size_) + " octets received"));
+    }
 }
 
 void SMTPSession::process_auth_response(const std::string& line) {
@@ -194,20 +292,8 @@ void SMTPSession::process_auth_response(const std::string& line) {
                 return;
             }
 
-            std::string username = decoded.substr(first_null + 1, second_null - first_null - 1);
-            std::string password = decoded.substr(second_null + 1);
-
-            if (auth_->authenticate(username, password)) {
-                set_authenticated(true);
-                auto [user, domain] = Authenticator::parse_email(username);
-                set_username(user);
-                set_domain(domain);
-                auth_state_ = AuthState::AUTHENTICATED;
-                send_line(reply::make(reply::AUTH_SUCCESS, "Authentication successful"));
-            } else {
-                send_line(reply::make(reply::AUTH_INVALID, "Authentication failed"));
-                auth_state_ = AuthState::NONE;
-            }
+            login(decoded.substr(first_null + 1, second_null - first_null - 1),
+                  decoded.substr(second_null + 1));
             break;
         }
 
@@ -217,28 +303,35 @@ void SMTPSession::process_auth_response(const std::string& line) {
             send_line(reply::make(reply::AUTH_CONTINUE, base64_encode("Password:")));
             break;
 
-        case AuthState::LOGIN_WAITING_PASSWORD: {
-            std::string password = decoded;
+        case AuthState::LOGIN_WAITING_PASSWORD:
+            login(std::exchange(auth_username_, {}), decoded);
+            break;
 
-            if (auth_->authenticate(auth_username_, password)) {
+        default:
+            auth_state_ = AuthState::NONE;
+            break;
+    }
+}
+
+void SMTPSession::login(std::string username, std::string password) {
+    // No further command is read until the KDF, run on the authenticator's
+    // pool, has answered.
+    auth_state_ = AuthState::NONE;
+    suspend_input();
+    auth_->authenticate_async(username, std::move(password),
+        on_strand([this, username](bool valid) {
+            if (valid) {
                 set_authenticated(true);
-                auto [user, domain] = Authenticator::parse_email(auth_username_);
+                auto [user, domain] = Authenticator::parse_email(username);
                 set_username(user);
                 set_domain(domain);
                 auth_state_ = AuthState::AUTHENTICATED;
                 send_line(reply::make(reply::AUTH_SUCCESS, "Authentication successful"));
             } else {
                 send_line(reply::make(reply::AUTH_INVALID, "Authentication failed"));
-                auth_state_ = AuthState::NONE;
             }
-            auth_username_.clear();
-            break;
-        }
-
-        default:
-            auth_state_ = AuthState::NONE;
-            break;
-    }
+            resume_input();
+        }));
 }
 
 bool SMTPSession::is_local_domain(const std::string& domain) const {
@@ -250,23 +343,45 @@ bool SMTPSession::is_local_domain(const std::string& domain) const {
     return auth_->is_local_domain(domain);
 }
 
+uint64_t SMTPSession::room_left(const User& user) {
+    if (user.quota_bytes <= 0) {
+        return UINT64_MAX;
+    }
+    Maildir maildir(maildir_root_, user.domain, user.username);
+    const uint64_t used = maildir.usage().bytes;
+    const auto quota = static_cast<uint64_t>(user.quota_bytes);
+    return used < quota ? quota - used : 0;
+}
+
+bool SMTPSession::recipients_have_room() {
+    // Checked for everyone before delivering to anyone: the one reply to
+    // DATA cannot accept the message for some recipients only. The usage
+    // is as RCPT found it, so a large fan-out costs no lookups here.
+    for (size_t i = 0; i < envelope_.room.size(); ++i) {
+        if (message_.size() > envelope_.room[i]) {
+            LOG_INFO_FMT("Refusing message for {}: over quota", envelope_.rcpt_to[i]);
+            return false;
+        }
+    }
+    return true;
+}
+
 bool SMTPSession::deliver_message() {
     if (envelope_.rcpt_to.empty()) {
         return false;
     }
 
-    // Add Received header
-    std::ostringstream received;
-    received << "Received: from " << client_hostname_
-             << " (" << remote_address() << ")\r\n"
-             << "\tby " << hostname_ << " with "
-             << (is_tls() ? "ESMTPS" : "ESMTP") << ";\r\n"
-             << "\t" << get_timestamp() << "\r\n";
-
-    std::string full_message = received.str() + data_buffer_;
-    envelope_.data = full_message;
+    // In memory, or mapped from the spool file; never copied from here on.
+    auto contents = message_.contents();
+    if (!contents) {
+        LOG_ERROR_FMT("Cannot read received message: {}", message_.last_error());
+        return false;
+    }
+    const std::string_view full_message = *contents;
 
     bool all_delivered = true;
+    std::vector<std::string> local;
+    std::vector<std::string> relayed;
 
     for (const auto& recipient : envelope_.rcpt_to) {
         auto addr = EmailAddress::parse(recipient);
@@ -277,24 +392,39 @@ bool SMTPSession::deliver_message() {
         }
 
         if (is_local_domain(addr->domain)) {
-            // Local delivery
-            if (!relay_->deliver_local(addr->domain, addr->local_part,
-                                       full_message, maildir_root_)) {
-                all_delivered = false;
-            }
+            local.push_back(addr->local_part + "@" + addr->domain);
         } else if (allow_relay_ || is_authenticated()) {
-            // Remote delivery
-            auto result = relay_->deliver_remote(recipient, envelope_.mail_from, full_message);
-            if (!result.success) {
-                LOG_ERROR_FMT("Failed to relay to {}: {}", recipient, result.error);
-                all_delivered = false;
-            }
+            relayed.push_back(recipient);
         } else {
             LOG_WARNING_FMT("Relay denied for {}", recipient);
             all_delivered = false;
         }
     }
 
+    // Stored once for all of them, delivered in parallel.
+    auto delivered = relay_->deliver_local(local, full_message, maildir_root_);
+    for (size_t i = 0; i < delivered.size(); ++i) {
+        if (!delivered[i].success) {
+            LOG_ERROR_FMT("Failed to deliver to {}: {}", local[i], delivered[i].error);
+            all_delivered = false;
+        }
+    }
+
+    if (relayed.empty()) {
+        return all_delivered;
+    }
+    // Accepted once the spool holds it; the delivery workers go on from there.
+    if (relay_->queue_enabled()) {
+        return relay_->queue_message(envelope_.mail_from, relayed, full_message) && all_delivered;
+    }
+    auto results = relay_->deliver_remote(relayed, envelope_.mail_from, full_message);
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (!results[i].success) {
+            LOG_ERROR_FMT("Failed to relay to {}: {}", relayed[i], results[i].error);
+            all_delivered = false;
+        }
+    }
+
     return all_delivered;
 }
 
@@ -1,5 +1,19 @@
 #include <catch2/catch_test_macros.hpp>
 #include "smtp_commands.hpp"
+#include "outbound_queue.hpp"
+#include "smtp_client.hpp"
+#include "dns_resolver.hpp"
+#include "dot_stuffing.hpp"
+#include "inbound_message.hpp"
+#include "storage/maildir.hpp"
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/use_future.hpp>
+#include <future>
+#include <chrono>
+#include <filesystem>
+#include <set>
+#include <thread>
+#include <sys/stat.h>
 
 using namespace email::smtp;
 
@@ -33,6 +47,12 @@ TEST_CASE("SMTP command parsing", "[smtp][commands]") {
         REQUIRE(cmd.type == CommandType::DATA);
     }
 
+    SECTION("Parse BDAT command") {
+        auto cmd = Command::parse("BDAT 1024 LAST");
+        REQUIRE(cmd.type == CommandType::BDAT);
+        REQUIRE(cmd.argument == "1024 LAST");
+    }
+
     SECTION("Parse RSET command") {
         auto cmd = Command::parse("RSET");
         REQUIRE(cmd.type == CommandType::RSET);
@@ -161,3 +181,503 @@ TEST_CASE("Command type conversion", "[smtp][commands]") {
         REQUIRE(Command::string_to_type("INVALID") == CommandType::UNKNOWN);
     }
 }
+
+TEST_CASE("Inbound message spooling", "[smtp][inbound]") {
+    auto dir = std::filesystem::temp_directory_path() / "email_inbound_test";
+    std::filesystem::remove_all(dir);
+
+    SECTION("Small messages stay in memory") {
+        InboundMessage message(dir, 1024);
+        REQUIRE(message.append("Subject: hi\r\n\r\n"));
+        REQUIRE(message.append_line("body"));
+        REQUIRE_FALSE(message.spooled());
+        REQUIRE(message.contents() == std::string_view("Subject: hi\r\n\r\nbody\r\n"));
+    }
+
+    SECTION("Large messages move to an unlinked spool file") {
+        InboundMessage message(dir, 1024);
+        std::string expected;
+        for (int i = 0; i < 5000; ++i) {
+            std::string line = "line " + std::to_string(i) + std::string(40, 'x');
+            REQUIRE(message.append_line(line));
+            expected += line + "\r\n";
+        }
+        const std::string chunk(3 * InboundMessage::write_buffer_size, 'c');
+        REQUIRE(message.append(chunk));
+        expected += chunk;
+
+        REQUIRE(message.spooled());
+        REQUIRE(message.size() == expected.size());
+        REQUIRE(message.memory() <= InboundMessage::write_buffer_size);
+        REQUIRE(std::filesystem::is_empty(dir));
+        auto contents = message.contents();
+        REQUIRE(contents);
+        REQUIRE(*contents == expected);
+
+        REQUIRE(message.append("more"));
+        REQUIRE(message.contents()->substr(expected.size()) == "more");
+
+        message.reset();
+        REQUIRE_FALSE(message.spooled());
+        REQUIRE(message.size() == 0);
+        REQUIRE(message.memory() < 64);  // No more than the empty string holds
+    }
+
+    SECTION("An unwritable spool fails the message") {
+        InboundMessage message("/proc/email_inbound_test", 16);
+        REQUIRE_FALSE(message.append(std::string(64, 'a')));
+        REQUIRE(message.failed());
+        REQUIRE_FALSE(message.contents());
+        REQUIRE_FALSE(message.last_error().empty());
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Dot-stuffing codec", "[smtp][dotstuff]") {
+    // Long enough for the vector loops, with events on either side of
+    // block boundaries.
+    std::string content;
+    std::string body;  // As decoded: CRLF lines, dots unstuffed
+    for (int i = 0; i < 200; ++i) {
+        std::string line(static_cast<size_t>(i % 70), static_cast<char>('a' + i % 26));
+        if (i % 3 == 0) line.insert(0, ".");
+        if (i % 7 == 0) line += ".";
+        content += line + (i % 5 == 0 ? "\n" : "\r\n");
+        body += line + "\r\n";
+    }
+    content += "no newline";
+    body += "no newline\r\n";
+
+    auto decode_in_pieces = [](std::string_view input, size_t piece, size_t& taken) {
+        DotUnstuffer unstuffer;
+        std::string out;
+        taken = 0;
+        while (taken < input.size() && !unstuffer.done()) {
+            auto part = input.substr(taken, piece);
+            taken += unstuffer.decode(part, [&](std::string_view bytes) { out += bytes; });
+        }
+        REQUIRE(unstuffer.done());
+        return out;
+    };
+
+    SECTION("Encoding") {
+        REQUIRE(DotStuffer::encode_all("") == ".\r\n");
+        REQUIRE(DotStuffer::encode_all(".\n..\r\nx\r") == "..\r\n...\r\nx\r\n.\r\n");
+        const std::string encoded = DotStuffer::encode_all(content);
+        REQUIRE(encoded.find("\r\n.a") == std::string::npos);
+        REQUIRE(encoded.find("\r\n..a") != std::string::npos);
+
+        // Pieces cut anywhere encode the same as the whole.
+        for (size_t piece : {1, 7, 16, 33, 4096}) {
+            DotStuffer stuffer;
+            std::string out;
+            for (size_t pos = 0; pos < content.size(); pos += piece) {
+                stuffer.encode(std::string_view(content).substr(pos, piece), out);
+            }
+            stuffer.finish(out);
+            REQUIRE(out == encoded);
+        }
+    }
+
+    SECTION("Round trip, split anywhere") {
+        const std::string encoded = DotStuffer::encode_all(content);
+        size_t taken = 0;
+        for (size_t piece : std::vector<size_t>{1, 2, 3, 15, 31, 64, 1000, encoded.size()}) {
+            REQUIRE(decode_in_pieces(encoded, piece, taken) == body);
+            REQUIRE(taken == encoded.size());
+        }
+    }
+
+    SECTION("Terminator") {
+        const std::string input = "a\r\n..b\n.\r\nQUIT\r\n";
+        size_t taken = 0;
+        for (size_t piece = 1; piece <= input.size(); ++piece) {
+            REQUIRE(decode_in_pieces(input, piece, taken) == "a\r\n.b\r\n");
+            REQUIRE(input.substr(taken) == "QUIT\r\n");
+        }
+        REQUIRE(decode_in_pieces(".\nRSET\r\n", 64, taken).empty());
+        REQUIRE(taken == 2);
+        // A dot and CR not ending the line are body.
+        REQUIRE(decode_in_pieces("x\r\n.\ry\r\n.\r\n", 4, taken) == "x\r\n\ry\r\n");
+    }
+}
+
+TEST_CASE("Local fan-out delivery", "[smtp][local]") {
+    const auto root = std::filesystem::temp_directory_path() / "email_fanout_test";
+    std::filesystem::remove_all(root);
+    asio::io_context io;
+    SMTPRelay relay(io);
+
+    std::vector<std::string> recipients;
+    for (int i = 0; i < 40; ++i) {
+        recipients.push_back("user" + std::to_string(i) + "@local.test");
+    }
+    recipients.push_back("broken");
+    const std::string message = "Subject: All hands\r\nFrom: ceo@local.test\r\n\r\nMeeting at noon.\r\n";
+
+    auto results = relay.deliver_local(recipients, message, root);
+    REQUIRE(results.size() == recipients.size());
+    REQUIRE_FALSE(results.back().success);
+
+    std::set<ino_t> inodes;
+    for (size_t i = 0; i + 1 < recipients.size(); ++i) {
+        REQUIRE(results[i].success);
+        email::Maildir maildir(root, "local.test", "user" + std::to_string(i));
+        auto messages = maildir.list_messages();
+        REQUIRE(messages.size() == 1);
+        REQUIRE(maildir.get_message_content(messages[0].unique_id) == message);
+        REQUIRE(maildir.get_message_structure(messages[0].unique_id)->envelope.subject ==
+                "All hands");
+        REQUIRE(maildir.usage().bytes == message.size());
+        struct stat st{};
+        REQUIRE(::stat(messages[0].path.c_str(), &st) == 0);
+        inodes.insert(st.st_ino);
+    }
+    // One file, linked into every maildir; the shared name is gone.
+    REQUIRE(inodes.size() == 1);
+    REQUIRE(std::filesystem::is_empty(root / ".shared"));
+
+    std::filesystem::remove_all(root);
+}
+
+TEST_CASE("Outbound queue", "[smtp][queue]") {
+    const auto spool = std::filesystem::temp_directory_path() / "email_server_test" /
+                       ("queue" + std::to_string(std::chrono::system_clock::now().time_since_epoch().count()));
+
+    std::vector<std::vector<std::string>> calls;
+    std::string bounce;
+    auto deliver = [&](const std::string&, const std::vector<std::string>& recipients,
+                       const std::string& content) {
+        calls.push_back(recipients);
+        std::vector<DeliveryResult> results(recipients.size());
+        for (size_t i = 0; i < recipients.size(); ++i) {
+            const auto& recipient = recipients[i];
+            if (recipient.ends_with("@bad.example")) {
+                results[i].reply_code = 550;
+                results[i].error = "550 No such user";
+            } else if (recipient.ends_with("@slow.example")) {
+                results[i].error = "Connection timed out";
+            } else {
+                results[i].success = true;
+                if (recipient == "alice@local.test") bounce = content;
+            }
+        }
+        return results;
+    };
+
+    OutboundQueue::Options options;
+    options.retry_interval = std::chrono::hours(1);
+    options.max_retries = 1;
+
+    {
+        OutboundQueue queue(spool, options, deliver);
+        REQUIRE(queue.open());
+        auto id = queue.enqueue("alice@local.test",
+                                {"a@good.example", "b@good.example", "c@slow.example",
+                                 "d@bad.example"},
+                                "Subject: Hi\r\n\r\nBody\r\n");
+        REQUIRE(id.has_value());
+        REQUIRE(queue.pending() == 3);
+
+        // Good and bad are done, the bounce for bad is sent, slow waits.
+        REQUIRE(queue.run_due() == 4);
+        REQUIRE(calls[0] == std::vector<std::string>{"a@good.example", "b@good.example"});
+        REQUIRE(bounce.find("<d@bad.example>: 550 No such user") != std::string::npos);
+        REQUIRE(bounce.find("Subject: Hi") != std::string::npos);
+        REQUIRE(queue.pending() == 1);
+    }
+
+    // A restart finds the deferred destination in the index.
+    OutboundQueue queue(spool, options, deliver);
+    REQUIRE(queue.open());
+    auto waiting = queue.snapshot();
+    REQUIRE(waiting.size() == 1);
+    REQUIRE(waiting[0].recipients == std::vector<std::string>{"c@slow.example"});
+    REQUIRE(waiting[0].retry_count == 1);
+    REQUIRE(waiting[0].last_error == "Connection timed out");
+    REQUIRE(queue.run_due() == 0);
+
+    // Out of retries: bounced, and the spool is empty again.
+    bounce.clear();
+    queue.flush();
+    REQUIRE(queue.run_due() == 2);
+    REQUIRE(bounce.find("<c@slow.example>: Gave up after 2 attempts") != std::string::npos);
+    REQUIRE(queue.pending() == 0);
+    REQUIRE(std::filesystem::is_empty(spool / "messages"));
+
+    std::filesystem::remove_all(spool);
+}
+
+TEST_CASE("Outbound SMTP client", "[smtp][client]") {
+    REQUIRE(SMTPClient::encode_data("a\n.b\r\nc") == "a\r\n..b\r\nc\r\n.\r\n");
+
+    // A server offering PIPELINING that rejects nobody@, noting what it is sent.
+    asio::io_context server_io;
+    tcp::acceptor acceptor(server_io, tcp::endpoint(asio::ip::make_address("127.0.0.1"), 0));
+    const uint16_t port = acceptor.local_endpoint().port();
+    size_t accepted = 0;
+    std::vector<std::string> commands;
+    std::thread server([&] {
+        tcp::socket socket(server_io);
+        acceptor.accept(socket);
+        ++accepted;
+        asio::write(socket, asio::buffer(std::string("220 mx.test ESMTP\r\n")));
+        asio::streambuf input;
+        bool in_data = false;
+        boost::system::error_code ec;
+        while (asio::read_until(socket, input, "\r\n", ec)) {
+            std::istream stream(&input);
+            std::string line;
+            std::getline(stream, line);
+            line.pop_back();
+            std::string reply;
+            if (in_data) {
+                if (line == ".") {
+                    in_data = false;
+                    reply = "250 Queued";
+                }
+            } else {
+                commands.push_back(line);
+                if (line.starts_with("EHLO")) {
+                    reply = "250-mx.test\r\n250-PIPELINING\r\n250 SIZE 1000";
+                } else if (line.starts_with("RCPT") && line.find("nobody@") != std::string::npos) {
+                    reply = "550 No such user";
+                } else if (line == "DATA") {
+                    in_data = true;
+                    reply = "354 Go ahead";
+                } else if (line == "QUIT") {
+                    reply = "221 Bye";
+                } else {
+                    reply = "250 OK";
+                }
+            }
+            if (!reply.empty()) {
+                asio::write(socket, asio::buffer(reply + "\r\n"));
+            }
+        }
+    });
+
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    std::thread io_thread([&] { io.run(); });
+    {
+        SMTPClient::Options options;
+        options.starttls = false;
+        SMTPClient client(io, options);
+
+        auto results = client.send_sync("127.0.0.1", port, "alice@local.test",
+                                        {"a@remote.test", "nobody@remote.test", "b@remote.test"},
+                                        "Subject: hi\r\n\r\nHello\r\n");
+        REQUIRE(results.size() == 3);
+        REQUIRE(results[0].success);
+        REQUIRE(results[1].reply_code == 550);
+        REQUIRE(results[2].success);
+
+        auto capabilities = client.capabilities("127.0.0.1", port);
+        REQUIRE(capabilities);
+        REQUIRE(capabilities->pipelining);
+        REQUIRE(capabilities->size_limit == 1000);
+        REQUIRE(client.idle_connections() == 1);
+
+        // The second message takes the pooled connection.
+        results = client.send_sync("127.0.0.1", port, "alice@local.test", {"c@remote.test"},
+                                   "Subject: again\r\n\r\nHello\r\n");
+        REQUIRE(results[0].success);
+        REQUIRE(client.stats().connections == 1);
+        REQUIRE(client.stats().reused == 1);
+
+        // Over the announced SIZE, refused without a connection.
+        results = client.send_sync("127.0.0.1", port, "alice@local.test", {"d@remote.test"},
+                                   std::string(2000, 'x'));
+        REQUIRE(results[0].reply_code == 552);
+        REQUIRE(client.stats().transactions == 2);
+
+        work.reset();
+        io.stop();
+        io_thread.join();
+    }
+    server.join();
+
+    REQUIRE(accepted == 1);
+    REQUIRE(std::count_if(commands.begin(), commands.end(), [](const std::string& c) {
+                return c.starts_with("MAIL FROM:<alice@local.test> SIZE=");
+            }) == 2);
+    REQUIRE(std::count_if(commands.begin(), commands.end(), [](const std::string& c) {
+                return c.starts_with("RCPT TO:");
+            }) == 4);
+}
+
+namespace {
+
+void put_name(std::vector<unsigned char>& out, const std::string& name) {
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = std::min(name.find('.', start), name.size());
+        out.push_back(static_cast<unsigned char>(dot - start));
+        out.insert(out.end(), name.begin() + start, name.begin() + dot);
+        start = dot + 1;
+    }
+    out.push_back(0);
+}
+
+void put_record(std::vector<unsigned char>& out, uint16_t type, uint32_t ttl,
+                const std::vector<unsigned char>& rdata) {
+    out.insert(out.end(), {0xC0, 0x0C, static_cast<unsigned char>(type >> 8),
+                           static_cast<unsigned char>(type), 0, 1,
+                           static_cast<unsigned char>(ttl >> 24), static_cast<unsigned char>(ttl >> 16),
+                           static_cast<unsigned char>(ttl >> 8), static_cast<unsigned char>(ttl),
+                           static_cast<unsigned char>(rdata.size() >> 8),
+                           static_cast<unsigned char>(rdata.size())});
+    out.insert(out.end(), rdata.begin(), rdata.end());
+}
+
+// Answers for a test zone: nothing for gone.test, a truncated UDP answer
+// for big.test, an address for a.mx.test and two exchangers for the rest.
+std::vector<unsigned char> answer_query(const unsigned char* query, size_t size, bool tcp) {
+    size_t end = 12;
+    std::string name;
+    while (end < size && query[end] != 0) {
+        if (!name.empty()) name += '.';
+        name.append(reinterpret_cast<const char*>(query) + end + 1, query[end]);
+        end += query[end] + 1;
+    }
+    const uint16_t type = query[end + 1] << 8 | query[end + 2];
+    end += 5;
+
+    std::vector<unsigned char> out(query, query + end);
+    out[2] = 0x81;
+    out[3] = 0x80;
+    out[11] = 0;  // No OPT back
+    uint16_t answers = 0;
+    uint16_t authority = 0;
+    if (name == "gone.test") {
+        out[3] |= 3;  // NXDOMAIN
+        std::vector<unsigned char> soa;
+        put_name(soa, "ns.test");
+        put_name(soa, "host.test");
+        soa.insert(soa.end(), {0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4, 0, 0, 0, 30});
+        put_record(out, 6, 3600, soa);
+        authority = 1;
+    } else if (name == "big.test" && !tcp) {
+        out[2] |= 0x02;  // TC
+    } else if (name == "a.mx.test") {
+        if (type == 1) {
+            put_record(out, 1, 60, {127, 0, 0, 1});
+            answers = 1;
+        }
+    } else if (type == 15) {
+        for (auto [priority, host] : {std::pair<int, std::string>{20, "b.mx.test"}, {10, "a.mx.test"}}) {
+            std::vector<unsigned char> mx = {0, static_cast<unsigned char>(priority)};
+            put_name(mx, host);
+            put_record(out, 15, 300, mx);
+            ++answers;
+        }
+    }
+    out[6] = 0;
+    out[7] = static_cast<unsigned char>(answers);
+    out[8] = 0;
+    out[9] = static_cast<unsigned char>(authority);
+    return out;
+}
+
+}  // namespace
+
+TEST_CASE("DNS resolver", "[smtp][dns]") {
+    using udp = asio::ip::udp;
+    asio::io_context server_io;
+    udp::socket server_udp(server_io, udp::endpoint(asio::ip::make_address("127.0.0.1"), 0));
+    const uint16_t port = server_udp.local_endpoint().port();
+    tcp::acceptor server_tcp(server_io, tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+    std::atomic<int> udp_queries{0};
+
+    std::array<unsigned char, 512> datagram;
+    udp::endpoint client;
+    std::function<void()> receive = [&] {
+        server_udp.async_receive_from(asio::buffer(datagram), client,
+                                      [&](const boost::system::error_code& ec, size_t n) {
+            if (ec) return;
+            ++udp_queries;
+            server_udp.send_to(asio::buffer(answer_query(datagram.data(), n, false)), client);
+            receive();
+        });
+    };
+    receive();
+    std::thread server([&] { server_io.run(); });
+    std::thread server_stream([&] {
+        tcp::socket socket(server_io);
+        server_tcp.accept(socket);
+        unsigned char length[2];
+        asio::read(socket, asio::buffer(length));
+        std::vector<unsigned char> query(length[0] << 8 | length[1]);
+        asio::read(socket, asio::buffer(query));
+        auto reply = answer_query(query.data(), query.size(), true);
+        unsigned char framed[2] = {static_cast<unsigned char>(reply.size() >> 8),
+                                   static_cast<unsigned char>(reply.size())};
+        asio::write(socket, std::array{asio::buffer(framed), asio::buffer(reply)});
+    });
+
+    asio::io_context io;
+    auto work = asio::make_work_guard(io);
+    std::thread io_thread([&] { io.run(); });
+    {
+        DNSResolver::Options options;
+        options.servers = {udp::endpoint(asio::ip::make_address("127.0.0.1"), port)};
+        DNSResolver resolver(io, options);
+
+        auto mx = resolver.lookup_sync("MX.test.", DNSResolver::Type::MX);
+        REQUIRE(mx.status == DNSAnswer::Status::Found);
+        REQUIRE(mx.exchangers.size() == 2);
+        REQUIRE(mx.exchangers[0].hostname == "a.mx.test");
+        REQUIRE(mx.exchangers[0].priority == 10);
+        REQUIRE(resolver.lookup_sync("mx.test", DNSResolver::Type::MX).exchangers.size() == 2);
+        REQUIRE(udp_queries == 1);
+
+        REQUIRE(resolver.lookup_sync("gone.test", DNSResolver::Type::MX).status ==
+                DNSAnswer::Status::NoDomain);
+        REQUIRE(resolver.lookup_sync("gone.test", DNSResolver::Type::MX).status ==
+                DNSAnswer::Status::NoDomain);
+        REQUIRE(udp_queries == 2);
+
+        auto big = resolver.lookup_sync("big.test", DNSResolver::Type::MX);
+        REQUIRE(big.exchangers.size() == 2);
+        REQUIRE(resolver.stats().truncated == 1);
+
+        auto host = resolver.lookup_sync("a.mx.test", DNSResolver::Type::Address);
+        REQUIRE(host.status == DNSAnswer::Status::Found);
+        REQUIRE(host.addresses == std::vector{asio::ip::make_address("127.0.0.1")});
+
+        // Lookups for one name at once share a query.
+        const int before = udp_queries;
+        std::vector<std::future<DNSAnswer>> lookups;
+        for (int i = 0; i < 5; ++i) {
+            lookups.push_back(asio::co_spawn(io, resolver.lookup("other.test", DNSResolver::Type::MX),
+                                             asio::use_future));
+        }
+        for (auto& lookup : lookups) {
+            REQUIRE(lookup.get().exchangers.size() == 2);
+        }
+        REQUIRE(udp_queries == before + 1);
+
+        auto stats = resolver.stats();
+        REQUIRE(stats.hits == 2);
+        REQUIRE(stats.coalesced == 4);
+        REQUIRE(stats.failures == 0);
+        REQUIRE(resolver.cached() == 5);
+
+        // Nothing listening: a failure, and not remembered.
+        options.servers = {udp::endpoint(asio::ip::make_address("127.0.0.1"), 9)};
+        options.timeout = std::chrono::milliseconds(200);
+        options.attempts = 1;
+        DNSResolver unreachable(io, options);
+        REQUIRE(unreachable.lookup_sync("mx.test", DNSResolver::Type::MX).status ==
+                DNSAnswer::Status::Failed);
+        REQUIRE(unreachable.cached() == 0);
+
+        work.reset();
+        io_thread.join();
+    }
+    server_io.stop();
+    server.join();
+    server_stream.join();
+}
@@ -1,8 +1,37 @@
 #include <catch2/catch_test_macros.hpp>
 #include "auth/authenticator.hpp"
+#include "storage/compression.hpp"
+#include "storage/group_commit.hpp"
 #include "storage/maildir.hpp"
 #include "config.hpp"
+#include "logger.hpp"
+#include "metrics.hpp"
+#include "net/coro_session.hpp"
+#include "net/line_scanner.hpp"
+#include "net/metrics_exporter.hpp"
+#include "net/reactor.hpp"
+#include "net/server.hpp"
+#include "net/session.hpp"
+#include "net/session_registry.hpp"
+#include "net/stream_codec.hpp"
+#include "ssl_context.hpp"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef ENABLE_TLS
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
 
 using namespace email;
 
@@ -58,6 +87,44 @@ TEST_CASE("Authenticator integration", "[integration][auth]") {
         REQUIRE_FALSE(auth.authenticate("alice@test.com", "pass1"));
     }
 
+    SECTION("Verified credential cache") {
+        REQUIRE(auth.create_user("carol", "first", "example.com"));
+        REQUIRE(auth.authenticate("carol@example.com", "first"));
+        REQUIRE(auth.authenticate("carol@example.com", "first"));  // From the cache
+        REQUIRE_FALSE(auth.authenticate("carol@example.com", "First"));
+
+        // A changed password or a disabled account is not answered from
+        // the cache.
+        REQUIRE(auth.change_password("carol@example.com", "second"));
+        REQUIRE_FALSE(auth.authenticate("carol@example.com", "first"));
+        REQUIRE(auth.authenticate("carol@example.com", "second"));
+        REQUIRE(auth.set_user_active("carol@example.com", false));
+        REQUIRE_FALSE(auth.authenticate("carol@example.com", "second"));
+        REQUIRE(auth.set_user_active("carol@example.com", true));
+
+        auth.set_credential_cache_ttl(std::chrono::seconds(0));
+        REQUIRE(auth.authenticate("carol@example.com", "second"));
+    }
+
+    SECTION("Asynchronous verification") {
+        REQUIRE(auth.create_user("dave", "secret", "example.com"));
+        std::mutex mutex;
+        std::condition_variable done;
+        std::vector<bool> results;
+        const std::vector<std::string> attempts = {"secret", "wrong", "secret", "Secret"};
+        for (const auto& password : attempts) {
+            auth.authenticate_async("dave@example.com", password, [&](bool valid) {
+                std::lock_guard lock(mutex);
+                results.push_back(valid);
+                done.notify_one();
+            });
+        }
+        std::unique_lock lock(mutex);
+        REQUIRE(done.wait_for(lock, std::chrono::seconds(60),
+                              [&] { return results.size() == attempts.size(); }));
+        REQUIRE(std::count(results.begin(), results.end(), true) == 2);
+    }
+
     SECTION("Domain management") {
         auth.create_domain("domain1.com");
         auth.create_domain("domain2.com");
@@ -72,6 +139,56 @@ TEST_CASE("Authenticator integration", "[integration][auth]") {
         // Domain should still exist but be inactive
     }
 
+    SECTION("Cached records follow writes") {
+        REQUIRE_FALSE(auth.get_user("erin@example.org"));  // A cached miss
+        REQUIRE_FALSE(auth.is_local_domain("example.org"));
+        REQUIRE(auth.create_user("erin", "pw", "example.org"));
+        REQUIRE(auth.get_user("erin@example.org"));
+        REQUIRE(auth.is_local_domain("example.org"));
+
+        REQUIRE(auth.update_quota("erin@example.org", 1234));
+        REQUIRE(auth.get_user("erin@example.org")->quota_bytes == 1234);
+        REQUIRE(auth.set_domain_active("example.org", false));
+        REQUIRE_FALSE(auth.is_local_domain("example.org"));
+
+        REQUIRE(auth.delete_domain("example.org"));
+        REQUIRE_FALSE(auth.get_user("erin@example.org"));
+        REQUIRE_FALSE(auth.update_quota("erin@example.org", 1));
+    }
+
+    SECTION("Writes by another process are picked up") {
+        REQUIRE(auth.create_user("frank", "pw", "example.net"));
+        REQUIRE(auth.get_user("frank@example.net")->active);
+
+        Authenticator other(db_path);
+        REQUIRE(other.initialize());
+        REQUIRE(other.set_user_active("frank@example.net", false));
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        REQUIRE_FALSE(auth.get_user("frank@example.net")->active);
+    }
+
+    SECTION("Concurrent lookups share the reader pool") {
+        for (int i = 0; i < 8; ++i) {
+            REQUIRE(auth.create_user("user" + std::to_string(i), "pw", "pool.com"));
+        }
+        std::atomic<int> found{0};
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 8; ++t) {
+            threads.emplace_back([&] {
+                for (int i = 0; i < 50; ++i) {
+                    if (auth.list_users("pool.com").size() == 8 &&
+                        auth.get_user("user" + std::to_string(i % 8) + "@pool.com")) {
+                        ++found;
+                    }
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        REQUIRE(found == 8 * 50);
+    }
+
     SECTION("Email parsing") {
         auto [user1, domain1] = Authenticator::parse_email("user@domain.com");
         REQUIRE(user1 == "user");
@@ -107,6 +224,12 @@ TEST_CASE("Maildir integration", "[integration][maildir]") {
         auto content = maildir.get_message_content(id);
         REQUIRE(content.has_value());
         REQUIRE(content->find("Test Message") != std::string::npos);
+
+        std::string flagged = maildir.deliver(message, "INBOX", {'F', 'S'});
+        auto stored = maildir.get_message(flagged);
+        REQUIRE(stored.has_value());
+        REQUIRE_FALSE(stored->is_new);
+        REQUIRE(stored->flags == std::set<char>{'F', 'S'});
     }
 
     SECTION("Mailbox operations") {
@@ -200,6 +323,38 @@ TEST_CASE("Maildir integration", "[integration][maildir]") {
         messages = maildir.list_messages();
         REQUIRE(messages.size() == 3);
     }
+
+    SECTION("Concurrent deliveries share directory syncs") {
+        auto& commit = GroupCommit::instance();
+        const uint64_t syncs_before = commit.syncs();
+        const uint64_t requests_before = commit.requests();
+
+        std::vector<std::vector<std::string>> ids(4);
+        std::vector<std::thread> writers;
+        for (auto& thread_ids : ids) {
+            writers.emplace_back([&temp, &thread_ids] {
+                Maildir writer(temp.path(), "example.com", "testuser");
+                for (int i = 0; i < 25; ++i) {
+                    thread_ids.push_back(writer.deliver("Subject: Burst\r\n\r\n"));
+                }
+            });
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+
+        std::set<std::string> unique;
+        for (const auto& thread_ids : ids) {
+            for (const auto& id : thread_ids) {
+                REQUIRE_FALSE(id.empty());
+                unique.insert(id);
+            }
+        }
+        REQUIRE(unique.size() == 100);
+        REQUIRE(maildir.list_messages().size() == 100);
+        REQUIRE(commit.requests() - requests_before == 100);
+        REQUIRE(commit.syncs() - syncs_before <= 100);
+    }
 }
 
 TEST_CASE("Configuration loading", "[integration][config]") {
@@ -235,12 +390,17 @@ TEST_CASE("Configuration loading", "[integration][config]") {
              << "port = 143\n"
              << "tls_port = 993\n"
              << "\n"
+             << "[daemon]\n"
+             << "pop3 = false\n"
+             << "io_threads = 6\n"
+             << "metrics_port = 9100\n"
+             << "\n"
              << "[log]\n"
              << "level = info\n"
              << "console = true\n";
     }
 
-    Config config;
+    Config& config = Config::instance();
     REQUIRE(config.load(config_path));
 
     SECTION("TLS configuration") {
@@ -274,6 +434,728 @@ TEST_CASE("Configuration loading", "[integration][config]") {
         REQUIRE(config.imap().port == 143);
         REQUIRE(config.imap().tls_port == 993);
     }
+
+    SECTION("Single-process configuration") {
+        REQUIRE(config.daemon().smtp);
+        REQUIRE_FALSE(config.daemon().pop3);
+        REQUIRE(config.daemon().imap);
+        REQUIRE(config.daemon().io_threads == 6);
+        REQUIRE(config.daemon().metrics_port == 9100);
+    }
+}
+
+TEST_CASE("Mailbox index", "[integration][maildir]") {
+    TempDirectory temp;
+    Maildir maildir(temp.path(), "example.com", "indexuser");
+    REQUIRE(maildir.initialize());
+    auto inbox = maildir.path();
+
+    std::string first = maildir.deliver("Subject: One\r\n\r\nBody");
+    auto messages = maildir.list_messages();
+    REQUIRE(messages.size() == 1);
+    REQUIRE(std::filesystem::exists(inbox / MailboxIndex::file_name));
+    uint32_t first_uid = messages[0].uid;
+    REQUIRE(first_uid != 0);
+
+    SECTION("Own changes are applied in place") {
+        std::string second = maildir.deliver("Subject: Two\r\n\r\nLonger body");
+        REQUIRE(maildir.add_flags(first, {'S', 'F'}));
+
+        // A fresh instance sees the same records, UIDs included.
+        Maildir other(temp.path(), "example.com", "indexuser");
+        messages = other.list_messages();
+        REQUIRE(messages.size() == 2);
+        auto one = std::find_if(messages.begin(), messages.end(),
+                                [&](const Message& m) { return m.unique_id == first; });
+        auto two = std::find_if(messages.begin(), messages.end(),
+                                [&](const Message& m) { return m.unique_id == second; });
+        REQUIRE(one != messages.end());
+        REQUIRE(two != messages.end());
+        REQUIRE(one->uid == first_uid);
+        REQUIRE(two->uid > first_uid);
+        REQUIRE(one->flags == std::set<char>{'F', 'S'});
+        REQUIRE_FALSE(one->is_new);
+        REQUIRE(std::filesystem::exists(one->path));
+        REQUIRE(two->is_new);
+        REQUIRE(two->size == std::string("Subject: Two\r\n\r\nLonger body").size());
+
+        auto info = other.get_mailbox_info("INBOX");
+        REQUIRE(info->total_messages == 2);
+        REQUIRE(info->unseen_messages == 1);
+        REQUIRE(info->recent_messages == 1);
+
+        REQUIRE(maildir.delete_message(second));
+        REQUIRE(other.list_messages().size() == 1);
+    }
+
+    SECTION("Changes raise mod-sequences and removals are logged") {
+        const uint64_t delivered = messages[0].modseq;
+        REQUIRE(delivered != 0);
+        REQUIRE(maildir.get_mailbox_info("INBOX")->highest_modseq == delivered);
+
+        std::string second = maildir.deliver("Subject: Two\r\n\r\nBody");
+        REQUIRE(maildir.add_flags(first, {'S'}));
+        const std::string ids[] = {first, second};
+        auto modseqs = maildir.get_modseqs(ids);
+        REQUIRE(modseqs[1] > delivered);
+        REQUIRE(modseqs[0] > modseqs[1]);
+        const uint32_t second_uid = maildir.list_messages().back().uid;
+
+        // Another instance reads the log; a removal behind the index's back
+        // is logged by the sync that finds it.
+        REQUIRE(maildir.delete_message(second));
+        std::filesystem::remove(maildir.get_message(first)->path);
+        Maildir other(temp.path(), "example.com", "indexuser");
+        REQUIRE(other.list_messages().empty());
+        REQUIRE(*other.vanished_since(modseqs[0]) == std::vector<uint32_t>{first_uid, second_uid});
+        REQUIRE(other.get_mailbox_info("INBOX")->highest_modseq > modseqs[0]);
+        // The index was created just before the first delivery.
+        REQUIRE(other.vanished_since(delivered - 1));
+        REQUIRE_FALSE(other.vanished_since(delivered - 2));
+    }
+
+    SECTION("Changes made behind its back are picked up") {
+        std::ofstream(inbox / "cur" / "1700000000.external.host:2,S") << "Subject: Ext\r\n\r\n";
+        std::filesystem::remove(messages[0].path);
+
+        messages = maildir.list_messages();
+        REQUIRE(messages.size() == 1);
+        REQUIRE(messages[0].unique_id == "1700000000.external.host");
+        REQUIRE(messages[0].is_seen());
+        REQUIRE(messages[0].uid > first_uid);
+    }
+
+    SECTION("Lookups match the whole unique id and follow renames") {
+        REQUIRE_FALSE(maildir.get_message(first.substr(0, first.size() - 1)));
+        REQUIRE(maildir.get_message(first)->is_new);
+
+        std::filesystem::rename(inbox / "new" / first, inbox / "cur" / (first + ":2,S"));
+        auto msg = maildir.get_message(first);
+        REQUIRE(msg);
+        REQUIRE_FALSE(msg->is_new);
+        REQUIRE(msg->is_seen());
+
+        REQUIRE(maildir.set_flags(first, {'F'}));
+        REQUIRE(maildir.get_message(first)->flags == std::set<char>{'F'});
+        REQUIRE(maildir.delete_message(first));
+        REQUIRE_FALSE(maildir.get_message(first));
+    }
+
+    SECTION("Flag changes are applied as one batch") {
+        std::string second = maildir.deliver("Subject: Two\r\n\r\n");
+        REQUIRE(maildir.set_flags(second, {'F'}));
+
+        std::vector<FlagChange> changes{
+            {first, FlagChange::Mode::Add, {'S'}},
+            {second, FlagChange::Mode::Add, {'S'}},
+            {second, FlagChange::Mode::Remove, {'F'}},
+            {"no.such.message", FlagChange::Mode::Add, {'S'}},
+        };
+        auto results = maildir.apply_flags(changes);
+        REQUIRE(results.size() == 4);
+        REQUIRE(results[0] == std::set<char>{'S'});
+        REQUIRE(results[1] == std::set<char>{'F', 'S'});
+        REQUIRE(results[2] == std::set<char>{'S'});
+        REQUIRE_FALSE(results[3]);
+
+        // The index agrees with the files, also for a fresh instance.
+        Maildir other(temp.path(), "example.com", "indexuser");
+        for (const auto& msg : other.list_messages()) {
+            REQUIRE(msg.flags == std::set<char>{'S'});
+            REQUIRE_FALSE(msg.is_new);
+            REQUIRE(std::filesystem::exists(msg.path));
+        }
+        REQUIRE(other.get_mailbox_info("INBOX")->unseen_messages == 0);
+    }
+
+    SECTION("Copies share the file and keep flags and date") {
+        std::string second = maildir.deliver("Subject: Two\r\n\r\n");
+        REQUIRE(maildir.set_flags(first, {'S', 'F'}));
+        REQUIRE(maildir.list_messages("Archive").empty());
+
+        std::vector<std::string> ids{first, "no.such.message", second};
+        auto copies = maildir.copy_messages(ids, "INBOX", "Archive");
+        REQUIRE(copies.size() == 3);
+        REQUIRE_FALSE(copies[0].empty());
+        REQUIRE(copies[1].empty());
+        REQUIRE_FALSE(copies[2].empty());
+
+        auto original = maildir.get_message(first);
+        auto copy = maildir.get_message(copies[0], "Archive");
+        REQUIRE(copy);
+        REQUIRE(copy->flags == std::set<char>{'F', 'S'});
+        REQUIRE_FALSE(copy->is_new);
+        REQUIRE(copy->timestamp == original->timestamp);
+        REQUIRE(std::filesystem::equivalent(copy->path, original->path));
+        REQUIRE(maildir.get_message_content(copies[0], "Archive") ==
+                std::string("Subject: One\r\n\r\nBody"));
+
+        // Both are in the index already, with fresh UIDs, and the copy
+        // keeps its own name when the original's flags change.
+        Maildir other(temp.path(), "example.com", "indexuser");
+        messages = other.list_messages("Archive");
+        REQUIRE(messages.size() == 2);
+        REQUIRE(messages[0].uid != 0);
+        REQUIRE(messages[1].uid == messages[0].uid + 1);
+        REQUIRE(maildir.set_flags(first, {}));
+        REQUIRE(maildir.get_message(copies[0], "Archive")->flags.size() == 2);
+    }
+
+    SECTION("Header reads stop at the blank line and are cached") {
+        // Deliveries record the offset as they write the message.
+        std::string second = maildir.deliver("Subject: Two\r\n\r\nBody");
+        REQUIRE(Maildir(temp.path(), "example.com", "indexuser").list_messages()[1].body_offset ==
+                std::string("Subject: Two\r\n\r\n").size());
+        REQUIRE(maildir.get_message_headers(second) == std::string("Subject: Two"));
+        REQUIRE(maildir.get_message_headers(first) == std::string("Subject: One"));
+
+        // Found behind its back: the first header read records the offset.
+        std::string big_body(100000, 'x');
+        std::ofstream(inbox / "cur" / "external:2,S")
+            << "From: a@example.com\nSubject: Big\n\n" << big_body;
+        Maildir other(temp.path(), "example.com", "indexuser");
+        REQUIRE(other.get_message("external")->body_offset == 0);
+        REQUIRE(other.get_message_headers("external") ==
+                std::string("From: a@example.com\nSubject: Big"));
+        Maildir fresh(temp.path(), "example.com", "indexuser");
+        REQUIRE(fresh.get_message("external")->body_offset == 34);
+        REQUIRE(fresh.get_message_headers("external") ==
+                std::string("From: a@example.com\nSubject: Big"));
+
+        auto view = fresh.map_message("external");
+        REQUIRE(view);
+        REQUIRE(view->size() == 34 + big_body.size());
+        REQUIRE(view->headers() == "From: a@example.com\nSubject: Big");
+        REQUIRE(view->body() == big_body);
+    }
+
+    SECTION("POP3 listings and tops need only the index and the first pages") {
+        const std::string content = "Subject: Two\r\n\r\nline 1\r\n.line 2\r\nline 3\r\n";
+        std::string second = maildir.deliver(content);
+        auto summaries = Maildir(temp.path(), "example.com", "indexuser").list_summaries();
+        REQUIRE(summaries.size() == 2);
+        REQUIRE(summaries[0].unique_id == first);
+        REQUIRE(summaries[0].uid == first_uid);
+        REQUIRE(summaries[1].unique_id == second);
+        REQUIRE(summaries[1].size == content.size());
+
+        REQUIRE(maildir.get_message_top(second, 0) == std::string("Subject: Two\r\n\r\n"));
+        REQUIRE(maildir.get_message_top(second, 2) ==
+                std::string("Subject: Two\r\n\r\nline 1\r\n.line 2\r\n"));
+        REQUIRE(maildir.get_message_top(second, 10) == content);
+        REQUIRE(maildir.get_message_top(first, 1) == std::string("Subject: One\r\n\r\nBody"));
+
+        // Many pages of body, and no offset cached yet.
+        std::string big_body;
+        for (int i = 0; i < 5000; ++i) {
+            big_body += "line " + std::to_string(i) + "\n";
+        }
+        std::ofstream(inbox / "cur" / "external:2,S") << "Subject: Big\n\n" << big_body;
+        Maildir other(temp.path(), "example.com", "indexuser");
+        REQUIRE(other.get_message_top("external", 3) ==
+                std::string("Subject: Big\n\nline 0\nline 1\nline 2\n"));
+    }
+
+    SECTION("Listings of the same mailbox state are shared") {
+        auto& cache = MailboxSnapshotCache::instance();
+        cache.clear();
+        Maildir phone(temp.path(), "example.com", "indexuser");
+        Maildir laptop(temp.path(), "example.com", "indexuser");
+        auto listed = phone.snapshot();
+        REQUIRE(listed->size() == 1);
+        REQUIRE(listed->unique_ids[0] == first);
+        REQUIRE(laptop.snapshot() == listed);
+        REQUIRE(cache.entries() == 1);
+
+        // A change on one side is a new state for the other.
+        REQUIRE(laptop.add_flags(first, {'S'}));
+        auto relisted = phone.snapshot();
+        REQUIRE(relisted != listed);
+        REQUIRE(relisted->flags[0] == MailboxIndex::flag_bit('S'));
+        REQUIRE(listed->flags[0] == 0);
+        REQUIRE(phone.get_message(first)->flags == std::set<char>{'S'});
+
+        cache.set_capacity(0);
+        REQUIRE(cache.entries() == 0);
+        REQUIRE(phone.snapshot()->size() == 1);
+        REQUIRE(cache.bytes() == 0);
+        cache.set_capacity(64 * 1024 * 1024);
+    }
+
+    SECTION("A move to cur/ under the same name reaches shared listings") {
+        REQUIRE(messages[0].is_new);
+        Maildir a(temp.path(), "example.com", "indexuser");
+        REQUIRE(a.snapshot()->in_new[0]);
+        REQUIRE(a.set_flags(first, {}));
+
+        Maildir c(temp.path(), "example.com", "indexuser");
+        REQUIRE_FALSE(c.snapshot()->in_new[0]);
+        REQUIRE(c.get_message(first));
+        REQUIRE(c.get_message_content(first));
+    }
+
+    SECTION("Batch deletes update the index and totals once") {
+        std::vector<std::string> ids{first, maildir.deliver("Subject: Two\r\n\r\n"),
+                                     "no.such.message"};
+        std::string kept = maildir.deliver("Subject: Three\r\n\r\n");
+        maildir.list_messages();
+        const uint64_t before = maildir.get_highest_modseq();
+        REQUIRE(maildir.delete_messages(ids) == 2);
+        REQUIRE_FALSE(maildir.get_message(first));
+
+        Maildir other(temp.path(), "example.com", "indexuser");
+        auto summaries = other.list_summaries();
+        REQUIRE(summaries.size() == 1);
+        REQUIRE(summaries[0].unique_id == kept);
+        REQUIRE(other.usage().messages == 1);
+        auto vanished = other.vanished_since(before);
+        REQUIRE(vanished);
+        REQUIRE(vanished->size() == 2);
+        REQUIRE(vanished->front() == first_uid);
+        REQUIRE(other.get_highest_modseq() == before + 1);
+    }
+
+    SECTION("A damaged index is rebuilt with the same UIDs") {
+        std::ofstream(inbox / MailboxIndex::file_name, std::ios::trunc) << "garbage";
+        Maildir other(temp.path(), "example.com", "indexuser");
+        messages = other.list_messages();
+        REQUIRE(messages.size() == 1);
+        REQUIRE(messages[0].unique_id == first);
+        REQUIRE(messages[0].uid == first_uid);
+    }
+}
+
+TEST_CASE("Persistent UIDs", "[integration][maildir]") {
+    TempDirectory temp;
+    Maildir maildir(temp.path(), "example.com", "uiduser");
+    REQUIRE(maildir.initialize());
+    auto inbox = maildir.path();
+
+    std::string first = maildir.deliver("Subject: One\r\n\r\n");
+    std::string second = maildir.deliver("Subject: Two\r\n\r\n");
+    auto info = maildir.get_mailbox_info("INBOX");
+    REQUIRE(info.has_value());
+    REQUIRE(info->uid_validity != 0);
+    REQUIRE(info->uid_next == 3);
+    REQUIRE(std::filesystem::exists(inbox / UidList::file_name));
+
+    SECTION("Reading UIDNEXT does not consume UIDs") {
+        REQUIRE(maildir.get_uid_next() == 3);
+        REQUIRE(maildir.get_mailbox_info("INBOX")->uid_next == 3);
+        REQUIRE(maildir.get_uid_validity() == info->uid_validity);
+    }
+
+    SECTION("UIDs are stable across instances and never reused") {
+        auto messages = maildir.list_messages();
+        REQUIRE(messages.size() == 2);
+        REQUIRE(messages[0].unique_id == first);
+        REQUIRE(messages[0].uid == 1);
+        REQUIRE(messages[1].uid == 2);
+
+        REQUIRE(maildir.delete_message(second));
+        std::string third = maildir.deliver("Subject: Three\r\n\r\n");
+
+        Maildir other(temp.path(), "example.com", "uiduser");
+        messages = other.list_messages();
+        REQUIRE(messages.size() == 2);
+        REQUIRE(messages[0].uid == 1);
+        REQUIRE(messages[1].unique_id == third);
+        REQUIRE(messages[1].uid == 3);
+        REQUIRE(other.get_uid_validity() == info->uid_validity);
+    }
+
+    SECTION("A message moved away and back is a new message") {
+        REQUIRE(maildir.create_mailbox("Archive"));
+        REQUIRE(maildir.move_message(first, "INBOX", "Archive"));
+        REQUIRE(maildir.list_messages("Archive").size() == 1);
+        REQUIRE(maildir.move_message(first, "Archive", "INBOX"));
+
+        auto messages = maildir.list_messages();
+        REQUIRE(messages.size() == 2);
+        REQUIRE(messages[1].unique_id == first);
+        REQUIRE(messages[1].uid == 3);
+    }
+
+    SECTION("A lost UID list is recovered from the index") {
+        std::filesystem::remove(inbox / UidList::file_name);
+        Maildir other(temp.path(), "example.com", "uiduser");
+        std::string third = other.deliver("Subject: Three\r\n\r\n");
+
+        auto messages = other.list_messages();
+        REQUIRE(messages.size() == 3);
+        REQUIRE(messages[2].unique_id == third);
+        REQUIRE(messages[2].uid == 3);
+        REQUIRE(other.get_uid_validity() == info->uid_validity);
+    }
+
+    SECTION("Losing both starts over under a new UIDVALIDITY") {
+        std::filesystem::remove(inbox / UidList::file_name);
+        std::filesystem::remove(inbox / MailboxIndex::file_name);
+        // UIDVALIDITY is a timestamp; with nothing left to compare against
+        // it can only differ once the clock has moved on.
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+        Maildir other(temp.path(), "example.com", "uiduser");
+        REQUIRE(other.list_messages().size() == 2);
+        REQUIRE(other.get_uid_validity() != info->uid_validity);
+    }
+}
+
+TEST_CASE("Mailbox change tracking", "[integration][maildir]") {
+    TempDirectory temp;
+    Maildir watched(temp.path(), "example.com", "watchuser");
+    REQUIRE(watched.initialize());
+    std::string first = watched.deliver("Subject: One\r\n\r\n");
+
+    REQUIRE(watched.watch());
+    auto messages = watched.list_messages();
+    REQUIRE(messages.size() == 1);
+    REQUIRE(watched.poll_changes().empty());
+
+    // Another process working on the same mailbox.
+    Maildir other(temp.path(), "example.com", "watchuser");
+
+    SECTION("Deliveries are reported with their UIDs") {
+        std::string second = other.deliver("Subject: Two\r\n\r\nBody");
+        auto changes = watched.poll_changes();
+        REQUIRE(changes.size() == 1);
+        REQUIRE(changes[0].kind == MailboxChange::Kind::Added);
+        REQUIRE(changes[0].message.unique_id == second);
+        REQUIRE(changes[0].message.uid > messages[0].uid);
+        REQUIRE(changes[0].message.is_new);
+        REQUIRE(changes[0].message.size == std::string("Subject: Two\r\n\r\nBody").size());
+        REQUIRE(watched.poll_changes().empty());
+        REQUIRE(watched.get_message(second));
+    }
+
+    SECTION("Flag changes and removals are reported, our own are not") {
+        REQUIRE(other.add_flags(first, {'S'}));
+        auto changes = watched.poll_changes();
+        REQUIRE(changes.size() == 1);
+        REQUIRE(changes[0].kind == MailboxChange::Kind::FlagsChanged);
+        REQUIRE(changes[0].message.flags == std::set<char>{'S'});
+        REQUIRE(changes[0].message.uid == messages[0].uid);
+
+        REQUIRE(watched.add_flags(first, {'F'}));
+        REQUIRE(watched.poll_changes().empty());
+
+        REQUIRE(other.delete_message(first));
+        changes = watched.poll_changes();
+        REQUIRE(changes.size() == 1);
+        REQUIRE(changes[0].kind == MailboxChange::Kind::Removed);
+        REQUIRE(changes[0].message.unique_id == first);
+        REQUIRE(changes[0].message.uid == messages[0].uid);
+        REQUIRE_FALSE(watched.get_message(first));
+    }
+
+    SECTION("Changes found by a lookup wait for the next poll") {
+        std::string second = other.deliver("Subject: Two\r\n\r\n");
+        REQUIRE(watched.get_message(second));
+        auto changes = watched.poll_changes();
+        REQUIRE(changes.size() == 1);
+        REQUIRE(changes[0].message.unique_id == second);
+    }
+
+    SECTION("Changes in this process are published") {
+        int inbox = 0;
+        int sent = 0;
+        auto inbox_subscription = watched.subscribe("INBOX", [&inbox] { ++inbox; });
+        auto sent_subscription = watched.subscribe("Sent", [&sent] { ++sent; });
+        REQUIRE(other.create_mailbox("Sent"));
+
+        std::string second = other.deliver("Subject: Two\r\n\r\n");
+        REQUIRE(inbox == 1);
+        REQUIRE(other.add_flags(second, {'S'}));
+        REQUIRE(inbox == 2);
+        REQUIRE(other.add_flags(second, {'S'}));  // No change, no news
+        REQUIRE(inbox == 2);
+        REQUIRE(other.copy_message(second, "INBOX", "Sent"));
+        REQUIRE(inbox == 2);
+        REQUIRE(sent == 1);
+        REQUIRE(other.delete_message(first));
+        REQUIRE(inbox == 3);
+
+        inbox_subscription.reset();
+        other.deliver("Subject: Three\r\n\r\n");
+        REQUIRE(inbox == 3);
+        REQUIRE(MailboxEvents::instance().subscribers() == 1);
+    }
+}
+
+TEST_CASE("Storage usage accounting", "[integration][maildir]") {
+    TempDirectory temp;
+    Maildir maildir(temp.path(), "example.com", "quotauser");
+    REQUIRE(maildir.initialize());
+    const std::string body = "Subject: Usage\r\n\r\n0123456789";
+    std::string first = maildir.deliver(body);
+
+    // The first read counts the mailboxes; later changes are appended.
+    auto usage = maildir.usage();
+    REQUIRE(usage.messages == 1);
+    REQUIRE(usage.bytes == body.size());
+    REQUIRE(std::filesystem::exists(maildir.path() / UsageFile::file_name));
+
+    SECTION("Deliveries, copies and deletions keep the totals current") {
+        std::string second = maildir.deliver(body, "Sent");
+        REQUIRE(maildir.copy_message(first, "INBOX", "Drafts"));
+        REQUIRE(maildir.move_message(second, "Sent", "Trash"));
+        REQUIRE(maildir.usage().messages == 3);
+        REQUIRE(maildir.usage().bytes == 3 * body.size());
+
+        REQUIRE(maildir.add_flags(first, {'T'}));
+        REQUIRE(maildir.expunge() == 1);
+        REQUIRE(maildir.delete_mailbox("Drafts"));
+        Maildir other(temp.path(), "example.com", "quotauser");
+        REQUIRE(other.usage().messages == 1);
+        REQUIRE(other.get_total_size() == body.size());
+        REQUIRE(other.reconcile_usage().bytes == body.size());
+    }
+
+    SECTION("Reconciliation corrects drift") {
+        // Delivered behind Maildir's back, then noticed by a recount.
+        std::ofstream(maildir.path() / "cur" / "external:2,S") << body;
+        REQUIRE(maildir.usage().messages == 1);
+        auto recounted = maildir.reconcile_usage();
+        REQUIRE(recounted.messages == 2);
+        REQUIRE(recounted.bytes == 2 * body.size());
+        REQUIRE(recounted.reconciled_at > 0);
+        REQUIRE(maildir.usage().messages == 2);
+    }
+
+    SECTION("Many changes are folded into the totals") {
+        for (int i = 0; i < 400; ++i) {
+            REQUIRE(maildir.delete_message(maildir.deliver(body)));
+        }
+        REQUIRE(std::filesystem::file_size(maildir.path() / UsageFile::file_name) < 8192);
+        REQUIRE(maildir.usage().messages == 1);
+        REQUIRE(maildir.usage().bytes == body.size());
+    }
+}
+
+TEST_CASE("Compressed storage", "[integration][maildir]") {
+    if (!compression::available()) {
+        SUCCEED("Built without ENABLE_COMPRESSION");
+        return;
+    }
+    struct LevelGuard {
+        ~LevelGuard() { Maildir::set_compression_level(0); }
+    } guard;
+
+    TempDirectory temp;
+    Maildir maildir(temp.path(), "example.com", "zuser");
+    REQUIRE(maildir.initialize());
+    std::string content = "Subject: Report\r\n\r\n";
+    for (int i = 0; i < 500; ++i) {
+        content += "Line " + std::to_string(i % 10) + " of a very repetitive report\r\n";
+    }
+    auto stored_bytes = [&](const std::string& unique_id) {
+        return std::filesystem::file_size(maildir.get_message(unique_id)->path);
+    };
+
+    SECTION("Deliveries are compressed and read back transparently") {
+        Maildir::set_compression_level(3);
+        std::string id = maildir.deliver(content);
+        REQUIRE(maildir.deliver("Subject: Short\r\n\r\nHi") != "");
+        REQUIRE(stored_bytes(id) < content.size() / 4);
+
+        Maildir other(temp.path(), "example.com", "zuser");
+        auto listed = other.list_messages();
+        auto report = std::find_if(listed.begin(), listed.end(),
+                                   [&](const Message& msg) { return msg.unique_id == id; });
+        REQUIRE(report != listed.end());
+        REQUIRE(report->size == content.size());
+        REQUIRE(other.get_message(id)->size == content.size());
+        REQUIRE(other.get_message_content(id) == content);
+        REQUIRE(other.get_message_headers(id) == std::string("Subject: Report"));
+        REQUIRE(other.usage().bytes == content.size() + 20);
+
+        auto file = OutboundFile::open(other.get_message(id)->path);
+        REQUIRE(file);
+        REQUIRE(file->compressed());
+        REQUIRE(file->size() == content.size());
+        std::string tail(100, '\0');
+        REQUIRE(file->read(content.size() - 100, tail.data(), tail.size()) == 100);
+        REQUIRE(tail == content.substr(content.size() - 100));
+        std::string head(15, '\0');
+        REQUIRE(file->read(0, head.data(), head.size()) == 15);
+        REQUIRE(head == "Subject: Report");
+    }
+
+    SECTION("Existing messages are recompressed in place") {
+        std::string id = maildir.deliver(content);
+        REQUIRE(maildir.add_flags(id, {'S'}));
+        const uint32_t uid = maildir.list_messages()[0].uid;
+        REQUIRE(stored_bytes(id) == content.size());
+
+        REQUIRE(maildir.recompress(100) == 0);  // Compression is off
+        Maildir::set_compression_level(3);
+        REQUIRE(maildir.recompress(100) == 1);
+        REQUIRE(maildir.recompress(100) == 0);  // Already looked at
+        REQUIRE(std::filesystem::exists(maildir.path() / "email.recompress"));
+
+        Maildir other(temp.path(), "example.com", "zuser");
+        auto messages = other.list_messages();
+        REQUIRE(messages.size() == 1);
+        REQUIRE(messages[0].unique_id == id);
+        REQUIRE(messages[0].uid == uid);
+        REQUIRE(messages[0].is_seen());
+        REQUIRE(other.get_message_content(id) == content);
+        REQUIRE(stored_bytes(id) < content.size() / 4);
+        REQUIRE(std::filesystem::is_empty(maildir.path() / "tmp"));
+    }
+}
+
+TEST_CASE("Message structure cache", "[integration][maildir]") {
+    TempDirectory temp;
+    Maildir maildir(temp.path(), "example.com", "suser");
+    REQUIRE(maildir.initialize());
+    const std::string content =
+        "From: Alice <alice@example.com>\r\n"
+        "To: bob@example.com\r\n"
+        "Subject: Pictures\r\n"
+        "Content-Type: multipart/mixed; boundary=\"XYZ\"\r\n"
+        "\r\n"
+        "--XYZ\r\n"
+        "Content-Type: text/plain; charset=utf-8\r\n"
+        "\r\n"
+        "Hello\r\nthere\r\n"
+        "--XYZ\r\n"
+        "Content-Type: message/rfc822\r\n"
+        "\r\n"
+        "Subject: Inner\r\n"
+        "\r\n"
+        "Inner body\r\n"
+        "--XYZ--\r\n";
+
+    SECTION("Parts are located by offset") {
+        auto structure = MessageStructure::parse(content);
+        REQUIRE(structure.envelope.from == "Alice <alice@example.com>");
+        REQUIRE(structure.envelope.subject == "Pictures");
+        REQUIRE(structure.body.is_multipart());
+        REQUIRE(structure.body.subtype == "mixed");
+        REQUIRE(structure.body.parts.size() == 2);
+
+        const auto& text = structure.body.parts[0];
+        REQUIRE(text.params[0] == std::make_pair(std::string("charset"), std::string("utf-8")));
+        REQUIRE(content.substr(text.body_offset, text.size()) == "Hello\r\nthere");
+        REQUIRE(text.lines == 1);
+
+        const auto& inner = structure.body.parts[1];
+        REQUIRE(inner.is_message());
+        REQUIRE(inner.envelope.subject == "Inner");
+        REQUIRE(content.substr(inner.parts[0].body_offset, inner.parts[0].size()) == "Inner body");
+
+        auto copy = MessageStructure::deserialize(structure.serialize());
+        REQUIRE(copy);
+        REQUIRE(copy->body.parts[1].parts[0].body_offset == inner.parts[0].body_offset);
+        REQUIRE_FALSE(MessageStructure::deserialize("garbage"));
+    }
+
+    SECTION("Delivery fills the cache for other instances") {
+        std::string id = maildir.deliver(content);
+        REQUIRE(std::filesystem::exists(maildir.path() / StructureCache::file_name));
+        auto path = maildir.get_message(id)->path;
+
+        Maildir other(temp.path(), "example.com", "suser");
+        std::filesystem::rename(path, path.string() + ".away");  // Only the cache can answer
+        auto structure = other.get_message_structure(id);
+        REQUIRE(structure);
+        REQUIRE(structure->body.parts.size() == 2);
+        std::filesystem::rename(path.string() + ".away", path);
+    }
+
+    SECTION("Structures of expunged messages are dropped") {
+        std::vector<std::string> ids;
+        for (int i = 0; i < 80; ++i) {
+            ids.push_back(maildir.deliver(content));
+        }
+        const auto cache = maildir.path() / StructureCache::file_name;
+        const auto full_size = std::filesystem::file_size(cache);
+
+        for (size_t i = 1; i < ids.size(); ++i) {
+            REQUIRE(maildir.delete_message(ids[i]));
+        }
+        maildir.prune_caches();
+        REQUIRE(std::filesystem::file_size(cache) < full_size / 40);
+        REQUIRE(maildir.get_message_structure(ids[0]));
+
+        // Instances holding the old file move over to the new one.
+        REQUIRE(maildir.deliver(content) != "");
+        Maildir other(temp.path(), "example.com", "suser");
+        REQUIRE(other.get_message_structure(ids[0])->envelope.subject == "Pictures");
+    }
+}
+
+TEST_CASE("Search index", "[integration][maildir]") {
+    TempDirectory temp;
+    Maildir maildir(temp.path(), "example.com", "fuser");
+    REQUIRE(maildir.initialize());
+    const std::string first = maildir.deliver(
+        "From: Alice Example <alice@example.com>\r\n"
+        "To: bob@example.org\r\n"
+        "Subject: =?utf-8?Q?Quarterly_report?=\r\n"
+        "Date: Tue, 3 Feb 2026 09:30:00 +0100\r\n"
+        "X-Priority: 1\r\n"
+        "Content-Transfer-Encoding: quoted-printable\r\n"
+        "\r\n"
+        "Revenue is up=2C costs are do=\r\nwn.\r\n");
+    const std::string second = maildir.deliver(
+        "From: carol@example.net\r\n"
+        "Subject: Lunch\r\n"
+        "Content-Type: text/html\r\n"
+        "\r\n"
+        "<p class=\"revenue\">Pizza on Friday</p>\r\n");
+
+    auto docs_of = [](SearchIndex& index, std::initializer_list<std::string_view> fields,
+                      std::string_view text) {
+        auto docs = index.lookup(fields, text);
+        REQUIRE(docs);
+        return docs->size();
+    };
+
+    SECTION("Delivered messages are indexed by word") {
+        auto& index = maildir.prepare_search({first, second});
+        REQUIRE(index.find(first));
+        REQUIRE(docs_of(index, {""}, "revenue") == 1);  // Not the HTML attribute
+        REQUIRE(docs_of(index, {""}, "cost down") == 1);
+        REQUIRE(docs_of(index, {""}, "piz") == 1);      // Words match by prefix
+        REQUIRE(docs_of(index, {"*"}, "quarterly") == 1);
+        REQUIRE(docs_of(index, {"x-priority"}, "1") == 1);
+        REQUIRE(index.postings("x-priority:").size() == 1);
+        REQUIRE_FALSE(index.lookup({""}, "?!"));
+
+        const auto& doc = index.document(*index.find(first));
+        REQUIRE(doc.subject == "Quarterly report");
+        REQUIRE(doc.from == "Alice Example <alice@example.com>");
+        REQUIRE(doc.sent_day == 20487);  // 2026-02-03
+    }
+
+    SECTION("Messages delivered elsewhere are indexed on first search") {
+        std::ofstream(maildir.path() / "new" / "1700000000.other.host") << "Subject: Hello\r\n\r\nworld\r\n";
+        Maildir other(temp.path(), "example.com", "fuser");
+        std::vector<std::string> ids;
+        for (const auto& msg : other.list_messages()) {
+            ids.push_back(msg.unique_id);
+        }
+        REQUIRE(ids.size() == 3);
+        auto& index = other.prepare_search(ids);
+        REQUIRE(index.find("1700000000.other.host"));
+        REQUIRE(docs_of(index, {""}, "world") == 1);
+        REQUIRE(docs_of(index, {""}, "revenue") == 1);  // Read from the first instance's file
+    }
+
+    SECTION("Documents of expunged messages are dropped") {
+        for (int i = 0; i < 70; ++i) {
+            REQUIRE(maildir.delete_message(maildir.deliver("Subject: Spam\r\n\r\nspam\r\n")));
+        }
+        const auto path = maildir.path() / SearchIndex::file_name;
+        const auto before = std::filesystem::file_size(path);
+        maildir.prune_caches();
+        REQUIRE(std::filesystem::file_size(path) < before / 4);
+
+        auto& index = maildir.prepare_search({first, second});
+        REQUIRE(docs_of(index, {""}, "spam") == 0);
+        REQUIRE(docs_of(index, {""}, "revenue") == 1);
+    }
 }
 
 TEST_CASE("Full email flow simulation", "[integration][flow]") {
@@ -367,3 +1249,981 @@ TEST_CASE("Full email flow simulation", "[integration][flow]") {
         REQUIRE(archive.size() == 1);
     }
 }
+
+TEST_CASE("Line splitting", "[integration][net]") {
+    std::vector<std::string_view> lines;
+
+    SECTION("CRLF and bare LF terminators are stripped") {
+        std::string input = "A001 NOOP\r\nA002 LOGOUT\nA003 partial";
+        size_t consumed = split_lines(input, lines);
+        REQUIRE(lines.size() == 2);
+        REQUIRE(lines[0] == "A001 NOOP");
+        REQUIRE(lines[1] == "A002 LOGOUT");
+        REQUIRE(input.substr(consumed) == "A003 partial");
+    }
+
+    SECTION("Empty lines and lines longer than a vector register") {
+        std::string long_line(200, 'x');
+        std::string input = "\r\n" + long_line + "\r\n.\r\n";
+        size_t consumed = split_lines(input, lines);
+        REQUIRE(consumed == input.size());
+        REQUIRE(lines.size() == 3);
+        REQUIRE(lines[0].empty());
+        REQUIRE(lines[1] == long_line);
+        REQUIRE(lines[2] == ".");
+    }
+
+    SECTION("Every newline position in a 64-byte block is found") {
+        for (size_t pos = 0; pos < 130; ++pos) {
+            std::string input(130, 'a');
+            input[pos] = '\n';
+            lines.clear();
+            size_t consumed = split_lines(input, lines);
+            REQUIRE(lines.size() == 1);
+            REQUIRE(lines[0].size() == pos);
+            REQUIRE(consumed == pos + 1);
+        }
+    }
+
+    SECTION("Clean prefix skips bytes already scanned") {
+        std::string input = "0123456789abcdef0123456789\r\nnext";
+        size_t consumed = split_lines(input, lines, 20);
+        REQUIRE(lines.size() == 1);
+        REQUIRE(lines[0] == "0123456789abcdef0123456789");
+        REQUIRE(consumed == 28);
+    }
+}
+
+TEST_CASE("Session registry", "[integration][net]") {
+    struct FakeSession {
+        int id;
+    };
+
+    SessionRegistry<FakeSession> registry(4);
+
+    SECTION("Reservations respect the limit") {
+        REQUIRE(registry.try_reserve(2));
+        REQUIRE(registry.try_reserve(2));
+        REQUIRE_FALSE(registry.try_reserve(2));
+        registry.release();
+        REQUIRE(registry.size() == 1);
+        REQUIRE(registry.try_reserve(2));
+    }
+
+    SECTION("Add, remove and iterate") {
+        std::vector<std::shared_ptr<FakeSession>> sessions;
+        for (int i = 0; i < 50; ++i) {
+            REQUIRE(registry.try_reserve(100));
+            sessions.push_back(std::make_shared<FakeSession>(FakeSession{i}));
+            registry.add(sessions.back());
+        }
+        REQUIRE(registry.size() == 50);
+
+        REQUIRE(registry.remove(sessions[7].get()) == sessions[7]);
+        REQUIRE(registry.remove(sessions[7].get()) == nullptr);
+        REQUIRE(registry.size() == 49);
+
+        int visited = 0;
+        int id_sum = 0;
+        registry.for_each([&](const std::shared_ptr<FakeSession>& session) {
+            ++visited;
+            id_sum += session->id;
+        });
+        REQUIRE(visited == 49);
+        REQUIRE(id_sum == (49 * 50) / 2 - 7);
+
+        auto remaining = registry.clear();
+        REQUIRE(remaining.size() == 49);
+        REQUIRE(registry.size() == 0);
+    }
+}
+
+namespace {
+
+// Streams one file to its peer and then closes.
+class FileSendSession : public Session {
+public:
+    FileSendSession(asio::io_context& io, tcp::socket socket, std::filesystem::path path,
+                    StreamFilter filter)
+        : Session(io, std::move(socket)), path_(std::move(path)), filter_(std::move(filter)) {}
+
+    int drained = 0;
+
+protected:
+    void on_connect() override {
+        send_line("BEGIN");
+        send_file(path_, 0, to_end, filter_);
+        send_line("END");
+        close_after_flush();
+    }
+    void on_write_drained() override { ++drained; }
+    void on_data(const std::string&) override {}
+
+private:
+    std::filesystem::path path_;
+    StreamFilter filter_;
+};
+
+std::string stream_file_over_socket(const std::filesystem::path& path,
+                                    Session::StreamFilter filter, int& drained) {
+    asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+
+    auto session = std::make_shared<FileSendSession>(io, acceptor.accept(), path, std::move(filter));
+    session->set_write_watermarks(64 * 1024, 16 * 1024);
+    session->set_max_write_batch(8 * 1024);
+    session->set_timeout(std::chrono::seconds(0));  // no wheel timer to keep run() alive
+    session->start();
+
+    std::string received;
+    std::array<char, 16 * 1024> buffer;
+    std::function<void()> read_more = [&]() {
+        client.async_read_some(asio::buffer(buffer), [&](const boost::system::error_code& ec, std::size_t n) {
+            received.append(buffer.data(), n);
+            if (!ec) read_more();
+        });
+    };
+    read_more();
+    io.run();
+
+    drained = session->drained;
+    return received;
+}
+
+}  // namespace
+
+TEST_CASE("Streaming file send", "[integration][net]") {
+    TempDirectory temp_dir;
+    auto path = temp_dir.path() / "message";
+
+    std::string content;
+    for (int i = 0; i < 20000; ++i) {
+        content += (i % 7 == 0 ? ".line " : "line ") + std::to_string(i) + "\n";
+    }
+    std::ofstream(path, std::ios::binary) << content;
+
+    SECTION("Unfiltered file is sent verbatim between queued lines") {
+        int drained = 0;
+        auto received = stream_file_over_socket(path, {}, drained);
+        REQUIRE(received == "BEGIN\r\n" + content + "END\r\n");
+        REQUIRE(drained == 1);  // queued past the high watermark, then drained
+    }
+
+    SECTION("Filter sees every chunk in order and a final call") {
+        int last_calls = 0;
+        auto upper = [&](std::string_view chunk, bool last, std::string& out) {
+            for (char c : chunk) out += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            if (last) ++last_calls;
+        };
+        int drained = 0;
+        auto received = stream_file_over_socket(path, upper, drained);
+
+        std::string expected = content;
+        for (auto& c : expected) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        REQUIRE(received == "BEGIN\r\n" + expected + "END\r\n");
+        REQUIRE(last_calls == 1);
+    }
+
+    SECTION("Compressed file is sent decompressed") {
+        if (!compression::available()) {
+            return;
+        }
+        auto compressed_path = temp_dir.path() / "compressed";
+        std::ofstream(compressed_path, std::ios::binary) << *compression::compress(content, 3);
+        int drained = 0;
+        auto received = stream_file_over_socket(compressed_path, {}, drained);
+        REQUIRE(received == "BEGIN\r\n" + content + "END\r\n");
+    }
+
+    SECTION("Missing file cannot be opened") {
+        REQUIRE_FALSE(OutboundFile::open(temp_dir.path() / "missing"));
+    }
+}
+
+namespace {
+
+// Upper-cases each line on a worker pool and echoes it back until QUIT.
+class ShoutSession : public CoroSession {
+public:
+    ShoutSession(asio::io_context& io, tcp::socket socket, asio::thread_pool& pool)
+        : CoroSession(io, std::move(socket)), pool_(pool) {}
+
+    std::vector<bool> ran_on_strand;
+
+protected:
+    asio::awaitable<void> run() override {
+        co_await write_line("READY");
+        while (auto line = co_await read_line()) {
+            if (*line == "QUIT") co_return;
+            auto shouted = co_await offload(pool_, [&line]() {
+                std::string out = *line;
+                for (auto& c : out) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+                return out;
+            });
+            ran_on_strand.push_back(strand_.running_in_this_thread());
+            co_await write_line(std::move(shouted));
+        }
+    }
+
+private:
+    asio::thread_pool& pool_;
+};
+
+}  // namespace
+
+TEST_CASE("Coroutine session", "[integration][net]") {
+    asio::io_context io;
+    asio::thread_pool pool(2);
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+
+    auto session = std::make_shared<ShoutSession>(io, acceptor.accept(), pool);
+    session->set_timeout(std::chrono::seconds(0));
+    session->start();
+
+    // Pipelined, with the last line split across two writes.
+    asio::write(client, asio::buffer(std::string("hello\r\nmixed Case\nlong")));
+    std::string received;
+    std::array<char, 4096> buffer;
+    std::function<void()> read_more = [&]() {
+        client.async_read_some(asio::buffer(buffer), [&](const boost::system::error_code& ec, std::size_t n) {
+            received.append(buffer.data(), n);
+            if (received.find("MIXED CASE\r\n") != std::string::npos &&
+                received.find("LONG") == std::string::npos) {
+                asio::write(client, asio::buffer(std::string(" line\r\nQUIT\r\nignored\r\n")));
+            }
+            if (!ec) read_more();
+        });
+    };
+    read_more();
+    io.run();
+    pool.join();
+
+    REQUIRE(received == "READY\r\nHELLO\r\nMIXED CASE\r\nLONG LINE\r\n");
+    REQUIRE(session->ran_on_strand == std::vector<bool>{true, true, true});
+}
+
+namespace {
+
+// "BLOB n" is followed by n raw bytes, answered with their size and whether
+// they were intact; other lines are echoed.
+class BlobSession : public Session {
+public:
+    using Session::Session;
+
+protected:
+    void on_connect() override {}
+    void on_data(const std::string& line) override {
+        if (line.starts_with("BLOB ")) {
+            blob_.clear();
+            read_bytes(std::stoul(line.substr(5)));
+        } else if (line == "QUIT") {
+            close_after_flush();
+        } else {
+            send_line(line);
+        }
+    }
+    void on_bytes(std::string_view bytes, bool last) override {
+        blob_.append(bytes);
+        if (last) {
+            bool intact = true;
+            for (std::size_t i = 0; i < blob_.size(); ++i) {
+                intact = intact && blob_[i] == static_cast<char>('a' + i % 26);
+            }
+            send_line(std::to_string(blob_.size()) + (intact ? " intact" : " damaged"));
+        }
+    }
+
+private:
+    std::string blob_;
+};
+
+}  // namespace
+
+TEST_CASE("Length-prefixed input", "[integration][net]") {
+    asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+    auto session = std::make_shared<BlobSession>(io, acceptor.accept());
+    session->set_timeout(std::chrono::seconds(0));
+    session->start();
+
+    // Blobs that look like lines, one far larger than a read, and lines
+    // pipelined behind them in the same writes.
+    auto blob = [](std::size_t size) {
+        std::string bytes;
+        for (std::size_t i = 0; i < size; ++i) bytes += static_cast<char>('a' + i % 26);
+        return bytes;
+    };
+    std::string request = "one\r\nBLOB 5\r\n" + blob(5) + "two\r\nBLOB 200000\r\n" +
+                          blob(200000) + "BLOB 0\r\nthree\r\nQUIT\r\n";
+    std::thread server([&io]() { io.run(); });
+    asio::write(client, asio::buffer(request));
+    std::string received;
+    std::array<char, 4096> buffer;
+    boost::system::error_code ec;
+    while (!ec) {
+        std::size_t n = client.read_some(asio::buffer(buffer), ec);
+        received.append(buffer.data(), n);
+    }
+    server.join();
+
+    REQUIRE(received == "one\r\n5 intact\r\ntwo\r\n200000 intact\r\nthree\r\n");
+}
+
+namespace {
+
+// "SLOW x" is answered from another thread after a delay; lines pipelined
+// behind it wait for the answer. Other lines are echoed.
+class SlowSession : public Session {
+public:
+    using Session::Session;
+
+protected:
+    void on_connect() override {}
+    void on_data(const std::string& line) override {
+        if (line.starts_with("SLOW ")) {
+            suspend_input();
+            std::thread([done = on_strand([this](std::string reply) {
+                send_line(reply);
+                resume_input();
+            }), reply = line.substr(5)]() {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                done(reply);
+            }).detach();
+        } else if (line == "QUIT") {
+            close_after_flush();
+        } else {
+            send_line(line);
+        }
+    }
+};
+
+}  // namespace
+
+TEST_CASE("Suspended input", "[integration][net]") {
+    asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+    tcp::socket client(io);
+    client.connect(acceptor.local_endpoint());
+    auto session = std::make_shared<SlowSession>(io, acceptor.accept());
+    session->set_timeout(std::chrono::seconds(0));
+    session->start();
+
+    std::thread server([&io]() { io.run(); });
+    asio::write(client, asio::buffer(std::string("one\r\nSLOW two\r\nthree\r\nSLOW four\r\n")));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    asio::write(client, asio::buffer(std::string("five\r\nQUIT\r\n")));
+    std::string received;
+    std::array<char, 4096> buffer;
+    boost::system::error_code ec;
+    while (!ec) {
+        std::size_t n = client.read_some(asio::buffer(buffer), ec);
+        received.append(buffer.data(), n);
+    }
+    server.join();
+
+    REQUIRE(received == "one\r\ntwo\r\nthree\r\nfour\r\nfive\r\n");
+}
+
+namespace {
+
+// Does nothing on its own; the test drives it.
+class QuietSession : public Session {
+public:
+    using Session::Session;
+
+protected:
+    void on_connect() override {}
+    void on_data(const std::string&) override {}
+};
+
+}  // namespace
+
+TEST_CASE("Memory budget", "[integration][net]") {
+    SECTION("Limit and pressure") {
+        MemoryBudget budget(1000);
+        REQUIRE(budget.has_room(1000));
+        budget.charge(700);
+        REQUIRE_FALSE(budget.has_room(301));
+        REQUIRE_FALSE(budget.under_pressure());
+        budget.charge(100);
+        REQUIRE(budget.under_pressure());
+        budget.release(800);
+        REQUIRE(budget.used() == 0);
+
+        MemoryBudget unlimited;
+        unlimited.charge(1 << 30);
+        REQUIRE(unlimited.has_room(1 << 30));
+        REQUIRE_FALSE(unlimited.under_pressure());
+    }
+
+    SECTION("Sessions charge their footprint and release it when destroyed") {
+        asio::io_context io;
+        tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        tcp::socket client(io);
+        client.connect(acceptor.local_endpoint());
+
+        auto budget = std::make_shared<MemoryBudget>();
+        auto session = std::make_shared<QuietSession>(io, acceptor.accept());
+        session->set_memory_budget(budget, sizeof(QuietSession));
+        REQUIRE(budget->used() >= session->footprint().total());
+        REQUIRE(budget->used() % 4096 == 0);
+
+        std::size_t before = budget->used();
+        std::size_t queued = 0;
+        std::size_t charged = 0;
+        session->send(std::string(64 * 1024, 'x'));
+        // Runs on the io thread after the send has been queued.
+        asio::post(io, [&]() {
+            queued = session->footprint().write_queue;
+            charged = budget->used();
+            session->stop();
+        });
+        io.run();
+        REQUIRE(queued >= 64 * 1024);
+        REQUIRE(charged >= before + 64 * 1024);
+
+        session.reset();
+        REQUIRE(budget->used() == 0);
+    }
+}
+
+TEST_CASE("Timing wheel", "[integration][net]") {
+    using std::chrono::seconds;
+    asio::io_context io;  // Never run: the tests drive the ticks
+    auto& wheel = TimingWheel::get(io);
+    const auto epoch = wheel.epoch();
+    // A session that was just active and times out after `timeout`.
+    auto idle_session = [&io](seconds timeout) {
+        auto session = std::make_shared<QuietSession>(io, tcp::socket(io));
+        session->set_timeout(timeout);
+        session->reset_timeout();
+        return session;
+    };
+
+    SECTION("Expires at the tick of its deadline, rounded up") {
+        auto session = idle_session(seconds(1));
+        wheel.schedule(session, epoch + std::chrono::milliseconds(5500), 0);
+        REQUIRE(wheel.size() == 1);
+        REQUIRE(wheel.advance(epoch + seconds(5)).empty());
+        auto expired = wheel.advance(epoch + seconds(6));
+        REQUIRE(expired.size() == 1);
+        REQUIRE(expired[0] == session);
+        REQUIRE(wheel.size() == 0);
+    }
+
+    SECTION("Cascades from the upper level") {
+        auto session = idle_session(seconds(1));
+        wheel.schedule(session, epoch + seconds(1000), 0);
+        REQUIRE(wheel.advance(epoch + seconds(999)).empty());
+        REQUIRE(wheel.size() == 1);
+        REQUIRE(wheel.advance(epoch + seconds(1000)).size() == 1);
+    }
+
+    SECTION("Activity since scheduling re-files the session") {
+        auto session = idle_session(seconds(10));
+        wheel.schedule(session, epoch + seconds(2), 0);
+        REQUIRE(wheel.advance(epoch + seconds(2)).empty());
+        REQUIRE(wheel.size() == 1);
+        REQUIRE(wheel.advance(epoch + seconds(9)).empty());
+        REQUIRE(wheel.advance(epoch + seconds(12)).size() == 1);
+        REQUIRE(wheel.size() == 0);
+    }
+
+    SECTION("Entries of an older generation are dropped") {
+        auto session = idle_session(seconds(1));
+        wheel.schedule(session, epoch + seconds(3), 1);  // The session is at 0
+        REQUIRE(wheel.advance(epoch + seconds(3)).empty());
+        REQUIRE(wheel.size() == 0);
+
+        auto gone = idle_session(seconds(1));
+        wheel.schedule(gone, epoch + seconds(3), 0);
+        gone.reset();
+        REQUIRE(wheel.advance(epoch + seconds(4)).empty());
+        REQUIRE(wheel.size() == 0);
+    }
+
+    SECTION("Deadlines already past or within the tick wait for the next one") {
+        auto past = idle_session(seconds(0));
+        wheel.schedule(past, epoch - seconds(5), 0);
+        auto soon = idle_session(seconds(1));
+        wheel.schedule(soon, epoch + std::chrono::milliseconds(200), 0);
+        REQUIRE(wheel.advance(epoch).empty());
+
+        // Tick 1 is due for both; `soon` was active until after it.
+        auto expired = wheel.advance(epoch + seconds(1));
+        REQUIRE(expired.size() == 1);
+        REQUIRE(expired[0] == past);
+        REQUIRE(wheel.size() == 1);
+        REQUIRE(wheel.advance(epoch + seconds(2)).size() == 1);
+    }
+}
+
+namespace {
+
+// Echoes lines upper-cased; COMPRESS answers OK and compresses from then on.
+class DeflateEchoSession : public Session {
+public:
+    using Session::Session;
+
+protected:
+    void on_connect() override {}
+    void on_data(const std::string& line) override {
+        if (line == "COMPRESS") {
+            send_line("OK");
+            start_compression(DeflateCodec::create({}));
+        } else if (line == "QUIT") {
+            close_after_flush();
+        } else {
+            std::string out = line;
+            for (auto& c : out) c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+            send_line(std::move(out));
+        }
+    }
+};
+
+}  // namespace
+
+TEST_CASE("Stream compression", "[integration][net]") {
+    if (!DeflateCodec::available()) {
+        SUCCEED("Built without ENABLE_DEFLATE");
+        return;
+    }
+
+    SECTION("Flushed output decodes in any split") {
+        auto sender = DeflateCodec::create({});
+        auto receiver = DeflateCodec::create({});
+        REQUIRE(sender);
+        REQUIRE(receiver);
+
+        std::string plain;
+        for (int i = 0; i < 5000; ++i) {
+            plain += "* " + std::to_string(i) + " FETCH (FLAGS (\\Seen))\r\n";
+        }
+        std::string wire;
+        REQUIRE(sender->encode(std::string_view(plain).substr(0, 1000), wire, false));
+        REQUIRE(sender->encode(std::string_view(plain).substr(1000), wire, true));
+        REQUIRE(wire.size() < plain.size() / 4);
+
+        std::vector<char> out;
+        std::size_t end = 0;
+        bool decoded = true;
+        for (std::size_t pos = 0; pos < wire.size() && decoded; pos += 7) {
+            decoded = receiver->decode(std::string_view(wire).substr(pos, 7), out, end);
+        }
+        REQUIRE(decoded);
+        REQUIRE(std::string(out.data(), end) == plain);
+
+        REQUIRE(sender->stats().plain_out == plain.size());
+        REQUIRE(sender->stats().wire_out == wire.size());
+        REQUIRE(receiver->stats().wire_in == wire.size());
+        REQUIRE(receiver->stats().plain_in == plain.size());
+        REQUIRE(DeflateCodec::totals().plain_out >= plain.size());
+
+        std::vector<char> garbage_out;
+        std::size_t garbage_end = 0;
+        REQUIRE_FALSE(DeflateCodec::create({})->decode("\xff\xff\xff\xff", garbage_out, garbage_end));
+    }
+
+    SECTION("Session switches after the reply and keeps pipelined input") {
+        asio::io_context io;
+        tcp::acceptor acceptor(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        tcp::socket client(io);
+        client.connect(acceptor.local_endpoint());
+        auto session = std::make_shared<DeflateEchoSession>(io, acceptor.accept());
+        session->set_timeout(std::chrono::seconds(0));
+        session->start();
+
+        // The client compresses right behind COMPRESS without waiting.
+        auto client_codec = DeflateCodec::create({});
+        std::string request = "one\r\nCOMPRESS\r\n";
+        REQUIRE(client_codec->encode("two\r\nthree\r\nQUIT\r\n", request, true));
+        asio::write(client, asio::buffer(request));
+
+        std::thread server([&io]() { io.run(); });
+        std::string received;
+        std::array<char, 4096> buffer;
+        boost::system::error_code ec;
+        while (!ec) {
+            std::size_t n = client.read_some(asio::buffer(buffer), ec);
+            received.append(buffer.data(), n);
+        }
+        server.join();
+
+        const std::string plain = "ONE\r\nOK\r\n";
+        REQUIRE(received.substr(0, plain.size()) == plain);
+        std::vector<char> out;
+        std::size_t end = 0;
+        REQUIRE(client_codec->decode(std::string_view(received).substr(plain.size()), out, end));
+        REQUIRE(std::string(out.data(), end) == "TWO\r\nTHREE\r\n");
+        REQUIRE(session->compressing());
+        REQUIRE(session->codec()->stats().plain_in == 18);
+    }
+}
+
+TEST_CASE("Shared reactor", "[integration][net]") {
+    auto free_port = [] {
+        asio::io_context io;
+        tcp::acceptor probe(io, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+        return probe.local_endpoint().port();
+    };
+    auto reactor = std::make_shared<Reactor>(2);
+    reactor->start();
+    const uint16_t first_port = free_port();
+    const uint16_t second_port = free_port();
+    Server<BlobSession> first("first", "127.0.0.1", first_port);
+    Server<BlobSession> second("second", "127.0.0.1", second_port);
+    first.set_reactor(reactor);
+    second.set_reactor(reactor);
+    first.start();
+    second.start();
+
+    asio::io_context io;
+    auto connect = [&io](uint16_t port) {
+        tcp::socket socket(io);
+        socket.connect({asio::ip::make_address("127.0.0.1"), port});
+        return socket;
+    };
+    auto echo = [](tcp::socket& socket, const std::string& line) {
+        boost::system::error_code ec;
+        asio::write(socket, asio::buffer(line + "\r\n"), ec);
+        asio::streambuf reply;
+        asio::read_until(socket, reply, "\r\n", ec);
+        return std::string(asio::buffers_begin(reply.data()), asio::buffers_end(reply.data()));
+    };
+
+    std::vector<tcp::socket> first_clients;
+    std::vector<tcp::socket> second_clients;
+    for (int i = 0; i < 4; ++i) {
+        first_clients.push_back(connect(first_port));
+        second_clients.push_back(connect(second_port));
+    }
+    for (auto& client : first_clients) {
+        REQUIRE(echo(client, "first") == "first\r\n");
+    }
+    for (auto& client : second_clients) {
+        REQUIRE(echo(client, "second") == "second\r\n");
+    }
+    REQUIRE(first.connection_count() == 4);
+    REQUIRE(second.connection_count() == 4);
+
+    SECTION("One server stops while the other keeps serving") {
+        first.stop();
+        REQUIRE(first.connection_count() == 0);
+        for (auto& client : first_clients) {
+            REQUIRE(echo(client, "gone").empty());
+        }
+        for (auto& client : second_clients) {
+            REQUIRE(echo(client, "still") == "still\r\n");
+        }
+        auto late = connect(second_port);
+        REQUIRE(echo(late, "late") == "late\r\n");
+        second.stop();
+        reactor->stop();
+    }
+
+    SECTION("Stopping the reactor first leaves the servers to stop") {
+        reactor->stop();
+        first.stop();
+        second.stop();
+        for (auto& client : second_clients) {
+            REQUIRE(echo(client, "gone").empty());
+        }
+    }
+}
+
+TEST_CASE("Asynchronous logging", "[integration][log]") {
+    TempDirectory temp;
+    auto log_path = temp.path() / "test.log";
+    auto& logger = Logger::instance();
+    logger.init(LogLevel::Trace, false, log_path);
+
+    auto count_lines = [&](std::string_view marker) {
+        std::ifstream in(log_path);
+        size_t count = 0;
+        for (std::string line; std::getline(in, line);) {
+            count += line.find(marker) != std::string::npos;
+        }
+        return count;
+    };
+
+    SECTION("Every thread's messages are written, in order per thread") {
+        logger.set_overflow(LogOverflow::Block);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([t] {
+                for (int i = 0; i < 3000; ++i) {
+                    LOG_INFO_FMT("blocking {} {}", t, i);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        logger.flush();
+        REQUIRE(count_lines("] blocking ") == 4 * 3000);
+
+        std::ifstream in(log_path);
+        int last = -1;
+        for (std::string line; std::getline(in, line);) {
+            if (auto at = line.find("] blocking 0 "); at != std::string::npos) {
+                int i = std::stoi(line.substr(at + 13));
+                REQUIRE(i == last + 1);
+                last = i;
+            }
+        }
+    }
+
+    SECTION("A full queue drops low levels and says so") {
+        logger.set_overflow(LogOverflow::Drop);
+        for (int i = 0; i < 20000; ++i) {
+            LOG_INFO_FMT("dropping {}", i);
+        }
+        LOG_WARNING("kept");
+        logger.flush();
+        size_t written = count_lines("] dropping ");
+        REQUIRE(written > 0);
+        REQUIRE(count_lines("] kept") == 1);
+
+        std::ifstream in(log_path);
+        size_t dropped = 0;
+        for (std::string line; std::getline(in, line);) {
+            if (line.find("log messages dropped") != std::string::npos) {
+                dropped += std::stoul(line.substr(line.rfind("] ") + 2));
+            }
+        }
+        REQUIRE(written + dropped == 20000);
+    }
+
+    logger.set_overflow(LogOverflow::Drop);
+    logger.init(LogLevel::Info, true);
+}
+
+TEST_CASE("Metrics export", "[integration][metrics]") {
+    auto& metrics = Metrics::instance();
+
+    SECTION("Histogram buckets stay within an eighth of their values") {
+        for (uint64_t ns : {0ull, 1ull, 7ull, 8ull, 9ull, 1000ull, 123456789ull, 1ull << 39}) {
+            const size_t bucket = Histogram::bucket_of(ns);
+            REQUIRE(bucket < Histogram::bucket_count);
+            REQUIRE(ns < Histogram::bucket_end(bucket));
+            if (bucket > 0) {
+                REQUIRE(ns >= Histogram::bucket_end(bucket - 1));
+            }
+            REQUIRE(Histogram::bucket_end(bucket) - ns <= std::max<uint64_t>(1, ns / 8));
+        }
+
+        Histogram histogram;
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&histogram] {
+                for (int i = 1; i <= 1000; ++i) {
+                    histogram.record(std::chrono::microseconds(i));
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        auto snapshot = histogram.snapshot();
+        REQUIRE(snapshot.count == 4000);
+        REQUIRE(snapshot.sum_ns == 4 * 500500 * 1000ull);
+        const double median = static_cast<double>(snapshot.quantile(0.5));
+        REQUIRE(median >= 500000);
+        REQUIRE(median <= 500000 * 1.125);
+    }
+
+    SECTION("Registered metrics render in the Prometheus text format") {
+        auto& counter = metrics.counter("test_requests_total", "Requests", {{"kind", "a\"b"}});
+        REQUIRE(&counter == &metrics.counter("test_requests_total", "Requests", {{"kind", "a\"b"}}));
+        counter.add(3);
+        metrics.histogram("test_duration_seconds", "Durations")
+            .record(std::chrono::milliseconds(2));
+        int depth = 7;
+        {
+            auto probe = metrics.probe("test_depth", "Depth", {}, [&depth] { return depth; });
+            auto text = metrics.render();
+            REQUIRE(text.find("# TYPE test_requests_total counter\n") != std::string::npos);
+            REQUIRE(text.find("test_requests_total{kind=\"a\\\"b\"} 3\n") != std::string::npos);
+            REQUIRE(text.find("test_duration_seconds_bucket{le=\"0.001\"} 0\n") != std::string::npos);
+            REQUIRE(text.find("test_duration_seconds_bucket{le=\"0.0025\"} 1\n") != std::string::npos);
+            REQUIRE(text.find("test_duration_seconds_bucket{le=\"+Inf\"} 1\n") != std::string::npos);
+            REQUIRE(text.find("test_duration_seconds_count 1\n") != std::string::npos);
+            REQUIRE(text.find("test_depth 7\n") != std::string::npos);
+        }
+        REQUIRE(metrics.render().find("test_depth") == std::string::npos);
+    }
+
+    SECTION("The exporter serves them over HTTP") {
+        metrics.counter("test_scrapes_total", "Scrapes").add();
+        MetricsExporter exporter("127.0.0.1", 0);
+        REQUIRE(exporter.start());
+
+        auto get = [&](const std::string& target) {
+            asio::io_context io;
+            tcp::socket socket(io);
+            socket.connect({asio::ip::make_address("127.0.0.1"), exporter.port()});
+            std::string request = "GET " + target + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+            asio::write(socket, asio::buffer(request));
+            std::string response;
+            boost::system::error_code ec;
+            std::array<char, 4096> buffer;
+            while (!ec) {
+                std::size_t n = socket.read_some(asio::buffer(buffer), ec);
+                response.append(buffer.data(), n);
+            }
+            return response;
+        };
+
+        auto response = get("/metrics");
+        REQUIRE(response.rfind("HTTP/1.1 200 OK\r\n", 0) == 0);
+        REQUIRE(response.find("text/plain; version=0.0.4") != std::string::npos);
+        REQUIRE(response.find("\ntest_scrapes_total 1\n") != std::string::npos);
+        REQUIRE(get("/").rfind("HTTP/1.1 404", 0) == 0);
+        exporter.stop();
+    }
+}
+
+#ifdef ENABLE_TLS
+namespace {
+
+// Writes a throwaway self-signed certificate for localhost and its key.
+bool write_self_signed_certificate(const std::filesystem::path& cert_file,
+                                   const std::filesystem::path& key_file) {
+    EVP_PKEY* key = nullptr;
+    EVP_PKEY_CTX* keygen = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+    bool ok = keygen && EVP_PKEY_keygen_init(keygen) == 1 &&
+              EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keygen, NID_X9_62_prime256v1) == 1 &&
+              EVP_PKEY_keygen(keygen, &key) == 1;
+    EVP_PKEY_CTX_free(keygen);
+
+    X509* cert = ok ? X509_new() : nullptr;
+    if (cert) {
+        X509_NAME* name = X509_get_subject_name(cert);
+        ok = X509_set_version(cert, 2) == 1 &&
+             X509_gmtime_adj(X509_getm_notBefore(cert), 0) &&
+             X509_gmtime_adj(X509_getm_notAfter(cert), 3600) &&
+             X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                                        reinterpret_cast<const unsigned char*>("localhost"),
+                                        -1, -1, 0) == 1 &&
+             X509_set_issuer_name(cert, name) == 1 && X509_set_pubkey(cert, key) == 1 &&
+             X509_sign(cert, key, EVP_sha256()) > 0;
+    }
+
+    BIO* cert_out = ok ? BIO_new_file(cert_file.c_str(), "w") : nullptr;
+    BIO* key_out = ok ? BIO_new_file(key_file.c_str(), "w") : nullptr;
+    ok = cert_out && key_out && PEM_write_bio_X509(cert_out, cert) == 1 &&
+         PEM_write_bio_PrivateKey(key_out, key, nullptr, nullptr, 0, nullptr, nullptr) == 1;
+    BIO_free(cert_out);
+    BIO_free(key_out);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    return ok;
+}
+
+// One connection from `client` to `server` over a BIO pair, offering
+// `offer` for resumption if given. Returns the session the client holds
+// after reading the server's tickets (the caller frees it), or nullptr if
+// the handshake failed.
+SSL_SESSION* tls_connect(SSLContext& server, SSL_CTX* client, SSL_SESSION* offer,
+                         bool& reused) {
+    SSL* s = SSL_new(server.native().native_handle());
+    SSL* c = SSL_new(client);
+    BIO* server_bio = nullptr;
+    BIO* client_bio = nullptr;
+    BIO_new_bio_pair(&server_bio, 0, &client_bio, 0);
+    SSL_set_bio(s, server_bio, server_bio);
+    SSL_set_bio(c, client_bio, client_bio);
+    SSL_set_accept_state(s);
+    SSL_set_connect_state(c);
+    if (offer) {
+        SSL_set_session(c, offer);
+    }
+
+    for (int flight = 0; flight < 8 && !(SSL_is_init_finished(s) && SSL_is_init_finished(c));
+         ++flight) {
+        SSL_do_handshake(c);
+        SSL_do_handshake(s);
+    }
+    // TLS 1.3 tickets follow the handshake; reading past them collects them.
+    SSL_SESSION* session = nullptr;
+    char byte = 0;
+    if (SSL_write(s, "x", 1) == 1 && SSL_read(c, &byte, 1) == 1) {
+        reused = SSL_session_reused(c) == 1;
+        session = SSL_get1_session(c);
+    }
+    // Freed without a shutdown, OpenSSL would mark the session unresumable.
+    SSL_shutdown(c);
+    SSL_shutdown(s);
+    SSL_free(c);
+    SSL_free(s);
+    return session;
+}
+
+}  // namespace
+
+TEST_CASE("TLS session resumption", "[integration][tls]") {
+    using std::chrono::milliseconds;
+    TempDirectory temp;
+    TLSConfig config;
+    config.certificate_file = temp.path() / "cert.pem";
+    config.private_key_file = temp.path() / "key.pem";
+    config.ticket_key_lifetime = 1;
+    REQUIRE(write_self_signed_certificate(config.certificate_file, config.private_key_file));
+
+    const auto start = std::chrono::steady_clock::now();
+    SSLContext server = SSLContext::create_server_context(config);
+    REQUIRE(server.is_initialized());
+    // TLS 1.3 resumes from tickets alone, never from the session-ID cache.
+    SSL_CTX* client = SSL_CTX_new(TLS_client_method());
+    SSL_CTX_set_min_proto_version(client, TLS1_3_VERSION);
+
+    bool reused = true;
+    SSL_SESSION* first = tls_connect(server, client, nullptr, reused);
+    REQUIRE(first != nullptr);
+    REQUIRE_FALSE(reused);
+    REQUIRE(server.stats().full_handshakes == 1);
+    REQUIRE(server.stats().ticket_key_rotations == 1);
+
+    SSL_SESSION* again = tls_connect(server, client, first, reused);
+    REQUIRE(again != nullptr);
+    REQUIRE(reused);
+    REQUIRE(server.stats().resumed_handshakes == 1);
+    SSL_SESSION_free(again);
+
+    // Past one lifetime the next ticket issued rotates the key; tickets from
+    // the previous key still resume, and come back under the new one.
+    std::this_thread::sleep_until(start + milliseconds(1200));
+    SSL_SESSION* fresh = tls_connect(server, client, nullptr, reused);
+    REQUIRE(fresh != nullptr);
+    REQUIRE(server.stats().ticket_key_rotations == 2);
+    SSL_SESSION_free(fresh);
+    SSL_SESSION* renewed = tls_connect(server, client, first, reused);
+    REQUIRE(renewed != nullptr);
+    REQUIRE(reused);
+    REQUIRE(server.stats().resumed_handshakes == 2);
+
+    // Two lifetimes after the first key was made, its tickets are refused.
+    std::this_thread::sleep_until(start + milliseconds(2500));
+    SSL_SESSION* expired = tls_connect(server, client, first, reused);
+    REQUIRE(expired != nullptr);
+    REQUIRE_FALSE(reused);
+    REQUIRE(server.stats().full_handshakes == 3);
+    SSL_SESSION_free(expired);
+    SSL_SESSION* current = tls_connect(server, client, renewed, reused);
+    REQUIRE(current != nullptr);
+    REQUIRE(reused);
+    REQUIRE(server.stats().resumed_handshakes == 3);
+    REQUIRE(server.stats().failed_handshakes == 0);
+    SSL_SESSION_free(current);
+
+    SSL_SESSION_free(renewed);
+    SSL_SESSION_free(first);
+    SSL_CTX_free(client);
+}
+#endif
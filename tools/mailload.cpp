@@ -0,0 +1,414 @@
+// Closed-loop load generator: each connection sends a request, waits for
+// the whole reply and sends the next, so throughput is what the server
+// sustains at that concurrency and the latencies are what clients see.
+#include "metrics.hpp"
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::string smtp_port = "25";
+    std::string imap_port = "143";
+    std::string pop3_port = "110";
+    std::vector<std::string> users;
+    std::string password;
+    std::string from = "mailload@localhost";
+    size_t concurrency = 4;
+    std::chrono::seconds duration{10};
+    size_t message_size = 2048;
+    // IMAP operations and their weights.
+    std::vector<std::pair<std::string, unsigned>> mix = {
+        {"select", 10}, {"fetch", 50}, {"search", 20}, {"store", 20},
+    };
+    std::vector<std::string> protocols;
+};
+
+void print_usage(const char* program) {
+    std::cout << "Closed-loop load generator for the email servers\n\n"
+              << "Usage: " << program << " [options] <smtp|imap|pop3>...\n\n"
+              << "Each named protocol gets its own connections, which run until the\n"
+              << "duration is up; throughput and latency are then reported per operation.\n\n"
+              << "Options:\n"
+              << "  -H, --host <host>         Server address (default: 127.0.0.1)\n"
+              << "      --smtp-port <port>    SMTP port (default: 25)\n"
+              << "      --imap-port <port>    IMAP port (default: 143)\n"
+              << "      --pop3-port <port>    POP3 port (default: 110)\n"
+              << "  -u, --user <email>        Mailbox to log in to and deliver to; repeat to\n"
+              << "                            spread connections over several users\n"
+              << "  -p, --password <pass>     Their password\n"
+              << "  -f, --from <email>        SMTP envelope sender (default: mailload@localhost)\n"
+              << "  -c, --concurrency <n>     Connections per protocol (default: 4)\n"
+              << "  -d, --duration <seconds>  How long to run (default: 10)\n"
+              << "  -s, --size <bytes>        Size of SMTP messages (default: 2048)\n"
+              << "  -m, --mix <op=weight,...> IMAP operations, from select, fetch, search and\n"
+              << "                            store (default: select=10,fetch=50,search=20,store=20)\n"
+              << "  -h, --help                Show this help\n";
+}
+
+// Latency of each operation, by name; filled before the workers start.
+class Results {
+public:
+    void add(const std::string& operation) { ops_[operation]; }
+    email::Histogram& operator[](const std::string& operation) { return ops_.at(operation).latency; }
+    void error(const std::string& operation) { ops_.at(operation).errors.fetch_add(1); }
+
+    void report(std::chrono::duration<double> elapsed) const {
+        std::printf("%-12s %10s %10s %10s %10s %10s %8s\n",
+                    "operation", "count", "ops/s", "p50 ms", "p99 ms", "p999 ms", "errors");
+        for (const auto& [name, op] : ops_) {
+            const auto snapshot = op.latency.snapshot();
+            auto ms = [&](double q) { return static_cast<double>(snapshot.quantile(q)) / 1e6; };
+            std::printf("%-12s %10llu %10.1f %10.3f %10.3f %10.3f %8llu\n", name.c_str(),
+                        static_cast<unsigned long long>(snapshot.count),
+                        static_cast<double>(snapshot.count) / elapsed.count(),
+                        ms(0.5), ms(0.99), ms(0.999),
+                        static_cast<unsigned long long>(op.errors.load()));
+        }
+    }
+
+private:
+    struct Operation {
+        email::Histogram latency;
+        std::atomic<uint64_t> errors{0};
+    };
+    std::map<std::string, Operation> ops_;
+};
+
+// A line-oriented client connection; any failure throws, and the worker
+// reconnects.
+class Connection {
+public:
+    Connection(asio::io_context& io, const std::string& host, const std::string& port)
+        : socket_(io) {
+        tcp::resolver resolver(io);
+        asio::connect(socket_, resolver.resolve(host, port));
+        socket_.set_option(tcp::no_delay(true));
+    }
+
+    void send(const std::string& data) { asio::write(socket_, asio::buffer(data)); }
+
+    // The next line, without its CRLF.
+    std::string line() {
+        const size_t n = asio::read_until(socket_, buffer_, "\r\n");
+        std::string result(asio::buffers_begin(buffer_.data()),
+                           asio::buffers_begin(buffer_.data()) + n - 2);
+        buffer_.consume(n);
+        return result;
+    }
+
+    void skip(size_t bytes) {
+        if (buffer_.size() < bytes) {
+            asio::read(socket_, buffer_, asio::transfer_exactly(bytes - buffer_.size()));
+        }
+        buffer_.consume(bytes);
+    }
+
+private:
+    tcp::socket socket_;
+    asio::streambuf buffer_;
+};
+
+void expect(bool ok, const std::string& what) {
+    if (!ok) {
+        throw std::runtime_error(what);
+    }
+}
+
+std::string make_message(const Options& options, const std::string& to) {
+    std::string message = "From: <" + options.from + ">\r\nTo: <" + to + ">\r\n"
+                          "Subject: mailload\r\n\r\n";
+    while (message.size() < options.message_size) {
+        message += "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod.\r\n";
+    }
+    return message;
+}
+
+class Worker {
+public:
+    Worker(const Options& options, Results& results, size_t index, Clock::time_point deadline)
+        : options_(options), results_(results), index_(index), deadline_(deadline),
+          random_(static_cast<unsigned>(index)) {}
+
+    void smtp() {
+        const auto& user = this->user();
+        const std::string message = make_message(options_, user) + ".\r\n";
+        loop(options_.smtp_port, [&](Connection& c) {
+            expect(c.line().starts_with("220"), "greeting");
+            c.send("EHLO mailload\r\n");
+            while (c.line().starts_with("250-")) {}
+        }, [&](Connection& c) {
+            timed("smtp.send", [&] {
+                c.send("MAIL FROM:<" + options_.from + ">\r\n");
+                expect(c.line().starts_with("250"), "MAIL FROM");
+                c.send("RCPT TO:<" + user + ">\r\n");
+                expect(c.line().starts_with("250"), "RCPT TO");
+                c.send("DATA\r\n");
+                expect(c.line().starts_with("354"), "DATA");
+                c.send(message);
+                return c.line().starts_with("250");
+            });
+        });
+    }
+
+    void imap() {
+        std::vector<unsigned> weights;
+        for (const auto& [op, weight] : options_.mix) {
+            weights.push_back(weight);
+        }
+        std::discrete_distribution<size_t> pick(weights.begin(), weights.end());
+        uint32_t exists = 0;
+        loop(options_.imap_port, [&](Connection& c) {
+            expect(c.line().starts_with("* OK"), "greeting");
+            expect(imap_command(c, "LOGIN \"" + user() + "\" \"" + options_.password + "\""), "LOGIN");
+            expect(imap_command(c, "SELECT INBOX", &exists), "SELECT");
+        }, [&](Connection& c) {
+            const auto& op = options_.mix[pick(random_)].first;
+            const auto n = std::to_string(exists ? random_() % exists + 1 : 1);
+            if (op == "select") {
+                timed("imap.select", [&] { return imap_command(c, "SELECT INBOX", &exists); });
+            } else if (op == "fetch") {
+                timed("imap.fetch", [&] {
+                    return imap_command(c, "FETCH " + n + " (FLAGS RFC822.SIZE BODY.PEEK[])");
+                });
+            } else if (op == "search") {
+                timed("imap.search", [&] { return imap_command(c, "SEARCH UNSEEN SUBJECT \"mailload\""); });
+            } else {
+                const char* sign = random_() % 2 ? "+" : "-";
+                timed("imap.store", [&] {
+                    return imap_command(c, "STORE " + n + " " + sign + "FLAGS.SILENT (\\Flagged)");
+                });
+            }
+        });
+    }
+
+    void pop3() {
+        uint32_t count = 0;
+        loop(options_.pop3_port, [&](Connection& c) {
+            expect(c.line().starts_with("+OK"), "greeting");
+            c.send("USER " + user() + "\r\n");
+            expect(c.line().starts_with("+OK"), "USER");
+            c.send("PASS " + options_.password + "\r\n");
+            expect(c.line().starts_with("+OK"), "PASS");
+            c.send("STAT\r\n");
+            const auto stat = c.line();
+            expect(stat.starts_with("+OK"), "STAT");
+            count = static_cast<uint32_t>(std::stoul(stat.substr(4)));
+            expect(count > 0, "empty maildrop");
+        }, [&](Connection& c) {
+            timed("pop3.retr", [&] {
+                c.send("RETR " + std::to_string(random_() % count + 1) + "\r\n");
+                if (!c.line().starts_with("+OK")) {
+                    return false;
+                }
+                while (c.line() != ".") {}
+                return true;
+            });
+        });
+    }
+
+private:
+    const std::string& user() const { return options_.users[index_ % options_.users.size()]; }
+
+    // Runs `run` on a connection set up by `setup` until the deadline,
+    // opening a new connection whenever one fails.
+    template<typename Setup, typename Run>
+    void loop(const std::string& port, Setup setup, Run run) {
+        asio::io_context io;
+        while (Clock::now() < deadline_) {
+            try {
+                Connection connection(io, options_.host, port);
+                setup(connection);
+                while (Clock::now() < deadline_) {
+                    run(connection);
+                }
+            } catch (const std::exception& e) {
+                if (!failed_ && Clock::now() < deadline_) {
+                    std::cerr << "connection " << index_ << ": " << e.what() << "\n";
+                }
+                failed_ = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+        }
+    }
+
+    template<typename Request>
+    void timed(const std::string& operation, Request request) {
+        const auto start = Clock::now();
+        bool ok = false;
+        try {
+            ok = request();
+        } catch (...) {
+            results_.error(operation);
+            throw;
+        }
+        if (ok) {
+            results_[operation].record(Clock::now() - start);
+        } else {
+            results_.error(operation);
+        }
+    }
+
+    // Sends a tagged command and reads through its tagged reply, skipping
+    // literals; true on OK. Sets `exists` from an untagged EXISTS.
+    bool imap_command(Connection& c, const std::string& command, uint32_t* exists = nullptr) {
+        const std::string tag = "L" + std::to_string(++tag_);
+        c.send(tag + " " + command + "\r\n");
+        for (;;) {
+            auto line = c.line();
+            while (line.ends_with("}")) {
+                const auto open = line.rfind('{');
+                expect(open != std::string::npos, "malformed literal");
+                c.skip(std::stoul(line.substr(open + 1)));
+                line = c.line();
+            }
+            if (line.starts_with(tag + " ")) {
+                return line.compare(tag.size() + 1, 2, "OK") == 0;
+            }
+            if (exists && line.starts_with("* ") && line.ends_with(" EXISTS")) {
+                *exists = static_cast<uint32_t>(std::stoul(line.substr(2)));
+            }
+        }
+    }
+
+    const Options& options_;
+    Results& results_;
+    size_t index_;
+    Clock::time_point deadline_;
+    std::minstd_rand random_;
+    uint64_t tag_ = 0;
+    bool failed_ = false;
+};
+
+bool parse_mix(const std::string& text, Options& options) {
+    options.mix.clear();
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        const auto item = text.substr(start, end - start);
+        const auto eq = item.find('=');
+        const auto op = item.substr(0, eq);
+        if (op != "select" && op != "fetch" && op != "search" && op != "store") {
+            return false;
+        }
+        const unsigned weight = eq == std::string::npos ? 1 : std::stoul(item.substr(eq + 1));
+        if (weight > 0) {
+            options.mix.emplace_back(op, weight);
+        }
+        start = end + 1;
+    }
+    return !options.mix.empty();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    Options options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument(arg + " needs a value");
+            }
+            return argv[++i];
+        };
+        try {
+            if (arg == "-h" || arg == "--help") {
+                print_usage(argv[0]);
+                return 0;
+            } else if (arg == "-H" || arg == "--host") {
+                options.host = value();
+            } else if (arg == "--smtp-port") {
+                options.smtp_port = value();
+            } else if (arg == "--imap-port") {
+                options.imap_port = value();
+            } else if (arg == "--pop3-port") {
+                options.pop3_port = value();
+            } else if (arg == "-u" || arg == "--user") {
+                options.users.push_back(value());
+            } else if (arg == "-p" || arg == "--password") {
+                options.password = value();
+            } else if (arg == "-f" || arg == "--from") {
+                options.from = value();
+            } else if (arg == "-c" || arg == "--concurrency") {
+                options.concurrency = std::stoul(value());
+            } else if (arg == "-d" || arg == "--duration") {
+                options.duration = std::chrono::seconds(std::stoul(value()));
+            } else if (arg == "-s" || arg == "--size") {
+                options.message_size = std::stoul(value());
+            } else if (arg == "-m" || arg == "--mix") {
+                if (!parse_mix(value(), options)) {
+                    throw std::invalid_argument("bad --mix");
+                }
+            } else if (arg == "smtp" || arg == "imap" || arg == "pop3") {
+                options.protocols.push_back(arg);
+            } else {
+                throw std::invalid_argument("unknown argument " + arg);
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << "\n\n";
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.protocols.empty() || options.users.empty() || options.concurrency == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    Results results;
+    for (const auto& protocol : options.protocols) {
+        if (protocol == "smtp") {
+            results.add("smtp.send");
+        } else if (protocol == "pop3") {
+            results.add("pop3.retr");
+        } else {
+            for (const auto& [op, weight] : options.mix) {
+                results.add("imap." + op);
+            }
+        }
+    }
+
+    const auto start = Clock::now();
+    const auto deadline = start + options.duration;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    for (const auto& protocol : options.protocols) {
+        for (size_t i = 0; i < options.concurrency; ++i) {
+            auto& worker = *workers.emplace_back(
+                std::make_unique<Worker>(options, results, workers.size(), deadline));
+            threads.emplace_back([&worker, protocol]() {
+                if (protocol == "smtp") {
+                    worker.smtp();
+                } else if (protocol == "imap") {
+                    worker.imap();
+                } else {
+                    worker.pop3();
+                }
+            });
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    results.report(Clock::now() - start);
+    return 0;
+}